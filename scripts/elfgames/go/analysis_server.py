@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+
+# Copyright (c) 2018-present, Facebook, Inc.
+# All rights reserved.
+#
+# This source code is licensed under the BSD-style license found in the
+# LICENSE file in the root directory of this source tree.
+
+# Analysis server: many users, one model.
+#
+# Each TCP connection sends request lines "<session> <command> [args...]"
+# (see AnalysisServer in analysis_server.h) and reads back one reply per
+# line. The searches of all the sessions share the actor_black batches.
+# "analyze <k> <interval>" also streams the search so far every interval
+# ms, as lines without the "= " of the reply; closing the connection stops
+# the search.
+#
+#   ANALYSIS_PORT=5000 game=elfgames.go.game model=df_pred \
+#       model_file=elfgames.go.df_model3 python3 analysis_server.py \
+#       --mode analysis --use_mcts --load $MODEL --num_games 16 ...
+
+import os
+import socketserver
+import threading
+
+from rlpytorch import Evaluator, load_env
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        for line in self.rfile:
+            line = line.decode("utf-8").strip()
+            if not line:
+                continue
+            # Waits for the search, without the GIL.
+            reply = self.server.GC.GC.analysis(line, self.progress)
+            self.wfile.write((reply + "\n\n").encode("utf-8"))
+
+    def progress(self, snapshot):
+        try:
+            self.wfile.write((snapshot + "\n").encode("utf-8"))
+            self.wfile.flush()
+            return True
+        except OSError:
+            return False
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+if __name__ == '__main__':
+    additional_to_load = {
+        'evaluator': (
+            Evaluator.get_option_spec(),
+            lambda object_map: Evaluator(object_map, stats=None)),
+    }
+
+    env = load_env(
+        os.environ,
+        overrides=dict(
+            greedy=True,
+            T=1,
+            model="online",
+            additional_labels=['aug_code', 'move_idx'],
+        ),
+        additional_to_load=additional_to_load)
+
+    evaluator = env['evaluator']
+
+    GC = env["game"].initialize()
+
+    model_loader = env["model_loaders"][0]
+    model = model_loader.load_model(GC.params)
+
+    mi = env['mi']
+    mi.add_model("model", model)
+    mi.add_model("actor", model)
+    mi["model"].eval()
+    mi["actor"].eval()
+
+    evaluator.setup(sampler=env["sampler"], mi=mi)
+
+    GC.reg_callback_if_exists("actor_black", evaluator.actor)
+
+    GC.start()
+    evaluator.episode_start(0)
+
+    server = Server(
+        ("", int(os.environ.get("ANALYSIS_PORT", 5000))), Handler)
+    server.GC = GC
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("Analysis server on port %d" % server.server_address[1])
+
+    try:
+        while True:
+            GC.run()
+    except KeyboardInterrupt:
+        pass
+    server.shutdown()
+    print(GC.GC.getAnalysisInfo())
+    GC.stop()
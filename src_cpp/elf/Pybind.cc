@@ -14,16 +14,169 @@
 
 #include <stdint.h>
 
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <spdlog/spdlog.h>
 
 #include "elf/ai/tree_search/tree_search_options.h"
+#include "elf/base/batch_replay.h"
 #include "elf/base/context.h"
+#include "elf/base/shm_channel.h"
 #include "elf/comm/comm.h"
 #include "elf/logging/Pybind.h"
+#include "elf/metrics/Pybind.h"
 #include "elf/options/Pybind.h"
+#include "elf/tracing/Pybind.h"
+
+#ifdef ELF_WITH_TORCH
+#include "elf/ai/inference/torchscript_backend.h"
+#endif
 
 namespace {
 
+// Runs the wait / callback / step loop of a Context for Python, with the GIL
+// released while waiting for a batch and while handing it back. A callback is
+// bound per SharedMem, either
+//   bind(idx, cb, inputs, replies): inputs and replies are the dicts of
+//     tensors (or numpy arrays) allocated on top of the SharedMem buffers.
+//     Their views on the first batchsize rows are built once per batch size
+//     and reused, and the batch is served with cb(inputs, replies, smem);
+//     cb writes the reply in place.
+//   bindRaw(idx, cb): cb(smem), as GCWrapper._call does.
+class BatchDispatcher {
+ public:
+  BatchDispatcher(elf::Context* ctx, int batchdim)
+      : ctx_(ctx), batchdim_(batchdim) {}
+
+  void bind(
+      int idx,
+      pybind11::object cb,
+      pybind11::dict inputs,
+      pybind11::dict replies) {
+    Entry& e = entry(idx);
+    e.cb = std::move(cb);
+    e.raw = false;
+    e.inputs = std::move(inputs);
+    e.replies = std::move(replies);
+    e.views.clear();
+  }
+
+  void bindRaw(int idx, pybind11::object cb) {
+    Entry& e = entry(idx);
+    e.cb = std::move(cb);
+    e.raw = true;
+    e.views.clear();
+  }
+
+  // Serves up to num_batches batches (forever if <= 0), and returns how many
+  // were served. Stops early if no batch comes within timeout_usec (if > 0).
+  int run(int num_batches, int timeout_usec) {
+    namespace py = pybind11;
+    int n = 0;
+    while (num_batches <= 0 || n < num_batches) {
+      const elf::SharedMem* smem = nullptr;
+      {
+        py::gil_scoped_release release;
+        smem = ctx_->wait(timeout_usec);
+      }
+      if (smem == nullptr) {
+        break;
+      }
+      try {
+        dispatch(*smem);
+      } catch (...) {
+        py::gil_scoped_release release;
+        ctx_->step(comm::FAILED);
+        throw;
+      }
+      {
+        py::gil_scoped_release release;
+        ctx_->step();
+      }
+      n++;
+      if (PyErr_CheckSignals() != 0) {
+        throw py::error_already_set();
+      }
+    }
+    return n;
+  }
+
+ private:
+  struct Entry {
+    pybind11::object cb;
+    bool raw = true;
+    pybind11::dict inputs;
+    pybind11::dict replies;
+    // (inputs, replies) sliced to the batch size, by batch size.
+    std::vector<std::pair<pybind11::object, pybind11::object>> views;
+  };
+
+  elf::Context* ctx_;
+  const int batchdim_;
+  std::vector<Entry> entries_;
+
+  Entry& entry(int idx) {
+    if (idx < 0) {
+      throw std::invalid_argument(
+          "BatchDispatcher: invalid SharedMem idx " + std::to_string(idx));
+    }
+    if ((size_t)idx >= entries_.size()) {
+      entries_.resize(idx + 1);
+    }
+    return entries_[idx];
+  }
+
+  pybind11::dict slice(const pybind11::dict& d, size_t batchsize) const {
+    namespace py = pybind11;
+    // v[:, ..., :batchsize], with batchsize at batchdim_.
+    py::tuple index(batchdim_ + 1);
+    for (int i = 0; i < batchdim_; ++i) {
+      index[i] = py::reinterpret_steal<py::object>(
+          PySlice_New(nullptr, nullptr, nullptr));
+    }
+    index[batchdim_] = py::slice(0, (ssize_t)batchsize, 1);
+    py::dict res;
+    for (auto item : d) {
+      py::object view = item.second[index];
+      res[item.first] = view;
+    }
+    return res;
+  }
+
+  void dispatch(const elf::SharedMem& smem) {
+    namespace py = pybind11;
+    const int idx = smem.getSharedMemOptions().getIdx();
+    if (idx < 0 || (size_t)idx >= entries_.size() || !entries_[idx].cb) {
+      throw std::runtime_error(
+          "BatchDispatcher: no callback for smem idx " + std::to_string(idx));
+    }
+    Entry& e = entries_[idx];
+    if (e.cb.is_none()) {
+      return;
+    }
+    auto smem_obj = py::cast(&smem, py::return_value_policy::reference);
+    if (e.raw) {
+      e.cb(smem_obj);
+      return;
+    }
+    const size_t batchsize = smem.getEffectiveBatchSize();
+    if (batchsize >= e.views.size()) {
+      e.views.resize(batchsize + 1);
+    }
+    auto& views = e.views[batchsize];
+    if (!views.first) {
+      views.first = slice(e.inputs, batchsize);
+      views.second = slice(e.replies, batchsize);
+    }
+    e.cb(views.first, views.second, smem_obj);
+  }
+};
+
 void register_common_func(pybind11::module& m) {
   namespace py = pybind11;
 
@@ -43,7 +196,8 @@ void register_common_func(pybind11::module& m) {
       .value("UNKNOWN", ReplyStatus::UNKNOWN)
       .export_values();
 
-  py::class_<Context>(m, "Context")
+  auto context = py::class_<Context>(m, "Context");
+  context
       .def(
           "wait",
           &Context::wait,
@@ -59,7 +213,97 @@ void register_common_func(pybind11::module& m) {
       .def("stop", &Context::stop)
       .def("version", &Context::version)
       .def("allocateSharedMem", &Context::allocateSharedMem, ref)
-      .def("createSharedMemOptions", &Context::createSharedMemOptions);
+      .def("createSharedMemOptions", &Context::createSharedMemOptions)
+      .def("hasInferenceBackend", &Context::hasInferenceBackend)
+      .def(
+          "setShmServer",
+          [](Context& ctx,
+             const std::string& label,
+             const std::string& prefix,
+             const std::vector<std::string>& input,
+             const std::vector<std::string>& reply) {
+            elf::ShmChannelOptions options;
+            options.prefix = prefix;
+            options.input = input;
+            options.reply = reply;
+            ctx.setBatchSource(label, elf::makeShmSource(options));
+          },
+          py::arg("label"),
+          py::arg("prefix"),
+          py::arg("input"),
+          py::arg("reply"))
+      .def(
+          "setShmWorker",
+          [](Context& ctx,
+             const std::string& label,
+             const std::string& prefix,
+             const std::vector<std::string>& input,
+             const std::vector<std::string>& reply,
+             int worker_idx,
+             int slots_per_worker) {
+            elf::ShmChannelOptions options;
+            options.prefix = prefix;
+            options.input = input;
+            options.reply = reply;
+            options.worker_idx = worker_idx;
+            options.slots_per_worker = slots_per_worker;
+            ctx.setInferenceBackend(label, elf::makeShmBackend(options));
+          },
+          py::arg("label"),
+          py::arg("prefix"),
+          py::arg("input"),
+          py::arg("reply"),
+          py::arg("worker_idx"),
+          py::arg("slots_per_worker"))
+      .def(
+          "setBatchCapture",
+          [](Context& ctx,
+             const std::string& path,
+             bool data,
+             const std::vector<std::string>& fields,
+             int max_batches) {
+            elf::BatchCaptureOptions options;
+            options.path = path;
+            options.data = data;
+            options.fields = fields;
+            options.max_batches = max_batches;
+            ctx.setBatchRecorder(std::make_shared<elf::BatchRecorder>(options));
+          },
+          py::arg("path"),
+          py::arg("data") = true,
+          py::arg("fields") = std::vector<std::string>(),
+          py::arg("max_batches") = 0)
+      .def("batchCaptureInfo", [](const Context& ctx) {
+        auto recorder = ctx.getBatchRecorder();
+        return recorder != nullptr ? recorder->info() : std::string();
+      });
+
+#ifdef ELF_WITH_TORCH
+  context.def(
+      "setTorchScriptBackend",
+      [](Context& ctx,
+         const std::string& label,
+         const std::string& model_path,
+         const std::vector<std::string>& input,
+         const std::vector<std::string>& reply,
+         int device,
+         bool fp16) {
+        elf::ai::inference::TorchScriptOptions options;
+        options.model_path = model_path;
+        options.input = input;
+        options.reply = reply;
+        options.device = device;
+        options.fp16 = fp16;
+        ctx.setInferenceBackend(
+            label, elf::ai::inference::makeTorchScriptBackend(options));
+      },
+      py::arg("label"),
+      py::arg("model_path"),
+      py::arg("input"),
+      py::arg("reply"),
+      py::arg("device") = -1,
+      py::arg("fp16") = false);
+#endif
 
   py::class_<Size>(m, "Size").def("vec", &Size::vec, ref);
 
@@ -67,12 +311,24 @@ void register_common_func(pybind11::module& m) {
       .def("idx", &SharedMemOptions::getIdx)
       .def("batchsize", &SharedMemOptions::getBatchSize)
       .def("label", &SharedMemOptions::getLabel, ref)
-      .def("setTimeout", &SharedMemOptions::setTimeout);
+      .def("setTimeout", &SharedMemOptions::setTimeout)
+      .def("setLatencyTarget", &SharedMemOptions::setLatencyTarget)
+      .def("setPriorityWeight", &SharedMemOptions::setPriorityWeight)
+      .def("setPooled", &SharedMemOptions::setPooled)
+      .def("setReleaseOnFill", &SharedMemOptions::setReleaseOnFill)
+      .def("setPartitionByKey", &SharedMemOptions::setPartitionByKey)
+      .def(
+          "setDevice",
+          &SharedMemOptions::setDevice,
+          py::arg("device"),
+          py::arg("capacity") = 1.0)
+      .def("device", &SharedMemOptions::getDevice);
 
   py::class_<SharedMem>(m, "SharedMem")
       .def("__getitem__", &SharedMem::get, ref)
       .def("getSharedMemOptions", &SharedMem::getSharedMemOptions, ref)
       .def("effective_batchsize", &SharedMem::getEffectiveBatchSize)
+      .def("batch_key", &SharedMem::getBatchKey)
       .def("info", &SharedMem::info);
 
   py::class_<AnyP>(m, "AnyP")
@@ -86,6 +342,50 @@ void register_common_func(pybind11::module& m) {
       .def("sz", &FuncMapBase::getSize, ref)
       .def("type_name", &FuncMapBase::getTypeName)
       .def("type_size", &FuncMapBase::getSizeOfType);
+
+  py::class_<elf::BatchReplayOptions>(m, "BatchReplayOptions")
+      .def(py::init<>())
+      .def_readwrite("path", &elf::BatchReplayOptions::path)
+      .def_readwrite("speed", &elf::BatchReplayOptions::speed)
+      .def_readwrite("num_clients", &elf::BatchReplayOptions::num_clients)
+      .def_readwrite("stub", &elf::BatchReplayOptions::stub)
+      .def_readwrite("max_batches", &elf::BatchReplayOptions::max_batches)
+      .def_readwrite("batchsize", &elf::BatchReplayOptions::batchsize)
+      .def("info", &elf::BatchReplayOptions::info);
+
+  // Also a game context for GCWrapper, to serve the replay with a model.
+  py::class_<elf::BatchReplay>(m, "BatchReplay")
+      .def(py::init<const elf::BatchReplayOptions&>())
+      .def("ctx", &elf::BatchReplay::ctx, ref)
+      .def("getLabels", &elf::BatchReplay::getLabels)
+      .def("getKeys", &elf::BatchReplay::getKeys)
+      .def("getBatchSize", &elf::BatchReplay::getBatchSize)
+      .def("setInput", &elf::BatchReplay::setInput)
+      .def("allocateSharedMem", &elf::BatchReplay::allocateSharedMem, ref)
+      .def("done", &elf::BatchReplay::done)
+      .def(
+          "waitUntilDone",
+          &elf::BatchReplay::waitUntilDone,
+          py::arg("timeout_msec") = 0,
+          py::call_guard<py::gil_scoped_release>())
+      .def("summary", &elf::BatchReplay::summary)
+      .def("printSummary", [](const elf::BatchReplay& replay) {
+        std::cout << replay.summary();
+      });
+
+  py::class_<BatchDispatcher>(m, "BatchDispatcher")
+      .def(
+          py::init<Context*, int>(),
+          py::arg("ctx"),
+          py::arg("batchdim") = 0,
+          py::keep_alive<1, 2>())
+      .def("bind", &BatchDispatcher::bind)
+      .def("bindRaw", &BatchDispatcher::bindRaw)
+      .def(
+          "run",
+          &BatchDispatcher::run,
+          py::arg("num_batches") = 1,
+          py::arg("timeout_usec") = 0);
 }
 
 void register_tree_search(pybind11::module& m) {
@@ -111,6 +411,12 @@ void registerPy(pybind11::module& m) {
   auto m_options = m.def_submodule("_options");
   elf::options::registerPy(m_options);
 
+  auto m_metrics = m.def_submodule("_metrics");
+  elf::metrics::registerPy(m_metrics);
+
+  auto m_tracing = m.def_submodule("_tracing");
+  elf::tracing::registerPy(m_tracing);
+
   register_tree_search(m);
 }
 
@@ -9,11 +9,17 @@
 #pragma once
 
 #include <atomic>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include "elf/base/context.h"
+#include "elf/concurrency/ConcurrentQueue.h"
 #include "elf/utils/utils.h"
 
 namespace elf {
@@ -63,27 +69,46 @@ class AI_T {
   int id_ = -1;
 };
 
-template <typename S, typename A>
+// If AFields is a StaticFieldsT<A, ...>, the actions are bound through it
+// rather than through the Extractor.
+template <typename S, typename A, typename AFields = void>
 class AIClientT : public AI_T<S, A> {
  public:
   using Action = A;
   using State = S;
 
-  AIClientT(elf::GameClient* client, const std::vector<std::string>& targets)
-      : client_(client), targets_(targets) {}
+  AIClientT(
+      elf::GameClient* client,
+      const std::vector<std::string>& targets,
+      int priority = comm::PRIORITY_NORMAL)
+      : client_(client), targets_(targets), priority_(priority) {
+    if constexpr (!std::is_void<AFields>::value) {
+      afields_.reset(new AFields(client_->getSMemKeys(targets_)));
+    }
+  }
+
+  ~AIClientT() {
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      tasks_.push(nullptr);
+    }
+    for (auto& th : workers_) {
+      th.join();
+    }
+  }
 
   // Given the current state, perform action and send the action to _a;
   // Return false if this procedure fails.
   bool act(const S& s, A* a) override {
     elf::FuncsWithState funcs_s = client_->BindStateToFunctions(targets_, &s);
-    elf::FuncsWithState funcs_a = client_->BindStateToFunctions(targets_, a);
+    elf::FuncsWithState funcs_a = bindAction(a);
     // elf::FuncsWithState funcs =
     // elf::FuncsWithState::MergePkg(funcs_s, funcs_a);
 
     funcs_s.add(funcs_a);
 
     // return client_->sendWait(targets_, &funcs);
-    comm::ReplyStatus status = client_->sendWait(targets_, &funcs_s);
+    comm::ReplyStatus status =
+        client_->sendWait(targets_, &funcs_s, priority_, key_.load());
     return status == comm::ReplyStatus::SUCCESS ||
         status == comm::ReplyStatus::UNKNOWN;
   }
@@ -93,26 +118,100 @@ class AIClientT : public AI_T<S, A> {
       const std::vector<A*>& batch_a) {
     std::vector<elf::FuncsWithState> funcs_s =
         client_->BindStateToFunctions(targets_, batch_s);
-    std::vector<elf::FuncsWithState> funcs_a =
-        client_->BindStateToFunctions(targets_, batch_a);
+    std::vector<elf::FuncsWithState> funcs_a = bindActions(batch_a);
     // elf::FuncsWithState funcs =
     // elf::FuncsWithState::MergePkg(funcs_s, funcs_a);
     //
     std::vector<elf::FuncsWithState*> ptr_funcs_s;
+    ptr_funcs_s.reserve(funcs_s.size());
     for (size_t i = 0; i < funcs_s.size(); ++i) {
       funcs_s[i].add(funcs_a[i]);
       ptr_funcs_s.push_back(&funcs_s[i]);
     }
 
     // return client_->sendWait(targets_, &funcs);
-    comm::ReplyStatus status = client_->sendBatchWait(targets_, ptr_funcs_s);
+    comm::ReplyStatus status =
+        client_->sendBatchWait(targets_, ptr_funcs_s, priority_, key_.load());
     return status == comm::ReplyStatus::SUCCESS ||
         status == comm::ReplyStatus::UNKNOWN;
   }
 
+  // Partition key of the requests from now on (see comm::SendOptions).
+  void setKey(int64_t key) {
+    key_ = key;
+  }
+
+  // Same as act_batch, but the request is sent from a worker thread owned by
+  // this client and the call returns immediately. The states and actions
+  // must stay alive until the future is ready. Comm identifies clients by
+  // thread id, so workers are persistent and one is added whenever all of
+  // them are busy.
+  std::future<bool> act_batch_async(
+      const std::vector<const S*>& batch_s,
+      const std::vector<A*>& batch_a) {
+    auto task = std::make_shared<std::packaged_task<bool()>>(
+        [this, batch_s, batch_a]() { return this->act_batch(batch_s, batch_a); });
+    std::future<bool> res = task->get_future();
+
+    {
+      std::lock_guard<std::mutex> lock(workersMutex_);
+      if (numBusyWorkers_++ >= (int)workers_.size()) {
+        workers_.emplace_back([this]() { this->workerLoop(); });
+      }
+    }
+    tasks_.push(task);
+    return res;
+  }
+
  private:
+  using Task = std::shared_ptr<std::packaged_task<bool()>>;
+
   elf::GameClient* client_;
   std::vector<std::string> targets_;
+  int priority_;
+  std::atomic<int64_t> key_{-1};
+  using AFieldsOrInt = typename std::
+      conditional<std::is_void<AFields>::value, int, AFields>::type;
+  std::unique_ptr<AFieldsOrInt> afields_;
+
+  concurrency::ConcurrentQueue<Task> tasks_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> numBusyWorkers_{0};
+  std::mutex workersMutex_;
+
+  elf::FuncsWithState bindAction(A* a) {
+    if constexpr (std::is_void<AFields>::value) {
+      return client_->BindStateToFunctions(targets_, a);
+    } else {
+      elf::FuncsWithState funcs;
+      afields_->bind(*a, &funcs);
+      return funcs;
+    }
+  }
+
+  std::vector<elf::FuncsWithState> bindActions(const std::vector<A*>& batch_a) {
+    if constexpr (std::is_void<AFields>::value) {
+      return client_->BindStateToFunctions(targets_, batch_a);
+    } else {
+      std::vector<elf::FuncsWithState> funcs(batch_a.size());
+      for (size_t i = 0; i < batch_a.size(); ++i) {
+        afields_->bind(*batch_a[i], &funcs[i]);
+      }
+      return funcs;
+    }
+  }
+
+  void workerLoop() {
+    while (true) {
+      Task task;
+      tasks_.pop(&task);
+      if (task == nullptr) {
+        return;
+      }
+      (*task)();
+      numBusyWorkers_--;
+    }
+  }
 };
 
 } // namespace ai
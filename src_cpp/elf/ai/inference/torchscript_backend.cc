@@ -0,0 +1,196 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "torchscript_backend.h"
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <torch/script.h>
+#ifdef ELF_TORCH_CUDA
+#include <c10/cuda/CUDAGuard.h>
+#include <c10/cuda/CUDAStream.h>
+#endif
+
+#include "elf/base/sharedmem.h"
+
+namespace elf {
+namespace ai {
+namespace inference {
+
+namespace {
+
+using Module = torch::jit::script::Module;
+
+// Same types as the Python allocator.
+torch::ScalarType toScalarType(const std::string& type_name) {
+  if (type_name == "float") {
+    return torch::kFloat;
+  } else if (type_name == "int32_t") {
+    return torch::kInt;
+  } else if (type_name == "int64_t") {
+    return torch::kLong;
+  } else if (
+      type_name == "uint8_t" || type_name == "unsigned char" ||
+      type_name == "char") {
+    return torch::kByte;
+  }
+  throw std::invalid_argument("TorchScript: unsupported type " + type_name);
+}
+
+// The first batchsize rows of the field, in place.
+torch::Tensor wrap(const AnyP& p, size_t batchsize) {
+  const FuncMapBase& f = p.field();
+  const std::vector<int>& extents = f.getSize().vec();
+  std::vector<int64_t> sizes(extents.begin(), extents.end());
+  sizes[0] = batchsize;
+  std::vector<int64_t> strides;
+  for (int stride : p.getStride().vec()) {
+    strides.push_back(stride / (int)f.getSizeOfType());
+  }
+  return torch::from_blob(
+      p.data(),
+      sizes,
+      strides,
+      torch::TensorOptions().dtype(toScalarType(f.getTypeName())));
+}
+
+class TorchScriptBackend : public InferenceBackend {
+ public:
+  TorchScriptBackend(
+      std::shared_ptr<Module> module,
+      const TorchScriptOptions& options)
+      : module_(std::move(module)),
+        options_(options),
+        device_(
+            options.device >= 0 ? torch::Device(torch::kCUDA, options.device)
+                                : torch::Device(torch::kCPU)) {
+#ifdef ELF_TORCH_CUDA
+    if (options.device >= 0) {
+      stream_.emplace(c10::cuda::getStreamFromPool(false, options.device));
+    }
+#endif
+  }
+
+  comm::ReplyStatus process(SharedMem& smem) override {
+    const size_t batchsize = smem.getEffectiveBatchSize();
+    try {
+      torch::NoGradGuard no_grad;
+#ifdef ELF_TORCH_CUDA
+      c10::optional<c10::cuda::CUDAStreamGuard> guard;
+      if (stream_) {
+        guard.emplace(*stream_);
+      }
+#endif
+      std::vector<torch::jit::IValue> args;
+      for (const auto& key : options_.input) {
+        torch::Tensor t = wrap(*field(smem, key), batchsize);
+        auto to = t.options().device(device_);
+        if (options_.fp16 && t.is_floating_point()) {
+          to = to.dtype(torch::kHalf);
+        }
+        args.push_back(t.to(to, /*non_blocking=*/true));
+      }
+
+      const torch::jit::IValue out = module_->forward(args);
+
+      for (size_t i = 0; i < options_.reply.size(); ++i) {
+        torch::Tensor dst = wrap(*field(smem, options_.reply[i]), batchsize);
+        dst.copy_(output(out, i).reshape(dst.sizes()), /*non_blocking=*/true);
+      }
+#ifdef ELF_TORCH_CUDA
+      if (stream_) {
+        stream_->synchronize();
+      }
+#endif
+    } catch (const std::exception& e) {
+      std::cout << "Error! TorchScript on "
+                << smem.getSharedMemOptions().getLabel() << ": " << e.what()
+                << std::endl;
+      return comm::FAILED;
+    }
+    return comm::SUCCESS;
+  }
+
+  std::string info() const override {
+    return options_.info();
+  }
+
+ private:
+  std::shared_ptr<Module> module_;
+  const TorchScriptOptions options_;
+  const torch::Device device_;
+#ifdef ELF_TORCH_CUDA
+  c10::optional<c10::cuda::CUDAStream> stream_;
+#endif
+
+  static AnyP* field(SharedMem& smem, const std::string& key) {
+    AnyP* p = smem[key];
+    if (p == nullptr || p->data() == nullptr) {
+      throw std::invalid_argument("no allocated field " + key);
+    }
+    return p;
+  }
+
+  torch::Tensor output(const torch::jit::IValue& out, size_t i) const {
+    if (out.isGenericDict()) {
+      return out.toGenericDict().at(options_.reply[i]).toTensor();
+    } else if (out.isTuple()) {
+      return out.toTuple()->elements().at(i).toTensor();
+    }
+    return out.toTensor();
+  }
+};
+
+} // namespace
+
+InferenceBackendFactory makeTorchScriptBackend(
+    const TorchScriptOptions& options) {
+  auto module = std::make_shared<Module>(torch::jit::load(options.model_path));
+  if (options.device >= 0) {
+    module->to(torch::Device(torch::kCUDA, options.device));
+  }
+  if (options.fp16) {
+    module->to(torch::kHalf);
+  }
+  module->eval();
+  std::cout << "Loaded " << options.info() << std::endl;
+
+  // Copies of the module on the other devices of the collectors, made by the
+  // first collector of each.
+  auto mutex = std::make_shared<std::mutex>();
+  auto copies = std::make_shared<std::map<int, std::shared_ptr<Module>>>();
+  (*copies)[options.device] = module;
+
+  return [copies, mutex, options](const SharedMem& smem) {
+    TorchScriptOptions opts = options;
+    const int device = smem.getSharedMemOptions().getDevice();
+    if (options.device >= 0 && device >= 0) {
+      opts.device = device;
+    }
+    std::shared_ptr<Module> m;
+    {
+      std::lock_guard<std::mutex> lock(*mutex);
+      auto& copy = (*copies)[opts.device];
+      if (copy == nullptr) {
+        copy = std::make_shared<Module>(copies->at(options.device)->clone());
+        copy->to(torch::Device(torch::kCUDA, opts.device));
+        std::cout << "Copied " << opts.info() << std::endl;
+      }
+      m = copy;
+    }
+    return std::unique_ptr<InferenceBackend>(new TorchScriptBackend(m, opts));
+  };
+}
+
+} // namespace inference
+} // namespace ai
+} // namespace elf
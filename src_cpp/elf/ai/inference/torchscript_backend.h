@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Built with -DELF_WITH_TORCH=ON only (needs libtorch).
+
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "elf/base/inference.h"
+
+namespace elf {
+namespace ai {
+namespace inference {
+
+struct TorchScriptOptions {
+  // An exported (torch.jit.save) module.
+  std::string model_path;
+  // Its forward() takes the input fields in this order, and returns either
+  // a dict keyed by the reply fields, a tuple in the order of reply, or a
+  // single tensor for a single reply field.
+  std::vector<std::string> input;
+  std::vector<std::string> reply;
+  // CUDA device, or -1 to run on the cpu. On a gpu, the collectors with a
+  // device of their own (SharedMemOptions::setDevice) run a copy of the
+  // module there instead.
+  int device = -1;
+  // Runs the module in half precision; floating point inputs are converted,
+  // and the replies are converted back to the types of their fields.
+  bool fp16 = false;
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "TorchScript: " << model_path << ", device: " << device
+       << ", fp16: " << fp16 << ", #input: " << input.size()
+       << ", #reply: " << reply.size();
+    return ss.str();
+  }
+};
+
+// Loads the module once; the backends of the factory share it, and each has
+// its own CUDA stream (on a gpu), so that the collectors of a label run
+// their batches concurrently. Throws if the module cannot be loaded.
+InferenceBackendFactory makeTorchScriptBackend(
+    const TorchScriptOptions& options);
+
+} // namespace inference
+} // namespace ai
+} // namespace elf
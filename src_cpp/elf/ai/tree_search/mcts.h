@@ -53,25 +53,13 @@ class MCTSAI_T : public AI_T<typename Actor::State, typename Actor::Action> {
   }
 
   bool act(const State& s, Action* a) override {
-    align_state(s);
-
-    if (options_.verbose_time) {
-      elf_utils::MyClock clock;
-      clock.restart();
-
-      lastResult_ = ts_->run(s);
-
-      clock.record("MCTS");
-      std::cout << "[" << this->getID()
-                << "] MCTSAI Result: " << lastResult_.info()
-                << " Action:" << lastResult_.best_action << std::endl;
-      std::cout << clock.summary() << std::endl;
-    } else {
-      lastResult_ = ts_->run(s);
-    }
+    return search(s, a, [&]() { return ts_->run(s); });
+  }
 
-    *a = lastResult_.best_action;
-    return true;
+  // See TreeSearch::runFast().
+  bool actFast(const State& s, Action* a, int num_rollouts_per_thread) {
+    return search(
+        s, a, [&]() { return ts_->runFast(s, num_rollouts_per_thread); });
   }
 
   bool actPolicyOnly(const State& s, Action* a) {
@@ -84,6 +72,7 @@ class MCTSAI_T : public AI_T<typename Actor::State, typename Actor::Action> {
 
   bool endGame(const State&) override {
     resetTree();
+    ts_->clearTranspositionTable();
     return true;
   }
 
@@ -101,6 +90,23 @@ class MCTSAI_T : public AI_T<typename Actor::State, typename Actor::Action> {
     return ss.str();
   }
 
+  // The current tree, in the binary form of SearchTreeT::save().
+  bool saveTree(std::ostream* os, int min_visits = 0) {
+    return ts_->saveTree(os, min_visits);
+  }
+
+  // Seeds the search of s with the subtree of file at node, saved at the
+  // same position. The next act(s) keeps it if options().persistent_tree.
+  bool loadTree(
+      const State& s,
+      const elf::ai::tree_search::TreeFileT<Action>& file,
+      size_t node = 0) {
+    resetTree();
+    // Only to catch up with the move number of s.
+    advanceMoves(s);
+    return ts_->loadTree(file, node);
+  }
+
   /*
   MEMBER_FUNC_CHECK(restart)
   template <typename Actor_ = Actor, typename
@@ -126,11 +132,59 @@ class MCTSAI_T : public AI_T<typename Actor::State, typename Actor::Action> {
   size_t nextMoveNumber_ = 0;
   MCTSResult lastResult_;
 
+  template <typename Run>
+  bool search(const State& s, Action* a, Run run) {
+    align_state(s);
+
+    if (options_.verbose_time) {
+      elf_utils::MyClock clock;
+      clock.restart();
+
+      lastResult_ = run();
+
+      clock.record("MCTS");
+      std::cout << "[" << this->getID()
+                << "] MCTSAI Result: " << lastResult_.info()
+                << " Action:" << lastResult_.best_action << std::endl;
+      std::cout << clock.summary() << std::endl;
+      std::cout << ts_->getWaitStats().info() << std::endl;
+      ts_->resetWaitStats();
+      // Cumulative: owners of the AI collect and reset these (e.g., per game).
+      std::cout << ts_->getPhaseStats().info() << std::endl;
+      if (ts_->getTranspositionTable() != nullptr) {
+        std::cout << ts_->getTranspositionTable()->getStats().info()
+                  << std::endl;
+        ts_->resetTranspositionStats();
+      }
+      std::cout << "Tree: #nodes: " << lastResult_.tree_num_nodes
+                << ", bytes: " << lastResult_.tree_bytes << std::endl;
+    } else {
+      lastResult_ = run();
+    }
+
+    *a = lastResult_.best_action;
+    if (options_.ponder_rollouts_per_thread > 0 && options_.persistent_tree) {
+      startPondering(s, *a);
+    }
+    return true;
+  }
+
   void resetTree() {
     ts_->clear();
     nextMoveNumber_ = 0;
   }
 
+  // Advance the tree by our move and search it while the opponent thinks.
+  // The next act() stops the search before aligning the tree.
+  void startPondering(const State& s, const Action& a) {
+    State next(s);
+    if (!ts_->getActor(0).forward(next, a)) {
+      return;
+    }
+    advanceMoves(next);
+    ts_->ponder(next);
+  }
+
   void align_state(const State& s) {
     if (!options_.persistent_tree) {
       resetTree();
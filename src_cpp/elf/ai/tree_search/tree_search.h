@@ -8,9 +8,14 @@
 
 #pragma once
 
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <sstream>
@@ -24,10 +29,15 @@
 #include "elf/comm/primitive.h"
 #include "elf/concurrency/ConcurrentQueue.h"
 #include "elf/concurrency/Counter.h"
+#include "elf/concurrency/Fiber.h"
+#include "elf/metrics/Metrics.h"
+#include "elf/tracing/Trace.h"
 #include "elf/utils/member_check.h"
 
 #include "tree_search_node.h"
 #include "tree_search_options.h"
+#include "tree_search_stats.h"
+#include "tree_search_tt.h"
 
 /*
  * Use the following function of S
@@ -65,9 +75,17 @@ class TreeSearchSingleThreadT {
  public:
   using Node = NodeT<State, Action>;
   using SearchTree = SearchTreeT<State, Action>;
-
-  TreeSearchSingleThreadT(int thread_id, const TSOptions& options)
-      : threadId_(thread_id), options_(options) {
+  using TranspositionTable = TranspositionTableT<Action>;
+
+  TreeSearchSingleThreadT(
+      int thread_id,
+      const TSOptions& options,
+      EvalWaitStats* wait_stats = nullptr,
+      TranspositionTable* tt = nullptr)
+      : threadId_(thread_id),
+        options_(options),
+        waitStats_(wait_stats),
+        tt_(tt) {
     if (options_.verbose) {
       std::string log_file =
           "tree_search_" + std::to_string(thread_id) + ".txt";
@@ -79,6 +97,14 @@ class TreeSearchSingleThreadT {
     runInfoWhenStateReady_.push(num_rollout);
   }
 
+  const SearchPhaseCounters& getStats() const {
+    return stats_;
+  }
+
+  void resetStats() {
+    stats_.reset();
+  }
+
   template <typename Actor>
   bool run(
       int run_id,
@@ -87,6 +113,7 @@ class TreeSearchSingleThreadT {
       SearchTree& search_tree) {
     int num_rollout;
     runInfoWhenStateReady_.pop(&num_rollout);
+    tracing::Span span("mcts", "search", num_rollout);
 
     Node* root = search_tree.getRootNode();
     if (root == nullptr || root->getStatePtr() == nullptr) {
@@ -103,11 +130,16 @@ class TreeSearchSingleThreadT {
                << std::flush;
     }
 
-    for (int idx = 0; idx < num_rollout &&
-         (stop_search == nullptr || !stop_search->load());) {
-      // Start from the root and run one path
-      idx += batch_rollouts<Actor>(
-          RunContext(run_id, idx, num_rollout), root, actor, search_tree);
+    if (options_.num_pipelined_batches > 1) {
+      pipelined_rollouts<Actor>(
+          run_id, num_rollout, stop_search, root, actor, search_tree);
+    } else {
+      for (int idx = 0; idx < num_rollout &&
+           (stop_search == nullptr || !stop_search->load());) {
+        // Start from the root and run one path
+        idx += batch_rollouts<Actor>(
+            RunContext(run_id, idx, num_rollout), root, actor, search_tree);
+      }
     }
 
     if (output_ != nullptr) {
@@ -121,14 +153,56 @@ class TreeSearchSingleThreadT {
  private:
   int threadId_;
   const TSOptions& options_;
+  EvalWaitStats* waitStats_;
+  TranspositionTable* tt_;
+  SearchPhaseCounters stats_;
+  elf::metrics::Counter* rollouts_ = elf::metrics::Registry::global().counter(
+      "elf_mcts_rollouts_total",
+      "Rollouts backed up by the tree searches");
+  elf::metrics::Counter* collisions_ =
+      elf::metrics::Registry::global().counter(
+          "elf_mcts_collisions_total",
+          "Rollouts ending at a leaf already being evaluated");
+
+  using Clock = SearchPhaseCounters::Clock;
 
   struct Traj {
-    std::vector<std::pair<Node*, Action>> traj;
+    // The nodes and the indices of the edges followed from them.
+    std::vector<std::pair<Node*, int>> traj;
+    // Virtual loss added to each edge of traj, by this rollout and those
+    // merged into it (see select_batch).
+    std::vector<float> virtual_losses;
     Node* leaf;
+    // Stopped at an already visited node by the node budget.
+    bool capped = false;
+  };
+
+  // Rollouts selected together and sent to the actor as one batch.
+  struct Batch {
+    // Reserved for all the rollouts of the batch: traj_counts points into it.
+    std::vector<Traj> trajs;
+    // Leaves locked by this batch, and their states.
+    std::vector<Node*> locked_leaves;
+    std::vector<const State*> locked_states;
+    // Transposition table key of each locked leaf, if it has one.
+    std::vector<std::pair<bool, uint64_t>> locked_keys;
+    // Locked leaves expanded from the transposition table.
+    size_t num_cached = 0;
+    // Rollouts stopped by the node budget.
+    size_t num_capped = 0;
+    // Distinct leaves reached by the batch, with one of their trajectories
+    // and the number of rollouts that ended there.
+    std::vector<std::pair<Node*, std::pair<Traj*, int>>> traj_counts;
+    std::vector<NodeResponseT<Action>> resps;
+
+    // Rollouts that count towards num_rollout.
+    size_t numRollouts() const {
+      return locked_leaves.size() + num_cached + num_capped;
+    }
   };
 
   // TODO: The weird variable name below needs to change (ssengupta@fb)
-  elf::concurrency::ConcurrentQueue<int> runInfoWhenStateReady_;
+  elf::concurrency::ConcurrentQueueFutex<int> runInfoWhenStateReady_;
   std::unique_ptr<std::ostream> output_;
 
   MEMBER_FUNC_CHECK(reward)
@@ -168,10 +242,16 @@ class TreeSearchSingleThreadT {
       const Node* node,
       const Action& action,
       Actor& actor,
-      Node* next_node) {
+      Node* next_node,
+      Clock::duration* expand_time) {
     auto func = [&]() -> State* {
+      const auto start = Clock::now();
       State* state = new State(*node->getStatePtr());
-      if (!actor.forward(*state, action)) {
+      const bool valid = actor.forward(*state, action);
+      const auto elapsed = Clock::now() - start;
+      *expand_time += elapsed;
+      stats_.addTime(PHASE_EXPAND, elapsed);
+      if (!valid) {
         delete state;
         return nullptr;
       }
@@ -181,6 +261,19 @@ class TreeSearchSingleThreadT {
     return next_node->setStateIfUnset(func);
   }
 
+  // Over the node budget of the tree, or the memory budget of all trees.
+  bool treeFull(const SearchTree& search_tree) const {
+    if (treeMemory().overBudget()) {
+      return true;
+    }
+    if (options_.max_num_nodes <= 0) {
+      return false;
+    }
+    const size_t max_num_nodes = options_.max_num_nodes;
+    return search_tree.capacity() >= max_num_nodes &&
+        search_tree.size() >= max_num_nodes;
+  }
+
   void printHelper(const RunContext& ctx, std::string str) {
     if (output_ != nullptr) {
       *output_ << "[run=" << ctx.run_id << "][iter=" << ctx.idx << "/"
@@ -190,69 +283,267 @@ class TreeSearchSingleThreadT {
   }
 
   template <typename Actor>
-  size_t batch_rollouts(
+  void select_batch(
       const RunContext& ctx,
       Node* root,
       Actor& actor,
-      SearchTree& search_tree) {
-    // Start from the root and run one path
-    std::vector<Traj> trajs;
-    for (int j = 0; j < options_.num_rollouts_per_batch; ++j) {
-      trajs.push_back(single_rollout<Actor>(ctx, root, actor, search_tree));
-    }
-
-    // Now we want to batch create nodes.
-    std::vector<Node*> locked_leaves;
-    std::vector<const State*> locked_states;
-
-    std::unordered_map<Node*, std::pair<Traj*, int>> traj_counts;
-
-    // For unlocked leaves, just let it go
-    // Reason:
-    //   1. Other threads lock it
+      SearchTree& search_tree,
+      Batch* batch) {
+    ELF_TRACE_SPAN("mcts", "select");
+    const int max_retries = std::max(0, options_.max_collision_retries);
+    batch->trajs.reserve(options_.num_rollouts_per_batch + max_retries);
+
+    std::unordered_map<Node*, size_t> leaf_indices;
+    size_t num_collisions = 0;
+    size_t num_duplicates = 0;
+    size_t num_retries = 0;
+
+    // Leaves that are not locked are just backed up once evaluated:
+    //   1. Other threads lock them (collisions)
     //   2. Duplicated leaf.
-    for (Traj& traj : trajs) {
+    // Such a rollout is wasted: up to max_retries of them are selected again.
+    // Their virtual loss stays until the backup, steering the next ones to
+    // other leaves.
+    int num_to_select = options_.num_rollouts_per_batch;
+    for (int j = 0; j < num_to_select; ++j) {
+      // Start from the root and run one path
+      batch->trajs.push_back(
+          single_rollout<Actor>(ctx, root, actor, search_tree));
+      Traj& traj = batch->trajs.back();
+
+      if (traj.capped) {
+        // Capped rollouts through the same node may differ in their last
+        // edge, so each is backed up on its own.
+        batch->num_capped++;
+        batch->traj_counts.push_back(
+            std::make_pair(traj.leaf, std::make_pair(&traj, 1)));
+        continue;
+      }
+
       if (traj.leaf->lockNodeForEvaluation()) {
-        locked_leaves.push_back(traj.leaf);
-        locked_states.push_back(traj.leaf->getStatePtr());
+        const State* state = traj.leaf->getStatePtr();
+        uint64_t key = 0;
+        bool hashed = tt_ != nullptr &&
+            StateTrait<State, Action>::hash(*state, &key);
+        NodeResponseT<Action> resp;
+        if (hashed && tt_->lookup(key, &resp)) {
+          traj.leaf->setNodeEvaluationAndUnlock(resp);
+          batch->num_cached++;
+        } else {
+          batch->locked_leaves.push_back(traj.leaf);
+          batch->locked_states.push_back(state);
+          batch->locked_keys.push_back(std::make_pair(hashed, key));
+        }
       }
 
-      auto it = traj_counts.find(traj.leaf);
-      if (it == traj_counts.end())
-        traj_counts[traj.leaf] = std::make_pair(&traj, 1);
-      else
-        it->second.second++;
+      bool wasted = false;
+      auto it = leaf_indices.find(traj.leaf);
+      if (it == leaf_indices.end()) {
+        if (!traj.leaf->isVisited() &&
+            (batch->locked_leaves.empty() ||
+             batch->locked_leaves.back() != traj.leaf)) {
+          num_collisions++;
+          wasted = true;
+        }
+        leaf_indices[traj.leaf] = batch->traj_counts.size();
+        batch->traj_counts.push_back(
+            std::make_pair(traj.leaf, std::make_pair(&traj, 1)));
+      } else {
+        num_duplicates++;
+        wasted = true;
+        // Same leaf, same path: backed up together.
+        auto& first = batch->traj_counts[it->second].second;
+        first.second++;
+        for (size_t k = 0; k < traj.virtual_losses.size(); ++k) {
+          first.first->virtual_losses[k] += traj.virtual_losses[k];
+        }
+      }
+      if (wasted && (int)num_retries < max_retries) {
+        num_retries++;
+        num_to_select++;
+      }
     }
 
-    // Batch evaluate.
-    std::vector<NodeResponseT<Action>> resps;
-    actor.evaluate(locked_states, &resps);
+    stats_.addRollouts(batch->numRollouts());
+    stats_.addBatch(
+        batch->locked_leaves.size(),
+        batch->num_cached,
+        batch->num_capped,
+        num_collisions,
+        num_duplicates,
+        num_retries);
+    collisions_->add(num_collisions + num_duplicates);
+  }
 
-    for (size_t j = 0; j < locked_leaves.size(); ++j) {
+  void apply_batch(Batch& batch) {
+    for (size_t j = 0; j < batch.locked_leaves.size(); ++j) {
+      if (batch.locked_keys[j].first) {
+        tt_->insert(batch.locked_keys[j].second, batch.resps[j]);
+      }
       // Now the node points to a recently created node.
       // Evaluate it and backpropagate.
-      locked_leaves[j]->setNodeEvaluationAndUnlock(resps[j]);
+      batch.locked_leaves[j]->setNodeEvaluationAndUnlock(batch.resps[j]);
     }
+  }
 
-    for (auto& traj_pair : traj_counts) {
+  template <typename Actor>
+  void backprop_batch(Batch& batch, Actor& actor) {
+    ELF_TRACE_SPAN("mcts", "backprop");
+    const auto start = Clock::now();
+    for (auto& traj_pair : batch.traj_counts) {
       Node* leaf = traj_pair.first;
       Traj* traj = traj_pair.second.first;
-      int count = traj_pair.second.second;
 
-      leaf->waitForEvaluation();
+      leaf->waitForEvaluation(waitStats_);
       float reward = get_reward(actor, leaf);
       // PRINT_TS("Reward: " << reward << " Start backprop");
 
       // Add reward back.
-      for (const auto& p : traj->traj) {
-        p.first->updateEdgeStats(
-            p.second, reward, options_.virtual_loss * count);
+      for (size_t k = 0; k < traj->traj.size(); ++k) {
+        traj->traj[k].first->updateEdge(
+            traj->traj[k].second,
+            reward,
+            traj->virtual_losses[k],
+            options_.lock_free_backprop);
       }
     }
+    rollouts_->add(batch.numRollouts());
+    stats_.addTime(PHASE_BACKPROP, start);
+  }
+
+  template <typename Actor>
+  size_t batch_rollouts(
+      const RunContext& ctx,
+      Node* root,
+      Actor& actor,
+      SearchTree& search_tree) {
+    Batch batch;
+    select_batch<Actor>(ctx, root, actor, search_tree, &batch);
+
+    // Batch evaluate.
+    const auto start = Clock::now();
+    {
+      tracing::Span span("mcts", "evaluate", batch.locked_states.size());
+      actor.evaluate(batch.locked_states, &batch.resps);
+    }
+    if (!batch.locked_states.empty()) {
+      stats_.addTime(PHASE_EVALUATE, start);
+    }
+
+    apply_batch(batch);
+    backprop_batch(batch, actor);
 
     printHelper(ctx, "Done backprop");
-    // Return the leaves that are actually expanded.
-    return locked_leaves.size();
+    // Return the leaves that are actually expanded (or refined, see
+    // single_rollout).
+    return batch.numRollouts();
+  }
+
+  MEMBER_FUNC_CHECK(evaluateAsync)
+
+  // Keep up to options_.num_pipelined_batches batches in flight. While the
+  // actor evaluates batch N, this thread selects and locks leaves of batch
+  // N + 1, and backprops N once its reply arrives. Evaluations are applied as
+  // soon as they arrive (not in backprop order), so a rollout waiting on a
+  // leaf locked by another thread never waits on this thread's backprop.
+  template <
+      typename Actor,
+      typename std::enable_if<has_func_evaluateAsync<Actor>::value>::type* U =
+          nullptr>
+  void pipelined_rollouts(
+      int run_id,
+      int num_rollout,
+      const std::atomic_bool* stop_search,
+      Node* root,
+      Actor& actor,
+      SearchTree& search_tree) {
+    struct Pending {
+      std::unique_ptr<Batch> batch;
+      typename Actor::AsyncHandle handle;
+      Clock::time_point submitted;
+      bool applied;
+    };
+    std::deque<Pending> inflight;
+    int idx = 0;
+    int num_inflight_leaves = 0;
+
+    auto apply_ready = [&](bool block_on_front) {
+      for (size_t i = 0; i < inflight.size(); ++i) {
+        Pending& p = inflight[i];
+        if (p.applied ||
+            !((block_on_front && i == 0) || actor.isEvaluationReady(p.handle))) {
+          continue;
+        }
+        {
+          ELF_TRACE_SPAN("mcts", "collectEvaluation");
+          actor.collectEvaluation(p.handle);
+        }
+        if (!p.batch->locked_states.empty()) {
+          stats_.addTime(PHASE_EVALUATE, p.submitted);
+        }
+        apply_batch(*p.batch);
+        p.applied = true;
+      }
+    };
+
+    auto finish_front = [&]() {
+      apply_ready(true);
+      Pending& p = inflight.front();
+      for (auto& traj_pair : p.batch->traj_counts) {
+        Node* leaf = traj_pair.first;
+        while (!leaf->waitForEvaluation(
+            waitStats_, std::chrono::microseconds(200))) {
+          apply_ready(false);
+        }
+      }
+      backprop_batch(*p.batch, actor);
+      idx += p.batch->numRollouts();
+      num_inflight_leaves -= p.batch->numRollouts();
+      inflight.pop_front();
+    };
+
+    while (idx + num_inflight_leaves < num_rollout &&
+           (stop_search == nullptr || !stop_search->load())) {
+      RunContext ctx(run_id, idx + num_inflight_leaves, num_rollout);
+      Pending p;
+      p.batch.reset(new Batch);
+      select_batch<Actor>(ctx, root, actor, search_tree, p.batch.get());
+      p.submitted = Clock::now();
+      p.handle =
+          actor.evaluateAsync(p.batch->locked_states, &p.batch->resps);
+      p.applied = false;
+      num_inflight_leaves += p.batch->numRollouts();
+      inflight.push_back(std::move(p));
+
+      if ((int)inflight.size() >= options_.num_pipelined_batches) {
+        finish_front();
+        printHelper(ctx, "Done backprop");
+      }
+    }
+
+    // Locked leaves must always be released, even when the search stops.
+    while (!inflight.empty()) {
+      finish_front();
+    }
+  }
+
+  // Actors without evaluateAsync() are not pipelined.
+  template <
+      typename Actor,
+      typename std::enable_if<!has_func_evaluateAsync<Actor>::value>::type* U =
+          nullptr>
+  void pipelined_rollouts(
+      int run_id,
+      int num_rollout,
+      const std::atomic_bool* stop_search,
+      Node* root,
+      Actor& actor,
+      SearchTree& search_tree) {
+    for (int idx = 0; idx < num_rollout &&
+         (stop_search == nullptr || !stop_search->load());) {
+      idx += batch_rollouts<Actor>(
+          RunContext(run_id, idx, num_rollout), root, actor, search_tree);
+    }
   }
 
   template <typename Actor>
@@ -261,30 +552,51 @@ class TreeSearchSingleThreadT {
       Node* root,
       Actor& actor,
       SearchTree& search_tree) {
+    const auto start = Clock::now();
+    Clock::duration expand_time(0);
     Node* node = root;
 
     Traj traj;
     while (node->isVisited()) {
       // If there is no move available, skip.
-      Action action;
+      int edge;
       bool has_move =
-          node->findMove(options_.alg_opt, ctx.depth, &action, output_.get());
+          node->findEdge(options_.alg_opt, ctx.depth, &edge, output_.get());
       if (!has_move) {
         printHelper(ctx, "No available action");
         break;
       }
+      const Action action = node->getEdges().action(edge);
 
       printHelper(ctx, "No available action");
       // PRINT_TS(" Action: " << action);
 
       // Add virtual loss if there is any.
+      float virtual_loss = 0;
       if (options_.virtual_loss > 0) {
-        node->addVirtualLoss(action, options_.virtual_loss);
+        virtual_loss = options_.virtual_loss;
+        if (options_.virtual_loss_growth > 0) {
+          // Whole losses, so that backups take off exactly what was added.
+          virtual_loss += std::round(
+              options_.virtual_loss_growth * node->getEdgeVirtualLoss(edge));
+        }
+        node->addEdgeVirtualLoss(
+            edge, virtual_loss, options_.lock_free_backprop);
       }
 
       // Save trajectory.
-      traj.traj.push_back(std::make_pair(node, action));
-      NodeId next = node->followEdge(action, search_tree);
+      traj.traj.push_back(std::make_pair(node, edge));
+      traj.virtual_losses.push_back(virtual_loss);
+
+      // Once the tree is over its node budget, refine the existing nodes
+      // instead of growing it: the rollout ends here and backs up the value
+      // of this node.
+      if (node->getEdgeChild(edge) == InvalidNodeId && treeFull(search_tree)) {
+        traj.capped = true;
+        break;
+      }
+
+      NodeId next = node->followEdgeAt(edge, search_tree);
       // PRINT_TS(" Descent node id: " << next);
 
       assert(node->getStatePtr());
@@ -301,7 +613,7 @@ class TreeSearchSingleThreadT {
       // actor takes action with node's state. If this
       // action is valid, then next_node is set with the new state
       // Otherwise next_node's state is a nullptr
-      if (!allocateState(node, action, actor, next_node)) {
+      if (!allocateState(node, action, actor, next_node, &expand_time)) {
         break;
       }
 
@@ -313,6 +625,8 @@ class TreeSearchSingleThreadT {
       ctx.incDepth();
     }
     traj.leaf = node;
+    stats_.addTime(PHASE_SELECT, Clock::now() - start - expand_time);
+    stats_.addDepth(traj.traj.size());
     return traj;
   }
 };
@@ -325,38 +639,33 @@ class TreeSearchT {
   using TreeSearchSingleThread = TreeSearchSingleThreadT<State, Action>;
   using SearchTree = SearchTreeT<State, Action>;
   using MCTSResult = MCTSResultT<Action>;
+  using MCTSSnapshot = MCTSSnapshotT<Action>;
+  using TranspositionTable = TranspositionTableT<Action>;
+  // Returns false to stop the search.
+  using SnapshotCallback = std::function<bool(const MCTSSnapshot&)>;
 
   TreeSearchT(const TSOptions& options, std::function<Actor*(int)> actor_gen)
-      : options_(options), stopSearch_(false) {
+      : options_(options),
+        stopSearch_(false),
+        stopRollouts_(false),
+        pondering_(false) {
+    if (options.transposition_table_size > 0) {
+      tt_.reset(new TranspositionTable(options.transposition_table_size));
+    }
     for (int i = 0; i < options.num_threads; ++i) {
-      treeSearches_.emplace_back(new TreeSearchSingleThread(i, options_));
+      treeSearches_.emplace_back(
+          new TreeSearchSingleThread(i, options_, &waitStats_, tt_.get()));
       actors_.emplace_back(actor_gen(i));
     }
 
-    // cout << "#Thread: " << options.num_threads << endl;
-    for (int i = 0; i < options.num_threads; ++i) {
-      TreeSearchSingleThread* th = treeSearches_[i].get();
-      threadPool_.emplace_back(std::thread{[i, this, th]() {
-        int counter = 0;
-        while (true) {
-          th->run(
-              counter,
-              // &this->done_.flag(),
-              &this->stopSearch_,
-              *this->actors_[i],
-              this->searchTree_);
-
-          // if (this->done_.get()) {
-          if (this->stopSearch_.load()) {
-            break;
-          }
-
-          this->treeReady_.increment();
-          counter++;
-        }
-        this->countStoppedThreads_.increment();
-        // this->done_.notify();
-      }});
+    const int threads_per_tree = options.num_threads_per_tree > 0
+        ? options.num_threads_per_tree
+        : std::max(options.num_threads, 1);
+    const int num_trees =
+        (std::max(options.num_threads, 1) + threads_per_tree - 1) /
+        threads_per_tree;
+    for (int i = 0; i < num_trees; ++i) {
+      searchTrees_.emplace_back(new SearchTree);
     }
   }
 
@@ -373,7 +682,80 @@ class TreeSearchT {
   }
 
   std::string printTree() const {
-    return searchTree_.printTree();
+    if (searchTrees_.size() == 1) {
+      return searchTrees_[0]->printTree();
+    }
+    std::stringstream ss;
+    for (size_t i = 0; i < searchTrees_.size(); ++i) {
+      ss << "Tree " << i << ":" << std::endl << searchTrees_[i]->printTree();
+    }
+    return ss.str();
+  }
+
+  size_t getNumTrees() const {
+    return searchTrees_.size();
+  }
+
+  // Number of live nodes in all trees. Only meaningful between searches.
+  size_t getTreeSize() const {
+    size_t n = 0;
+    for (const auto& tree : searchTrees_) {
+      n += tree->size();
+    }
+    return n;
+  }
+
+  // Bytes held by the trees (nodes, states and edges), from their running
+  // counts.
+  size_t getTreeBytes() const {
+    size_t n = 0;
+    for (const auto& tree : searchTrees_) {
+      n += tree->memoryBytes();
+    }
+    return n;
+  }
+
+  const EvalWaitStats& getWaitStats() const {
+    return waitStats_;
+  }
+
+  void resetWaitStats() {
+    waitStats_.reset();
+  }
+
+  // Per-phase counters and timings, summed over the search threads.
+  SearchPhaseStats getPhaseStats() const {
+    SearchPhaseStats stats;
+    for (const auto& th : treeSearches_) {
+      stats.merge(th->getStats().snapshot());
+    }
+    return stats;
+  }
+
+  // Only called between searches.
+  void resetPhaseStats() {
+    for (auto& th : treeSearches_) {
+      th->resetStats();
+    }
+  }
+
+  // nullptr if the transposition table is disabled.
+  const TranspositionTable* getTranspositionTable() const {
+    return tt_.get();
+  }
+
+  void resetTranspositionStats() {
+    if (tt_ != nullptr) {
+      tt_->resetStats();
+    }
+  }
+
+  // The table outlives clear(), so that a tree rebuilt every move still reuses
+  // evaluations. Drop it when they may be stale (e.g., the model changes).
+  void clearTranspositionTable() {
+    if (tt_ != nullptr) {
+      tt_->clear();
+    }
   }
 
   MCTSResult runPolicyOnly(const State& /*root_state*/) {
@@ -390,52 +772,172 @@ class TreeSearchT {
     Node* root = searchTree_.getRootNode();
     treeSearches_[0]->visit(*actors_[0], root);
 
-    // return StrongestPrior(root->getStateActions());
+    // return StrongestPrior(root->getEdges());
     */
 
     MCTSResult result;
     // result.action_rank_method = MCTSResult::PRIOR;
-    // result.addActions(root->getStateActions());
+    // result.addActions(root->getEdges());
 
     return result;
   }
 
   MCTSResult run(const State& root_state) {
-    setRootNodeState(root_state);
+    return search(root_state, options_.num_rollouts_per_thread, true);
+  }
 
-    if (options_.root_epsilon > 0.0) {
-      Node* root = searchTree_.getRootNode();
-      root->enhanceExploration(
-          options_.root_epsilon, options_.root_alpha, actors_[0]->rng());
+  // A cheaper search, of num_rollouts_per_thread rollouts per thread without
+  // noise at the root nor time budget (e.g., for moves that are not kept as
+  // training targets).
+  MCTSResult runFast(const State& root_state, int num_rollouts_per_thread) {
+    return search(root_state, num_rollouts_per_thread, false);
+  }
+
+  // Every interval of the next searches, cb gets getSnapshot(top_k) while
+  // the search threads keep going, on the thread that waits for them. Once
+  // cb returns false the search stops, with the result so far. A null cb
+  // turns the snapshots off.
+  void setSnapshotCallback(
+      std::chrono::milliseconds interval,
+      int top_k,
+      SnapshotCallback cb) {
+    snapshotInterval_ = interval;
+    snapshotTopK_ = top_k;
+    snapshotCb_ = std::move(cb);
+  }
+
+  // The top_k most visited root moves of the current (or last) search. The
+  // search threads need not stop: edge statistics are atomic, the edges of
+  // a node are read once it is visited (they do not change after that) and
+  // no node is freed during a search. Called from the snapshot callback or
+  // between searches.
+  MCTSSnapshot getSnapshot(int top_k) const {
+    MCTSSnapshot snapshot;
+    snapshot.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - searchStart_);
+    const SearchTree& tree = *searchTrees_[0];
+    const Node* root = tree.getRootNode();
+    if (root == nullptr || !root->isVisited()) {
+      return snapshot;
+    }
+    snapshot.moves = rootActions();
+    for (const auto& p : snapshot.moves) {
+      snapshot.total_visits += p.second.num_visits;
+    }
+    std::stable_sort(
+        snapshot.moves.begin(),
+        snapshot.moves.end(),
+        [](const auto& a, const auto& b) {
+          return a.second.num_visits > b.second.num_visits;
+        });
+    if (top_k >= 0 && (size_t)top_k < snapshot.moves.size()) {
+      snapshot.moves.erase(
+          snapshot.moves.begin() + top_k, snapshot.moves.end());
+    }
+    if (!snapshot.moves.empty() && snapshot.moves[0].second.num_visits > 0) {
+      snapshot.value = snapshot.moves[0].second.getQSA();
+    }
+
+    for (const auto& p : snapshot.moves) {
+      std::vector<Action> pv(1, p.first);
+      NodeId id = root->getChild(p.first);
+      while (id != InvalidNodeId && pv.size() < kMaxPvLength) {
+        const Node* node = tree[id];
+        if (!node->isVisited()) {
+          break;
+        }
+        const auto& edges = node->getEdges();
+        int best = -1;
+        int best_visits = 0;
+        for (size_t i = 0; i < edges.size(); ++i) {
+          const int n = edges.numVisits(i);
+          if (n > best_visits) {
+            best = i;
+            best_visits = n;
+          }
+        }
+        if (best < 0) {
+          break;
+        }
+        pv.push_back(edges.action(best));
+        id = edges.child(best);
+      }
+      snapshot.pvs.push_back(std::move(pv));
     }
+    return snapshot;
+  }
 
-    notifySearches(options_.num_rollouts_per_thread);
+  // Keep searching from root_state (usually the position after our move)
+  // in the background, until the next run(), treeAdvance() or clear().
+  void ponder(const State& root_state) {
+    if (options_.ponder_rollouts_per_thread <= 0) {
+      return;
+    }
+    stopPondering();
+    startSearches();
+    setRootNodeState(root_state);
+    pruneTree();
+    stopRollouts_ = false;
+    pondering_ = true;
+    notifySearches(options_.ponder_rollouts_per_thread);
+  }
 
-    // Wait until all tree searches are done.
-    treeReady_.waitUntilCount(threadPool_.size());
+  void stopPondering() {
+    if (!pondering_) {
+      return;
+    }
+    stopRollouts_ = true;
+    treeReady_.waitUntilCount(numSearchThreads());
     treeReady_.reset();
-
-    return chooseAction();
+    pondering_ = false;
   }
 
   void treeAdvance(const Action& action) {
-    searchTree_.treeAdvance(action);
+    stopPondering();
+    for (auto& tree : searchTrees_) {
+      tree->treeAdvance(action);
+    }
   }
 
   void clear() {
-    searchTree_.clear();
+    stopPondering();
+    for (auto& tree : searchTrees_) {
+      tree->clear();
+    }
+  }
+
+  // Saves the (first) tree, see SearchTreeT::save().
+  bool saveTree(std::ostream* os, int min_visits = 0) {
+    stopPondering();
+    return searchTrees_[0]->save(os, min_visits);
+  }
+
+  // Seeds all the trees with the subtree of file at node, for the next search
+  // from the state of that node (see SearchTreeT::load()).
+  bool loadTree(const TreeFileT<Action>& file, size_t node = 0) {
+    stopPondering();
+    for (auto& tree : searchTrees_) {
+      if (!tree->load(file, node)) {
+        return false;
+      }
+    }
+    return true;
   }
 
   void stop() {
     stopSearch_ = true;
+    stopRollouts_ = true;
 
     notifySearches(0);
 
-    countStoppedThreads_.waitUntilCount(threadPool_.size());
+    countStoppedThreads_.waitUntilCount(numSearchThreads());
 
     for (auto& p : threadPool_) {
       p.join();
     }
+    for (auto& f : searchFibers_) {
+      f->waitUntilTrue();
+    }
   }
 
   ~TreeSearchT() {
@@ -447,18 +949,84 @@ class TreeSearchT {
  private:
   // Multiple threads.
   std::vector<std::thread> threadPool_;
+  // Or fibers, each with the switch set once it has returned.
+  std::vector<std::shared_ptr<elf::concurrency::AtomicSwitch>> searchFibers_;
   std::vector<std::unique_ptr<TreeSearchSingleThread>> treeSearches_;
   std::vector<std::unique_ptr<Actor>> actors_;
 
   std::unique_ptr<std::ostream> output_;
 
-  SearchTree searchTree_;
+  // One tree per group of options_.num_threads_per_tree threads.
+  std::vector<std::unique_ptr<SearchTree>> searchTrees_;
 
   TSOptions options_;
   std::atomic<bool> stopSearch_;
+  // Ends the current run (time budget, early stop or end of pondering).
+  std::atomic<bool> stopRollouts_;
+  bool pondering_;
+  // Whether the search threads are running (startSearches()).
+  bool started_ = false;
+  EvalWaitStats waitStats_;
+  std::unique_ptr<TranspositionTable> tt_;
+  // See setSnapshotCallback().
+  static constexpr size_t kMaxPvLength = 32;
+  std::chrono::milliseconds snapshotInterval_{0};
+  int snapshotTopK_ = 0;
+  SnapshotCallback snapshotCb_;
+  std::chrono::steady_clock::time_point searchStart_;
   // Notif done_;
-  elf::concurrency::Counter<size_t> treeReady_;
-  elf::concurrency::Counter<size_t> countStoppedThreads_;
+  elf::concurrency::AtomicCounter<size_t> treeReady_;
+  elf::concurrency::AtomicCounter<size_t> countStoppedThreads_;
+
+  // Games that never search (e.g., waiting for their first move, or
+  // evaluation games that are not played) cost no thread.
+  void startSearches() {
+    if (started_ || stopSearch_.load()) {
+      return;
+    }
+    started_ = true;
+    const int threads_per_tree = options_.num_threads_per_tree > 0
+        ? options_.num_threads_per_tree
+        : std::max(options_.num_threads, 1);
+    // Started in a fiber (a game run by a FiberPool), or on a thread lent a
+    // pool shared by the games, the search threads are fibers of that pool.
+    elf::concurrency::FiberPool* fibers =
+        elf::concurrency::FiberPool::spawnPool();
+    for (int i = 0; i < options_.num_threads; ++i) {
+      TreeSearchSingleThread* th = treeSearches_[i].get();
+      SearchTree* tree = searchTrees_[i / threads_per_tree].get();
+      auto search = [i, this, th, tree]() {
+        int counter = 0;
+        while (true) {
+          th->run(
+              counter,
+              // &this->done_.flag(),
+              &this->stopRollouts_,
+              *this->actors_[i],
+              *tree);
+
+          // if (this->done_.get()) {
+          if (this->stopSearch_.load()) {
+            break;
+          }
+
+          this->treeReady_.increment();
+          counter++;
+        }
+        this->countStoppedThreads_.increment();
+        // this->done_.notify();
+      };
+      if (fibers != nullptr) {
+        searchFibers_.push_back(fibers->spawn(search));
+      } else {
+        threadPool_.emplace_back(search);
+      }
+    }
+  }
+
+  size_t numSearchThreads() const {
+    return threadPool_.size() + searchFibers_.size();
+  }
 
   void notifySearches(int num_rollout) {
     for (size_t i = 0; i < treeSearches_.size(); ++i) {
@@ -466,52 +1034,241 @@ class TreeSearchT {
     }
   }
 
-  void setRootNodeState(const State& root_state) {
-    Node* root = searchTree_.getRootNode();
+  // Wait for the search threads, raising stopRollouts_ once the time budget
+  // is used up or the most visited root move is decided.
+  MCTSResult search(const State& root_state, int num_rollouts, bool full) {
+    searchStart_ = std::chrono::steady_clock::now();
+    stopPondering();
+    startSearches();
+    setRootNodeState(root_state);
+    pruneTree();
+    if (tt_ != nullptr) {
+      tt_->newGeneration();
+    }
 
-    if (root == nullptr) {
-      throw std::range_error("TreeSearch::root cannot be null!");
+    if (full && options_.root_epsilon > 0.0) {
+      for (auto& tree : searchTrees_) {
+        tree->getRootNode()->enhanceExploration(
+            options_.root_epsilon, options_.root_alpha, actors_[0]->rng());
+      }
     }
 
-    root->setStateIfUnset([&]() { return new State(root_state); });
+    if (full && options_.time_budget_ms > 0 && num_rollouts <= 0) {
+      num_rollouts = std::numeric_limits<int>::max();
+    }
+    stopRollouts_ = false;
+    notifySearches(num_rollouts);
 
-    // Check hash code.
-    if (!elf::ai::tree_search::StateTrait<State, Action>::equals(
-            root_state, *root->getStatePtr())) {
-      throw std::range_error(
-          "TreeSearch::Root state is not the same as the input state");
+    // Wait until all tree searches are done.
+    if (full && (options_.time_budget_ms > 0 || options_.early_stop)) {
+      waitWithBudget(num_rollouts, true);
+    } else if (snapshotCb_ != nullptr) {
+      waitWithBudget(num_rollouts, false);
+    } else {
+      treeReady_.waitUntilCount(numSearchThreads());
+    }
+    treeReady_.reset();
+
+    return chooseAction();
+  }
+
+  // Also takes the snapshots, at their interval; only that if !full.
+  void waitWithBudget(int num_rollouts_per_thread, bool full) {
+    const auto start = std::chrono::steady_clock::now();
+    auto next_snapshot = start + snapshotInterval_;
+    const auto budget = std::chrono::milliseconds(options_.time_budget_ms);
+    const int start_visits = rootVisits();
+    const int64_t max_rollouts =
+        num_rollouts_per_thread == std::numeric_limits<int>::max()
+        ? std::numeric_limits<int64_t>::max()
+        : (int64_t)num_rollouts_per_thread * numSearchThreads();
+
+    while (treeReady_.waitUntilCount(
+               numSearchThreads(), std::chrono::milliseconds(1)) <
+           numSearchThreads()) {
+      if (stopRollouts_.load()) {
+        continue;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (snapshotCb_ != nullptr && now >= next_snapshot) {
+        next_snapshot = now + snapshotInterval_;
+        const MCTSSnapshot snapshot = getSnapshot(snapshotTopK_);
+        if (!snapshot.moves.empty() && !snapshotCb_(snapshot)) {
+          stopRollouts_ = true;
+          continue;
+        }
+      }
+      if (!full) {
+        continue;
+      }
+      const auto elapsed = now - start;
+      if (options_.time_budget_ms > 0 && elapsed >= budget) {
+        stopRollouts_ = true;
+        continue;
+      }
+      if (!options_.early_stop || options_.pick_method != "most_visited") {
+        continue;
+      }
+
+      const int64_t done = rootVisits() - start_visits;
+      int64_t remaining = max_rollouts - done;
+      if (options_.time_budget_ms > 0) {
+        // Extrapolate the rollouts that fit in the remaining time.
+        const double elapsed_sec =
+            std::chrono::duration<double>(elapsed).count();
+        const double left_sec =
+            std::chrono::duration<double>(budget - elapsed).count();
+        if (elapsed_sec > 0) {
+          remaining = std::min(
+              remaining, (int64_t)(done / elapsed_sec * left_sec) + 1);
+        }
+      }
+      if (isDecided(remaining)) {
+        stopRollouts_ = true;
+      }
+    }
+  }
+
+  // True if the gap between the two most visited root moves is larger than
+  // remaining_rollouts.
+  bool isDecided(int64_t remaining_rollouts) const {
+    const auto edges = rootActions();
+    int first = 0;
+    int second = 0;
+    for (const auto& p : edges) {
+      const int n = p.second.num_visits;
+      if (n > first) {
+        second = first;
+        first = n;
+      } else if (n > second) {
+        second = n;
+      }
+    }
+    return edges.size() > 0 && first - second > remaining_rollouts;
+  }
+
+  // A tree kept from earlier searches (persistent_tree, pondering) that is
+  // above 3/4 of the node budget is pruned down to half of it, so that the
+  // new search has room to expand. Over the memory budget of the trees (of
+  // all searches), trees are halved and give back their spare slabs.
+  void pruneTree() {
+    if (treeMemory().overBudget()) {
+      for (auto& tree : searchTrees_) {
+        tree->prune(tree->size() / 2);
+        tree->trimPool();
+      }
+      return;
+    }
+    if (options_.max_num_nodes <= 0) {
+      return;
+    }
+    const size_t high_water = (size_t)options_.max_num_nodes * 3 / 4;
+    for (auto& tree : searchTrees_) {
+      if (tree->capacity() > high_water && tree->size() > high_water) {
+        tree->prune(options_.max_num_nodes / 2);
+      }
+    }
+  }
+
+  int rootVisits() const {
+    int n = 0;
+    for (const auto& tree : searchTrees_) {
+      n += tree->getRootNode()->getNumVisits();
+    }
+    return n;
+  }
+
+  // Root edges of all trees, merged by action: visits, rewards and virtual
+  // losses add up and priors (which differ with root noise) are averaged.
+  // Actions are in the expansion order of the first tree.
+  std::vector<std::pair<Action, EdgeInfo>> rootActions() const {
+    auto res = searchTrees_[0]->getRootNode()->getStateActions();
+    if (searchTrees_.size() == 1) {
+      return res;
+    }
+    std::vector<int> num_priors(res.size(), 1);
+    for (size_t t = 1; t < searchTrees_.size(); ++t) {
+      const auto& edges = searchTrees_[t]->getRootNode()->getEdges();
+      for (size_t i = 0; i < edges.size(); ++i) {
+        // Same policy, same order: try the same index first.
+        size_t j = i;
+        if (j >= res.size() || !(res[j].first == edges.action(i))) {
+          for (j = 0; j < res.size() && !(res[j].first == edges.action(i));
+               ++j) {
+          }
+        }
+        const EdgeInfo info = edges.get(i);
+        if (j == res.size()) {
+          res.push_back(std::make_pair(edges.action(i), info));
+          num_priors.push_back(1);
+          continue;
+        }
+        EdgeInfo& merged = res[j].second;
+        merged.prior_probability += info.prior_probability;
+        merged.reward += info.reward;
+        merged.num_visits += info.num_visits;
+        merged.virtual_loss += info.virtual_loss;
+        num_priors[j]++;
+      }
+    }
+    for (size_t j = 0; j < res.size(); ++j) {
+      res[j].second.prior_probability /= num_priors[j];
+    }
+    return res;
+  }
+
+  void setRootNodeState(const State& root_state) {
+    for (auto& tree : searchTrees_) {
+      Node* root = tree->getRootNode();
+
+      if (root == nullptr) {
+        throw std::range_error("TreeSearch::root cannot be null!");
+      }
+
+      root->setStateIfUnset([&]() { return new State(root_state); });
+
+      // Check hash code.
+      if (!elf::ai::tree_search::StateTrait<State, Action>::equals(
+              root_state, *root->getStatePtr())) {
+        throw std::range_error(
+            "TreeSearch::Root state is not the same as the input state");
+      }
     }
   }
 
   MCTSResult chooseAction() const {
-    const Node* root = searchTree_.getRootNode();
-    if (root == nullptr) {
-      std::cout << "TreeSearch::root cannot be null!" << std::endl;
-      throw std::range_error("TreeSearch::root cannot be null!");
+    for (const auto& tree : searchTrees_) {
+      if (tree->getRootNode() == nullptr) {
+        std::cout << "TreeSearch::root cannot be null!" << std::endl;
+        throw std::range_error("TreeSearch::root cannot be null!");
+      }
     }
+    const auto actions = rootActions();
 
     // Pick the best solution.
     MCTSResult result;
     // MCTSResult result2;
     if (options_.pick_method == "strongest_prior") {
       result.action_rank_method = MCTSResult::PRIOR;
-      result.addActions(root->getStateActions());
-      // result2 = StrongestPrior(root->getStateActions());
+      result.addActions(actions);
+      // result2 = StrongestPrior(root->getEdges());
     } else if (options_.pick_method == "most_visited") {
       result.action_rank_method = MCTSResult::MOST_VISITED;
-      result.addActions(root->getStateActions());
-      // result2 = MostVisited(root->getStateActions());
+      result.addActions(actions);
+      // result2 = MostVisited(root->getEdges());
 
       // assert(result.max_score == result2.max_score);
       // assert(result.total_visits == result2.total_visits);
     } else if (options_.pick_method == "uniform_random") {
       result.action_rank_method = MCTSResult::UNIFORM_RANDOM;
-      result.addActions(root->getStateActions());
-      // result = UniformRandom(root->getStateActions());
+      result.addActions(actions);
+      // result = UniformRandom(root->getEdges());
     } else {
       throw std::range_error(
           "MCTS Pick method unknown! " + options_.pick_method);
     }
+    result.tree_num_nodes = getTreeSize();
+    result.tree_bytes = getTreeBytes();
 
     return result;
     // return result2;
@@ -0,0 +1,430 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+#include "elf/concurrency/Fiber.h"
+#include "elf/concurrency/HugePages.h"
+#include "elf/metrics/Memory.h"
+
+#include "tree_search_base.h"
+
+namespace elf {
+namespace ai {
+namespace tree_search {
+
+// Bytes of the search trees (node slabs, states and edges): the "tree"
+// memory account.
+inline elf::metrics::MemoryAccount& treeMemory() {
+  static elf::metrics::MemoryAccount& account =
+      elf::metrics::MemoryAccount::get("tree");
+  return account;
+}
+
+// States and edges of the nodes of one tree, charged along with
+// treeMemory(). Sharded per thread like the memory accounts, since the
+// search threads of the tree all expand nodes.
+class TreeNodeBytes {
+ public:
+  void add(int64_t bytes) {
+    treeMemory().add(bytes);
+    shards_[elf::metrics::threadShard()].v.fetch_add(
+        bytes, std::memory_order_relaxed);
+  }
+
+  void sub(int64_t bytes) {
+    add(-bytes);
+  }
+
+  int64_t bytes() const {
+    int64_t v = 0;
+    for (const auto& s : shards_) {
+      v += s.v.load(std::memory_order_relaxed);
+    }
+    return v;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> v{0};
+  };
+  Shard shards_[elf::metrics::kNumShards];
+};
+
+// Slab allocator for search tree nodes.
+//
+// Nodes live in fixed-size slabs and are addressed by dense NodeIds
+// (slab index << kSlabBits | offset), so id-to-pointer lookup is three array
+// reads and needs no lock. The slab table grows by directories of
+// kDirSize slabs as the tree does, up to the whole NodeId range. Each thread
+// (or fiber) bump-allocates from a small private chunk of ids; the arena
+// mutex is only taken once per kChunkSize nodes.
+// Slabs that become empty are pooled and handed out again, so a tree that is
+// cleared or advanced every move stops hitting the heap after warm-up.
+// With huge pages (see elf/concurrency/HugePages.h), the slabs of all the
+// arenas come from shared huge page regions, which keep the slabs freed.
+//
+// recycle()/reset() must not run concurrently with allocate(). The search
+// tree only calls them between searches. free() may run concurrently with
+// allocate() and with get() of other nodes, since ids are not handed out
+// again before their slab is recycled.
+template <typename Node>
+class NodeArenaT {
+ public:
+  static constexpr int kSlabBits = 10;
+  static constexpr int kSlabSize = 1 << kSlabBits;
+  static constexpr int kDirBits = 12;
+  static constexpr int kDirSize = 1 << kDirBits;
+  // All the non negative NodeIds.
+  static constexpr int kMaxSlabs = 1 << (31 - kSlabBits);
+  static constexpr int kMaxDirs = kMaxSlabs >> kDirBits;
+  static constexpr int kChunkSize = 32;
+
+  static_assert(kSlabSize % kChunkSize == 0, "Chunks must tile a slab");
+
+  NodeArenaT()
+      : dirs_(new std::atomic<std::atomic<Slab*>*>[kMaxDirs]),
+        generation_(newGeneration()) {
+    for (int i = 0; i < kMaxDirs; ++i) {
+      dirs_[i] = nullptr;
+    }
+  }
+
+  NodeArenaT(const NodeArenaT&) = delete;
+  NodeArenaT& operator=(const NodeArenaT&) = delete;
+
+  ~NodeArenaT() {
+    reset();
+    treeMemory().sub(pool_.size() * sizeof(Slab));
+    for (int i = 0; i < kMaxDirs; ++i) {
+      std::atomic<Slab*>* dir = dirs_[i].load(std::memory_order_relaxed);
+      if (dir != nullptr) {
+        delete[] dir;
+        treeMemory().sub(kDirSize * sizeof(*dir));
+      }
+    }
+  }
+
+  template <typename... Args>
+  NodeId allocate(Args&&... args) {
+    Cursor& cursor = threadCursor();
+    if (cursor.generation != generation_.load(std::memory_order_relaxed) ||
+        cursor.next == cursor.end) {
+      reserveChunk(&cursor);
+    }
+    NodeId id = cursor.next++;
+    Slab* slab = slot(id >> kSlabBits).load(std::memory_order_acquire);
+    const int offset = id & (kSlabSize - 1);
+
+    new (&slab->nodes[offset]) Node(std::forward<Args>(args)...);
+    slab->alive[offset] = true;
+    slab->live.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  Node* get(NodeId id) const {
+    if (id < 0) {
+      return nullptr;
+    }
+    const int idx = id >> kSlabBits;
+    const std::atomic<Slab*>* dir =
+        dirs_[idx >> kDirBits].load(std::memory_order_acquire);
+    if (dir == nullptr) {
+      return nullptr;
+    }
+    Slab* slab = dir[idx & (kDirSize - 1)].load(std::memory_order_acquire);
+    const int offset = id & (kSlabSize - 1);
+    if (slab == nullptr || !slab->alive[offset]) {
+      return nullptr;
+    }
+    return reinterpret_cast<Node*>(&slab->nodes[offset]);
+  }
+
+  // Destroy a single node. Its slab is only reclaimed by recycle().
+  void free(NodeId id) {
+    Node* node = get(id);
+    if (node == nullptr) {
+      return;
+    }
+    Slab* slab = slot(id >> kSlabBits).load(std::memory_order_relaxed);
+    node->~Node();
+    slab->alive[id & (kSlabSize - 1)] = false;
+    slab->live.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Drop every thread's pending chunk and return empty slabs to the pool.
+  void recycle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_ = newGeneration();
+    for (int i = 0; i < numSlabs_; ++i) {
+      Slab* slab = slot(i).load(std::memory_order_relaxed);
+      if (slab != nullptr && slab->live.load(std::memory_order_acquire) == 0) {
+        releaseSlab(i);
+      }
+    }
+  }
+
+  // Destroy all nodes. Slabs are kept in the pool for the next tree.
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_ = newGeneration();
+    for (int i = 0; i < numSlabs_; ++i) {
+      Slab* slab = slot(i).load(std::memory_order_relaxed);
+      if (slab == nullptr) {
+        continue;
+      }
+      for (int j = 0; j < kSlabSize && slab->live > 0; ++j) {
+        if (slab->alive[j]) {
+          reinterpret_cast<Node*>(&slab->nodes[j])->~Node();
+          slab->alive[j] = false;
+          slab->live--;
+        }
+      }
+      slot(i) = nullptr;
+      pool_.emplace_back(slab);
+    }
+    numSlabs_ = 0;
+    capacity_ = 0;
+    freeSlabIds_.clear();
+    currentSlab_ = -1;
+    currentOffset_ = kSlabSize;
+  }
+
+  // Free the pooled slabs, e.g. once a tree is pruned over the memory budget.
+  // Same constraints as recycle().
+  void trimPool() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    treeMemory().sub(pool_.size() * sizeof(Slab));
+    pool_.clear();
+  }
+
+  // Number of live nodes. Not synchronized with concurrent allocation.
+  size_t size() const {
+    size_t n = 0;
+    const int num_slabs = numSlabs_.load(std::memory_order_relaxed);
+    for (int i = 0; i < num_slabs; ++i) {
+      Slab* slab = slot(i).load(std::memory_order_relaxed);
+      if (slab != nullptr) {
+        n += slab->live;
+      }
+    }
+    return n;
+  }
+
+  // Number of slabs currently holding nodes (excluding the pool).
+  int numActiveSlabs() const {
+    return numSlabs_ - static_cast<int>(freeSlabIds_.size());
+  }
+
+  // #nodes that fit in the active slabs, an upper bound of size(). Cheap
+  // enough to be checked on every allocation.
+  size_t capacity() const {
+    return capacity_.load(std::memory_order_relaxed);
+  }
+
+  // Memory held by the active slabs.
+  size_t bytes() const {
+    return capacity() / kSlabSize * sizeof(Slab);
+  }
+
+ private:
+  struct Slab {
+    typename std::aligned_storage<sizeof(Node), alignof(Node)>::type
+        nodes[kSlabSize];
+    bool alive[kSlabSize];
+    std::atomic<int> live;
+    // From slabBlocks().
+    bool huge = false;
+  };
+
+  struct SlabDeleter {
+    void operator()(Slab* slab) const {
+      if (slab->huge) {
+        slab->~Slab();
+        slabBlocks().deallocate(slab);
+      } else {
+        delete slab;
+      }
+    }
+  };
+
+  struct Cursor {
+    uint64_t generation = 0;
+    NodeId next = 0;
+    NodeId end = 0;
+  };
+
+  // Directories of kDirSize slabs, allocated as the slabs are and kept until
+  // the arena is destroyed, so that get() may read them without a lock.
+  std::unique_ptr<std::atomic<std::atomic<Slab*>*>[]> dirs_;
+  std::vector<std::unique_ptr<Slab, SlabDeleter>> pool_;
+  std::vector<int> freeSlabIds_;
+  std::atomic<int> numSlabs_{0};
+  std::atomic<size_t> capacity_{0};
+  int currentSlab_ = -1;
+  int currentOffset_ = kSlabSize;
+
+  std::atomic<uint64_t> generation_;
+  std::mutex mutex_;
+
+  // Never destroyed: slabs may outlive the static objects.
+  static elf::concurrency::HugePageBlocks& slabBlocks() {
+    static_assert(alignof(Slab) <= 64, "Huge page blocks are 64B aligned");
+    static auto* blocks =
+        new elf::concurrency::HugePageBlocks(sizeof(Slab), "tree");
+    return *blocks;
+  }
+
+  // Of slab idx, whose directory exists.
+  std::atomic<Slab*>& slot(int idx) const {
+    return dirs_[idx >> kDirBits].load(
+        std::memory_order_acquire)[idx & (kDirSize - 1)];
+  }
+
+  static Slab* newSlab() {
+    if (elf::concurrency::getHugePages() == elf::concurrency::HugePages::OFF) {
+      return new Slab;
+    }
+    Slab* slab = new (slabBlocks().allocate()) Slab;
+    slab->huge = true;
+    return slab;
+  }
+
+  static uint64_t newGeneration() {
+    static std::atomic<uint64_t> counter(1);
+    return counter++;
+  }
+
+  // Per fiber when the search runs in fibers, so that the searches sharing
+  // a thread do not take turns at dropping each other's chunk.
+  static Cursor& threadCursor() {
+    return elf::concurrency::executionLocal<Cursor>();
+  }
+
+  void reserveChunk(Cursor* cursor) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (currentOffset_ + kChunkSize > kSlabSize) {
+      currentSlab_ = acquireSlab();
+      currentOffset_ = 0;
+    }
+    cursor->generation = generation_;
+    cursor->next = (currentSlab_ << kSlabBits) + currentOffset_;
+    cursor->end = cursor->next + kChunkSize;
+    currentOffset_ += kChunkSize;
+  }
+
+  int acquireSlab() {
+    int idx;
+    if (!freeSlabIds_.empty()) {
+      idx = freeSlabIds_.back();
+      freeSlabIds_.pop_back();
+    } else {
+      if (numSlabs_ >= kMaxSlabs) {
+        // 2^31 nodes: the memory runs out well before.
+        throw std::bad_alloc();
+      }
+      idx = numSlabs_;
+      if (dirs_[idx >> kDirBits].load(std::memory_order_relaxed) == nullptr) {
+        auto* dir = new std::atomic<Slab*>[kDirSize];
+        for (int i = 0; i < kDirSize; ++i) {
+          dir[i] = nullptr;
+        }
+        treeMemory().add(kDirSize * sizeof(*dir));
+        dirs_[idx >> kDirBits].store(dir, std::memory_order_release);
+      }
+      numSlabs_++;
+    }
+
+    std::unique_ptr<Slab, SlabDeleter> slab;
+    if (!pool_.empty()) {
+      slab = std::move(pool_.back());
+      pool_.pop_back();
+    } else {
+      slab.reset(newSlab());
+      treeMemory().add(sizeof(Slab));
+    }
+    memset(slab->alive, 0, sizeof(slab->alive));
+    slab->live = 0;
+    slot(idx).store(slab.release(), std::memory_order_release);
+    capacity_ += kSlabSize;
+    return idx;
+  }
+
+  void releaseSlab(int idx) {
+    Slab* slab = slot(idx).load(std::memory_order_relaxed);
+    slot(idx) = nullptr;
+    pool_.emplace_back(slab);
+    if (idx == currentSlab_) {
+      currentSlab_ = -1;
+      currentOffset_ = kSlabSize;
+    }
+    freeSlabIds_.push_back(idx);
+    capacity_ -= kSlabSize;
+  }
+};
+
+// Process-wide thread that runs deferred reclamation jobs (e.g., freeing the
+// subtrees cut off by SearchTreeT::treeAdvance), so that the thread driving
+// the search does not pay for them between moves.
+class BackgroundReclaimer {
+ public:
+  static BackgroundReclaimer& get() {
+    static BackgroundReclaimer reclaimer;
+    return reclaimer;
+  }
+
+  std::future<void> submit(std::function<void()> job) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+    std::future<void> done = task->get_future();
+    q_.push(task);
+    return done;
+  }
+
+  ~BackgroundReclaimer() {
+    // Jobs queued before the sentinel are still run.
+    q_.push(nullptr);
+    thread_.join();
+  }
+
+ private:
+  using Task = std::shared_ptr<std::packaged_task<void()>>;
+
+  elf::concurrency::ConcurrentQueue<Task> q_;
+  std::thread thread_;
+
+  BackgroundReclaimer() {
+    thread_ = std::thread([this]() {
+      while (true) {
+        Task task;
+        q_.pop(&task);
+        if (task == nullptr) {
+          break;
+        }
+        (*task)();
+      }
+    });
+  }
+};
+
+} // namespace tree_search
+} // namespace ai
+} // namespace elf
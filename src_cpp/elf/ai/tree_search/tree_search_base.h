@@ -9,15 +9,23 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <nlohmann/json.hpp>
 
@@ -66,6 +74,13 @@ struct StateTrait {
     // By default it is not provided.
     return false;
   }
+
+  // Key of the state in the transposition table. Return false if the state
+  // should not be shared between nodes.
+  static bool hash(const S&, uint64_t*) {
+    // By default it is not provided.
+    return false;
+  }
 };
 
 template <typename Action>
@@ -170,6 +185,263 @@ struct EdgeInfo {
   }
 };
 
+// How often and how long rollouts block on a leaf that another thread is
+// evaluating.
+struct EvalWaitStats {
+  std::atomic<uint64_t> num_waits{0};
+  std::atomic<uint64_t> total_wait_usec{0};
+  std::atomic<uint64_t> max_wait_usec{0};
+
+  void add(uint64_t usec) {
+    num_waits++;
+    total_wait_usec += usec;
+    uint64_t cur = max_wait_usec.load();
+    while (usec > cur && !max_wait_usec.compare_exchange_weak(cur, usec)) {
+    }
+  }
+
+  void reset() {
+    num_waits = 0;
+    total_wait_usec = 0;
+    max_wait_usec = 0;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    const uint64_t n = num_waits.load();
+    ss << "EvalWait: #wait: " << n << ", total: " << total_wait_usec.load()
+       << "us, avg: " << (n > 0 ? total_wait_usec.load() / n : 0)
+       << "us, max: " << max_wait_usec.load() << "us";
+    return ss.str();
+  }
+};
+
+inline void atomicAdd(std::atomic<float>& target, float delta) {
+  float cur = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(
+      cur, cur + delta, std::memory_order_relaxed)) {
+  }
+}
+
+// Striped mutexes for the locked edge update path (TSOptions::
+// lock_free_backprop = false), kept for comparison with the lock-free one.
+class EdgeLockTable {
+ public:
+  static constexpr size_t kNumStripes = 256;
+
+  static std::mutex& get(const void* key) {
+    static std::mutex stripes[kNumStripes];
+    return stripes[(reinterpret_cast<uintptr_t>(key) >> 3) % kNumStripes];
+  }
+};
+
+// Structure-of-arrays edge storage of a node. It is sized once when the node
+// is expanded and its shape never changes afterwards. Per-edge statistics are
+// atomics, so concurrent rollouts update them without any per-edge mutex.
+template <typename Action>
+class EdgeArrayT {
+ public:
+  EdgeArrayT() {}
+
+  EdgeArrayT(const EdgeArrayT&) = delete;
+  EdgeArrayT& operator=(const EdgeArrayT&) = delete;
+
+  // Not thread-safe. Called once while the owning node is locked.
+  void reset(const std::vector<std::pair<Action, float>>& pi) {
+    size_ = pi.size();
+    actions_.reset(new Action[size_]);
+    priors_.reset(new float[size_]);
+    stats_.reset(new std::atomic<uint64_t>[size_]);
+    virtualLoss_.reset(new std::atomic<float>[size_]);
+    children_.reset(new std::atomic<NodeId>[size_]);
+
+    for (size_t i = 0; i < size_; ++i) {
+      actions_[i] = pi[i].first;
+      priors_[i] = pi[i].second;
+      stats_[i] = pack(0, 0);
+      virtualLoss_[i] = 0;
+      children_[i] = InvalidNodeId;
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Linear scan over the contiguous action ids. Returns -1 if not found.
+  int find(const Action& action) const {
+    for (size_t i = 0; i < size_; ++i) {
+      if (actions_[i] == action) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  const Action& action(size_t i) const {
+    return actions_[i];
+  }
+
+  float prior(size_t i) const {
+    return priors_[i];
+  }
+
+  const float* priors() const {
+    return priors_.get();
+  }
+
+  // Not thread-safe (used for root noise before the search starts).
+  void setPrior(size_t i, float prior) {
+    priors_[i] = prior;
+  }
+
+  float reward(size_t i) const {
+    return unpackReward(stats_[i].load(std::memory_order_relaxed));
+  }
+
+  float virtualLoss(size_t i) const {
+    return virtualLoss_[i].load(std::memory_order_relaxed);
+  }
+
+  int numVisits(size_t i) const {
+    return unpackVisits(stats_[i].load(std::memory_order_relaxed));
+  }
+
+  NodeId child(size_t i) const {
+    NodeId id = children_[i].load(std::memory_order_acquire);
+    return id == PendingNodeId ? InvalidNodeId : id;
+  }
+
+  // Not thread-safe (used to restore a saved tree).
+  void setStats(size_t i, float reward, int num_visits) {
+    stats_[i] = pack(reward, num_visits);
+  }
+
+  // Unlink child i and return it; the edge statistics are kept. Not
+  // thread-safe: only called between searches.
+  NodeId detachChild(size_t i) {
+    return children_[i].exchange(InvalidNodeId, std::memory_order_acq_rel);
+  }
+
+  // Heap memory of the arrays.
+  size_t memoryBytes() const {
+    return size_ *
+        (sizeof(Action) + sizeof(float) + sizeof(std::atomic<uint64_t>) +
+         sizeof(std::atomic<float>) + sizeof(std::atomic<NodeId>));
+  }
+
+  void addVirtualLoss(size_t i, float virtual_loss, bool lock_free = true) {
+    if (lock_free) {
+      atomicAdd(virtualLoss_[i], virtual_loss);
+    } else {
+      std::lock_guard<std::mutex> lock(EdgeLockTable::get(&stats_[i]));
+      virtualLoss_[i].store(
+          virtualLoss_[i].load(std::memory_order_relaxed) + virtual_loss,
+          std::memory_order_relaxed);
+    }
+  }
+
+  // Reward and visit count are packed in one word and updated by a single
+  // CAS, so readers always see a consistent Q.
+  void update(
+      size_t i,
+      float reward,
+      float virtual_loss,
+      bool lock_free = true) {
+    if (lock_free) {
+      uint64_t cur = stats_[i].load(std::memory_order_relaxed);
+      while (!stats_[i].compare_exchange_weak(
+          cur,
+          pack(unpackReward(cur) + reward, unpackVisits(cur) + 1),
+          std::memory_order_relaxed)) {
+      }
+      // Reduce virtual loss.
+      atomicAdd(virtualLoss_[i], -virtual_loss);
+    } else {
+      std::lock_guard<std::mutex> lock(EdgeLockTable::get(&stats_[i]));
+      uint64_t cur = stats_[i].load(std::memory_order_relaxed);
+      stats_[i].store(
+          pack(unpackReward(cur) + reward, unpackVisits(cur) + 1),
+          std::memory_order_relaxed);
+      virtualLoss_[i].store(
+          virtualLoss_[i].load(std::memory_order_relaxed) - virtual_loss,
+          std::memory_order_relaxed);
+    }
+  }
+
+  // Return the child of edge i, creating it with alloc() if there is none.
+  // Exactly one caller runs alloc(); the others wait for its result.
+  template <typename AllocFunc>
+  NodeId getOrCreateChild(size_t i, AllocFunc alloc) {
+    NodeId id = children_[i].load(std::memory_order_acquire);
+    if (id == InvalidNodeId &&
+        children_[i].compare_exchange_strong(id, PendingNodeId)) {
+      id = alloc();
+      children_[i].store(id, std::memory_order_release);
+      return id;
+    }
+    while (id == PendingNodeId) {
+      std::this_thread::yield();
+      id = children_[i].load(std::memory_order_acquire);
+    }
+    return id;
+  }
+
+  // Copy the current statistics into plain arrays of size() floats, as
+  // input of the PUCT kernels (tree_search_alg.h).
+  void snapshot(float* reward, float* num_visits, float* virtual_loss) const {
+    for (size_t i = 0; i < size_; ++i) {
+      const uint64_t stats = stats_[i].load(std::memory_order_relaxed);
+      reward[i] = unpackReward(stats);
+      num_visits[i] = unpackVisits(stats);
+      virtual_loss[i] = virtualLoss_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  // Snapshot of edge i in the AoS form used by results and printing.
+  EdgeInfo get(size_t i) const {
+    EdgeInfo info(priors_[i]);
+    const uint64_t stats = stats_[i].load(std::memory_order_relaxed);
+    info.child_node = child(i);
+    info.reward = unpackReward(stats);
+    info.num_visits = unpackVisits(stats);
+    info.virtual_loss = virtualLoss(i);
+    return info;
+  }
+
+ private:
+  static constexpr NodeId PendingNodeId = -2;
+
+  size_t size_ = 0;
+  std::unique_ptr<Action[]> actions_;
+  std::unique_ptr<float[]> priors_;
+  // High 32 bits: #visits, low 32 bits: accumulated reward (float bits).
+  std::unique_ptr<std::atomic<uint64_t>[]> stats_;
+  std::unique_ptr<std::atomic<float>[]> virtualLoss_;
+  std::unique_ptr<std::atomic<NodeId>[]> children_;
+
+  static uint64_t pack(float reward, int num_visits) {
+    uint32_t r;
+    memcpy(&r, &reward, sizeof(r));
+    return (static_cast<uint64_t>(num_visits) << 32) | r;
+  }
+
+  static float unpackReward(uint64_t stats) {
+    const uint32_t r = static_cast<uint32_t>(stats);
+    float reward;
+    memcpy(&reward, &r, sizeof(reward));
+    return reward;
+  }
+
+  static int unpackVisits(uint64_t stats) {
+    return static_cast<int>(stats >> 32);
+  }
+};
+
 template <typename Action>
 struct MCTSPolicy {
   std::vector<std::pair<Action, float>> policy;
@@ -219,6 +491,9 @@ struct MCTSResultT {
   std::vector<std::pair<Action, EdgeInfo>> action_edge_pairs;
   int total_visits;
   RankCriterion action_rank_method;
+  // Size of the search tree when the result was taken.
+  size_t tree_num_nodes;
+  size_t tree_bytes;
 
   // TODO: Constructor should set action_rank_methhohd and
   //       action_edges ssengupta@fb.com
@@ -227,70 +502,55 @@ struct MCTSResultT {
         max_score(std::numeric_limits<float>::lowest()),
         best_edge_info(0),
         total_visits(0),
-        action_rank_method(MOST_VISITED) {}
+        action_rank_method(MOST_VISITED),
+        tree_num_nodes(0),
+        tree_bytes(0) {}
 
   // TODO: This function should be private and called from the constructor
   //       ssengupta@fb.com
-  void addActions(const std::unordered_map<Action, EdgeInfo>& action_edges) {
+  void addActions(const EdgeArrayT<Action>& edges) {
+    std::vector<std::pair<Action, EdgeInfo>> actions;
+    actions.reserve(edges.size());
+    for (size_t i = 0; i < edges.size(); ++i) {
+      actions.push_back(std::make_pair(edges.action(i), edges.get(i)));
+    }
+    addActions(actions);
+  }
+
+  // Same as above, from root edges merged over several trees.
+  void addActions(const std::vector<std::pair<Action, EdgeInfo>>& actions) {
     static std::mt19937 rng(time(NULL));
     int random_idx = 0;
 
-    assert(action_edges.size() > 0);
+    assert(actions.size() > 0);
 
     if (action_rank_method == UNIFORM_RANDOM) {
-      random_idx = rng() % action_edges.size();
+      random_idx = rng() % actions.size();
     }
 
-    int index = 0;
-    for (const std::pair<Action, EdgeInfo>& action_edge : action_edges) {
-      // float score = 0;
-
+    for (size_t i = 0; i < actions.size(); ++i) {
+      const EdgeInfo& info = actions[i].second;
       float score = (action_rank_method == MOST_VISITED)
-          ? action_edge.second.num_visits
-          : (action_rank_method == PRIOR) ? action_edge.second.prior_probability
-                                          : 1;
-
-#if 0
-      switch (action_rank_method) {
-        case MOST_VISITED:
-          score = action_edge.second.num_visits;
-          break;
-        case PRIOR:
-          score = action_edge.second.prior_probability;
-          break;
-        case UNIFORM_RANDOM:
-          score = 1;
-          break;
-        default:
-          break;
-      }
-#endif
-
-      mcts_policy.addAction(action_edge.first, score);
-      action_edge_pairs.push_back(action_edge);
-      total_visits += action_edge.second.num_visits;
+          ? info.num_visits
+          : (action_rank_method == PRIOR) ? info.prior_probability : 1;
 
       if (action_rank_method == UNIFORM_RANDOM) {
         // Choose random action
-        if (index == random_idx) {
+        if ((int)i == random_idx) {
           max_score = score;
-          best_action = action_edge.first;
-          best_edge_info = action_edge.second;
+          best_action = actions[i].first;
+          best_edge_info = info;
         }
+        mcts_policy.addAction(actions[i].first, score);
+        action_edge_pairs.push_back(actions[i]);
+        total_visits += info.num_visits;
       } else {
         // Choose action with max score
-        if (score > max_score) {
-          max_score = score;
-          best_action = action_edge.first;
-          best_edge_info = action_edge.second;
-        }
+        feed(score, actions[i]);
       }
-
-      index++;
     }
   }
 
-#if 0
   bool feed(float score, const std::pair<Action, EdgeInfo>& action_edge) {
     mcts_policy.addAction(action_edge.first, score);
     action_edge_pairs.push_back(action_edge);
@@ -304,7 +564,6 @@ struct MCTSResultT {
     }
     return false;
   }
-#endif
 
   std::pair<int, EdgeInfo> getRank(const Action& action, RankCriterion rc)
       const {
@@ -350,6 +609,23 @@ struct MCTSResultT {
   }
 };
 
+// The search so far, read from the trees while the search threads run (see
+// TreeSearchT::getSnapshot()).
+template <typename Action>
+struct MCTSSnapshotT {
+  // Since the start of the search.
+  std::chrono::microseconds elapsed{0};
+  // Of all the root moves, in all trees.
+  int total_visits = 0;
+  // Q of the most visited root move (0 until one is visited).
+  float value = 0;
+  // The most visited root moves, most visited first.
+  std::vector<std::pair<Action, EdgeInfo>> moves;
+  // Principal variation of each move: the move, then the most visited path
+  // below it (in the first tree).
+  std::vector<std::vector<Action>> pvs;
+};
+
 } // namespace tree_search
 } // namespace ai
 } // namespace elf
@@ -0,0 +1,269 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace elf {
+namespace ai {
+namespace tree_search {
+
+// Binary form of a search tree (SearchTreeT::save()), to keep a tree across
+// restarts, ship it to other processes, or analyze it offline.
+//
+//   header | node 0 | node 1 | ... | index | footer
+//
+// Nodes are in breadth-first order from the root (node 0), each a
+// TreeNodeRecord followed by its num_edges TreeEdgeRecordT. Children are
+// referred to by their index in this order. The index has the offset of
+// every node, so that a mapped file is read at random without parsing it.
+// States are not saved: a loaded tree gets the state of its root from the
+// search, and those of the other nodes by following their moves from there,
+// as for any node.
+//
+// Native byte order; the records are only for processes of the same build.
+struct TreeFileHeader {
+  char magic[4] = {'E', 'L', 'F', 'T'};
+  uint32_t version = 1;
+  uint32_t action_bytes = 0;
+  uint32_t edge_bytes = 0;
+};
+
+struct TreeFileFooter {
+  uint64_t index_offset = 0;
+  uint64_t num_nodes = 0;
+  char magic[4] = {'E', 'L', 'F', 'T'};
+  uint32_t version = 1;
+};
+
+struct TreeNodeRecord {
+  float value = 0;
+  float unsigned_mean_q = 0;
+  float unsigned_parent_q = 0;
+  int32_t num_visits = 0;
+  uint32_t num_edges = 0;
+  uint8_t visited = 0;
+  uint8_t q_flip = 0;
+  uint8_t reserved[2] = {0, 0};
+};
+
+template <typename Action>
+struct TreeEdgeRecordT {
+  Action action;
+  float prior;
+  float reward;
+  int32_t num_visits;
+  // Index of the child node, -1 if it is not saved.
+  int32_t child;
+};
+
+// Writes the records of a tree as they come, node after node; only their
+// offsets are kept until finish().
+template <typename Action>
+class TreeWriterT {
+  static_assert(
+      std::is_trivially_copyable<Action>::value,
+      "Actions are saved as they are in memory");
+
+ public:
+  using EdgeRecord = TreeEdgeRecordT<Action>;
+
+  explicit TreeWriterT(std::ostream* os) : os_(os) {
+    TreeFileHeader header;
+    header.action_bytes = sizeof(Action);
+    header.edge_bytes = sizeof(EdgeRecord);
+    write(&header, sizeof(header));
+  }
+
+  void addNode(const TreeNodeRecord& node, const std::vector<EdgeRecord>& e) {
+    offsets_.push_back(offset_);
+    TreeNodeRecord r = node;
+    r.num_edges = e.size();
+    write(&r, sizeof(r));
+    write(e.data(), e.size() * sizeof(EdgeRecord));
+  }
+
+  size_t numNodes() const {
+    return offsets_.size();
+  }
+
+  // Writes the index. Return false if the stream failed.
+  bool finish() {
+    TreeFileFooter footer;
+    footer.index_offset = offset_;
+    footer.num_nodes = offsets_.size();
+    write(offsets_.data(), offsets_.size() * sizeof(uint64_t));
+    write(&footer, sizeof(footer));
+    os_->flush();
+    return os_->good();
+  }
+
+ private:
+  std::ostream* os_;
+  uint64_t offset_ = 0;
+  std::vector<uint64_t> offsets_;
+
+  void write(const void* p, size_t n) {
+    os_->write(static_cast<const char*>(p), n);
+    offset_ += n;
+  }
+};
+
+// Random access to the nodes of a saved tree, in memory or mapped from a
+// file. The buffer is not copied.
+template <typename Action>
+class TreeFileT {
+ public:
+  using EdgeRecord = TreeEdgeRecordT<Action>;
+
+  // Check valid() before use.
+  TreeFileT(const char* data, size_t size) : data_(data), size_(size) {
+    valid_ = check();
+  }
+
+  TreeFileT(const TreeFileT&) = delete;
+  TreeFileT& operator=(const TreeFileT&) = delete;
+
+  ~TreeFileT() {
+    if (mapped_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  // The file mapped, nullptr if it cannot be read or is not a tree of
+  // Action.
+  static std::unique_ptr<TreeFileT> open(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+      return nullptr;
+    }
+    std::unique_ptr<TreeFileT> file(
+        new TreeFileT(static_cast<const char*>(p), st.st_size));
+    file->mapped_ = true;
+    if (!file->valid()) {
+      return nullptr;
+    }
+    return file;
+  }
+
+  bool valid() const {
+    return valid_;
+  }
+
+  size_t numNodes() const {
+    return numNodes_;
+  }
+
+  TreeNodeRecord node(size_t i) const {
+    TreeNodeRecord r;
+    memcpy(&r, data_ + nodeOffset(i), sizeof(r));
+    return r;
+  }
+
+  EdgeRecord edge(size_t i, size_t j) const {
+    EdgeRecord e;
+    memcpy(
+        &e,
+        data_ + nodeOffset(i) + sizeof(TreeNodeRecord) + j * sizeof(e),
+        sizeof(e));
+    return e;
+  }
+
+  // The node reached from node `from` by moves, -1 if it is not saved.
+  int64_t find(const std::vector<Action>& moves, size_t from = 0) const {
+    int64_t i = from;
+    for (const Action& a : moves) {
+      const TreeNodeRecord r = node(i);
+      int64_t next = -1;
+      for (size_t j = 0; j < r.num_edges; ++j) {
+        const EdgeRecord e = edge(i, j);
+        if (e.action == a) {
+          next = e.child;
+          break;
+        }
+      }
+      if (next < 0 || next >= (int64_t)numNodes_) {
+        return -1;
+      }
+      i = next;
+    }
+    return i;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+  bool mapped_ = false;
+  bool valid_ = false;
+  size_t numNodes_ = 0;
+  size_t indexOffset_ = 0;
+
+  uint64_t nodeOffset(size_t i) const {
+    uint64_t offset;
+    memcpy(&offset, data_ + indexOffset_ + i * sizeof(offset), sizeof(offset));
+    return offset;
+  }
+
+  bool check() {
+    TreeFileHeader header;
+    TreeFileFooter footer;
+    if (size_ < sizeof(header) + sizeof(footer)) {
+      return false;
+    }
+    const TreeFileHeader expected;
+    memcpy(&header, data_, sizeof(header));
+    memcpy(&footer, data_ + size_ - sizeof(footer), sizeof(footer));
+    if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        memcmp(footer.magic, expected.magic, sizeof(footer.magic)) != 0 ||
+        header.version != expected.version ||
+        header.action_bytes != sizeof(Action) ||
+        header.edge_bytes != sizeof(EdgeRecord) || footer.num_nodes == 0 ||
+        footer.index_offset + footer.num_nodes * sizeof(uint64_t) !=
+            size_ - sizeof(footer)) {
+      return false;
+    }
+    numNodes_ = footer.num_nodes;
+    indexOffset_ = footer.index_offset;
+    for (size_t i = 0; i < numNodes_; ++i) {
+      const uint64_t offset = nodeOffset(i);
+      if (offset + sizeof(TreeNodeRecord) > indexOffset_ ||
+          offset +
+                  sizeof(TreeNodeRecord) +
+                  (uint64_t)node(i).num_edges * sizeof(EdgeRecord) >
+              indexOffset_) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+} // namespace tree_search
+} // namespace ai
+} // namespace elf
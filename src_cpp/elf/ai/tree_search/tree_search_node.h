@@ -8,17 +8,27 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
+#include "elf/concurrency/Counter.h"
+
+#include "tree_search_alg.h"
+#include "tree_search_arena.h"
 #include "tree_search_base.h"
+#include "tree_search_io.h"
 #include "tree_search_options.h"
 
 namespace elf {
@@ -28,12 +38,101 @@ namespace tree_search {
 template <typename State, typename Action>
 class SearchTreeT;
 
+// Threads that pick a leaf which is being evaluated by another thread park
+// here until the evaluation is set. Futex words are striped by node address
+// so that nodes do not each carry one; a search running in a fiber parks the
+// fiber (see futexWait()).
+class EvaluationWaitTable {
+ public:
+  static constexpr size_t kNumStripes = 64;
+
+  static EvaluationWaitTable& get() {
+    static EvaluationWaitTable table;
+    return table;
+  }
+
+  template <typename Pred>
+  void wait(const void* key, Pred ready) {
+    waitUntil(key, ready, nullptr);
+  }
+
+  template <typename Pred, typename Rep, typename Period>
+  bool waitFor(
+      const void* key,
+      Pred ready,
+      std::chrono::duration<Rep, Period> timeout) {
+    const auto end = std::chrono::steady_clock::now() + timeout;
+    return waitUntil(key, ready, &end);
+  }
+
+  // Must be called after the condition has been made true.
+  void notify(const void* key) {
+    Stripe& s = stripe(key);
+    if (s.numWaiters.load() == 0) {
+      return;
+    }
+    s.epoch.fetch_add(1);
+    elf::concurrency::futexWake(&s.epoch);
+  }
+
+ private:
+  struct Stripe {
+    std::atomic<int32_t> epoch{0};
+    std::atomic<int> numWaiters{0};
+  };
+
+  Stripe stripes_[kNumStripes];
+
+  Stripe& stripe(const void* key) {
+    return stripes_[(reinterpret_cast<uintptr_t>(key) >> 6) % kNumStripes];
+  }
+
+  // All seq_cst, as in AtomicCounter: either notify() sees the waiter, or
+  // the waiter sees the condition after registering.
+  template <typename Pred>
+  bool waitUntil(
+      const void* key,
+      Pred& ready,
+      const std::chrono::steady_clock::time_point* end) {
+    Stripe& s = stripe(key);
+    s.numWaiters++;
+    bool res = false;
+    while (true) {
+      const int32_t epoch = s.epoch.load();
+      if (ready()) {
+        res = true;
+        break;
+      }
+      if (end == nullptr) {
+        elf::concurrency::futexWait(&s.epoch, epoch, nullptr);
+      } else {
+        const std::chrono::nanoseconds left =
+            *end - std::chrono::steady_clock::now();
+        if (left.count() <= 0) {
+          break;
+        }
+        elf::concurrency::futexWait(&s.epoch, epoch, &left);
+      }
+    }
+    s.numWaiters--;
+    return res;
+  }
+};
+
 template <typename State>
 class NodeBaseT {
  public:
   enum StateType { NODE_STATE_NULL = 0, NODE_STATE_INVALID, NODE_STATE_SET };
 
-  NodeBaseT() : stateType_(NODE_STATE_NULL) {}
+  // bytes: the account of the tree of the node, if any.
+  explicit NodeBaseT(TreeNodeBytes* bytes = nullptr)
+      : bytes_(bytes), stateType_(NODE_STATE_NULL) {}
+
+  ~NodeBaseT() {
+    if (state_ != nullptr) {
+      charge(-static_cast<int64_t>(sizeof(State)));
+    }
+  }
 
   const State* getStatePtr() const {
     return state_.get();
@@ -71,6 +170,7 @@ class NodeBaseT {
       return false;
     } else {
       stateType_ = NODE_STATE_SET;
+      charge(sizeof(State));
       return true;
     }
   }
@@ -78,8 +178,17 @@ class NodeBaseT {
  protected:
   std::mutex lockState_;
   std::unique_ptr<State> state_;
+  TreeNodeBytes* bytes_;
   // TODO Poor choice of variable name - think later (ssengupta@fb)
   StateType stateType_;
+
+  void charge(int64_t bytes) {
+    if (bytes_ != nullptr) {
+      bytes_->add(bytes);
+    } else {
+      treeMemory().add(bytes);
+    }
+  }
 };
 
 // Tree node.
@@ -95,16 +204,37 @@ class NodeT : public NodeBaseT<State> {
     NODE_ALREADY_VISITED
   };
 
-  NodeT(float unsigned_parent_q)
-      : visited_(false), numVisits_(0), unsignedParentQ_(unsigned_parent_q) {
+  NodeT(float unsigned_parent_q, TreeNodeBytes* bytes = nullptr)
+      : NodeBaseT<State>(bytes),
+        numVisits_(0),
+        unsignedParentQ_(unsigned_parent_q),
+        visited_(false) {
     unsignedMeanQ_ = unsignedParentQ_;
   }
 
   NodeT(const Node&) = delete;
   Node& operator=(const Node&) = delete;
 
-  const std::unordered_map<Action, EdgeInfo>& getStateActions() const {
-    return stateActions_;
+  ~NodeT() {
+    if (!edges_.empty()) {
+      this->charge(-static_cast<int64_t>(edges_.memoryBytes()));
+    }
+  }
+
+  using EdgeArray = EdgeArrayT<Action>;
+
+  const EdgeArray& getEdges() const {
+    return edges_;
+  }
+
+  // Snapshot of all edges, in expansion order.
+  std::vector<std::pair<Action, EdgeInfo>> getStateActions() const {
+    std::vector<std::pair<Action, EdgeInfo>> res;
+    res.reserve(edges_.size());
+    for (size_t i = 0; i < edges_.size(); ++i) {
+      res.push_back(std::make_pair(edges_.action(i), edges_.get(i)));
+    }
+    return res;
   }
 
   int getNumVisits() const {
@@ -133,18 +263,16 @@ class NodeT : public NodeBaseT<State> {
     std::gamma_distribution<> dis(alpha);
 
     // Draw distribution.
-    std::vector<float> etas(stateActions_.size());
+    std::vector<float> etas(edges_.size());
     float Z = 1e-10;
-    for (size_t i = 0; i < stateActions_.size(); ++i) {
+    for (size_t i = 0; i < edges_.size(); ++i) {
       etas[i] = dis(*rng);
       Z += etas[i];
     }
 
-    int i = 0;
-    for (auto& p : stateActions_) {
-      p.second.prior_probability =
-          (1 - epsilon) * p.second.prior_probability + epsilon * etas[i] / Z;
-      i++;
+    for (size_t i = 0; i < edges_.size(); ++i) {
+      edges_.setPrior(
+          i, (1 - epsilon) * edges_.prior(i) + epsilon * etas[i] / Z);
     }
   }
 
@@ -154,26 +282,43 @@ class NodeT : public NodeBaseT<State> {
     return lockNode_.try_lock();
   }
 
-  void waitForEvaluation() {
-    // Simple busy wait here.
-    while (!visited_) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  void waitForEvaluation(EvalWaitStats* stats = nullptr) {
+    if (visited_) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    EvaluationWaitTable::get().wait(this, [this]() { return visited_.load(); });
+    if (stats != nullptr) {
+      stats->add(std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count());
+    }
+  }
+
+  // Same as above, but gives up after timeout. Return true if visited.
+  template <typename Rep, typename Period>
+  bool waitForEvaluation(
+      EvalWaitStats* stats,
+      std::chrono::duration<Rep, Period> timeout) {
+    if (visited_) {
+      return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool visited = EvaluationWaitTable::get().waitFor(
+        this, [this]() { return visited_.load(); }, timeout);
+    if (stats != nullptr && visited) {
+      stats->add(std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count());
     }
+    return visited;
   }
 
   bool setNodeEvaluationAndUnlock(const NodeResponseT<Action>& resp) {
     if (visited_)
       return false;
-    // Then we need to allocate sa_val_
-    for (const std::pair<Action, float>& action_pair : resp.pi) {
-      stateActions_.insert(
-          std::make_pair(action_pair.first, EdgeInfo(action_pair.second)));
-      lockStateActions_[action_pair.first].reset(new std::mutex());
-
-      // Compute v here.
-      // Node *child = alloc[res.first->second.next];
-      // child->V_ = V_ + log(action_pair.second + 1e-6);
-    }
+    edges_.reset(resp.pi);
+    this->charge(edges_.memoryBytes());
 
     // value
     V_ = resp.value;
@@ -182,6 +327,7 @@ class NodeT : public NodeBaseT<State> {
     // Once sa_ is allocated, its structure won't change.
     visited_ = true;
     lockNode_.unlock();
+    EvaluationWaitTable::get().notify(this);
     return true;
   }
 
@@ -200,17 +346,8 @@ class NodeT : public NodeBaseT<State> {
 
     NodeResponseT<Action> resp;
     func(this, &resp);
-
-    // Then we need to allocate sa_val_
-    for (const std::pair<Action, float>& action_pair : resp.pi) {
-      stateActions_.insert(
-          std::make_pair(action_pair.first, EdgeInfo(action_pair.second)));
-      lockStateActions_[action_pair.first].reset(new std::mutex());
-
-      // Compute v here.
-      // Node *child = alloc[res.first->second.next];
-      // child->V_ = V_ + log(action_pair.second + 1e-6);
-    }
+    edges_.reset(resp.pi);
+    this->charge(edges_.memoryBytes());
 
     // value
     V_ = resp.value;
@@ -218,6 +355,7 @@ class NodeT : public NodeBaseT<State> {
 
     // Once sa_ is allocated, its structure won't change.
     visited_ = true;
+    EvaluationWaitTable::get().notify(this);
     return NODE_JUST_VISITED;
   }
 
@@ -227,9 +365,24 @@ class NodeT : public NodeBaseT<State> {
       // const NodeDynInfo& node_info,
       Action* action,
       std::ostream* oo = nullptr) {
+    int i;
+    if (!findEdge(alg_opt, node_depth, &i, oo)) {
+      return false;
+    }
+    *action = edges_.action(i);
+    return true;
+  }
+
+  // As findMove(), but returns the index of the edge of the move, for the
+  // edge methods below that take it rather than the action.
+  bool findEdge(
+      const SearchAlgoOptions& alg_opt,
+      int node_depth,
+      int* edge,
+      std::ostream* oo = nullptr) {
     std::lock_guard<std::mutex> lock(lockNode_);
 
-    if (stateActions_.empty()) {
+    if (edges_.empty()) {
       return false;
     }
 
@@ -239,73 +392,135 @@ class NodeT : public NodeBaseT<State> {
     }
 
     BestAction best_action = UCT(alg_opt, oo);
-    *action = best_action.action_with_max_score;
+    if (best_action.edge_with_max_score < 0) {
+      return false;
+    }
+    *edge = best_action.edge_with_max_score;
     unsignedMeanQ_ = (unsignedParentQ_ + best_action.total_unsigned_q) /
         (best_action.total_visits + 1);
 
     return true;
   }
 
-  bool addVirtualLoss(const Action& action, float virtual_loss) {
-    auto it = stateActions_.find(action);
-
-    if (it == stateActions_.end()) {
+  bool addVirtualLoss(
+      const Action& action,
+      float virtual_loss,
+      bool lock_free = true) {
+    int i = edges_.find(action);
+    if (i < 0) {
       return false;
     }
+    addEdgeVirtualLoss(i, virtual_loss, lock_free);
+    return true;
+  }
 
-    EdgeInfo& info = it->second;
+  void addEdgeVirtualLoss(size_t i, float virtual_loss, bool lock_free = true) {
+    edges_.addVirtualLoss(i, virtual_loss, lock_free);
+  }
 
-    auto lock_it = lockStateActions_.find(action);
-    assert(lock_it != lockStateActions_.end());
-    std::lock_guard<std::mutex> lock(*(lock_it->second.get()));
+  // The virtual loss on the edge of action, 0 if there is none.
+  float getVirtualLoss(const Action& action) const {
+    int i = edges_.find(action);
+    return i < 0 ? 0 : getEdgeVirtualLoss(i);
+  }
 
-    info.virtual_loss += virtual_loss;
-    return true;
+  float getEdgeVirtualLoss(size_t i) const {
+    return edges_.virtualLoss(i);
   }
 
-  bool updateEdgeStats(const Action& action, float reward, float virtual_loss) {
-    auto it = stateActions_.find(action);
-    if (it == stateActions_.end()) {
+  bool updateEdgeStats(
+      const Action& action,
+      float reward,
+      float virtual_loss,
+      bool lock_free = true) {
+    int i = edges_.find(action);
+    if (i < 0) {
       return false;
     }
+    updateEdge(i, reward, virtual_loss, lock_free);
+    return true;
+  }
 
-    EdgeInfo& edge = it->second;
-
+  void updateEdge(
+      size_t i,
+      float reward,
+      float virtual_loss,
+      bool lock_free = true) {
     numVisits_++;
+    edges_.update(i, reward, virtual_loss, lock_free);
+  }
 
-    // Async modification (we probably need to add a locker in the future, or
-    // not for speed).
+  // InvalidNodeId if the edge has not been followed yet.
+  NodeId getChild(const Action& action) const {
+    int i = edges_.find(action);
+    return i < 0 ? InvalidNodeId : getEdgeChild(i);
+  }
 
-    auto lock_it = lockStateActions_.find(action);
-    assert(lock_it != lockStateActions_.end());
-    std::lock_guard<std::mutex> lock(*(lock_it->second.get()));
+  NodeId getEdgeChild(size_t i) const {
+    return edges_.child(i);
+  }
 
-    edge.reward += reward;
-    edge.num_visits++;
-    // Reduce virtual loss.
-    edge.virtual_loss -= virtual_loss;
-    return true;
+  NodeId detachChild(size_t i) {
+    return edges_.detachChild(i);
   }
 
-  NodeId followEdge(const Action& action, SearchTree& tree) {
-    auto it = stateActions_.find(action);
-    if (it == stateActions_.end()) {
-      return InvalidNodeId;
+  // The node as saved by SearchTreeT::save(), but for its edges.
+  TreeNodeRecord record() const {
+    TreeNodeRecord r;
+    r.value = V_;
+    r.unsigned_mean_q = unsignedMeanQ_;
+    r.unsigned_parent_q = unsignedParentQ_;
+    r.num_visits = numVisits_;
+    r.visited = visited_;
+    r.q_flip = flipQSign_;
+    return r;
+  }
+
+  // Restores a saved node, created with the same unsigned parent Q; its
+  // children are linked with linkChild(). Not thread-safe: only called
+  // between searches.
+  void restore(
+      const TreeNodeRecord& r,
+      const std::vector<TreeEdgeRecordT<Action>>& edges) {
+    numVisits_ = r.num_visits;
+    unsignedMeanQ_ = r.unsigned_mean_q;
+    if (!r.visited) {
+      return;
+    }
+    std::vector<std::pair<Action, float>> pi;
+    pi.reserve(edges.size());
+    for (const auto& e : edges) {
+      pi.emplace_back(e.action, e.prior);
     }
+    edges_.reset(pi);
+    this->charge(edges_.memoryBytes());
+    for (size_t i = 0; i < edges.size(); ++i) {
+      edges_.setStats(i, edges[i].reward, edges[i].num_visits);
+    }
+    V_ = r.value;
+    flipQSign_ = r.q_flip;
+    visited_ = true;
+  }
 
-    EdgeInfo& edge = it->second;
+  void linkChild(size_t i, NodeId child) {
+    edges_.getOrCreateChild(i, [child]() { return child; });
+  }
 
-    if (edge.child_node == InvalidNodeId) {
-      auto lock_it = lockStateActions_.find(action);
-      assert(lock_it != lockStateActions_.end());
-      std::lock_guard<std::mutex> lock(*(lock_it->second.get()));
+  // Heap memory owned by the node (state and edges), not counting the node
+  // itself.
+  size_t memoryBytes() const {
+    return (this->state_ != nullptr ? sizeof(State) : 0) +
+        edges_.memoryBytes();
+  }
 
-      // Need to check twice.
-      if (edge.child_node == InvalidNodeId) {
-        edge.child_node = tree.addNode(unsignedMeanQ_);
-      }
-    }
-    return edge.child_node;
+  NodeId followEdge(const Action& action, SearchTree& tree) {
+    int i = edges_.find(action);
+    return i < 0 ? InvalidNodeId : followEdgeAt(i, tree);
+  }
+
+  NodeId followEdgeAt(size_t i, SearchTree& tree) {
+    return edges_.getOrCreateChild(
+        i, [&]() { return tree.addNode(unsignedMeanQ_); });
   }
 
  private:
@@ -313,9 +528,7 @@ class NodeT : public NodeBaseT<State> {
   friend class NodeTest;
 
   std::mutex lockNode_;
-  std::atomic<bool> visited_;
-  std::unordered_map<Action, EdgeInfo> stateActions_;
-  std::unordered_map<Action, std::unique_ptr<std::mutex>> lockStateActions_;
+  EdgeArray edges_;
 
   std::atomic<int> numVisits_;
   float V_ = 0.0;
@@ -323,21 +536,27 @@ class NodeT : public NodeBaseT<State> {
 
   // TODO Poor choice of variable name - fix later (ssengupta@fb)
   const float unsignedParentQ_;
+  // Last, with flipQSign_, to fill the padding of the node.
+  std::atomic<bool> visited_;
   bool flipQSign_ = false;
 
   struct BestAction {
     Action action_with_max_score;
+    // -1 if there is no edge.
+    int edge_with_max_score;
     float max_score;
     float total_unsigned_q;
     int total_visits;
 
     BestAction()
         : action_with_max_score(ActionTrait<Action>::default_value()),
+          edge_with_max_score(-1),
           max_score(std::numeric_limits<float>::lowest()),
           total_unsigned_q(0),
           total_visits(0) {}
 
     void addAction(
+        int edge,
         const Action& action,
         float score,
         float unsigned_q,
@@ -345,6 +564,7 @@ class NodeT : public NodeBaseT<State> {
       if (score > max_score) {
         max_score = score;
         action_with_max_score = action;
+        edge_with_max_score = edge;
       }
 
       if (!first_visit) {
@@ -374,13 +594,18 @@ class NodeT : public NodeBaseT<State> {
           << ", parent_cnt: " << (numVisits_.load() + 1) << std::endl;
     }
 
-    for (const auto& action_pair : stateActions_) {
-      const Action& action = action_pair.first;
-      const EdgeInfo& edge = action_pair.second;
+    // num_visits_ + 1 is sum of all visits to all other actions from
+    // this node
+    const int all_visits = numVisits_.load() + 1;
+
+    if (oo == nullptr) {
+      return vectorizedUCT(alg_opt, all_visits);
+    }
+
+    for (size_t i = 0; i < edges_.size(); ++i) {
+      const Action& action = edges_.action(i);
+      const EdgeInfo edge = edges_.get(i);
 
-      // num_visits_ + 1 is sum of all visits to all other actions from
-      // this node
-      const int all_visits = numVisits_.load() + 1;
       auto prior_score = edge.getScore(flipQSign_, all_visits, unsignedMeanQ_);
 
       float score = alg_opt.use_prior
@@ -388,7 +613,7 @@ class NodeT : public NodeBaseT<State> {
           : prior_score.q;
 
       best_action.addAction(
-          action, score, prior_score.unsigned_q, prior_score.first_visit);
+          i, action, score, prior_score.unsigned_q, prior_score.first_visit);
 
       if (oo) {
         *oo << "UCT [a=" << ActionTrait<Action>::to_string(action)
@@ -402,6 +627,36 @@ class NodeT : public NodeBaseT<State> {
     }
     return best_action;
   };
+
+  BestAction vectorizedUCT(const SearchAlgoOptions& alg_opt, int all_visits)
+      const {
+    const size_t n = edges_.size();
+    static thread_local std::vector<float> scratch;
+    scratch.resize(3 * n);
+    float* reward = scratch.data();
+    float* num_visits = reward + n;
+    float* virtual_loss = num_visits + n;
+    edges_.snapshot(reward, num_visits, virtual_loss);
+
+    PUCTParams params;
+    params.c_puct = alg_opt.c_puct;
+    params.use_prior = alg_opt.use_prior;
+    params.flip_q_sign = flipQSign_;
+    params.sqrt_parent_visits = std::sqrt(static_cast<float>(all_visits));
+    params.unsigned_default_q = unsignedMeanQ_;
+    const PUCTResult res = PUCTSelect(
+        edges_.priors(), reward, num_visits, virtual_loss, n, params);
+
+    BestAction best_action;
+    if (res.best >= 0) {
+      best_action.action_with_max_score = edges_.action(res.best);
+      best_action.edge_with_max_score = res.best;
+      best_action.max_score = res.max_score;
+    }
+    best_action.total_unsigned_q = res.total_unsigned_q;
+    best_action.total_visits = res.total_visits;
+    return best_action;
+  }
 };
 
 template <typename State, typename Action>
@@ -410,16 +665,20 @@ class SearchTreeT {
   using Node = NodeT<State, Action>;
   using SearchTree = SearchTreeT<State, Action>;
 
-  SearchTreeT() {
-    clear();
+  SearchTreeT() : rootId_(InvalidNodeId) {
+    allocateRoot();
   }
 
   SearchTreeT(const SearchTree&) = delete;
   SearchTree& operator=(const SearchTree&) = delete;
 
+  ~SearchTreeT() {
+    waitForReclaim();
+  }
+
+  // The old tree is freed in the background; the new root is usable at once.
   void clear() {
-    allocatedNodes_.clear();
-    allocatedNodeCount_ = 0;
+    deferFree(InvalidNodeId, {rootId_});
     rootId_ = InvalidNodeId;
     allocateRoot();
   }
@@ -428,20 +687,29 @@ class SearchTreeT {
     NodeId next_root = InvalidNodeId;
     Node* r = getRootNode();
 
-    for (const auto& p : r->getStateActions()) {
-      if (p.first == action) {
-        next_root = p.second.child_node;
-      } else {
-        recursiveFree(p.second.child_node);
+    std::vector<NodeId> siblings;
+    const auto& edges = r->getEdges();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      if (edges.action(i) == action) {
+        next_root = edges.child(i);
+      } else if (edges.child(i) != InvalidNodeId) {
+        siblings.push_back(edges.child(i));
       }
     }
 
-    // Free root.
-    freeNode(rootId_);
+    deferFree(rootId_, std::move(siblings));
     rootId_ = next_root;
     allocateRoot();
   }
 
+  // Block until the subtrees handed to the background reclaimer are freed.
+  void waitForReclaim() {
+    for (auto& f : pendingFrees_) {
+      f.wait();
+    }
+    pendingFrees_.clear();
+  }
+
   Node* getRootNode() {
     return (*this)[rootId_];
   }
@@ -452,13 +720,11 @@ class SearchTreeT {
 
   // Low level functions.
   NodeId addNode(float unsigned_parent_q) {
-    std::lock_guard<std::mutex> lock(allocMutex_);
-    allocatedNodes_[allocatedNodeCount_].reset(new Node(unsigned_parent_q));
-    return allocatedNodeCount_++;
+    return arena_.allocate(unsigned_parent_q, &nodeBytes_);
   }
 
   void freeNode(NodeId id) {
-    allocatedNodes_.erase(id);
+    arena_.free(id);
   }
 
   void recursiveFree(NodeId id) {
@@ -466,23 +732,127 @@ class SearchTreeT {
       return;
     }
     Node* root = (*this)[id];
-    for (const auto& p : root->getStateActions()) {
-      p.second.checkValid();
-      recursiveFree(p.second.child_node);
+    const auto& edges = root->getEdges();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      edges.get(i).checkValid();
+      recursiveFree(edges.child(i));
     }
     freeNode(id);
   }
 
   Node* operator[](NodeId i) {
-    std::lock_guard<std::mutex> lock(allocMutex_);
     return getNode(i);
   }
 
   const Node* operator[](NodeId i) const {
-    std::lock_guard<std::mutex> lock(allocMutex_);
     return getNode(i);
   }
 
+  size_t size() const {
+    return arena_.size();
+  }
+
+  // Upper bound of size() that is cheap to read during a search.
+  size_t capacity() const {
+    return arena_.capacity();
+  }
+
+  // Node slabs plus the states and edges of the nodes, including those
+  // still to be freed in the background. Cheap to read at any time.
+  size_t memoryBytes() const {
+    return arena_.bytes() + nodeBytes_.bytes();
+  }
+
+  // As memoryBytes(), but walks the nodes reachable from the root: O(tree),
+  // for checks and debugging. Only called when no search is performed.
+  size_t reachableMemoryBytes() const {
+    return arena_.bytes() + memoryBytes(getRootNode());
+  }
+
+  // Free the subtrees behind the least visited edges until at most
+  // max_num_nodes nodes remain. Edge statistics are kept, so a pruned child
+  // is simply expanded again if a later search goes back there. Only called
+  // when no search is performed. Return the number of nodes freed.
+  size_t prune(size_t max_num_nodes) {
+    waitForReclaim();
+    arena_.recycle();
+    const size_t initial_size = size();
+    const Node* root = getRootNode();
+    if (root == nullptr) {
+      return 0;
+    }
+
+    for (int min_visits = 2; size() > max_num_nodes; min_visits *= 2) {
+      std::vector<NodeId> pruned;
+      detachLowVisits(rootId_, min_visits, &pruned);
+      for (NodeId id : pruned) {
+        recursiveFree(id);
+      }
+      arena_.recycle();
+      if (min_visits > root->getNumVisits()) {
+        // Only the root is left.
+        break;
+      }
+    }
+    return initial_size - size();
+  }
+
+  // Writes the tree from the root (see tree_search_io.h). The subtrees
+  // behind edges of fewer than min_visits visits are left out, their edges
+  // are kept. Only called when no search is performed. Return false if the
+  // stream failed.
+  bool save(std::ostream* os, int min_visits = 0) const {
+    using EdgeRecord = TreeEdgeRecordT<Action>;
+    TreeWriterT<Action> writer(os);
+    std::deque<NodeId> queue = {rootId_};
+    int32_t next = 1;
+    std::vector<EdgeRecord> records;
+    while (!queue.empty()) {
+      const Node* node = getNode(queue.front());
+      queue.pop_front();
+      const auto& edges = node->getEdges();
+      records.resize(edges.size());
+      // The padding too, so that the same tree is saved the same.
+      memset(records.data(), 0, records.size() * sizeof(EdgeRecord));
+      for (size_t i = 0; i < edges.size(); ++i) {
+        EdgeRecord& e = records[i];
+        e.action = edges.action(i);
+        e.prior = edges.prior(i);
+        e.reward = edges.reward(i);
+        e.num_visits = edges.numVisits(i);
+        e.child = -1;
+        if (getNode(edges.child(i)) != nullptr &&
+            e.num_visits >= min_visits) {
+          e.child = next++;
+          queue.push_back(edges.child(i));
+        }
+      }
+      writer.addNode(node->record(), records);
+    }
+    return writer.finish();
+  }
+
+  // Replaces the tree by the subtree of file at node, e.g. found with
+  // TreeFileT::find(). As after clear(), the next search sets the state of
+  // the root, that of the node. Only called when no search is performed.
+  // Return false if file has no such node.
+  bool load(const TreeFileT<Action>& file, size_t node = 0) {
+    if (!file.valid() || node >= file.numNodes()) {
+      return false;
+    }
+    deferFree(InvalidNodeId, {rootId_});
+    rootId_ = restore(file, node);
+    return true;
+  }
+
+  // Free the slabs kept for reuse (see NodeArenaT::trimPool()). Only called
+  // when no search is performed.
+  void trimPool() {
+    waitForReclaim();
+    arena_.recycle();
+    arena_.trimPool();
+  }
+
   std::string printTree() const {
     // [TODO]: Only called when no search is performed!
     return printTree(0, getRootNode());
@@ -535,28 +905,91 @@ class SearchTreeT {
   }
 
  private:
-  // TODO: We might just allocate one chunk at a time.
-  std::unordered_map<NodeId, std::unique_ptr<Node>> allocatedNodes_;
-  NodeId allocatedNodeCount_;
+  // Outlives the nodes of arena_, which it accounts.
+  TreeNodeBytes nodeBytes_;
+  NodeArenaT<Node> arena_;
   NodeId rootId_;
-  mutable std::mutex allocMutex_;
+  std::vector<std::future<void>> pendingFrees_;
 
   const Node* getNode(NodeId i) const {
-    auto it = allocatedNodes_.find(i);
-    if (it == allocatedNodes_.end()) {
-      return nullptr;
-    } else {
-      return it->second.get();
-    }
+    return arena_.get(i);
   }
 
   Node* getNode(NodeId i) {
-    auto it = allocatedNodes_.find(i);
-    if (it == allocatedNodes_.end()) {
-      return nullptr;
-    } else {
-      return it->second.get();
+    return arena_.get(i);
+  }
+
+  // Free node `id` (but not its children) and the subtrees rooted at
+  // `subtrees` on the background reclaimer. No search may reach them any
+  // more. Slabs emptied by earlier jobs are recycled here, so memory is
+  // reused one move later.
+  void deferFree(NodeId id, std::vector<NodeId> subtrees) {
+    pendingFrees_.erase(
+        std::remove_if(
+            pendingFrees_.begin(),
+            pendingFrees_.end(),
+            [](const std::future<void>& f) {
+              return f.wait_for(std::chrono::seconds(0)) ==
+                  std::future_status::ready;
+            }),
+        pendingFrees_.end());
+    arena_.recycle();
+    pendingFrees_.push_back(BackgroundReclaimer::get().submit(
+        [this, id, subtrees = std::move(subtrees)]() {
+          for (NodeId child : subtrees) {
+            recursiveFree(child);
+          }
+          freeNode(id);
+        }));
+  }
+
+  size_t memoryBytes(const Node* node) const {
+    if (node == nullptr) {
+      return 0;
+    }
+    size_t n = node->memoryBytes();
+    const auto& edges = node->getEdges();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      n += memoryBytes(getNode(edges.child(i)));
+    }
+    return n;
+  }
+
+  void detachLowVisits(NodeId id, int min_visits, std::vector<NodeId>* res) {
+    Node* node = getNode(id);
+    const auto& edges = node->getEdges();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      if (edges.child(i) == InvalidNodeId) {
+        continue;
+      }
+      if (edges.numVisits(i) < min_visits) {
+        res->push_back(node->detachChild(i));
+      } else {
+        detachLowVisits(edges.child(i), min_visits, res);
+      }
+    }
+  }
+
+  NodeId restore(const TreeFileT<Action>& file, size_t i) {
+    const TreeNodeRecord r = file.node(i);
+    std::vector<TreeEdgeRecordT<Action>> edges(r.num_edges);
+    for (size_t j = 0; j < edges.size(); ++j) {
+      edges[j] = file.edge(i, j);
+    }
+    const NodeId id = addNode(r.unsigned_parent_q);
+    Node* node = getNode(id);
+    node->restore(r, edges);
+    if (!r.visited) {
+      return id;
+    }
+    for (size_t j = 0; j < edges.size(); ++j) {
+      // Children come after their parent: anything else is not a saved tree.
+      const int64_t child = edges[j].child;
+      if (child > (int64_t)i && child < (int64_t)file.numNodes()) {
+        node->linkChild(j, restore(file, child));
+      }
     }
+    return id;
   }
 
   bool allocateRoot() {
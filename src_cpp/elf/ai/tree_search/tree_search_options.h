@@ -14,6 +14,7 @@
 #include "tree_search_base.h"
 
 #include "elf/legacy/pybind_helper.h"
+#include "elf/utils/binary_utils.h"
 #include "elf/utils/json_utils.h"
 
 namespace elf {
@@ -53,6 +54,22 @@ struct SearchAlgoOptions {
     return opt;
   }
 
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, use_prior);
+    BIN_SAVE(w, c_puct);
+    BIN_SAVE(w, unexplored_q_zero);
+    BIN_SAVE(w, root_unexplored_q_zero);
+  }
+
+  static SearchAlgoOptions createFromBinary(elf_utils::BinaryReader& r) {
+    SearchAlgoOptions opt;
+    BIN_LOAD(opt, r, use_prior);
+    BIN_LOAD(opt, r, c_puct);
+    BIN_LOAD(opt, r, unexplored_q_zero);
+    BIN_LOAD(opt, r, root_unexplored_q_zero);
+    return opt;
+  }
+
   friend bool operator==(
       const SearchAlgoOptions& t1,
       const SearchAlgoOptions& t2) {
@@ -79,6 +96,14 @@ struct TSOptions {
   int num_threads = 16;
   int num_rollouts_per_thread = 100;
   int num_rollouts_per_batch = 8;
+  // Threads sharing one search tree. 0 (or >= num_threads): all threads
+  // share a single tree (tree parallel); 1: each thread searches a private
+  // tree (root parallel); otherwise groups of that many threads share a tree
+  // (hybrid). Trees are merged at the root when picking the move.
+  int num_threads_per_tree = 0;
+  // #batches each search thread keeps in flight (1 = no pipelining).
+  // Requires an actor with evaluateAsync().
+  int num_pipelined_batches = 1;
   bool verbose = false;
   bool verbose_time = false;
   int seed = 0;
@@ -94,6 +119,38 @@ struct TSOptions {
 
   // Pre-added pseudo playout.
   int virtual_loss = 0;
+  // A rollout through an edge adds virtual_loss plus virtual_loss_growth
+  // times the virtual loss already there (rounded), so that the loss grows
+  // with the rollouts in flight on the edge and those of a large batch
+  // spread out (0 = constant).
+  float virtual_loss_growth = 0.0;
+  // Rollouts a batch selects again in place of those ending at a leaf that
+  // is already being evaluated, by another thread or the same batch.
+  int max_collision_retries = 0;
+
+  // Update edge statistics with atomics (true) or under striped mutexes.
+  bool lock_free_backprop = true;
+
+  // #entries of the transposition table shared by all search threads. Leaves
+  // whose state hash is in the table reuse the cached evaluation instead of
+  // being sent to the actor (0 = disabled).
+  int transposition_table_size = 0;
+
+  // Wall-clock budget of one search in milliseconds (0 = none). With a
+  // budget, num_rollouts_per_thread <= 0 means no rollout cap.
+  int time_budget_ms = 0;
+  // Stop once the most visited root move cannot be overtaken within the
+  // remaining rollout/time budget (pick_method "most_visited" only).
+  bool early_stop = false;
+  // Rollouts per thread searched from the position after our move while the
+  // opponent thinks (0 = no pondering). Requires persistent_tree.
+  int ponder_rollouts_per_thread = 0;
+
+  // Node budget of the search tree (0 = unbounded). A full tree stops
+  // expanding and keeps refining its nodes; a tree above 3/4 of the budget
+  // at the start of a search is pruned to half of it, least visited
+  // subtrees first.
+  int max_num_nodes = 0;
 
   std::string info(bool verbose = false) const {
     std::stringstream ss;
@@ -104,13 +161,28 @@ struct TSOptions {
       ss << "Seed: " << seed << std::endl;
       ss << "#Threads: " << num_threads << std::endl;
       ss << "#Rollout per thread: " << num_rollouts_per_thread
-         << ", #rollouts per batch: " << num_rollouts_per_batch << std::endl;
+         << ", #rollouts per batch: " << num_rollouts_per_batch
+         << ", #pipelined batches: " << num_pipelined_batches << std::endl;
+      ss << "#Threads per tree (0 = all): " << num_threads_per_tree
+         << std::endl;
       ss << "Verbose: " << elf_utils::print_bool(verbose)
          << ", Verbose_time: " << elf_utils::print_bool(verbose_time)
          << std::endl;
       ss << "Persistent tree: " << elf_utils::print_bool(persistent_tree)
          << std::endl;
-      ss << "#Virtual loss: " << virtual_loss << std::endl;
+      ss << "#Virtual loss: " << virtual_loss
+         << ", growth: " << virtual_loss_growth
+         << ", #collision retries: " << max_collision_retries << std::endl;
+      ss << "Lock-free backprop: " << elf_utils::print_bool(lock_free_backprop)
+         << std::endl;
+      ss << "Transposition table size: " << transposition_table_size
+         << std::endl;
+      ss << "Time budget (ms, 0 = none): " << time_budget_ms
+         << ", early stop: " << elf_utils::print_bool(early_stop)
+         << ", #ponder rollouts per thread: " << ponder_rollouts_per_thread
+         << std::endl;
+      ss << "Maximal #nodes (0 = no constraint): " << max_num_nodes
+         << std::endl;
       ss << "Pick method: " << pick_method << std::endl;
 
       if (root_epsilon > 0) {
@@ -141,6 +213,12 @@ struct TSOptions {
     if (t1.num_rollouts_per_batch != t2.num_rollouts_per_batch) {
       return false;
     }
+    if (t1.num_pipelined_batches != t2.num_pipelined_batches) {
+      return false;
+    }
+    if (t1.num_threads_per_tree != t2.num_threads_per_tree) {
+      return false;
+    }
     if (t1.verbose != t2.verbose) {
       return false;
     }
@@ -168,6 +246,30 @@ struct TSOptions {
     if (t1.virtual_loss != t2.virtual_loss) {
       return false;
     }
+    if (t1.lock_free_backprop != t2.lock_free_backprop) {
+      return false;
+    }
+    if (t1.transposition_table_size != t2.transposition_table_size) {
+      return false;
+    }
+    if (t1.time_budget_ms != t2.time_budget_ms) {
+      return false;
+    }
+    if (t1.early_stop != t2.early_stop) {
+      return false;
+    }
+    if (t1.ponder_rollouts_per_thread != t2.ponder_rollouts_per_thread) {
+      return false;
+    }
+    if (t1.max_num_nodes != t2.max_num_nodes) {
+      return false;
+    }
+    if (t1.virtual_loss_growth != t2.virtual_loss_growth) {
+      return false;
+    }
+    if (t1.max_collision_retries != t2.max_collision_retries) {
+      return false;
+    }
     return true;
   }
 
@@ -176,6 +278,8 @@ struct TSOptions {
     JSON_SAVE(j, num_threads);
     JSON_SAVE(j, num_rollouts_per_thread);
     JSON_SAVE(j, num_rollouts_per_batch);
+    JSON_SAVE(j, num_pipelined_batches);
+    JSON_SAVE(j, num_threads_per_tree);
     JSON_SAVE(j, verbose);
     JSON_SAVE(j, verbose_time);
     JSON_SAVE(j, seed);
@@ -184,6 +288,14 @@ struct TSOptions {
     JSON_SAVE(j, root_epsilon);
     JSON_SAVE(j, root_alpha);
     JSON_SAVE(j, virtual_loss);
+    JSON_SAVE(j, lock_free_backprop);
+    JSON_SAVE(j, transposition_table_size);
+    JSON_SAVE(j, time_budget_ms);
+    JSON_SAVE(j, early_stop);
+    JSON_SAVE(j, ponder_rollouts_per_thread);
+    JSON_SAVE(j, max_num_nodes);
+    JSON_SAVE(j, virtual_loss_growth);
+    JSON_SAVE(j, max_collision_retries);
     JSON_SAVE_OBJ(j, alg_opt);
   }
 
@@ -193,6 +305,8 @@ struct TSOptions {
     JSON_LOAD(opt, j, num_threads);
     JSON_LOAD(opt, j, num_rollouts_per_thread);
     JSON_LOAD(opt, j, num_rollouts_per_batch);
+    JSON_LOAD_OPTIONAL(opt, j, num_pipelined_batches);
+    JSON_LOAD_OPTIONAL(opt, j, num_threads_per_tree);
     JSON_LOAD(opt, j, verbose);
     JSON_LOAD(opt, j, verbose_time);
     JSON_LOAD(opt, j, seed);
@@ -201,15 +315,80 @@ struct TSOptions {
     JSON_LOAD(opt, j, root_epsilon);
     JSON_LOAD(opt, j, root_alpha);
     JSON_LOAD(opt, j, virtual_loss);
+    JSON_LOAD_OPTIONAL(opt, j, lock_free_backprop);
+    JSON_LOAD_OPTIONAL(opt, j, transposition_table_size);
+    JSON_LOAD_OPTIONAL(opt, j, time_budget_ms);
+    JSON_LOAD_OPTIONAL(opt, j, early_stop);
+    JSON_LOAD_OPTIONAL(opt, j, ponder_rollouts_per_thread);
+    JSON_LOAD_OPTIONAL(opt, j, max_num_nodes);
+    JSON_LOAD_OPTIONAL(opt, j, virtual_loss_growth);
+    JSON_LOAD_OPTIONAL(opt, j, max_collision_retries);
     JSON_LOAD_OBJ(opt, j, alg_opt);
     return opt;
   }
 
+  // Fields added later are appended with BIN_LOAD_OPTIONAL.
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, max_num_moves);
+    BIN_SAVE(w, num_threads);
+    BIN_SAVE(w, num_rollouts_per_thread);
+    BIN_SAVE(w, num_rollouts_per_batch);
+    BIN_SAVE(w, num_pipelined_batches);
+    BIN_SAVE(w, num_threads_per_tree);
+    BIN_SAVE(w, verbose);
+    BIN_SAVE(w, verbose_time);
+    BIN_SAVE(w, seed);
+    BIN_SAVE(w, persistent_tree);
+    BIN_SAVE(w, pick_method);
+    BIN_SAVE(w, root_epsilon);
+    BIN_SAVE(w, root_alpha);
+    BIN_SAVE(w, virtual_loss);
+    BIN_SAVE(w, lock_free_backprop);
+    BIN_SAVE(w, transposition_table_size);
+    BIN_SAVE(w, time_budget_ms);
+    BIN_SAVE(w, early_stop);
+    BIN_SAVE(w, ponder_rollouts_per_thread);
+    BIN_SAVE(w, max_num_nodes);
+    BIN_SAVE_OBJ(w, alg_opt);
+    BIN_SAVE(w, virtual_loss_growth);
+    BIN_SAVE(w, max_collision_retries);
+  }
+
+  static TSOptions createFromBinary(elf_utils::BinaryReader& r) {
+    TSOptions opt;
+    BIN_LOAD(opt, r, max_num_moves);
+    BIN_LOAD(opt, r, num_threads);
+    BIN_LOAD(opt, r, num_rollouts_per_thread);
+    BIN_LOAD(opt, r, num_rollouts_per_batch);
+    BIN_LOAD(opt, r, num_pipelined_batches);
+    BIN_LOAD(opt, r, num_threads_per_tree);
+    BIN_LOAD(opt, r, verbose);
+    BIN_LOAD(opt, r, verbose_time);
+    BIN_LOAD(opt, r, seed);
+    BIN_LOAD(opt, r, persistent_tree);
+    BIN_LOAD(opt, r, pick_method);
+    BIN_LOAD(opt, r, root_epsilon);
+    BIN_LOAD(opt, r, root_alpha);
+    BIN_LOAD(opt, r, virtual_loss);
+    BIN_LOAD(opt, r, lock_free_backprop);
+    BIN_LOAD(opt, r, transposition_table_size);
+    BIN_LOAD(opt, r, time_budget_ms);
+    BIN_LOAD(opt, r, early_stop);
+    BIN_LOAD(opt, r, ponder_rollouts_per_thread);
+    BIN_LOAD(opt, r, max_num_nodes);
+    BIN_LOAD_OBJ(opt, r, alg_opt);
+    BIN_LOAD_OPTIONAL(opt, r, virtual_loss_growth);
+    BIN_LOAD_OPTIONAL(opt, r, max_collision_retries);
+    return opt;
+  }
+
   REGISTER_PYBIND_FIELDS(
       max_num_moves,
       num_threads,
       num_rollouts_per_thread,
       num_rollouts_per_batch,
+      num_pipelined_batches,
+      num_threads_per_tree,
       verbose,
       persistent_tree,
       pick_method,
@@ -217,7 +396,15 @@ struct TSOptions {
       verbose_time,
       alg_opt,
       root_epsilon,
-      root_alpha);
+      root_alpha,
+      lock_free_backprop,
+      transposition_table_size,
+      time_budget_ms,
+      early_stop,
+      ponder_rollouts_per_thread,
+      max_num_nodes,
+      virtual_loss_growth,
+      max_collision_retries);
 };
 
 } // namespace tree_search
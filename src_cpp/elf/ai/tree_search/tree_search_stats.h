@@ -0,0 +1,280 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "elf/legacy/pybind_helper.h"
+
+namespace elf {
+namespace ai {
+namespace tree_search {
+
+enum SearchPhase {
+  // Descent from the root to a leaf, excluding EXPAND.
+  PHASE_SELECT = 0,
+  // State allocation and actor.forward() of new leaves.
+  PHASE_EXPAND,
+  // From sending a batch to the actor to getting its reply.
+  PHASE_EVALUATE,
+  // Edge updates of a batch, including waits on leaves of other threads.
+  PHASE_BACKPROP,
+  NUM_SEARCH_PHASES
+};
+
+inline const char* searchPhaseName(int phase) {
+  switch (phase) {
+    case PHASE_SELECT:
+      return "select";
+    case PHASE_EXPAND:
+      return "expand";
+    case PHASE_EVALUATE:
+      return "evaluate";
+    case PHASE_BACKPROP:
+      return "backprop";
+    default:
+      return "unknown";
+  }
+}
+
+// Snapshot of the search counters, summed over threads. Histogram bucket i
+// counts the samples of [2^i, 2^(i+1)) nanoseconds; the last bucket also
+// holds anything longer.
+struct SearchPhaseStats {
+  static constexpr int kNumBuckets = 32;
+
+  uint64_t num_rollouts = 0;
+  uint64_t num_batches = 0;
+  // Leaves sent to the actor.
+  uint64_t num_evaluated = 0;
+  // Leaves expanded from the transposition table.
+  uint64_t num_cached = 0;
+  // Rollouts stopped by the node budget.
+  uint64_t num_capped = 0;
+  // Rollouts ending at a leaf that another thread is evaluating.
+  uint64_t num_collisions = 0;
+  // Rollouts ending at a leaf already picked by the same batch.
+  uint64_t num_duplicates = 0;
+  // Rollouts selected again after a collision or a duplicate (see
+  // TSOptions::max_collision_retries).
+  uint64_t num_retries = 0;
+  uint64_t total_depth = 0;
+  // Indexed by SearchPhase.
+  std::vector<uint64_t> total_nsec =
+      std::vector<uint64_t>(NUM_SEARCH_PHASES, 0);
+  std::vector<uint64_t> num_samples =
+      std::vector<uint64_t>(NUM_SEARCH_PHASES, 0);
+  std::vector<std::vector<uint64_t>> histograms =
+      std::vector<std::vector<uint64_t>>(
+          NUM_SEARCH_PHASES,
+          std::vector<uint64_t>(kNumBuckets, 0));
+
+  void merge(const SearchPhaseStats& other) {
+    num_rollouts += other.num_rollouts;
+    num_batches += other.num_batches;
+    num_evaluated += other.num_evaluated;
+    num_cached += other.num_cached;
+    num_capped += other.num_capped;
+    num_collisions += other.num_collisions;
+    num_duplicates += other.num_duplicates;
+    num_retries += other.num_retries;
+    total_depth += other.total_depth;
+    for (int p = 0; p < NUM_SEARCH_PHASES; ++p) {
+      total_nsec[p] += other.total_nsec[p];
+      num_samples[p] += other.num_samples[p];
+      for (int i = 0; i < kNumBuckets; ++i) {
+        histograms[p][i] += other.histograms[p][i];
+      }
+    }
+  }
+
+  // Share of the selected rollouts that ended at a leaf already being
+  // evaluated.
+  double collisionRate() const {
+    const uint64_t wasted = num_collisions + num_duplicates;
+    return wasted > 0 ? (double)wasted / (num_rollouts + wasted) : 0.0;
+  }
+
+  // Upper bound (in nanoseconds) of the bucket holding the q-quantile of a
+  // phase, 0 if there is no sample.
+  uint64_t quantileNsec(int phase, double q) const {
+    const uint64_t n = num_samples[phase];
+    if (n == 0) {
+      return 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += histograms[phase][i];
+      if (seen >= q * n) {
+        return uint64_t(2) << i;
+      }
+    }
+    return uint64_t(2) << (kNumBuckets - 1);
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "Search: #rollout: " << num_rollouts << ", #batch: " << num_batches
+       << ", #evaluated: " << num_evaluated << ", #cached: " << num_cached
+       << ", #capped: " << num_capped << ", #collision: " << num_collisions
+       << ", #duplicate: " << num_duplicates << ", #retry: " << num_retries
+       << ", collision rate: " << collisionRate() << ", avg depth: "
+       << (num_rollouts > 0 ? (double)total_depth / num_rollouts : 0.0);
+    for (int p = 0; p < NUM_SEARCH_PHASES; ++p) {
+      const uint64_t n = num_samples[p];
+      ss << std::endl
+         << "  " << searchPhaseName(p) << ": #" << n
+         << ", total: " << total_nsec[p] / 1000 << "us, avg: "
+         << (n > 0 ? total_nsec[p] / n : 0)
+         << "ns, p50 < " << quantileNsec(p, 0.5)
+         << "ns, p99 < " << quantileNsec(p, 0.99) << "ns";
+    }
+    return ss.str();
+  }
+
+  REGISTER_PYBIND_FIELDS(
+      num_rollouts,
+      num_batches,
+      num_evaluated,
+      num_cached,
+      num_capped,
+      num_collisions,
+      num_duplicates,
+      num_retries,
+      total_depth,
+      total_nsec,
+      num_samples,
+      histograms);
+};
+
+// Counters of one search thread. Only the owning thread writes, so updates
+// are plain relaxed load/store pairs; other threads may take a snapshot at
+// any time.
+class SearchPhaseCounters {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  SearchPhaseCounters() {
+    reset();
+  }
+
+  void addRollouts(uint64_t n) {
+    inc(numRollouts_, n);
+  }
+
+  void addBatch(
+      uint64_t num_evaluated,
+      uint64_t num_cached,
+      uint64_t num_capped,
+      uint64_t num_collisions,
+      uint64_t num_duplicates,
+      uint64_t num_retries) {
+    inc(numBatches_, 1);
+    inc(numEvaluated_, num_evaluated);
+    inc(numCached_, num_cached);
+    inc(numCapped_, num_capped);
+    inc(numCollisions_, num_collisions);
+    inc(numDuplicates_, num_duplicates);
+    inc(numRetries_, num_retries);
+  }
+
+  void addDepth(uint64_t depth) {
+    inc(totalDepth_, depth);
+  }
+
+  void addTime(SearchPhase phase, Clock::duration d) {
+    const uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= SearchPhaseStats::kNumBuckets) {
+      bucket = SearchPhaseStats::kNumBuckets - 1;
+    }
+    inc(totalNsec_[phase], ns);
+    inc(numSamples_[phase], 1);
+    inc(histograms_[phase][bucket], 1);
+  }
+
+  void addTime(SearchPhase phase, Clock::time_point start) {
+    addTime(phase, Clock::now() - start);
+  }
+
+  SearchPhaseStats snapshot() const {
+    SearchPhaseStats s;
+    s.num_rollouts = get(numRollouts_);
+    s.num_batches = get(numBatches_);
+    s.num_evaluated = get(numEvaluated_);
+    s.num_cached = get(numCached_);
+    s.num_capped = get(numCapped_);
+    s.num_collisions = get(numCollisions_);
+    s.num_duplicates = get(numDuplicates_);
+    s.num_retries = get(numRetries_);
+    s.total_depth = get(totalDepth_);
+    for (int p = 0; p < NUM_SEARCH_PHASES; ++p) {
+      s.total_nsec[p] = get(totalNsec_[p]);
+      s.num_samples[p] = get(numSamples_[p]);
+      for (int i = 0; i < SearchPhaseStats::kNumBuckets; ++i) {
+        s.histograms[p][i] = get(histograms_[p][i]);
+      }
+    }
+    return s;
+  }
+
+  // Not synchronized with the owning thread: call between searches.
+  void reset() {
+    numRollouts_ = 0;
+    numBatches_ = 0;
+    numEvaluated_ = 0;
+    numCached_ = 0;
+    numCapped_ = 0;
+    numCollisions_ = 0;
+    numDuplicates_ = 0;
+    numRetries_ = 0;
+    totalDepth_ = 0;
+    for (int p = 0; p < NUM_SEARCH_PHASES; ++p) {
+      totalNsec_[p] = 0;
+      numSamples_[p] = 0;
+      for (int i = 0; i < SearchPhaseStats::kNumBuckets; ++i) {
+        histograms_[p][i] = 0;
+      }
+    }
+  }
+
+ private:
+  using Counter = std::atomic<uint64_t>;
+
+  Counter numRollouts_;
+  Counter numBatches_;
+  Counter numEvaluated_;
+  Counter numCached_;
+  Counter numCapped_;
+  Counter numCollisions_;
+  Counter numDuplicates_;
+  Counter numRetries_;
+  Counter totalDepth_;
+  Counter totalNsec_[NUM_SEARCH_PHASES];
+  Counter numSamples_[NUM_SEARCH_PHASES];
+  Counter histograms_[NUM_SEARCH_PHASES][SearchPhaseStats::kNumBuckets];
+
+  static void inc(Counter& c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  static uint64_t get(const Counter& c) {
+    return c.load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace tree_search
+} // namespace ai
+} // namespace elf
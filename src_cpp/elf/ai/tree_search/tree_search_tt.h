@@ -0,0 +1,168 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tree_search_base.h"
+
+namespace elf {
+namespace ai {
+namespace tree_search {
+
+struct TTStats {
+  std::atomic<uint64_t> lookups{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> inserts{0};
+  std::atomic<uint64_t> replacements{0};
+
+  void reset() {
+    lookups = 0;
+    hits = 0;
+    inserts = 0;
+    replacements = 0;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    const uint64_t n = lookups.load();
+    ss << "TT: #lookup: " << n << ", #hit: " << hits.load() << " ("
+       << (n > 0 ? 100.0 * hits.load() / n : 0.0)
+       << "%), #insert: " << inserts.load()
+       << ", #replaced: " << replacements.load();
+    return ss.str();
+  }
+};
+
+// Transposition table of leaf evaluations, keyed on the state hash
+// (StateTrait<S, A>::hash). Nodes reached through different move orders
+// reuse the network response instead of sending the state again.
+//
+// The table has a fixed number of entries arranged in 2-way buckets. On
+// insertion, an empty slot is used first, then the entry written longest ago
+// (by search generation) is replaced. A stripe of mutexes guards the buckets.
+template <typename Action>
+class TranspositionTableT {
+ public:
+  using NodeResponse = NodeResponseT<Action>;
+
+  explicit TranspositionTableT(size_t num_entries) {
+    size_t num_buckets = 1;
+    while (num_buckets * kWays < num_entries) {
+      num_buckets <<= 1;
+    }
+    mask_ = num_buckets - 1;
+    buckets_.reset(new Bucket[num_buckets]);
+  }
+
+  size_t capacity() const {
+    return (mask_ + 1) * kWays;
+  }
+
+  // Called once per search, so that entries of older searches are replaced
+  // first.
+  void newGeneration() {
+    generation_++;
+  }
+
+  bool lookup(uint64_t key, NodeResponse* resp) {
+    stats_.lookups++;
+    Bucket& b = bucket(key);
+    std::lock_guard<std::mutex> lock(stripe(key));
+    for (int i = 0; i < kWays; ++i) {
+      if (b.entries[i].used && b.entries[i].key == key) {
+        *resp = b.entries[i].resp;
+        stats_.hits++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void insert(uint64_t key, const NodeResponse& resp) {
+    Bucket& b = bucket(key);
+    const uint32_t gen = generation_.load();
+    std::lock_guard<std::mutex> lock(stripe(key));
+
+    Entry* target = nullptr;
+    for (int i = 0; i < kWays; ++i) {
+      Entry& e = b.entries[i];
+      if (!e.used || e.key == key) {
+        target = &e;
+        break;
+      }
+      if (target == nullptr || e.generation < target->generation) {
+        target = &e;
+      }
+    }
+    if (target->used && target->key != key) {
+      stats_.replacements++;
+    }
+    stats_.inserts++;
+    target->used = true;
+    target->key = key;
+    target->generation = gen;
+    target->resp = resp;
+  }
+
+  void clear() {
+    for (size_t i = 0; i <= mask_; ++i) {
+      for (int j = 0; j < kWays; ++j) {
+        buckets_[i].entries[j].used = false;
+      }
+    }
+  }
+
+  const TTStats& getStats() const {
+    return stats_;
+  }
+
+  void resetStats() {
+    stats_.reset();
+  }
+
+ private:
+  static constexpr int kWays = 2;
+  static constexpr size_t kNumStripes = 64;
+
+  struct Entry {
+    bool used = false;
+    uint64_t key = 0;
+    uint32_t generation = 0;
+    NodeResponse resp;
+  };
+
+  struct Bucket {
+    Entry entries[kWays];
+  };
+
+  std::unique_ptr<Bucket[]> buckets_;
+  size_t mask_;
+  std::atomic<uint32_t> generation_{0};
+  std::mutex stripes_[kNumStripes];
+  TTStats stats_;
+
+  Bucket& bucket(uint64_t key) {
+    return buckets_[key & mask_];
+  }
+
+  std::mutex& stripe(uint64_t key) {
+    return stripes_[(key & mask_) % kNumStripes];
+  }
+};
+
+} // namespace tree_search
+} // namespace ai
+} // namespace elf
@@ -0,0 +1,376 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sharedmem.h"
+
+namespace elf {
+
+// What a BatchRecorder captures, and where.
+struct BatchCaptureOptions {
+  std::string path;
+  // Also the rows of the fields, rather than only the timing and sizes of
+  // the batches.
+  bool data = true;
+  // The rows of these fields only, if not empty.
+  std::vector<std::string> fields;
+  // Batches captured at most (0: no limit).
+  int max_batches = 0;
+};
+
+// A field of the batches of a label, as captured.
+struct CapturedField {
+  std::string key;
+  // That of the extractor, e.g. "float".
+  std::string type_name;
+  // The batch first.
+  std::vector<int> extents;
+  size_t row_bytes = 0;
+};
+
+struct CapturedLabel {
+  std::string label;
+  int batchsize = 0;
+  // The fields of its SharedMems, and whether their rows were captured.
+  std::vector<CapturedField> fields;
+  bool has_rows = false;
+};
+
+struct CapturedBatch {
+  // In BatchCaptureReader::labels().
+  int label = 0;
+  // Idx of the SharedMem of the collector.
+  int collector = 0;
+  // Since the capture started: when the collector started to fill the batch,
+  // and how long filling and serving it took.
+  int64_t start_usec = 0;
+  int64_t fill_usec = 0;
+  int64_t serve_usec = 0;
+  int batchsize = 0;
+  // Partition key of the batch, -1 if none.
+  int64_t key = -1;
+  // The batchsize rows of each field of the label, back to back, if
+  // captured.
+  std::vector<std::vector<char>> rows;
+};
+
+// The served batches of the collectors of a Context (see
+// Context::setBatchRecorder()), in a compact file, to be fed back by a
+// BatchReplay.
+//
+// The file is the magic "ELFBCAP1", then records of a type byte: 'L' for a
+// label, the first time one of its batches is captured (its id, name,
+// batchsize, whether rows follow its batches, and its fields: key, type
+// name, extents, row bytes), and 'B' for a batch (label id, collector,
+// start, fill and serve usec, batchsize, key, then the rows of the fields of
+// the label, field after field). Integers are in the byte order of the host,
+// strings are prefixed by their length.
+//
+// Thread safe: the collectors record their batches as they are served.
+class BatchRecorder {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr char kMagic[9] = "ELFBCAP1";
+  static constexpr char kLabel = 'L';
+  static constexpr char kBatch = 'B';
+
+  // Throws std::runtime_error if the file cannot be created.
+  explicit BatchRecorder(const BatchCaptureOptions& options)
+      : options_(options), start_(Clock::now()) {
+    f_ = fopen(options_.path.c_str(), "wb");
+    if (f_ == nullptr) {
+      throw std::runtime_error("BatchRecorder: cannot create " + options_.path);
+    }
+    write(kMagic, 8);
+  }
+
+  ~BatchRecorder() {
+    if (f_ != nullptr) {
+      fclose(f_);
+    }
+  }
+
+  BatchRecorder(const BatchRecorder&) = delete;
+  BatchRecorder& operator=(const BatchRecorder&) = delete;
+
+  // The batch of smem, filled from fill_start for fill_usec and served in
+  // serve_usec; with its replies, if served already.
+  void record(
+      const SharedMem& smem,
+      Clock::time_point fill_start,
+      int64_t fill_usec,
+      int64_t serve_usec) {
+    const size_t n = smem.getEffectiveBatchSize();
+    if (n == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (f_ == nullptr ||
+        (options_.max_batches > 0 && num_batches_ >= options_.max_batches)) {
+      return;
+    }
+    const Label& l = label(smem);
+    put<char>(kBatch);
+    put<uint32_t>(l.id);
+    put<int32_t>(smem.getSharedMemOptions().getIdx());
+    put<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                     fill_start - start_)
+                     .count());
+    put<int64_t>(fill_usec);
+    put<int64_t>(serve_usec);
+    put<uint32_t>(n);
+    put<int64_t>(smem.getBatchKey());
+    if (l.has_rows) {
+      for (const auto& f : l.fields) {
+        const AnyP* p = smem[f.key];
+        const char* rows = static_cast<const char*>(p->data());
+        const size_t stride = p->getStride()[0];
+        if (stride == f.row_bytes) {
+          write(rows, n * f.row_bytes);
+        } else {
+          for (size_t i = 0; i < n; ++i) {
+            write(rows + i * stride, f.row_bytes);
+          }
+        }
+      }
+    }
+    num_batches_++;
+    if (ferror(f_)) {
+      std::cout << "Error! BatchRecorder: cannot write " << options_.path
+                << ", stopped" << std::endl;
+      fclose(f_);
+      f_ = nullptr;
+    }
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (f_ != nullptr) {
+      fflush(f_);
+    }
+  }
+
+  std::string info() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::stringstream ss;
+    ss << "BatchRecorder: " << options_.path << ", #labels: " << labels_.size()
+       << ", #batches: " << num_batches_ << ", bytes: " << bytes_;
+    return ss.str();
+  }
+
+ private:
+  struct Label : CapturedLabel {
+    uint32_t id;
+  };
+
+  const BatchCaptureOptions options_;
+  const Clock::time_point start_;
+  mutable std::mutex mutex_;
+  FILE* f_ = nullptr;
+  std::unordered_map<std::string, Label> labels_;
+  int num_batches_ = 0;
+  uint64_t bytes_ = 0;
+
+  void write(const void* p, size_t n) {
+    fwrite(p, 1, n, f_);
+    bytes_ += n;
+  }
+
+  template <typename T>
+  void put(T v) {
+    write(&v, sizeof(v));
+  }
+
+  void putString(const std::string& s) {
+    put<uint32_t>(s.size());
+    write(s.data(), s.size());
+  }
+
+  // Of the label of smem; written the first time.
+  const Label& label(const SharedMem& smem) {
+    const SharedMemOptions& opts = smem.getSharedMemOptions();
+    auto it = labels_.find(opts.getLabel());
+    if (it != labels_.end()) {
+      return it->second;
+    }
+    Label& l = labels_[opts.getLabel()];
+    l.id = labels_.size() - 1;
+    l.label = opts.getLabel();
+    l.batchsize = opts.getBatchSize();
+    l.has_rows = options_.data;
+    for (const auto& key : smem.getKeys()) {
+      if (!options_.fields.empty() &&
+          std::find(options_.fields.begin(), options_.fields.end(), key) ==
+              options_.fields.end()) {
+        continue;
+      }
+      const AnyP* p = smem[key];
+      if (p->data() == nullptr) {
+        continue;
+      }
+      const FuncMapBase& f = p->field();
+      const Size& sz = f.getSize();
+      CapturedField c;
+      c.key = key;
+      c.type_name = f.getTypeName();
+      c.extents = sz.vec();
+      c.row_bytes = sz.nelement() / sz[0] * f.getSizeOfType();
+      l.fields.push_back(c);
+    }
+
+    put<char>(kLabel);
+    put<uint32_t>(l.id);
+    putString(l.label);
+    put<int32_t>(l.batchsize);
+    put<uint8_t>(l.has_rows);
+    put<uint32_t>(l.fields.size());
+    for (const auto& f : l.fields) {
+      putString(f.key);
+      putString(f.type_name);
+      put<uint32_t>(f.extents.size());
+      for (int e : f.extents) {
+        put<int32_t>(e);
+      }
+      put<uint64_t>(f.row_bytes);
+    }
+    return l;
+  }
+};
+
+// Reads the batches of a BatchRecorder file, in the order they were served.
+class BatchCaptureReader {
+ public:
+  // Throws std::runtime_error if path is not a capture.
+  explicit BatchCaptureReader(const std::string& path) : path_(path) {
+    f_ = fopen(path.c_str(), "rb");
+    char magic[8];
+    if (f_ == nullptr || fread(magic, 1, 8, f_) != 8 ||
+        memcmp(magic, BatchRecorder::kMagic, 8) != 0) {
+      if (f_ != nullptr) {
+        fclose(f_);
+      }
+      throw std::runtime_error("BatchCaptureReader: not a capture: " + path);
+    }
+  }
+
+  ~BatchCaptureReader() {
+    fclose(f_);
+  }
+
+  BatchCaptureReader(const BatchCaptureReader&) = delete;
+  BatchCaptureReader& operator=(const BatchCaptureReader&) = delete;
+
+  // The next batch, false at the end; throws std::runtime_error if the file
+  // is cut short.
+  bool next(CapturedBatch* b) {
+    while (true) {
+      char type;
+      if (fread(&type, 1, 1, f_) != 1) {
+        return false;
+      }
+      if (type == BatchRecorder::kLabel) {
+        readLabel();
+        continue;
+      }
+      if (type != BatchRecorder::kBatch) {
+        fail();
+      }
+      const uint32_t id = get<uint32_t>();
+      if (id >= labels_.size()) {
+        fail();
+      }
+      b->label = id;
+      b->collector = get<int32_t>();
+      b->start_usec = get<int64_t>();
+      b->fill_usec = get<int64_t>();
+      b->serve_usec = get<int64_t>();
+      b->batchsize = get<uint32_t>();
+      b->key = get<int64_t>();
+      const CapturedLabel& l = labels_[id];
+      b->rows.resize(l.has_rows ? l.fields.size() : 0);
+      for (size_t i = 0; i < b->rows.size(); ++i) {
+        b->rows[i].resize(b->batchsize * l.fields[i].row_bytes);
+        read(b->rows[i].data(), b->rows[i].size());
+      }
+      return true;
+    }
+  }
+
+  // The labels read so far (all of them, once at the end).
+  const std::vector<CapturedLabel>& labels() const {
+    return labels_;
+  }
+
+ private:
+  const std::string path_;
+  FILE* f_ = nullptr;
+  std::vector<CapturedLabel> labels_;
+
+  [[noreturn]] void fail() {
+    throw std::runtime_error("BatchCaptureReader: corrupted " + path_);
+  }
+
+  void read(void* p, size_t n) {
+    if (fread(p, 1, n, f_) != n) {
+      fail();
+    }
+  }
+
+  template <typename T>
+  T get() {
+    T v;
+    read(&v, sizeof(v));
+    return v;
+  }
+
+  std::string getString() {
+    std::string s(get<uint32_t>(), '\0');
+    read(&s[0], s.size());
+    return s;
+  }
+
+  void readLabel() {
+    if (get<uint32_t>() != labels_.size()) {
+      fail();
+    }
+    CapturedLabel l;
+    l.label = getString();
+    l.batchsize = get<int32_t>();
+    l.has_rows = get<uint8_t>() != 0;
+    l.fields.resize(get<uint32_t>());
+    for (auto& f : l.fields) {
+      f.key = getString();
+      f.type_name = getString();
+      f.extents.resize(get<uint32_t>());
+      for (int& e : f.extents) {
+        e = get<int32_t>();
+      }
+      f.row_bytes = get<uint64_t>();
+    }
+    labels_.push_back(std::move(l));
+  }
+};
+
+} // namespace elf
@@ -0,0 +1,249 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "batch_capture.h"
+
+#include <unistd.h>
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "batch_replay.h"
+
+namespace elf {
+
+namespace {
+
+constexpr int kBatchSize = 4;
+constexpr int kDim = 3;
+
+// A SharedMem with fields x (kDim floats per row, in rows of kDim + 1) and
+// y, over its own buffers.
+struct Batch {
+  explicit Batch(const Extractor& e)
+      : x(kBatchSize * (kDim + 1)),
+        y(kBatchSize),
+        smem(0, SharedMemOptions("act", kBatchSize), e.getAnyP({"x", "y"})) {
+    smem["x"]->setAddress(
+        (uint64_t)x.data(), {(kDim + 1) * sizeof(float), sizeof(float)});
+    smem["y"]->setAddress((uint64_t)y.data(), {sizeof(int32_t)});
+  }
+
+  std::vector<float> x;
+  std::vector<int32_t> y;
+  SharedMem smem;
+};
+
+void addFields(Extractor* e) {
+  e->addField<float>("x").addExtents(kBatchSize, {kBatchSize, kDim});
+  e->addField<int32_t>("y").addExtent(kBatchSize);
+}
+
+std::string capturePath(const std::string& name) {
+  return "/tmp/elf_capture_test_" + std::to_string(getpid()) + "_" + name;
+}
+
+// Batch k has k % kBatchSize + 1 rows, the rows i of x all 100 * k + i.
+void recordBatches(BatchRecorder* recorder, int num_batches) {
+  Extractor e;
+  addFields(&e);
+  Batch b(e);
+  const auto start = BatchRecorder::Clock::now();
+  for (int k = 0; k < num_batches; ++k) {
+    const int n = k % kBatchSize + 1;
+    b.smem.setEffectiveBatchSize(n);
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < kDim; ++j) {
+        b.x[i * (kDim + 1) + j] = 100 * k + i;
+      }
+      b.y[i] = -k;
+    }
+    recorder->record(
+        b.smem, start + std::chrono::milliseconds(k), 500, 100 * n);
+  }
+}
+
+// Of each row of the batches of "act": x[0].
+class RowsBackend : public InferenceBackend {
+ public:
+  RowsBackend(std::mutex* mutex, std::set<float>* rows)
+      : mutex_(mutex), rows_(rows) {}
+
+  comm::ReplyStatus process(SharedMem& smem) override {
+    const AnyP* x = smem["x"];
+    std::lock_guard<std::mutex> lock(*mutex_);
+    for (size_t i = 0; i < smem.getEffectiveBatchSize(); ++i) {
+      rows_->insert(*x->getAddress<float>({(int)i, 0}));
+    }
+    return comm::SUCCESS;
+  }
+
+ private:
+  std::mutex* mutex_;
+  std::set<float>* rows_;
+};
+
+} // namespace
+
+TEST(BatchCaptureTest, ReadsBackTheBatches) {
+  const std::string path = capturePath("read");
+  {
+    BatchCaptureOptions options;
+    options.path = path;
+    BatchRecorder recorder(options);
+    recordBatches(&recorder, 6);
+  }
+  BatchCaptureReader reader(path);
+  CapturedBatch b;
+  int64_t first_usec = 0;
+  for (int k = 0; k < 6; ++k) {
+    ASSERT_TRUE(reader.next(&b));
+    const int n = k % kBatchSize + 1;
+    if (k == 0) {
+      first_usec = b.start_usec;
+    }
+    EXPECT_EQ(b.label, 0);
+    EXPECT_EQ(b.batchsize, n);
+    EXPECT_EQ(b.start_usec - first_usec, 1000 * k);
+    EXPECT_EQ(b.fill_usec, 500);
+    EXPECT_EQ(b.serve_usec, 100 * n);
+    ASSERT_EQ(b.rows.size(), 2u);
+    // Without the padding of the rows.
+    ASSERT_EQ(b.rows[0].size(), n * kDim * sizeof(float));
+    const float* x = reinterpret_cast<const float*>(b.rows[0].data());
+    const int32_t* y = reinterpret_cast<const int32_t*>(b.rows[1].data());
+    for (int i = 0; i < n; ++i) {
+      EXPECT_EQ(x[i * kDim + kDim - 1], 100 * k + i);
+      EXPECT_EQ(y[i], -k);
+    }
+  }
+  EXPECT_FALSE(reader.next(&b));
+
+  ASSERT_EQ(reader.labels().size(), 1u);
+  const CapturedLabel& l = reader.labels()[0];
+  EXPECT_EQ(l.label, "act");
+  EXPECT_EQ(l.batchsize, kBatchSize);
+  ASSERT_EQ(l.fields.size(), 2u);
+  EXPECT_EQ(l.fields[0].key, "x");
+  EXPECT_EQ(l.fields[0].type_name, "float");
+  EXPECT_EQ(l.fields[0].extents, std::vector<int>({kBatchSize, kDim}));
+  EXPECT_EQ(l.fields[1].type_name, "int32_t");
+  unlink(path.c_str());
+}
+
+TEST(BatchCaptureTest, TimingOnly) {
+  const std::string path = capturePath("timing");
+  {
+    BatchCaptureOptions options;
+    options.path = path;
+    options.data = false;
+    options.max_batches = 3;
+    BatchRecorder recorder(options);
+    recordBatches(&recorder, 6);
+    EXPECT_NE(recorder.info().find("#batches: 3"), std::string::npos);
+  }
+  BatchCaptureReader reader(path);
+  CapturedBatch b;
+  int num_batches = 0;
+  while (reader.next(&b)) {
+    EXPECT_TRUE(b.rows.empty());
+    num_batches++;
+  }
+  EXPECT_EQ(num_batches, 3);
+  EXPECT_FALSE(reader.labels()[0].has_rows);
+  unlink(path.c_str());
+
+  EXPECT_THROW(BatchCaptureReader("/nonexistent"), std::runtime_error);
+}
+
+// Every captured row reaches the batches of the replay, and the replay can
+// be captured in turn. The requests sent once the replay is done copy no rows,
+// hence sets.
+TEST(BatchCaptureTest, ReplaysThroughContext) {
+  const std::string path = capturePath("replay");
+  const std::string again = capturePath("again");
+  const int kNumBatches = 20;
+  {
+    BatchCaptureOptions options;
+    options.path = path;
+    BatchRecorder recorder(options);
+    recordBatches(&recorder, kNumBatches);
+  }
+
+  std::mutex mutex;
+  std::set<float> rows;
+  {
+    BatchReplayOptions options;
+    options.path = path;
+    options.speed = 10;
+    options.num_clients = 8;
+    options.stub = false;
+    BatchReplay replay(options);
+    EXPECT_EQ(replay.getLabels(), std::vector<std::string>({"act"}));
+    EXPECT_EQ(replay.getKeys("act"), std::vector<std::string>({"x", "y"}));
+    EXPECT_EQ(replay.getBatchSize("act"), kBatchSize);
+
+    Context* ctx = replay.ctx();
+    ctx->setInferenceBackend("act", [&](const SharedMem&) {
+      return std::unique_ptr<InferenceBackend>(new RowsBackend(&mutex, &rows));
+    });
+    BatchCaptureOptions capture;
+    capture.path = again;
+    ctx->setBatchRecorder(std::make_shared<BatchRecorder>(capture));
+    SharedMemOptions smem_opts("act", kBatchSize);
+    smem_opts.setTimeout(1000);
+    replay.allocateSharedMem(smem_opts);
+    replay.allocateSharedMem(smem_opts);
+
+    ctx->start();
+    EXPECT_TRUE(replay.waitUntilDone(10000));
+    EXPECT_NE(replay.summary().find("#batches: 20"), std::string::npos);
+    ctx->stop();
+  }
+
+  std::set<float> expected;
+  for (int k = 0; k < kNumBatches; ++k) {
+    for (int i = 0; i <= k % kBatchSize; ++i) {
+      expected.insert(100 * k + i);
+    }
+  }
+  EXPECT_EQ(rows, expected);
+
+  BatchCaptureReader reader(again);
+  CapturedBatch b;
+  std::set<float> recaptured;
+  while (reader.next(&b)) {
+    const float* x = reinterpret_cast<const float*>(b.rows[0].data());
+    for (int i = 0; i < b.batchsize; ++i) {
+      recaptured.insert(x[i * kDim]);
+    }
+  }
+  EXPECT_EQ(recaptured, expected);
+  unlink(path.c_str());
+  unlink(again.c_str());
+}
+
+TEST(BatchCaptureTest, FitsServiceTime) {
+  const ServiceTimeModel m =
+      ServiceTimeModel::fit({{1, 150}, {2, 200}, {4, 300}, {8, 500}});
+  EXPECT_NEAR(m.base_usec, 100, 1e-6);
+  EXPECT_NEAR(m.usec_per_row, 50, 1e-6);
+  EXPECT_EQ(m.usec(10), 600);
+  EXPECT_EQ(ServiceTimeModel::fit({}).usec(10), 0);
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
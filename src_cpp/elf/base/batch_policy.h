@@ -0,0 +1,117 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "elf/comm/broadcast.h"
+
+namespace elf {
+
+// Picks the batch cutoff of a SharedMem so that its requests meet a latency
+// target. The first request of a batch waits for the batch to fill, then for
+// the batch to be served; with an arrival rate of r requests/usec and a
+// service time of S usec, a cutoff of B costs it about (B - 1) / r + S, so
+// the cutoff is the largest B within the target. A deadline of target - S
+// after the first request bounds the wait when arrivals slow down.
+//
+// Arrival rate and service time are exponential moving averages; the
+// arrival rate counts the requests of a batch over its collection time
+// (from the release of the previous batch), which underestimates it when
+// the queue is idle and errs toward smaller batches.
+class AdaptiveBatchPolicy {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    uint64_t num_batches = 0;
+    // Sums over the batches, to get the averages.
+    uint64_t total_cutoff = 0;
+    uint64_t total_size = 0;
+    int last_cutoff = 0;
+    double arrival_per_usec = 0;
+    double service_usec = 0;
+
+    std::string info() const {
+      std::stringstream ss;
+      ss << "#batch: " << num_batches << ", avg cutoff: "
+         << (num_batches > 0 ? (double)total_cutoff / num_batches : 0.0)
+         << ", avg size: "
+         << (num_batches > 0 ? (double)total_size / num_batches : 0.0)
+         << ", last cutoff: " << last_cutoff
+         << ", arrival: " << arrival_per_usec * 1e6
+         << "/s, service: " << service_usec << "us";
+      return ss.str();
+    }
+  };
+
+  AdaptiveBatchPolicy(int max_batchsize, int latency_target_usec)
+      : maxBatchSize_(max_batchsize), targetUsec_(latency_target_usec) {}
+
+  // Sets the batch size and deadline of opt for the next batch, from the
+  // estimates so far (the full batch if there is none yet).
+  void apply(comm::WaitOptions* opt) {
+    const double budget = targetUsec_ - stats_.service_usec;
+    int cutoff = maxBatchSize_;
+    if (stats_.num_batches > 0) {
+      cutoff = budget <= 0
+          ? 1
+          : (int)std::min<double>(
+                maxBatchSize_, 1 + stats_.arrival_per_usec * budget);
+    }
+    cutoff = std::max(1, std::min(maxBatchSize_, cutoff));
+    opt->batchsize = cutoff;
+    opt->min_batchsize = std::min(opt->min_batchsize, cutoff);
+    opt->deadline_usec = std::max(1, (int)budget);
+    stats_.last_cutoff = cutoff;
+  }
+
+  // A batch of n requests was collected in the given time.
+  void onBatchCollected(size_t n, Clock::duration collect) {
+    if (n == 0) {
+      return;
+    }
+    const double usec = std::max<double>(
+        1, std::chrono::duration<double, std::micro>(collect).count());
+    update(&stats_.arrival_per_usec, n / usec, stats_.num_batches == 0);
+    stats_.num_batches++;
+    stats_.total_cutoff += stats_.last_cutoff;
+    stats_.total_size += n;
+  }
+
+  // The last batch took the given time to be served.
+  void onBatchServed(Clock::duration service) {
+    update(
+        &stats_.service_usec,
+        std::chrono::duration<double, std::micro>(service).count(),
+        numServed_++ == 0);
+  }
+
+  const Stats& getStats() const {
+    return stats_;
+  }
+
+ private:
+  static constexpr double kDecay = 0.9;
+
+  const int maxBatchSize_;
+  const int targetUsec_;
+  Stats stats_;
+  uint64_t numServed_ = 0;
+
+  static void update(double* avg, double sample, bool first) {
+    *avg = first ? sample : kDecay * *avg + (1 - kDecay) * sample;
+  }
+};
+
+} // namespace elf
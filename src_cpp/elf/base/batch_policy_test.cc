@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "batch_policy.h"
+
+#include <gtest/gtest.h>
+
+namespace elf {
+
+using std::chrono::microseconds;
+
+TEST(AdaptiveBatchPolicyTest, FullBatchWithoutEstimates) {
+  AdaptiveBatchPolicy policy(64, 1000);
+  comm::WaitOptions opt(64, 0, 0);
+  policy.apply(&opt);
+  EXPECT_EQ(opt.batchsize, 64);
+  EXPECT_EQ(opt.deadline_usec, 1000);
+}
+
+// 10 requests per ms and 200us of service leave 800us of waiting: 8 more
+// requests after the first one.
+TEST(AdaptiveBatchPolicyTest, CutoffMeetsLatencyTarget) {
+  AdaptiveBatchPolicy policy(64, 1000);
+  comm::WaitOptions opt(64, 0, 0);
+  policy.apply(&opt);
+  policy.onBatchCollected(20, microseconds(2000));
+  policy.onBatchServed(microseconds(200));
+  policy.apply(&opt);
+  EXPECT_EQ(opt.batchsize, 9);
+  EXPECT_EQ(opt.deadline_usec, 800);
+
+  // Faster arrivals fill larger batches, up to the allocated size.
+  for (int i = 0; i < 100; ++i) {
+    policy.onBatchCollected(64, microseconds(10));
+    policy.onBatchServed(microseconds(200));
+  }
+  policy.apply(&opt);
+  EXPECT_EQ(opt.batchsize, 64);
+
+  const auto& stats = policy.getStats();
+  EXPECT_EQ(stats.num_batches, 101u);
+  EXPECT_EQ(stats.total_size, 20u + 100 * 64);
+  EXPECT_EQ(stats.last_cutoff, 64);
+}
+
+TEST(AdaptiveBatchPolicyTest, SlowServiceGivesSingleRequests) {
+  AdaptiveBatchPolicy policy(64, 1000);
+  comm::WaitOptions opt(64, 0, 4);
+  policy.onBatchCollected(64, microseconds(10));
+  policy.onBatchServed(microseconds(5000));
+  policy.apply(&opt);
+  EXPECT_EQ(opt.batchsize, 1);
+  EXPECT_EQ(opt.min_batchsize, 1);
+  EXPECT_EQ(opt.deadline_usec, 1);
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,427 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "elf/metrics/Metrics.h"
+
+#include "batch_capture.h"
+#include "context.h"
+
+namespace elf {
+
+struct BatchReplayOptions {
+  // Of a BatchRecorder.
+  std::string path;
+  // Of the captured rate: 2 replays twice as fast; 0 sends the requests as
+  // fast as the clients can.
+  double speed = 1.0;
+  // Requests waiting for their replies at the same time, at most (the games
+  // of the context).
+  int num_clients = 256;
+  // Serves the labels with a StubBackend, rather than with a model (Python,
+  // or an inference backend set on the context).
+  bool stub = true;
+  // Captured batches replayed at most (0: all of them).
+  int max_batches = 0;
+  // Of the batches of the labels (0: the captured ones).
+  int batchsize = 0;
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "BatchReplay: " << path << ", speed: " << speed
+       << ", #clients: " << num_clients << ", stub: " << stub;
+    if (max_batches > 0) {
+      ss << ", max #batches: " << max_batches;
+    }
+    if (batchsize > 0) {
+      ss << ", batchsize: " << batchsize;
+    }
+    return ss.str();
+  }
+};
+
+// Service time of the batches of a label: base_usec + usec_per_row * their
+// size.
+struct ServiceTimeModel {
+  double base_usec = 0;
+  double usec_per_row = 0;
+
+  // Least squares over the (size, usec) of the batches; clamped to
+  // non negative.
+  static ServiceTimeModel fit(
+      const std::vector<std::pair<int, int64_t>>& batches) {
+    ServiceTimeModel m;
+    if (batches.empty()) {
+      return m;
+    }
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (const auto& b : batches) {
+      sx += b.first;
+      sy += b.second;
+      sxx += (double)b.first * b.first;
+      sxy += (double)b.first * b.second;
+    }
+    const double n = batches.size();
+    const double var = sxx - sx * sx / n;
+    m.usec_per_row = var > 0 ? std::max((sxy - sx * sy / n) / var, 0.0) : 0.0;
+    m.base_usec = std::max((sy - m.usec_per_row * sx) / n, 0.0);
+    return m;
+  }
+
+  int64_t usec(size_t batchsize) const {
+    return base_usec + usec_per_row * batchsize;
+  }
+};
+
+// A model that takes as long as the captured one: waits for the service time
+// of the batch, and leaves the reply fields as they are.
+class StubBackend : public InferenceBackend {
+ public:
+  explicit StubBackend(const ServiceTimeModel& model) : model_(model) {}
+
+  comm::ReplyStatus process(SharedMem& smem) override {
+    std::this_thread::sleep_for(
+        std::chrono::microseconds(model_.usec(smem.getEffectiveBatchSize())));
+    return comm::SUCCESS;
+  }
+
+  std::string info() const override {
+    std::stringstream ss;
+    ss << "Stub: " << model_.base_usec << " + " << model_.usec_per_row
+       << " usec/row";
+    return ss.str();
+  }
+
+ private:
+  const ServiceTimeModel model_;
+};
+
+// Feeds the requests of a capture (see BatchRecorder) back through its own
+// Context, to compare batching options, queues and the serving of the batches
+// under the traffic of a real run. The requests of each captured batch
+// arrive evenly over its fill time, at the captured times (scaled by
+// speed), with their captured rows and keys; the clients of the context send
+// them, and the batching is that of the SharedMems allocated for the replay.
+//
+// Once all the requests are replied to, the clients send requests of no rows
+// until the context stops; these do not count in the summary, but the batches
+// of the labels do.
+//
+// Usage: allocate the SharedMems of the labels with the options to try
+// (allocateSharedMem(), or in Python a GCWrapper over this object, as for a
+// game context, to serve them with a model), start ctx(), waitUntilDone(),
+// print summary() and stop ctx().
+class BatchReplay {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Throws std::runtime_error if the capture cannot be read.
+  explicit BatchReplay(const BatchReplayOptions& options) : options_(options) {
+    BatchCaptureReader reader(options.path);
+    std::vector<std::vector<std::pair<int, int64_t>>> served;
+    CapturedBatch b;
+    while ((options.max_batches == 0 ||
+            (int)batches_.size() < options.max_batches) &&
+           reader.next(&b)) {
+      served.resize(reader.labels().size());
+      served[b.label].emplace_back(b.batchsize, b.serve_usec);
+      for (int i = 0; i < b.batchsize; ++i) {
+        const double at = b.start_usec + b.fill_usec * (i + 0.5) / b.batchsize;
+        requests_.push_back(Request{
+            static_cast<int64_t>(
+                options.speed > 0 ? at / options.speed : 0.0),
+            (int)batches_.size(),
+            i});
+      }
+      captured_usec_ = std::max(captured_usec_, b.start_usec + b.fill_usec);
+      batches_.push_back(std::move(b));
+    }
+    labels_ = reader.labels();
+    std::stable_sort(
+        requests_.begin(),
+        requests_.end(),
+        [](const Request& a, const Request& b) { return a.at_usec < b.at_usec; });
+
+    auto& registry = metrics::Registry::global();
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      const CapturedLabel& l = labels_[i];
+      addFields(l);
+      input_.emplace_back();
+      for (size_t j = 0; j < l.fields.size() && l.has_rows; ++j) {
+        input_.back().push_back(j);
+      }
+      latency_.push_back(registry.histogram(
+          "elf_replay_latency_usec",
+          "Time for the replayed requests to be replied to",
+          {{"label", l.label}}));
+      if (options.stub) {
+        served.resize(labels_.size());
+        const ServiceTimeModel model = ServiceTimeModel::fit(served[i]);
+        ctx_.setInferenceBackend(l.label, [model](const SharedMem&) {
+          return std::unique_ptr<InferenceBackend>(new StubBackend(model));
+        });
+      }
+    }
+    lag_ = registry.histogram(
+        "elf_replay_lag_usec",
+        "How late the replayed requests were sent, for want of clients",
+        {});
+
+    ctx_.setStartCallback(
+        options.num_clients, [this](int, GameClient* client) {
+          replay(client);
+        });
+  }
+
+  Context* ctx() {
+    return &ctx_;
+  }
+
+  std::vector<std::string> getLabels() const {
+    std::vector<std::string> labels;
+    for (const auto& l : labels_) {
+      labels.push_back(l.label);
+    }
+    return labels;
+  }
+
+  // The captured fields of label, all of them needed by its SharedMems
+  // unless setInput() says otherwise.
+  std::vector<std::string> getKeys(const std::string& label) const {
+    std::vector<std::string> keys;
+    for (const auto& f : labels_[index(label)].fields) {
+      keys.push_back(f.key);
+    }
+    return keys;
+  }
+
+  // Of the SharedMems of label, at most.
+  int getBatchSize(const std::string& label) const {
+    return batchSize(labels_[index(label)]);
+  }
+
+  // Copies only these captured fields of the requests of label to their
+  // batches (e.g. the input of a model, rather than also its reply).
+  void setInput(const std::string& label, const std::vector<std::string>& keys) {
+    const size_t i = index(label);
+    input_[i].clear();
+    for (size_t j = 0; j < labels_[i].fields.size(); ++j) {
+      if (std::find(keys.begin(), keys.end(), labels_[i].fields[j].key) !=
+          keys.end()) {
+        input_[i].push_back(j);
+      }
+    }
+  }
+
+  // A SharedMem of a captured label (opts.getLabel()) for the batches served
+  // in C++, with buffers of its own for all the captured fields.
+  SharedMem& allocateSharedMem(const SharedMemOptions& opts) {
+    SharedMem& smem = ctx_.allocateSharedMem(opts, getKeys(opts.getLabel()));
+    for (const auto& key : smem.getKeys()) {
+      AnyP* p = smem[key];
+      const Size& sz = p->field().getSize();
+      const size_t elem = p->field().getSizeOfType();
+      buffers_.emplace_back(sz.nelement() * elem);
+      std::vector<int> strides = sz.getContinuousStrides(elem).vec();
+      p->setAddress((uint64_t)buffers_.back().data(), strides);
+    }
+    return smem;
+  }
+
+  bool done() const {
+    return num_done_.load() == requests_.size();
+  }
+
+  // Whether all the requests were replied to within timeout_msec (forever if
+  // 0).
+  bool waitUntilDone(int timeout_msec = 0) {
+    const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_msec);
+    while (!done()) {
+      if (timeout_msec > 0 && Clock::now() > deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+  }
+
+  std::string summary() const {
+    const auto snapshot = metrics::Registry::global().snapshot();
+    std::stringstream ss;
+    ss << options_.info() << std::endl;
+    const double replayed_usec = !started_
+        ? 0.0
+        : done() ? end_usec_.load()
+                 : std::chrono::duration_cast<std::chrono::microseconds>(
+                       Clock::now() - start_)
+                       .count();
+    ss << "#batches: " << batches_.size() << ", #requests: " << num_done_
+       << "/" << requests_.size() << ", captured: " << captured_usec_ / 1e6
+       << " s, replayed: " << replayed_usec / 1e6 << " s ("
+       << (replayed_usec > 0 ? num_done_ * 1e6 / replayed_usec : 0.0)
+       << " requests/s)" << std::endl;
+    ss << "Lag: " << lag_->snapshot().info() << std::endl;
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      const std::string& label = labels_[i].label;
+      ss << "[" << label << "] latency (usec): "
+         << latency_[i]->snapshot().info();
+      auto it = snapshot.histograms.find(
+          "elf_batch_size{label=\"" + label + "\"}");
+      if (it != snapshot.histograms.end()) {
+        ss << ", batch size: " << it->second.info();
+      }
+      ss << std::endl;
+    }
+    return ss.str();
+  }
+
+ private:
+  struct Request {
+    // Since the replay started.
+    int64_t at_usec;
+    int batch;
+    int row;
+  };
+
+  const BatchReplayOptions options_;
+  Context ctx_;
+  std::vector<CapturedLabel> labels_;
+  std::vector<CapturedBatch> batches_;
+  std::vector<Request> requests_;
+  // Of each label, the fields copied to the batches.
+  std::vector<std::vector<size_t>> input_;
+  std::vector<std::vector<char>> buffers_;
+  int64_t captured_usec_ = 0;
+
+  std::atomic<size_t> next_{0};
+  std::atomic<size_t> num_done_{0};
+  std::atomic<bool> started_{false};
+  Clock::time_point start_;
+  // When the last request was replied to, since start_.
+  std::atomic<int64_t> end_usec_{0};
+  std::vector<metrics::Histogram*> latency_;
+  metrics::Histogram* lag_ = nullptr;
+  std::once_flag start_once_;
+
+  size_t index(const std::string& label) const {
+    for (size_t i = 0; i < labels_.size(); ++i) {
+      if (labels_[i].label == label) {
+        return i;
+      }
+    }
+    throw std::invalid_argument("BatchReplay: no captured label " + label);
+  }
+
+  int batchSize(const CapturedLabel& l) const {
+    return options_.batchsize > 0 ? options_.batchsize : l.batchsize;
+  }
+
+  void addFields(const CapturedLabel& l) {
+    Extractor& e = ctx_.getExtractor();
+    const int batchsize = batchSize(l);
+    for (const auto& f : l.fields) {
+      std::vector<int> extents = f.extents;
+      extents[0] = batchsize;
+      const Size sz(extents);
+      if (f.type_name == "float") {
+        e.addField<float>(f.key).addExtents(batchsize, sz);
+      } else if (f.type_name == "double") {
+        e.addField<double>(f.key).addExtents(batchsize, sz);
+      } else if (f.type_name == "int64_t") {
+        e.addField<int64_t>(f.key).addExtents(batchsize, sz);
+      } else if (f.type_name == "int32_t") {
+        e.addField<int32_t>(f.key).addExtents(batchsize, sz);
+      } else if (f.type_name == "uint8_t") {
+        e.addField<uint8_t>(f.key).addExtents(batchsize, sz);
+      } else {
+        throw std::runtime_error(
+            "BatchReplay: unsupported type " + f.type_name + " of " + f.key);
+      }
+    }
+  }
+
+  // The loop of a client: the next request, when it is due.
+  void replay(GameClient* client) {
+    std::call_once(start_once_, [this]() {
+      start_ = Clock::now();
+      started_ = true;
+    });
+    while (!client->DoStopGames()) {
+      const size_t k = next_++;
+      if (k >= requests_.size()) {
+        idle(client);
+        break;
+      }
+      const Request& r = requests_[k];
+      const CapturedBatch& b = batches_[r.batch];
+      const CapturedLabel& l = labels_[b.label];
+
+      const auto due = start_ + std::chrono::microseconds(r.at_usec);
+      std::this_thread::sleep_until(due);
+      const auto sent = Clock::now();
+      lag_->add(
+          std::chrono::duration_cast<std::chrono::microseconds>(sent - due)
+              .count());
+
+      FuncsWithState funcs;
+      for (size_t j : input_[b.label]) {
+        const size_t bytes = l.fields[j].row_bytes;
+        const char* row = b.rows[j].data() + r.row * bytes;
+        funcs.state_to_mem_funcs.addFunction(
+            l.fields[j].key, [row, bytes](AnyP& p, int batch_idx) {
+              memcpy(
+                  static_cast<char*>(p.data()) +
+                      batch_idx * p.getStride()[0],
+                  row,
+                  bytes);
+            });
+      }
+      client->sendWait({l.label}, &funcs, comm::PRIORITY_NORMAL, b.key);
+      latency_[b.label]->add(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              Clock::now() - sent)
+              .count());
+      const int64_t since_start =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              Clock::now() - start_)
+              .count();
+      if (num_done_ + 1 == requests_.size()) {
+        end_usec_ = since_start;
+      }
+      num_done_++;
+    }
+  }
+
+  // Once the requests run out: requests of no rows to the labels, until the
+  // context stops, as its collectors expect.
+  void idle(GameClient* client) {
+    FuncsWithState funcs;
+    while (!client->DoStopGames()) {
+      for (const auto& l : labels_) {
+        client->sendWait({l.label}, &funcs);
+      }
+    }
+  }
+};
+
+} // namespace elf
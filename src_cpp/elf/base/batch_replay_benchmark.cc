@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Replays a capture of the batches of a run (see BatchRecorder) against a
+// stub of its model, that takes the captured service time, to compare the
+// batching options offline: the batch size, timeout, latency target and
+// pooling of the collectors, and the number of them per label.
+//
+// Usage: benchmark_cpp_elf_base_batch_replay_benchmark capture [speed]
+//   [clients] [collectors_per_label] [batchsize (0: captured)] [timeout_usec]
+//   [latency_target_usec] [pooled]
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "batch_replay.h"
+
+using namespace elf;
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0]
+              << " capture [speed] [clients] [collectors_per_label] "
+              << "[batchsize] [timeout_usec] [latency_target_usec] [pooled]"
+              << std::endl;
+    return 1;
+  }
+  BatchReplayOptions options;
+  options.path = argv[1];
+  options.speed = argc > 2 ? atof(argv[2]) : 1.0;
+  options.num_clients = argc > 3 ? atoi(argv[3]) : 256;
+  const int collectors = argc > 4 ? atoi(argv[4]) : 1;
+  options.batchsize = argc > 5 ? atoi(argv[5]) : 0;
+  const int timeout_usec = argc > 6 ? atoi(argv[6]) : 1000;
+  const int latency_target_usec = argc > 7 ? atoi(argv[7]) : 0;
+  const bool pooled = argc > 8 && atoi(argv[8]) != 0;
+
+  BatchReplay replay(options);
+  for (const auto& label : replay.getLabels()) {
+    SharedMemOptions opts(label, replay.getBatchSize(label));
+    opts.setTimeout(timeout_usec);
+    opts.setLatencyTarget(latency_target_usec);
+    opts.setPooled(pooled);
+    for (int i = 0; i < collectors; ++i) {
+      replay.allocateSharedMem(opts);
+    }
+  }
+
+  replay.ctx()->start();
+  replay.waitUntilDone();
+  std::cout << replay.summary();
+  replay.ctx()->stop();
+  return 0;
+}
@@ -0,0 +1,322 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Overhead of the batching of the requests of the games, without a model:
+// synthetic games send tiny states at a given rate, and an echo consumer
+// replies to them at once.
+//
+// comm: games are threads calling comm::CommT::sendWait directly, a server
+//   thread batches them with waitBatch and releases them, for each queue
+//   implementation of the server.
+// context: games of a Context send through its collector, and a consumer
+//   thread takes the batches with wait() / step() as Python does, for several
+//   batch options of the collector.
+//
+// For each: batches/sec, requests/sec, batch fill, latency percentiles of the
+// requests and context switches of the process per request. If these are
+// far from the rate of the model, the model is the bottleneck.
+//
+// Usage: benchmark_cpp_elf_base_batching_benchmark [games]
+//   [requests_per_game] [rate_per_game (requests/sec, 0: as fast as
+//   possible)] [batchsize] [timeout_usec (> 0)]
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "elf/comm/comm.h"
+#include "elf/concurrency/ConcurrentQueue.h"
+
+#include "context.h"
+
+using namespace elf;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+  int num_games;
+  int num_requests;
+  double rate;
+  int batchsize;
+  int timeout_usec;
+};
+
+struct Request {
+  int64_t x = 0;
+  int64_t y = 0;
+};
+
+int64_t contextSwitches() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Of the requests of the games, until each sent its quota.
+class Run {
+ public:
+  explicit Run(const Config& config)
+      : config_(config), latencies_(config.num_games) {
+    for (auto& l : latencies_) {
+      l.reserve(config.num_requests);
+    }
+  }
+
+  void start() {
+    start_ = Clock::now();
+    switches_ = contextSwitches();
+  }
+
+  // The loop of game game_idx, around send (that returns whether the request
+  // was replied to); until stop() returns true.
+  template <typename Send, typename Stop>
+  void game(int game_idx, Send send, Stop stop) {
+    std::mt19937 rng(game_idx);
+    const auto period = config_.rate > 0
+        ? std::chrono::duration_cast<Clock::duration>(
+              std::chrono::duration<double>(1.0 / config_.rate))
+        : Clock::duration(0);
+    // Not all in step.
+    auto next = Clock::now() +
+        std::chrono::duration_cast<Clock::duration>(
+                    period * std::uniform_real_distribution<>()(rng));
+    auto& latencies = latencies_[game_idx];
+    Request r;
+    while (!stop()) {
+      if (config_.rate > 0) {
+        std::this_thread::sleep_until(next);
+        next += period;
+      }
+      r.x = game_idx;
+      r.y = -1;
+      const auto sent = Clock::now();
+      const bool replied = send(&r);
+      if ((int)latencies.size() == config_.num_requests) {
+        continue;
+      }
+      if (replied && r.y == r.x) {
+        latencies.push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - sent)
+                .count());
+      }
+      if ((int)latencies.size() == config_.num_requests) {
+        numDone_++;
+      }
+    }
+  }
+
+  // A batch of n rows was served.
+  void served(size_t n) {
+    if (!done()) {
+      batches_++;
+      rows_ += n;
+    }
+  }
+
+  bool done() const {
+    return numDone_.load() == config_.num_games;
+  }
+
+  void waitUntilDone() {
+    while (!done()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    finish();
+  }
+
+  // Once done().
+  void finish() {
+    seconds_ =
+        std::chrono::duration<double>(Clock::now() - start_).count();
+    switches_ = contextSwitches() - switches_;
+  }
+
+  void print(const std::string& name) {
+    std::vector<int64_t> all;
+    for (const auto& l : latencies_) {
+      all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) -> int64_t {
+      return all.empty() ? 0
+                         : all[std::min(all.size() - 1, size_t(p * all.size()))];
+    };
+    const double batches = batches_.load();
+    std::cout << name << ": " << batches / seconds_ << " batches/sec, "
+              << all.size() / seconds_ << " requests/sec, fill "
+              << (batches > 0 ? rows_.load() / batches / config_.batchsize : 0)
+              << ", latency (usec) p50 " << percentile(0.5) << ", p90 "
+              << percentile(0.9) << ", p99 " << percentile(0.99) << ", max "
+              << (all.empty() ? 0 : all.back()) << ", "
+              << (double)switches_ / std::max(all.size(), (size_t)1)
+              << " context switches/request" << std::endl;
+  }
+
+ private:
+  const Config config_;
+  std::vector<std::vector<int64_t>> latencies_;
+  std::atomic<int> numDone_{0};
+  std::atomic<int64_t> batches_{0};
+  std::atomic<int64_t> rows_{0};
+  Clock::time_point start_;
+  double seconds_ = 0;
+  int64_t switches_ = 0;
+};
+
+template <template <typename> class ServerQueue>
+void benchComm(const std::string& name, const Config& config) {
+  using CommT = comm::CommT<
+      Request*,
+      true,
+      concurrency::ConcurrentQueueFutex,
+      ServerQueue>;
+  CommT c;
+  auto server = c.getServer();
+  Run run(config);
+  std::atomic<bool> stop(false);
+
+  std::thread server_thread([&]() {
+    server->RegServer("act");
+    comm::RecvOptions options("act", config.batchsize, config.timeout_usec);
+    std::vector<typename CommT::Message> batch;
+    while (!stop) {
+      server->waitBatch(options, &batch);
+      size_t n = 0;
+      for (auto& m : batch) {
+        for (Request* r : m.data) {
+          r->y = r->x;
+        }
+        n += m.data.size();
+      }
+      if (n > 0) {
+        run.served(n);
+      }
+      server->ReleaseBatch(batch, comm::SUCCESS);
+    }
+  });
+  server->waitForRegs(1);
+
+  std::vector<std::thread> games;
+  run.start();
+  for (int i = 0; i < config.num_games; ++i) {
+    games.emplace_back([&, i]() {
+      auto client = c.getClient();
+      run.game(
+          i,
+          [&client](Request* r) {
+            return client->sendWait(r, {"act"}) == comm::SUCCESS;
+          },
+          [&run]() { return run.done(); });
+    });
+  }
+  run.waitUntilDone();
+  for (auto& th : games) {
+    th.join();
+  }
+  stop = true;
+  server_thread.join();
+  run.print("comm " + name);
+}
+
+void benchContext(
+    const std::string& name,
+    const Config& config,
+    std::function<void(SharedMemOptions*)> options) {
+  Context ctx;
+  Extractor& e = ctx.getExtractor();
+  e.addField<int64_t>({"x", "y"}).addExtent(config.batchsize);
+  e.addClass<Request>()
+      .addFunction<int64_t>(
+          "x", [](const Request& r, int64_t* p) { *p = r.x; })
+      .addFunction<int64_t>(
+          "y", [](Request& r, const int64_t* p) { r.y = *p; });
+
+  std::vector<int64_t> x(config.batchsize), y(config.batchsize);
+  SharedMemOptions smem_opts =
+      ctx.createSharedMemOptions("act", config.batchsize);
+  smem_opts.setTimeout(config.timeout_usec);
+  options(&smem_opts);
+  SharedMem& smem = ctx.allocateSharedMem(smem_opts, {"x", "y"});
+  smem["x"]->setAddress((uint64_t)x.data(), {sizeof(int64_t)});
+  smem["y"]->setAddress((uint64_t)y.data(), {sizeof(int64_t)});
+
+  Run run(config);
+  // Games keep sending until stopped, as the collectors expect.
+  ctx.setStartCallback(config.num_games, [&](int game_idx, GameClient* client) {
+    run.game(
+        game_idx,
+        [client](Request* r) {
+          FuncsWithState funcs = client->BindStateToFunctions({"act"}, r);
+          // The batches stepped from Python reply UNKNOWN.
+          return client->sendWait({"act"}, &funcs) != comm::FAILED;
+        },
+        [client]() { return client->DoStopGames(); });
+  });
+
+  // On the thread that started the context, as in Python.
+  ctx.start();
+  run.start();
+  while (!run.done()) {
+    const SharedMem* batch = ctx.wait(1000);
+    if (batch == nullptr) {
+      continue;
+    }
+    const size_t n = batch->getEffectiveBatchSize();
+    std::copy(x.begin(), x.begin() + n, y.begin());
+    run.served(n);
+    ctx.step();
+  }
+  run.finish();
+  ctx.stop();
+  run.print("context " + name);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Config config;
+  config.num_games = argc > 1 ? atoi(argv[1]) : 256;
+  config.num_requests = argc > 2 ? atoi(argv[2]) : 2000;
+  config.rate = argc > 3 ? atof(argv[3]) : 0;
+  config.batchsize = argc > 4 ? atoi(argv[4]) : 128;
+  // The servers check for the end of the run between batches.
+  config.timeout_usec = std::max(argc > 5 ? atoi(argv[5]) : 1000, 1);
+
+  std::cout << "#games: " << config.num_games
+            << ", #requests/game: " << config.num_requests
+            << ", rate/game: " << config.rate
+            << ", batchsize: " << config.batchsize
+            << ", timeout_usec: " << config.timeout_usec << std::endl;
+
+  benchComm<concurrency::ConcurrentQueueMoodyCamel>("MoodyCamel", config);
+  benchComm<concurrency::ConcurrentQueueTBB>("TBB", config);
+  benchComm<concurrency::ConcurrentQueueRing>("Ring", config);
+
+  benchContext("timeout", config, [](SharedMemOptions*) {});
+  // Of the requests that can be waiting.
+  const int min_batchsize =
+      std::max(std::min(config.batchsize, config.num_games) / 2, 1);
+  benchContext("min batch 1/2", config, [min_batchsize](SharedMemOptions* opts) {
+    opts->setMinBatchSize(min_batchsize);
+  });
+  benchContext("latency target", config, [&config](SharedMemOptions* opts) {
+    opts->setLatencyTarget(config.timeout_usec);
+  });
+  return 0;
+}
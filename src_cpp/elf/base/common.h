@@ -37,6 +37,7 @@ TYPE_NAME_CLASS(float);
 TYPE_NAME_CLASS(double);
 TYPE_NAME_CLASS(int64_t);
 TYPE_NAME_CLASS(int32_t);
+TYPE_NAME_CLASS(uint8_t);
 
 struct Size {
  public:
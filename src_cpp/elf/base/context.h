@@ -12,6 +12,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -22,9 +23,15 @@
 #include <utility>
 
 #include "elf/comm/comm.h"
+#include "elf/concurrency/Affinity.h"
 #include "elf/concurrency/ConcurrentQueue.h"
 #include "elf/concurrency/Counter.h"
+#include "elf/concurrency/Fiber.h"
+#include "elf/metrics/Metrics.h"
+#include "elf/tracing/Trace.h"
+#include "batch_capture.h"
 #include "extractor.h"
+#include "inference.h"
 #include "sharedmem.h"
 
 namespace elf {
@@ -65,21 +72,34 @@ class GameClient {
       const std::vector<std::string>& smem_names,
       S* s);
 
+  // Keys of the SharedMems with these labels, e.g. for a StaticFieldsT.
+  std::vector<std::string> getSMemKeys(
+      const std::vector<std::string>& smem_names) const;
+
   template <typename S>
   std::vector<FuncsWithState> BindStateToFunctions(
       const std::vector<std::string>& smem_names,
       const std::vector<S*>& batch_s);
 
+  // priority is a comm::Priority, the class of the request in the queues
+  // of the targets, and key its partition (see comm::SendOptions).
   comm::ReplyStatus sendWait(
       const std::vector<std::string>& targets,
-      FuncsWithState* funcs) {
-    return client_->sendWait(funcs, targets);
+      FuncsWithState* funcs,
+      int priority = comm::PRIORITY_NORMAL,
+      int64_t key = -1) {
+    ELF_TRACE_SPAN("game", "sendWait");
+    return client_->sendWait(funcs, comm::SendOptions(targets, priority, key));
   }
 
   comm::ReplyStatus sendBatchWait(
       const std::vector<std::string>& targets,
-      const std::vector<FuncsWithState*>& funcs) {
-    return client_->sendBatchWait(funcs, targets);
+      const std::vector<FuncsWithState*>& funcs,
+      int priority = comm::PRIORITY_NORMAL,
+      int64_t key = -1) {
+    tracing::Span span("game", "sendBatchWait", funcs.size());
+    return client_->sendBatchWait(
+        funcs, comm::SendOptions(targets, priority, key));
   }
 
  private:
@@ -94,7 +114,7 @@ class GameClient {
 
   std::atomic<bool> prepareToStop_;
 
-  concurrency::Counter<int> numStoppedCounter_;
+  concurrency::AtomicCounter<int> numStoppedCounter_;
 
   void prepareToStop() {
     prepareToStop_ = true;
@@ -122,11 +142,45 @@ class Context {
       return *smem_;
     }
 
-    void start() {
-      th_.reset(new std::thread([&]() {
-        assert(nice(10) == 10);
-        collectAndSendBatch();
-      }));
+    // Called by Context::wait() when Python takes the batch, after waiting
+    // since wait_start.
+    void onTaken(std::chrono::steady_clock::time_point wait_start) {
+      const auto now = std::chrono::steady_clock::now();
+      waitUsec_->add(std::chrono::duration_cast<std::chrono::microseconds>(
+                         now - wait_start)
+                         .count());
+      readyUsec_->add(std::chrono::duration_cast<std::chrono::microseconds>(
+                          now - readySince_)
+                          .count());
+      readyBatches_->add(-1);
+    }
+
+    // cpus: where the thread runs, if not empty. With a backend factory, the
+    // batches are served by its backend rather than sent to Python; with a
+    // source factory, they come from its source rather than from the games.
+    void start(
+        const std::vector<int>& cpus,
+        const InferenceBackendFactory& backend_factory,
+        const BatchSourceFactory& source_factory) {
+      th_.reset(
+          new std::thread([&, cpus, backend_factory, source_factory]() {
+            assert(nice(10) == 10);
+            if (!cpus.empty()) {
+              concurrency::setThreadAffinity(cpus);
+            }
+            if (backend_factory != nullptr) {
+              backend_ = backend_factory(*smem_);
+            }
+            if (source_factory != nullptr) {
+              source_ = source_factory(*smem_);
+            }
+            collectAndSendBatch();
+          }));
+    }
+
+    // Captures the served batches, if not null; before start().
+    void setRecorder(BatchRecorder* recorder) {
+      recorder_ = recorder;
     }
 
     void prepareToStop() {
@@ -150,12 +204,35 @@ class Context {
     Server* server_;
     BatchClient* batchClient_;
     std::unique_ptr<SharedMem> smem_;
+    std::unique_ptr<InferenceBackend> backend_;
+    std::unique_ptr<BatchSource> source_;
     std::unique_ptr<std::thread> th_;
 
-    concurrency::Switch completedSwitch_;
+    concurrency::AtomicSwitch completedSwitch_;
 
     concurrency::ConcurrentQueue<_Msg> msgQueue_;
 
+    // Of the label of smem_.
+    metrics::Histogram* batchSize_ = nullptr;
+    metrics::Histogram* serveUsec_ = nullptr;
+    metrics::Gauge* queueDepth_[comm::NUM_PRIORITIES];
+    // Producer and consumer waits of the batches sent to Python: for their
+    // requests, for Python to take them, and of Python for them.
+    metrics::Histogram* fillUsec_ = nullptr;
+    metrics::Histogram* readyUsec_ = nullptr;
+    metrics::Histogram* waitUsec_ = nullptr;
+    metrics::Gauge* readyBatches_ = nullptr;
+    // Of the device of smem_, if any.
+    metrics::Gauge* deviceInflight_ = nullptr;
+    metrics::Gauge* deviceUsec_ = nullptr;
+    // When the batch was sent to Python; read by onTaken(), once the batch
+    // comm hands it over.
+    std::chrono::steady_clock::time_point readySince_;
+    // Of the batches from the games, for recorder_.
+    std::chrono::steady_clock::time_point fillStart_;
+    int64_t lastFillUsec_ = 0;
+    BatchRecorder* recorder_ = nullptr;
+
     // Collect game states into batch
     // Send batch to batch_server (through batchClient_)
     void collectAndSendBatch() {
@@ -165,7 +242,54 @@ class Context {
       // Each collector has its own shared memory.
       // min_batchsize = 1 and wait indefinitely (timeout = 0).
       const SharedMemOptions& smem_opts = smem_->getSharedMemOptions();
-      server_->RegServer(smem_opts.getRecvOptions().label);
+      auto& registry = metrics::Registry::global();
+      const std::string& label = smem_opts.getLabel();
+      batchSize_ = registry.histogram(
+          "elf_batch_size", "Requests per batch", {{"label", label}});
+      serveUsec_ = registry.histogram(
+          "elf_batch_serve_usec",
+          "Time for the model to reply to a batch",
+          {{"label", label}});
+      fillUsec_ = registry.histogram(
+          "elf_batch_fill_usec",
+          "Time for the requests of a batch to arrive",
+          {{"label", label}});
+      readyUsec_ = registry.histogram(
+          "elf_batch_ready_usec",
+          "Time a full batch waits for Python to take it",
+          {{"label", label}});
+      waitUsec_ = registry.histogram(
+          "elf_batch_wait_usec",
+          "Time Python waits for a batch",
+          {{"label", label}});
+      readyBatches_ = registry.gauge(
+          "elf_batch_ready",
+          "Full batches waiting for Python",
+          {{"label", label}});
+      for (int i = 0; i < comm::NUM_PRIORITIES; ++i) {
+        queueDepth_[i] = registry.gauge(
+            "elf_batch_queue_depth",
+            "Requests waiting for a batch, by priority class",
+            {{"label", label}, {"priority", std::to_string(i)}});
+      }
+      if (smem_opts.getDevice() >= 0) {
+        const std::string device = std::to_string(smem_opts.getDevice());
+        deviceInflight_ = registry.gauge(
+            "elf_device_inflight",
+            "Requests routed to the device and not served yet",
+            {{"device", device}});
+        deviceUsec_ = registry.gauge(
+            "elf_device_usec_per_request",
+            "Service time per request of the device, that routes the requests",
+            {{"device", device}});
+      }
+      if (source_ == nullptr) {
+        server_->RegServer(
+            smem_opts.getRecvOptions().label,
+            smem_opts.isPooled(),
+            smem_opts.getDevice(),
+            smem_opts.getCapacity());
+      }
 
       while (true) {
         _Msg msg;
@@ -178,20 +302,79 @@ class Context {
             smem_->setTimeout(2);
             completedSwitch_.set(true);
           } else if (msg == STOP) {
+            // Lets the other end of the source know.
+            source_.reset();
             completedSwitch_.set(true);
             break;
           }
         }
+        if (source_ != nullptr) {
+          // Back to the messages between the batches.
+          if (source_->fill(*smem_, std::chrono::milliseconds(1))) {
+            source_->reply(*smem_, serve());
+          }
+          continue;
+        }
+        fillStart_ = std::chrono::steady_clock::now();
         smem_->waitBatchFillMem(server_);
+        lastFillUsec_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - fillStart_)
+                            .count();
+        fillUsec_->add(lastFillUsec_);
         // LOG(INFO) << "Receiver: Batch received. #batch = "
         //           << batch.size() << std::endl;
-        comm::ReplyStatus batch_status =
-            batchClient_->sendWait(smem_.get(), {""});
+        const comm::QueueStats& queues = smem_->getQueueStats();
+        for (int i = 0; i < comm::NUM_PRIORITIES; ++i) {
+          queueDepth_[i]->set(queues.classes[i].depth());
+        }
+        if (smem_opts.isReleaseOnFill()) {
+          // The games go on while the batch waits for Python.
+          smem_->releaseBatch(server_, comm::SUCCESS);
+          serve();
+          continue;
+        }
+        comm::ReplyStatus batch_status = serve();
 
         // LOG(INFO) << "Receiver: Release batch" << std::endl;
         smem_->waitReplyReleaseBatch(server_, batch_status);
       }
     }
+
+    comm::ReplyStatus serve() {
+      const size_t batchsize = smem_->getEffectiveBatchSize();
+      const auto start = std::chrono::steady_clock::now();
+      comm::ReplyStatus status = comm::SUCCESS;
+      // Python, or the inference backend.
+      tracing::Span span("collector", "serve", batchsize);
+      if (backend_ == nullptr) {
+        readySince_ = start;
+        readyBatches_->add(1);
+        status = batchClient_->sendWait(smem_.get(), {""});
+      } else if (batchsize > 0) {
+        status = backend_->process(*smem_);
+      }
+      if (batchsize > 0) {
+        const int64_t usec =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        batchSize_->add(batchsize);
+        serveUsec_->add(usec);
+        if (recorder_ != nullptr && source_ == nullptr) {
+          recorder_->record(*smem_, fillStart_, lastFillUsec_, usec);
+        }
+        if (deviceInflight_ != nullptr) {
+          // The next requests go to the devices by their load.
+          server_->reportServed(batchsize, usec);
+          Comm::DeviceStats stats;
+          if (server_->getDeviceStats(&stats)) {
+            deviceInflight_->set(stats.inflight);
+            deviceUsec_->set(stats.usec_per_request);
+          }
+        }
+      }
+      return status;
+    }
   };
 
  public:
@@ -228,6 +411,55 @@ class Context {
     cb_after_game_start_ = cb;
   }
 
+  // Placement of the collectors, their shared memory and the game threads
+  // (search threads inherit the mask of their game); applied in start().
+  void setAffinity(const concurrency::AffinityPolicy& affinity) {
+    affinity_ = affinity;
+  }
+
+  // Runs the games as fibers on this many threads (0: a thread per game);
+  // their tree searches become fibers too.
+  void setNumGameThreads(int num_game_threads) {
+    num_game_threads_ = num_game_threads;
+  }
+
+  // With a thread per game, runs the tree searches of all the games as fibers
+  // on this many threads (0: threads of each search), created as the games
+  // first search. Idle threads steal the ready searches of busy ones, so that
+  // games that wait or end leave no core idle.
+  void setNumSearchThreads(int num_search_threads) {
+    num_search_threads_ = num_search_threads;
+  }
+
+  // The batches of the label are served in C++ by backends of the factory
+  // (one per collector), and never reach wait(); to be set before start().
+  void setInferenceBackend(
+      const std::string& label,
+      InferenceBackendFactory factory) {
+    backends_[label] = std::move(factory);
+  }
+
+  bool hasInferenceBackend(const std::string& label) const {
+    return backends_.find(label) != backends_.end();
+  }
+
+  // The batches of the label come from sources of the factory (one per
+  // collector), e.g. games of other processes, rather than from the games of
+  // this context; to be set before start().
+  void setBatchSource(const std::string& label, BatchSourceFactory factory) {
+    sources_[label] = std::move(factory);
+  }
+
+  // Captures the batches of all the labels as they are served, e.g. to be
+  // replayed by a BatchReplay; to be set before start().
+  void setBatchRecorder(std::shared_ptr<BatchRecorder> recorder) {
+    recorder_ = std::move(recorder);
+  }
+
+  const BatchRecorder* getBatchRecorder() const {
+    return recorder_.get();
+  }
+
   // Initialization
   SharedMemOptions createSharedMemOptions(
       const std::string& name,
@@ -268,23 +500,79 @@ class Context {
   }
 
   void start() {
+    static const std::vector<int> kAnyCpu;
+    const int collector_node = affinity_.getCollectorNode();
+    if (affinity_.enabled()) {
+      std::cout << affinity_.info() << std::endl;
+    }
+    int num_regs = 0;
     for (auto& r : collectors_) {
-      r->start();
+      // The memory is allocated by now (in Python), but not yet used.
+      r->smem().accountMemory();
+      r->smem().adviseHugePages();
+      if (affinity_.enabled() &&
+          r->smem().bindToNumaNode(collector_node) == 0) {
+        std::cout << "Warning! Cannot bind shared memory "
+                  << r->smem().getSharedMemOptions().getLabel()
+                  << " to NUMA node " << collector_node << std::endl;
+      }
+      const std::string& label = r->smem().getSharedMemOptions().getLabel();
+      auto it = backends_.find(label);
+      auto it_source = sources_.find(label);
+      if (it_source == sources_.end()) {
+        num_regs++;
+      }
+      r->setRecorder(recorder_.get());
+      r->start(
+          affinity_.enabled() ? affinity_.getCpus(collector_node) : kAnyCpu,
+          it != backends_.end() ? it->second : nullptr,
+          it_source != sources_.end() ? it_source->second : nullptr);
     }
-    server_->waitForRegs(collectors_.size());
+    server_->waitForRegs(num_regs);
 
     batch_server_->RegServer("");
     batch_server_->waitForRegs(1);
 
     game_threads_.clear();
     auto* client = getClient();
-    for (int i = 0; i < num_games_; ++i) {
-      game_threads_.emplace_back([i, client, this]() {
-        assert(nice(19) == 19);
-        client->start();
-        game_cb_(i, client);
-        client->End();
-      });
+    auto run_game = [client, this](int i) {
+      client->start();
+      game_cb_(i, client);
+      client->End();
+    };
+    // Threads of the games (or of their fibers).
+    auto setup_thread = [this](int i) {
+      assert(nice(19) == 19);
+      if (affinity_.enabled()) {
+        concurrency::setThreadAffinity(
+            affinity_.getCpus(affinity_.getGameNode(i)));
+      }
+    };
+    if (num_game_threads_ > 0) {
+      game_fibers_.reset(new concurrency::FiberPool(
+          num_game_threads_,
+          concurrency::FiberPool::kDefaultStackSize,
+          setup_thread));
+      for (int i = 0; i < num_games_; ++i) {
+        game_fibers_->spawn([i, run_game]() { run_game(i); });
+      }
+    } else {
+      if (num_search_threads_ > 0) {
+        search_fibers_.reset(new concurrency::FiberPool(
+            num_search_threads_,
+            concurrency::FiberPool::kDefaultStackSize,
+            [](int) { assert(nice(19) == 19); },
+            true));
+      }
+      concurrency::FiberPool* search_fibers = search_fibers_.get();
+      for (int i = 0; i < num_games_; ++i) {
+        game_threads_.emplace_back(
+            [i, run_game, setup_thread, search_fibers]() {
+              setup_thread(i);
+              concurrency::FiberPool::setSpawnPool(search_fibers);
+              run_game(i);
+            });
+      }
     }
 
     if (cb_after_game_start_ != nullptr) {
@@ -305,11 +593,19 @@ class Context {
   }
 
   const SharedMem* wait(int time_usec = 0) {
+    // Since the first of the calls that timed out, if any.
+    if (!waiting_) {
+      waitStart_ = std::chrono::steady_clock::now();
+      waiting_ = true;
+    }
     batch_server_->waitBatch(comm::RecvOptions("", 1, time_usec), &smem_batch_);
     if (smem_batch_.empty() || smem_batch_[0].data.empty()) {
       return nullptr;
     } else {
-      return smem_batch_[0].data[0];
+      const SharedMem* smem = smem_batch_[0].data[0];
+      collectors_[smem->getSharedMemOptions().getIdx()]->onTaken(waitStart_);
+      waiting_ = false;
+      return smem;
     }
   }
 
@@ -349,6 +645,10 @@ class Context {
       for (auto& p : game_threads_) {
         p.join();
       }
+      if (game_fibers_ != nullptr) {
+        game_fibers_->join();
+        game_fibers_.reset();
+      }
 
       std::cout << "Stop all collectors ..." << std::endl;
       for (auto& r : collectors_) {
@@ -380,15 +680,41 @@ class Context {
   std::unique_ptr<BatchClient> batchClient_;
 
   std::vector<BatchMessage> smem_batch_;
+  // Of the caller of wait() (Python).
+  bool waiting_ = false;
+  std::chrono::steady_clock::time_point waitStart_;
 
   std::unordered_map<std::string, std::vector<std::string>> smem2keys_;
+  std::unordered_map<std::string, InferenceBackendFactory> backends_;
+  std::unordered_map<std::string, BatchSourceFactory> sources_;
+  std::shared_ptr<BatchRecorder> recorder_;
 
   int num_games_ = 0;
   GameCallback game_cb_ = nullptr;
   std::function<void()> cb_after_game_start_ = nullptr;
   std::vector<std::thread> game_threads_;
+  int num_game_threads_ = 0;
+  std::unique_ptr<concurrency::FiberPool> game_fibers_;
+  int num_search_threads_ = 0;
+  // Outlives the searches: they end with the games, which the owner of the
+  // context destroys first.
+  std::unique_ptr<concurrency::FiberPool> search_fibers_;
+
+  concurrency::AffinityPolicy affinity_;
 };
 
+inline std::vector<std::string> GameClient::getSMemKeys(
+    const std::vector<std::string>& smem_names) const {
+  std::vector<std::string> res;
+  for (const auto& name : smem_names) {
+    const std::vector<std::string>* keys = context_->getSMemKeys(name);
+    if (keys != nullptr) {
+      res.insert(res.end(), keys->begin(), keys->end());
+    }
+  }
+  return res;
+}
+
 template <typename S>
 inline FuncsWithState GameClient::BindStateToFunctions(
     const std::vector<std::string>& smem_names,
@@ -10,22 +10,25 @@
 
 #include <assert.h>
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <memory>
 #include <thread>
 #include <typeindex>
 #include <unordered_map>
+#include <vector>
 
 #include <tbb/concurrent_hash_map.h>
 
 #include "elf/concurrency/Counter.h"
+#include "elf/concurrency/Fiber.h"
 #include "elf/concurrency/TBBHashers.h"
 
 namespace elf {
 
 struct Addr {
-  std::thread::id id;
+  concurrency::ExecutionId id;
   std::string label;
 
   bool matchPrefix(const std::string& prefix) const {
@@ -119,7 +122,7 @@ inline void init_mailbox(MailboxMap&) {}
 template <template <typename> class Queue>
 struct _ThreadInfoT {
  public:
-  using Id = std::thread::id;
+  using Id = concurrency::ExecutionId;
 
   template <typename... RecvTs>
   const Addr& Init(Id id, const std::string& label) {
@@ -153,7 +156,7 @@ struct _ThreadInfoT {
 template <template <typename> class Queue>
 class ThreadInfosT {
  public:
-  using Id = std::thread::id;
+  using Id = concurrency::ExecutionId;
   using _ThreadInfo = _ThreadInfoT<Queue>;
 
   template <typename... MailboxTs>
@@ -223,7 +226,7 @@ class ThreadInfosT {
   }
 
   using ThreadInfoMap =
-      tbb::concurrent_hash_map<std::thread::id, std::unique_ptr<_ThreadInfo>>;
+      tbb::concurrent_hash_map<Id, std::unique_ptr<_ThreadInfo>>;
 
   ThreadInfoMap threadInfoMap_;
 };
@@ -237,11 +240,11 @@ class CtrlT {
   template <typename... RecvTs>
   const Addr& RegMailbox(std::string label = "") {
     return threads_.template registerThreadId<RecvTs...>(
-        std::this_thread::get_id(), label);
+        concurrency::getExecutionId(), label);
   }
 
   const Addr& getAddr() const {
-    return threads_.getAddr(std::this_thread::get_id());
+    return threads_.getAddr(concurrency::getExecutionId());
   }
 
   // Process it immediately.
@@ -249,19 +252,19 @@ class CtrlT {
   bool process(const T& msg) {
     auto cb = callbacks_.template getCallback<T>();
     assert(cb != nullptr);
-    const auto& addr = threads_.getAddr(std::this_thread::get_id());
+    const auto& addr = threads_.getAddr(concurrency::getExecutionId());
     return cb(addr, msg);
   }
 
   template <typename R>
   void waitMail(R* r) {
-    auto id = std::this_thread::get_id();
+    auto id = concurrency::getExecutionId();
     threads_.template waitMail<R>(id, r);
   }
 
   template <typename R>
   bool peekMail(R* r, int timeout_usec) {
-    auto id = std::this_thread::get_id();
+    auto id = concurrency::getExecutionId();
     return threads_.template peekMail<R>(id, r, timeout_usec);
   }
 
@@ -289,14 +292,22 @@ class CtrlT {
   ThreadInfosT<Queue> threads_;
 };
 
+// A thread with a mailbox. Polling, it calls on_thread() every
+// time_millisec; as an event loop, it blocks in on_wait() until mail comes
+// (or the next timer), so that messages are handled as they come and an idle
+// thread costs nothing.
 template <template <typename> class Queue>
 class ThreadedCtrlBase {
  public:
   using Ctrl = CtrlT<Queue>;
+  using Clock = std::chrono::steady_clock;
 
   ThreadedCtrlBase(Ctrl& ctrl, int time_millisec)
       : ctrl_(ctrl), time_millisec_(time_millisec), done_(false) {}
 
+  // Event loop.
+  explicit ThreadedCtrlBase(Ctrl& ctrl) : ThreadedCtrlBase(ctrl, -1) {}
+
   const Addr& addr() const {
     return addr_;
   }
@@ -317,6 +328,9 @@ class ThreadedCtrlBase {
   }
 
  protected:
+  // Longest wait of the event loop, to see done_.
+  static constexpr std::chrono::microseconds kMaxWait{100000};
+
   Ctrl& ctrl_;
   int time_millisec_;
 
@@ -326,9 +340,21 @@ class ThreadedCtrlBase {
   std::atomic_bool done_;
   std::unique_ptr<std::thread> thread_;
 
-  virtual void on_thread() = 0;
+  virtual void on_thread() {}
   virtual void before_loop() {}
 
+  // Event loop: waits for mail up to timeout (e.g., with
+  // ctrl_.peekMail(&msg, timeout.count())) and handles it.
+  virtual void on_wait(std::chrono::microseconds timeout) {
+    std::this_thread::sleep_for(timeout);
+  }
+
+  // Periodic work of the event loop, on its thread: f runs every period
+  // from now on. Called before start(), or on the thread.
+  void every(Clock::duration period, std::function<void()> f) {
+    timers_.push_back({period, Clock::now() + period, std::move(f)});
+  }
+
   template <typename... Ts>
   void start() {
     done_ = false;
@@ -338,6 +364,10 @@ class ThreadedCtrlBase {
       before_loop();
 
       while (!done_.load()) {
+        if (time_millisec_ < 0) {
+          on_wait(runTimers());
+          continue;
+        }
         on_thread();
         std::this_thread::sleep_for(std::chrono::milliseconds(time_millisec_));
       }
@@ -347,6 +377,37 @@ class ThreadedCtrlBase {
     startedSwitch_.waitUntilTrue();
     startedSwitch_.reset();
   }
+
+ private:
+  struct Timer {
+    Clock::duration period;
+    Clock::time_point next;
+    std::function<void()> f;
+  };
+  std::vector<Timer> timers_;
+
+  // Runs the timers that are due; returns the time until the next one.
+  std::chrono::microseconds runTimers() {
+    std::chrono::microseconds wait = kMaxWait;
+    for (size_t i = 0; i < timers_.size(); ++i) {
+      const auto now = Clock::now();
+      if (timers_[i].next <= now) {
+        // f may add timers.
+        timers_[i].f();
+        Timer& t = timers_[i];
+        t.next += t.period;
+        // Late timers skip the periods they missed.
+        if (t.next <= now) {
+          t.next = now + t.period;
+        }
+      }
+      wait = std::min(
+          wait,
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              timers_[i].next - Clock::now()));
+    }
+    return std::max(wait, std::chrono::microseconds(0));
+  }
 };
 
 } // namespace elf
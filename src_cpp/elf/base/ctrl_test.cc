@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "ctrl.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+
+namespace elf {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Ctrl = CtrlT<concurrency::ConcurrentQueueFutex>;
+using Base = ThreadedCtrlBase<concurrency::ConcurrentQueueFutex>;
+
+// Stamps the mail it gets with the time it got it.
+class Echo : public Base {
+ public:
+  explicit Echo(Ctrl& ctrl) : Base(ctrl) {
+    every(std::chrono::milliseconds(20), [this]() { numTicks++; });
+    start<int64_t>();
+  }
+
+  ~Echo() override {
+    done_ = true;
+    thread_->join();
+    thread_.reset();
+  }
+
+  std::atomic<int64_t> lastMail{-1};
+  std::atomic<int64_t> gotAt{0};
+  std::atomic<int> numTicks{0};
+
+ protected:
+  void on_wait(std::chrono::microseconds timeout) override {
+    EXPECT_LE(timeout, kMaxWait);
+    int64_t v;
+    if (ctrl_.peekMail(&v, timeout.count())) {
+      gotAt = Clock::now().time_since_epoch().count();
+      lastMail = v;
+    }
+  }
+};
+
+} // namespace
+
+// Mail is handled as it comes, not at the next timer (every 20 ms, nor the
+// longest wait); the timers still run.
+TEST(CtrlTest, EventLoop) {
+  Ctrl ctrl;
+  Echo echo(ctrl);
+  for (int64_t i = 0; i < 5; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const auto sent = Clock::now();
+    echo.sendToThread(i);
+    while (echo.lastMail.load() != i) {
+      std::this_thread::yield();
+    }
+    EXPECT_LT(
+        Clock::time_point(Clock::duration(echo.gotAt.load())) - sent,
+        std::chrono::milliseconds(10));
+  }
+  const auto deadline = Clock::now() + std::chrono::seconds(1);
+  while (echo.numTicks.load() < 5 && Clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_GE(echo.numTicks.load(), 5);
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
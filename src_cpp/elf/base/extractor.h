@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <set>
@@ -330,6 +331,21 @@ class AnyP {
     return reinterpret_cast<const T*>(p_ + LinearIdx({l}));
   }
 
+  // Byte strides, set with the address.
+  const Size& getStride() const {
+    return stride_;
+  }
+
+  // Extent of the whole batch in memory, with the batch index outermost.
+  void* data() const {
+    return p_;
+  }
+
+  size_t byteSize() const {
+    return f_.getSize().size() == 0 ? 0
+                                    : (size_t)f_.getSize()[0] * stride_[0];
+  }
+
   std::string info() const {
     std::stringstream ss;
     ss << std::hex << (void*)p_ << std::dec << ", Field: " << f_.info();
@@ -370,6 +386,8 @@ class FuncsWithStateT {
       typename std::conditional<use_const, T*, const T*>::type)>;
 
   using AnyP_t = typename std::conditional<use_const, AnyP, const AnyP>::type&;
+  using AnyPPtr =
+      typename std::conditional<use_const, AnyP, const AnyP>::type*;
   using Func = std::function<void(AnyP_t, int batch_idx)>;
   using SharedMem_t =
       typename std::conditional<use_const, SharedMem, const SharedMem>::type&;
@@ -378,7 +396,12 @@ class FuncsWithStateT {
 
   bool addFunction(const std::string& key, Func func) {
     if (func != nullptr) {
-      funcs_[key] = func;
+      auto it = lower_bound(key);
+      if (it != funcs_.end() && it->first == key) {
+        it->second = func;
+      } else {
+        funcs_.emplace(it, key, func);
+      }
       return true;
     }
     return false;
@@ -400,6 +423,28 @@ class FuncsWithStateT {
 
   void transfer(int batch_idx, SharedMem_t smem) const;
 
+  // Same as transfer(), with the fields already looked up by resolve(); this
+  // also works for any funcs with sameKeys().
+  void transfer(int batch_idx, const std::vector<AnyPPtr>& fields) const {
+    for (size_t i = 0; i < funcs_.size(); ++i) {
+      funcs_[i].second(*fields[i], batch_idx);
+    }
+  }
+
+  void resolve(SharedMem_t smem, std::vector<AnyPPtr>* fields) const;
+
+  bool sameKeys(const FuncsWithState& funcs) const {
+    if (funcs.funcs_.size() != funcs_.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < funcs_.size(); ++i) {
+      if (funcs.funcs_[i].first != funcs_[i].first) {
+        return false;
+      }
+    }
+    return true;
+  }
+
 #if 0
     Func getFunction(const std::string &key) const {
         auto it = funcs_.find(key);
@@ -428,12 +473,28 @@ class FuncsWithStateT {
 
   void add(const FuncsWithState& funcs) {
     for (const auto& p : funcs.funcs_) {
-      funcs_.insert(p);
+      auto it = lower_bound(p.first);
+      if (it == funcs_.end() || it->first != p.first) {
+        funcs_.insert(it, p);
+      }
     }
   }
 
  private:
-  std::unordered_map<std::string, Func> funcs_;
+  // Sorted by key: there are only a few, and the funcs of all the states
+  // bound to the same keys line up.
+  std::vector<std::pair<std::string, Func>> funcs_;
+
+  typename std::vector<std::pair<std::string, Func>>::iterator lower_bound(
+      const std::string& key) {
+    return std::lower_bound(
+        funcs_.begin(),
+        funcs_.end(),
+        key,
+        [](const std::pair<std::string, Func>& p, const std::string& k) {
+          return p.first < k;
+        });
+  }
 };
 
 using FuncStateToMemWithState = FuncsWithStateT<true>;
@@ -622,4 +683,108 @@ class ClassFieldT {
   }
 };
 
+// Fields of a class S known at compile time. Each of Fields has
+//
+//   static constexpr const char* key = ...;
+//   using type = ...;
+//
+// and toMem(const S&, type*) and/or fromMem(S&, const type*) static
+// functions. An instance binds states to the fields among the keys it was
+// built with, with no lookup in the Extractor, and the transfer of a field
+// calls toMem / fromMem directly. registerTo() also adds them to the
+// Extractor for the dynamic path.
+template <typename S, typename... Fields>
+class StaticFieldsT {
+ public:
+  explicit StaticFieldsT(const std::vector<std::string>& keys) {
+    size_t i = 0;
+    ((present_[i++] =
+          std::find(keys.begin(), keys.end(), Fields::key) != keys.end()),
+     ...);
+  }
+
+  // The fields must have been added with Extractor::addField.
+  static void registerTo(Extractor* ext) {
+    ClassFieldT<S> c = ext->addClass<S>();
+    (registerField<Fields>(&c), ...);
+  }
+
+  // Binds the toMem of the fields.
+  void bind(const S& s, FuncsWithState* funcs) const {
+    size_t i = 0;
+    (bindToMem<Fields>(present_[i++], s, funcs), ...);
+  }
+
+  // Binds both the toMem and the fromMem of the fields.
+  void bind(S& s, FuncsWithState* funcs) const {
+    size_t i = 0;
+    ((bindToMem<Fields>(present_[i], s, funcs),
+      bindFromMem<Fields>(present_[i], s, funcs),
+      i++),
+     ...);
+  }
+
+ private:
+  bool present_[sizeof...(Fields) > 0 ? sizeof...(Fields) : 1] = {};
+
+  template <typename F, typename = void>
+  struct HasToMem : std::false_type {};
+
+  template <typename F>
+  struct HasToMem<
+      F,
+      decltype(F::toMem(
+          std::declval<const S&>(),
+          std::declval<typename F::type*>()))> : std::true_type {};
+
+  template <typename F, typename = void>
+  struct HasFromMem : std::false_type {};
+
+  template <typename F>
+  struct HasFromMem<
+      F,
+      decltype(F::fromMem(
+          std::declval<S&>(),
+          std::declval<const typename F::type*>()))> : std::true_type {};
+
+  template <typename F>
+  static void registerField(ClassFieldT<S>* c) {
+    using T = typename F::type;
+    if constexpr (HasToMem<F>::value) {
+      c->template addFunction<T>(
+          F::key, FuncStateToMem::FuncType<S, T>(F::toMem));
+    }
+    if constexpr (HasFromMem<F>::value) {
+      c->template addFunction<T>(
+          F::key, FuncMemToState::FuncType<S, T>(F::fromMem));
+    }
+  }
+
+  template <typename F>
+  static void bindToMem(bool present, const S& s, FuncsWithState* funcs) {
+    if constexpr (HasToMem<F>::value) {
+      if (present) {
+        funcs->state_to_mem_funcs.addFunction(
+            F::key, [&s](AnyP& anyp, int batch_idx) {
+              F::toMem(
+                  s, anyp.template getAddress<typename F::type>(batch_idx));
+            });
+      }
+    }
+  }
+
+  template <typename F>
+  static void bindFromMem(bool present, S& s, FuncsWithState* funcs) {
+    if constexpr (HasFromMem<F>::value) {
+      if (present) {
+        funcs->mem_to_state_funcs.addFunction(
+            F::key, [&s](const AnyP& anyp, int batch_idx) {
+              F::fromMem(
+                  s, anyp.template getAddress<typename F::type>(batch_idx));
+            });
+      }
+    }
+  }
+};
+
 } // namespace elf
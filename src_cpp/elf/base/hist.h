@@ -8,29 +8,65 @@
 
 #pragma once
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <cassert>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <vector>
 
-#include <boost/range/adaptor/reversed.hpp>
-
 namespace elf {
 
-// Accumulate history buffer.
+// Accumulate history buffer: the last q_size vectors of vec_size elements,
+// extracted most recent first.
+//
+// The steps are in one ring, cache line aligned, filled backwards so that
+// most recent first is in memory order up to the wrap: a sample in
+// BATCH_HIST order is extracted with (at most) two memcpy.
 template <typename T>
 class HistT {
+  static_assert(
+      std::is_trivially_copyable<T>::value,
+      "HistT copies its elements with memcpy");
+
  public:
   enum MemOrder { BATCH_HIST, HIST_BATCH };
 
   HistT(size_t q_size, size_t vec_size, MemOrder order)
-      : vec_size_(vec_size), order_(order) {
-    q_ = std::vector<std::vector<T>>(q_size, std::vector<T>(vec_size_));
-    assert(q_.size() > 0);
-    assert(q_[0].size() == vec_size_);
+      : q_size_(q_size), vec_size_(vec_size), order_(order) {
+    assert(q_size_ > 0);
+    void* p = nullptr;
+    const size_t bytes = q_size_ * vec_size_ * sizeof(T);
+    if (posix_memalign(&p, kAlignment, bytes > 0 ? bytes : kAlignment) != 0) {
+      throw std::bad_alloc();
+    }
+    memset(p, 0, bytes);
+    q_.reset(static_cast<T*>(p));
   }
 
+  // The vector of the next step, in place of the oldest one.
   T* prepare() {
-    q_idx_ = (q_idx_ + 1) % q_.size();
-    return &q_[q_idx_][0];
+    q_idx_ = (q_idx_ + q_size_ - 1) % q_size_;
+    return step(0);
+  }
+
+  // The vector of the i-th most recent step.
+  T* step(size_t i) {
+    return q_.get() + ((q_idx_ + i) % q_size_) * vec_size_;
+  }
+
+  const T* step(size_t i) const {
+    return q_.get() + ((q_idx_ + i) % q_size_) * vec_size_;
+  }
+
+  size_t size() const {
+    return q_size_;
+  }
+
+  size_t vecSize() const {
+    return vec_size_;
   }
 
   void extract(T* s, int batchsize, int batch_idx) const {
@@ -46,28 +82,62 @@ class HistT {
     }
   }
 
+  // hists[i] to batch index i of s, for all of them (of the same sizes and
+  // order); the batch size is hists.size().
+  static void extractBatch(const std::vector<const HistT*>& hists, T* s) {
+    if (hists.empty()) {
+      return;
+    }
+    const HistT& h0 = *hists[0];
+    const int batchsize = hists.size();
+    if (h0.order_ == BATCH_HIST) {
+      for (int i = 0; i < batchsize; ++i) {
+        hists[i]->ext_batch_hist(s, i);
+      }
+      return;
+    }
+    // Step by step, so that the writes go forward.
+    const size_t bytes = h0.vec_size_ * sizeof(T);
+    T* start = s;
+    for (size_t t = 0; t < h0.q_size_; ++t) {
+      for (int i = 0; i < batchsize; ++i) {
+        assert(hists[i]->q_size_ == h0.q_size_);
+        assert(hists[i]->vec_size_ == h0.vec_size_);
+        memcpy(start, hists[i]->step(t), bytes);
+        start += h0.vec_size_;
+      }
+    }
+  }
+
  private:
-  std::vector<std::vector<T>> q_;
+  static constexpr size_t kAlignment = 64;
+
+  struct Free {
+    void operator()(T* p) const {
+      free(p);
+    }
+  };
+
+  std::unique_ptr<T, Free> q_;
+  size_t q_size_;
   size_t q_idx_ = 0;
   size_t vec_size_;
   MemOrder order_;
 
   void ext_batch_hist(T* s, int batch_idx) const {
     // one sample = dim per feature * time length
-    T* start = s + batch_idx * vec_size_ * q_.size();
-    for (const auto& v : boost::adaptors::reverse(q_)) {
-      assert(v.size() == vec_size_);
-      copy(v.begin(), v.end(), start);
-      start += v.size();
-    }
+    T* start = s + batch_idx * vec_size_ * q_size_;
+    // Steps q_idx_ .. q_size_ - 1, then 0 .. q_idx_ - 1.
+    const size_t head = (q_size_ - q_idx_) * vec_size_;
+    memcpy(start, q_.get() + q_idx_ * vec_size_, head * sizeof(T));
+    memcpy(start + head, q_.get(), q_idx_ * vec_size_ * sizeof(T));
   }
 
   void ext_hist_batch(T* s, int batchsize, int batch_idx) const {
     T* start = s + batch_idx * vec_size_;
-    int stride = batchsize * vec_size_;
-    for (const auto& v : boost::adaptors::reverse(q_)) {
-      assert(v.size() == vec_size_);
-      copy(v.begin(), v.end(), s);
+    const size_t stride = batchsize * vec_size_;
+    for (size_t t = 0; t < q_size_; ++t) {
+      memcpy(start, step(t), vec_size_ * sizeof(T));
       start += stride;
     }
   }
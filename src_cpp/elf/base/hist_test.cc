@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "hist.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+
+namespace {
+
+// Steps 1 .. n of vectors {10 * t + 0, 10 * t + 1, ...}.
+void fill(HistT<float>* h, int n) {
+  for (int t = 1; t <= n; ++t) {
+    float* v = h->prepare();
+    for (size_t j = 0; j < h->vecSize(); ++j) {
+      v[j] = 10 * t + j;
+    }
+  }
+}
+
+} // namespace
+
+TEST(HistTest, MostRecentFirstAcrossWrap) {
+  HistT<float> h(3, 2, HistT<float>::BATCH_HIST);
+  EXPECT_EQ((uintptr_t)h.step(0) % 64, 0u);
+  fill(&h, 2);
+  std::vector<float> s(2 * 6, -1);
+  h.extract(s.data(), 2, 1);
+  EXPECT_EQ(
+      s, std::vector<float>({-1, -1, -1, -1, -1, -1, 20, 21, 10, 11, 0, 0}));
+
+  // Steps 5, 4, 3, wrapped around the ring.
+  fill(&h, 5);
+  h.extract(s.data(), 2, 0);
+  EXPECT_EQ(
+      s, std::vector<float>({50, 51, 40, 41, 30, 31, 20, 21, 10, 11, 0, 0}));
+}
+
+TEST(HistTest, HistBatchOrder) {
+  HistT<float> a(2, 2, HistT<float>::HIST_BATCH);
+  HistT<float> b(2, 2, HistT<float>::HIST_BATCH);
+  fill(&a, 3);
+  fill(&b, 1);
+
+  std::vector<float> s(8, -1);
+  a.extract(s.data(), 2, 0);
+  b.extract(s.data(), 2, 1);
+  const std::vector<float> expected = {30, 31, 10, 11, 20, 21, 0, 0};
+  EXPECT_EQ(s, expected);
+
+  std::vector<float> batch(8, -1);
+  HistT<float>::extractBatch({&a, &b}, batch.data());
+  EXPECT_EQ(batch, expected);
+}
+
+TEST(HistTest, ExtractBatchBatchHist) {
+  HistT<float> a(2, 1, HistT<float>::BATCH_HIST);
+  HistT<float> b(2, 1, HistT<float>::BATCH_HIST);
+  fill(&a, 2);
+  fill(&b, 3);
+  std::vector<float> s(4, -1);
+  HistT<float>::extractBatch({&a, &b}, s.data());
+  EXPECT_EQ(s, std::vector<float>({20, 10, 30, 20}));
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
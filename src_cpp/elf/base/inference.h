@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "elf/comm/comm.h"
+
+namespace elf {
+
+class SharedMem;
+
+// Serves the batches of a SharedMem label in C++, in place of Python: its
+// collectors hand each batch to the backend instead of the batch comm, so
+// that the clients (e.g. AIClientT) are unchanged. Each collector has its
+// own instance, created and used only on the collector thread.
+class InferenceBackend {
+ public:
+  virtual ~InferenceBackend() = default;
+
+  // Reads the input fields of the first smem.getEffectiveBatchSize() rows,
+  // and writes their reply fields.
+  virtual comm::ReplyStatus process(SharedMem& smem) = 0;
+
+  virtual std::string info() const {
+    return "";
+  }
+};
+
+// Called on the collector thread, with its (allocated) SharedMem.
+using InferenceBackendFactory =
+    std::function<std::unique_ptr<InferenceBackend>(const SharedMem&)>;
+
+// The other end: fills the batches of a SharedMem label from outside the
+// process (e.g. games of another process), in place of the games of this
+// one. The batches are then served as usual, by Python or a backend. Each
+// collector has its own instance, created and used only on the collector
+// thread.
+class BatchSource {
+ public:
+  virtual ~BatchSource() = default;
+
+  // Waits up to timeout for a batch; if there is one, fills its input fields
+  // and sets smem.getEffectiveBatchSize().
+  virtual bool fill(SharedMem& smem, std::chrono::nanoseconds timeout) = 0;
+
+  // Hands back the reply fields of the batch.
+  virtual void reply(SharedMem& smem, comm::ReplyStatus status) = 0;
+
+  virtual std::string info() const {
+    return "";
+  }
+};
+
+using BatchSourceFactory =
+    std::function<std::unique_ptr<BatchSource>(const SharedMem&)>;
+
+} // namespace elf
@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "context.h"
+
+#include <atomic>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+
+namespace {
+
+struct Request {
+  float x = 0;
+  float y = 0;
+};
+
+// y = 2 * x, for the rows of the batch.
+class DoubleBackend : public InferenceBackend {
+ public:
+  explicit DoubleBackend(std::atomic<int>* num_batches)
+      : numBatches_(num_batches) {}
+
+  comm::ReplyStatus process(SharedMem& smem) override {
+    const AnyP* x = smem["x"];
+    AnyP* y = smem["y"];
+    for (size_t i = 0; i < smem.getEffectiveBatchSize(); ++i) {
+      *y->getAddress<float>(i) = 2 * *x->getAddress<float>(i);
+    }
+    (*numBatches_)++;
+    return comm::SUCCESS;
+  }
+
+ private:
+  std::atomic<int>* numBatches_;
+};
+
+} // namespace
+
+TEST(InferenceBackendTest, CollectorsServeBatchesInCpp) {
+  constexpr int kBatchSize = 4;
+  constexpr int kNumGames = 8;
+  constexpr int kNumRequests = 20;
+
+  Context ctx;
+  Extractor& e = ctx.getExtractor();
+  e.addField<float>({"x", "y"}).addExtent(kBatchSize);
+  e.addClass<Request>()
+      .addFunction<float>("x", [](const Request& r, float* p) { *p = r.x; })
+      .addFunction<float>("y", [](Request& r, const float* p) { r.y = *p; });
+
+  std::vector<float> x(kBatchSize), y(kBatchSize);
+  SharedMem& smem = ctx.allocateSharedMem(
+      ctx.createSharedMemOptions("act", kBatchSize), {"x", "y"});
+  smem["x"]->setAddress((uint64_t)x.data(), {sizeof(float)});
+  smem["y"]->setAddress((uint64_t)y.data(), {sizeof(float)});
+
+  std::atomic<int> num_batches(0);
+  ctx.setInferenceBackend("act", [&num_batches](const SharedMem&) {
+    return std::unique_ptr<InferenceBackend>(new DoubleBackend(&num_batches));
+  });
+  EXPECT_TRUE(ctx.hasInferenceBackend("act"));
+  EXPECT_FALSE(ctx.hasInferenceBackend("train"));
+
+  // Games keep sending until stopped, as the collectors expect.
+  std::atomic<int> num_replies(0);
+  std::atomic<int> num_wrong(0);
+  ctx.setStartCallback(kNumGames, [&](int game_idx, GameClient* client) {
+    for (int i = 0; !client->DoStopGames(); ++i) {
+      Request r;
+      r.x = game_idx * 1000 + i % 1000;
+      FuncsWithState funcs = client->BindStateToFunctions({"act"}, &r);
+      if (client->sendWait({"act"}, &funcs) == comm::SUCCESS) {
+        if (r.y != 2 * r.x) {
+          num_wrong++;
+        }
+        num_replies++;
+      }
+    }
+  });
+
+  ctx.start();
+  // Nothing reaches Python: no wait() / step() needed until stop().
+  while (num_replies.load() < kNumGames * kNumRequests) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ctx.stop();
+
+  EXPECT_EQ(num_wrong.load(), 0);
+  EXPECT_GE(num_batches.load(), kNumGames * kNumRequests / kBatchSize);
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
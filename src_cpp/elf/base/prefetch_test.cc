@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "context.h"
+
+#include <atomic>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+
+namespace {
+
+struct Sample {
+  int x = 0;
+};
+
+int readyBatches(const std::string& label) {
+  return metrics::Registry::global()
+      .gauge("elf_batch_ready", "", {{"label", label}})
+      ->value();
+}
+
+} // namespace
+
+// A ring of pooled batches released on fill keeps filling while Python holds
+// one: the games never wait for Python.
+TEST(PrefetchTest, RingFillsWhilePythonHoldsABatch) {
+  constexpr int kBatchSize = 4;
+  constexpr int kNumBuffers = 3;
+  constexpr int kNumGames = 4;
+  constexpr int kNumBatches = 20;
+
+  Context ctx;
+  Extractor& e = ctx.getExtractor();
+  e.addField<int>("x").addExtent(kBatchSize);
+  e.addClass<Sample>().addFunction<int>(
+      "x", [](const Sample& s, int* p) { *p = s.x; });
+
+  SharedMemOptions opts = ctx.createSharedMemOptions("prefetch", kBatchSize);
+  opts.setPooled(true);
+  opts.setReleaseOnFill(true);
+  std::vector<std::vector<int>> buffers(
+      kNumBuffers, std::vector<int>(kBatchSize));
+  for (auto& b : buffers) {
+    SharedMem& smem = ctx.allocateSharedMem(opts, {"x"});
+    smem["x"]->setAddress((uint64_t)b.data(), {sizeof(int)});
+  }
+
+  std::atomic<int> num_sent(0);
+  ctx.setStartCallback(kNumGames, [&](int game_idx, GameClient* client) {
+    for (int i = 0; !client->DoStopGames(); ++i) {
+      Sample s;
+      s.x = game_idx * 1000000 + i;
+      FuncsWithState funcs = client->BindStateToFunctions({"prefetch"}, &s);
+      if (client->sendWait({"prefetch"}, &funcs) == comm::SUCCESS) {
+        num_sent++;
+      }
+    }
+  });
+
+  ctx.start();
+  const SharedMem* held = ctx.wait();
+  ASSERT_NE(held, nullptr);
+  // The other buffers fill up, from more requests than there are games.
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (readyBatches("prefetch") < kNumBuffers - 1 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(readyBatches("prefetch"), kNumBuffers - 1);
+  EXPECT_GE(num_sent.load(), kNumBuffers * kBatchSize);
+  ctx.step();
+
+  // Each sample is in one batch only.
+  std::set<int> seen;
+  for (int i = 0; i < kNumBatches; ++i) {
+    const SharedMem* smem = ctx.wait();
+    ASSERT_NE(smem, nullptr);
+    ASSERT_EQ(smem->getEffectiveBatchSize(), (size_t)kBatchSize);
+    const std::vector<int>& b = buffers[smem->getSharedMemOptions().getIdx()];
+    for (int x : b) {
+      EXPECT_TRUE(seen.insert(x).second) << x;
+    }
+    ctx.step();
+  }
+
+  const metrics::Snapshot snapshot = metrics::Registry::global().snapshot();
+  EXPECT_EQ(
+      snapshot.histograms.at("elf_batch_wait_usec{label=\"prefetch\"}").count,
+      (uint64_t)kNumBatches + 1);
+  EXPECT_GE(
+      snapshot.histograms.at("elf_batch_fill_usec{label=\"prefetch\"}").count,
+      (uint64_t)kNumBatches + 1);
+  ctx.stop();
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,21 +8,31 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 
 #include "elf/comm/comm.h"
+#include "elf/concurrency/Affinity.h"
 #include "elf/concurrency/ConcurrentQueue.h"
+#include "elf/concurrency/HugePages.h"
+#include "elf/metrics/Memory.h"
+#include "elf/tracing/Trace.h"
 
+#include "batch_policy.h"
 #include "extractor.h"
 
 namespace elf {
 
+// Clients (games) wait for replies on a futex queue, so that they can run
+// as fibers.
 using Comm = typename comm::CommT<
     FuncsWithState*,
     true,
-    concurrency::ConcurrentQueue,
+    concurrency::ConcurrentQueueFutex,
     concurrency::ConcurrentQueue>;
 // Message sent from client to server
 using Message = typename Comm::Message;
@@ -48,10 +58,52 @@ class SharedMemOptions {
     options_.wait_opt.min_batchsize = minbatchsize;
   }
 
+  // If latency_target_usec > 0, the batch cutoff adapts to the arrival rate
+  // and service time to keep requests within it (see AdaptiveBatchPolicy).
+  void setLatencyTarget(int latency_target_usec) {
+    latency_target_usec_ = latency_target_usec;
+  }
+
+  // Share of the batch slots for the requests of a comm::Priority class when
+  // several classes are waiting.
+  void setPriorityWeight(int priority, int weight) {
+    assert(priority >= 0 && priority < comm::NUM_PRIORITIES);
+    options_.wait_opt.priority_weights[priority] = weight;
+  }
+
   void setTransferType(TransferType type) {
     type_ = type;
   }
 
+  // The collectors of the pooled SharedMems of a label fill their batches
+  // from a shared queue, each taking the next batch when it is free.
+  void setPooled(bool pooled) {
+    pooled_ = pooled;
+  }
+
+  // The requests of a batch are replied to once their states are copied
+  // into it, rather than once it is served, so that the clients go on to the
+  // next batch meanwhile. For batches without reply fields (e.g. training
+  // batches, prefetched by a ring of pooled SharedMems).
+  void setReleaseOnFill(bool release_on_fill) {
+    release_on_fill_ = release_on_fill;
+  }
+
+  // Each batch only has the requests of one key (e.g., the model version
+  // they need; see comm::SendOptions::key), then given by
+  // SharedMem::getBatchKey().
+  void setPartitionByKey(bool partition) {
+    options_.wait_opt.partition_by_key = partition;
+  }
+
+  // The device (e.g., the gpu) serving the batches, of relative speed
+  // capacity: the requests of the label go to the collector whose device is
+  // the least loaded (see comm::CommT). -1: none, any collector of the label.
+  void setDevice(int device, float capacity = 1.0) {
+    device_ = device;
+    capacity_ = capacity;
+  }
+
   int getIdx() const {
     return idx_;
   }
@@ -76,10 +128,30 @@ class SharedMemOptions {
     return options_.wait_opt.min_batchsize;
   }
 
+  int getLatencyTarget() const {
+    return latency_target_usec_;
+  }
+
   TransferType getTransferType() const {
     return type_;
   }
 
+  bool isPooled() const {
+    return pooled_;
+  }
+
+  bool isReleaseOnFill() const {
+    return release_on_fill_;
+  }
+
+  int getDevice() const {
+    return device_;
+  }
+
+  float getCapacity() const {
+    return capacity_;
+  }
+
   std::string info() const {
     std::stringstream ss;
     ss << "SMem[" << options_.label << "], idx: " << idx_
@@ -89,39 +161,77 @@ class SharedMemOptions {
       ss << ", timeout_usec: " << options_.wait_opt.timeout_usec;
     }
 
+    if (latency_target_usec_ > 0) {
+      ss << ", latency_target_usec: " << latency_target_usec_;
+    }
+
     if (type_ != SERVER) {
       ss << ", transfer_type: " << type_;
     }
 
+    if (pooled_) {
+      ss << ", pooled";
+    }
+
+    if (release_on_fill_) {
+      ss << ", release on fill";
+    }
+
+    if (options_.wait_opt.partition_by_key) {
+      ss << ", by key";
+    }
+
+    if (device_ >= 0) {
+      ss << ", device: " << device_ << " (capacity " << capacity_ << ")";
+    }
+
     return ss.str();
   }
 
  private:
   int idx_ = -1;
+  int latency_target_usec_ = 0;
   comm::RecvOptions options_;
   TransferType type_ = CLIENT;
+  bool pooled_ = false;
+  bool release_on_fill_ = false;
+  int device_ = -1;
+  float capacity_ = 1.0;
 };
 
 class SharedMem;
 
-inline void state2mem(const Message& msg, SharedMem& mem) {
-  // LOG(INFO) << "BatchIdx: " << msg_idx << ", msg addr: "
-  //           << std::hex << &msg << std::dec << std::endl;
+// The fields of the shared memory are looked up once for all the states of
+// a message bound to the same keys (usually all of them), rather than per
+// state.
+template <typename FuncsWithStateT, typename SharedMemT>
+void transferMessage(
+    const Message& msg,
+    const FuncsWithStateT FuncsWithState::*funcs,
+    SharedMemT& mem) {
+  std::vector<typename FuncsWithStateT::AnyPPtr> fields;
+  const FuncsWithStateT* resolved = nullptr;
   int idx = msg.base_idx;
   for (const auto* datum : msg.data) {
     assert(datum != nullptr);
-    datum->state_to_mem_funcs.transfer(idx, mem);
+    const FuncsWithStateT& f = datum->*funcs;
+    if (resolved == nullptr || !f.sameKeys(*resolved)) {
+      f.resolve(mem, &fields);
+      resolved = &f;
+    }
+    f.transfer(idx, fields);
     idx++;
   }
 }
 
+inline void state2mem(const Message& msg, SharedMem& mem) {
+  // LOG(INFO) << "BatchIdx: " << msg_idx << ", msg addr: "
+  //           << std::hex << &msg << std::dec << std::endl;
+  transferMessage(msg, &FuncsWithState::state_to_mem_funcs, mem);
+}
+
 inline void mem2state(const SharedMem& mem, Message& msg) {
-  int idx = msg.base_idx;
-  for (const auto* datum : msg.data) {
-    assert(datum != nullptr);
-    datum->mem_to_state_funcs.transfer(idx, mem);
-    idx++;
-  }
+  transferMessage(msg, &FuncsWithState::mem_to_state_funcs, mem);
 }
 
 class SharedMem {
@@ -130,22 +240,52 @@ class SharedMem {
       int idx,
       const SharedMemOptions& smem_opts,
       const std::unordered_map<std::string, AnyP>& mem)
-      : opts_(smem_opts), mem_(mem) {
+      : opts_(smem_opts),
+        mem_(mem),
+        adaptive_opts_(smem_opts.getRecvOptions()) {
     opts_.setIdx(idx);
+    if (opts_.getLatencyTarget() > 0) {
+      policy_.reset(new AdaptiveBatchPolicy(
+          opts_.getBatchSize(), opts_.getLatencyTarget()));
+    }
   }
 
   void waitBatchFillMem(Server* server) {
-    server->waitBatch(opts_.getRecvOptions(), &msgs_from_client_);
+    tracing::Span span("smem", "waitBatchFillMem");
+    {
+      ELF_TRACE_SPAN("smem", "waitBatch");
+      if (policy_ != nullptr) {
+        adaptive_opts_.wait_opt = opts_.getRecvOptions().wait_opt;
+        policy_->apply(&adaptive_opts_.wait_opt);
+        server->waitBatch(adaptive_opts_, &msgs_from_client_);
+      } else {
+        server->waitBatch(opts_.getRecvOptions(), &msgs_from_client_);
+      }
+    }
+    queue_stats_ = server->getQueueStats();
     active_batch_size_ = 0;
     for (const Message& m : msgs_from_client_) {
       active_batch_size_ += m.data.size();
     }
+    batch_key_ = msgs_from_client_.empty() ? -1 : msgs_from_client_[0].key;
+    span.setArg(active_batch_size_);
+    if (policy_ != nullptr) {
+      auto now = AdaptiveBatchPolicy::Clock::now();
+      policy_->onBatchCollected(active_batch_size_, now - released_);
+      filled_ = now;
+    }
 
-    if ((int)active_batch_size_ > opts_.getBatchSize() ||
-        (int)active_batch_size_ < opts_.getMinBatchSize()) {
+    // The options of this wait, as lowered by the policy. Once its deadline
+    // passes, a batch is returned under the minimum size.
+    const comm::WaitOptions& wait_opt = policy_ != nullptr
+        ? adaptive_opts_.wait_opt
+        : opts_.getRecvOptions().wait_opt;
+    if ((int)active_batch_size_ > wait_opt.batchsize ||
+        (wait_opt.deadline_usec == 0 &&
+         (int)active_batch_size_ < wait_opt.min_batchsize)) {
       std::cout << "Error: active_batch_size =  " << active_batch_size_
-                << ", max_batch_size: " << opts_.getBatchSize()
-                << ", min_batch_size: " << opts_.getMinBatchSize()
+                << ", max_batch_size: " << wait_opt.batchsize
+                << ", min_batch_size: " << wait_opt.min_batchsize
                 << ", #msg count: " << msgs_from_client_.size() << std::endl;
       assert(false);
     }
@@ -161,6 +301,10 @@ class SharedMem {
   }
 
   void waitReplyReleaseBatch(Server* server, comm::ReplyStatus batch_status) {
+    tracing::Span span("smem", "waitReplyReleaseBatch", active_batch_size_);
+    if (policy_ != nullptr && active_batch_size_ > 0) {
+      policy_->onBatchServed(AdaptiveBatchPolicy::Clock::now() - filled_);
+    }
     if (opts_.getTransferType() == SharedMemOptions::SERVER) {
       local_mem2state();
     } else {
@@ -171,6 +315,15 @@ class SharedMem {
     //           << active_batch_size_ << std::endl;
     server->ReleaseBatch(msgs_from_client_, batch_status);
     msgs_from_client_.clear();
+    released_ = AdaptiveBatchPolicy::Clock::now();
+  }
+
+  // Replies to the requests of the batch without reading its reply fields
+  // (see SharedMemOptions::setReleaseOnFill()).
+  void releaseBatch(Server* server, comm::ReplyStatus batch_status) {
+    server->ReleaseBatch(msgs_from_client_, batch_status);
+    msgs_from_client_.clear();
+    released_ = AdaptiveBatchPolicy::Clock::now();
   }
 
   const SharedMemOptions& getSharedMemOptions() const {
@@ -181,6 +334,17 @@ class SharedMem {
     return active_batch_size_;
   }
 
+  // Key of the requests of the batch if partitioned by key (see
+  // SharedMemOptions::setPartitionByKey()), -1 if not set.
+  int64_t getBatchKey() const {
+    return batch_key_;
+  }
+
+  // For batches filled by a BatchSource rather than by waitBatchFillMem().
+  void setEffectiveBatchSize(size_t batchsize) {
+    active_batch_size_ = batchsize;
+  }
+
   void setTimeout(int timeout_usec) {
     opts_.setTimeout(timeout_usec);
   }
@@ -189,9 +353,61 @@ class SharedMem {
     opts_.setMinBatchSize(minbatchsize);
   }
 
+  // Chosen batch cutoffs and estimates, if the latency target is set.
+  const AdaptiveBatchPolicy* getBatchPolicy() const {
+    return policy_.get();
+  }
+
+  // Queue depths per priority class, as of the last batch.
+  const comm::QueueStats& getQueueStats() const {
+    return queue_stats_;
+  }
+
+  // Moves the fields to a NUMA node; returns how many of them were bound.
+  int bindToNumaNode(int node) {
+    int num_bound = 0;
+    for (const auto& p : mem_) {
+      if (p.second.data() != nullptr &&
+          concurrency::bindMemoryToNode(
+              p.second.data(), p.second.byteSize(), node)) {
+        num_bound++;
+      }
+    }
+    return num_bound;
+  }
+
+  // Asks for transparent huge pages for the fields (see
+  // elf/concurrency/HugePages.h); returns how many of them got them.
+  int adviseHugePages() {
+    int num_advised = 0;
+    for (const auto& p : mem_) {
+      if (p.second.data() != nullptr &&
+          concurrency::adviseHugePages(
+              p.second.data(), p.second.byteSize(), "smem")) {
+        num_advised++;
+      }
+    }
+    return num_advised;
+  }
+
+  // Charges the fields to the "smem" memory account, once allocated.
+  void accountMemory() {
+    size_t bytes = 0;
+    for (const auto& p : mem_) {
+      if (p.second.data() != nullptr) {
+        bytes += p.second.byteSize();
+      }
+    }
+    memory_.set(bytes);
+  }
+
   std::string info() const {
     std::stringstream ss;
     ss << opts_.info() << std::endl;
+    if (policy_ != nullptr) {
+      ss << "Adaptive batching: " << policy_->getStats().info() << std::endl;
+    }
+    ss << "Queues: " << queue_stats_.info() << std::endl;
     for (const auto& p : mem_) {
       ss << "[" << p.first << "]: " << p.second.info() << std::endl;
     }
@@ -208,6 +424,16 @@ class SharedMem {
     }
   }
 
+  // Of the fields, sorted.
+  std::vector<std::string> getKeys() const {
+    std::vector<std::string> keys;
+    for (const auto& p : mem_) {
+      keys.push_back(p.first);
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  }
+
   // [TODO] For python to use.
   AnyP* get(const std::string& key) {
     return (*this)[key];
@@ -225,12 +451,23 @@ class SharedMem {
  private:
   SharedMemOptions opts_;
   std::unordered_map<std::string, AnyP> mem_;
+  elf::metrics::MemoryCharge memory_{"smem"};
 
   // We get a batch of messages from client
   // Note that msgs_from_client_.size() is no longer the batchsize, since one
   // Message could contain multiple states.
   std::vector<Message> msgs_from_client_;
   size_t active_batch_size_ = 0;
+  int64_t batch_key_ = -1;
+  comm::QueueStats queue_stats_;
+
+  std::unique_ptr<AdaptiveBatchPolicy> policy_;
+  // The recv options with the cutoff of policy_.
+  comm::RecvOptions adaptive_opts_;
+  // When the last batch was released and the current one filled.
+  AdaptiveBatchPolicy::Clock::time_point released_ =
+      AdaptiveBatchPolicy::Clock::now();
+  AdaptiveBatchPolicy::Clock::time_point filled_;
 
   void local_state2mem() {
     // Send the state to shared memory.
@@ -287,6 +524,18 @@ void FuncsWithStateT<use_const>::transfer(int msg_idx, SharedMem_t smem) const {
   }
 }
 
+template <bool use_const>
+void FuncsWithStateT<use_const>::resolve(
+    SharedMem_t smem,
+    std::vector<AnyPPtr>* fields) const {
+  fields->clear();
+  for (const auto& p : funcs_) {
+    auto* anyp = smem[p.first];
+    assert(anyp != nullptr);
+    fields->push_back(anyp);
+  }
+}
+
 using BatchComm = comm::CommT<
     SharedMem*,
     false,
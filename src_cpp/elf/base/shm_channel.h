@@ -0,0 +1,385 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "elf/concurrency/Counter.h"
+#include "inference.h"
+#include "sharedmem.h"
+
+namespace elf {
+
+// Fields exchanged through a ShmChannel, and where it lives: the channel of
+// slot k of a label is the segment "/<prefix>.<label>.<k>".
+struct ShmChannelOptions {
+  std::string prefix = "elf";
+  // Copied from the workers to the server, and back.
+  std::vector<std::string> input;
+  std::vector<std::string> reply;
+  // Workers: this worker serves slots [worker_idx * slots_per_worker, ...),
+  // one per collector of the label.
+  int worker_idx = 0;
+  int slots_per_worker = 1;
+  // Workers: how long to wait for the server to create the segment.
+  int open_timeout_sec = 60;
+};
+
+// The batches of a SharedMem mirrored in a POSIX shared memory segment, to
+// serve the collectors of one process (ShmBackend, e.g. in a process running
+// the games) from the collectors of another (ShmSource, e.g. in the trainer).
+// The segment is a header followed by the rows of each field, in the order of
+// the options; the state word of the header is the doorbell, a futex waited
+// on by the side whose turn it is not.
+class ShmChannel {
+ public:
+  enum State : int32_t { IDLE = 0, REQUEST, REPLY, CLOSED };
+
+  static std::string segmentName(
+      const std::string& prefix,
+      const std::string& label,
+      int slot) {
+    return "/" + prefix + "." + label + "." + std::to_string(slot);
+  }
+
+  // Server side: creates (or replaces) the segment, removed when destroyed.
+  static std::unique_ptr<ShmChannel> create(
+      const std::string& name,
+      const SharedMem& smem,
+      const ShmChannelOptions& options) {
+    std::unique_ptr<ShmChannel> c(new ShmChannel(name, smem, options, true));
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, c->size_) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error("ShmChannel: cannot create " + name);
+    }
+    c->map(fd);
+    Header* h = c->header();
+    h->layout = c->layout_;
+    h->server_pid = getpid();
+    h->state.store(IDLE);
+    h->magic.store(kMagic, std::memory_order_release);
+    return c;
+  }
+
+  // Worker side: waits until the server has created the segment.
+  static std::unique_ptr<ShmChannel> open(
+      const std::string& name,
+      const SharedMem& smem,
+      const ShmChannelOptions& options) {
+    std::unique_ptr<ShmChannel> c(new ShmChannel(name, smem, options, false));
+    const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(options.open_timeout_sec);
+    while (true) {
+      int fd = shm_open(name.c_str(), O_RDWR, 0600);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size == c->size_) {
+        c->map(fd);
+        if (c->header()->magic.load(std::memory_order_acquire) == kMagic) {
+          break;
+        }
+        c->unmap();
+      } else if (fd >= 0) {
+        close(fd);
+      }
+      if (std::chrono::steady_clock::now() > deadline) {
+        throw std::runtime_error("ShmChannel: cannot open " + name);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (c->header()->layout != c->layout_) {
+      throw std::runtime_error("ShmChannel: field layout mismatch in " + name);
+    }
+    // A request of a previous worker of this slot is dropped.
+    c->header()->state.store(IDLE);
+    return c;
+  }
+
+  ~ShmChannel() {
+    if (base_ == nullptr) {
+      return;
+    }
+    if (owner_) {
+      header()->state.store(CLOSED);
+      concurrency::futexWakeShared(&header()->state);
+    }
+    unmap();
+    if (owner_) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  // Worker side: sends the input rows of the batch, and waits for the reply
+  // rows. FAILED if the server is gone.
+  comm::ReplyStatus call(SharedMem& smem) {
+    Header* h = header();
+    const int n = smem.getEffectiveBatchSize();
+    h->batchsize = n;
+    copyRows(smem, input_, n, true);
+    int32_t idle = IDLE;
+    if (!h->state.compare_exchange_strong(
+            idle, REQUEST, std::memory_order_release)) {
+      // Closed by the server.
+      return comm::FAILED;
+    }
+    concurrency::futexWakeShared(&h->state);
+
+    while (true) {
+      int32_t state = h->state.load(std::memory_order_acquire);
+      if (state == REPLY) {
+        break;
+      }
+      if (state == CLOSED || kill(h->server_pid, 0) != 0) {
+        return comm::FAILED;
+      }
+      concurrency::futexWaitShared(&h->state, state, &kPollInterval);
+    }
+    copyRows(smem, reply_, n, false);
+    const auto status = static_cast<comm::ReplyStatus>(h->status);
+    h->state.store(IDLE, std::memory_order_release);
+    return status;
+  }
+
+  // Server side: waits up to timeout for a request, and fills smem with its
+  // input rows.
+  bool receive(SharedMem& smem, std::chrono::nanoseconds timeout) {
+    Header* h = header();
+    const int32_t state = h->state.load(std::memory_order_acquire);
+    if (state != REQUEST) {
+      concurrency::futexWaitShared(&h->state, state, &timeout);
+      if (h->state.load(std::memory_order_acquire) != REQUEST) {
+        return false;
+      }
+    }
+    const int n = h->batchsize;
+    smem.setEffectiveBatchSize(n);
+    copyRows(smem, input_, n, false);
+    return true;
+  }
+
+  // Server side: sends the reply rows of the request.
+  void reply(SharedMem& smem, comm::ReplyStatus status) {
+    Header* h = header();
+    copyRows(smem, reply_, smem.getEffectiveBatchSize(), true);
+    h->status = status;
+    h->state.store(REPLY, std::memory_order_release);
+    concurrency::futexWakeShared(&h->state);
+  }
+
+ private:
+  static constexpr uint64_t kMagic = 0x454c46534d454d31ULL;
+  static constexpr size_t kAlign = 64;
+  static constexpr std::chrono::nanoseconds kPollInterval =
+      std::chrono::milliseconds(100);
+
+  struct alignas(kAlign) Header {
+    std::atomic<uint64_t> magic;
+    // Hash of the fields, their row sizes and the batch size.
+    uint64_t layout;
+    pid_t server_pid;
+    int32_t batchsize;
+    int32_t status;
+    alignas(kAlign) std::atomic<int32_t> state;
+  };
+
+  struct Region {
+    std::string key;
+    size_t offset;
+    size_t row_bytes;
+  };
+
+  std::string name_;
+  bool owner_;
+  std::vector<Region> input_;
+  std::vector<Region> reply_;
+  uint64_t layout_ = 1469598103934665603ULL;
+  size_t size_ = sizeof(Header);
+  char* base_ = nullptr;
+
+  ShmChannel(
+      const std::string& name,
+      const SharedMem& smem,
+      const ShmChannelOptions& options,
+      bool owner)
+      : name_(name), owner_(owner) {
+    const int batchsize = smem.getSharedMemOptions().getBatchSize();
+    hash(batchsize);
+    addRegions(smem, options.input, batchsize, &input_);
+    addRegions(smem, options.reply, batchsize, &reply_);
+  }
+
+  void hash(uint64_t v) {
+    // FNV-1a
+    layout_ = (layout_ ^ v) * 1099511628211ULL;
+  }
+
+  void addRegions(
+      const SharedMem& smem,
+      const std::vector<std::string>& keys,
+      int batchsize,
+      std::vector<Region>* regions) {
+    for (const auto& key : keys) {
+      const AnyP* p = smem[key];
+      if (p == nullptr) {
+        throw std::invalid_argument(
+            "ShmChannel: " + smem.getSharedMemOptions().getLabel() +
+            " has no field " + key);
+      }
+      const Size& sz = p->field().getSize();
+      const size_t row_bytes =
+          sz.nelement() / sz[0] * p->field().getSizeOfType();
+      regions->push_back(Region{key, size_, row_bytes});
+      size_ += (row_bytes * batchsize + kAlign - 1) / kAlign * kAlign;
+      for (char c : key) {
+        hash(c);
+      }
+      hash(row_bytes);
+    }
+  }
+
+  Header* header() const {
+    return reinterpret_cast<Header*>(base_);
+  }
+
+  void map(int fd) {
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::runtime_error("ShmChannel: cannot map " + name_);
+    }
+    base_ = static_cast<char*>(p);
+  }
+
+  void unmap() {
+    munmap(base_, size_);
+    base_ = nullptr;
+  }
+
+  // Rows of a field are contiguous in the segment, and at their byte stride
+  // in the SharedMem.
+  void copyRows(
+      SharedMem& smem,
+      const std::vector<Region>& regions,
+      int n,
+      bool to_segment) {
+    for (const auto& r : regions) {
+      AnyP* p = smem[r.key];
+      char* rows = static_cast<char*>(p->data());
+      const size_t stride = p->getStride()[0];
+      char* seg = base_ + r.offset;
+      if (stride == r.row_bytes) {
+        if (to_segment) {
+          memcpy(seg, rows, n * r.row_bytes);
+        } else {
+          memcpy(rows, seg, n * r.row_bytes);
+        }
+        continue;
+      }
+      for (int i = 0; i < n; ++i) {
+        if (to_segment) {
+          memcpy(seg + i * r.row_bytes, rows + i * stride, r.row_bytes);
+        } else {
+          memcpy(rows + i * stride, seg + i * r.row_bytes, r.row_bytes);
+        }
+      }
+    }
+  }
+};
+
+// Worker side: the batches of each collector are served by the process that
+// created its channel.
+class ShmBackend : public InferenceBackend {
+ public:
+  explicit ShmBackend(std::unique_ptr<ShmChannel>&& channel)
+      : channel_(std::move(channel)) {}
+
+  comm::ReplyStatus process(SharedMem& smem) override {
+    return channel_->call(smem);
+  }
+
+  std::string info() const override {
+    return "Shm: " + channel_->name();
+  }
+
+ private:
+  std::unique_ptr<ShmChannel> channel_;
+};
+
+// Server side: each collector gets the batches of its channel, rather than
+// from games of this process.
+class ShmSource : public BatchSource {
+ public:
+  explicit ShmSource(std::unique_ptr<ShmChannel>&& channel)
+      : channel_(std::move(channel)) {}
+
+  bool fill(SharedMem& smem, std::chrono::nanoseconds timeout) override {
+    return channel_->receive(smem, timeout);
+  }
+
+  void reply(SharedMem& smem, comm::ReplyStatus status) override {
+    channel_->reply(smem, status);
+  }
+
+  std::string info() const override {
+    return "Shm: " + channel_->name();
+  }
+
+ private:
+  std::unique_ptr<ShmChannel> channel_;
+};
+
+// Collectors take the slots of their label in the order they start.
+inline InferenceBackendFactory makeShmBackend(
+    const ShmChannelOptions& options) {
+  auto next_slot = std::make_shared<std::atomic<int>>(0);
+  return [options, next_slot](const SharedMem& smem) {
+    const int slot =
+        options.worker_idx * options.slots_per_worker + (*next_slot)++;
+    return std::unique_ptr<InferenceBackend>(new ShmBackend(ShmChannel::open(
+        ShmChannel::segmentName(
+            options.prefix, smem.getSharedMemOptions().getLabel(), slot),
+        smem,
+        options)));
+  };
+}
+
+inline BatchSourceFactory makeShmSource(const ShmChannelOptions& options) {
+  auto next_slot = std::make_shared<std::atomic<int>>(0);
+  return [options, next_slot](const SharedMem& smem) {
+    return std::unique_ptr<BatchSource>(new ShmSource(ShmChannel::create(
+        ShmChannel::segmentName(
+            options.prefix, smem.getSharedMemOptions().getLabel(),
+            (*next_slot)++),
+        smem,
+        options)));
+  };
+}
+
+} // namespace elf
@@ -0,0 +1,241 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "shm_channel.h"
+
+#include <sys/wait.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "context.h"
+
+namespace elf {
+
+namespace {
+
+constexpr int kBatchSize = 4;
+constexpr int kDim = 3;
+
+// A SharedMem with fields x (kDim floats per row) and y, over its own buffers.
+struct Batch {
+  explicit Batch(const Extractor& e)
+      : x(kBatchSize * kDim),
+        y(kBatchSize),
+        smem(0, SharedMemOptions("act", kBatchSize), e.getAnyP({"x", "y"})) {
+    smem["x"]->setAddress(
+        (uint64_t)x.data(), {kDim * sizeof(float), sizeof(float)});
+    smem["y"]->setAddress((uint64_t)y.data(), {sizeof(float)});
+  }
+
+  std::vector<float> x;
+  std::vector<float> y;
+  SharedMem smem;
+};
+
+void addFields(Extractor* e) {
+  e->addField<float>("x").addExtents(kBatchSize, {kBatchSize, kDim});
+  e->addField<float>("y").addExtent(kBatchSize);
+}
+
+ShmChannelOptions channelOptions() {
+  ShmChannelOptions options;
+  options.prefix = "elf_test_" + std::to_string(getpid());
+  options.input = {"x"};
+  options.reply = {"y"};
+  options.open_timeout_sec = 5;
+  return options;
+}
+
+// y = sum(x) for the rows of each batch from the source.
+void serve(BatchSource* source, Batch* b, int num_batches) {
+  for (int served = 0; served < num_batches;) {
+    if (!source->fill(b->smem, std::chrono::milliseconds(10))) {
+      continue;
+    }
+    for (size_t i = 0; i < b->smem.getEffectiveBatchSize(); ++i) {
+      b->y[i] = b->x[i * kDim] + b->x[i * kDim + 1] + b->x[i * kDim + 2];
+    }
+    source->reply(b->smem, comm::SUCCESS);
+    served++;
+  }
+}
+
+} // namespace
+
+TEST(ShmChannelTest, BackendGetsRepliesOfSource) {
+  Extractor e;
+  addFields(&e);
+  const ShmChannelOptions options = channelOptions();
+
+  Batch server(e);
+  auto source = makeShmSource(options)(server.smem);
+  std::thread th([&]() { serve(source.get(), &server, 10); });
+
+  Batch worker(e);
+  auto backend = makeShmBackend(options)(worker.smem);
+  for (int k = 0; k < 10; ++k) {
+    const int n = k % kBatchSize + 1;
+    worker.smem.setEffectiveBatchSize(n);
+    for (int i = 0; i < n * kDim; ++i) {
+      worker.x[i] = k + i;
+    }
+    ASSERT_EQ(backend->process(worker.smem), comm::SUCCESS);
+    for (int i = 0; i < n; ++i) {
+      EXPECT_EQ(worker.y[i], 3 * (k + i * kDim) + 3);
+    }
+  }
+  th.join();
+}
+
+// The games of another process get their batches served.
+TEST(ShmChannelTest, ServesAnotherProcess) {
+  Extractor e;
+  addFields(&e);
+  const ShmChannelOptions options = channelOptions();
+
+  Batch server(e);
+  auto source = makeShmSource(options)(server.smem);
+
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    Batch worker(e);
+    auto backend = makeShmBackend(options)(worker.smem);
+    worker.smem.setEffectiveBatchSize(kBatchSize);
+    std::fill(worker.x.begin(), worker.x.end(), 1.0);
+    const bool ok = backend->process(worker.smem) == comm::SUCCESS &&
+        worker.y == std::vector<float>(kBatchSize, 3.0);
+    _exit(ok ? 0 : 1);
+  }
+  serve(source.get(), &server, 1);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(ShmChannelTest, FailsWhenServerIsGone) {
+  Extractor e;
+  addFields(&e);
+  const ShmChannelOptions options = channelOptions();
+
+  Batch server(e);
+  auto source = makeShmSource(options)(server.smem);
+  Batch worker(e);
+  auto backend = makeShmBackend(options)(worker.smem);
+  source.reset();
+
+  worker.smem.setEffectiveBatchSize(1);
+  EXPECT_EQ(backend->process(worker.smem), comm::FAILED);
+}
+
+TEST(ShmChannelTest, RejectsOtherLayouts) {
+  Extractor e;
+  addFields(&e);
+  ShmChannelOptions options = channelOptions();
+
+  Batch server(e);
+  auto source = makeShmSource(options)(server.smem);
+  Batch worker(e);
+  options.input = {"x", "y"};
+  options.open_timeout_sec = 1;
+  EXPECT_THROW(makeShmBackend(options)(worker.smem), std::runtime_error);
+}
+
+// The games of one context are served by wait() / step() of another.
+TEST(ShmChannelTest, ContextServesGamesOfAnotherContext) {
+  constexpr int kNumGames = 6;
+  constexpr int kNumRequests = 50;
+  const ShmChannelOptions options = channelOptions();
+
+  struct Request {
+    float x[kDim] = {0, 0, 0};
+    float y = 0;
+  };
+  auto setup = [](Context* ctx) {
+    Extractor& e = ctx->getExtractor();
+    addFields(&e);
+    e.addClass<Request>()
+        .addFunction<float>(
+            "x",
+            [](const Request& r, float* p) { std::copy(r.x, r.x + kDim, p); })
+        .addFunction<float>("y", [](Request& r, const float* p) { r.y = *p; });
+  };
+
+  Context server;
+  setup(&server);
+  Batch server_batch(server.getExtractor());
+  SharedMem& server_smem = server.allocateSharedMem(
+      server.createSharedMemOptions("act", kBatchSize), {"x", "y"});
+  server_smem["x"]->setAddress(
+      (uint64_t)server_batch.x.data(), {kDim * sizeof(float), sizeof(float)});
+  server_smem["y"]->setAddress(
+      (uint64_t)server_batch.y.data(), {sizeof(float)});
+  server.setBatchSource("act", makeShmSource(options));
+  server.start();
+
+  Context worker;
+  setup(&worker);
+  Batch worker_batch(worker.getExtractor());
+  SharedMem& worker_smem = worker.allocateSharedMem(
+      worker.createSharedMemOptions("act", kBatchSize), {"x", "y"});
+  worker_smem["x"]->setAddress(
+      (uint64_t)worker_batch.x.data(), {kDim * sizeof(float), sizeof(float)});
+  worker_smem["y"]->setAddress(
+      (uint64_t)worker_batch.y.data(), {sizeof(float)});
+  worker.setInferenceBackend("act", makeShmBackend(options));
+
+  std::atomic<int> num_replies(0);
+  std::atomic<int> num_wrong(0);
+  worker.setStartCallback(kNumGames, [&](int game_idx, GameClient* client) {
+    for (int i = 0; !client->DoStopGames(); ++i) {
+      Request r;
+      r.x[0] = game_idx;
+      r.x[1] = i;
+      FuncsWithState funcs = client->BindStateToFunctions({"act"}, &r);
+      // Batches released by step() are not SUCCESS but UNKNOWN.
+      if (client->sendWait({"act"}, &funcs) != comm::FAILED) {
+        if (r.y != game_idx + i) {
+          num_wrong++;
+        }
+        num_replies++;
+      }
+    }
+  });
+  worker.start();
+
+  while (num_replies.load() < kNumGames * kNumRequests) {
+    const SharedMem* smem = server.wait(1000);
+    if (smem == nullptr) {
+      continue;
+    }
+    for (size_t i = 0; i < smem->getEffectiveBatchSize(); ++i) {
+      server_batch.y[i] = server_batch.x[i * kDim] +
+          server_batch.x[i * kDim + 1] + server_batch.x[i * kDim + 2];
+    }
+    server.step();
+  }
+
+  EXPECT_EQ(num_wrong.load(), 0);
+
+  // Releases the last requests of the games (unserved) while they stop.
+  std::thread stopper([&]() { worker.stop(); });
+  server.stop();
+  stopper.join();
+}
+
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
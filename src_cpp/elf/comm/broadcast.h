@@ -8,15 +8,31 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <chrono>
+#include <cstdint>
+#include <deque>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "elf/concurrency/Counter.h"
 
 namespace comm {
 
+// Priority classes of the messages to a node; lower is more urgent.
+enum Priority {
+  PRIORITY_HIGH = 0,
+  PRIORITY_NORMAL,
+  PRIORITY_LOW,
+  NUM_PRIORITIES
+};
+
 template <
     typename Data,
     typename Reply,
@@ -37,6 +53,13 @@ struct MsgT {
   ServerToClient* to = nullptr;
   std::vector<Data> data;
   size_t base_idx = 0;
+  int priority = PRIORITY_NORMAL;
+  // Receivers that partition by key batch the messages of a key together
+  // (see WaitOptions::partition_by_key), e.g. of a model version.
+  int64_t key = -1;
+  // When the message was queued at its receiver (see WaitOptions::
+  // deadline_usec).
+  std::chrono::steady_clock::time_point enqueued;
 
   MsgT(ClientToServer* from, ServerToClient* to, const std::vector<Data>& in)
       : from(from), to(to), data(in) {}
@@ -54,7 +77,15 @@ struct WaitOptions {
   // If timeout_usec > 0, an incomplete batch of
   // size >= min_batchsize will be returned.
   int timeout_usec = 0;
-  bool min_batchsize = 0;
+  int min_batchsize = 0;
+  // If deadline_usec > 0, the batch is returned at most deadline_usec after
+  // its first message arrived, whatever its size.
+  int deadline_usec = 0;
+  // Share of the dequeues of each priority class when several are waiting.
+  std::array<int, NUM_PRIORITIES> priority_weights = {{16, 4, 1}};
+  // If set, a batch only has messages of the key of its first one; those of
+  // other keys are kept for the next batches, the oldest first.
+  bool partition_by_key = false;
 
   WaitOptions(int batchsize, int timeout_usec = 0, int min_batchsize = 0)
       : batchsize(batchsize),
@@ -65,6 +96,40 @@ struct WaitOptions {
     std::stringstream ss;
     ss << "[bs=" << batchsize << "][timeout_usec=" << timeout_usec
        << "][min_bs=" << min_batchsize << "]";
+    if (deadline_usec > 0) {
+      ss << "[deadline_usec=" << deadline_usec << "]";
+    }
+    if (partition_by_key) {
+      ss << "[by_key]";
+    }
+    ss << "[weights=" << priority_weights[0];
+    for (int i = 1; i < NUM_PRIORITIES; ++i) {
+      ss << "," << priority_weights[i];
+    }
+    ss << "]";
+    return ss.str();
+  }
+};
+
+struct QueueStats {
+  struct Class {
+    uint64_t enqueued = 0;
+    uint64_t dequeued = 0;
+    int64_t max_depth = 0;
+
+    int64_t depth() const {
+      return (int64_t)(enqueued - dequeued);
+    }
+  };
+  std::array<Class, NUM_PRIORITIES> classes;
+
+  std::string info() const {
+    std::stringstream ss;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+      const Class& c = classes[i];
+      ss << "[p" << i << ": depth=" << c.depth() << ", max=" << c.max_depth
+         << ", #dequeued=" << c.dequeued << "]";
+    }
     return ss.str();
   }
 };
@@ -82,24 +147,39 @@ class NodeT {
   using SendMsg = MsgT<Data, Reply, MyQueue, PartnerQueue>;
   using RecvMsg = MsgT<Reply, Data, PartnerQueue, MyQueue>;
 
+  // Sends the messages of a session; each receiver calls
+  // notifySessionInvite() once done with its message. Fails while replies of
+  // the last session are pending.
   bool startSession(const std::vector<SendMsg>& targets) {
-    if (n_ > 0) {
+    if (pending_.get() > 0) {
       return false;
     }
 
+    // Before the messages go, as their receivers may reply at once.
+    pending_.set(targets.size());
     for (const auto& pa : targets) {
-      pa.to->EnqueueMessage(SendMsg(this, pa.to, pa.data));
+      SendMsg msg(this, pa.to, pa.data);
+      msg.priority = pa.priority;
+      msg.key = pa.key;
+      pa.to->EnqueueMessage(std::move(msg));
     }
-
-    n_ = targets.size();
     return true;
   }
 
-  void waitSessionEnd(int timeout_usec = 0) {
-    (void)timeout_usec;
-    replyCount_.waitUntilCount(n_);
-    n_ = 0;
-    replyCount_.reset();
+  // Waits for the replies of the session, at most timeout_usec if > 0.
+  // Returns the number still pending, 0 once the session is complete. An
+  // incomplete session stays open: its late replies still count, and a later
+  // call waits for them.
+  int waitSessionEnd(int timeout_usec = 0) {
+    auto done = [](int n) { return n <= 0; };
+    if (timeout_usec > 0) {
+      return pending_.wait(done, std::chrono::microseconds(timeout_usec));
+    }
+    return pending_.wait(done);
+  }
+
+  int numPendingReplies() const {
+    return pending_.get();
   }
 
   bool waitSessionInvite(
@@ -110,17 +190,59 @@ class NodeT {
     messages->clear();
 
     size_t data_count = 0;
+    std::chrono::steady_clock::time_point deadline;
+    // With partition_by_key, the key of the batch once it has a message.
+    bool keyed = false;
+    int64_t key = -1;
+    // Once messages of other keys are parked, the batch only takes those
+    // already queued: it does not wait for its key while others are ready.
+    bool draining = false;
 
     while (true) {
       RecvMsg message;
+      const size_t room = opt.batchsize - data_count;
+
+      if (opt.partition_by_key && take_parked(keyed, key, &message)) {
+        // Parked by an earlier batch.
+      } else if (draining && (int)data_count >= opt.min_batchsize) {
+        if (!get_msg(opt, std::chrono::microseconds(0), room, &message))
+          break;
+      } else if (opt.deadline_usec > 0 && data_count > 0) {
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0 || !get_msg(opt, left, room, &message))
+          break;
+      } else {
+        bool use_timeout =
+            ((int)data_count >= opt.min_batchsize && opt.timeout_usec > 0);
+        if (!get_msg(opt, use_timeout, room, &message))
+          break;
+      }
+      if (data_count == 0) {
+        // From its arrival: it may have waited in the queue already.
+        deadline =
+            message.enqueued + std::chrono::microseconds(opt.deadline_usec);
+      }
 
-      bool use_timeout =
-          ((int)data_count >= opt.min_batchsize && opt.timeout_usec > 0);
-      if (!get_msg(opt, use_timeout, &message))
-        break;
+      if (opt.partition_by_key) {
+        if (!keyed) {
+          keyed = true;
+          key = message.key;
+        } else if (message.key != key) {
+          num_parked_[message.key]++;
+          parked_.push_back(std::move(message));
+          draining = true;
+          continue;
+        }
+      }
 
       if ((int)(message.data.size() + data_count) > opt.batchsize) {
-        unpop_msg(message);
+        if (opt.partition_by_key) {
+          num_parked_[message.key]++;
+          parked_.push_front(std::move(message));
+        } else {
+          inbox_.push_front(std::move(message));
+        }
         break;
       }
 
@@ -128,8 +250,8 @@ class NodeT {
       assert(!message.data.empty());
 
       message.base_idx = data_count;
-      messages->push_back(message);
       data_count += message.data.size();
+      messages->push_back(std::move(message));
 
       // LOG(INFO) << "Get a message, #m: "
       //           << data_count << std::endl;
@@ -141,47 +263,220 @@ class NodeT {
   }
 
   void notifySessionInvite() {
-    replyCount_.increment();
+    pending_.increment(-1);
   }
 
   void EnqueueMessage(RecvMsg&& msg) {
-    q_.push(msg);
+    const int p = msg.priority;
+    assert(p >= 0 && p < NUM_PRIORITIES);
+    Counters& c = counters_[p];
+    const int64_t depth = ++c.depth;
+    int64_t max_depth = c.max_depth.load(std::memory_order_relaxed);
+    while (depth > max_depth &&
+           !c.max_depth.compare_exchange_weak(max_depth, depth)) {
+    }
+    c.enqueued++;
+    msg.enqueued = std::chrono::steady_clock::now();
+    q_[p].push(msg);
+    ready_.push(p);
+  }
+
+  QueueStats getQueueStats() const {
+    QueueStats stats;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+      stats.classes[i].enqueued = counters_[i].enqueued.load();
+      stats.classes[i].dequeued = counters_[i].dequeued.load();
+      stats.classes[i].max_depth = counters_[i].max_depth.load();
+    }
+    return stats;
   }
 
  private:
-  int n_ = 0;
+  struct Counters {
+    std::atomic<uint64_t> enqueued{0};
+    std::atomic<uint64_t> dequeued{0};
+    std::atomic<int64_t> depth{0};
+    std::atomic<int64_t> max_depth{0};
+  };
+
+  // Replies pending for the current session.
+  elf::concurrency::AtomicCounter<int> pending_;
+
+  // Messages dequeued ahead of the batch taking them (a bulk dequeue, or one
+  // left out of a full batch), oldest first.
+  std::deque<RecvMsg> inbox_;
+  std::vector<int> tokens_;
+  std::vector<RecvMsg> bulk_;
+  // Dequeued messages of other keys than that of the batches they came in,
+  // oldest first (see WaitOptions::partition_by_key), and their number by
+  // key.
+  std::deque<RecvMsg> parked_;
+  std::unordered_map<int64_t, int> num_parked_;
+  // Concurrent Queues, one per priority class. ready_ gets the class of
+  // every message after it is pushed, so that a single blocking pop waits
+  // for all of them.
+  std::array<MyQueue<RecvMsg>, NUM_PRIORITIES> q_;
+  MyQueue<int> ready_;
+  std::array<Counters, NUM_PRIORITIES> counters_;
+  // Weighted fair dequeue (stride scheduling): a class served moves its pass
+  // 1 / weight ahead, and the waiting class with the smallest pass goes
+  // next. A class that was idle restarts from the pass of the last one
+  // served, so it does not get credit for the idle time.
+  std::array<double, NUM_PRIORITIES> pass_ = {};
+  double vtime_ = 0;
+
+  // The oldest parked message, of key if keyed.
+  bool take_parked(bool keyed, int64_t key, RecvMsg* msg) {
+    if (parked_.empty()) {
+      return false;
+    }
+    auto it = parked_.begin();
+    if (keyed) {
+      auto n = num_parked_.find(key);
+      if (n == num_parked_.end() || n->second == 0) {
+        return false;
+      }
+      while (it->key != key) {
+        ++it;
+      }
+    }
+    *msg = std::move(*it);
+    parked_.erase(it);
+    if (--num_parked_[msg->key] == 0) {
+      num_parked_.erase(msg->key);
+    }
+    return true;
+  }
 
-  RecvMsg unprocessed_msg_;
-  // Concurrent Queue.
-  MyQueue<RecvMsg> q_;
+  // The next message, waiting at most timeout for it. The messages already
+  // queued are dequeued with it in bulk, up to room.
+  bool get_msg(
+      const WaitOptions& opt,
+      std::chrono::microseconds timeout,
+      size_t room,
+      RecvMsg* msg) {
+    if (inbox_.empty()) {
+      int p;
+      if (!ready_.pop(&p, timeout)) {
+        return false;
+      }
+      take_msgs(opt, room);
+    }
+    *msg = std::move(inbox_.front());
+    inbox_.pop_front();
+    return true;
+  }
+
+  bool get_msg(
+      const WaitOptions& opt,
+      bool use_timeout,
+      size_t room,
+      RecvMsg* msg) {
+    if (use_timeout) {
+      return get_msg(
+          opt, std::chrono::microseconds(opt.timeout_usec), room, msg);
+    }
+    if (inbox_.empty()) {
+      // This will block.
+      int p;
+      ready_.pop(&p);
+      take_msgs(opt, room);
+    }
+    *msg = std::move(inbox_.front());
+    inbox_.pop_front();
+    return true;
+  }
+
+  // Once a token was popped from ready_, takes those of up to room - 1 more
+  // messages, and dequeues them all to inbox_: a bulk dequeue per class, in
+  // the shares the weighted fair dequeue would give them one by one.
+  void take_msgs(const WaitOptions& opt, size_t room) {
+    size_t n = 1;
+    if (room > 1) {
+      tokens_.resize(room - 1);
+      n += ready_.tryPopBulk(tokens_.data(), room - 1);
+    }
+    if (n == 1) {
+      inbox_.emplace_back();
+      take_msg(opt, &inbox_.back());
+      return;
+    }
 
-  elf::concurrency::Counter<int> replyCount_;
+    std::array<size_t, NUM_PRIORITIES> counts = {};
+    std::array<int64_t, NUM_PRIORITIES> depths;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+      depths[i] = counters_[i].depth.load();
+    }
+    size_t planned = 0;
+    for (; planned < n; ++planned) {
+      const int p = next_class(opt, depths);
+      if (p < 0) {
+        break;
+      }
+      depths[p]--;
+      counts[p]++;
+    }
+    for (int p = 0; p < NUM_PRIORITIES; ++p) {
+      if (counts[p] == 0) {
+        continue;
+      }
+      bulk_.resize(counts[p]);
+      const size_t got = q_[p].tryPopBulk(bulk_.data(), counts[p]);
+      counters_[p].depth -= got;
+      counters_[p].dequeued += got;
+      for (size_t i = 0; i < got; ++i) {
+        inbox_.push_back(std::move(bulk_[i]));
+      }
+      // Those counted but not pushed yet are taken below, one by one.
+      planned -= counts[p] - got;
+    }
+    for (; planned < n; ++planned) {
+      inbox_.emplace_back();
+      take_msg(opt, &inbox_.back());
+    }
+  }
 
-  void unpop_msg(const RecvMsg& msg) {
-    assert(unprocessed_msg_.data.empty());
-    unprocessed_msg_ = msg;
+  // The class the weighted fair dequeue serves next among those of
+  // depths > 0, -1 if none; moves its pass ahead.
+  int next_class(
+      const WaitOptions& opt,
+      const std::array<int64_t, NUM_PRIORITIES>& depths) {
+    int best = -1;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+      pass_[i] = std::max(pass_[i], vtime_);
+      if (depths[i] > 0 && (best < 0 || pass_[i] < pass_[best])) {
+        best = i;
+      }
+    }
+    if (best >= 0) {
+      vtime_ = pass_[best];
+      pass_[best] += 1.0 / std::max(1, opt.priority_weights[best]);
+    }
+    return best;
   }
 
-  bool get_msg(const WaitOptions& opt, bool use_timeout, RecvMsg* msg) {
-    if (!unprocessed_msg_.data.empty()) {
-      *msg = unprocessed_msg_;
-      unprocessed_msg_.data.clear();
-      return true;
+  // Dequeues a message after its token was popped from ready_: one of the
+  // queues has it, or soon will.
+  void take_msg(const WaitOptions& opt, RecvMsg* msg) {
+    std::array<int, NUM_PRIORITIES> order;
+    for (int i = 0; i < NUM_PRIORITIES; ++i) {
+      order[i] = i;
+      pass_[i] = std::max(pass_[i], vtime_);
     }
-    if (use_timeout) {
-      // use timeout.
-      // LOG(INFO) << "Timeout. " << hex << this
-      //           << dec
-      //           << ", opt.timeout_usec = "
-      //           << opt.timeout_usec
-      //           << ", messages->size() = "
-      //           << messages->size()
-      //           << std::endl;
-      return q_.pop(msg, std::chrono::microseconds(opt.timeout_usec));
-    } else {
-      // This will block.
-      q_.pop(msg);
-      return true;
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+      return pass_[a] < pass_[b];
+    });
+    while (true) {
+      for (int p : order) {
+        if (counters_[p].depth.load() > 0 &&
+            q_[p].pop(msg, std::chrono::microseconds(0))) {
+          counters_[p].depth--;
+          counters_[p].dequeued++;
+          vtime_ = pass_[p];
+          pass_[p] += 1.0 / std::max(1, opt.priority_weights[p]);
+          return;
+        }
+      }
     }
   }
 };
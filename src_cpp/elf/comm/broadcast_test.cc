@@ -0,0 +1,189 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "broadcast.h"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+
+namespace comm {
+
+using Node = NodeT<
+    int,
+    int,
+    elf::concurrency::ConcurrentQueue,
+    elf::concurrency::ConcurrentQueue>;
+using Msg = Node::RecvMsg;
+
+namespace {
+
+void enqueue(Node* node, int priority, int n) {
+  for (int i = 0; i < n; ++i) {
+    Msg msg(nullptr, node, priority);
+    msg.priority = priority;
+    node->EnqueueMessage(std::move(msg));
+  }
+}
+
+// Number of messages of each priority in a batch of batchsize.
+std::array<int, NUM_PRIORITIES> waitBatch(Node* node, int batchsize) {
+  std::vector<Msg> batch;
+  node->waitSessionInvite(WaitOptions(batchsize), &batch);
+  std::array<int, NUM_PRIORITIES> counts = {};
+  for (const Msg& msg : batch) {
+    counts[msg.priority]++;
+  }
+  return counts;
+}
+
+} // namespace
+
+TEST(NodeTest, WeightedFairDequeue) {
+  Node node;
+  enqueue(&node, PRIORITY_LOW, 40);
+  enqueue(&node, PRIORITY_HIGH, 40);
+
+  // Weights 16:1, while both are waiting.
+  auto counts = waitBatch(&node, 17);
+  EXPECT_EQ(counts[PRIORITY_HIGH], 16);
+  EXPECT_EQ(counts[PRIORITY_LOW], 1);
+
+  counts = waitBatch(&node, 34);
+  EXPECT_EQ(counts[PRIORITY_HIGH], 24);
+  EXPECT_EQ(counts[PRIORITY_LOW], 10);
+
+  // Then the low priority messages alone.
+  counts = waitBatch(&node, 29);
+  EXPECT_EQ(counts[PRIORITY_LOW], 29);
+}
+
+TEST(NodeTest, IdleClassGetsNoCredit) {
+  Node node;
+  enqueue(&node, PRIORITY_LOW, 20);
+  waitBatch(&node, 20);
+
+  enqueue(&node, PRIORITY_LOW, 20);
+  enqueue(&node, PRIORITY_NORMAL, 20);
+  // 4:1 from where the low priority class is, rather than all the normal
+  // priority messages first to catch up.
+  auto counts = waitBatch(&node, 10);
+  EXPECT_EQ(counts[PRIORITY_NORMAL], 9);
+  EXPECT_EQ(counts[PRIORITY_LOW], 1);
+}
+
+TEST(NodeTest, PartitionsByKey) {
+  Node node;
+  for (int key : {1, 2, 1, 2, 1, 1, 3}) {
+    Msg msg(nullptr, &node, key);
+    msg.key = key;
+    node.EnqueueMessage(std::move(msg));
+  }
+  WaitOptions opt(4, 1000);
+  opt.partition_by_key = true;
+  auto keys = [&]() {
+    std::vector<Msg> batch;
+    node.waitSessionInvite(opt, &batch);
+    std::vector<int64_t> res;
+    for (const Msg& msg : batch) {
+      EXPECT_EQ(msg.data[0], msg.key);
+      res.push_back(msg.key);
+    }
+    return res;
+  };
+  EXPECT_EQ(keys(), std::vector<int64_t>({1, 1, 1, 1}));
+  // Those parked, the oldest key first.
+  EXPECT_EQ(keys(), std::vector<int64_t>({2, 2}));
+  EXPECT_EQ(keys(), std::vector<int64_t>({3}));
+
+  // Without timeout, a batch does not wait for its key while others are
+  // ready.
+  for (int key : {1, 2, 1}) {
+    Msg msg(nullptr, &node, key);
+    msg.key = key;
+    node.EnqueueMessage(std::move(msg));
+  }
+  opt.timeout_usec = 0;
+  EXPECT_EQ(keys(), std::vector<int64_t>({1, 1}));
+}
+
+TEST(NodeTest, BatchesFromBulkDequeue) {
+  Node node;
+  enqueue(&node, PRIORITY_NORMAL, 3);
+  // A message of 3 does not fit in what is left of the first batch: it
+  // starts the next one, ahead of those queued after it.
+  Msg big(nullptr, &node, std::vector<int>{7, 7, 7});
+  node.EnqueueMessage(std::move(big));
+  enqueue(&node, PRIORITY_NORMAL, 2);
+
+  std::vector<Msg> batch;
+  node.waitSessionInvite(WaitOptions(4), &batch);
+  ASSERT_EQ(batch.size(), 3u);
+  EXPECT_EQ(batch[2].base_idx, 2u);
+
+  node.waitSessionInvite(WaitOptions(4, 1000), &batch);
+  ASSERT_EQ(batch.size(), 2u);
+  EXPECT_EQ(batch[0].data.size(), 3u);
+  EXPECT_EQ(batch[1].base_idx, 3u);
+
+  node.waitSessionInvite(WaitOptions(4, 1000), &batch);
+  EXPECT_EQ(batch.size(), 1u);
+  node.waitSessionInvite(WaitOptions(4, 1000), &batch);
+  EXPECT_TRUE(batch.empty());
+  EXPECT_EQ(node.getQueueStats().classes[PRIORITY_NORMAL].depth(), 0);
+}
+
+TEST(NodeTest, SessionEndTimesOut) {
+  Node sender;
+  Node receiver;
+  std::vector<Msg> targets;
+  for (int i = 0; i < 3; ++i) {
+    targets.emplace_back(&sender, &receiver, i);
+  }
+  ASSERT_TRUE(sender.startSession(targets));
+
+  std::vector<Msg> batch;
+  receiver.waitSessionInvite(WaitOptions(3), &batch);
+  ASSERT_EQ(batch.size(), 3u);
+  batch[0].from->notifySessionInvite();
+  batch[1].from->notifySessionInvite();
+
+  // One straggler: the session is left open.
+  EXPECT_EQ(sender.waitSessionEnd(1000), 1);
+  EXPECT_EQ(sender.numPendingReplies(), 1);
+  EXPECT_FALSE(sender.startSession(targets));
+
+  std::thread straggler([&]() { batch[2].from->notifySessionInvite(); });
+  EXPECT_EQ(sender.waitSessionEnd(), 0);
+  straggler.join();
+  EXPECT_TRUE(sender.startSession({}));
+}
+
+TEST(NodeTest, QueueStats) {
+  Node node;
+  enqueue(&node, PRIORITY_HIGH, 3);
+  enqueue(&node, PRIORITY_NORMAL, 5);
+  waitBatch(&node, 4);
+
+  QueueStats stats = node.getQueueStats();
+  EXPECT_EQ(stats.classes[PRIORITY_HIGH].depth(), 0);
+  EXPECT_EQ(stats.classes[PRIORITY_HIGH].max_depth, 3);
+  EXPECT_EQ(stats.classes[PRIORITY_NORMAL].dequeued, 1u);
+  EXPECT_EQ(stats.classes[PRIORITY_NORMAL].depth(), 4);
+  EXPECT_EQ(stats.classes[PRIORITY_NORMAL].max_depth, 5);
+  EXPECT_EQ(stats.classes[PRIORITY_LOW].enqueued, 0u);
+}
+
+} // namespace comm
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,18 +8,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <tbb/concurrent_hash_map.h>
 
+#include "elf/concurrency/Fiber.h"
 #include "elf/concurrency/TBBHashers.h"
+#include "elf/tracing/Trace.h"
 
 #include "broadcast.h"
 
@@ -114,14 +120,22 @@ class CommInternalT {
     // data and reply can point to an identical object, since the previous reply
     // can be resent
     // (e.g., the action returned from the reply will be sent for training).
-    ReplyStatus sendWait(Id id, const std::vector<Id>& server_ids, Data data) {
-      return sendBatchWait(id, server_ids, std::vector<Data>{data});
+    ReplyStatus sendWait(
+        Id id,
+        const std::vector<Id>& server_ids,
+        Data data,
+        int priority = PRIORITY_NORMAL,
+        int64_t key = -1) {
+      return sendBatchWait(
+          id, server_ids, std::vector<Data>{data}, priority, key);
     }
 
     ReplyStatus sendBatchWait(
         Id id,
         const std::vector<Id>& server_ids,
-        const std::vector<Data>& data) {
+        const std::vector<Data>& data,
+        int priority = PRIORITY_NORMAL,
+        int64_t key = -1) {
       assert(!data.empty());
       // Find server that could accept this task.
       std::vector<ClientToServerMsg> messages;
@@ -131,6 +145,8 @@ class CommInternalT {
         // LOG(INFO) <<  "Send to server " << hex
         //           << server << dec << std::endl;
         messages.push_back(ClientToServerMsg(node, server, data));
+        messages.back().priority = priority;
+        messages.back().key = key;
       }
       node->startSession(messages);
 
@@ -140,6 +156,7 @@ class CommInternalT {
       // Wait batchsize 1, indefinitely.
       ReplyStatus final_status = UNKNOWN;
       if (kExpectReply) {
+        ELF_TRACE_SPAN("comm", "waitReply");
         final_status = SUCCESS;
 
         WaitOptions opt(1);
@@ -188,6 +205,25 @@ class CommInternalT {
       return node->waitSessionInvite(opt, batch);
     }
 
+    // Same, but takes the messages sent to queue_id; server id replies to and
+    // releases them. Waits on the same queue_id must not be concurrent.
+    bool waitBatch(
+        Id id,
+        Id queue_id,
+        const WaitOptions& opt,
+        std::vector<ClientToServerMsg>* batch) {
+      ServerNode* node = p_->server(id);
+      bool res = p_->server(queue_id)->waitSessionInvite(opt, batch);
+      for (ClientToServerMsg& message : *batch) {
+        message.to = node;
+      }
+      return res;
+    }
+
+    QueueStats getQueueStats(Id id) {
+      return p_->server(id)->getQueueStats();
+    }
+
    public:
     explicit Server(CommInternal* p) : p_(p) {}
 
@@ -198,6 +234,7 @@ class CommInternalT {
         return true;
       }
 
+      ELF_TRACE_SPAN("comm", "sendClosuresWaitDone");
       ServerNode* node = messages[0].to;
       // assert(node != nullptr);
 
@@ -271,11 +308,24 @@ struct SendOptions {
   // Then the message will be sent to (1, 2), (1, 4), (2, 3), (3, 4)
   // with equal probability.
   std::vector<std::string> labels;
+  // Priority class of the msg at the receivers; see
+  // WaitOptions::priority_weights.
+  int priority = PRIORITY_NORMAL;
+  // Partition key of the msg at the receivers; see
+  // WaitOptions::partition_by_key.
+  int64_t key = -1;
+
+  SendOptions(
+      const std::vector<std::string>& labels,
+      int priority = PRIORITY_NORMAL,
+      int64_t key = -1)
+      : labels(labels), priority(priority), key(key) {}
 };
 
 struct RecvOptions {
   // A receiver will only honor messags that matches its label
   std::string label;
+  // Also sets how the priority classes of the messages share the receiver.
   WaitOptions wait_opt;
 
   RecvOptions(
@@ -289,30 +339,36 @@ struct RecvOptions {
 ///
 /// Adds capability of grouping server by their levels and some simple routing
 ///
-///  1. Each server or client id is the current thread id. If a new thread
-///     calls `Client::sendwait`, it's thread id will be registered
-///     automatically.
+///  1. Each server or client id is the current thread id (the fiber id, in a
+///     fiber; see `getExecutionId`). If a new thread calls `Client::sendwait`,
+///     it's thread id will be registered automatically.
 ///  2. A server has a label associated with it that is be registered via
 ///     `RegServer`
 ///  3. When the Client call `sendWait`. it also needs to specify a set of
 ///     server labels. If there are multiple servers with the same label,
 ///     a server is chosen by uniform random sampling.
+///  4. Unless the servers registered a device (e.g., the gpu serving their
+///     batches): then the message goes to the server of the label whose
+///     device would be done with it first, given the requests in flight on
+///     the device and its service time per request, as reported by its
+///     servers (`reportServed`). The labels served on the same devices thus
+///     share them by their load.
 template <
     typename Data,
     bool kExpectReply,
     template <typename> class ClientQueue,
     template <typename> class ServerQueue>
 class CommT : public CommInternalT<
-                  std::thread::id,
+                  elf::concurrency::ExecutionId,
                   Data,
                   kExpectReply,
                   ClientQueue,
                   ServerQueue> {
  public:
-  using Id = std::thread::id;
+  using Id = elf::concurrency::ExecutionId;
   using Comm = CommT<Data, kExpectReply, ClientQueue, ServerQueue>;
   using CommInternal = CommInternalT<
-      std::thread::id,
+      elf::concurrency::ExecutionId,
       Data,
       kExpectReply,
       ClientQueue,
@@ -320,28 +376,59 @@ class CommT : public CommInternalT<
   using Message = typename CommInternal::ClientToServerMsg;
   using Function = typename CommInternal::ReplyFunction;
 
+  struct DeviceStats {
+    int device = -1;
+    float capacity = 0;
+    // Requests routed to the device and not served yet.
+    int64_t inflight = 0;
+    // Requests served so far.
+    uint64_t served = 0;
+    float usec_per_request = 0;
+  };
+
   class Client : public CommInternal::Client {
    public:
     explicit Client(Comm* pp)
         : CommInternal::Client(pp), pp_(pp), rng_(time(NULL)) {}
 
     ReplyStatus sendWait(Data data, const std::vector<std::string>& labels) {
+      return sendWait(data, SendOptions(labels));
+    }
+
+    ReplyStatus sendWait(Data data, const SendOptions& options) {
       return CommInternal::Client::sendWait(
-          std::this_thread::get_id(), label2server(labels), data);
+          elf::concurrency::getExecutionId(),
+          label2server(options.labels, 1),
+          data,
+          options.priority,
+          options.key);
     }
 
     ReplyStatus sendBatchWait(
         const std::vector<Data>& data,
         const std::vector<std::string>& labels) {
+      return sendBatchWait(data, SendOptions(labels));
+    }
+
+    ReplyStatus sendBatchWait(
+        const std::vector<Data>& data,
+        const SendOptions& options) {
       return CommInternal::Client::sendBatchWait(
-          std::this_thread::get_id(), label2server(labels), data);
+          elf::concurrency::getExecutionId(),
+          label2server(options.labels, data.size()),
+          data,
+          options.priority,
+          options.key);
     }
 
    private:
     Comm* pp_;
     std::mt19937 rng_;
 
-    std::vector<Id> label2server(const std::vector<std::string>& labels) {
+    // n: the number of requests, charged to the devices of the servers.
+    std::vector<Id> label2server(
+        const std::vector<std::string>& labels,
+        size_t n) {
       assert(!labels.empty());
       std::vector<Id> server_ids;
 
@@ -353,12 +440,27 @@ class CommT : public CommInternalT<
           std::cout << "WARNING! no servers has the label: " << label
                     << std::endl;
         } else {
-          const std::vector<Id>& ids = *(elem->second);
+          const std::vector<Route>& routes = *(elem->second);
           // Randomly pick one of the label.
           // Note that there is no lock needed since only
           // read access is requested.
-          const int idx = rng_() % ids.size();
-          server_ids.push_back(ids.at(idx));
+          const size_t start = rng_() % routes.size();
+          size_t idx = start;
+          if (routes[idx].device != nullptr) {
+            // The least loaded device; of its servers, the first from the
+            // random one.
+            float best = routes[idx].device->cost(n);
+            for (size_t k = 1; k < routes.size(); ++k) {
+              const size_t i = (start + k) % routes.size();
+              const float cost = routes[i].device->cost(n);
+              if (cost < best) {
+                best = cost;
+                idx = i;
+              }
+            }
+            routes[idx].device->inflight += n;
+          }
+          server_ids.push_back(routes[idx].id);
         }
       }
 
@@ -371,14 +473,54 @@ class CommT : public CommInternalT<
     explicit Server(Comm* pp) : CommInternal::Server(pp), pp_(pp) {}
 
     // TODO: Put these logic to a separate place.
-    void RegServer(const std::string& label) {
+    // The pooled servers of a label share one queue: clients send to the
+    // first of them, and whichever is free next takes the next batch.
+    //
+    // A server with a device (>= 0) is routed to by the load of the device
+    // (see above); the servers of a label either all have one or none has.
+    // Pooled servers are then pooled per device. capacity is the relative
+    // speed of the device, until its servers report their service times.
+    void RegServer(
+        const std::string& label,
+        bool pooled = false,
+        int device = -1,
+        float capacity = 1.0) {
       std::lock_guard<std::mutex> lock(pp_->register_mutex_);
-      ServerLabelMap::accessor elem;
-      bool uninitialized = pp_->serverLabels_.insert(elem, label);
-      if (uninitialized) {
-        elem->second.reset(new std::vector<Id>());
+      const Id id = elf::concurrency::getExecutionId();
+      DeviceLoad* load = nullptr;
+      if (device >= 0) {
+        auto& d = pp_->devices_[device];
+        if (d == nullptr) {
+          d.reset(new DeviceLoad(device, capacity));
+        }
+        load = d.get();
+        typename ServerDeviceMap::accessor elem;
+        pp_->serverDevices_.insert(elem, id);
+        elem->second = load;
+      }
+      bool listed = true;
+      if (pooled) {
+        auto& pool = pp_->pools_
+            [device >= 0 ? label + "@" + std::to_string(device) : label];
+        listed = pool == nullptr;
+        if (pool == nullptr) {
+          pool.reset(new Pool());
+          pool->queue_id = id;
+        }
+        typename ServerPoolMap::accessor elem;
+        pp_->serverPools_.insert(elem, id);
+        elem->second = pool.get();
+      }
+      if (listed) {
+        typename ServerLabelMap::accessor elem;
+        bool uninitialized = pp_->serverLabels_.insert(elem, label);
+        if (uninitialized) {
+          elem->second.reset(new std::vector<Route>());
+        }
+        assert(elem->second->empty() ||
+               (elem->second->front().device == nullptr) == (load == nullptr));
+        elem->second->push_back(Route{id, load});
       }
-      elem->second->push_back(std::this_thread::get_id());
       counter_.increment();
     }
 
@@ -388,8 +530,51 @@ class CommT : public CommInternalT<
     }
 
     bool waitBatch(const RecvOptions& options, std::vector<Message>* batch) {
+      const Id id = elf::concurrency::getExecutionId();
+      Pool* pool = pp_->pool(id);
+      if (pool == nullptr) {
+        return CommInternal::Server::waitBatch(id, options.wait_opt, batch);
+      }
+      std::lock_guard<std::mutex> lock(pool->mutex);
       return CommInternal::Server::waitBatch(
-          std::this_thread::get_id(), options.wait_opt, batch);
+          id, pool->queue_id, options.wait_opt, batch);
+    }
+
+    // Called by the calling thread's server once it has served n requests
+    // in usec (the time the device took): they are no longer in flight on
+    // its device, whose service time per request follows. Does nothing if
+    // the server has no device.
+    void reportServed(size_t n, int64_t usec) {
+      DeviceLoad* load = pp_->device(elf::concurrency::getExecutionId());
+      if (load == nullptr || n == 0) {
+        return;
+      }
+      load->inflight -= n;
+      load->served += n;
+      // Racy between the servers of the device, which only blurs the
+      // average.
+      const float per_request = std::max((float)usec / n, kMinUsecPerRequest);
+      load->usec_per_request = load->usec_per_request.load() * (1 - kAlpha) +
+          per_request * kAlpha;
+    }
+
+    // Of the device of the calling thread's server; false if none.
+    bool getDeviceStats(DeviceStats* stats) {
+      DeviceLoad* load = pp_->device(elf::concurrency::getExecutionId());
+      if (load == nullptr) {
+        return false;
+      }
+      *stats = load->stats();
+      return true;
+    }
+
+    // Per-priority queue depths of the calling thread's server (of its pool,
+    // if pooled).
+    QueueStats getQueueStats() {
+      const Id id = elf::concurrency::getExecutionId();
+      Pool* pool = pp_->pool(id);
+      return CommInternal::Server::getQueueStats(
+          pool == nullptr ? id : pool->queue_id);
     }
 
    private:
@@ -397,6 +582,22 @@ class CommT : public CommInternalT<
     elf::concurrency::Counter<int> counter_;
   };
 
+  // Of the devices of the servers registered so far, by device.
+  std::vector<DeviceStats> getDeviceStats() {
+    std::lock_guard<std::mutex> lock(register_mutex_);
+    std::vector<DeviceStats> stats;
+    for (const auto& d : devices_) {
+      stats.push_back(d.second->stats());
+    }
+    std::sort(
+        stats.begin(),
+        stats.end(),
+        [](const DeviceStats& a, const DeviceStats& b) {
+          return a.device < b.device;
+        });
+    return stats;
+  }
+
   // Create and return a client object
   std::unique_ptr<Client> getClient() {
     return std::unique_ptr<Client>(new Client(this));
@@ -408,11 +609,77 @@ class CommT : public CommInternalT<
   }
 
  private:
-  using ServerLabelMap =
-      tbb::concurrent_hash_map<std::string, std::unique_ptr<std::vector<Id>>>;
+  struct Pool {
+    Id queue_id;
+    // Held by the server filling a batch from the queue.
+    std::mutex mutex;
+  };
+
+  // Service time per request of a device before any is reported, at
+  // capacity 1; and how fast the reported ones are followed.
+  static constexpr float kInitialUsecPerRequest = 100;
+  static constexpr float kMinUsecPerRequest = 0.01;
+  static constexpr float kAlpha = 0.1;
+
+  struct DeviceLoad {
+    const int device;
+    const float capacity;
+    std::atomic<int64_t> inflight{0};
+    std::atomic<uint64_t> served{0};
+    std::atomic<float> usec_per_request;
+
+    DeviceLoad(int device, float capacity)
+        : device(device),
+          capacity(capacity),
+          usec_per_request(
+              kInitialUsecPerRequest / std::max(capacity, 1e-3f)) {}
+
+    DeviceStats stats() const {
+      DeviceStats s;
+      s.device = device;
+      s.capacity = capacity;
+      s.inflight = inflight.load();
+      s.served = served.load();
+      s.usec_per_request = usec_per_request.load();
+      return s;
+    }
+
+    // When n more requests would be served.
+    float cost(size_t n) const {
+      return (std::max(inflight.load(), (int64_t)0) + n) *
+          usec_per_request.load();
+    }
+  };
+
+  struct Route {
+    Id id;
+    // Of the server, if any.
+    DeviceLoad* device;
+  };
+
+  using ServerLabelMap = tbb::
+      concurrent_hash_map<std::string, std::unique_ptr<std::vector<Route>>>;
+  using ServerPoolMap = tbb::concurrent_hash_map<Id, Pool*>;
+  using ServerDeviceMap = tbb::concurrent_hash_map<Id, DeviceLoad*>;
 
   ServerLabelMap serverLabels_;
   std::mutex register_mutex_;
+  // Pools by label (and device), and the pool of each pooled server.
+  std::unordered_map<std::string, std::unique_ptr<Pool>> pools_;
+  ServerPoolMap serverPools_;
+  // Devices, and the device of each server that has one.
+  std::unordered_map<int, std::unique_ptr<DeviceLoad>> devices_;
+  ServerDeviceMap serverDevices_;
+
+  DeviceLoad* device(Id id) const {
+    typename ServerDeviceMap::const_accessor elem;
+    return serverDevices_.find(elem, id) ? elem->second : nullptr;
+  }
+
+  Pool* pool(Id id) const {
+    typename ServerPoolMap::const_accessor elem;
+    return serverPools_.find(elem, id) ? elem->second : nullptr;
+  }
 };
 
 } // namespace comm
@@ -0,0 +1,243 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "comm.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+#include "elf/concurrency/Fiber.h"
+
+namespace comm {
+
+using Comm = CommT<
+    int,
+    true,
+    elf::concurrency::ConcurrentQueue,
+    elf::concurrency::ConcurrentQueue>;
+
+// While the first pooled server holds a batch, the second one serves the
+// next requests from the same queue.
+TEST(CommTest, PooledServersShareQueue) {
+  const int kNumClients = 2;
+  const int kNumRequests = 50;
+  Comm comm;
+  auto server = comm.getServer();
+  std::atomic<bool> first_registered(false);
+  std::atomic<bool> done(false);
+  std::atomic<int> served[2];
+  served[0] = served[1] = 0;
+  bool second_served_meanwhile = false;
+
+  std::vector<std::thread> servers;
+  for (int i = 0; i < 2; ++i) {
+    servers.emplace_back([&, i]() {
+      // The first one to register owns the queue.
+      while (i > 0 && !first_registered) {
+        std::this_thread::yield();
+      }
+      server->RegServer("a", true);
+      first_registered = true;
+
+      RecvOptions options("a", 1, 1000, 0);
+      std::vector<Comm::Message> batch;
+      while (!done) {
+        server->waitBatch(options, &batch);
+        if (batch.empty()) {
+          continue;
+        }
+        if (served[i]++ == 0 && i == 0) {
+          auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+          while (served[1] == 0 && std::chrono::steady_clock::now() < end) {
+            std::this_thread::yield();
+          }
+          second_served_meanwhile = served[1] > 0;
+        }
+        server->ReleaseBatch(batch, SUCCESS);
+      }
+    });
+  }
+  server->waitForRegs(2);
+
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kNumClients; ++i) {
+    clients.emplace_back([&]() {
+      auto client = comm.getClient();
+      for (int j = 0; j < kNumRequests; ++j) {
+        EXPECT_EQ(client->sendWait(j, {"a"}), SUCCESS);
+      }
+    });
+  }
+  for (auto& th : clients) {
+    th.join();
+  }
+  done = true;
+  for (auto& th : servers) {
+    th.join();
+  }
+
+  EXPECT_TRUE(second_served_meanwhile);
+  EXPECT_EQ(served[0] + served[1], kNumClients * kNumRequests);
+}
+
+// The deadline of a batch runs from the arrival of its first request, not
+// from when the server gets to it.
+TEST(CommTest, DeadlineFromArrival) {
+  Comm comm;
+  auto server = comm.getServer();
+  server->RegServer("a");
+  server->waitForRegs(1);
+
+  std::thread client([&]() {
+    EXPECT_EQ(comm.getClient()->sendWait(1, {"a"}), SUCCESS);
+  });
+  // Longer than the deadline, which is over by the time the server waits.
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  RecvOptions options("a", 4, 0, 4);
+  options.wait_opt.deadline_usec = 200000;
+  std::vector<Comm::Message> batch;
+  const auto start = std::chrono::steady_clock::now();
+  server->waitBatch(options, &batch);
+  EXPECT_LT(
+      std::chrono::steady_clock::now() - start,
+      std::chrono::milliseconds(100));
+  ASSERT_EQ(batch.size(), 1u);
+  server->ReleaseBatch(batch, SUCCESS);
+  client.join();
+}
+
+// Clients that are fibers of one thread wait for their replies each on its
+// own node, and the server batches their requests.
+TEST(CommTest, FiberClients) {
+  const int kNumClients = 64;
+  const int kNumRequests = 20;
+  using FiberComm = CommT<
+      int,
+      true,
+      elf::concurrency::ConcurrentQueueFutex,
+      elf::concurrency::ConcurrentQueue>;
+  FiberComm comm;
+  auto server = comm.getServer();
+  std::atomic<bool> done(false);
+  int num_served = 0;
+  size_t max_batch = 0;
+
+  std::thread server_thread([&]() {
+    server->RegServer("a");
+    RecvOptions options("a", kNumClients, 1000, 0);
+    std::vector<FiberComm::Message> batch;
+    while (!done) {
+      server->waitBatch(options, &batch);
+      num_served += batch.size();
+      max_batch = std::max(max_batch, batch.size());
+      server->ReleaseBatch(batch, SUCCESS);
+    }
+  });
+  server->waitForRegs(1);
+
+  {
+    elf::concurrency::FiberPool pool(1);
+    auto client = comm.getClient();
+    for (int i = 0; i < kNumClients; ++i) {
+      pool.spawn([&]() {
+        for (int j = 0; j < kNumRequests; ++j) {
+          EXPECT_EQ(client->sendWait(j, {"a"}), SUCCESS);
+        }
+      });
+    }
+    pool.join();
+  }
+  done = true;
+  server_thread.join();
+
+  EXPECT_EQ(num_served, kNumClients * kNumRequests);
+  EXPECT_GT(max_batch, 1u);
+}
+
+// Of two devices serving a label, the slower one gets fewer requests, as
+// does the one with less capacity before any are served; and all are served
+// in the end.
+TEST(CommTest, RoutesByDeviceLoad) {
+  const int kNumClients = 8;
+  const int kNumRequests = 100;
+  Comm comm;
+  auto server = comm.getServer();
+  std::atomic<bool> done(false);
+  std::atomic<int> served[2];
+  served[0] = served[1] = 0;
+
+  std::vector<std::thread> servers;
+  for (int i = 0; i < 2; ++i) {
+    servers.emplace_back([&, i]() {
+      server->RegServer("a", false, i, i == 0 ? 1.0 : 0.5);
+      RecvOptions options("a", kNumClients, 100, 0);
+      std::vector<Comm::Message> batch;
+      while (!done) {
+        server->waitBatch(options, &batch);
+        if (batch.empty()) {
+          continue;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        // Device 1 takes 5 times as long.
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            i == 0 ? 200 : 1000));
+        served[i] += batch.size();
+        server->reportServed(
+            batch.size(),
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+        server->ReleaseBatch(batch, SUCCESS);
+      }
+    });
+  }
+  server->waitForRegs(2);
+
+  auto stats = comm.getDeviceStats();
+  ASSERT_EQ(stats.size(), 2u);
+  EXPECT_EQ(stats[0].device, 0);
+  EXPECT_LT(stats[0].usec_per_request, stats[1].usec_per_request);
+
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kNumClients; ++i) {
+    clients.emplace_back([&]() {
+      auto client = comm.getClient();
+      for (int j = 0; j < kNumRequests; ++j) {
+        EXPECT_EQ(client->sendWait(j, {"a"}), SUCCESS);
+      }
+    });
+  }
+  for (auto& th : clients) {
+    th.join();
+  }
+  done = true;
+  for (auto& th : servers) {
+    th.join();
+  }
+
+  EXPECT_EQ(served[0] + served[1], kNumClients * kNumRequests);
+  EXPECT_GT(served[0], 2 * served[1]);
+  EXPECT_GT(served[1], 0);
+  stats = comm.getDeviceStats();
+  for (const auto& s : stats) {
+    EXPECT_EQ(s.inflight, 0);
+    EXPECT_EQ(s.served, (uint64_t)served[s.device]);
+  }
+  EXPECT_LT(stats[0].usec_per_request, stats[1].usec_per_request);
+}
+
+} // namespace comm
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Affinity.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace elf {
+namespace concurrency {
+
+namespace {
+
+bool readLine(const std::string& filename, std::string* line) {
+  std::ifstream f(filename);
+  return f && std::getline(f, *line);
+}
+
+} // namespace
+
+std::vector<int> parseCpuList(const std::string& s) {
+  std::vector<int> cpus;
+  std::stringstream ss(s);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    const size_t dash = range.find('-');
+    const int first = atoi(range.c_str());
+    const int last =
+        dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<std::vector<int>> getNumaNodeCpus() {
+  std::vector<std::vector<int>> nodes;
+  std::string line;
+  if (readLine("/sys/devices/system/node/online", &line)) {
+    for (int node : parseCpuList(line)) {
+      std::string cpus;
+      if (!readLine(
+              "/sys/devices/system/node/node" + std::to_string(node) +
+                  "/cpulist",
+              &cpus)) {
+        nodes.clear();
+        break;
+      }
+      nodes.resize(node + 1);
+      nodes[node] = parseCpuList(cpus);
+    }
+  }
+  if (nodes.empty()) {
+    nodes.resize(1);
+    const int n = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < n; ++cpu) {
+      nodes[0].push_back(cpu);
+    }
+  }
+  return nodes;
+}
+
+int getPciDeviceNumaNode(const std::string& bus_id) {
+  std::string line;
+  if (!readLine("/sys/bus/pci/devices/" + bus_id + "/numa_node", &line)) {
+    return -1;
+  }
+  return atoi(line.c_str());
+}
+
+#ifdef __linux__
+
+bool setThreadAffinity(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool bindMemoryToNode(void* addr, size_t len, int node) {
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+  const uintptr_t end =
+      (reinterpret_cast<uintptr_t>(addr) + len + page - 1) & ~(page - 1);
+  const size_t kBitsPerWord = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / kBitsPerWord + 1, 0);
+  mask[node / kBitsPerWord] = 1UL << (node % kBitsPerWord);
+  return syscall(
+             SYS_mbind,
+             begin,
+             end - begin,
+             MPOL_BIND,
+             mask.data(),
+             mask.size() * kBitsPerWord,
+             MPOL_MF_MOVE) == 0;
+}
+
+#else
+
+bool setThreadAffinity(const std::vector<int>&) {
+  return false;
+}
+
+bool bindMemoryToNode(void*, size_t, int) {
+  return false;
+}
+
+#endif
+
+AffinityPolicy::AffinityPolicy(
+    int collector_node,
+    std::vector<std::vector<int>> node_cpus)
+    : collectorNode_(collector_node), nodeCpus_(std::move(node_cpus)) {
+  if (collectorNode_ >= (int)nodeCpus_.size()) {
+    std::cout << "Warning! NUMA node " << collectorNode_ << " out of "
+              << nodeCpus_.size() << ", using node 0" << std::endl;
+    collectorNode_ = 0;
+  }
+}
+
+std::string AffinityPolicy::info() const {
+  std::stringstream ss;
+  if (!enabled()) {
+    ss << "Affinity: off";
+    return ss.str();
+  }
+  ss << "Affinity: collectors on node " << collectorNode_ << ", "
+     << nodeCpus_.size() << " nodes [";
+  for (size_t i = 0; i < nodeCpus_.size(); ++i) {
+    ss << (i > 0 ? ", " : "") << nodeCpus_[i].size() << " cpus";
+  }
+  ss << "]";
+  return ss.str();
+}
+
+} // namespace concurrency
+} // namespace elf
@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Thread and memory placement on NUMA hosts (Linux; the functions fail
+ * gracefully elsewhere).
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace elf {
+namespace concurrency {
+
+/**
+ * Parses a cpu or node list of sysfs, such as "0-3,8,10-11".
+ */
+std::vector<int> parseCpuList(const std::string& s);
+
+/**
+ * CPUs of each NUMA node, from sysfs; a single node with all the CPUs if it
+ * is not available.
+ */
+std::vector<std::vector<int>> getNumaNodeCpus();
+
+/**
+ * NUMA node of a PCI device (e.g. "0000:3b:00.0" for a GPU), or -1.
+ */
+int getPciDeviceNumaNode(const std::string& bus_id);
+
+/**
+ * Pins the calling thread to cpus. The threads it creates afterwards
+ * inherit the mask.
+ */
+bool setThreadAffinity(const std::vector<int>& cpus);
+
+/**
+ * Binds [addr, addr + len) to a NUMA node, moving the pages already there.
+ */
+bool bindMemoryToNode(void* addr, size_t len, int node);
+
+/**
+ * Where the threads of a Context go: its collectors (and their shared
+ * memory) on the node of collector_node, usually the GPU's, and each game
+ * with its search threads on one node, round robin. Disabled if
+ * collector_node < 0.
+ */
+class AffinityPolicy {
+ public:
+  explicit AffinityPolicy(
+      int collector_node = -1,
+      std::vector<std::vector<int>> node_cpus = getNumaNodeCpus());
+
+  bool enabled() const {
+    return collectorNode_ >= 0;
+  }
+
+  int getCollectorNode() const {
+    return collectorNode_;
+  }
+
+  // Games start from the collector node, so that a single game goes there.
+  int getGameNode(int game_idx) const {
+    return (collectorNode_ + game_idx) % (int)nodeCpus_.size();
+  }
+
+  const std::vector<int>& getCpus(int node) const {
+    return nodeCpus_[node];
+  }
+
+  std::string info() const;
+
+ private:
+  int collectorNode_;
+  std::vector<std::vector<int>> nodeCpus_;
+};
+
+} // namespace concurrency
+} // namespace elf
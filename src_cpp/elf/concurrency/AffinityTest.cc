@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Affinity.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace concurrency {
+
+TEST(AffinityTest, ParseCpuList) {
+  EXPECT_EQ(
+      parseCpuList("0-3,8,10-11\n"),
+      std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(parseCpuList("5"), std::vector<int>({5}));
+  EXPECT_TRUE(parseCpuList("").empty());
+}
+
+TEST(AffinityTest, NodesCoverSomeCpus) {
+  auto nodes = getNumaNodeCpus();
+  ASSERT_FALSE(nodes.empty());
+  size_t num_cpus = 0;
+  for (const auto& cpus : nodes) {
+    num_cpus += cpus.size();
+  }
+  EXPECT_GT(num_cpus, 0u);
+}
+
+// Games go round robin over the nodes, starting from the collector node.
+TEST(AffinityTest, GamesSpreadFromCollectorNode) {
+  AffinityPolicy off;
+  EXPECT_FALSE(off.enabled());
+
+  AffinityPolicy policy(1, {{0, 1}, {2, 3}, {4, 5}});
+  ASSERT_TRUE(policy.enabled());
+  EXPECT_EQ(policy.getCollectorNode(), 1);
+  EXPECT_EQ(policy.getGameNode(0), 1);
+  EXPECT_EQ(policy.getGameNode(1), 2);
+  EXPECT_EQ(policy.getGameNode(2), 0);
+  EXPECT_EQ(policy.getCpus(2), std::vector<int>({4, 5}));
+
+  // A missing node falls back to node 0.
+  AffinityPolicy missing(7, {{0, 1}});
+  EXPECT_EQ(missing.getCollectorNode(), 0);
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
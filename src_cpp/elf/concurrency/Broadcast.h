@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * The Broadcast<T> class publishes successive versions of a value to many
+ * readers. Instead of one mail per reader, a reader keeps the last version it
+ * saw and gets the current value as a shared snapshot when there is a newer
+ * one: checking for it is a single atomic load. Readers wait on an
+ * AtomicCounter, so that they may be fibers.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "Counter.h"
+
+namespace elf {
+namespace concurrency {
+
+template <typename T>
+class Broadcast {
+ public:
+  struct Snapshot {
+    // Starts from 1.
+    int64_t version;
+    T value;
+  };
+  using SnapshotP = std::shared_ptr<const Snapshot>;
+
+  /**
+   * This method makes value the current one, and returns its version.
+   */
+  int64_t publish(T value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int64_t version = lastVersion_ + 1;
+    std::atomic_store(
+        &snapshot_,
+        SnapshotP(new Snapshot{version, std::move(value)}));
+    lastVersion_ = version;
+    version_.set(version);
+    return version;
+  }
+
+  int64_t version() {
+    return current();
+  }
+
+  /**
+   * This method returns the current snapshot if it is newer than version,
+   * nullptr otherwise.
+   */
+  SnapshotP peek(int64_t version) {
+    if (current() <= version) {
+      return nullptr;
+    }
+    // At least as new as the version checked, since it is stored first.
+    return std::atomic_load(&snapshot_);
+  }
+
+  /**
+   * This method blocks until there is a snapshot newer than version, then
+   * returns it.
+   */
+  SnapshotP wait(int64_t version) {
+    version_.waitUntilCount(version + 1);
+    return std::atomic_load(&snapshot_);
+  }
+
+ private:
+  std::mutex mutex_;
+  int64_t lastVersion_ = 0;
+  SnapshotP snapshot_;
+  AtomicCounter<int64_t> version_;
+
+  // Versions are positive: does not block.
+  int64_t current() {
+    return version_.waitUntilCount(0);
+  }
+};
+
+} // namespace concurrency
+} // namespace elf
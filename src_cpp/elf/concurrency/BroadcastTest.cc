@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Broadcast.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace concurrency {
+
+TEST(BroadcastTest, PeekOnlyNewer) {
+  Broadcast<std::string> b;
+  EXPECT_EQ(b.version(), 0);
+  EXPECT_EQ(b.peek(0), nullptr);
+
+  EXPECT_EQ(b.publish("a"), 1);
+  auto s = b.peek(0);
+  ASSERT_NE(s, nullptr);
+  EXPECT_EQ(s->version, 1);
+  EXPECT_EQ(s->value, "a");
+  EXPECT_EQ(b.peek(1), nullptr);
+
+  b.publish("b");
+  b.publish("c");
+  s = b.peek(1);
+  ASSERT_NE(s, nullptr);
+  EXPECT_EQ(s->version, 3);
+  EXPECT_EQ(s->value, "c");
+}
+
+// Each reader sees every version, when the publisher waits for all of them
+// before the next one (as ThreadedDispatcher does).
+TEST(BroadcastTest, ReadersSeeEveryVersion) {
+  constexpr int kNumReaders = 16;
+  constexpr int kNumVersions = 100;
+  Broadcast<int> b;
+  AtomicCounter<int64_t> replies;
+  std::vector<std::thread> readers;
+  std::vector<int64_t> sums(kNumReaders, 0);
+  for (int i = 0; i < kNumReaders; ++i) {
+    readers.emplace_back([&, i]() {
+      int64_t version = 0;
+      while (version < kNumVersions) {
+        auto s = b.wait(version);
+        EXPECT_EQ(s->version, version + 1);
+        version = s->version;
+        sums[i] += s->value;
+        replies.increment();
+      }
+    });
+  }
+  for (int v = 1; v <= kNumVersions; ++v) {
+    b.publish(v);
+    replies.waitUntilCount(int64_t(v) * kNumReaders);
+  }
+  for (auto& th : readers) {
+    th.join();
+  }
+  for (int i = 0; i < kNumReaders; ++i) {
+    EXPECT_EQ(sums[i], kNumVersions * (kNumVersions + 1) / 2);
+  }
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -20,6 +20,10 @@
  *   If the timeout duration is reached, then we return false and do not
  *   store anything in the given pointer.
  *
+ * size_t tryPopBulk(T* values, size_t max)
+ *   Non-blocking: pops up to max values already in the queue into values,
+ *   and returns their number.
+ *
  * We define the following classes:
  *
  * ConcurrentQueueMoodyCamel<T> (aliased to ConcurrentQueue<T>)
@@ -27,6 +31,14 @@
  *
  * ConcurrentQueueTBB<T>
  *   An alternative implementation, backed by tbb::concurrent_queue.
+ *
+ * ConcurrentQueueRing<T>
+ *   A bounded lock-free ring; pop parks on a condition variable when the
+ *   queue is empty (and push when it is full) and push wakes it up.
+ *
+ * ConcurrentQueueFutex<T>
+ *   The moodycamel queue, with pops that park on a futex (futexWait() in
+ *   Counter.h): a fiber waiting on it parks itself instead of its worker.
  */
 
 #pragma once
@@ -34,14 +46,19 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <blockingconcurrentqueue.h>
 #include <tbb/concurrent_queue.h>
 
+#include "Counter.h"
+
 namespace elf {
 namespace concurrency {
 
@@ -63,6 +80,10 @@ class ConcurrentQueueMoodyCamel {
     return q_.wait_dequeue_timed(*value, timeout);
   }
 
+  size_t tryPopBulk(T* values, size_t max) {
+    return q_.try_dequeue_bulk(values, max);
+  }
+
  private:
   using QueueT = moodycamel::BlockingConcurrentQueue<T>;
   QueueT q_;
@@ -97,11 +118,256 @@ class ConcurrentQueueTBB {
     return true;
   }
 
+  size_t tryPopBulk(T* values, size_t max) {
+    size_t n = 0;
+    while (n < max && q_.try_pop(values[n])) {
+      ++n;
+    }
+    return n;
+  }
+
  private:
   using QueueT = tbb::concurrent_queue<T>;
   QueueT q_;
 };
 
+template <typename T>
+class ConcurrentQueueRing {
+ public:
+  using value_type = T;
+
+  // The capacity is rounded up to a power of 2.
+  explicit ConcurrentQueueRing(size_t capacity = 1024) {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  void push(const T& value) {
+    if (!tryPush(value)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      numPushWaiters_.fetch_add(1);
+      while (!tryPush(value)) {
+        notFull_.wait(lock);
+      }
+      numPushWaiters_.fetch_sub(1);
+    }
+    wake(numPopWaiters_, notEmpty_);
+  }
+
+  void pop(T* value) {
+    popUntil(value, nullptr);
+  }
+
+  template <typename Rep, typename Period>
+  bool pop(T* value, std::chrono::duration<Rep, Period> timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    return popUntil(value, &deadline);
+  }
+
+  // Non-blocking versions: return false if the queue is full (resp. empty).
+  bool tryPush(const T& value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      const size_t seq = cell.seq.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T* value) {
+    if (!take(value)) {
+      return false;
+    }
+    wake(numPushWaiters_, notFull_);
+    return true;
+  }
+
+  size_t tryPopBulk(T* values, size_t max) {
+    size_t n = 0;
+    while (n < max && take(&values[n])) {
+      ++n;
+    }
+    if (n > 0) {
+      wake(numPushWaiters_, notFull_);
+    }
+    return n;
+  }
+
+ private:
+  // Pops spinning this many times before parking.
+  static constexpr int kNumSpins = 64;
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  // Producers and consumers on separate cache lines.
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<size_t> head_{0};
+
+  // Only touched when a side has to wait.
+  alignas(64) std::mutex mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+  std::atomic<int> numPopWaiters_{0};
+  std::atomic<int> numPushWaiters_{0};
+
+  // tryPop() without waking up the producers.
+  bool take(T* value) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      const size_t seq = cell.seq.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          *value = std::move(cell.value);
+          cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // A waiter registers itself before its last try under mutex_, and the
+  // other side checks for waiters after its update, both with full fences:
+  // either the waiter sees the update, or the other side sees the waiter
+  // and notifies it once it is parked.
+  void wake(std::atomic<int>& num_waiters, std::condition_variable& cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv.notify_one();
+    }
+  }
+
+  bool popUntil(T* value, const std::chrono::steady_clock::time_point* end) {
+    for (int i = 0; i < kNumSpins; ++i) {
+      if (tryPop(value)) {
+        return true;
+      }
+    }
+    bool popped;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      numPopWaiters_.fetch_add(1);
+      popped = take(value);
+      while (!popped) {
+        bool timeout = false;
+        if (end == nullptr) {
+          notEmpty_.wait(lock);
+        } else {
+          timeout =
+              notEmpty_.wait_until(lock, *end) == std::cv_status::timeout;
+        }
+        popped = take(value);
+        if (timeout) {
+          break;
+        }
+      }
+      numPopWaiters_.fetch_sub(1);
+    }
+    if (popped) {
+      wake(numPushWaiters_, notFull_);
+    }
+    return popped;
+  }
+};
+
+template <typename T>
+class ConcurrentQueueFutex {
+ public:
+  using value_type = T;
+
+  void push(const T& value) {
+    q_.enqueue(value);
+    // Same as AtomicCounter: either the pop sees the value after it
+    // registered, or the push sees the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (numWaiters_.load() > 0) {
+      epoch_.fetch_add(1);
+      futexWake(&epoch_);
+    }
+  }
+
+  void pop(T* value) {
+    popUntil(value, nullptr);
+  }
+
+  template <typename Rep, typename Period>
+  bool pop(T* value, std::chrono::duration<Rep, Period> timeout) {
+    if (q_.try_dequeue(*value)) {
+      return true;
+    }
+    const auto end = std::chrono::steady_clock::now() + timeout;
+    return popUntil(value, &end);
+  }
+
+  size_t tryPopBulk(T* values, size_t max) {
+    return q_.try_dequeue_bulk(values, max);
+  }
+
+ private:
+  moodycamel::ConcurrentQueue<T> q_;
+  std::atomic<int32_t> epoch_{0};
+  std::atomic<int32_t> numWaiters_{0};
+
+  bool popUntil(T* value, const std::chrono::steady_clock::time_point* end) {
+    if (q_.try_dequeue(*value)) {
+      return true;
+    }
+    numWaiters_.fetch_add(1);
+    bool popped = false;
+    while (true) {
+      const int32_t epoch = epoch_.load();
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (q_.try_dequeue(*value)) {
+        popped = true;
+        break;
+      }
+      if (end == nullptr) {
+        futexWait(&epoch_, epoch, nullptr);
+      } else {
+        const std::chrono::nanoseconds left =
+            *end - std::chrono::steady_clock::now();
+        if (left.count() <= 0) {
+          break;
+        }
+        futexWait(&epoch_, epoch, &left);
+      }
+    }
+    numWaiters_.fetch_sub(1);
+    return popped;
+  }
+};
+
 // Define the moodycamel queue to be the default implementation
 template <typename T>
 using ConcurrentQueue = ConcurrentQueueMoodyCamel<T>;
@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Throughput and wakeup latency of the ELF concurrent queues.
+//
+// throughput: producers push, consumers pop (blocking) as fast as they can.
+// ping-pong: two threads bounce a token through two queues with a timed pop
+//   (1ms timeout), as the collectors and mailboxes do; the round trip is
+//   twice the wakeup latency after a push.
+//
+// Usage: benchmark_cpp_elf_concurrency_ConcurrentQueueBenchmark [threads]
+//   [items_per_thread] [round_trips]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ConcurrentQueue.h"
+
+using namespace elf::concurrency;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename Queue>
+void throughput(const std::string& name, int num_threads, int num_items) {
+  Queue q;
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&q, num_items]() {
+      for (int i = 0; i < num_items; ++i) {
+        q.push(i);
+      }
+    });
+    threads.emplace_back([&q, num_items]() {
+      int v;
+      for (int i = 0; i < num_items; ++i) {
+        q.pop(&v);
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  std::cout << name << " throughput (" << num_threads << "+" << num_threads
+            << " threads): "
+            << (double)num_threads * num_items / secondsSince(start) / 1e6
+            << " M items/sec" << std::endl;
+}
+
+template <typename Queue>
+void pingPong(const std::string& name, int num_round_trips) {
+  Queue ping, pong;
+  const auto timeout = std::chrono::milliseconds(1);
+  std::thread echo([&]() {
+    int v;
+    for (int i = 0; i < num_round_trips; ++i) {
+      while (!ping.pop(&v, timeout)) {
+      }
+      pong.push(v);
+    }
+  });
+  auto start = Clock::now();
+  int v;
+  for (int i = 0; i < num_round_trips; ++i) {
+    ping.push(i);
+    while (!pong.pop(&v, timeout)) {
+    }
+  }
+  const double elapsed = secondsSince(start);
+  echo.join();
+  std::cout << name << " ping-pong: " << elapsed * 1e6 / num_round_trips
+            << " us/round trip" << std::endl;
+}
+
+template <typename Queue>
+void run(const std::string& name, int threads, int items, int round_trips) {
+  throughput<Queue>(name, threads, items);
+  pingPong<Queue>(name, round_trips);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const int threads = argc > 1 ? atoi(argv[1]) : 4;
+  const int items = argc > 2 ? atoi(argv[2]) : 1000000;
+  const int round_trips = argc > 3 ? atoi(argv[3]) : 2000;
+
+  run<ConcurrentQueueRing<int>>("Ring", threads, items, round_trips);
+  run<ConcurrentQueueMoodyCamel<int>>(
+      "MoodyCamel", threads, items, round_trips);
+  run<ConcurrentQueueTBB<int>>("TBB", threads, items, round_trips);
+  return 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "ConcurrentQueue.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace concurrency {
+
+TEST(ConcurrentQueueRingTest, FifoAndTimeout) {
+  ConcurrentQueueRing<int> q(4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(q.tryPush(i));
+  }
+  EXPECT_FALSE(q.tryPush(4));
+  for (int i = 0; i < 4; ++i) {
+    int v = -1;
+    q.pop(&v);
+    EXPECT_EQ(v, i);
+  }
+  int v = -1;
+  EXPECT_FALSE(q.tryPop(&v));
+  EXPECT_FALSE(q.pop(&v, std::chrono::microseconds(100)));
+  EXPECT_EQ(v, -1);
+}
+
+template <typename Queue>
+void testPopBulk() {
+  Queue q;
+  for (int i = 0; i < 5; ++i) {
+    q.push(i);
+  }
+  int values[4] = {-1, -1, -1, -1};
+  EXPECT_EQ(q.tryPopBulk(values, 4), 4u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(values[i], i);
+  }
+  EXPECT_EQ(q.tryPopBulk(values, 4), 1u);
+  EXPECT_EQ(values[0], 4);
+  EXPECT_EQ(q.tryPopBulk(values, 4), 0u);
+}
+
+TEST(ConcurrentQueueTest, PopBulk) {
+  testPopBulk<ConcurrentQueueRing<int>>();
+  testPopBulk<ConcurrentQueueFutex<int>>();
+  testPopBulk<ConcurrentQueueMoodyCamel<int>>();
+  testPopBulk<ConcurrentQueueTBB<int>>();
+}
+
+// Every value pushed by the producers is popped exactly once, with a ring
+// small enough for both sides to park.
+TEST(ConcurrentQueueRingTest, ManyProducersAndConsumers) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumPerThread = 20000;
+  ConcurrentQueueRing<int> q(8);
+  std::vector<std::thread> threads;
+  std::vector<std::vector<int>> popped(kNumThreads);
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&q, t]() {
+      for (int i = 0; i < kNumPerThread; ++i) {
+        q.push(t * kNumPerThread + i);
+      }
+    });
+    threads.emplace_back([&q, &popped, t]() {
+      for (int i = 0; i < kNumPerThread; ++i) {
+        int v;
+        if (i % 2 == 0) {
+          q.pop(&v);
+        } else {
+          while (!q.pop(&v, std::chrono::microseconds(10))) {
+          }
+        }
+        popped[t].push_back(v);
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  std::vector<int> count(kNumThreads * kNumPerThread, 0);
+  for (const auto& values : popped) {
+    for (int v : values) {
+      count[v]++;
+    }
+  }
+  for (int c : count) {
+    ASSERT_EQ(c, 1);
+  }
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -7,6 +7,14 @@
  */
 
 #include "Counter.h"
+#include "Fiber.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#endif
 
 namespace elf {
 namespace concurrency {
@@ -15,6 +23,143 @@ namespace concurrency {
 template class Counter<int64_t>;
 template class Counter<int32_t>;
 template class Counter<bool>;
+template class AtomicCounter<int64_t>;
+template class AtomicCounter<int32_t>;
+template class AtomicCounter<bool>;
+
+namespace {
+
+// A fiber parks itself, and leaves its worker to the other fibers.
+bool fiberWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout) {
+  if (currentFiber() == nullptr) {
+    return false;
+  }
+  if (timeout == nullptr) {
+    fiberFutexWait(word, expected, nullptr);
+  } else {
+    const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                              *timeout);
+    fiberFutexWait(word, expected, &deadline);
+  }
+  return true;
+}
+
+} // namespace
+
+#ifdef __linux__
+
+static_assert(
+    sizeof(std::atomic<int32_t>) == sizeof(int32_t) &&
+        std::atomic<int32_t>::is_always_lock_free,
+    "The futex word must be a plain int32_t.");
+
+void futexWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout) {
+  if (fiberWait(word, expected, timeout)) {
+    return;
+  }
+  struct timespec ts;
+  if (timeout != nullptr) {
+    ts.tv_sec = timeout->count() / 1000000000;
+    ts.tv_nsec = timeout->count() % 1000000000;
+  }
+  syscall(
+      SYS_futex,
+      reinterpret_cast<int32_t*>(word),
+      FUTEX_WAIT_PRIVATE,
+      expected,
+      timeout != nullptr ? &ts : nullptr,
+      nullptr,
+      0);
+}
+
+void futexWake(std::atomic<int32_t>* word) {
+  fiberFutexWake(word);
+  syscall(
+      SYS_futex,
+      reinterpret_cast<int32_t*>(word),
+      FUTEX_WAKE_PRIVATE,
+      INT32_MAX,
+      nullptr,
+      nullptr,
+      0);
+}
+
+void futexWaitShared(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout) {
+  struct timespec ts;
+  if (timeout != nullptr) {
+    ts.tv_sec = timeout->count() / 1000000000;
+    ts.tv_nsec = timeout->count() % 1000000000;
+  }
+  syscall(
+      SYS_futex,
+      reinterpret_cast<int32_t*>(word),
+      FUTEX_WAIT,
+      expected,
+      timeout != nullptr ? &ts : nullptr,
+      nullptr,
+      0);
+}
+
+void futexWakeShared(std::atomic<int32_t>* word) {
+  syscall(
+      SYS_futex,
+      reinterpret_cast<int32_t*>(word),
+      FUTEX_WAKE,
+      INT32_MAX,
+      nullptr,
+      nullptr,
+      0);
+}
+
+#else
+
+// No futex: poll.
+void futexWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout) {
+  if (fiberWait(word, expected, timeout)) {
+    return;
+  }
+  std::chrono::nanoseconds sleep = std::chrono::microseconds(50);
+  if (timeout != nullptr && *timeout < sleep) {
+    sleep = *timeout;
+  }
+  if (word->load() == expected) {
+    std::this_thread::sleep_for(sleep);
+  }
+}
+
+void futexWake(std::atomic<int32_t>* word) {
+  fiberFutexWake(word);
+}
+
+void futexWaitShared(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout) {
+  std::chrono::nanoseconds sleep = std::chrono::microseconds(50);
+  if (timeout != nullptr && *timeout < sleep) {
+    sleep = *timeout;
+  }
+  if (word->load() == expected) {
+    std::this_thread::sleep_for(sleep);
+  }
+}
+
+void futexWakeShared(std::atomic<int32_t>*) {}
+
+#endif
 
 } // namespace concurrency
 } // namespace elf
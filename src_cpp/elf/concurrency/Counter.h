@@ -8,16 +8,22 @@
 
 /**
  * The Counter<IntT> class is a thread-safe integer counter.
+ *
+ * AtomicCounter<IntT> has the same API, but updates the count with atomics
+ * and only parks waiters (on a futex) when they have to block; an update
+ * makes a system call only if someone is waiting.
  */
 
 #pragma once
 
 #include <stdint.h>
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 
 namespace elf {
 namespace concurrency {
@@ -111,14 +117,154 @@ class Counter {
   std::condition_variable cv_;
 };
 
+/**
+ * Blocks while *word == expected, until futexWake() or the timeout (if not
+ * null); it may also return spuriously.
+ */
+void futexWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout);
+
+/**
+ * Wakes up all the threads in futexWait() on word.
+ */
+void futexWake(std::atomic<int32_t>* word);
+
+/**
+ * Same as futexWait() / futexWake(), for a word in memory shared between
+ * processes (e.g. a POSIX shared memory segment). Not for fibers.
+ */
+void futexWaitShared(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::nanoseconds* timeout);
+void futexWakeShared(std::atomic<int32_t>* word);
+
+template <typename T>
+class AtomicCounter {
+ public:
+  using value_type = T;
+
+  AtomicCounter(T initialValue = 0) : count_(initialValue) {}
+
+  T get() const {
+    return count_.load();
+  }
+
+  template <typename PredicateT>
+  T replace(PredicateT predicate) {
+    T value = count_.load();
+    T newValue;
+    do {
+      newValue = predicate(value);
+    } while (!count_.compare_exchange_weak(value, newValue));
+    notify();
+    return newValue;
+  }
+
+  template <typename PredicateT>
+  T wait(PredicateT predicate) {
+    return waitImpl(predicate, nullptr);
+  }
+
+  template <typename PredicateT, typename Rep, typename Period>
+  T wait(PredicateT predicate, std::chrono::duration<Rep, Period> timeout) {
+    const auto end = std::chrono::steady_clock::now() + timeout;
+    return waitImpl(predicate, &end);
+  }
+
+  T increment(T increment = 1) {
+    if constexpr (std::is_same<T, bool>::value) {
+      return replace([=](T value) { return value + increment; });
+    } else {
+      T value = count_.fetch_add(increment) + increment;
+      notify();
+      return value;
+    }
+  }
+
+  T set(T newValue) {
+    count_.store(newValue);
+    notify();
+    return newValue;
+  }
+
+  T reset() {
+    return set(0);
+  }
+
+  T waitUntilCount(T expectedCount) {
+    return wait([=](T count) { return count >= expectedCount; });
+  }
+
+  template <typename Rep, typename Period>
+  T waitUntilCount(
+      T expectedCount,
+      std::chrono::duration<Rep, Period> timeout) {
+    return wait([=](T count) { return count >= expectedCount; }, timeout);
+  }
+
+ private:
+  std::atomic<T> count_;
+  // Bumped by the updates seen by a waiter; this is the futex word.
+  std::atomic<int32_t> epoch_{0};
+  std::atomic<int32_t> numWaiters_{0};
+
+  // All seq_cst: either the update sees the waiter, or the waiter sees the
+  // new count after registering.
+  void notify() {
+    if (numWaiters_.load() > 0) {
+      epoch_.fetch_add(1);
+      futexWake(&epoch_);
+    }
+  }
+
+  template <typename PredicateT>
+  T waitImpl(
+      PredicateT& predicate,
+      const std::chrono::steady_clock::time_point* end) {
+    T value = count_.load();
+    if (predicate(value)) {
+      return value;
+    }
+    numWaiters_.fetch_add(1);
+    while (true) {
+      const int32_t epoch = epoch_.load();
+      value = count_.load();
+      if (predicate(value)) {
+        break;
+      }
+      if (end == nullptr) {
+        futexWait(&epoch_, epoch, nullptr);
+      } else {
+        const std::chrono::nanoseconds left =
+            *end - std::chrono::steady_clock::now();
+        if (left.count() <= 0) {
+          break;
+        }
+        futexWait(&epoch_, epoch, &left);
+      }
+    }
+    numWaiters_.fetch_sub(1);
+    return value;
+  }
+};
+
 // Exempt the explicit instantiations in Counter.cc from compilation.
 extern template class Counter<int64_t>;
 extern template class Counter<int32_t>;
 extern template class Counter<bool>;
+extern template class AtomicCounter<int64_t>;
+extern template class AtomicCounter<int32_t>;
+extern template class AtomicCounter<bool>;
 
-class Switch : public Counter<bool> {
+template <typename CounterT>
+class SwitchT : public CounterT {
  public:
-  Switch(bool initialValue = false) : Counter(initialValue) {}
+  SwitchT(bool initialValue = false) : CounterT(initialValue) {}
+
+  using CounterT::wait;
 
   bool waitUntilValue(bool value) {
     return wait([=](bool currentValue) { return currentValue == value; });
@@ -149,5 +295,8 @@ class Switch : public Counter<bool> {
   }
 };
 
+using Switch = SwitchT<Counter<bool>>;
+using AtomicSwitch = SwitchT<AtomicCounter<bool>>;
+
 } // namespace concurrency
 } // namespace elf
@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Contention on the mutex and atomic counters.
+//
+// increment: threads increment one counter while the main thread waits for
+//   the total, as the reply and stop counters are used.
+// wakeup: threads wait on one switch until the main thread sets it, as the
+//   collectors and games wait on their switches.
+//
+// Usage: benchmark_cpp_elf_concurrency_CounterBenchmark [threads]
+//   [increments_per_thread] [rounds]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Counter.h"
+
+using namespace elf::concurrency;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename CounterT>
+void increment(const std::string& name, int num_threads, int num_increments) {
+  CounterT counter;
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&counter, num_increments]() {
+      for (int i = 0; i < num_increments; ++i) {
+        counter.increment();
+      }
+    });
+  }
+  counter.waitUntilCount(num_threads * num_increments);
+  const double elapsed = secondsSince(start);
+  for (auto& th : threads) {
+    th.join();
+  }
+  std::cout << name << " increment (" << num_threads << " threads): "
+            << elapsed * 1e9 / ((double)num_threads * num_increments)
+            << " ns/increment" << std::endl;
+}
+
+template <typename SwitchT>
+void wakeup(const std::string& name, int num_threads, int num_rounds) {
+  double total = 0;
+  for (int round = 0; round < num_rounds; ++round) {
+    SwitchT s;
+    Counter<int> parked;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&]() {
+        parked.increment();
+        s.waitUntilTrue();
+      });
+    }
+    parked.waitUntilCount(num_threads);
+    auto start = Clock::now();
+    s.set(true);
+    for (auto& th : threads) {
+      th.join();
+    }
+    total += secondsSince(start);
+  }
+  std::cout << name << " wakeup (" << num_threads
+            << " threads): " << total * 1e3 / num_rounds << " ms/round"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const int threads = argc > 1 ? atoi(argv[1]) : 1000;
+  const int increments = argc > 2 ? atoi(argv[2]) : 1000;
+  const int rounds = argc > 3 ? atoi(argv[3]) : 10;
+
+  increment<Counter<int>>("Counter", threads, increments);
+  increment<AtomicCounter<int>>("AtomicCounter", threads, increments);
+  wakeup<Switch>("Switch", threads, rounds);
+  wakeup<AtomicSwitch>("AtomicSwitch", threads, rounds);
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Counter.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace concurrency {
+
+template <typename CounterT>
+class CounterTest : public ::testing::Test {};
+
+using CounterTypes = ::testing::Types<Counter<int>, AtomicCounter<int>>;
+TYPED_TEST_SUITE(CounterTest, CounterTypes);
+
+TYPED_TEST(CounterTest, UpdatesAndTimeout) {
+  TypeParam counter(3);
+  EXPECT_EQ(counter.increment(), 4);
+  EXPECT_EQ(counter.increment(2), 6);
+  EXPECT_EQ(counter.replace([](int v) { return v * 2; }), 12);
+  EXPECT_EQ(counter.waitUntilCount(12), 12);
+  EXPECT_EQ(counter.waitUntilCount(13, std::chrono::milliseconds(1)), 12);
+  EXPECT_EQ(counter.reset(), 0);
+  EXPECT_EQ(counter.set(5), 5);
+}
+
+// Waiters on different targets are all woken up by the increments.
+TYPED_TEST(CounterTest, ManyWaiters) {
+  constexpr int kNumThreads = 16;
+  TypeParam counter;
+  std::vector<std::thread> waiters;
+  std::vector<int> seen(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    waiters.emplace_back(
+        [&, i]() { seen[i] = counter.waitUntilCount(i + 1); });
+  }
+  std::vector<std::thread> incrementers;
+  for (int i = 0; i < kNumThreads; ++i) {
+    incrementers.emplace_back([&]() { counter.increment(); });
+  }
+  for (auto& th : incrementers) {
+    th.join();
+  }
+  for (auto& th : waiters) {
+    th.join();
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    EXPECT_GE(seen[i], i + 1);
+  }
+}
+
+template <typename SwitchT>
+class SwitchTest : public ::testing::Test {};
+
+using SwitchTypes = ::testing::Types<Switch, AtomicSwitch>;
+TYPED_TEST_SUITE(SwitchTest, SwitchTypes);
+
+TYPED_TEST(SwitchTest, WaitUntilValue) {
+  TypeParam s;
+  EXPECT_FALSE(s.waitUntilTrue(std::chrono::milliseconds(1)));
+  std::thread setter([&]() { s.set(true); });
+  EXPECT_TRUE(s.waitUntilTrue());
+  setter.join();
+  s.reset();
+  EXPECT_FALSE(s.waitUntilFalse());
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,517 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Fiber.h"
+
+#include <assert.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#include "ConcurrentQueue.h"
+
+namespace elf {
+namespace concurrency {
+
+namespace {
+
+enum FiberState : int { RUNNING = 0, PARKED, NOTIFIED };
+enum FiberRequest { NONE = 0, PARK, YIELD, DONE };
+
+std::atomic<ExecutionId> nextExecutionId{1};
+// Bytes of the fiber locals so far.
+std::atomic<size_t> fiberLocalsSize{0};
+
+} // namespace
+
+class Fiber {
+ public:
+  using Timers = std::multimap<FiberPool::Clock::time_point, Fiber*>;
+
+  ucontext_t ctx;
+  void* stack = nullptr;
+  size_t stackSize = 0;
+  std::function<void()> func;
+  std::shared_ptr<AtomicSwitch> done;
+  const ExecutionId id = nextExecutionId++;
+
+  // The worker that last ran it, whose ready queue it goes back to.
+  FiberPool::Worker* worker = nullptr;
+  std::atomic<int> state{RUNNING};
+
+  // Set by the fiber for its worker, when it switches back.
+  FiberRequest request = NONE;
+  // Then in the timers of its worker, and not to be stolen.
+  bool hasDeadline = false;
+  FiberPool::Clock::time_point deadline;
+
+  // Only touched by the worker.
+  bool inTimers = false;
+  Timers::iterator timer;
+
+  // See executionLocal(); grown as they are used.
+  std::unique_ptr<unsigned char[]> locals;
+  size_t localsSize = 0;
+};
+
+namespace {
+
+thread_local Fiber* tlsFiber = nullptr;
+thread_local ucontext_t* tlsScheduler = nullptr;
+thread_local FiberPool* tlsPool = nullptr;
+thread_local FiberPool* tlsSpawnPool = nullptr;
+thread_local ExecutionId tlsThreadId = 0;
+
+// Not inlined, here and in currentFiber(): a fiber stolen by another worker
+// resumes on another thread, and must not use the address of a thread_local
+// computed before it parked.
+__attribute__((noinline)) void switchToScheduler(
+    Fiber* f,
+    FiberRequest request) {
+  f->request = request;
+  swapcontext(&f->ctx, tlsScheduler);
+}
+
+void fiberMain() {
+  Fiber* f = tlsFiber;
+  f->func();
+  f->func = nullptr;
+  switchToScheduler(f, DONE);
+}
+
+// Fibers waiting in fiberFutexWait(), striped by word address.
+struct FutexStripe {
+  std::mutex mutex;
+  std::vector<std::pair<const void*, Fiber*>> waiters;
+  std::atomic<int> numWaiters{0};
+};
+
+constexpr size_t kNumFutexStripes = 64;
+FutexStripe futexStripes[kNumFutexStripes];
+
+FutexStripe& futexStripe(const void* word) {
+  return futexStripes
+      [(reinterpret_cast<uintptr_t>(word) >> 2) % kNumFutexStripes];
+}
+
+} // namespace
+
+__attribute__((noinline)) Fiber* currentFiber() {
+  return tlsFiber;
+}
+
+void parkFiber(const std::chrono::steady_clock::time_point* deadline) {
+  Fiber* f = currentFiber();
+  if (f == nullptr) {
+    return;
+  }
+  int notified = NOTIFIED;
+  if (f->state.compare_exchange_strong(notified, RUNNING)) {
+    return;
+  }
+  f->hasDeadline = deadline != nullptr;
+  if (deadline != nullptr) {
+    f->deadline = *deadline;
+  }
+  switchToScheduler(f, PARK);
+}
+
+void yieldFiber() {
+  Fiber* f = currentFiber();
+  if (f != nullptr) {
+    switchToScheduler(f, YIELD);
+  }
+}
+
+void sleepFor(std::chrono::microseconds duration) {
+  if (currentFiber() == nullptr) {
+    std::this_thread::sleep_for(duration);
+    return;
+  }
+  const auto deadline = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < deadline) {
+    parkFiber(&deadline);
+  }
+}
+
+ExecutionId getExecutionId() {
+  if (tlsFiber != nullptr) {
+    return tlsFiber->id;
+  }
+  if (tlsThreadId == 0) {
+    tlsThreadId = nextExecutionId++;
+  }
+  return tlsThreadId;
+}
+
+size_t allocateFiberLocal(size_t size, size_t align) {
+  assert(align <= alignof(std::max_align_t));
+  size_t end = fiberLocalsSize.load();
+  size_t offset;
+  do {
+    offset = (end + align - 1) / align * align;
+  } while (!fiberLocalsSize.compare_exchange_weak(end, offset + size));
+  return offset;
+}
+
+void* getFiberLocal(size_t offset, size_t size) {
+  Fiber* f = tlsFiber;
+  if (f == nullptr) {
+    return nullptr;
+  }
+  if (offset + size > f->localsSize) {
+    const size_t n = fiberLocalsSize.load();
+    std::unique_ptr<unsigned char[]> locals(new unsigned char[n]());
+    if (f->localsSize > 0) {
+      memcpy(locals.get(), f->locals.get(), f->localsSize);
+    }
+    f->locals = std::move(locals);
+    f->localsSize = n;
+  }
+  return f->locals.get() + offset;
+}
+
+void fiberFutexWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::steady_clock::time_point* deadline) {
+  Fiber* f = tlsFiber;
+  assert(f != nullptr);
+  FutexStripe& s = futexStripe(word);
+  // Counted before the check: a wake that changed the word after it sees
+  // the waiter.
+  s.numWaiters++;
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (word->load() != expected) {
+      s.numWaiters--;
+      return;
+    }
+    s.waiters.emplace_back(word, f);
+  }
+  parkFiber(deadline);
+  // Still there after a timeout or a spurious wakeup.
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (size_t i = 0; i < s.waiters.size(); ++i) {
+    if (s.waiters[i].second == f) {
+      s.waiters[i] = s.waiters.back();
+      s.waiters.pop_back();
+      s.numWaiters--;
+      break;
+    }
+  }
+}
+
+void fiberFutexWake(std::atomic<int32_t>* word) {
+  FutexStripe& s = futexStripe(word);
+  if (s.numWaiters.load() == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (size_t i = 0; i < s.waiters.size();) {
+    if (s.waiters[i].first == word) {
+      unparkFiber(s.waiters[i].second);
+      s.waiters[i] = s.waiters.back();
+      s.waiters.pop_back();
+      s.numWaiters--;
+    } else {
+      ++i;
+    }
+  }
+}
+
+class FiberPool::Worker {
+ public:
+  Worker(
+      FiberPool* pool,
+      int idx,
+      const std::function<void(int)>& on_start)
+      : pool_(pool), idx_(idx) {
+    thread_ = std::thread([this, idx, on_start]() {
+      tlsPool = pool_;
+      tlsScheduler = &scheduler_;
+      if (on_start != nullptr) {
+        on_start(idx);
+      }
+      loop();
+    });
+  }
+
+  void push(Fiber* f) {
+    f->worker = this;
+    ready_.push(f);
+    if (pool_->steal_) {
+      // Same as ConcurrentQueueFutex: either an idle worker sees f when it
+      // looks again, or this sees it idle. An idle owner gets f itself.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (pool_->numIdle_.load() > 0 && !idle_.load()) {
+        pool_->wakeIdle(this);
+      }
+    }
+  }
+
+  // Wakes the worker if it is idle, to steal; false if it was not.
+  bool wake() {
+    if (!idle_.exchange(false)) {
+      return false;
+    }
+    pool_->numIdle_--;
+    ready_.push(nullptr);
+    return true;
+  }
+
+  // Once all the fibers are done.
+  void stop() {
+    stopping_ = true;
+    ready_.push(nullptr);
+    thread_.join();
+  }
+
+ private:
+  FiberPool* pool_;
+  const int idx_;
+  ConcurrentQueue<Fiber*> ready_;
+  // Parked fibers with a deadline.
+  Fiber::Timers timers_;
+  ucontext_t scheduler_;
+  std::thread thread_;
+  std::atomic<bool> idle_{false};
+  std::atomic<bool> stopping_{false};
+
+  void loop() {
+    while (true) {
+      Fiber* f = nullptr;
+      if (next(&f) && f != nullptr) {
+        run(f);
+      } else if (stopping_.load()) {
+        return;
+      }
+      expireTimers();
+    }
+  }
+
+  // Own ready fibers first, then stolen ones; otherwise waits for either,
+  // or the first timer. nullptr (and true) for a wakeup with nothing to run.
+  bool next(Fiber** f) {
+    if (ready_.tryPopBulk(f, 1) > 0) {
+      return true;
+    }
+    if (pool_->steal_) {
+      if (steal(f)) {
+        return true;
+      }
+      idle_ = true;
+      pool_->numIdle_++;
+      // Looks again, now that pushes see it idle.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const bool found = ready_.tryPopBulk(f, 1) > 0 || steal(f);
+      if (found || stopping_.load()) {
+        if (idle_.exchange(false)) {
+          pool_->numIdle_--;
+        }
+        return found;
+      }
+    }
+    bool popped = true;
+    if (timers_.empty()) {
+      ready_.pop(f);
+    } else {
+      auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+          timers_.begin()->first - Clock::now());
+      popped = ready_.pop(f, std::max(left, std::chrono::microseconds(0)));
+    }
+    if (idle_.exchange(false)) {
+      pool_->numIdle_--;
+    }
+    return popped;
+  }
+
+  // A ready fiber of another worker, from the next one on. Fibers in the
+  // timers of their worker, and wakeups, are given back.
+  bool steal(Fiber** f) {
+    const auto& workers = pool_->workers_;
+    for (size_t k = 1; k < workers.size(); ++k) {
+      Worker* victim = workers[(idx_ + k) % workers.size()].get();
+      Fiber* stolen = nullptr;
+      if (victim->ready_.tryPopBulk(&stolen, 1) == 0) {
+        continue;
+      }
+      if (stolen == nullptr || stolen->hasDeadline) {
+        victim->ready_.push(stolen);
+        continue;
+      }
+      pool_->numStolen_++;
+      *f = stolen;
+      return true;
+    }
+    return false;
+  }
+
+  void expireTimers() {
+    const auto now = Clock::now();
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+      Fiber* f = timers_.begin()->second;
+      timers_.erase(timers_.begin());
+      f->inTimers = false;
+      int parked = PARKED;
+      if (f->state.compare_exchange_strong(parked, RUNNING)) {
+        push(f);
+      }
+    }
+  }
+
+  void run(Fiber* f) {
+    if (f->inTimers) {
+      timers_.erase(f->timer);
+      f->inTimers = false;
+    }
+    f->worker = this;
+    f->hasDeadline = false;
+    f->request = NONE;
+    tlsFiber = f;
+    swapcontext(&scheduler_, &f->ctx);
+    tlsFiber = nullptr;
+
+    switch (f->request) {
+      case DONE:
+        finish(f);
+        break;
+      case YIELD:
+        push(f);
+        break;
+      case PARK: {
+        int running = RUNNING;
+        if (f->state.compare_exchange_strong(running, PARKED)) {
+          if (f->hasDeadline) {
+            f->timer = timers_.emplace(f->deadline, f);
+            f->inTimers = true;
+          }
+        } else {
+          // Unparked before it got there.
+          f->state = RUNNING;
+          push(f);
+        }
+        break;
+      }
+      case NONE:
+        assert(false);
+    }
+  }
+
+  void finish(Fiber* f) {
+    std::shared_ptr<AtomicSwitch> done = std::move(f->done);
+    munmap(f->stack, f->stackSize);
+    delete f;
+    done->set(true);
+    pool_->numDone_.increment();
+  }
+};
+
+void unparkFiber(Fiber* f) {
+  int state = f->state.load();
+  while (true) {
+    if (state == NOTIFIED) {
+      return;
+    }
+    const int next = state == PARKED ? RUNNING : NOTIFIED;
+    if (f->state.compare_exchange_weak(state, next)) {
+      break;
+    }
+  }
+  if (state == PARKED) {
+    f->worker->push(f);
+  }
+}
+
+FiberPool::FiberPool(
+    int num_threads,
+    size_t stack_size,
+    std::function<void(int)> on_start,
+    bool steal)
+    : stackSize_(stack_size), steal_(steal && num_threads > 1) {
+  assert(num_threads > 0);
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker(this, i, on_start));
+  }
+}
+
+FiberPool::~FiberPool() {
+  join();
+  for (auto& w : workers_) {
+    w->stop();
+  }
+}
+
+std::shared_ptr<AtomicSwitch> FiberPool::spawn(std::function<void()> f) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  Fiber* fiber = new Fiber;
+  fiber->stackSize = (stackSize_ + page - 1) / page * page + page;
+  fiber->stack = mmap(
+      nullptr,
+      fiber->stackSize,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+      -1,
+      0);
+  if (fiber->stack == MAP_FAILED) {
+    std::cout << "Error! Cannot map a fiber stack of " << fiber->stackSize
+              << " bytes" << std::endl;
+    abort();
+  }
+  // Guard page at the bottom: stacks grow down.
+  mprotect(fiber->stack, page, PROT_NONE);
+
+  fiber->func = std::move(f);
+  fiber->done = std::make_shared<AtomicSwitch>();
+  getcontext(&fiber->ctx);
+  fiber->ctx.uc_stack.ss_sp = fiber->stack;
+  fiber->ctx.uc_stack.ss_size = fiber->stackSize;
+  fiber->ctx.uc_link = nullptr;
+  makecontext(&fiber->ctx, fiberMain, 0);
+
+  std::shared_ptr<AtomicSwitch> done = fiber->done;
+  numSpawned_++;
+  workers_[nextWorker_++ % workers_.size()]->push(fiber);
+  return done;
+}
+
+void FiberPool::wakeIdle(Worker* from) {
+  const size_t n = workers_.size();
+  const size_t start = nextIdle_++;
+  for (size_t k = 0; k < n; ++k) {
+    Worker* w = workers_[(start + k) % n].get();
+    if (w != from && w->wake()) {
+      return;
+    }
+  }
+}
+
+void FiberPool::join() {
+  numDone_.waitUntilCount(numSpawned_.load());
+}
+
+FiberPool* FiberPool::current() {
+  return tlsPool;
+}
+
+FiberPool* FiberPool::spawnPool() {
+  return tlsFiber != nullptr ? tlsPool : tlsSpawnPool;
+}
+
+void FiberPool::setSpawnPool(FiberPool* pool) {
+  tlsSpawnPool = pool;
+}
+
+} // namespace concurrency
+} // namespace elf
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Cooperative fibers, to run many blocking clients (e.g. games) on a few
+ * threads.
+ *
+ * A FiberPool runs each fiber on one of its worker threads until it parks;
+ * the worker then runs the next ready fiber. A fiber stays on the same
+ * worker, unless the pool steals work: idle workers then take the ready
+ * fibers of busy ones, so that a few threads serve many fibers however
+ * unevenly they are busy (e.g., the tree searches of games that come and
+ * go). A stolen fiber resumes on another thread, and should not keep
+ * thread_local state across parks. The waits
+ * of AtomicCounter (and AtomicSwitch) park the calling fiber instead of its
+ * thread, so that a game blocked in GameClient::sendWait() costs a stack
+ * and nothing else. Other blocking calls (mutexes, condition variables,
+ * I/O) still block the whole worker, and should be short.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Counter.h"
+
+namespace elf {
+namespace concurrency {
+
+class FiberPool;
+
+class Fiber;
+
+/**
+ * The fiber running on this thread, or nullptr on a plain thread (or in the
+ * scheduler of a worker).
+ */
+Fiber* currentFiber();
+
+/**
+ * Suspends the current fiber until unparkFiber() or the deadline (if not
+ * null); it may also return spuriously. A wakeup that comes before the park
+ * is kept, so that the park returns at once.
+ */
+void parkFiber(const std::chrono::steady_clock::time_point* deadline);
+
+/**
+ * Makes a parked fiber runnable again; callable from any thread.
+ */
+void unparkFiber(Fiber* fiber);
+
+/**
+ * Lets the other ready fibers of the worker run; a no-op on plain threads.
+ */
+void yieldFiber();
+
+/**
+ * Sleeps without blocking the worker, when called from a fiber.
+ */
+void sleepFor(std::chrono::microseconds duration);
+
+/**
+ * Identifies the fiber, or the thread outside of fibers. Unique for the
+ * lifetime of the process; the comm nodes are keyed by it.
+ */
+using ExecutionId = uint64_t;
+ExecutionId getExecutionId();
+
+/**
+ * futexWait() and futexWake() for fibers: the waiter parks until a wake on
+ * the same word (or the deadline), if *word == expected.
+ */
+void fiberFutexWait(
+    std::atomic<int32_t>* word,
+    int32_t expected,
+    const std::chrono::steady_clock::time_point* deadline);
+void fiberFutexWake(std::atomic<int32_t>* word);
+
+size_t allocateFiberLocal(size_t size, size_t align);
+void* getFiberLocal(size_t offset, size_t size);
+
+/**
+ * A T of the current fiber (of the thread, outside of fibers), for state that
+ * would otherwise be thread_local. T must be trivially copyable, and valid
+ * zeroed. The reference is only valid until the fiber parks.
+ */
+template <typename T>
+T& executionLocal() {
+  static_assert(
+      std::is_trivially_copyable<T>::value, "Fiber locals are moved bytes");
+  static const size_t offset = allocateFiberLocal(sizeof(T), alignof(T));
+  void* p = getFiberLocal(offset, sizeof(T));
+  if (p == nullptr) {
+    static thread_local T value;
+    return value;
+  }
+  return *static_cast<T*>(p);
+}
+
+class FiberPool {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * on_start(worker_idx) runs first on each worker thread, e.g. to set its
+   * priority or affinity. With steal, idle workers run the ready fibers of
+   * the others.
+   */
+  explicit FiberPool(
+      int num_threads,
+      size_t stack_size = kDefaultStackSize,
+      std::function<void(int)> on_start = nullptr,
+      bool steal = false);
+
+  ~FiberPool();
+
+  FiberPool(const FiberPool&) = delete;
+  FiberPool& operator=(const FiberPool&) = delete;
+
+  /**
+   * Starts a fiber running f. Fibers go round robin over the workers. The
+   * switch is set once f has returned, and may outlive the pool.
+   */
+  std::shared_ptr<AtomicSwitch> spawn(std::function<void()> f);
+
+  /**
+   * Blocks until all the fibers spawned so far have returned.
+   */
+  void join();
+
+  int getNumThreads() const {
+    return (int)workers_.size();
+  }
+
+  /**
+   * Fibers that idle workers took from the others so far.
+   */
+  int64_t getNumStolen() const {
+    return numStolen_.load();
+  }
+
+  /**
+   * The pool of the fiber running on this thread, if any.
+   */
+  static FiberPool* current();
+
+  /**
+   * Where fibers started on this thread (e.g., by a tree search) go: the
+   * pool of the running fiber, or outside of fibers the one set with
+   * setSpawnPool(). nullptr for neither.
+   */
+  static FiberPool* spawnPool();
+
+  /**
+   * Lends pool to the code running on this thread outside of fibers, so that
+   * threads share its workers instead of starting their own.
+   */
+  static void setSpawnPool(FiberPool* pool);
+
+  // Stacks are mapped lazily, so only the pages in use count.
+  static constexpr size_t kDefaultStackSize = 1 << 20;
+
+ private:
+  class Worker;
+  friend class Fiber;
+
+  const size_t stackSize_;
+  const bool steal_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> nextWorker_{0};
+  // Workers waiting with nothing to run, when stealing.
+  std::atomic<int> numIdle_{0};
+  std::atomic<size_t> nextIdle_{0};
+  std::atomic<int64_t> numStolen_{0};
+  std::atomic<int64_t> numSpawned_{0};
+  AtomicCounter<int64_t> numDone_;
+
+  // Wakes an idle worker other than from, to steal.
+  void wakeIdle(Worker* from);
+};
+
+} // namespace concurrency
+} // namespace elf
@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Fiber.h"
+
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ConcurrentQueue.h"
+
+namespace elf {
+namespace concurrency {
+
+// Many more fibers than threads all wait at once, each with its own id.
+TEST(FiberTest, ManyWaitingFibers) {
+  constexpr int kNumFibers = 500;
+  AtomicSwitch go;
+  AtomicCounter<int> numDone;
+  std::mutex mutex;
+  std::set<ExecutionId> ids;
+  {
+    FiberPool pool(2);
+    for (int i = 0; i < kNumFibers; ++i) {
+      pool.spawn([&]() {
+        EXPECT_NE(currentFiber(), nullptr);
+        EXPECT_EQ(FiberPool::current(), &pool);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          ids.insert(getExecutionId());
+        }
+        go.waitUntilTrue();
+        numDone.increment();
+      });
+    }
+    go.set(true);
+    pool.join();
+  }
+  EXPECT_EQ(numDone.waitUntilCount(0), kNumFibers);
+  EXPECT_EQ(ids.size(), (size_t)kNumFibers);
+  EXPECT_EQ(ids.count(getExecutionId()), 0u);
+  EXPECT_EQ(currentFiber(), nullptr);
+}
+
+// Two fibers on one thread hand a token back and forth: a pop that blocked
+// the thread would deadlock.
+TEST(FiberTest, PingPongOnOneThread) {
+  constexpr int kNumRounds = 1000;
+  ConcurrentQueueFutex<int> ping, pong;
+  int last = -1;
+  FiberPool pool(1);
+  pool.spawn([&]() {
+    for (int i = 0; i < kNumRounds; ++i) {
+      int v;
+      ping.pop(&v);
+      pong.push(v + 1);
+    }
+  });
+  auto done = pool.spawn([&]() {
+    int v = 0;
+    for (int i = 0; i < kNumRounds; ++i) {
+      ping.push(v);
+      pong.pop(&v);
+    }
+    last = v;
+  });
+  done->waitUntilTrue();
+  EXPECT_EQ(last, kNumRounds);
+}
+
+// Timed waits and sleeps return without anyone waking them up.
+TEST(FiberTest, TimeoutsAndSleeps) {
+  AtomicCounter<int> never;
+  ConcurrentQueueFutex<int> empty;
+  FiberPool pool(1);
+  for (int i = 0; i < 10; ++i) {
+    pool.spawn([&]() {
+      EXPECT_EQ(never.waitUntilCount(1, std::chrono::milliseconds(2)), 0);
+      int v;
+      EXPECT_FALSE(empty.pop(&v, std::chrono::milliseconds(2)));
+      auto start = std::chrono::steady_clock::now();
+      sleepFor(std::chrono::milliseconds(5));
+      EXPECT_GE(
+          std::chrono::steady_clock::now() - start,
+          std::chrono::milliseconds(5));
+      yieldFiber();
+    });
+  }
+  pool.join();
+}
+
+// A fiber queued behind one that never parks runs on another worker, which
+// would deadlock without stealing.
+TEST(FiberTest, IdleWorkersSteal) {
+  std::atomic<bool> released{false};
+  FiberPool pool(2, FiberPool::kDefaultStackSize, nullptr, true);
+  // Round robin: the first and the third on worker 0.
+  pool.spawn([&]() {
+    while (!released.load()) {
+    }
+  });
+  pool.spawn([]() {});
+  pool.spawn([&]() { released = true; });
+  pool.join();
+  EXPECT_GE(pool.getNumStolen(), 1);
+}
+
+// Fibers that park, sleep and yield all the time move between the workers,
+// and all wake up.
+TEST(FiberTest, StealingUnderLoad) {
+  constexpr int kNumFibers = 200;
+  constexpr int kNumRounds = 50;
+  ConcurrentQueueFutex<int> tokens;
+  AtomicCounter<int> numDone;
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  {
+    FiberPool pool(4, FiberPool::kDefaultStackSize, nullptr, true);
+    for (int i = 0; i < kNumFibers; ++i) {
+      pool.spawn([&, i]() {
+        const ExecutionId id = getExecutionId();
+        for (int r = 0; r < kNumRounds; ++r) {
+          tokens.push(i);
+          int v;
+          tokens.pop(&v);
+          if (r % 3 == 0) {
+            sleepFor(std::chrono::microseconds(50));
+          } else {
+            yieldFiber();
+          }
+          EXPECT_EQ(getExecutionId(), id);
+          EXPECT_EQ(FiberPool::current(), &pool);
+          std::lock_guard<std::mutex> lock(mutex);
+          threads.insert(std::this_thread::get_id());
+        }
+        numDone.increment();
+      });
+    }
+    pool.join();
+  }
+  EXPECT_EQ(numDone.waitUntilCount(0), kNumFibers);
+  EXPECT_EQ(threads.size(), 4u);
+}
+
+// Threads lent a pool spawn into it; fibers spawn into their own pool.
+TEST(FiberTest, SpawnPool) {
+  FiberPool shared(2);
+  FiberPool games(1);
+  EXPECT_EQ(FiberPool::spawnPool(), nullptr);
+  std::thread th([&]() {
+    FiberPool::setSpawnPool(&shared);
+    EXPECT_EQ(FiberPool::spawnPool(), &shared);
+    FiberPool* inner = nullptr;
+    FiberPool::spawnPool()
+        ->spawn([&]() { inner = FiberPool::spawnPool(); })
+        ->waitUntilTrue();
+    EXPECT_EQ(inner, &shared);
+  });
+  th.join();
+  EXPECT_EQ(FiberPool::spawnPool(), nullptr);
+  FiberPool* in_game = nullptr;
+  games.spawn([&]() { in_game = FiberPool::spawnPool(); })->waitUntilTrue();
+  EXPECT_EQ(in_game, &games);
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,314 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "HugePages.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "elf/metrics/Metrics.h"
+
+namespace elf {
+namespace concurrency {
+
+namespace {
+
+constexpr size_t k2MB = 2 << 20;
+constexpr size_t k1GB = 1 << 30;
+
+std::atomic<HugePages> policy{HugePages::OFF};
+
+size_t roundUp(size_t n, size_t m) {
+  return (n + m - 1) / m * m;
+}
+
+std::string backingName(HugePages backing) {
+  return backing == HugePages::OFF ? "none" : hugePagesName(backing);
+}
+
+metrics::Gauge* bytesGauge(const std::string& arena, HugePages backing) {
+  return metrics::Registry::global().gauge(
+      "elf_huge_pages_bytes",
+      "Bytes of the arenas by the pages they got (none: normal pages)",
+      {{"arena", arena}, {"backing", backingName(backing)}});
+}
+
+// AnonHugePages of /proc/self/smaps_rollup, in bytes; 0 if not available.
+double transparentHugePageBytes() {
+  std::ifstream f("/proc/self/smaps_rollup");
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.compare(0, 14, "AnonHugePages:") == 0) {
+      std::istringstream iss(line.substr(14));
+      double kb = 0;
+      iss >> kb;
+      return kb * 1024;
+    }
+  }
+  return 0;
+}
+
+void registerThpGauge() {
+  // Never destroyed, as the registry.
+  static auto* registration = new metrics::Registry::Registration(
+      metrics::Registry::global().addGauge(
+          "elf_huge_pages_thp_bytes",
+          "Transparent huge pages of the process",
+          {},
+          transparentHugePageBytes));
+  (void)registration;
+}
+
+#ifdef __linux__
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// len rounded up to the huge pages of mode, or nullptr if the pool has not
+// enough of them.
+void* mapHugetlb(size_t len, HugePages mode, size_t* mapped) {
+  const bool gb = mode == HugePages::HUGETLB_1GB;
+  *mapped = roundUp(len, gb ? k1GB : k2MB);
+  void* p = mmap(
+      nullptr,
+      *mapped,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+          ((gb ? 30 : 21) << MAP_HUGE_SHIFT),
+      -1,
+      0);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+// Normal pages, aligned to 2 MB so that they may be made transparent huge
+// pages, if so; len rounded up to 2 MB.
+void* mapAligned(size_t len, bool thp, HugePages* backing, size_t* mapped) {
+  *mapped = roundUp(len, k2MB);
+  const size_t over = *mapped + (thp ? k2MB : 0);
+  void* p = mmap(
+      nullptr,
+      over,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  char* begin = static_cast<char*>(p);
+  if (thp) {
+    char* aligned = reinterpret_cast<char*>(
+        roundUp(reinterpret_cast<uintptr_t>(begin), k2MB));
+    if (aligned > begin) {
+      munmap(begin, aligned - begin);
+    }
+    char* end = aligned + *mapped;
+    if (end < begin + over) {
+      munmap(end, begin + over - end);
+    }
+    begin = aligned;
+    *backing = madvise(begin, *mapped, MADV_HUGEPAGE) == 0 ? HugePages::THP
+                                                           : HugePages::OFF;
+  } else {
+    *backing = HugePages::OFF;
+  }
+  return begin;
+}
+
+#endif
+
+} // namespace
+
+HugePages parseHugePages(const std::string& s) {
+  if (s.empty() || s == "off") {
+    return HugePages::OFF;
+  }
+  if (s == "thp") {
+    return HugePages::THP;
+  }
+  if (s == "2mb") {
+    return HugePages::HUGETLB_2MB;
+  }
+  if (s == "1gb") {
+    return HugePages::HUGETLB_1GB;
+  }
+  throw std::invalid_argument(
+      "Huge pages: expected off, thp, 2mb or 1gb, got " + s);
+}
+
+std::string hugePagesName(HugePages mode) {
+  switch (mode) {
+    case HugePages::OFF:
+      return "off";
+    case HugePages::THP:
+      return "thp";
+    case HugePages::HUGETLB_2MB:
+      return "2mb";
+    case HugePages::HUGETLB_1GB:
+      return "1gb";
+  }
+  return "off";
+}
+
+void setHugePages(HugePages mode) {
+  policy = mode;
+  if (mode != HugePages::OFF) {
+    registerThpGauge();
+  }
+}
+
+HugePages getHugePages() {
+  return policy.load();
+}
+
+#ifdef __linux__
+
+bool adviseHugePages(void* addr, size_t len, const std::string& arena) {
+  if (getHugePages() == HugePages::OFF) {
+    return false;
+  }
+  const uintptr_t begin = roundUp(reinterpret_cast<uintptr_t>(addr), k2MB);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + len) & ~(k2MB - 1);
+  if (begin >= end) {
+    return false;
+  }
+  const bool advised =
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE) == 0;
+  bytesGauge(arena, advised ? HugePages::THP : HugePages::OFF)
+      ->add(end - begin);
+  return advised;
+}
+
+HugePageRegion::HugePageRegion(size_t len, const std::string& arena)
+    : size_(len), arena_(arena) {
+  const HugePages mode = getHugePages();
+  len = std::max(len, (size_t)1);
+  if (mode == HugePages::HUGETLB_1GB || mode == HugePages::HUGETLB_2MB) {
+    data_ = mapHugetlb(len, mode, &mapped_);
+    if (data_ == nullptr && mode == HugePages::HUGETLB_1GB) {
+      data_ = mapHugetlb(len, HugePages::HUGETLB_2MB, &mapped_);
+      backing_ = HugePages::HUGETLB_2MB;
+    } else {
+      backing_ = mode;
+    }
+  }
+  if (data_ == nullptr) {
+    data_ = mapAligned(len, mode != HugePages::OFF, &backing_, &mapped_);
+  }
+  if (data_ == nullptr) {
+    throw std::bad_alloc();
+  }
+  bytesGauge(arena_, backing_)->add(mapped_);
+}
+
+void HugePageRegion::reset() {
+  if (data_ == nullptr) {
+    return;
+  }
+  munmap(data_, mapped_);
+  bytesGauge(arena_, backing_)->add(-(double)mapped_);
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = 0;
+}
+
+#else
+
+bool adviseHugePages(void*, size_t, const std::string&) {
+  return false;
+}
+
+HugePageRegion::HugePageRegion(size_t len, const std::string& arena)
+    : size_(len), arena_(arena) {
+  mapped_ = roundUp(std::max(len, (size_t)1), 64);
+  data_ = aligned_alloc(64, mapped_);
+  if (data_ == nullptr) {
+    throw std::bad_alloc();
+  }
+  memset(data_, 0, mapped_);
+  bytesGauge(arena_, backing_)->add(mapped_);
+}
+
+void HugePageRegion::reset() {
+  if (data_ == nullptr) {
+    return;
+  }
+  free(data_);
+  bytesGauge(arena_, backing_)->add(-(double)mapped_);
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = 0;
+}
+
+#endif
+
+HugePageRegion& HugePageRegion::operator=(HugePageRegion&& other) {
+  reset();
+  std::swap(data_, other.data_);
+  std::swap(size_, other.size_);
+  std::swap(mapped_, other.mapped_);
+  std::swap(backing_, other.backing_);
+  std::swap(arena_, other.arena_);
+  return *this;
+}
+
+HugePageBlocks::HugePageBlocks(size_t block_size, const std::string& arena)
+    : blockSize_(roundUp(std::max(block_size, (size_t)1), 64)),
+      arena_(arena) {}
+
+void* HugePageBlocks::allocate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!free_.empty()) {
+    void* p = free_.back();
+    free_.pop_back();
+    return p;
+  }
+  if (next_ == end_) {
+    // A 1 GB page at least, if so.
+    const size_t len = std::max(
+        roundUp(kRegionSize, blockSize_),
+        getHugePages() == HugePages::HUGETLB_1GB ? roundUp(k1GB, blockSize_)
+                                                 : 0);
+    regions_.emplace_back(len, arena_);
+    next_ = static_cast<char*>(regions_.back().data());
+    end_ = next_ + len / blockSize_ * blockSize_;
+  }
+  void* p = next_;
+  next_ += blockSize_;
+  return p;
+}
+
+void HugePageBlocks::deallocate(void* p) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(p);
+}
+
+size_t HugePageBlocks::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t n = 0;
+  for (const auto& r : regions_) {
+    n += r.size();
+  }
+  return n;
+}
+
+} // namespace concurrency
+} // namespace elf
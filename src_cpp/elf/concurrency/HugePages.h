@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Huge pages for the big arenas read at random (search tree slabs, datasets,
+ * the shared memory of the batches), to spare the TLB misses of 4 KB pages
+ * (Linux; elsewhere, or when the kernel has none, normal pages).
+ *
+ * The process-wide policy (setHugePages(), off by default) picks the pages
+ * asked for; each arena falls back to the next kind when it cannot get them:
+ * hugetlb pages of 1 GB or 2 MB (from the pools reserved in
+ * /sys/kernel/mm/hugepages), then transparent huge pages (madvise), then
+ * normal pages. The bytes got per arena and kind are the gauges
+ * elf_huge_pages_bytes{arena,backing}, and the transparent huge pages the
+ * kernel actually gave the process elf_huge_pages_thp_bytes.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace elf {
+namespace concurrency {
+
+enum class HugePages {
+  OFF = 0,
+  // Transparent huge pages.
+  THP = 1,
+  HUGETLB_2MB = 2,
+  HUGETLB_1GB = 3,
+};
+
+/**
+ * "off" (or ""), "thp", "2mb" or "1gb"; throws std::invalid_argument
+ * otherwise.
+ */
+HugePages parseHugePages(const std::string& s);
+
+std::string hugePagesName(HugePages mode);
+
+/**
+ * The policy of the arenas allocated from now on.
+ */
+void setHugePages(HugePages mode);
+
+HugePages getHugePages();
+
+/**
+ * Asks for transparent huge pages for [addr, addr + len), e.g. memory
+ * allocated elsewhere, and adds the 2 MB pages within to the bytes of arena
+ * (as "thp", or "none" if the kernel refuses) for as long as the process
+ * lives. Does nothing if the policy is off; false if not advised.
+ */
+bool adviseHugePages(void* addr, size_t len, const std::string& arena);
+
+/**
+ * Anonymous memory, zeroed, of the pages of the policy as available (see
+ * above), charged to arena until destroyed. Throws std::bad_alloc if not
+ * even normal pages can be mapped.
+ */
+class HugePageRegion {
+ public:
+  HugePageRegion() = default;
+  HugePageRegion(size_t len, const std::string& arena);
+
+  HugePageRegion(HugePageRegion&& other) {
+    *this = std::move(other);
+  }
+  HugePageRegion& operator=(HugePageRegion&& other);
+
+  HugePageRegion(const HugePageRegion&) = delete;
+  HugePageRegion& operator=(const HugePageRegion&) = delete;
+
+  ~HugePageRegion() {
+    reset();
+  }
+
+  void reset();
+
+  void* data() const {
+    return data_;
+  }
+
+  // Bytes asked for.
+  size_t size() const {
+    return size_;
+  }
+
+  // What the pages are: HugePages::OFF for normal pages.
+  HugePages backing() const {
+    return backing_;
+  }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  // Mapped, a multiple of the page size.
+  size_t mapped_ = 0;
+  HugePages backing_ = HugePages::OFF;
+  std::string arena_;
+};
+
+/**
+ * Blocks of a fixed size, e.g. the slabs of a node arena, carved from
+ * HugePageRegions of (about) 64 MB and pooled when freed: the regions are
+ * only unmapped when the HugePageBlocks is destroyed. Thread safe.
+ */
+class HugePageBlocks {
+ public:
+  // Blocks are aligned to 64 bytes.
+  HugePageBlocks(size_t block_size, const std::string& arena);
+
+  HugePageBlocks(const HugePageBlocks&) = delete;
+  HugePageBlocks& operator=(const HugePageBlocks&) = delete;
+
+  void* allocate();
+  void deallocate(void* p);
+
+  size_t blockSize() const {
+    return blockSize_;
+  }
+
+  // Bytes of the regions mapped so far.
+  size_t bytes() const;
+
+ private:
+  static constexpr size_t kRegionSize = 64 << 20;
+
+  const size_t blockSize_;
+  const std::string arena_;
+  mutable std::mutex mutex_;
+  std::vector<HugePageRegion> regions_;
+  std::vector<void*> free_;
+  // Blocks of the last region not handed out yet.
+  char* next_ = nullptr;
+  char* end_ = nullptr;
+};
+
+} // namespace concurrency
+} // namespace elf
@@ -0,0 +1,174 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "HugePages.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "elf/ai/tree_search/tree_search_arena.h"
+#include "elf/metrics/Metrics.h"
+
+namespace elf {
+namespace concurrency {
+
+namespace {
+
+// Bytes of arena, whatever their pages.
+double arenaBytes(const std::string& arena) {
+  const std::string prefix = "elf_huge_pages_bytes{arena=\"" + arena + "\"";
+  double bytes = 0;
+  for (const auto& g : metrics::Registry::global().snapshot().gauges) {
+    if (g.first.compare(0, prefix.size(), prefix) == 0) {
+      bytes += g.second;
+    }
+  }
+  return bytes;
+}
+
+// Restores the policy.
+class HugePagesTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    setHugePages(HugePages::OFF);
+  }
+};
+
+} // namespace
+
+TEST_F(HugePagesTest, ParsesNames) {
+  for (auto mode : {HugePages::OFF,
+                    HugePages::THP,
+                    HugePages::HUGETLB_2MB,
+                    HugePages::HUGETLB_1GB}) {
+    EXPECT_EQ(parseHugePages(hugePagesName(mode)), mode);
+  }
+  EXPECT_EQ(parseHugePages(""), HugePages::OFF);
+  EXPECT_THROW(parseHugePages("4kb"), std::invalid_argument);
+}
+
+// Whatever the host has, the regions get some pages, zeroed, and are
+// counted while they live.
+TEST_F(HugePagesTest, RegionsFallBack) {
+  for (auto mode : {HugePages::OFF,
+                    HugePages::THP,
+                    HugePages::HUGETLB_2MB,
+                    HugePages::HUGETLB_1GB}) {
+    setHugePages(mode);
+    const std::string arena = "test_" + hugePagesName(mode);
+    {
+      HugePageRegion region(3 << 20, arena);
+      ASSERT_NE(region.data(), nullptr);
+      EXPECT_EQ(region.size(), 3u << 20);
+      if (mode == HugePages::OFF) {
+        EXPECT_EQ(region.backing(), HugePages::OFF);
+      }
+      char* p = static_cast<char*>(region.data());
+      EXPECT_EQ(p[0], 0);
+      EXPECT_EQ(p[(3 << 20) - 1], 0);
+      memset(p, 1, 3 << 20);
+      EXPECT_GE(arenaBytes(arena), 3 << 20);
+
+      HugePageRegion moved(std::move(region));
+      EXPECT_EQ(region.data(), nullptr);
+      EXPECT_EQ(static_cast<char*>(moved.data()), p);
+    }
+    EXPECT_EQ(arenaBytes(arena), 0) << hugePagesName(mode);
+  }
+}
+
+TEST_F(HugePagesTest, AdvisesOnlyIfOn) {
+  HugePageRegion region(8 << 20, "test_advise");
+  EXPECT_FALSE(adviseHugePages(region.data(), 8 << 20, "test_advised"));
+  EXPECT_EQ(arenaBytes("test_advised"), 0);
+  setHugePages(HugePages::THP);
+  // Less than a 2 MB page within.
+  EXPECT_FALSE(adviseHugePages(
+      static_cast<char*>(region.data()) + 4096,
+      (2 << 20) - 1,
+      "test_advised"));
+  adviseHugePages(region.data(), 8 << 20, "test_advised");
+  // The 2 MB pages within.
+  EXPECT_GE(arenaBytes("test_advised"), 6 << 20);
+  EXPECT_LE(arenaBytes("test_advised"), 8 << 20);
+}
+
+TEST_F(HugePagesTest, BlocksArePooled) {
+  setHugePages(HugePages::THP);
+  HugePageBlocks blocks(1000, "test_blocks");
+  EXPECT_EQ(blocks.blockSize(), 1024u);
+  std::set<void*> seen;
+  for (int i = 0; i < 100000; ++i) {
+    void* p = blocks.allocate();
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % 64, 0u);
+    ASSERT_TRUE(seen.insert(p).second);
+  }
+  const size_t bytes = blocks.bytes();
+  EXPECT_GE(bytes, 100000u * 1024);
+  for (void* p : seen) {
+    blocks.deallocate(p);
+  }
+  for (int i = 0; i < 100000; ++i) {
+    EXPECT_EQ(seen.count(blocks.allocate()), 1u);
+  }
+  EXPECT_EQ(blocks.bytes(), bytes);
+}
+
+// The slabs of the node arenas come from the blocks, and go back to them.
+TEST_F(HugePagesTest, NodeArenaSlabs) {
+  setHugePages(HugePages::THP);
+  const double before = arenaBytes("tree");
+  {
+    elf::ai::tree_search::NodeArenaT<std::string> arena;
+    std::vector<elf::ai::tree_search::NodeId> ids;
+    for (int i = 0; i < 5000; ++i) {
+      ids.push_back(arena.allocate(std::to_string(i)));
+    }
+    for (int i = 0; i < 5000; ++i) {
+      ASSERT_EQ(*arena.get(ids[i]), std::to_string(i));
+    }
+    EXPECT_GT(arenaBytes("tree"), before);
+    arena.reset();
+    arena.trimPool();
+  }
+  // Kept for the next arenas.
+  EXPECT_GT(arenaBytes("tree"), before);
+}
+
+// The slab table grows with the tree rather than running out.
+TEST_F(HugePagesTest, NodeArenaGrows) {
+  using Arena = elf::ai::tree_search::NodeArenaT<int>;
+  Arena arena;
+  const int n = (Arena::kDirSize + 2) * Arena::kSlabSize;
+  std::vector<elf::ai::tree_search::NodeId> ids;
+  ids.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    ids.push_back(arena.allocate(i));
+  }
+  EXPECT_GT(arena.numActiveSlabs(), Arena::kDirSize);
+  for (int i = 0; i < n; i += 997) {
+    ASSERT_EQ(*arena.get(ids[i]), i);
+  }
+  EXPECT_EQ(arena.size(), (size_t)n);
+  EXPECT_EQ(
+      arena.get(ids.back() + Arena::kDirSize * Arena::kSlabSize), nullptr);
+}
+
+} // namespace concurrency
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#ifdef ELF_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace elf {
+
+namespace distri {
+
+// zstd compression of messages, optionally with a dictionary (e.g. from
+// `zstd --train` on dumped messages) that both ends load. Frames name the
+// dictionary they were compressed with (0: none), so that the receiver can
+// read frames of senders with or without it. Without ELF_WITH_ZSTD,
+// available() is false and nothing gets compressed.
+// Not thread safe.
+class Compressor {
+ public:
+  // Messages of more than kMaxSize bytes are rejected by decompress().
+  static constexpr uint64_t kMaxSize = 1ULL << 31;
+
+  // dict_file: path of the dictionary, or empty.
+  Compressor(int level, const std::string& dict_file) : level_(level) {
+    if (!dict_file.empty()) {
+      std::ifstream f(dict_file, std::ios::binary);
+      if (!f) {
+        throw std::runtime_error("Compressor: cannot read " + dict_file);
+      }
+      std::stringstream ss;
+      ss << f.rdbuf();
+      dict_ = ss.str();
+    }
+#ifdef ELF_WITH_ZSTD
+    cctx_ = ZSTD_createCCtx();
+    dctx_ = ZSTD_createDCtx();
+    if (!dict_.empty()) {
+      dict_id_ = ZSTD_getDictID_fromDict(dict_.data(), dict_.size());
+      cdict_ = ZSTD_createCDict(dict_.data(), dict_.size(), level_);
+      ddict_ = ZSTD_createDDict(dict_.data(), dict_.size());
+    }
+#endif
+  }
+
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  ~Compressor() {
+#ifdef ELF_WITH_ZSTD
+    ZSTD_freeCDict(cdict_);
+    ZSTD_freeDDict(ddict_);
+    ZSTD_freeCCtx(cctx_);
+    ZSTD_freeDCtx(dctx_);
+#endif
+  }
+
+  static bool available() {
+#ifdef ELF_WITH_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // 0 without a dictionary.
+  uint32_t dictId() const {
+    return dict_id_;
+  }
+
+  bool compress(const std::string& in, std::string* out, bool use_dict) {
+#ifdef ELF_WITH_ZSTD
+    out->resize(ZSTD_compressBound(in.size()));
+    size_t n;
+    if (use_dict && cdict_ != nullptr) {
+      n = ZSTD_compress_usingCDict(
+          cctx_, &(*out)[0], out->size(), in.data(), in.size(), cdict_);
+    } else {
+      n = ZSTD_compressCCtx(
+          cctx_, &(*out)[0], out->size(), in.data(), in.size(), level_);
+    }
+    if (ZSTD_isError(n)) {
+      return false;
+    }
+    out->resize(n);
+    return true;
+#else
+    (void)in;
+    (void)out;
+    (void)use_dict;
+    return false;
+#endif
+  }
+
+  // False if in is not a frame of compress(), or needs a dictionary other
+  // than ours.
+  bool decompress(const std::string& in, std::string* out) {
+    return decompress(in.data(), in.size(), out);
+  }
+
+  bool decompress(const char* in, size_t in_size, std::string* out) {
+#ifdef ELF_WITH_ZSTD
+    const uint64_t size = ZSTD_getFrameContentSize(in, in_size);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+        size > kMaxSize) {
+      return false;
+    }
+    const uint32_t frame_dict = ZSTD_getDictID_fromFrame(in, in_size);
+    if (frame_dict != 0 && frame_dict != dict_id_) {
+      return false;
+    }
+    out->resize(size);
+    const size_t n = frame_dict != 0
+        ? ZSTD_decompress_usingDDict(
+              dctx_, &(*out)[0], out->size(), in, in_size, ddict_)
+        : ZSTD_decompressDCtx(dctx_, &(*out)[0], out->size(), in, in_size);
+    return !ZSTD_isError(n) && n == size;
+#else
+    (void)in;
+    (void)in_size;
+    (void)out;
+    return false;
+#endif
+  }
+
+ private:
+  int level_;
+  std::string dict_;
+  uint32_t dict_id_ = 0;
+#ifdef ELF_WITH_ZSTD
+  ZSTD_CCtx* cctx_ = nullptr;
+  ZSTD_DCtx* dctx_ = nullptr;
+  ZSTD_CDict* cdict_ = nullptr;
+  ZSTD_DDict* ddict_ = nullptr;
+#endif
+};
+
+} // namespace distri
+
+} // namespace elf
@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace elf {
+
+namespace distri {
+
+// Maps keys to shards so that adding or removing a shard only moves the keys
+// of that shard: a key goes to the first point of a shard after its hash on
+// a ring, where each shard has kNumPoints points.
+class ConsistentHash {
+ public:
+  static constexpr int kNumPoints = 160;
+
+  explicit ConsistentHash(const std::vector<std::string>& shards) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+      for (int k = 0; k < kNumPoints; ++k) {
+        ring_.emplace_back(hash(shards[i] + "#" + std::to_string(k)), i);
+      }
+    }
+    std::sort(ring_.begin(), ring_.end());
+  }
+
+  // The shard of key, skipping those for which skip(shard) is true; -1 if
+  // all are skipped.
+  template <typename F>
+  int lookup(const std::string& key, F skip) const {
+    if (ring_.empty()) {
+      return -1;
+    }
+    const auto start = std::lower_bound(
+        ring_.begin(), ring_.end(), std::make_pair(hash(key), (size_t)0));
+    for (size_t n = 0; n < ring_.size(); ++n) {
+      auto it = start + n;
+      if (it >= ring_.end()) {
+        it -= ring_.size();
+      }
+      if (!skip(it->second)) {
+        return it->second;
+      }
+    }
+    return -1;
+  }
+
+  int lookup(const std::string& key) const {
+    return lookup(key, [](size_t) { return false; });
+  }
+
+  // FNV-1a with the finalizer of splitmix64 (similar keys are spread), the
+  // same on all hosts.
+  static uint64_t hash(const std::string& s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+
+ private:
+  std::vector<std::pair<uint64_t, size_t>> ring_;
+};
+
+} // namespace distri
+
+} // namespace elf
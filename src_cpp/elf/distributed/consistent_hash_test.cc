@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "consistent_hash.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace distri {
+
+namespace {
+
+std::vector<std::string> shards(int n) {
+  std::vector<std::string> res;
+  for (int i = 0; i < n; ++i) {
+    res.push_back("host:" + std::to_string(5556 + i));
+  }
+  return res;
+}
+
+} // namespace
+
+TEST(ConsistentHashTest, SpreadsKeys) {
+  ConsistentHash h(shards(4));
+  std::vector<int> counts(4, 0);
+  for (int i = 0; i < 8000; ++i) {
+    const int s = h.lookup("client-" + std::to_string(i));
+    ASSERT_GE(s, 0);
+    ASSERT_LT(s, 4);
+    counts[s]++;
+  }
+  for (int c : counts) {
+    EXPECT_GT(c, 1000);
+    EXPECT_LT(c, 3000);
+  }
+}
+
+// Only the keys of a skipped (or removed) shard move.
+TEST(ConsistentHashTest, MovesOnlyKeysOfMissingShard) {
+  ConsistentHash h4(shards(4));
+  ConsistentHash h3(shards(3));
+  for (int i = 0; i < 2000; ++i) {
+    const std::string key = "client-" + std::to_string(i);
+    const int s = h4.lookup(key);
+    const int skipped = h4.lookup(key, [](size_t shard) { return shard == 1; });
+    EXPECT_NE(skipped, 1);
+    if (s != 1) {
+      EXPECT_EQ(skipped, s);
+    }
+    if (s != 3) {
+      EXPECT_EQ(h3.lookup(key), s);
+    }
+  }
+  EXPECT_EQ(h4.lookup("a", [](size_t) { return true; }), -1);
+  EXPECT_EQ(ConsistentHash({}).lookup("a"), -1);
+}
+
+} // namespace distri
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,318 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "elf/legacy/pybind_helper.h"
+
+namespace elf {
+
+namespace shared {
+
+// Snapshot of a Log2Histogram. Bucket i counts the samples of
+// [2^i, 2^(i+1)) (0 goes to bucket 0); the last bucket also holds anything
+// larger.
+struct HistogramSnapshot {
+  static constexpr int kNumBuckets = 40;
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  std::vector<uint64_t> buckets = std::vector<uint64_t>(kNumBuckets, 0);
+
+  // Upper bound of the bucket holding the q-quantile, 0 without samples.
+  uint64_t quantile(double q) const {
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= q * count) {
+        return uint64_t(2) << i;
+      }
+    }
+    return uint64_t(2) << (kNumBuckets - 1);
+  }
+
+  double mean() const {
+    return count > 0 ? (double)sum / count : 0.0;
+  }
+
+  void merge(const HistogramSnapshot& other) {
+    count += other.count;
+    sum += other.sum;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      buckets[i] += other.buckets[i];
+    }
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "#" << count << ", avg: " << mean() << ", p50 < " << quantile(0.5)
+       << ", p99 < " << quantile(0.99);
+    return ss.str();
+  }
+
+  REGISTER_PYBIND_FIELDS(count, sum, buckets);
+};
+
+// Lock free: add() may be called from any thread.
+class Log2Histogram {
+ public:
+  Log2Histogram() {
+    for (auto& b : buckets_) {
+      b = 0;
+    }
+  }
+
+  void add(uint64_t v) {
+    int bucket = 63 - __builtin_clzll(v | 1);
+    if (bucket >= HistogramSnapshot::kNumBuckets) {
+      bucket = HistogramSnapshot::kNumBuckets - 1;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+  }
+
+  HistogramSnapshot snapshot() const {
+    HistogramSnapshot s;
+    s.count = count_.load(std::memory_order_relaxed);
+    s.sum = sum_.load(std::memory_order_relaxed);
+    for (int i = 0; i < HistogramSnapshot::kNumBuckets; ++i) {
+      s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return s;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[HistogramSnapshot::kNumBuckets];
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+};
+
+// Counters of a client (by its identity) at a Reader.
+struct ClientStats {
+  uint64_t num_msgs = 0;
+  uint64_t num_failed = 0;
+  uint64_t num_records = 0;
+  // Bytes of its "content" messages, as received and decompressed.
+  uint64_t wire = 0;
+  uint64_t raw = 0;
+  uint64_t decode_usec = 0;
+  // Sum of the ages of its records when they arrived.
+  uint64_t total_age_sec = 0;
+  // Seconds since epoch.
+  uint64_t first_seen = 0;
+  uint64_t last_seen = 0;
+
+  void merge(const ClientStats& other) {
+    num_msgs += other.num_msgs;
+    num_failed += other.num_failed;
+    num_records += other.num_records;
+    wire += other.wire;
+    raw += other.raw;
+    decode_usec += other.decode_usec;
+    total_age_sec += other.total_age_sec;
+    if (first_seen == 0 ||
+        (other.first_seen > 0 && other.first_seen < first_seen)) {
+      first_seen = other.first_seen;
+    }
+    last_seen = std::max(last_seen, other.last_seen);
+  }
+
+  REGISTER_PYBIND_FIELDS(
+      num_msgs,
+      num_failed,
+      num_records,
+      wire,
+      raw,
+      decode_usec,
+      total_age_sec,
+      first_seen,
+      last_seen);
+};
+
+// ClientStats of each identity, in kNumShards maps with a lock each so that
+// the threads of a Reader seldom wait on each other.
+class ShardedClientStats {
+ public:
+  static constexpr size_t kNumShards = 16;
+
+  // Calls f(&stats) of identity under the lock of its shard. Returns whether
+  // identity is new.
+  bool update(
+      const std::string& identity,
+      const std::function<void(ClientStats*)>& f) {
+    Shard& shard = shards_[std::hash<std::string>()(identity) % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto res = shard.clients.emplace(identity, ClientStats());
+    f(&res.first->second);
+    return res.second;
+  }
+
+  ClientStats get(const std::string& identity) const {
+    const Shard& shard =
+        shards_[std::hash<std::string>()(identity) % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.clients.find(identity);
+    return it != shard.clients.end() ? it->second : ClientStats();
+  }
+
+  std::map<std::string, ClientStats> snapshot() const {
+    std::map<std::string, ClientStats> res;
+    for (const Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      res.insert(shard.clients.begin(), shard.clients.end());
+    }
+    return res;
+  }
+
+ private:
+  struct Shard {
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, ClientStats> clients;
+  };
+
+  Shard shards_[kNumShards];
+};
+
+// Snapshot of the ingest of Readers, for python and for scrapers.
+struct IngestStats {
+  uint64_t num_msgs = 0;
+  uint64_t num_failed = 0;
+  uint64_t num_busy = 0;
+  // Bytes of the messages as received.
+  HistogramSnapshot msg_size;
+  HistogramSnapshot decode_usec;
+  // Seconds from Record::timestamp (or the like) to arrival.
+  HistogramSnapshot record_age_sec;
+  std::map<std::string, ClientStats> clients;
+
+  void merge(const IngestStats& other) {
+    num_msgs += other.num_msgs;
+    num_failed += other.num_failed;
+    num_busy += other.num_busy;
+    msg_size.merge(other.msg_size);
+    decode_usec.merge(other.decode_usec);
+    record_age_sec.merge(other.record_age_sec);
+    for (const auto& c : other.clients) {
+      clients[c.first].merge(c.second);
+    }
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "Ingest: #msg: " << num_msgs << ", #failed: " << num_failed
+       << ", #busy: " << num_busy << ", #client: " << clients.size()
+       << std::endl
+       << "  msg size: " << msg_size.info() << std::endl
+       << "  decode usec: " << decode_usec.info() << std::endl
+       << "  record age sec: " << record_age_sec.info();
+    return ss.str();
+  }
+
+  // In the text format of Prometheus.
+  std::string scrape() const {
+    std::stringstream ss;
+    counter(ss, "elf_ingest_msgs_total", num_msgs);
+    counter(ss, "elf_ingest_failed_total", num_failed);
+    counter(ss, "elf_ingest_busy_total", num_busy);
+    histogram(ss, "elf_ingest_msg_size_bytes", msg_size);
+    histogram(ss, "elf_ingest_decode_usec", decode_usec);
+    histogram(ss, "elf_ingest_record_age_sec", record_age_sec);
+
+    const struct {
+      const char* name;
+      const char* type;
+      uint64_t ClientStats::*field;
+    } kClientFields[] = {
+        {"elf_ingest_client_msgs_total", "counter", &ClientStats::num_msgs},
+        {"elf_ingest_client_failed_total", "counter", &ClientStats::num_failed},
+        {"elf_ingest_client_records_total",
+         "counter",
+         &ClientStats::num_records},
+        {"elf_ingest_client_wire_bytes_total", "counter", &ClientStats::wire},
+        {"elf_ingest_client_decode_usec_total",
+         "counter",
+         &ClientStats::decode_usec},
+        {"elf_ingest_client_record_age_sec_total",
+         "counter",
+         &ClientStats::total_age_sec},
+        {"elf_ingest_client_last_seen_sec", "gauge", &ClientStats::last_seen},
+    };
+    for (const auto& f : kClientFields) {
+      ss << "# TYPE " << f.name << " " << f.type << "\n";
+      for (const auto& c : clients) {
+        ss << f.name << "{identity=\"" << escape(c.first) << "\"} "
+           << c.second.*f.field << "\n";
+      }
+    }
+    return ss.str();
+  }
+
+  REGISTER_PYBIND_FIELDS(
+      num_msgs,
+      num_failed,
+      num_busy,
+      msg_size,
+      decode_usec,
+      record_age_sec,
+      clients);
+
+ private:
+  static void counter(std::ostream& os, const char* name, uint64_t v) {
+    os << "# TYPE " << name << " counter\n" << name << " " << v << "\n";
+  }
+
+  static void
+  histogram(std::ostream& os, const char* name, const HistogramSnapshot& h) {
+    os << "# TYPE " << name << " histogram\n";
+    uint64_t seen = 0;
+    for (int i = 0; i < HistogramSnapshot::kNumBuckets - 1; ++i) {
+      seen += h.buckets[i];
+      // Bucket i holds the integers below 2^(i+1).
+      os << name << "_bucket{le=\"" << ((uint64_t(2) << i) - 1) << "\"} "
+         << seen << "\n";
+    }
+    os << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+    os << name << "_sum " << h.sum << "\n";
+    os << name << "_count " << h.count << "\n";
+  }
+
+  static std::string escape(const std::string& s) {
+    std::string res;
+    for (char c : s) {
+      if (c == '\\' || c == '"') {
+        res += '\\';
+        res += c;
+      } else if (c == '\n') {
+        res += "\\n";
+      } else {
+        res += c;
+      }
+    }
+    return res;
+  }
+};
+
+} // namespace shared
+
+} // namespace elf
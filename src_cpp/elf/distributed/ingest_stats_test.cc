@@ -0,0 +1,145 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "ingest_stats.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "scrape_server.h"
+
+namespace elf {
+namespace shared {
+
+namespace {
+
+// The response of the server on port of localhost to a GET.
+std::string get(int port) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  std::string response;
+  if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+    const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    char buf[1024];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      response.append(buf, n);
+    }
+  }
+  close(fd);
+  return response;
+}
+
+} // namespace
+
+TEST(Log2HistogramTest, CountsPowersOfTwo) {
+  Log2Histogram h;
+  std::vector<std::thread> threads;
+  for (int k = 0; k < 4; ++k) {
+    threads.emplace_back([&h]() {
+      for (uint64_t v = 0; v < 1000; ++v) {
+        h.add(v);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  const HistogramSnapshot s = h.snapshot();
+  EXPECT_EQ(s.count, 4000u);
+  EXPECT_EQ(s.sum, 4u * 999 * 1000 / 2);
+  // 0 and 1.
+  EXPECT_EQ(s.buckets[0], 8u);
+  // [512, 1000).
+  EXPECT_EQ(s.buckets[9], 4u * 488);
+  EXPECT_EQ(s.quantile(0.5), 512u);
+  EXPECT_EQ(s.quantile(1.0), 1024u);
+  EXPECT_EQ(HistogramSnapshot().quantile(0.5), 0u);
+
+  h.add(uint64_t(1) << 60);
+  EXPECT_EQ(h.snapshot().buckets.back(), 1u);
+}
+
+TEST(IngestStatsTest, MergesClientsAndScrapes) {
+  ShardedClientStats clients;
+  EXPECT_TRUE(clients.update("a", [](ClientStats* c) { c->num_msgs++; }));
+  EXPECT_FALSE(clients.update("a", [](ClientStats* c) {
+    c->num_msgs++;
+    c->last_seen = 20;
+  }));
+  clients.update("b\"", [](ClientStats* c) { c->num_failed++; });
+  EXPECT_EQ(clients.get("a").num_msgs, 2u);
+  EXPECT_EQ(clients.get("c").num_msgs, 0u);
+
+  IngestStats s1;
+  s1.num_msgs = 3;
+  s1.clients = clients.snapshot();
+  s1.msg_size.count = 1;
+  s1.msg_size.sum = 100;
+  s1.msg_size.buckets[6] = 1;
+  IngestStats s2;
+  s2.num_msgs = 4;
+  s2.clients["a"].num_msgs = 5;
+  s2.clients["a"].last_seen = 10;
+  s1.merge(s2);
+  EXPECT_EQ(s1.num_msgs, 7u);
+  ASSERT_EQ(s1.clients.size(), 2u);
+  EXPECT_EQ(s1.clients["a"].num_msgs, 7u);
+  EXPECT_EQ(s1.clients["a"].last_seen, 20u);
+
+  const std::string text = s1.scrape();
+  EXPECT_NE(text.find("elf_ingest_msgs_total 7\n"), std::string::npos);
+  EXPECT_NE(
+      text.find("elf_ingest_msg_size_bytes_bucket{le=\"63\"} 0\n"),
+      std::string::npos);
+  EXPECT_NE(
+      text.find("elf_ingest_msg_size_bytes_bucket{le=\"127\"} 1\n"),
+      std::string::npos);
+  EXPECT_NE(
+      text.find("elf_ingest_client_msgs_total{identity=\"a\"} 7\n"),
+      std::string::npos);
+  EXPECT_NE(
+      text.find("elf_ingest_client_failed_total{identity=\"b\\\"\"} 1\n"),
+      std::string::npos);
+}
+
+TEST(ScrapeServerTest, ServesBody) {
+  // Some port that is free.
+  int port = 0;
+  std::unique_ptr<ScrapeServer> server;
+  for (int p = 19090; p < 19190 && server == nullptr; ++p) {
+    try {
+      server.reset(new ScrapeServer(p, []() { return std::string("x 1\n"); }));
+      port = p;
+    } catch (const std::exception&) {
+    }
+  }
+  ASSERT_NE(server, nullptr);
+  for (int i = 0; i < 2; ++i) {
+    const std::string response = get(port);
+    EXPECT_EQ(response.find("HTTP/1.0 200 OK\r\n"), 0u);
+    EXPECT_EQ(response.substr(response.size() - 4), "x 1\n");
+  }
+}
+
+} // namespace shared
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace elf {
+
+namespace shared {
+
+// A minimal HTTP endpoint for scrapers (e.g. Prometheus): any request on
+// port is answered with the text of body(), computed on the thread of the
+// server.
+class ScrapeServer {
+ public:
+  using BodyFunc = std::function<std::string()>;
+
+  ScrapeServer(int port, BodyFunc body) : body_(body) {
+    fd_ = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd_ >= 0) {
+      // Also on IPv4.
+      int v6only = 0;
+      setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+      int reuse = 1;
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      sockaddr_in6 addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin6_family = AF_INET6;
+      addr.sin6_addr = in6addr_any;
+      addr.sin6_port = htons(port);
+      if (bind(fd_, (const sockaddr*)&addr, sizeof(addr)) != 0 ||
+          listen(fd_, 16) != 0) {
+        close(fd_);
+        fd_ = -1;
+      }
+    }
+    if (fd_ < 0) {
+      throw std::runtime_error(
+          "ScrapeServer: cannot listen on " + std::to_string(port) + ": " +
+          strerror(errno));
+    }
+    thread_ = std::thread([this]() { serve(); });
+  }
+
+  ScrapeServer(const ScrapeServer&) = delete;
+  ScrapeServer& operator=(const ScrapeServer&) = delete;
+
+  ~ScrapeServer() {
+    done_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+ private:
+  BodyFunc body_;
+  int fd_ = -1;
+  std::atomic_bool done_{false};
+  std::thread thread_;
+
+  void serve() {
+    while (!done_.load()) {
+      pollfd p = {fd_, POLLIN, 0};
+      if (poll(&p, 1, 100) <= 0) {
+        continue;
+      }
+      const int conn = accept(fd_, nullptr, nullptr);
+      if (conn < 0) {
+        continue;
+      }
+      respond(conn);
+      close(conn);
+    }
+  }
+
+  // Reads the request (up to its first empty line, or for at most a second)
+  // and ignores it.
+  void respond(int conn) {
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < 16384) {
+      pollfd p = {conn, POLLIN, 0};
+      if (poll(&p, 1, 1000) <= 0) {
+        break;
+      }
+      const ssize_t n = recv(conn, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      request.append(buf, n);
+    }
+
+    const std::string body = body_();
+    const std::string response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+      const ssize_t n = send(
+          conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+  }
+};
+
+} // namespace shared
+
+} // namespace elf
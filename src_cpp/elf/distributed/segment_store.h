@@ -0,0 +1,354 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace elf {
+
+namespace shared {
+
+struct SegmentStoreOptions {
+  // Directory of the segments, created if missing.
+  std::string dir;
+  // Bytes of a segment (more for a record that does not fit in one).
+  size_t segment_size = 64 << 20;
+  // Segments kept on disk; the oldest ones are removed.
+  int max_segments = 16;
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "SegmentStore [dir=" << dir << "][segment=" << segment_size
+       << "][max_segments=" << max_segments << "]";
+    return ss.str();
+  }
+};
+
+// An append-only log of records on disk, in files of segment_size bytes
+// ("segment-<index>.bin", the index growing with each segment) that are
+// written and read through mmap. A segment has a header (kMagic, the number
+// of bytes of records) then records, each with its uint32_t size up front.
+// The header is updated after each record is written: the segment of a
+// process that crashed ends at its last complete record.
+//
+// Records are appended on a thread of the store; each run of the process
+// starts a new segment.
+class SegmentStore {
+ public:
+  static constexpr uint32_t kMagic = 0x53464c45; // "ELFS"
+
+  // f(buf) writes a record to buf, on the thread of the store.
+  using EncodeFunc = std::function<void(std::string*)>;
+
+  explicit SegmentStore(const SegmentStoreOptions& options)
+      : options_(options) {
+    if (mkdir(options_.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::runtime_error(
+          "SegmentStore: cannot create " + options_.dir + ": " +
+          strerror(errno));
+    }
+    const std::vector<uint64_t> indices = listSegments();
+    next_index_ = indices.empty() ? 0 : indices.back() + 1;
+    first_index_ = next_index_;
+    writer_ = std::thread([this]() { writeLoop(); });
+  }
+
+  SegmentStore(const SegmentStore&) = delete;
+  SegmentStore& operator=(const SegmentStore&) = delete;
+
+  // Writes the pending records.
+  ~SegmentStore() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    closeSegment();
+  }
+
+  void append(EncodeFunc f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(std::move(f));
+    }
+    cv_.notify_all();
+  }
+
+  // Waits until the records appended so far are written.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushed_cv_.wait(lock, [this]() { return pending_.empty() && !busy_; });
+  }
+
+  // Calls f(data, size) on the records of the last num_segments segments
+  // written by earlier runs, with a thread per segment. Returns the number
+  // of records.
+  size_t load(int num_segments, std::function<void(const char*, size_t)> f)
+      const {
+    std::vector<uint64_t> indices = listSegments();
+    indices.erase(
+        std::remove_if(
+            indices.begin(),
+            indices.end(),
+            [this](uint64_t i) { return i >= first_index_; }),
+        indices.end());
+    if ((int)indices.size() > num_segments) {
+      indices.erase(indices.begin(), indices.end() - num_segments);
+    }
+
+    std::atomic<size_t> count(0);
+    std::vector<std::thread> threads;
+    for (uint64_t index : indices) {
+      threads.emplace_back([this, index, &f, &count]() {
+        count += loadSegment(segmentPath(index), f);
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    return count;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << options_.info() << ", #written: " << num_written_.load()
+       << ", #bytes: " << num_bytes_.load();
+    return ss.str();
+  }
+
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t reserved;
+    // Bytes of records after the header.
+    uint64_t used;
+  };
+
+  const SegmentStoreOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable flushed_cv_;
+  std::deque<EncodeFunc> pending_;
+  // Whether the writer is writing a record out of pending_.
+  bool busy_ = false;
+  bool done_ = false;
+  std::thread writer_;
+
+  // Index of the next segment; the segments of this run start at
+  // first_index_.
+  uint64_t next_index_ = 0;
+  uint64_t first_index_ = 0;
+
+  // Segment being written.
+  int fd_ = -1;
+  char* map_ = nullptr;
+  size_t map_size_ = 0;
+  std::string buf_;
+
+  std::atomic<uint64_t> num_written_{0};
+  std::atomic<uint64_t> num_bytes_{0};
+
+  std::string segmentPath(uint64_t index) const {
+    char name[64];
+    snprintf(
+        name, sizeof(name), "segment-%010llu.bin", (unsigned long long)index);
+    return options_.dir + "/" + name;
+  }
+
+  // Indices of the segments in dir, in order.
+  std::vector<uint64_t> listSegments() const {
+    std::vector<uint64_t> indices;
+    DIR* d = opendir(options_.dir.c_str());
+    if (d == nullptr) {
+      return indices;
+    }
+    while (const dirent* e = readdir(d)) {
+      unsigned long long index;
+      char ext[8];
+      if (sscanf(e->d_name, "segment-%llu.%7s", &index, ext) == 2 &&
+          strcmp(ext, "bin") == 0) {
+        indices.push_back(index);
+      }
+    }
+    closedir(d);
+    std::sort(indices.begin(), indices.end());
+    return indices;
+  }
+
+  void writeLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return done_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      EncodeFunc f = std::move(pending_.front());
+      pending_.pop_front();
+      busy_ = true;
+      lock.unlock();
+
+      buf_.clear();
+      f(&buf_);
+      try {
+        write(buf_);
+      } catch (const std::exception& e) {
+        std::cout << "SegmentStore: record dropped: " << e.what()
+                  << std::endl;
+      }
+
+      lock.lock();
+      busy_ = false;
+      if (pending_.empty()) {
+        flushed_cv_.notify_all();
+      }
+    }
+  }
+
+  void write(const std::string& record) {
+    const size_t n = sizeof(uint32_t) + record.size();
+    if (map_ != nullptr) {
+      const Header* h = reinterpret_cast<const Header*>(map_);
+      if (sizeof(Header) + h->used + n > map_size_) {
+        closeSegment();
+      }
+    }
+    if (map_ == nullptr) {
+      openSegment(std::max(options_.segment_size, sizeof(Header) + n));
+    }
+
+    Header* h = reinterpret_cast<Header*>(map_);
+    char* p = map_ + sizeof(Header) + h->used;
+    const uint32_t size = record.size();
+    memcpy(p, &size, sizeof(size));
+    memcpy(p + sizeof(size), record.data(), record.size());
+    h->used += n;
+
+    num_written_++;
+    num_bytes_ += n;
+  }
+
+  void openSegment(size_t size) {
+    const uint64_t index = next_index_++;
+    const std::string path = segmentPath(index);
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, size) != 0) {
+      const std::string err = strerror(errno);
+      closeSegment();
+      throw std::runtime_error(
+          "SegmentStore: cannot create " + path + ": " + err);
+    }
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+      const std::string err = strerror(errno);
+      closeSegment();
+      throw std::runtime_error(
+          "SegmentStore: cannot map " + path + ": " + err);
+    }
+    map_ = static_cast<char*>(p);
+    map_size_ = size;
+    Header* h = reinterpret_cast<Header*>(map_);
+    h->magic = kMagic;
+    h->reserved = 0;
+    h->used = 0;
+
+    // Retention.
+    for (uint64_t i : listSegments()) {
+      if (i + options_.max_segments <= index) {
+        unlink(segmentPath(i).c_str());
+      }
+    }
+  }
+
+  // Cut to its records.
+  void closeSegment() {
+    if (map_ != nullptr) {
+      const uint64_t used = reinterpret_cast<const Header*>(map_)->used;
+      munmap(map_, map_size_);
+      if (ftruncate(fd_, sizeof(Header) + used) != 0) {
+        std::cout << "SegmentStore: cannot truncate a segment: "
+                  << strerror(errno) << std::endl;
+      }
+      map_ = nullptr;
+      map_size_ = 0;
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  static size_t loadSegment(
+      const std::string& path,
+      const std::function<void(const char*, size_t)>& f) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+      close(fd);
+      return 0;
+    }
+    const size_t size = st.st_size;
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      return 0;
+    }
+    const char* data = static_cast<const char*>(p);
+    Header h;
+    memcpy(&h, data, sizeof(h));
+    size_t count = 0;
+    if (h.magic == kMagic) {
+      const char* end = data + sizeof(Header) +
+          std::min<uint64_t>(h.used, size - sizeof(Header));
+      const char* q = data + sizeof(Header);
+      while (end - q >= (ptrdiff_t)sizeof(uint32_t)) {
+        uint32_t n;
+        memcpy(&n, q, sizeof(n));
+        q += sizeof(n);
+        if (n > (size_t)(end - q)) {
+          break;
+        }
+        f(q, n);
+        q += n;
+        count++;
+      }
+    }
+    munmap(p, size);
+    return count;
+  }
+};
+
+} // namespace shared
+
+} // namespace elf
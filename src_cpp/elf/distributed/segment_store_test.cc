@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "segment_store.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "shared_reader.h"
+
+namespace elf {
+namespace shared {
+
+namespace {
+
+std::vector<std::string> listDir(const std::string& dir) {
+  std::vector<std::string> names;
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return names;
+  }
+  while (const dirent* e = readdir(d)) {
+    if (e->d_name[0] != '.') {
+      names.push_back(e->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+class SegmentStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    options_.dir = "segment_store_test_" + std::to_string(getpid());
+  }
+
+  void TearDown() override {
+    for (const auto& name : listDir(options_.dir)) {
+      unlink((options_.dir + "/" + name).c_str());
+    }
+    rmdir(options_.dir.c_str());
+  }
+
+  std::vector<std::string> load(int num_segments) {
+    SegmentStore store(options_);
+    std::mutex mutex;
+    std::vector<std::string> records;
+    const size_t n =
+        store.load(num_segments, [&](const char* data, size_t size) {
+          std::lock_guard<std::mutex> lock(mutex);
+          records.emplace_back(data, size);
+        });
+    EXPECT_EQ(n, records.size());
+    std::sort(records.begin(), records.end());
+    return records;
+  }
+
+  SegmentStoreOptions options_;
+};
+
+std::string record(int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "record-%04d", i);
+  return buf;
+}
+
+} // namespace
+
+TEST_F(SegmentStoreTest, LoadsRecordsOfEarlierRuns) {
+  {
+    SegmentStore store(options_);
+    for (int i = 0; i < 100; ++i) {
+      store.append([i](std::string* buf) { *buf = record(i); });
+    }
+  }
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; ++i) {
+    expected.push_back(record(i));
+  }
+  EXPECT_EQ(load(1), expected);
+
+  // Records of this run are not loaded.
+  SegmentStore store(options_);
+  store.append([](std::string* buf) { *buf = record(100); });
+  store.flush();
+  EXPECT_EQ(store.load(10, [](const char*, size_t) {}), 100u);
+}
+
+TEST_F(SegmentStoreTest, RollsSegmentsAndKeepsTheLast) {
+  // Header + 5 records.
+  options_.segment_size = 16 + 5 * (4 + record(0).size());
+  options_.max_segments = 3;
+  {
+    SegmentStore store(options_);
+    for (int i = 0; i < 50; ++i) {
+      store.append([i](std::string* buf) { *buf = record(i); });
+    }
+    store.flush();
+    EXPECT_EQ(listDir(options_.dir).size(), 3u);
+    // Longer than a segment.
+    store.append([](std::string* buf) { *buf = std::string(1000, 'x'); });
+  }
+  std::vector<std::string> names = listDir(options_.dir);
+  ASSERT_EQ(names.size(), 3u);
+  EXPECT_EQ(names.back(), "segment-0000000010.bin");
+
+  std::vector<std::string> records = load(2);
+  ASSERT_EQ(records.size(), 6u);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(records[i], record(45 + i));
+  }
+  EXPECT_EQ(records.back(), std::string(1000, 'x'));
+}
+
+TEST_F(SegmentStoreTest, RestoresReaderQueues) {
+  RQCtrl ctrl;
+  ctrl.num_reader = 2;
+  ctrl.ctrl.queue_max_size = 100;
+  auto encode = [](const int& v, std::string* buf) {
+    buf->append(std::to_string(v));
+  };
+  auto decode = [](const char* data, size_t size, int* v) {
+    *v = std::stoi(std::string(data, size));
+    return *v >= 0;
+  };
+
+  {
+    SegmentStore store(options_);
+    ReaderQueuesT<int> qs(ctrl);
+    qs.setStore(&store, encode);
+    for (int i = 0; i < 10; ++i) {
+      qs[i % 2]->Insert(int(i));
+    }
+    qs[0]->Insert(-1);
+  }
+
+  SegmentStore store(options_);
+  ReaderQueuesT<int> qs(ctrl);
+  EXPECT_EQ(qs.loadStore(store, 1, decode), 10u);
+  std::vector<int> q0 = qs[0]->Dump();
+  std::vector<int> q1 = qs[1]->Dump();
+  std::sort(q0.begin(), q0.end());
+  std::sort(q1.begin(), q1.end());
+  EXPECT_EQ(q0, std::vector<int>({0, 2, 4, 6, 8}));
+  EXPECT_EQ(q1, std::vector<int>({1, 3, 5, 7, 9}));
+}
+
+} // namespace shared
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,13 +8,35 @@
 
 #pragma once
 
+#include <assert.h>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <deque>
 #include <functional>
 #include <iostream>
-#include <shared_mutex>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "elf/logging/Logging.h"
+#include "elf/metrics/Memory.h"
+#include "elf/metrics/Metrics.h"
+#include "elf/utils/binary_utils.h"
+#include "elf/utils/utils.h"
+
+#include "segment_store.h"
 
 namespace elf {
 
@@ -23,63 +45,265 @@ namespace shared {
 struct ReaderCtrl {
   size_t queue_min_size = 10;
   size_t queue_max_size = 1000;
+  // How samplers pick records:
+  //   "uniform": all alike.
+  //   "priority": proportional to their priority (see setPriority()).
+  //   "recency": the k-th newest with weight recency_decay^k.
+  //   "stratified": uniform among the strata of the records (see
+  //   setStratum()), then among the records of the stratum.
+  std::string sampling = "uniform";
+  double recency_decay = 0.999;
+  // By the model versions of the records (see ReaderQueueT::setVersion()):
+  //   version_window: only the records of the last version_window versions
+  //   are kept and sampled (0 = all).
+  //   version_quotas: the largest share of the samples of the records of the
+  //   k-th newest version (version newest - k), the last one for older
+  //   versions (empty = none).
+  int version_window = 0;
+  std::vector<double> version_quotas;
   std::string info() const {
     std::stringstream ss;
-    ss << "Queue [min=" << queue_min_size << "][max=" << queue_max_size << "]";
+    ss << "Queue [min=" << queue_min_size << "][max=" << queue_max_size
+       << "][sampling=" << sampling;
+    if (sampling == "recency") {
+      ss << "(" << recency_decay << ")";
+    }
+    ss << "]";
+    if (version_window > 0) {
+      ss << "[versions=" << version_window << "]";
+    }
+    if (!version_quotas.empty()) {
+      ss << "[quotas=";
+      for (size_t i = 0; i < version_quotas.size(); ++i) {
+        ss << (i > 0 ? "," : "") << version_quotas[i];
+      }
+      ss << "]";
+    }
     return ss.str();
   }
 };
 
+enum class SamplingMethod { UNIFORM, PRIORITY, RECENCY, STRATIFIED };
+
+inline SamplingMethod parseSamplingMethod(const std::string& s) {
+  if (s == "uniform")
+    return SamplingMethod::UNIFORM;
+  if (s == "priority")
+    return SamplingMethod::PRIORITY;
+  if (s == "recency")
+    return SamplingMethod::RECENCY;
+  if (s == "stratified")
+    return SamplingMethod::STRATIFIED;
+  throw std::invalid_argument("Unknown sampling method: " + s);
+}
+
+// Sums of the weights of ranges of slots, in a complete binary tree whose
+// leaves are the slots: O(log n) to set a weight or to find the slot at a
+// prefix sum. Set from one thread at a time; find() may run concurrently and
+// then sees a mix of old and new weights along its path, which only skews
+// the odds of the slots being updated.
+class SumTree {
+ public:
+  explicit SumTree(size_t n) : size_(1) {
+    while (size_ < n) {
+      size_ *= 2;
+    }
+    nodes_.reset(new std::atomic<double>[2 * size_]);
+    clear();
+  }
+
+  void set(size_t i, double w) {
+    size_t node = size_ + i;
+    nodes_[node].store(w, std::memory_order_relaxed);
+    for (node /= 2; node >= 1; node /= 2) {
+      nodes_[node].store(
+          nodes_[2 * node].load(std::memory_order_relaxed) +
+              nodes_[2 * node + 1].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+  }
+
+  double total() const {
+    return nodes_[1].load(std::memory_order_relaxed);
+  }
+
+  // The slot i with sum(w[0..i)) <= u < sum(w[0..i]), for 0 <= u < total().
+  size_t find(double u) const {
+    size_t node = 1;
+    while (node < size_) {
+      const double left = nodes_[2 * node].load(std::memory_order_relaxed);
+      const double right =
+          nodes_[2 * node + 1].load(std::memory_order_relaxed);
+      // Rounding may leave u past the last positive weight.
+      if (u < left || right <= 0) {
+        node = 2 * node;
+      } else {
+        u -= left;
+        node = 2 * node + 1;
+      }
+    }
+    return node - size_;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < 2 * size_; ++i) {
+      nodes_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  size_t size_;
+  std::unique_ptr<std::atomic<double>[]> nodes_;
+};
+
+// A ring of the last queue_max_size records. Records are shared: a slot
+// is overwritten by an insert while samplers may still read its previous
+// record, which lives as long as they do. Samplers never block inserts (which
+// only wait for each other), and take no lock but for stratified sampling,
+// which holds a short one to pick the position of a record.
+//
+// Records may instead be kept packed (see setPacking()), e.g. compressed,
+// and unpacked when sampled.
+//
+// Records may also be partitioned by the version of the model that made them
+// (see setVersion()), to evict those of obsolete models and cap the share of
+// the samples of each version.
 template <typename T>
 class ReaderQueueT {
  public:
   using ReaderQ = ReaderQueueT<T>;
+  using Entry = std::shared_ptr<const T>;
+  using PriorityFunc = std::function<double(const T&)>;
+  using StratumFunc = std::function<int64_t(const T&)>;
+  using VersionFunc = std::function<int64_t(const T&)>;
+  using InsertHook = std::function<void(const Entry&)>;
+  using SizeFunc = std::function<size_t(const T&)>;
+  using PackFunc = std::function<void(const T&, std::string*)>;
+  using UnpackFunc = std::function<bool(const std::string&, T*)>;
+  using Packed = std::shared_ptr<const std::string>;
 
   class Sampler {
    public:
-    explicit Sampler(ReaderQ* r, std::mt19937* rng)
-        : r_(r), lock_(r->rwMutex_), rng_(rng) {
-      released_ = false;
-    }
+    explicit Sampler(ReaderQ* r, std::mt19937* rng) : r_(r), rng_(rng) {}
     Sampler(const Sampler&) = delete;
-    Sampler(Sampler&& sampler)
-        : r_(sampler.r_), released_(sampler.released_), rng_(sampler.rng_) {}
+    Sampler(Sampler&& sampler) = default;
 
+    // The record is valid as long as the sampler (or until the next
+    // sample()).
+    // nullptr if the queue is not ready() within timeout_millisec.
+    // Packed records are unpacked to a record of the sampler, reused.
     const T* sample(int timeout_millisec = 100) {
-      const auto& buf = r_->buffer_;
-
-      if (buf.size() < r_->ctrl_.queue_min_size) {
-        lock_.unlock();
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(timeout_millisec));
-        lock_.lock();
-        if (buf.size() < r_->ctrl_.queue_min_size)
-          return nullptr;
-      }
-
-      int idx = (*rng_)() % buf.size();
-      return &buf[idx];
-    }
+      if (!r_->waitReady(std::chrono::milliseconds(timeout_millisec)))
+        return nullptr;
 
-    ~Sampler() {
-      release();
+      if (!r_->packed()) {
+        entry_ = r_->sampleEntry(rng_);
+        return entry_.get();
+      }
+      if (unpacked_ == nullptr) {
+        unpacked_.reset(new T());
+      }
+      return r_->unpack(r_->samplePacked(rng_), unpacked_.get())
+          ? unpacked_.get()
+          : nullptr;
     }
 
-   private:
-    void release() {
-      if (!released_) {
-        lock_.unlock();
-        released_ = true;
+    // sample(), sharing the record rather than lending it: it stays valid as
+    // long as the result, e.g. to be read without copying it. Packed records
+    // are unpacked to a new record.
+    Entry sampleShared(int timeout_millisec = 100) {
+      if (!r_->packed()) {
+        sample(timeout_millisec);
+        return entry_;
       }
+      if (!r_->waitReady(std::chrono::milliseconds(timeout_millisec)))
+        return nullptr;
+      auto v = std::make_shared<T>();
+      if (!r_->unpack(r_->samplePacked(rng_), v.get()))
+        return nullptr;
+      return v;
     }
 
+   private:
     ReaderQ* r_;
-    std::shared_lock<std::shared_mutex> lock_;
-    bool released_ = true;
     std::mt19937* rng_ = nullptr;
+    Entry entry_;
+    std::unique_ptr<T> unpacked_;
   };
 
-  ReaderQueueT(const ReaderCtrl& ctrl) : ctrl_(ctrl) {}
+  ReaderQueueT(const ReaderCtrl& ctrl)
+      : ctrl_(ctrl),
+        method_(parseSamplingMethod(ctrl.sampling)),
+        capacity_(std::max<size_t>(ctrl.queue_max_size, 1)),
+        slots_(new Entry[capacity_]),
+        slot_bytes_(new int64_t[capacity_]()) {
+    if (method_ == SamplingMethod::PRIORITY) {
+      priorities_.reset(new SumTree(capacity_));
+    } else if (method_ == SamplingMethod::STRATIFIED) {
+      slot_strata_.reset(new int64_t[capacity_]);
+    }
+  }
+
+  // Priority (>= 0) of a record for "priority" sampling; 1 for all records
+  // by default. Set before the first insert.
+  void setPriority(PriorityFunc f) {
+    priority_ = f;
+  }
+
+  // Stratum of a record for "stratified" sampling; all records are in one by
+  // default. Set before the first insert.
+  void setStratum(StratumFunc f) {
+    stratum_ = f;
+  }
+
+  // Model version of a record, for the version_window and version_quotas of
+  // the ReaderCtrl; all records are of version 0 by default. Set before the
+  // first insert.
+  //
+  // Versions are relative to the newest one the queue got: records of
+  // versions out of the window are refused, and dropped from the oldest end
+  // as newer versions come (or never sampled if newer records are older in
+  // the queue). Quotas are met by rejecting samples of versions over theirs,
+  // as counted from the records held.
+  void setVersion(VersionFunc f) {
+    version_ = f;
+    if (slot_versions_ == nullptr) {
+      slot_versions_.reset(new std::atomic<int64_t>[capacity_]);
+    }
+  }
+
+  // Called with the records of Insert(), e.g. to persist them. Set before
+  // the first insert.
+  void setInsertHook(InsertHook f) {
+    insert_hook_ = f;
+  }
+
+  // Bytes held by a record, charged to the "replay" memory account;
+  // sizeof(T) by default; packed records count for their packed size. Set
+  // before the first insert.
+  //
+  // While the account is over its budget, each insert drops the oldest
+  // records of the queue, down to queue_min_size of them.
+  void setSizeFunc(SizeFunc f) {
+    size_ = f;
+  }
+
+  // Keeps the records packed with pack(v, buf), which appends v to buf (e.g.
+  // compressed, for a longer replay window in the same memory), and
+  // unpacks them with unpack(buf, v) when sampled (false if it cannot). The
+  // records given to the other functions are the unpacked ones. Set before
+  // the first insert.
+  void setPacking(PackFunc pack, UnpackFunc unpack) {
+    pack_ = pack;
+    unpack_ = unpack;
+    if (packed_slots_ == nullptr) {
+      packed_slots_.reset(new Packed[capacity_]);
+    }
+  }
+
+  bool packed() const {
+    return packed_slots_ != nullptr;
+  }
 
   Sampler getSampler(std::mt19937* rng) {
     return Sampler(this, rng);
@@ -87,35 +311,132 @@ class ReaderQueueT {
 
   // Return delta buffer size.
   int Insert(T&& v) {
-    int delta = 0;
+    Entry entry = std::make_shared<const T>(std::move(v));
+    if (insert_hook_) {
+      insert_hook_(entry);
+    }
+    return insertEntry(std::move(entry));
+  }
+
+  // Insert() without the insert hook, for the records it already got (e.g.
+  // restored from where it persisted them).
+  int Restore(T&& v) {
+    return insertEntry(std::make_shared<const T>(std::move(v)));
+  }
+
+  // Whether the queue has queue_min_size records to sample.
+  bool ready() const {
+    return size() >= ctrl_.queue_min_size;
+  }
+
+  // Waits until ready(), woken by inserts. Returns false on timeout.
+  template <typename Duration>
+  bool waitReady(Duration timeout) {
+    if (ready())
+      return true;
+    const auto start = std::chrono::steady_clock::now();
+    bool res;
     {
-      std::unique_lock<std::shared_mutex> lock(rwMutex_);
-      buffer_.push_back(v);
-      delta++;
-      while (buffer_.size() > ctrl_.queue_max_size) {
-        buffer_.pop_front();
-        delta--;
-      }
+      std::unique_lock<std::mutex> lock(ready_mutex_);
+      num_waiters_++;
+      res = ready_cv_.wait_for(lock, timeout, [this]() { return ready(); });
+      num_waiters_--;
     }
-    return delta;
+    addStall(std::chrono::steady_clock::now() - start);
+    return res;
+  }
+
+  void waitReady() {
+    if (ready())
+      return;
+    const auto start = std::chrono::steady_clock::now();
+    {
+      std::unique_lock<std::mutex> lock(ready_mutex_);
+      num_waiters_++;
+      ready_cv_.wait(lock, [this]() { return ready(); });
+      num_waiters_--;
+    }
+    addStall(std::chrono::steady_clock::now() - start);
+  }
+
+  // Number and total time of the waits of samplers for the queue to be
+  // ready(): when they add up, training is waiting for data.
+  uint64_t numStalls() const {
+    return num_stalls_.load();
+  }
+
+  double stallSec() const {
+    return stall_usec_.load() / 1e6;
   }
 
   void clear() {
-    std::unique_lock<std::shared_mutex> lock(rwMutex_);
-    buffer_.clear();
+    std::lock_guard<std::mutex> lock(insert_mutex_);
+    begin_ = num_inserted_.load();
+    for (size_t i = 0; i < capacity_; ++i) {
+      storeSlot(i, Entry(), nullptr);
+      slot_bytes_[i] = 0;
+    }
+    memory_.set(0);
+    if (priorities_ != nullptr) {
+      priorities_->clear();
+    }
+    {
+      std::lock_guard<std::mutex> versions_lock(versions_mutex_);
+      versions_.clear();
+    }
+    std::lock_guard<std::mutex> strata_lock(strata_mutex_);
+    strata_.clear();
+    strata_keys_.clear();
   }
 
   std::vector<T> Dump() const {
     std::vector<T> vec;
-    {
-      std::shared_lock<std::shared_mutex> lock(rwMutex_);
-      vec.insert(vec.end(), buffer_.begin(), buffer_.end());
+    const uint64_t end = num_inserted_.load(std::memory_order_acquire);
+    const uint64_t n = std::min<uint64_t>(end - begin_.load(), capacity_);
+    for (uint64_t pos = end - n; pos < end; ++pos) {
+      const size_t slot = pos % capacity_;
+      if (packed()) {
+        T v;
+        if (unpack(std::atomic_load(&packed_slots_[slot]), &v)) {
+          vec.push_back(std::move(v));
+        }
+        continue;
+      }
+      Entry entry = std::atomic_load(&slots_[slot]);
+      if (entry != nullptr) {
+        vec.push_back(*entry);
+      }
     }
     return vec;
   }
 
   size_t size() const {
-    return buffer_.size();
+    const uint64_t n = num_inserted_.load() - begin_.load();
+    return std::min<uint64_t>(n, capacity_);
+  }
+
+  // Odds of a sample of the queue against those of the other queues: the
+  // sum of the priorities with "priority" sampling, the size otherwise.
+  double weight() const {
+    if (priorities_ != nullptr) {
+      return size() > 0 ? priorities_->total() : 0.0;
+    }
+    return size();
+  }
+
+  // Number of records of each version, with setVersion().
+  std::map<int64_t, size_t> versionSizes() const {
+    std::map<int64_t, size_t> sizes;
+    std::lock_guard<std::mutex> lock(versions_mutex_);
+    for (const auto& p : versions_) {
+      sizes[p.first] = p.second.size;
+    }
+    return sizes;
+  }
+
+  // Records refused or dropped as their version left the window.
+  uint64_t numStale() const {
+    return num_stale_.load();
   }
 
   std::string info() const {
@@ -125,12 +446,396 @@ class ReaderQueueT {
   }
 
  private:
-  // TODO: update to std::shared_mutex with C++17
-  mutable std::shared_mutex rwMutex_;
+  // Records of a version held by the queue.
+  struct Partition {
+    size_t size = 0;
+    // Odds to keep a sample of one of the records, for version_quotas.
+    double odds = 1.0;
+  };
+
+  // Samples rejected by version in a row before sampleSlot() gives up.
+  static constexpr int kMaxVersionTries = 64;
 
-  std::deque<T> buffer_;
+  // Live positions of a stratum, oldest first.
+  struct Stratum {
+    std::deque<uint64_t> positions;
+    // In strata_keys_.
+    size_t key_idx = 0;
+  };
 
   ReaderCtrl ctrl_;
+  const SamplingMethod method_;
+  const size_t capacity_;
+  // Record of insert k in slot k % capacity_.
+  std::unique_ptr<Entry[]> slots_;
+  std::atomic<uint64_t> num_inserted_{0};
+  // Inserts before clear(), or dropped over the memory budget.
+  std::atomic<uint64_t> begin_{0};
+  std::mutex insert_mutex_;
+
+  SizeFunc size_;
+  PackFunc pack_;
+  UnpackFunc unpack_;
+  // In place of slots_ if packed().
+  std::unique_ptr<Packed[]> packed_slots_;
+  // Bytes of the record of each slot, and their sum, with insert_mutex_.
+  std::unique_ptr<int64_t[]> slot_bytes_;
+  elf::metrics::MemoryCharge memory_{"replay"};
+
+  std::mutex ready_mutex_;
+  std::condition_variable ready_cv_;
+  std::atomic<int> num_waiters_{0};
+  std::atomic<uint64_t> num_stalls_{0};
+  std::atomic<uint64_t> stall_usec_{0};
+
+  InsertHook insert_hook_;
+
+  PriorityFunc priority_;
+  // Priorities of the slots, for "priority" sampling.
+  std::unique_ptr<SumTree> priorities_;
+
+  StratumFunc stratum_;
+  // Strata of the slots, for "stratified" sampling.
+  std::unique_ptr<int64_t[]> slot_strata_;
+  std::mutex strata_mutex_;
+  std::unordered_map<int64_t, Stratum> strata_;
+  // The keys of strata_, to pick one in O(1).
+  std::vector<int64_t> strata_keys_;
+
+  VersionFunc version_;
+  // Versions of the slots, with setVersion().
+  std::unique_ptr<std::atomic<int64_t>[]> slot_versions_;
+  std::atomic<int64_t> newest_version_{std::numeric_limits<int64_t>::min()};
+  mutable std::mutex versions_mutex_;
+  std::map<int64_t, Partition> versions_;
+  std::atomic<uint64_t> num_stale_{0};
+
+  int insertEntry(Entry entry) {
+    std::shared_ptr<std::string> packed;
+    int64_t bytes;
+    if (this->packed()) {
+      packed = std::make_shared<std::string>();
+      pack_(*entry, packed.get());
+      packed->shrink_to_fit();
+      bytes = sizeof(std::string) + packed->capacity();
+    } else {
+      bytes = size_ ? size_(*entry) : sizeof(T);
+    }
+    const int64_t version = version_ ? version_(*entry) : 0;
+    std::lock_guard<std::mutex> lock(insert_mutex_);
+    if (slot_versions_ != nullptr && stale(version)) {
+      num_stale_++;
+      return 0;
+    }
+    const uint64_t pos = num_inserted_.load(std::memory_order_relaxed);
+    const size_t slot = pos % capacity_;
+    const bool overwrite = pos - begin_.load() >= capacity_;
+    if (slot_versions_ != nullptr) {
+      insertVersion(slot, version, overwrite);
+    }
+    memory_.add(bytes - slot_bytes_[slot]);
+    slot_bytes_[slot] = bytes;
+    if (priorities_ != nullptr) {
+      priorities_->set(
+          slot, priority_ ? std::max(priority_(*entry), 0.0) : 1.0);
+    }
+    if (slot_strata_ != nullptr) {
+      insertStratum(pos, stratum_ ? stratum_(*entry) : 0, overwrite);
+    }
+    if (packed != nullptr) {
+      storeSlot(slot, Entry(), std::move(packed));
+    } else {
+      storeSlot(slot, std::move(entry), nullptr);
+    }
+    // Published with the record, and before num_waiters_ is read (see
+    // waitReady()).
+    num_inserted_.store(pos + 1);
+    int dropped = 0;
+    if (slot_versions_ != nullptr && ctrl_.version_window > 0) {
+      // The records of the versions left behind by this one.
+      while (size() > 0 && stale(slot_versions_[oldestPos() % capacity_])) {
+        dropOldest();
+        dropped++;
+        num_stale_++;
+      }
+    }
+    while (memory_.account().overBudget() && size() > ctrl_.queue_min_size) {
+      dropOldest();
+      dropped++;
+    }
+    if (num_waiters_.load() > 0) {
+      std::lock_guard<std::mutex> ready_lock(ready_mutex_);
+      ready_cv_.notify_all();
+    }
+    return (overwrite ? 0 : 1) - dropped;
+  }
+
+  // With insert_mutex_ held.
+  uint64_t oldestPos() const {
+    const uint64_t end = num_inserted_.load(std::memory_order_relaxed);
+    return std::max<uint64_t>(
+        begin_.load(), end > capacity_ ? end - capacity_ : 0);
+  }
+
+  // With insert_mutex_ held.
+  void dropOldest() {
+    const uint64_t pos = oldestPos();
+    const size_t slot = pos % capacity_;
+    if (slot_versions_ != nullptr) {
+      std::lock_guard<std::mutex> lock(versions_mutex_);
+      removeVersion(slot_versions_[slot]);
+      updateVersionOdds();
+    }
+    storeSlot(slot, Entry(), nullptr);
+    memory_.add(-slot_bytes_[slot]);
+    slot_bytes_[slot] = 0;
+    if (priorities_ != nullptr) {
+      priorities_->set(slot, 0.0);
+    }
+    if (slot_strata_ != nullptr) {
+      std::lock_guard<std::mutex> lock(strata_mutex_);
+      popStratum(slot);
+    }
+    begin_.store(pos + 1);
+  }
+
+  template <typename Duration>
+  void addStall(Duration d) {
+    num_stalls_++;
+    stall_usec_ +=
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+
+  void insertStratum(uint64_t pos, int64_t key, bool overwrite) {
+    const size_t slot = pos % capacity_;
+    std::lock_guard<std::mutex> lock(strata_mutex_);
+    if (overwrite) {
+      popStratum(slot);
+    }
+    auto res = strata_.emplace(key, Stratum());
+    if (res.second) {
+      res.first->second.key_idx = strata_keys_.size();
+      strata_keys_.push_back(key);
+    }
+    res.first->second.positions.push_back(pos);
+    slot_strata_[slot] = key;
+  }
+
+  bool stale(int64_t version) const {
+    const int64_t newest = newest_version_.load(std::memory_order_relaxed);
+    return ctrl_.version_window > 0 && version < newest &&
+        newest - version >= ctrl_.version_window;
+  }
+
+  // With insert_mutex_ held.
+  void insertVersion(size_t slot, int64_t version, bool overwrite) {
+    if (version > newest_version_.load(std::memory_order_relaxed)) {
+      newest_version_.store(version, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(versions_mutex_);
+    if (overwrite) {
+      removeVersion(slot_versions_[slot]);
+    }
+    versions_[version].size++;
+    slot_versions_[slot].store(version, std::memory_order_relaxed);
+    updateVersionOdds();
+  }
+
+  // With versions_mutex_ held.
+  void removeVersion(int64_t version) {
+    auto it = versions_.find(version);
+    if (it != versions_.end() && --it->second.size == 0) {
+      versions_.erase(it);
+    }
+  }
+
+  // Sets the odds of the partitions, with versions_mutex_ held. The share of
+  // the samples of each version is that of its records, scaled up as the
+  // versions over their quota are capped to it (until none is over); the
+  // odds to keep a sample are those shares over the shares of the records,
+  // relative to the largest.
+  void updateVersionOdds() {
+    const auto& quotas = ctrl_.version_quotas;
+    if (quotas.empty()) {
+      return;
+    }
+    const int64_t newest = newest_version_.load(std::memory_order_relaxed);
+    double total = 0;
+    for (const auto& p : versions_) {
+      if (!stale(p.first)) {
+        total += p.second.size;
+      }
+    }
+    if (total <= 0) {
+      return;
+    }
+    // Partitions and their quota, -1 once capped.
+    std::vector<std::pair<Partition*, double>> open;
+    for (auto& p : versions_) {
+      p.second.odds = 0;
+      if (!stale(p.first)) {
+        const size_t k = std::min<size_t>(
+            std::max<int64_t>(newest - p.first, 0), quotas.size() - 1);
+        open.emplace_back(&p.second, quotas[k]);
+      }
+    }
+    double capped_share = 0;
+    double open_size = total;
+    double scale = 1;
+    bool changed = true;
+    while (changed && open_size > 0) {
+      changed = false;
+      scale = (1 - capped_share) * total / open_size;
+      for (auto& p : open) {
+        if (p.second >= 0 && scale * p.first->size / total > p.second) {
+          p.first->odds = p.second * total / p.first->size;
+          capped_share += p.second;
+          open_size -= p.first->size;
+          p.second = -1;
+          changed = true;
+        }
+      }
+    }
+    double max_odds = 0;
+    for (auto& p : open) {
+      if (p.second >= 0) {
+        p.first->odds = open_size > 0 ? scale : 0;
+      }
+      max_odds = std::max(max_odds, p.first->odds);
+    }
+    for (auto& p : open) {
+      p.first->odds = max_odds > 0 ? p.first->odds / max_odds : 1.0;
+    }
+  }
+
+  // Odds to keep a sample of a record of version.
+  double versionOdds(int64_t version) const {
+    if (stale(version)) {
+      return 0;
+    }
+    if (ctrl_.version_quotas.empty()) {
+      return 1;
+    }
+    std::lock_guard<std::mutex> lock(versions_mutex_);
+    auto it = versions_.find(version);
+    return it != versions_.end() ? it->second.odds : 0;
+  }
+
+  void storeSlot(size_t slot, Entry entry, Packed packed) {
+    if (packed_slots_ != nullptr) {
+      std::atomic_store(&packed_slots_[slot], std::move(packed));
+    } else {
+      std::atomic_store(&slots_[slot], std::move(entry));
+    }
+  }
+
+  bool unpack(const Packed& packed, T* v) const {
+    return packed != nullptr && unpack_(*packed, v);
+  }
+
+  // Removes the record of slot, the oldest of its stratum, with
+  // strata_mutex_ held.
+  void popStratum(size_t slot) {
+    auto it = strata_.find(slot_strata_[slot]);
+    assert(it != strata_.end());
+    it->second.positions.pop_front();
+    if (it->second.positions.empty()) {
+      const size_t idx = it->second.key_idx;
+      strata_keys_[idx] = strata_keys_.back();
+      strata_[strata_keys_[idx]].key_idx = idx;
+      strata_keys_.pop_back();
+      strata_.erase(it);
+    }
+  }
+
+  // A record of the queue, picked by method_; nullptr if a concurrent
+  // clear() emptied it, or the record was dropped.
+  Entry sampleEntry(std::mt19937* rng) {
+    const int64_t slot = sampleSlot(rng);
+    return slot >= 0 ? std::atomic_load(&slots_[slot]) : nullptr;
+  }
+
+  // sampleEntry() of packed records.
+  Packed samplePacked(std::mt19937* rng) {
+    const int64_t slot = sampleSlot(rng);
+    return slot >= 0 ? std::atomic_load(&packed_slots_[slot]) : nullptr;
+  }
+
+  // The slot of a record picked by method_, and kept with the odds of its
+  // version; -1 if the queue is empty, or only stale records were picked.
+  int64_t sampleSlot(std::mt19937* rng) {
+    if (slot_versions_ == nullptr) {
+      return pickSlot(rng);
+    }
+    int64_t kept = -1;
+    for (int i = 0; i < kMaxVersionTries; ++i) {
+      const int64_t slot = pickSlot(rng);
+      if (slot < 0) {
+        return -1;
+      }
+      const double odds = versionOdds(slot_versions_[slot].load());
+      if (odds >= 1.0 ||
+          std::uniform_real_distribution<double>(0, 1)(*rng) < odds) {
+        return slot;
+      }
+      // Over its quota, but better than no record at all.
+      if (odds > 0) {
+        kept = slot;
+      }
+    }
+    return kept;
+  }
+
+  // The slot of a record picked by method_; -1 if the queue is empty.
+  int64_t pickSlot(std::mt19937* rng) {
+    const uint64_t end = num_inserted_.load(std::memory_order_acquire);
+    const uint64_t n = std::min<uint64_t>(end - begin_.load(), capacity_);
+    if (n == 0) {
+      return -1;
+    }
+    // The slot of the oldest records may be being overwritten: the record
+    // read is then the new one.
+    uint64_t pos = 0;
+    switch (method_) {
+      case SamplingMethod::UNIFORM:
+        pos = end - n + (*rng)() % n;
+        break;
+      case SamplingMethod::PRIORITY: {
+        const double total = priorities_->total();
+        if (total <= 0) {
+          pos = end - n + (*rng)() % n;
+          break;
+        }
+        const double u = std::uniform_real_distribution<double>(0, total)(*rng);
+        return std::min(priorities_->find(u), capacity_ - 1);
+      }
+      case SamplingMethod::RECENCY:
+        pos = end - 1 - sampleAge(n, ctrl_.recency_decay, rng);
+        break;
+      case SamplingMethod::STRATIFIED: {
+        std::lock_guard<std::mutex> lock(strata_mutex_);
+        if (strata_keys_.empty()) {
+          return -1;
+        }
+        const auto& positions =
+            strata_[strata_keys_[(*rng)() % strata_keys_.size()]].positions;
+        pos = positions[(*rng)() % positions.size()];
+        break;
+      }
+    }
+    return pos % capacity_;
+  }
+
+  // k in [0, n) with odds decay^k, by inverting its CDF.
+  static uint64_t sampleAge(uint64_t n, double decay, std::mt19937* rng) {
+    if (decay >= 1.0 || decay <= 0.0) {
+      return (*rng)() % n;
+    }
+    const double u = std::uniform_real_distribution<double>(0, 1)(*rng);
+    const double tail = std::pow(decay, (double)n);
+    const double k = std::log(1.0 - u * (1.0 - tail)) / std::log(decay);
+    return std::min<uint64_t>((uint64_t)k, n - 1);
+  }
 };
 
 class RQInterface {
@@ -141,10 +846,26 @@ class RQInterface {
     int msg_size = 0;
   };
 
+  // A message decoded by Decode().
+  struct Decoded {
+    virtual ~Decoded() = default;
+    int msg_size = 0;
+    // Creation times (seconds since epoch) of the records of the message, if
+    // the converter knows them.
+    std::vector<uint64_t> timestamps;
+  };
+
   // bool: whether the insert is successful
   // int: changes of the queue length.
   virtual InsertInfo Insert(const std::string&, int queue_idx) = 0;
   virtual InsertInfo Insert(const std::string&, std::mt19937* rng) = 0;
+  // Insert(msg, rng) in two steps, so that messages can be decoded in
+  // parallel: Decode() may be called from any thread (nullptr if msg is
+  // malformed), Insert() from one at a time.
+  virtual std::unique_ptr<Decoded> Decode(std::string&& msg) = 0;
+  virtual InsertInfo Insert(
+      std::unique_ptr<Decoded>&& decoded,
+      std::mt19937* rng) = 0;
   virtual size_t nqueue() const = 0;
 };
 
@@ -166,14 +887,76 @@ class ReaderQueuesT : public RQInterface {
   ReaderQueuesT(const RQCtrl& reader_ctrl) : min_size_satisfied_(false) {
     // Make sure this is an even number.
     assert(reader_ctrl.num_reader % 2 == 0);
-    min_size_per_queue_ = reader_ctrl.ctrl.queue_min_size;
 
+    // Each queue gets one in num_reader of the records: recency_decay is per
+    // record of them all.
+    ReaderCtrl ctrl = reader_ctrl.ctrl;
+    ctrl.recency_decay = std::pow(ctrl.recency_decay, reader_ctrl.num_reader);
     for (int i = 0; i < reader_ctrl.num_reader; ++i) {
-      qs_.emplace_back(new ReaderQueue(reader_ctrl.ctrl));
+      qs_.emplace_back(new ReaderQueue(ctrl));
+    }
+    fill_ = elf::metrics::Registry::global().addGauge(
+        "elf_replay_size", "Records held by the replay queues", {}, [this]() {
+          size_t total = 0;
+          for (const auto& q : qs_) {
+            total += q->size();
+          }
+          return (double)total;
+        });
+  }
+
+  // See ReaderQueueT::setPriority().
+  void setPriority(typename ReaderQueue::PriorityFunc f) {
+    for (auto& q : qs_) {
+      q->setPriority(f);
+    }
+  }
+
+  // See ReaderQueueT::setStratum(). Records are spread over the queues at
+  // random, so that each queue has about the same strata.
+  void setStratum(typename ReaderQueue::StratumFunc f) {
+    for (auto& q : qs_) {
+      q->setStratum(f);
+    }
+  }
+
+  // See ReaderQueueT::setVersion(). Each queue has the window and quotas of
+  // the newest version it got, which soon is the newest of all.
+  void setVersion(typename ReaderQueue::VersionFunc f) {
+    for (auto& q : qs_) {
+      q->setVersion(f);
+    }
+  }
+
+  // Number of records of each version, over all the queues.
+  std::map<int64_t, size_t> versionSizes() const {
+    std::map<int64_t, size_t> sizes;
+    for (const auto& q : qs_) {
+      for (const auto& p : q->versionSizes()) {
+        sizes[p.first] += p.second;
+      }
+    }
+    return sizes;
+  }
+
+  // See ReaderQueueT::setPacking().
+  void setPacking(
+      typename ReaderQueue::PackFunc pack,
+      typename ReaderQueue::UnpackFunc unpack) {
+    for (auto& q : qs_) {
+      q->setPacking(pack, unpack);
+    }
+  }
+
+  // See ReaderQueueT::setSizeFunc().
+  void setSizeFunc(typename ReaderQueue::SizeFunc f) {
+    for (auto& q : qs_) {
+      q->setSizeFunc(f);
     }
   }
 
   void setConverter(ConvertFuncSingle f) {
+    setRawDecoder();
     converter_ = [f, this](const std::string& s, std::function<int()> g) {
       RQInterface::InsertInfo info;
 
@@ -189,6 +972,7 @@ class ReaderQueuesT : public RQInterface {
   }
 
   void setConverter(ConvertFuncVector f) {
+    setRawDecoder();
     converter_ = [f, this](const std::string& s, std::function<int()> g) {
       RQInterface::InsertInfo info;
 
@@ -203,6 +987,57 @@ class ReaderQueuesT : public RQInterface {
     };
   }
 
+  // A converter in two steps: decode (thread safe) parses a message into a D,
+  // and apply (called from one thread at a time) acts on it and returns the
+  // entries to insert. timestamps(d, ts), if set, gives the creation times of
+  // the records of d (see Decoded::timestamps).
+  template <typename D>
+  void setConverter(
+      std::function<bool(const std::string&, D*)> decode,
+      std::function<bool(D&&, std::vector<T>*)> apply,
+      std::function<void(const D&, std::vector<uint64_t>*)> timestamps =
+          nullptr) {
+    decoder_ = [decode, timestamps](
+                   std::string&& s) -> std::unique_ptr<Decoded> {
+      std::unique_ptr<DecodedT<D>> d(new DecodedT<D>());
+      if (!decode(s, &d->value))
+        return nullptr;
+      d->msg_size = s.size();
+      if (timestamps != nullptr) {
+        timestamps(d->value, &d->timestamps);
+      }
+      return std::move(d);
+    };
+    applier_ = [apply, this](Decoded&& d, std::function<int()> g) {
+      RQInterface::InsertInfo info;
+
+      std::vector<T> vs;
+      if (!apply(std::move(static_cast<DecodedT<D>&>(d).value), &vs))
+        return info;
+
+      info = Insert(std::move(vs), g);
+      info.msg_size = d.msg_size;
+      return info;
+    };
+    converter_ = [this](const std::string& s, std::function<int()> g) {
+      std::unique_ptr<Decoded> d = decoder_(std::string(s));
+      if (d == nullptr)
+        return RQInterface::InsertInfo();
+      return applier_(std::move(*d), g);
+    };
+  }
+
+  std::unique_ptr<Decoded> Decode(std::string&& msg) override {
+    return decoder_(std::move(msg));
+  }
+
+  InsertInfo Insert(std::unique_ptr<Decoded>&& decoded, std::mt19937* rng)
+      override {
+    return applier_(std::move(*decoded), [rng, this]() -> int {
+      return (*rng)() % qs_.size();
+    });
+  }
+
   InsertInfo Insert(const std::string& msg, int idx) override {
     return converter_(msg, [=]() { return idx; });
   }
@@ -279,13 +1114,83 @@ class ReaderQueuesT : public RQInterface {
     return qs_[idx].get();
   }
 
-  typename ReaderQueue::Sampler getSampler(int idx, std::mt19937* rng) {
-    if (!min_size_satisfied_.load()) {
-      while (!sufficient_per_queue_size()) {
-        std::this_thread::sleep_for(std::chrono::seconds(60));
+  // Appends the records inserted from now on to store, with the index of
+  // their queue; encode(v, buf) appends v to buf, on the thread of the store.
+  void setStore(
+      SegmentStore* store,
+      std::function<void(const T&, std::string*)> encode) {
+    for (size_t i = 0; i < qs_.size(); ++i) {
+      qs_[i]->setInsertHook(
+          [store, encode, i](const typename ReaderQueue::Entry& entry) {
+            store->append([entry, encode, i](std::string* buf) {
+              elf_utils::BinaryWriter w(buf);
+              w.write<uint32_t>(i);
+              encode(*entry, buf);
+            });
+          });
+    }
+  }
+
+  // Restores the records of the last num_segments segments of store to
+  // their queues (modulo nqueue()), decoding the segments in parallel.
+  // decode(data, size, v) is false for records to skip. Returns the number
+  // of records restored.
+  size_t loadStore(
+      const SegmentStore& store,
+      int num_segments,
+      std::function<bool(const char*, size_t, T*)> decode) {
+    std::atomic<size_t> count(0);
+    store.load(num_segments, [&](const char* data, size_t size) {
+      try {
+        elf_utils::BinaryReader r(data, size);
+        const uint32_t idx = r.read<uint32_t>();
+        T v;
+        if (decode(data + sizeof(idx), r.remaining(), &v)) {
+          qs_[idx % qs_.size()]->Restore(std::move(v));
+          count++;
+        }
+      } catch (const std::exception&) {
       }
-      min_size_satisfied_ = true;
+    });
+    return count;
+  }
+
+  // A queue to sample, with the odds of its weight() (uniform until they
+  // have records), so that samples of its sampler follow the sampling method
+  // over all the records.
+  // Called by every sampling thread for every sample: it allocates nothing
+  // and takes no lock, weights being read twice (inserts that change them
+  // in between only skew the odds a little).
+  int pickQueue(std::mt19937* rng) const {
+    double total = 0;
+    for (const auto& q : qs_) {
+      total += q->weight();
+    }
+    if (total <= 0) {
+      return (*rng)() % qs_.size();
+    }
+    double u = std::uniform_real_distribution<double>(0, total)(*rng);
+    for (size_t i = 0; i < qs_.size(); ++i) {
+      const double w = qs_[i]->weight();
+      if (u < w)
+        return i;
+      u -= w;
+    }
+    return qs_.size() - 1;
+  }
+
+  // Waits until all the queues are ready() (again after clear()).
+  void waitAllReady() {
+    if (min_size_satisfied_.load())
+      return;
+    for (auto& q : qs_) {
+      q->waitReady();
     }
+    min_size_satisfied_ = true;
+  }
+
+  typename ReaderQueue::Sampler getSampler(int idx, std::mt19937* rng) {
+    waitAllReady();
     return qs_[idx]->getSampler(rng);
   }
 
@@ -300,34 +1205,67 @@ class ReaderQueuesT : public RQInterface {
       ss << p->size() << ", ";
       total += p->size();
     }
-    ss << "Total: " << total
+    uint64_t num_stalls = 0;
+    double stall_sec = 0;
+    uint64_t num_stale = 0;
+    for (const auto& p : qs_) {
+      num_stalls += p->numStalls();
+      stall_sec += p->stallSec();
+      num_stale += p->numStale();
+    }
+    ss << "Total: " << total << ", Stalls: " << num_stalls << " ("
+       << stall_sec << " sec)"
        << ", MinSizeSatisfied: " << min_size_satisfied_.load();
+    const auto versions = versionSizes();
+    if (!versions.empty()) {
+      ss << ", Versions: " << versions.begin()->first << "-"
+         << versions.rbegin()->first << " (stale: " << num_stale << ")";
+    }
     return ss.str();
   }
 
  private:
   std::vector<std::unique_ptr<ReaderQueue>> qs_;
+  template <typename D>
+  struct DecodedT : public Decoded {
+    D value;
+  };
+
   std::function<
       RQInterface::InsertInfo(const std::string&, std::function<int()>)>
       converter_;
-  size_t min_size_per_queue_ = 0;
+  std::function<std::unique_ptr<Decoded>(std::string&&)> decoder_;
+  std::function<RQInterface::InsertInfo(Decoded&&, std::function<int()>)>
+      applier_;
   std::atomic_bool min_size_satisfied_;
   size_t total_insertion_ = 0;
+  std::shared_ptr<spdlog::logger> logger_ =
+      elf::logging::getIndexedLogger("elf::shared::ReaderQueuesT-");
+  elf::metrics::Counter* inserted_ = elf::metrics::Registry::global().counter(
+      "elf_replay_inserted_total",
+      "Records inserted to the replay queues");
+  // Declared after qs_, which it reads.
+  elf::metrics::Registry::Registration fill_;
+
+  // For the converters in one step: the message is decoded by them when
+  // inserted.
+  void setRawDecoder() {
+    decoder_ = [](std::string&& s) -> std::unique_ptr<Decoded> {
+      std::unique_ptr<DecodedT<std::string>> d(new DecodedT<std::string>());
+      d->value = std::move(s);
+      return std::move(d);
+    };
+    applier_ = [this](Decoded&& d, std::function<int()> g) {
+      return converter_(static_cast<DecodedT<std::string>&>(d).value, g);
+    };
+  }
 
   void inc_insertion_count() {
+    inserted_->add();
     total_insertion_++;
     if (total_insertion_ % 1000 == 0) {
-      std::cout << elf_utils::now()
-                << ", ReaderQueue Insertion: " << total_insertion_ << std::endl;
-    }
-  }
-
-  bool sufficient_per_queue_size() const {
-    for (const auto& q : qs_) {
-      if (q->size() < min_size_per_queue_)
-        return false;
+      logger_->info("ReaderQueue Insertion: {}", total_insertion_);
     }
-    return true;
   }
 };
 
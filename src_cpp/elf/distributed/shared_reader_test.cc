@@ -0,0 +1,403 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "shared_reader.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace shared {
+
+namespace {
+
+ReaderCtrl makeCtrl(
+    size_t min_size,
+    size_t max_size,
+    const std::string& sampling = "uniform") {
+  ReaderCtrl ctrl;
+  ctrl.queue_min_size = min_size;
+  ctrl.queue_max_size = max_size;
+  ctrl.sampling = sampling;
+  return ctrl;
+}
+
+// Number of samples of each value in [0, n).
+std::vector<int>
+histogram(ReaderQueueT<int>* q, int n, int num_samples, int seed = 0) {
+  std::mt19937 rng(seed);
+  auto sampler = q->getSampler(&rng);
+  std::vector<int> counts(n, 0);
+  for (int i = 0; i < num_samples; ++i) {
+    const int* v = sampler.sample(0);
+    if (v != nullptr && *v >= 0 && *v < n) {
+      counts[*v]++;
+    }
+  }
+  return counts;
+}
+
+} // namespace
+
+TEST(ReaderQueueTest, KeepsTheLastRecords) {
+  ReaderQueueT<int> q(makeCtrl(1, 4));
+  int delta = 0;
+  for (int i = 0; i < 10; ++i) {
+    delta += q.Insert(int(i));
+  }
+  EXPECT_EQ(delta, 4);
+  EXPECT_EQ(q.size(), 4u);
+  EXPECT_EQ(q.Dump(), std::vector<int>({6, 7, 8, 9}));
+
+  std::mt19937 rng(0);
+  auto sampler = q.getSampler(&rng);
+  for (int i = 0; i < 100; ++i) {
+    const int* v = sampler.sample();
+    ASSERT_NE(v, nullptr);
+    EXPECT_GE(*v, 6);
+  }
+
+  q.clear();
+  EXPECT_EQ(q.size(), 0u);
+  EXPECT_EQ(sampler.sample(0), nullptr);
+  EXPECT_EQ(q.Insert(10), 1);
+  EXPECT_EQ(q.Dump(), std::vector<int>({10}));
+}
+
+// A sampled record outlives its slot.
+TEST(ReaderQueueTest, SampleSurvivesOverwrite) {
+  ReaderQueueT<std::vector<int>> q(makeCtrl(1, 1));
+  q.Insert(std::vector<int>(100, 1));
+  std::mt19937 rng(0);
+  auto sampler = q.getSampler(&rng);
+  const std::vector<int>* v = sampler.sample();
+  ASSERT_NE(v, nullptr);
+  q.Insert(std::vector<int>(100, 2));
+  EXPECT_EQ(*v, std::vector<int>(100, 1));
+  EXPECT_EQ(*sampler.sample(), std::vector<int>(100, 2));
+
+  // A shared sample outlives its sampler.
+  std::shared_ptr<const std::vector<int>> shared;
+  {
+    auto other = q.getSampler(&rng);
+    shared = other.sampleShared();
+  }
+  q.Insert(std::vector<int>(100, 3));
+  ASSERT_NE(shared, nullptr);
+  EXPECT_EQ(*shared, std::vector<int>(100, 2));
+}
+
+TEST(ReaderQueueTest, SamplersDoNotBlockInserts) {
+  constexpr int kNumInserts = 100000;
+  ReaderQueueT<std::vector<int>> q(makeCtrl(1, 64));
+  q.Insert(std::vector<int>(8, 0));
+
+  std::atomic<bool> done(false);
+  std::atomic<int> num_wrong(0);
+  std::vector<std::thread> samplers;
+  for (int k = 0; k < 4; ++k) {
+    samplers.emplace_back([&, k]() {
+      std::mt19937 rng(k);
+      // Held for the whole test.
+      auto sampler = q.getSampler(&rng);
+      while (!done) {
+        const std::vector<int>* v = sampler.sample(0);
+        if (v == nullptr || v->size() != 8 || (*v)[0] != (*v)[7]) {
+          num_wrong++;
+        }
+      }
+    });
+  }
+  for (int i = 1; i <= kNumInserts; ++i) {
+    q.Insert(std::vector<int>(8, i));
+  }
+  done = true;
+  for (auto& t : samplers) {
+    t.join();
+  }
+  EXPECT_EQ(num_wrong.load(), 0);
+  EXPECT_EQ(q.Dump().back()[0], kNumInserts);
+}
+
+// A sampler waiting for the queue is woken by the insert that makes it ready.
+TEST(ReaderQueueTest, SamplerWakesUpOnInsert) {
+  ReaderQueueT<int> q(makeCtrl(2, 4));
+  q.Insert(1);
+  std::mt19937 rng(0);
+  auto sampler = q.getSampler(&rng);
+  EXPECT_EQ(sampler.sample(0), nullptr);
+  EXPECT_EQ(q.numStalls(), 1u);
+
+  std::thread inserter([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    q.Insert(2);
+  });
+  const auto start = std::chrono::steady_clock::now();
+  const int* v = sampler.sample(60000);
+  inserter.join();
+  ASSERT_NE(v, nullptr);
+  EXPECT_LT(
+      std::chrono::steady_clock::now() - start, std::chrono::seconds(30));
+  EXPECT_EQ(q.numStalls(), 2u);
+  EXPECT_GT(q.stallSec(), 0.01);
+}
+
+TEST(ReaderQueuesTest, WaitsForAllQueues) {
+  RQCtrl ctrl;
+  ctrl.num_reader = 2;
+  ctrl.ctrl = makeCtrl(1, 4);
+  ReaderQueuesT<int> qs(ctrl);
+  qs[0]->Insert(1);
+
+  std::atomic<bool> ready(false);
+  std::thread waiter([&]() {
+    qs.waitAllReady();
+    ready = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(ready.load());
+  qs[1]->Insert(2);
+  waiter.join();
+  EXPECT_TRUE(ready.load());
+}
+
+TEST(SumTreeTest, FindsSlotOfPrefixSum) {
+  SumTree tree(5);
+  const std::vector<double> w = {1.0, 0.0, 2.0, 0.5, 1.5};
+  for (size_t i = 0; i < w.size(); ++i) {
+    tree.set(i, w[i]);
+  }
+  EXPECT_DOUBLE_EQ(tree.total(), 5.0);
+  EXPECT_EQ(tree.find(0.0), 0u);
+  EXPECT_EQ(tree.find(0.99), 0u);
+  EXPECT_EQ(tree.find(1.0), 2u);
+  EXPECT_EQ(tree.find(3.2), 3u);
+  EXPECT_EQ(tree.find(4.99), 4u);
+  // Past the total.
+  EXPECT_EQ(tree.find(7.0), 4u);
+  tree.set(2, 0.0);
+  EXPECT_DOUBLE_EQ(tree.total(), 3.0);
+  EXPECT_EQ(tree.find(1.0), 3u);
+}
+
+TEST(ReaderQueueTest, PrioritySampling) {
+  ReaderQueueT<int> q(makeCtrl(1, 4, "priority"));
+  // Priority of v is v, which overwritten records no longer have.
+  q.setPriority([](const int& v) { return double(v); });
+  for (int v : {7, 7, 0, 1, 2, 3}) {
+    q.Insert(int(v));
+  }
+  EXPECT_DOUBLE_EQ(q.weight(), 6.0);
+  const std::vector<int> counts = histogram(&q, 4, 60000);
+  EXPECT_EQ(counts[0], 0);
+  EXPECT_NEAR(counts[1], 10000, 600);
+  EXPECT_NEAR(counts[2], 20000, 600);
+  EXPECT_NEAR(counts[3], 30000, 600);
+
+  q.clear();
+  EXPECT_DOUBLE_EQ(q.weight(), 0.0);
+}
+
+TEST(ReaderQueueTest, RecencySampling) {
+  ReaderCtrl ctrl = makeCtrl(1, 8, "recency");
+  ctrl.recency_decay = 0.5;
+  ReaderQueueT<int> q(ctrl);
+  for (int i = 0; i < 12; ++i) {
+    q.Insert(int(i));
+  }
+  // 11 is the newest.
+  const std::vector<int> counts = histogram(&q, 12, 100000);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(counts[i], 0);
+  }
+  EXPECT_NEAR(counts[11], 50000, 1000);
+  EXPECT_NEAR(counts[10], 25000, 1000);
+  EXPECT_NEAR(counts[9], 12500, 1000);
+  EXPECT_GT(counts[4], 0);
+}
+
+TEST(ReaderQueueTest, StratifiedSampling) {
+  ReaderQueueT<int> q(makeCtrl(1, 8, "stratified"));
+  // Stratum of v is v / 10.
+  q.setStratum([](const int& v) -> int64_t { return v / 10; });
+  // Stratum 0 is overwritten.
+  for (int v : {0, 1, 10, 11, 12, 13, 14, 15, 16, 20}) {
+    q.Insert(int(v));
+  }
+  const std::vector<int> counts = histogram(&q, 21, 60000);
+  EXPECT_EQ(counts[0], 0);
+  EXPECT_EQ(counts[1], 0);
+  int stratum1 = 0;
+  for (int v = 10; v <= 16; ++v) {
+    EXPECT_NEAR(counts[v], 30000 / 7, 500);
+    stratum1 += counts[v];
+  }
+  EXPECT_NEAR(stratum1, 30000, 800);
+  EXPECT_NEAR(counts[20], 30000, 800);
+
+  q.clear();
+  EXPECT_EQ(q.Insert(30), 1);
+  EXPECT_EQ(histogram(&q, 31, 10)[30], 10);
+}
+
+TEST(ReaderQueueTest, DropsOldestOverMemoryBudget) {
+  auto& account = elf::metrics::MemoryAccount::get("replay");
+  ReaderQueueT<int> q(makeCtrl(2, 100, "stratified"));
+  q.setSizeFunc([](const int&) -> size_t { return 100; });
+  q.setStratum([](const int& v) -> int64_t { return v / 10; });
+  account.setBudget(450);
+  int delta = 0;
+  for (int v : {0, 1, 10, 11, 12, 13}) {
+    delta += q.Insert(int(v));
+  }
+  EXPECT_EQ(delta, 4);
+  EXPECT_EQ(q.Dump(), std::vector<int>({10, 11, 12, 13}));
+  EXPECT_EQ(account.bytes(), 400);
+  const std::vector<int> counts = histogram(&q, 14, 1000);
+  EXPECT_EQ(counts[0] + counts[1], 0);
+  EXPECT_EQ(counts[10] + counts[11] + counts[12] + counts[13], 1000);
+
+  // Never below queue_min_size.
+  account.setBudget(50);
+  q.Insert(20);
+  EXPECT_EQ(q.Dump(), std::vector<int>({13, 20}));
+  EXPECT_EQ(account.bytes(), 200);
+
+  account.setBudget(0);
+  q.clear();
+  EXPECT_EQ(account.bytes(), 0);
+}
+
+TEST(ReaderQueueTest, EvictsStaleVersions) {
+  ReaderCtrl ctrl = makeCtrl(1, 100);
+  ctrl.version_window = 2;
+  ReaderQueueT<int> q(ctrl);
+  // Version of v is v / 10.
+  q.setVersion([](const int& v) -> int64_t { return v / 10; });
+  int delta = 0;
+  for (int v : {0, 1, 10, 11}) {
+    delta += q.Insert(int(v));
+  }
+  EXPECT_EQ(delta, 4);
+  // Version 0 leaves the window.
+  EXPECT_EQ(q.Insert(20), 1 - 2);
+  EXPECT_EQ(q.Dump(), std::vector<int>({10, 11, 20}));
+  EXPECT_EQ(q.Insert(2), 0);
+  EXPECT_EQ(q.numStale(), 3u);
+  EXPECT_EQ(q.versionSizes(), (std::map<int64_t, size_t>{{1, 2}, {2, 1}}));
+
+  // Records of version 1 behind one of version 2 stay, but are not sampled.
+  q.Insert(12);
+  q.Insert(30);
+  EXPECT_EQ(q.Dump(), std::vector<int>({20, 12, 30}));
+  const std::vector<int> counts = histogram(&q, 31, 1000);
+  EXPECT_EQ(counts[12], 0);
+  EXPECT_EQ(counts[20] + counts[30], 1000);
+}
+
+TEST(ReaderQueueTest, VersionQuotas) {
+  ReaderCtrl ctrl = makeCtrl(1, 100);
+  // At most 20% of the samples from the versions before the newest.
+  ctrl.version_quotas = {1.0, 0.2};
+  ReaderQueueT<int> q(ctrl);
+  q.setVersion([](const int& v) -> int64_t { return v / 10; });
+  for (int v : {0, 1, 2, 3, 4, 5, 6, 7, 10, 11}) {
+    q.Insert(int(v));
+  }
+  const std::vector<int> counts = histogram(&q, 12, 20000);
+  int old = 0;
+  for (int v = 0; v < 8; ++v) {
+    old += counts[v];
+  }
+  EXPECT_NEAR(old, 4000, 400);
+  EXPECT_NEAR(counts[10], 8000, 400);
+  EXPECT_NEAR(counts[11], 8000, 400);
+
+  // Under their quota, versions get the share of their records.
+  q.clear();
+  for (int v : {0, 10, 11, 12, 13, 14, 15, 16, 17, 18}) {
+    q.Insert(int(v));
+  }
+  EXPECT_NEAR(histogram(&q, 19, 20000)[0], 2000, 300);
+}
+
+TEST(ReaderQueueTest, PackedRecords) {
+  ReaderQueueT<std::vector<int>> q(makeCtrl(1, 4));
+  // Run-length encoded.
+  q.setPacking(
+      [](const std::vector<int>& v, std::string* buf) {
+        *buf = std::to_string(v.size()) + "x" + std::to_string(v[0]);
+      },
+      [](const std::string& buf, std::vector<int>* v) {
+        const size_t x = buf.find('x');
+        if (x == std::string::npos) {
+          return false;
+        }
+        v->assign(std::stoi(buf.substr(0, x)), std::stoi(buf.substr(x + 1)));
+        return true;
+      });
+  ASSERT_TRUE(q.packed());
+  for (int i = 0; i < 6; ++i) {
+    q.Insert(std::vector<int>(1000, i));
+  }
+  EXPECT_LT(
+      elf::metrics::MemoryAccount::get("replay").bytes(),
+      4 * (int64_t)(sizeof(std::string) + 32));
+  const auto dump = q.Dump();
+  ASSERT_EQ(dump.size(), 4u);
+  EXPECT_EQ(dump[0], std::vector<int>(1000, 2));
+
+  std::mt19937 rng(0);
+  auto sampler = q.getSampler(&rng);
+  const std::vector<int>* v = sampler.sample();
+  ASSERT_NE(v, nullptr);
+  ASSERT_EQ(v->size(), 1000u);
+  EXPECT_GE((*v)[0], 2);
+  // Unpacked again, to the same record.
+  EXPECT_EQ(sampler.sample(), v);
+
+  auto shared = sampler.sampleShared();
+  ASSERT_NE(shared, nullptr);
+  EXPECT_EQ(shared->size(), 1000u);
+  EXPECT_NE(shared.get(), v);
+
+  q.clear();
+  EXPECT_EQ(sampler.sample(0), nullptr);
+}
+
+TEST(ReaderQueuesTest, PicksQueuesByWeight) {
+  RQCtrl ctrl;
+  ctrl.num_reader = 2;
+  ctrl.ctrl = makeCtrl(1, 100, "priority");
+  ReaderQueuesT<int> qs(ctrl);
+  qs.setPriority([](const int& v) { return double(v); });
+  qs[0]->Insert(1);
+  qs[1]->Insert(3);
+  std::mt19937 rng(0);
+  int num_first = 0;
+  for (int i = 0; i < 40000; ++i) {
+    if (qs.pickQueue(&rng) == 0) {
+      num_first++;
+    }
+  }
+  EXPECT_NEAR(num_first, 10000, 500);
+}
+
+} // namespace shared
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -6,49 +6,191 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#pragma once
+
+#include <atomic>
 #include <cassert>
-#include <map>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <vector>
 
-template <typename Key, typename Record>
+namespace elf {
+
+namespace shared {
+
+// Records by key, each generated by gen(key) the first time it is asked for,
+// once, and kept until the buffer is destroyed.
+//
+// Thread safe. Keys are hashed to kNumShards chained hash tables. Lookups of
+// existing records take no lock: the chains only ever grow at their head, and
+// a table that is grown is replaced by a new one, the old one being kept for
+// the readers still on it. A miss takes the lock of its shard to add the key;
+// the record is then generated out of the lock, and concurrent Get() of the
+// same key wait for it.
+template <typename Key, typename Record, typename Hash = std::hash<Key>>
 class SharedReplayBuffer {
  public:
   using GenFunc = std::function<std::unique_ptr<Record>(const Key&)>;
 
-  SharedReplayBuffer(GenFunc gen) : _gen(gen) {}
+  static constexpr size_t kNumShards = 64;
+
+  SharedReplayBuffer(GenFunc gen) : _gen(gen) {
+    for (auto& shard : _shards) {
+      shard.tables.emplace_back(new Table(kInitBuckets));
+      shard.table = shard.tables.back().get();
+    }
+  }
+
+  SharedReplayBuffer(const SharedReplayBuffer&) = delete;
+  SharedReplayBuffer& operator=(const SharedReplayBuffer&) = delete;
+
   void InitRecords(const std::vector<Key>& keys) {
-    std::lock_guard<std::mutex> lock(_mutex);
     for (const auto& key : keys)
-      add_record_no_lock(key);
+      Get(key);
   }
 
+  // Whether the record of key is generated.
   bool HasKey(const Key& key) const {
-    return _buffer.find(key) != _buffer.end();
+    const Entry* e = find(shard(key), key);
+    return e != nullptr && e->ready.load(std::memory_order_acquire) != nullptr;
   }
 
   const Record& Get(const Key& key) {
-    typename BufferType::const_iterator it = _buffer.find(key);
-    if (it == _buffer.end()) {
-      std::lock_guard<std::mutex> lock(_mutex);
+    Shard& s = shard(key);
+    Entry* e = find(s, key);
+    if (e == nullptr) {
+      std::lock_guard<std::mutex> lock(s.mutex);
       // Check again.
-      it = _buffer.find(key);
-      if (it == _buffer.end())
-        it = add_record_no_lock(key);
+      e = find(s, key);
+      if (e == nullptr)
+        e = add_entry_no_lock(s, key);
     }
-    return *it->second;
+    return e->get(_gen);
+  }
+
+  // Number of keys asked for so far.
+  size_t Size() const {
+    size_t n = 0;
+    for (const auto& s : _shards) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      n += s.entries.size();
+    }
+    return n;
   }
 
  private:
-  using BufferType = std::map<Key, std::unique_ptr<Record>>;
+  static constexpr size_t kInitBuckets = 16;
+
+  struct Entry {
+    explicit Entry(const Key& key) : key(key) {}
+
+    const Key key;
+    std::unique_ptr<Record> record;
+    // record.get() once generated.
+    std::atomic<const Record*> ready{nullptr};
+    std::once_flag once;
+
+    const Record& get(const GenFunc& gen) {
+      const Record* r = ready.load(std::memory_order_acquire);
+      if (r == nullptr) {
+        std::call_once(once, [&]() {
+          assert(gen != nullptr);
+          record = gen(key);
+          ready.store(record.get(), std::memory_order_release);
+        });
+        r = ready.load(std::memory_order_acquire);
+      }
+      return *r;
+    }
+  };
+
+  // Immutable once linked.
+  struct Node {
+    Entry* entry;
+    size_t hash;
+    const Node* next;
+  };
+
+  struct Table {
+    explicit Table(size_t num_buckets)
+        : mask(num_buckets - 1),
+          buckets(new std::atomic<const Node*>[num_buckets]) {
+      for (size_t i = 0; i < num_buckets; ++i) {
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    const size_t mask;
+    std::unique_ptr<std::atomic<const Node*>[]> buckets;
+    std::deque<Node> nodes;
 
-  BufferType _buffer;
-  std::mutex _mutex;
+    // The shard took the low bits of hash (modulo kNumShards).
+    std::atomic<const Node*>& bucket(size_t hash) const {
+      return buckets[(hash / kNumShards) & mask];
+    }
+
+    void link(Entry* entry, size_t hash) {
+      std::atomic<const Node*>& head = bucket(hash);
+      nodes.push_back(Node{entry, hash, head.load(std::memory_order_relaxed)});
+      head.store(&nodes.back(), std::memory_order_release);
+    }
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::atomic<Table*> table{nullptr};
+    // The current table last; the others may still be read.
+    std::vector<std::unique_ptr<Table>> tables;
+    std::deque<Entry> entries;
+  };
+
+  Shard _shards[kNumShards];
   GenFunc _gen;
+  Hash _hash;
+
+  Shard& shard(const Key& key) {
+    return _shards[_hash(key) % kNumShards];
+  }
 
-  typename BufferType::const_iterator add_record_no_lock(const Key& key) {
-    assert(_gen != nullptr);
-    return _buffer.emplace(make_pair(key, _gen(key))).first;
+  const Shard& shard(const Key& key) const {
+    return _shards[_hash(key) % kNumShards];
+  }
+
+  // No lock.
+  Entry* find(const Shard& s, const Key& key) const {
+    const size_t h = _hash(key);
+    const Table* t = s.table.load(std::memory_order_acquire);
+    for (const Node* n = t->bucket(h).load(std::memory_order_acquire);
+         n != nullptr;
+         n = n->next) {
+      if (n->hash == h && n->entry->key == key) {
+        return n->entry;
+      }
+    }
+    return nullptr;
+  }
+
+  Entry* add_entry_no_lock(Shard& s, const Key& key) {
+    s.entries.emplace_back(key);
+    Entry* e = &s.entries.back();
+    Table* t = s.table.load(std::memory_order_relaxed);
+    if (s.entries.size() > t->mask + 1) {
+      // Load factor above 1: twice the buckets, in a new table.
+      s.tables.emplace_back(new Table(2 * (t->mask + 1)));
+      t = s.tables.back().get();
+      for (auto& entry : s.entries) {
+        t->link(&entry, _hash(entry.key));
+      }
+      s.table.store(t, std::memory_order_release);
+    } else {
+      t->link(e, _hash(key));
+    }
+    return e;
   }
 };
+
+} // namespace shared
+
+} // namespace elf
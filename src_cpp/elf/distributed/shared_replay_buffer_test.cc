@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "shared_replay_buffer.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace shared {
+
+TEST(SharedReplayBufferTest, GeneratesOnce) {
+  std::atomic<int> num_gen(0);
+  SharedReplayBuffer<int, std::string> buffer([&](const int& key) {
+    num_gen++;
+    return std::unique_ptr<std::string>(new std::string(std::to_string(key)));
+  });
+  EXPECT_FALSE(buffer.HasKey(3));
+  buffer.InitRecords({1, 2, 3});
+  EXPECT_TRUE(buffer.HasKey(3));
+  EXPECT_EQ(num_gen, 3);
+  EXPECT_EQ(buffer.Get(2), "2");
+  EXPECT_EQ(num_gen, 3);
+}
+
+// Threads asking for the same keys, enough of them for the tables to grow
+// while they are read.
+TEST(SharedReplayBufferTest, ConcurrentGetOrCreate) {
+  constexpr int kNumThreads = 16;
+  constexpr int kNumKeys = 20000;
+  std::vector<std::atomic<int>> num_gen(kNumKeys);
+  for (auto& n : num_gen) {
+    n = 0;
+  }
+  SharedReplayBuffer<int, int> buffer([&](const int& key) {
+    num_gen[key]++;
+    return std::unique_ptr<int>(new int(key * 2));
+  });
+
+  std::atomic<int> num_wrong(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int k = 0; k < kNumKeys; ++k) {
+        const int key = (k * 7919 + i * 13) % kNumKeys;
+        if (buffer.Get(key) != key * 2) {
+          num_wrong++;
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(num_wrong, 0);
+  EXPECT_EQ(buffer.Size(), static_cast<size_t>(kNumKeys));
+  for (int k = 0; k < kNumKeys; ++k) {
+    EXPECT_EQ(num_gen[k], 1) << k;
+    EXPECT_TRUE(buffer.HasKey(k));
+  }
+}
+
+} // namespace shared
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -9,21 +9,41 @@
 #pragma once
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <ctime>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <thread>
-
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+#include "elf/logging/Logging.h"
+#include "elf/metrics/Memory.h"
 #include "elf/utils/utils.h"
 
+#include "compression.h"
+#include "consistent_hash.h"
+#include "ingest_stats.h"
 #include "shared_reader.h"
 #include "zmq_util.h"
 
@@ -37,6 +57,57 @@ struct Options {
   bool use_ipv6 = true;
   bool verbose = false;
   std::string identity;
+  // zstd level of the "content" messages (0: uncompressed). A Writer
+  // compresses once its Reader, with a level > 0 as well, offers it (see
+  // Reader::offer_codec()).
+  int compression_level = 0;
+  // Dictionary file of the compression, the same on both ends (optional).
+  std::string compression_dict;
+  // Reader: threads decoding the messages, and the capacity of the queues
+  // between its stages.
+  int num_decode_threads = 4;
+  size_t queue_capacity = 256;
+  // Writer: directory where the messages are kept while the Reader is busy
+  // (empty: in memory).
+  std::string spill_dir;
+  // The server has num_shards Readers, on port, port + 1, ... of addr, or
+  // at shard_addrs ("host:port,host:port,..."). A Writer sends to the shard
+  // of its identity (by consistent hashing), and to the next one on the ring
+  // when its shard does not answer a message within failover_sec.
+  int num_shards = 1;
+  std::string shard_addrs;
+  int failover_sec = 120;
+  // Port (0: none) on which the server broadcasts updates (e.g. of its
+  // models) to all its Writers, from addr.
+  int pub_port = 0;
+  // Port (0: none) of the HTTP endpoint with the IngestStats of the server.
+  int stats_port = 0;
+  // Directory of the Unix sockets of the Readers (see
+  // elf::distri::endpoint()), for Writers on the same host; empty: TCP.
+  std::string ipc_dir;
+
+  // (host, port) of the shards.
+  std::vector<std::pair<std::string, int>> shards() const {
+    std::vector<std::pair<std::string, int>> res;
+    if (shard_addrs.empty()) {
+      for (int i = 0; i < std::max(num_shards, 1); ++i) {
+        res.emplace_back(addr, port + i);
+      }
+      return res;
+    }
+    std::stringstream ss(shard_addrs);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      const size_t colon = item.rfind(':');
+      if (colon == std::string::npos) {
+        res.emplace_back(item, port);
+      } else {
+        res.emplace_back(
+            item.substr(0, colon), std::stoi(item.substr(colon + 1)));
+      }
+    }
+    return res;
+  }
 
   std::string info() const {
     std::stringstream ss;
@@ -48,17 +119,58 @@ struct Options {
     }
     ss << ", ipv6: " << elf_utils::print_bool(use_ipv6)
        << ", verbose: " << elf_utils::print_bool(verbose);
+    if (compression_level > 0) {
+      ss << ", zstd: " << compression_level;
+      if (!compression_dict.empty()) {
+        ss << ", dict: " << compression_dict;
+      }
+    }
+    if (!spill_dir.empty()) {
+      ss << ", spill: " << spill_dir;
+    }
+    if (num_shards > 1 || !shard_addrs.empty()) {
+      ss << ", shards: " << shards().size();
+    }
+    if (pub_port > 0) {
+      ss << ", pub: " << pub_port;
+    }
+    if (!ipc_dir.empty()) {
+      ss << ", ipc: " << ipc_dir;
+    }
     return ss.str();
   }
 };
 
+// Messages are sent by a thread of the Writer, which owns the socket: Insert()
+// and Ctrl() queue them and return at once, and replies are queued for
+// getReply(). When its Reader is busy (see Reader), the content messages are
+// held back, on disk in options.spill_dir if set, and sent in order once it
+// is ready again. With several shards (see Options), the last content
+// message is sent again to the next shard on failover.
 class Writer {
  public:
   // Constructor.
-  Writer(const Options& opt) : rng_(time(NULL)), options_(opt) {
+  Writer(const Options& opt)
+      : rng_(time(NULL)),
+        options_(opt),
+        shards_(opt.shards()),
+        ring_(shardNames(shards_)),
+        dead_(shards_.size(), false) {
     identity_ = options_.identity + "-" + get_id(rng_);
-    sender_.reset(new elf::distri::ZMQSender(
-        identity_, options_.addr, options_.port, options_.use_ipv6));
+    connect();
+    if (options_.compression_level > 0 &&
+        elf::distri::Compressor::available()) {
+      compressor_.reset(new elf::distri::Compressor(
+          options_.compression_level, options_.compression_dict));
+    }
+    if (!options_.spill_dir.empty()) {
+      init_spill();
+    }
+    if (options_.pub_port > 0) {
+      subscriber_.reset(new elf::distri::ZMQSubscriber(
+          options_.addr, options_.pub_port, options_.use_ipv6));
+    }
+    io_thread_ = std::thread([this]() { threaded_io(); });
   }
 
   const std::string& identity() const {
@@ -73,44 +185,309 @@ class Writer {
   }
 
   bool Insert(const std::string& s) {
-    write_mutex_.lock();
-    sender_->send("content", s);
-    write_mutex_.unlock();
+    return Insert(std::string(s));
+  }
+
+  // Sends s without a copy.
+  bool Insert(std::string&& s) {
+    outbox_.push(std::make_pair(std::string("content"), std::move(s)));
     return true;
   }
 
   bool Ctrl(const std::string& msg) {
-    sender_->send("ctrl", msg);
+    outbox_.push(std::make_pair(std::string("ctrl"), msg));
     return true;
   }
 
   bool getReplyNoblock(std::string* msg) {
-    std::string title;
-    bool received = sender_->recv_noblock(&title, msg);
-    if (!received)
-      return false;
+    return replies_.pop(msg, std::chrono::milliseconds(0));
+  }
 
-    if (title != "reply") {
-      std::cout << "Writer[" << identity_ << "] wrong title " << title
-                << " in getReplyNoblock()" << std::endl;
-      return false;
-    } else {
-      return true;
-    }
+  // Waits up to timeout for a reply.
+  bool getReply(std::string* msg, std::chrono::microseconds timeout) {
+    return replies_.pop(msg, timeout);
+  }
+
+  // f(msg) is called (on the thread of the writer) with the updates the
+  // server publishes (see Options::pub_port).
+  void setOnUpdate(std::function<void(const std::string&)> f) {
+    std::lock_guard<std::mutex> lock(update_mutex_);
+    on_update_ = f;
+  }
+
+  // Whether the Reader asked to hold back the messages.
+  bool busy() const {
+    return busy_.load();
+  }
+
+  // Messages held back (in memory or on disk).
+  size_t numHeld() const {
+    return num_held_.load();
   }
 
+  // Sends what is queued, unless the Reader is busy (the messages held back
+  // are then kept on disk if they are spilled).
   ~Writer() {
-    // std::cout << "Started writer distructor" << std::endl;
+    done_ = true;
+    io_thread_.join();
+    subscriber_.reset(nullptr);
     sender_.reset(nullptr);
-    // std::cout << "Writer distructor done" << std::endl;
   }
 
  private:
+  using Msg = std::pair<std::string, std::string>;
+
+  // Spilled messages sent in a row, between the checks of the Reader.
+  static constexpr int kSendBatch = 16;
+  static constexpr std::chrono::milliseconds kPollInterval{10};
+
   std::unique_ptr<elf::distri::ZMQSender> sender_;
   std::mt19937 rng_;
   std::string identity_;
   Options options_;
-  std::mutex write_mutex_;
+
+  std::vector<std::pair<std::string, int>> shards_;
+  elf::distri::ConsistentHash ring_;
+  // Shards that failed to answer, skipped until they all have.
+  std::vector<bool> dead_;
+  int shard_ = -1;
+  // Last content message, and when the shard was last waited for (nothing
+  // was received since it was sent).
+  std::string last_content_;
+  bool waiting_ = false;
+  std::chrono::steady_clock::time_point waiting_since_;
+
+  std::unique_ptr<elf::distri::Compressor> compressor_;
+  // Offered by the Reader.
+  bool compress_ = false;
+  bool use_dict_ = false;
+
+  elf::concurrency::ConcurrentQueue<Msg> outbox_;
+  elf::concurrency::ConcurrentQueue<std::string> replies_;
+  std::thread io_thread_;
+  std::atomic_bool done_{false};
+
+  std::unique_ptr<elf::distri::ZMQSubscriber> subscriber_;
+  std::mutex update_mutex_;
+  std::function<void(const std::string&)> on_update_;
+
+  // A message held back: in the file at path if spilled, in msg otherwise.
+  struct Held {
+    std::string path;
+    std::string msg;
+  };
+
+  std::atomic_bool busy_{false};
+  // Oldest first.
+  std::deque<Held> held_;
+  std::atomic<size_t> num_held_{0};
+  uint64_t spill_seq_ = 0;
+
+  void threaded_io() {
+    while (true) {
+      const bool done = done_.load();
+
+      std::string title, msg;
+      while (sender_->recv_noblock(&title, &msg)) {
+        waiting_ = false;
+        on_message(title, msg);
+      }
+      while (subscriber_ != nullptr &&
+             subscriber_->recv_noblock(&title, &msg)) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        if (on_update_ != nullptr) {
+          on_update_(msg);
+        }
+      }
+      if (waiting_ && shards_.size() > 1 &&
+          std::chrono::steady_clock::now() - waiting_since_ >
+              std::chrono::seconds(options_.failover_sec)) {
+        failover();
+      }
+      if (!busy_) {
+        send_held();
+      }
+      Msg m;
+      while (outbox_.pop(&m, std::chrono::milliseconds(0))) {
+        if (m.first == "content" && (busy_ || num_held_ > 0)) {
+          hold(std::move(m.second));
+        } else {
+          send(m.first, std::move(m.second));
+        }
+      }
+      if (done) {
+        break;
+      }
+      sender_->poll(kPollInterval);
+    }
+  }
+
+  void on_message(const std::string& title, const std::string& msg) {
+    if (title == "reply") {
+      replies_.push(msg);
+    } else if (title == "codec") {
+      on_codec(msg);
+    } else if (title == "busy" || title == "ready") {
+      busy_ = title == "busy";
+      std::cout << elf_utils::now() << ", Writer[" << identity_
+                << "] reader " << title << ", #held: " << num_held_
+                << std::endl;
+    } else {
+      std::cout << "Writer[" << identity_ << "] wrong title " << title
+                << std::endl;
+    }
+  }
+
+  void send(const std::string& title, std::string&& s) {
+    if (title == "content" && shards_.size() > 1) {
+      last_content_ = s;
+      if (!waiting_) {
+        waiting_ = true;
+        waiting_since_ = std::chrono::steady_clock::now();
+      }
+    }
+    if (title == "content" && compress_) {
+      std::string z;
+      if (compressor_->compress(s, &z, use_dict_)) {
+        sender_->send("content_zstd", std::move(z));
+        return;
+      }
+    }
+    sender_->send(title, std::move(s));
+  }
+
+  static std::vector<std::string> shardNames(
+      const std::vector<std::pair<std::string, int>>& shards) {
+    std::vector<std::string> names;
+    for (const auto& s : shards) {
+      names.push_back(s.first + ":" + std::to_string(s.second));
+    }
+    return names;
+  }
+
+  // To the shard of identity_ on the ring, skipping the dead ones.
+  void connect() {
+    shard_ = ring_.lookup(identity_, [this](size_t i) { return dead_[i]; });
+    const auto& shard = shards_[shard_];
+    sender_.reset(new elf::distri::ZMQSender(
+        identity_,
+        shard.first,
+        shard.second,
+        options_.use_ipv6,
+        options_.ipc_dir));
+    // Offered again by the new Reader.
+    compress_ = false;
+    use_dict_ = false;
+    busy_ = false;
+    if (shards_.size() > 1) {
+      std::cout << elf_utils::now() << ", Writer[" << identity_
+                << "] shard: " << shard.first << ":" << shard.second
+                << std::endl;
+    }
+  }
+
+  void failover() {
+    std::cout << elf_utils::now() << ", Writer[" << identity_ << "] shard "
+              << shards_[shard_].first << ":" << shards_[shard_].second
+              << " did not answer in " << options_.failover_sec << " sec"
+              << std::endl;
+    dead_[shard_] = true;
+    if (std::find(dead_.begin(), dead_.end(), false) == dead_.end()) {
+      dead_.assign(dead_.size(), false);
+      dead_[shard_] = true;
+    }
+    connect();
+    waiting_ = false;
+    if (!last_content_.empty()) {
+      send("content", std::string(last_content_));
+    }
+  }
+
+  void hold(std::string&& s) {
+    Held h;
+    if (!options_.spill_dir.empty()) {
+      char name[64];
+      snprintf(
+          name,
+          sizeof(name),
+          "%020lld-%010llu.msg",
+          (long long)std::chrono::system_clock::now()
+              .time_since_epoch()
+              .count(),
+          (unsigned long long)spill_seq_++);
+      h.path = options_.spill_dir + "/" + name;
+      std::ofstream f(h.path, std::ios::binary);
+      f.write(s.data(), s.size());
+      if (!f) {
+        std::cout << "Writer[" << identity_ << "] cannot spill to " << h.path
+                  << ", kept in memory" << std::endl;
+        h.path.clear();
+      }
+    }
+    if (h.path.empty()) {
+      h.msg = std::move(s);
+    }
+    held_.push_back(std::move(h));
+    num_held_++;
+  }
+
+  // The oldest messages held back, a batch at a time.
+  void send_held() {
+    for (int i = 0; i < kSendBatch && !held_.empty(); ++i) {
+      Held h = std::move(held_.front());
+      held_.pop_front();
+      num_held_--;
+      if (!h.path.empty()) {
+        std::ifstream f(h.path, std::ios::binary);
+        std::stringstream ss;
+        ss << f.rdbuf();
+        h.msg = ss.str();
+        unlink(h.path.c_str());
+      }
+      send("content", std::move(h.msg));
+    }
+  }
+
+  // Messages spilled by earlier runs are sent first.
+  void init_spill() {
+    if (mkdir(options_.spill_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::runtime_error(
+          "Writer: cannot create " + options_.spill_dir + ": " +
+          strerror(errno));
+    }
+    std::vector<std::string> names;
+    if (DIR* d = opendir(options_.spill_dir.c_str())) {
+      while (const dirent* e = readdir(d)) {
+        const std::string name = e->d_name;
+        if (name.size() > 4 && name.substr(name.size() - 4) == ".msg") {
+          names.push_back(name);
+        }
+      }
+      closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) {
+      held_.push_back(Held{options_.spill_dir + "/" + name, std::string()});
+    }
+    num_held_ = held_.size();
+    if (!held_.empty()) {
+      std::cout << "Writer[" << identity_ << "] " << held_.size()
+                << " messages spilled earlier" << std::endl;
+    }
+  }
+
+  // "zstd <dict id>" or "none".
+  void on_codec(const std::string& msg) {
+    std::stringstream ss(msg);
+    std::string codec;
+    uint32_t dict_id = 0;
+    ss >> codec >> dict_id;
+    compress_ = compressor_ != nullptr && codec == "zstd";
+    use_dict_ = compress_ && dict_id != 0 && dict_id == compressor_->dictId();
+    std::cout << "Writer[" << identity_ << "] codec: " << msg
+              << ", compress: " << elf_utils::print_bool(compress_)
+              << ", dict: " << elf_utils::print_bool(use_dict_) << std::endl;
+  }
 
   static std::string get_id(std::mt19937& rng) {
     long host_name_max = sysconf(_SC_HOST_NAME_MAX);
@@ -140,13 +517,21 @@ class Reader {
     std::atomic<int> failed_count;
     std::atomic<int> msg_count;
     std::atomic<uint64_t> total_msg_size;
+    // Bytes of the "content" messages, as received and decompressed.
+    std::atomic<uint64_t> total_wire_size;
+    std::atomic<uint64_t> total_raw_size;
+    // Clients told that the Reader is busy.
+    std::atomic<int> busy_count;
 
     Stats()
         : client_size(0),
           buffer_size(0),
           failed_count(0),
           msg_count(0),
-          total_msg_size(0) {}
+          total_msg_size(0),
+          total_wire_size(0),
+          total_raw_size(0),
+          busy_count(0) {}
 
     std::string info() const {
       std::stringstream ss;
@@ -154,18 +539,111 @@ class Reader {
       ss << "Msg count: " << msg_count
          << ", avg msg size: " << (float)(total_msg_size) / msg_count
          << ", failed count: " << failed_count;
+      if (total_wire_size > 0) {
+        ss << ", compression ratio: "
+           << (float)(total_raw_size) / total_wire_size;
+      }
+      if (busy_count > 0) {
+        ss << ", busy count: " << busy_count;
+      }
+      return ss.str();
+    }
+
+    // Compression ratio of each client.
+    std::string clientInfo() const {
+      std::stringstream ss;
+      for (const auto& c : clients_.snapshot()) {
+        ss << c.first << ": " << c.second.raw << "/" << c.second.wire << " = "
+           << (c.second.wire > 0 ? (float)(c.second.raw) / c.second.wire : 0)
+           << std::endl;
+      }
       return ss.str();
     }
 
-    void feed(const RQInterface::InsertInfo& insert_info) {
+    ClientStats client(const std::string& identity) const {
+      return clients_.get(identity);
+    }
+
+    // A message of size bytes from identity arrived at now_sec (since
+    // epoch). Returns whether identity is new.
+    bool feedArrival(
+        const std::string& identity,
+        size_t size,
+        uint64_t now_sec) {
+      msg_size_.add(size);
+      return clients_.update(identity, [now_sec](ClientStats* c) {
+        c->num_msgs++;
+        if (c->first_seen == 0) {
+          c->first_seen = now_sec;
+        }
+        c->last_seen = now_sec;
+      });
+    }
+
+    void feedBytes(const std::string& identity, size_t wire, size_t raw) {
+      total_wire_size += wire;
+      total_raw_size += raw;
+      clients_.update(identity, [wire, raw](ClientStats* c) {
+        c->wire += wire;
+        c->raw += raw;
+      });
+    }
+
+    // A message of identity, which arrived at arrival_sec, was decoded in
+    // usec, with records created at timestamps.
+    void feedDecode(
+        const std::string& identity,
+        uint64_t usec,
+        const std::vector<uint64_t>& timestamps,
+        uint64_t arrival_sec) {
+      decode_usec_.add(usec);
+      uint64_t total_age = 0;
+      for (uint64_t t : timestamps) {
+        const uint64_t age = arrival_sec > t ? arrival_sec - t : 0;
+        record_age_sec_.add(age);
+        total_age += age;
+      }
+      clients_.update(identity, [&](ClientStats* c) {
+        c->decode_usec += usec;
+        c->num_records += timestamps.size();
+        c->total_age_sec += total_age;
+      });
+    }
+
+    void feedFailure(const std::string& identity) {
+      failed_count++;
+      clients_.update(identity, [](ClientStats* c) { c->num_failed++; });
+    }
+
+    void feed(
+        const std::string& identity,
+        const RQInterface::InsertInfo& insert_info) {
       if (!insert_info.success) {
-        failed_count++;
+        feedFailure(identity);
       } else {
         buffer_size += insert_info.delta;
         msg_count++;
         total_msg_size += insert_info.msg_size;
       }
     }
+
+    IngestStats snapshot() const {
+      IngestStats s;
+      s.num_msgs = msg_count;
+      s.num_failed = failed_count;
+      s.num_busy = busy_count;
+      s.msg_size = msg_size_.snapshot();
+      s.decode_usec = decode_usec_.snapshot();
+      s.record_age_sec = record_age_sec_.snapshot();
+      s.clients = clients_.snapshot();
+      return s;
+    }
+
+   private:
+    ShardedClientStats clients_;
+    Log2Histogram msg_size_;
+    Log2Histogram decode_usec_;
+    Log2Histogram record_age_sec_;
   };
 
   using ReplyFunc =
@@ -173,23 +651,41 @@ class Reader {
   using StartFunc = std::function<void()>;
 
   Reader(const std::string& filename, const Options& opt)
-      : receiver_(opt.port, opt.use_ipv6),
+      : receiver_(opt.port, opt.use_ipv6, opt.ipc_dir),
         options_(opt),
         db_name_(filename),
         rng_(time(NULL)),
-        done_(false) {}
+        decode_q_(opt.queue_capacity),
+        insert_q_(opt.queue_capacity),
+        done_(false) {
+    if (opt.compression_level > 0 && elf::distri::Compressor::available()) {
+      offer_ = "zstd " +
+          std::to_string(
+                   elf::distri::Compressor(
+                       opt.compression_level, opt.compression_dict)
+                       .dictId());
+    }
+  }
 
+  // Messages are received on one thread, decoded (RQInterface::Decode()) on
+  // options.num_decode_threads threads and inserted (RQInterface::Insert())
+  // on another one, which calls start_func first, and replier after each
+  // message.
   void startReceiving(
       RQInterface* rq,
       StartFunc start_func = nullptr,
       ReplyFunc replier = nullptr) {
-    receiver_thread_.reset(new std::thread(
-        [=](Reader* reader) {
-          if (start_func != nullptr)
-            start_func();
-          reader->threaded_receive_msg(rq, replier);
-        },
-        this));
+    receiver_thread_.reset(
+        new std::thread([this]() { threaded_receive_msg(); }));
+    num_decoding_ = std::max(options_.num_decode_threads, 1);
+    for (int i = 0; i < num_decoding_; ++i) {
+      decode_threads_.emplace_back([this, rq]() { threaded_decode(rq); });
+    }
+    insert_thread_.reset(new std::thread([=]() {
+      if (start_func != nullptr)
+        start_func();
+      threaded_insert(rq, replier);
+    }));
   }
 
   const Stats& stats() const {
@@ -206,62 +702,228 @@ class Reader {
   ~Reader() {
     std::cout << "Destroying Reader ... " << std::endl;
     done_ = true;
-    receiver_thread_->join();
+    if (receiver_thread_ != nullptr) {
+      receiver_thread_->join();
+      for (auto& t : decode_threads_) {
+        t.join();
+      }
+      insert_thread_->join();
+    }
 
     std::cout << "Reader destroyed... " << std::endl;
   }
 
  private:
+  // A message on its way through the stages.
+  struct Item {
+    std::string identity;
+    std::string title;
+    elf::distri::MsgView msg;
+    std::unique_ptr<RQInterface::Decoded> decoded;
+    // Seconds since epoch.
+    uint64_t arrival_sec = 0;
+  };
+  using ItemP = std::shared_ptr<Item>;
+  using Queue = elf::concurrency::ConcurrentQueueRing<ItemP>;
+
+  static constexpr std::chrono::milliseconds kPollInterval{10};
+
   elf::distri::ZMQReceiver receiver_;
-  std::unique_ptr<std::thread> receiver_thread_;
   Options options_;
   std::string db_name_;
   std::mt19937 rng_;
   Stats stats_;
+  std::shared_ptr<spdlog::logger> logger_ =
+      elf::logging::getIndexedLogger("elf::distri::Reader-");
+
+  // Bounded: a stage that falls behind holds back the previous ones.
+  Queue decode_q_;
+  Queue insert_q_;
+  // Messages received and not inserted yet. Clients whose messages arrive
+  // while there are queue_capacity of them are told that the Reader is
+  // "busy" (so that they hold back theirs), and "ready" once they are down
+  // to a quarter of it. Likewise while the received frames are over the
+  // budget of the "ingest" memory account (which they are charged to).
+  std::atomic<size_t> num_in_flight_{0};
+  elf::metrics::MemoryAccount& memory_ =
+      elf::metrics::MemoryAccount::get("ingest");
+  std::unordered_set<std::string> busy_clients_;
+  // Sent by the receiving thread, which owns the socket.
+  elf::concurrency::ConcurrentQueue<std::pair<std::string, std::string>>
+      reply_q_;
 
+  std::unique_ptr<std::thread> receiver_thread_;
+  std::vector<std::thread> decode_threads_;
+  std::unique_ptr<std::thread> insert_thread_;
   std::atomic_bool done_;
+  std::atomic_bool receiving_done_{false};
+  std::atomic<int> num_decoding_{0};
+
+  // The "codec" message to new clients, if compression is offered.
+  std::string offer_;
+
+  void offer_codec(const std::string& identity) {
+    if (!offer_.empty()) {
+      receiver_.send(identity, "codec", offer_);
+    }
+  }
+
+  // Pops from q, until it is empty and upstream_done().
+  template <typename F>
+  static void drain(Queue& q, const std::function<bool()>& upstream_done, F f) {
+    ItemP item;
+    while (true) {
+      if (q.pop(&item, std::chrono::milliseconds(100))) {
+        f(std::move(item));
+      } else if (upstream_done()) {
+        while (q.tryPop(&item)) {
+          f(std::move(item));
+        }
+        return;
+      }
+    }
+  }
 
-  void threaded_receive_msg(RQInterface* rq, ReplyFunc replier = nullptr) {
-    std::string identity, title, msg;
+  void threaded_receive_msg() {
     while (!done_.load()) {
-      if (!receiver_.recv_noblock(&identity, &title, &msg)) {
-        std::cout << elf_utils::now()
-                  << ", Reader: no message, wait for 10 sec ... " << std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(10));
-        continue;
+      std::pair<std::string, std::string> reply;
+      while (reply_q_.pop(&reply, std::chrono::milliseconds(0))) {
+        receiver_.send(reply.first, "reply", std::move(reply.second));
+      }
+      if (!busy_clients_.empty() &&
+          num_in_flight_.load() <= options_.queue_capacity / 4 &&
+          !memory_.overBudget()) {
+        for (const auto& identity : busy_clients_) {
+          receiver_.send(identity, "ready", "");
+        }
+        busy_clients_.clear();
       }
 
-      if (title == "ctrl") {
-        stats_.client_size++;
-        std::cout << elf_utils::now() << " Ctrl from " << identity << "["
-                  << stats_.client_size << "]: " << msg << std::endl;
-        // receiver_.send(identity, "ctrl", "");
-      } else if (title == "content") {
-        // Save to
-        auto insert_info = rq->Insert(msg, &rng_);
-        stats_.feed(insert_info);
-        if (insert_info.success) {
-          if (options_.verbose) {
-            std::cout << "Content from " << identity
-                      << ", msg_size: " << msg.size() << ", " << stats_.info()
-                      << std::endl;
-          }
-          if (stats_.msg_count % 1000 == 0) {
-            std::cout << elf_utils::now() << ", last_identity: " << identity
-                      << ", " << stats_.info() << std::endl;
-          }
-        } else {
-          std::cout << "Msg insertion error! from " << identity << std::endl;
+      if (!receiver_.poll(kPollInterval)) {
+        continue;
+      }
+      ItemP item = std::make_shared<Item>();
+      while (
+          receiver_.recv_noblock(&item->identity, &item->title, &item->msg)) {
+        item->arrival_sec = elf_utils::sec_since_epoch_from_now();
+        memory_.add(item->msg.size());
+        if (stats_.feedArrival(
+                item->identity, item->msg.size(), item->arrival_sec)) {
+          offer_codec(item->identity);
         }
+        const bool busy = ++num_in_flight_ >= options_.queue_capacity ||
+            memory_.overBudget();
+        if (busy && busy_clients_.insert(item->identity).second) {
+          receiver_.send(item->identity, "busy", "");
+          stats_.busy_count++;
+        }
+        decode_q_.push(item);
+        item = std::make_shared<Item>();
       }
+    }
+    receiving_done_ = true;
+  }
+
+  void threaded_decode(RQInterface* rq) {
+    std::unique_ptr<elf::distri::Compressor> compressor;
+    if (elf::distri::Compressor::available()) {
+      // Reads compressed messages even if it does not offer compression.
+      compressor.reset(new elf::distri::Compressor(
+          options_.compression_level, options_.compression_dict));
+    }
 
+    auto upstream_done = [this]() { return receiving_done_.load(); };
+    drain(decode_q_, upstream_done, [&](ItemP item) {
+      decode(rq, compressor.get(), item.get());
+      insert_q_.push(item);
+    });
+    num_decoding_--;
+  }
+
+  // Compressed messages are decoded from the received frame, others copied
+  // once for rq.
+  void
+  decode(RQInterface* rq, elf::distri::Compressor* compressor, Item* item) {
+    const auto& msg = item->msg;
+    const auto start = std::chrono::steady_clock::now();
+    std::string raw;
+    if (item->title == "content_zstd") {
+      if (compressor == nullptr ||
+          !compressor->decompress(msg.data(), msg.size(), &raw)) {
+        stats_.feedFailure(item->identity);
+        ELF_LOG_EVERY_SEC(
+            logger_, error, 1, "Cannot decompress msg from {}", item->identity);
+        item->title.clear();
+        return;
+      }
+      stats_.feedBytes(item->identity, msg.size(), raw.size());
+      item->title = "content";
+    } else if (item->title == "content") {
+      raw = msg.str();
+      stats_.feedBytes(item->identity, raw.size(), raw.size());
+    } else {
+      return;
+    }
+    item->decoded = rq->Decode(std::move(raw));
+    const uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    stats_.feedDecode(
+        item->identity,
+        usec,
+        item->decoded != nullptr ? item->decoded->timestamps
+                                 : std::vector<uint64_t>(),
+        item->arrival_sec);
+  }
+
+  void threaded_insert(RQInterface* rq, ReplyFunc replier) {
+    auto upstream_done = [this]() { return num_decoding_.load() == 0; };
+    drain(insert_q_, upstream_done, [&](ItemP item) {
+      insert(rq, item.get());
+      num_in_flight_--;
+      memory_.sub(item->msg.size());
       // Send reply if there is any.
       if (replier != nullptr) {
         std::string reply;
-        if (replier(this, identity, &reply)) {
-          receiver_.send(identity, "reply", reply);
+        if (replier(this, item->identity, &reply)) {
+          reply_q_.push(std::make_pair(item->identity, std::move(reply)));
         }
       }
+    });
+  }
+
+  void insert(RQInterface* rq, Item* item) {
+    const std::string& identity = item->identity;
+    if (item->title == "ctrl") {
+      stats_.client_size++;
+      logger_->info(
+          "Ctrl from {}[{}]: {}",
+          identity,
+          stats_.client_size,
+          item->msg.str());
+    } else if (item->title == "content") {
+      RQInterface::InsertInfo insert_info;
+      if (item->decoded != nullptr) {
+        insert_info = rq->Insert(std::move(item->decoded), &rng_);
+      }
+      stats_.feed(identity, insert_info);
+      if (insert_info.success) {
+        if (options_.verbose) {
+          ELF_LOG(
+              logger_,
+              debug,
+              "Content from {}, msg_size: {}, {}",
+              identity,
+              insert_info.msg_size,
+              stats_.info());
+        }
+        if (stats_.msg_count % 1000 == 0) {
+          logger_->info("last_identity: {}, {}", identity, stats_.info());
+        }
+      } else {
+        ELF_LOG_EVERY_SEC(
+            logger_, error, 1, "Msg insertion error! from {}", identity);
+      }
     }
   }
 };
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <iomanip>
@@ -16,6 +17,7 @@
 #include <vector>
 
 #include <sched.h>
+#include <string.h>
 
 #include <zmq.hpp>
 
@@ -23,6 +25,40 @@ namespace elf {
 
 namespace distri {
 
+// A received frame, read in place: data() is valid as long as the view.
+class MsgView {
+ public:
+  MsgView() {}
+  MsgView(MsgView&&) = default;
+  MsgView& operator=(MsgView&&) = default;
+
+  zmq::message_t* message() {
+    return &message_;
+  }
+
+  const char* data() const {
+    return static_cast<const char*>(message_.data());
+  }
+
+  size_t size() const {
+    return message_.size();
+  }
+
+  std::string str() const {
+    return std::string(data(), size());
+  }
+
+  friend bool operator==(const MsgView& v, const std::string& s) {
+    return v.size() == s.size() && memcmp(v.data(), s.data(), s.size()) == 0;
+  }
+  friend bool operator!=(const MsgView& v, const std::string& s) {
+    return !(v == s);
+  }
+
+ private:
+  zmq::message_t message_;
+};
+
 inline std::string s_recv(zmq::socket_t& socket) {
   zmq::message_t message;
   socket.recv(&message);
@@ -41,6 +77,10 @@ inline bool s_recv_noblock(zmq::socket_t& socket, std::string* msg) {
   }
 }
 
+inline bool s_recv_noblock(zmq::socket_t& socket, MsgView* msg) {
+  return socket.recv(msg->message(), ZMQ_NOBLOCK);
+}
+
 //  Convert string to 0MQ string and send to socket
 inline bool s_send(zmq::socket_t& socket, const std::string& s) {
   zmq::message_t message(s.size());
@@ -61,6 +101,18 @@ inline bool s_sendmore(zmq::socket_t& socket, const std::string& s) {
   return (rc);
 }
 
+// Sends s without a copy: the message owns its buffer until ZeroMQ is done
+// with it.
+inline bool s_send(zmq::socket_t& socket, std::string&& s, int flags = 0) {
+  std::string* buf = new std::string(std::move(s));
+  zmq::message_t message(
+      &(*buf)[0],
+      buf->size(),
+      [](void*, void* hint) { delete static_cast<std::string*>(hint); },
+      buf);
+  return socket.send(message, flags);
+}
+
 inline std::string s_version() {
   int major, minor, patch;
   zmq_version(&major, &minor, &patch);
@@ -119,6 +171,30 @@ class SegmentedRecv {
     } while (msgs[0] != prefix);
   }
 
+  // As above, with the frames read in place. Do not mix with the string
+  // version on one socket.
+  bool recvNonblocked(int n, std::vector<MsgView>* p_msgs) {
+    auto& msgs = *p_msgs;
+    msgs.resize(n);
+    int i = 0;
+    while (i < n && !last_views_.empty()) {
+      msgs[i] = std::move(last_views_.front());
+      last_views_.pop_front();
+      i++;
+    }
+    while (i < n) {
+      if (!s_recv_noblock(socket_, &msgs[i])) {
+        for (int j = 0; j < i; ++j) {
+          last_views_.push_back(std::move(msgs[j]));
+        }
+        p_msgs->clear();
+        return false;
+      }
+      i++;
+    }
+    return true;
+  }
+
   bool recvPrefixNonblocked(const std::string& prefix) {
     // std::cout << "Wait for prefix " << prefix << " nonblocked " << std::endl;
     std::vector<std::string> msgs;
@@ -132,6 +208,7 @@ class SegmentedRecv {
  private:
   zmq::socket_t& socket_;
   std::deque<std::string> last_msgs_;
+  std::deque<MsgView> last_views_;
 
   int get_last_msgs(int n, std::vector<std::string>* p_msgs) {
     auto& msgs = *p_msgs;
@@ -171,9 +248,22 @@ class SameThreadChecker {
   std::thread::id id_;
 };
 
+// The endpoint of port: on TCP, or if ipc_dir is set, on a Unix socket in it
+// (for peers on the same host).
+inline std::string endpoint(
+    const std::string& addr,
+    int port,
+    const std::string& ipc_dir = "") {
+  if (!ipc_dir.empty()) {
+    return "ipc://" + ipc_dir + "/elf-" + std::to_string(port);
+  }
+  return "tcp://" + addr + ":" + std::to_string(port);
+}
+
 class ZMQReceiver : public SameThreadChecker {
  public:
-  ZMQReceiver(int port, bool use_ipv6) : context_(1) {
+  ZMQReceiver(int port, bool use_ipv6, const std::string& ipc_dir = "")
+      : context_(1) {
     broker_.reset(new zmq::socket_t(context_, ZMQ_ROUTER));
     if (use_ipv6) {
       int ipv6 = 1;
@@ -181,7 +271,7 @@ class ZMQReceiver : public SameThreadChecker {
     }
     set_opts(broker_.get());
 
-    broker_->bind("tcp://*:" + std::to_string(port));
+    broker_->bind(endpoint("*", port, ipc_dir));
     receiver_.reset(new SegmentedRecv(*broker_));
   }
 
@@ -204,19 +294,37 @@ class ZMQReceiver : public SameThreadChecker {
     }
   }
 
-  bool
-  recv_noblock(std::string* identity, std::string* title, std::string* msg) {
+  // Sends msg without a copy.
+  void send(
+      const std::string& identity,
+      const std::string& title,
+      std::string&& msg) {
+    std::lock_guard<std::mutex> locker(mutex_);
+
+    try {
+      s_sendmore(*broker_, identity);
+      s_sendmore(*broker_, "");
+      s_sendmore(*broker_, title);
+      s_sendmore(*broker_, "");
+      s_send(*broker_, std::move(msg));
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+    }
+  }
+
+  // msg is read in place.
+  bool recv_noblock(std::string* identity, std::string* title, MsgView* msg) {
     assert(msg != nullptr);
     std::lock_guard<std::mutex> locker(mutex_);
 
     try {
-      std::vector<std::string> msgs;
+      std::vector<MsgView> msgs;
       if (!receiver_->recvNonblocked(5, &msgs))
         return false;
 
-      *identity = msgs[0];
-      *title = msgs[2];
-      *msg = msgs[4];
+      *identity = msgs[0].str();
+      *title = msgs[2].str();
+      *msg = std::move(msgs[4]);
       return true;
     } catch (const std::exception& e) {
       std::cout << "Exception encountered! " << e.what() << std::endl;
@@ -224,6 +332,28 @@ class ZMQReceiver : public SameThreadChecker {
     }
   }
 
+  // Waits up to timeout for a message.
+  bool poll(std::chrono::milliseconds timeout) {
+    std::lock_guard<std::mutex> locker(mutex_);
+    zmq::pollitem_t item = {static_cast<void*>(*broker_), 0, ZMQ_POLLIN, 0};
+    try {
+      return zmq::poll(&item, 1, timeout.count()) > 0;
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  bool
+  recv_noblock(std::string* identity, std::string* title, std::string* msg) {
+    assert(msg != nullptr);
+    MsgView view;
+    if (!recv_noblock(identity, title, &view))
+      return false;
+    msg->assign(view.data(), view.size());
+    return true;
+  }
+
   ~ZMQReceiver() {
     std::lock_guard<std::mutex> locker(mutex_);
 
@@ -244,7 +374,8 @@ class ZMQSender : public SameThreadChecker {
       const std::string& id,
       const std::string& addr,
       int port,
-      bool use_ipv6)
+      bool use_ipv6,
+      const std::string& ipc_dir = "")
       : context_(1) {
     sender_.reset(new zmq::socket_t(context_, ZMQ_DEALER));
     if (use_ipv6) {
@@ -254,7 +385,7 @@ class ZMQSender : public SameThreadChecker {
     sender_->setsockopt(ZMQ_IDENTITY, id.c_str(), id.length());
     set_opts(sender_.get());
 
-    sender_->connect("tcp://" + addr + ":" + std::to_string(port));
+    sender_->connect(endpoint(addr, port, ipc_dir));
     receiver_.reset(new SegmentedRecv(*sender_));
   }
 
@@ -270,18 +401,44 @@ class ZMQSender : public SameThreadChecker {
     }
   }
 
-  bool recv_noblock(std::string* title, std::string* msg) {
+  // Sends msg without a copy.
+  void send(const std::string& title, std::string&& msg) {
+    std::lock_guard<std::mutex> locker(mutex_);
+    try {
+      s_sendmore(*sender_, "");
+      s_sendmore(*sender_, title);
+      s_sendmore(*sender_, "");
+      s_send(*sender_, std::move(msg));
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+    }
+  }
+
+  // Waits up to timeout for a message.
+  bool poll(std::chrono::milliseconds timeout) {
+    std::lock_guard<std::mutex> locker(mutex_);
+    zmq::pollitem_t item = {static_cast<void*>(*sender_), 0, ZMQ_POLLIN, 0};
+    try {
+      return zmq::poll(&item, 1, timeout.count()) > 0;
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  // msg is read in place.
+  bool recv_noblock(std::string* title, MsgView* msg) {
     assert(msg != nullptr);
 
     std::lock_guard<std::mutex> locker(mutex_);
     try {
-      std::vector<std::string> msgs;
+      std::vector<MsgView> msgs;
 
       if (!receiver_->recvNonblocked(4, &msgs))
         return false;
 
-      *title = msgs[1];
-      *msg = msgs[3];
+      *title = msgs[1].str();
+      *msg = std::move(msgs[3]);
       return true;
     } catch (const std::exception& e) {
       std::cout << "Exception encountered! " << e.what() << std::endl;
@@ -289,6 +446,15 @@ class ZMQSender : public SameThreadChecker {
     }
   }
 
+  bool recv_noblock(std::string* title, std::string* msg) {
+    assert(msg != nullptr);
+    MsgView view;
+    if (!recv_noblock(title, &view))
+      return false;
+    msg->assign(view.data(), view.size());
+    return true;
+  }
+
   ~ZMQSender() {
     std::lock_guard<std::mutex> locker(mutex_);
 
@@ -308,6 +474,80 @@ class ZMQSender : public SameThreadChecker {
   std::mutex mutex_;
 };
 
+// Broadcasts (topic, msg) to all the subscribers connected to port.
+class ZMQPublisher {
+ public:
+  ZMQPublisher(int port, bool use_ipv6) : context_(1) {
+    publisher_.reset(new zmq::socket_t(context_, ZMQ_PUB));
+    if (use_ipv6) {
+      int ipv6 = 1;
+      publisher_->setsockopt(ZMQ_IPV6, &ipv6, sizeof(ipv6));
+    }
+    set_opts(publisher_.get());
+    publisher_->bind("tcp://*:" + std::to_string(port));
+  }
+
+  void publish(const std::string& topic, const std::string& msg) {
+    std::lock_guard<std::mutex> locker(mutex_);
+    try {
+      s_sendmore(*publisher_, topic);
+      s_send(*publisher_, msg);
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+    }
+  }
+
+ private:
+  zmq::context_t context_;
+  std::unique_ptr<zmq::socket_t> publisher_;
+  std::mutex mutex_;
+};
+
+// Receives all the topics of a ZMQPublisher. Messages published while it
+// is not connected are lost.
+class ZMQSubscriber {
+ public:
+  ZMQSubscriber(const std::string& addr, int port, bool use_ipv6)
+      : context_(1) {
+    subscriber_.reset(new zmq::socket_t(context_, ZMQ_SUB));
+    if (use_ipv6) {
+      int ipv6 = 1;
+      subscriber_->setsockopt(ZMQ_IPV6, &ipv6, sizeof(ipv6));
+    }
+    set_opts(subscriber_.get());
+    subscriber_->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    subscriber_->connect("tcp://" + addr + ":" + std::to_string(port));
+    receiver_.reset(new SegmentedRecv(*subscriber_));
+  }
+
+  bool recv_noblock(std::string* topic, std::string* msg) {
+    std::lock_guard<std::mutex> locker(mutex_);
+    try {
+      std::vector<MsgView> msgs;
+      if (!receiver_->recvNonblocked(2, &msgs))
+        return false;
+      *topic = msgs[0].str();
+      *msg = msgs[1].str();
+      return true;
+    } catch (const std::exception& e) {
+      std::cout << "Exception encountered! " << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  ~ZMQSubscriber() {
+    std::lock_guard<std::mutex> locker(mutex_);
+    receiver_.reset(nullptr);
+    subscriber_.reset(nullptr);
+  }
+
+ private:
+  zmq::context_t context_;
+  std::unique_ptr<zmq::socket_t> subscriber_;
+  std::unique_ptr<SegmentedRecv> receiver_;
+  std::mutex mutex_;
+};
+
 } // namespace distri
 
 } // namespace elf
@@ -21,6 +21,13 @@ struct ContextOptions {
 
   int batchsize = 0;
 
+  // Threads running the games as fibers (0: a thread per game).
+  int num_game_threads = 0;
+
+  // With a thread per game, threads running the tree searches of all the
+  // games as fibers (0: threads of each search).
+  int num_search_threads = 0;
+
   // History length. How long we should keep the history.
   int T = 1;
 
@@ -29,6 +36,21 @@ struct ContextOptions {
 
   std::string job_id;
 
+  // NUMA node of the collectors and their shared memory, usually the GPU's;
+  // the games are spread over the nodes from there. -1: no pinning, unless
+  // gpu_pci_bus_id (e.g. "0000:3b:00.0") gives the node.
+  int numa_collector_node = -1;
+  std::string gpu_pci_bus_id;
+
+  // Huge pages of the search trees, datasets and shared memory: "off",
+  // "thp", "2mb" or "1gb" (see elf/concurrency/HugePages.h).
+  std::string huge_pages = "off";
+
+  // File to capture the served batches to, for elf::BatchReplay (empty: no
+  // capture); batch_capture_max batches at most (0: no limit).
+  std::string batch_capture;
+  int batch_capture_max = 0;
+
   elf::ai::tree_search::TSOptions mcts_options;
 
   ContextOptions() {}
@@ -36,7 +58,19 @@ struct ContextOptions {
   void print() const {
     std::cout << "JobId: " << job_id << std::endl;
     std::cout << "#Game: " << num_games << std::endl;
+    if (num_game_threads > 0)
+      std::cout << "#GameThreads: " << num_game_threads << std::endl;
+    if (num_search_threads > 0)
+      std::cout << "#SearchThreads: " << num_search_threads << std::endl;
     std::cout << "T: " << T << std::endl;
+    if (numa_collector_node >= 0 || !gpu_pci_bus_id.empty())
+      std::cout << "NUMA collector node: " << numa_collector_node
+                << ", GPU: " << gpu_pci_bus_id << std::endl;
+    if (huge_pages != "off")
+      std::cout << "Huge pages: " << huge_pages << std::endl;
+    if (!batch_capture.empty())
+      std::cout << "Batch capture: " << batch_capture << ", max #batches: "
+                << batch_capture_max << std::endl;
     if (verbose_comm)
       std::cout << "Comm Verbose On" << std::endl;
     std::cout << mcts_options.info() << std::endl;
@@ -46,7 +80,14 @@ struct ContextOptions {
       job_id,
       batchsize,
       num_games,
+      num_game_threads,
+      num_search_threads,
       T,
       verbose_comm,
+      numa_collector_node,
+      gpu_pci_bus_id,
+      huge_pages,
+      batch_capture,
+      batch_capture_max,
       mcts_options);
 };
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Logging.h"
+
+#include <mutex>
+
+#include "IndexedLoggerFactory.h"
+
+#if defined(SPDLOG_VER_MAJOR)
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#endif
+
+namespace elf {
+namespace logging {
+
+namespace {
+
+std::mutex asyncMutex;
+std::atomic<bool> async{false};
+
+} // namespace
+
+void initAsync(size_t queue_size) {
+  std::lock_guard<std::mutex> lock(asyncMutex);
+  if (async || queue_size == 0) {
+    return;
+  }
+#if defined(SPDLOG_VER_MAJOR)
+  spdlog::init_thread_pool(queue_size, 1);
+#else
+  // Applies to all the loggers made from now on through the registry.
+  spdlog::set_async_mode(
+      queue_size, spdlog::async_overflow_policy::discard_log_msg);
+#endif
+  async = true;
+}
+
+bool isAsync() {
+  return async;
+}
+
+std::shared_ptr<spdlog::logger> makeStdoutLogger(const std::string& name) {
+#if defined(SPDLOG_VER_MAJOR)
+  if (async) {
+    return spdlog::stdout_color_mt<spdlog::async_factory_nonblock>(name);
+  }
+#endif
+  return spdlog::stdout_color_mt(name);
+}
+
+std::shared_ptr<spdlog::logger> getIndexedLogger(
+    const std::string& prefix,
+    const std::string& suffix) {
+  static IndexedLoggerFactory factory(makeStdoutLogger);
+  return factory.makeLogger(prefix, suffix);
+}
+
+} // namespace logging
+} // namespace elf
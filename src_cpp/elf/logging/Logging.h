@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Logging of the C++ side through spdlog loggers (e.g. made by an
+ * IndexedLoggerFactory with makeStdoutLogger()), instead of std::cout:
+ *
+ *   - After initAsync(), the loggers made by makeStdoutLogger() hand their
+ *     messages to a thread of spdlog through a bounded queue. A message that
+ *     finds the queue full is dropped (spdlog 0.x) or replaces the oldest one
+ *     (spdlog 1.x), but the caller never waits for stdout.
+ *   - ELF_LOG(logger, level, ...) compiles to nothing for the levels below
+ *     ELF_LOG_ACTIVE_LEVEL (trace is off unless defined otherwise).
+ *   - ELF_LOG_EVERY_SEC(logger, level, sec, ...) logs at most once every sec
+ *     seconds from its call site, and tells how many were skipped.
+ *
+ * level is the name of the spdlog::logger method: trace, debug, info, warn,
+ * error or critical.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#define ELF_LOG_LEVEL_trace 0
+#define ELF_LOG_LEVEL_debug 1
+#define ELF_LOG_LEVEL_info 2
+#define ELF_LOG_LEVEL_warn 3
+#define ELF_LOG_LEVEL_error 4
+#define ELF_LOG_LEVEL_critical 5
+
+#ifndef ELF_LOG_ACTIVE_LEVEL
+#define ELF_LOG_ACTIVE_LEVEL ELF_LOG_LEVEL_debug
+#endif
+
+#define ELF_LOG_ENABLED(level) (ELF_LOG_LEVEL_##level >= ELF_LOG_ACTIVE_LEVEL)
+
+#define ELF_LOG(logger, level, ...) \
+  do {                              \
+    if (ELF_LOG_ENABLED(level)) {   \
+      (logger)->level(__VA_ARGS__); \
+    }                               \
+  } while (0)
+
+#define ELF_LOG_EVERY_SEC(logger, level, sec, ...)                        \
+  do {                                                                    \
+    if (ELF_LOG_ENABLED(level)) {                                         \
+      static ::elf::logging::RateLimiter elf_log_limiter_(sec);           \
+      uint64_t elf_log_skipped_ = 0;                                      \
+      if (elf_log_limiter_.allow(&elf_log_skipped_)) {                    \
+        (logger)->level(__VA_ARGS__);                                     \
+        if (elf_log_skipped_ > 0) {                                       \
+          (logger)->level("(skipped {} similar)", elf_log_skipped_);      \
+        }                                                                 \
+      }                                                                   \
+    }                                                                     \
+  } while (0)
+
+namespace elf {
+namespace logging {
+
+// From now on, makeStdoutLogger() makes loggers writing on a thread of
+// spdlog, through a queue of queue_size messages. To be called before the
+// loggers are made; later calls do nothing.
+void initAsync(size_t queue_size);
+
+bool isAsync();
+
+// A logger to stdout, asynchronous after initAsync(). Meant as the creator
+// of an IndexedLoggerFactory.
+std::shared_ptr<spdlog::logger> makeStdoutLogger(const std::string& name);
+
+// A logger named prefix + <index> + suffix, from an IndexedLoggerFactory of
+// makeStdoutLogger() shared by the process.
+std::shared_ptr<spdlog::logger> getIndexedLogger(
+    const std::string& prefix,
+    const std::string& suffix = "");
+
+// Lets through one event every interval, and counts the others. Thread safe.
+class RateLimiter {
+ public:
+  explicit RateLimiter(double sec)
+      : interval_(std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(sec))) {}
+
+  // *skipped: #events not let through since the last one that was.
+  bool allow(uint64_t* skipped = nullptr) {
+    const int64_t now = Clock::now().time_since_epoch().count();
+    int64_t next = next_.load(std::memory_order_relaxed);
+    if (now < next ||
+        !next_.compare_exchange_strong(next, now + interval_.count())) {
+      skipped_++;
+      return false;
+    }
+    const uint64_t n = skipped_.exchange(0);
+    if (skipped != nullptr) {
+      *skipped = n;
+    }
+    return true;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  const Clock::duration interval_;
+  std::atomic<int64_t> next_{0};
+  std::atomic<uint64_t> skipped_{0};
+};
+
+} // namespace logging
+} // namespace elf
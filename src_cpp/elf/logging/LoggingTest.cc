@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Logging.h"
+
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <spdlog/sinks/ostream_sink.h>
+
+namespace elf {
+namespace logging {
+
+namespace {
+
+std::shared_ptr<spdlog::logger> makeLogger(std::ostringstream& oss) {
+  auto logger = std::make_shared<spdlog::logger>(
+      "LoggingTest", std::make_shared<spdlog::sinks::ostream_sink_mt>(oss));
+  logger->set_pattern("%v");
+  logger->set_level(spdlog::level::trace);
+  return logger;
+}
+
+} // namespace
+
+TEST(RateLimiterTest, CountsSkipped) {
+  RateLimiter limiter(0.05);
+  uint64_t skipped = 42;
+  EXPECT_TRUE(limiter.allow(&skipped));
+  EXPECT_EQ(skipped, 0u);
+  EXPECT_FALSE(limiter.allow());
+  EXPECT_FALSE(limiter.allow());
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_TRUE(limiter.allow(&skipped));
+  EXPECT_EQ(skipped, 2u);
+}
+
+TEST(LoggingTest, CompilesOutLowLevels) {
+  std::ostringstream oss;
+  auto logger = makeLogger(oss);
+  int evaluated = 0;
+  auto arg = [&]() { return ++evaluated; };
+
+  ELF_LOG(logger, trace, "trace {}", arg());
+  EXPECT_EQ(evaluated, 0);
+  ELF_LOG(logger, debug, "debug {}", arg());
+  ELF_LOG(logger, error, "error {}", arg());
+  EXPECT_EQ(evaluated, 2);
+  logger->flush();
+  EXPECT_EQ(oss.str(), "debug 1\nerror 2\n");
+}
+
+TEST(LoggingTest, RateLimitsCallSite) {
+  std::ostringstream oss;
+  auto logger = makeLogger(oss);
+  for (int i = 0; i < 10; ++i) {
+    ELF_LOG_EVERY_SEC(logger, warn, 3600, "warn {}", i);
+  }
+  logger->flush();
+  EXPECT_EQ(oss.str(), "warn 0\n");
+}
+
+TEST(LoggingTest, IndexesLoggers) {
+  auto first = getIndexedLogger("LoggingTest-", "-x");
+  auto second = getIndexedLogger("LoggingTest-", "-x");
+  EXPECT_NE(first->name(), second->name());
+  EXPECT_EQ(spdlog::get(first->name()), first);
+}
+
+// A full queue drops messages rather than blocking the caller.
+TEST(LoggingTest, AsyncStdoutLogger) {
+  initAsync(4);
+  EXPECT_TRUE(isAsync());
+  auto logger = makeStdoutLogger("LoggingTest-async");
+  for (int i = 0; i < 100; ++i) {
+    logger->info("async {}", i);
+  }
+  logger->flush();
+}
+
+} // namespace logging
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -13,6 +13,7 @@
 
 #include "IndexedLoggerFactory.h"
 #include "Levels.h"
+#include "Logging.h"
 
 namespace elf {
 namespace logging {
@@ -50,6 +51,10 @@ void registerPy(pybind11::module& m) {
 
 #undef _ELF_PYBIND_DECLARE_LOG_LEVEL
 
+  m.def("init_async", initAsync)
+      .def("is_async", isAsync)
+      .def("make_stdout_logger", makeStdoutLogger);
+
   m.def("drop", spdlog::drop)
       .def("drop_all", spdlog::drop_all)
       .def("get", spdlog::get)
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Memory.h"
+
+#include <memory>
+#include <mutex>
+
+namespace elf {
+namespace metrics {
+
+namespace {
+
+std::mutex accountsMutex;
+
+// Never destroyed: accounts may be used by other static objects, and must not
+// unregister their gauges from a destroyed registry.
+std::map<std::string, std::unique_ptr<MemoryAccount>>& accounts() {
+  static auto* m = new std::map<std::string, std::unique_ptr<MemoryAccount>>;
+  return *m;
+}
+
+} // namespace
+
+MemoryAccount& MemoryAccount::get(const std::string& subsystem) {
+  std::lock_guard<std::mutex> lock(accountsMutex);
+  auto& p = accounts()[subsystem];
+  if (p == nullptr) {
+    p.reset(new MemoryAccount(subsystem));
+  }
+  return *p;
+}
+
+std::map<std::string, int64_t> MemoryAccount::usage() {
+  std::map<std::string, int64_t> res;
+  std::lock_guard<std::mutex> lock(accountsMutex);
+  for (const auto& a : accounts()) {
+    res[a.first] = a.second->bytes();
+  }
+  return res;
+}
+
+MemoryAccount::MemoryAccount(const std::string& subsystem)
+    : subsystem_(subsystem) {
+  Registry& registry = Registry::global();
+  bytesGauge_ = registry.addGauge(
+      "elf_memory_bytes",
+      "Bytes held per subsystem",
+      {{"subsystem", subsystem}},
+      [this]() { return (double)bytes(); });
+  budgetGauge_ = registry.addGauge(
+      "elf_memory_budget_bytes",
+      "Memory budget per subsystem (0 = none)",
+      {{"subsystem", subsystem}},
+      [this]() { return (double)budget(); });
+}
+
+} // namespace metrics
+} // namespace elf
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Bytes held per subsystem ("tree", "replay", "smem", "game", "ingest"),
+ * charged and released by the containers holding them, and exported as the
+ * gauges elf_memory_bytes{subsystem} and elf_memory_budget_bytes{subsystem}.
+ *
+ * A subsystem may have a budget: its containers then check overBudget() or
+ * fits() before they grow, and shrink (or refuse to grow) instead.
+ *
+ *   auto& account = elf::metrics::MemoryAccount::get("replay");
+ *   account.add(record_bytes);
+ *   ...
+ *   account.sub(record_bytes);
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+#include "Metrics.h"
+
+namespace elf {
+namespace metrics {
+
+class MemoryAccount {
+ public:
+  // The account of subsystem, made on the first call; lives as long as the
+  // process.
+  static MemoryAccount& get(const std::string& subsystem);
+
+  // Bytes of all the accounts, by subsystem.
+  static std::map<std::string, int64_t> usage();
+
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  const std::string& subsystem() const {
+    return subsystem_;
+  }
+
+  void add(int64_t bytes) {
+    shards_[threadShard()].v.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  void sub(int64_t bytes) {
+    add(-bytes);
+  }
+
+  int64_t bytes() const {
+    int64_t v = 0;
+    for (const auto& s : shards_) {
+      v += s.v.load(std::memory_order_relaxed);
+    }
+    return v;
+  }
+
+  // 0 for no budget.
+  void setBudget(int64_t bytes) {
+    budget_.store(bytes, std::memory_order_relaxed);
+  }
+
+  int64_t budget() const {
+    return budget_.load(std::memory_order_relaxed);
+  }
+
+  bool overBudget() const {
+    const int64_t b = budget();
+    return b > 0 && bytes() > b;
+  }
+
+  // Whether bytes more stay within the budget.
+  bool fits(int64_t bytes) const {
+    const int64_t b = budget();
+    return b <= 0 || this->bytes() + bytes <= b;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> v{0};
+  };
+
+  const std::string subsystem_;
+  Shard shards_[kNumShards];
+  std::atomic<int64_t> budget_{0};
+  Registry::Registration bytesGauge_;
+  Registry::Registration budgetGauge_;
+
+  explicit MemoryAccount(const std::string& subsystem);
+};
+
+// Bytes charged to an account by one owner, e.g. a game, and released when
+// it is destroyed.
+class MemoryCharge {
+ public:
+  explicit MemoryCharge(const std::string& subsystem)
+      : account_(&MemoryAccount::get(subsystem)) {}
+
+  MemoryCharge(const MemoryCharge&) = delete;
+  MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+  ~MemoryCharge() {
+    set(0);
+  }
+
+  void add(int64_t bytes) {
+    account_->add(bytes);
+    bytes_ += bytes;
+  }
+
+  void set(int64_t bytes) {
+    add(bytes - bytes_);
+  }
+
+  int64_t bytes() const {
+    return bytes_;
+  }
+
+  MemoryAccount& account() const {
+    return *account_;
+  }
+
+ private:
+  MemoryAccount* account_;
+  int64_t bytes_ = 0;
+};
+
+} // namespace metrics
+} // namespace elf
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Memory.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace metrics {
+
+TEST(MemoryTest, AccountsAcrossThreads) {
+  MemoryAccount& account = MemoryAccount::get("test_threads");
+  EXPECT_EQ(&MemoryAccount::get("test_threads"), &account);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&account, i]() {
+      for (int j = 0; j < 1000; ++j) {
+        account.add(i + 1);
+      }
+      // Released on another thread than it was charged on.
+      account.sub(1000);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(account.bytes(), 36000 - 8000);
+  EXPECT_EQ(MemoryAccount::usage().at("test_threads"), 28000);
+  EXPECT_EQ(
+      Registry::global().snapshot().gauges.at(
+          "elf_memory_bytes{subsystem=\"test_threads\"}"),
+      28000);
+}
+
+TEST(MemoryTest, Budget) {
+  MemoryAccount& account = MemoryAccount::get("test_budget");
+  account.add(100);
+  EXPECT_FALSE(account.overBudget());
+  EXPECT_TRUE(account.fits(1 << 30));
+
+  account.setBudget(150);
+  EXPECT_FALSE(account.overBudget());
+  EXPECT_TRUE(account.fits(50));
+  EXPECT_FALSE(account.fits(51));
+  account.add(51);
+  EXPECT_TRUE(account.overBudget());
+  EXPECT_EQ(
+      Registry::global().snapshot().gauges.at(
+          "elf_memory_budget_bytes{subsystem=\"test_budget\"}"),
+      150);
+}
+
+TEST(MemoryTest, ChargeIsReleased) {
+  MemoryAccount& account = MemoryAccount::get("test_charge");
+  {
+    MemoryCharge charge("test_charge");
+    charge.add(10);
+    charge.set(40);
+    EXPECT_EQ(charge.bytes(), 40);
+    EXPECT_EQ(account.bytes(), 40);
+  }
+  EXPECT_EQ(account.bytes(), 0);
+}
+
+} // namespace metrics
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
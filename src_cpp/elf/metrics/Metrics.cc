@@ -0,0 +1,203 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Metrics.h"
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace elf {
+namespace metrics {
+
+namespace {
+
+const char* typeName(int type) {
+  static const char* kNames[] = {"counter", "gauge", "histogram"};
+  return kNames[type];
+}
+
+std::string escape(const std::string& s, bool quote) {
+  std::string res;
+  for (char c : s) {
+    if (c == '\\' || (quote && c == '"')) {
+      res += '\\';
+      res += c;
+    } else if (c == '\n') {
+      res += "\\n";
+    } else {
+      res += c;
+    }
+  }
+  return res;
+}
+
+// name{labels}, or name without labels.
+std::string key(const std::string& name, const std::string& labels) {
+  return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+// labels with extra appended.
+std::string join(const std::string& labels, const std::string& extra) {
+  return labels.empty() ? extra : labels + "," + extra;
+}
+
+} // namespace
+
+Registry& Registry::global() {
+  static Registry registry;
+  return registry;
+}
+
+Counter* Registry::counter(
+    const std::string& name,
+    const std::string& help,
+    const Labels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& p = family(name, help, COUNTER).counters[formatLabels(labels)];
+  if (p == nullptr) {
+    p.reset(new Counter);
+  }
+  return p.get();
+}
+
+Gauge* Registry::gauge(
+    const std::string& name,
+    const std::string& help,
+    const Labels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& p = family(name, help, GAUGE).gauges[formatLabels(labels)];
+  if (p == nullptr) {
+    p.reset(new Gauge);
+  }
+  return p.get();
+}
+
+Histogram* Registry::histogram(
+    const std::string& name,
+    const std::string& help,
+    const Labels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& p = family(name, help, HISTOGRAM).histograms[formatLabels(labels)];
+  if (p == nullptr) {
+    p.reset(new Histogram);
+  }
+  return p.get();
+}
+
+Registry::Registration Registry::addGauge(
+    const std::string& name,
+    const std::string& help,
+    const Labels& labels,
+    GaugeFunc f) {
+  const std::string formatted = formatLabels(labels);
+  std::lock_guard<std::mutex> lock(mutex_);
+  family(name, help, GAUGE).gauge_funcs[formatted] = std::move(f);
+  return Registration(this, name, formatted);
+}
+
+void Registry::removeGauge(
+    const std::string& name,
+    const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = families_.find(name);
+  if (it != families_.end()) {
+    it->second.gauge_funcs.erase(labels);
+  }
+}
+
+Snapshot Registry::snapshot() const {
+  Snapshot s;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& f : families_) {
+    const std::string& name = f.first;
+    for (const auto& c : f.second.counters) {
+      s.counters[key(name, c.first)] = c.second->value();
+    }
+    for (const auto& g : f.second.gauges) {
+      s.gauges[key(name, g.first)] = g.second->value();
+    }
+    for (const auto& g : f.second.gauge_funcs) {
+      s.gauges[key(name, g.first)] = g.second();
+    }
+    for (const auto& h : f.second.histograms) {
+      s.histograms[key(name, h.first)] = h.second->snapshot();
+    }
+  }
+  return s;
+}
+
+std::string Registry::scrape() const {
+  std::stringstream ss;
+  ss << std::setprecision(12);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& f : families_) {
+    const std::string& name = f.first;
+    const Family& family = f.second;
+    if (!family.help.empty()) {
+      ss << "# HELP " << name << " " << escape(family.help, false) << "\n";
+    }
+    ss << "# TYPE " << name << " " << typeName(family.type) << "\n";
+    for (const auto& c : family.counters) {
+      ss << key(name, c.first) << " " << c.second->value() << "\n";
+    }
+    for (const auto& g : family.gauges) {
+      ss << key(name, g.first) << " " << g.second->value() << "\n";
+    }
+    for (const auto& g : family.gauge_funcs) {
+      ss << key(name, g.first) << " " << g.second() << "\n";
+    }
+    for (const auto& h : family.histograms) {
+      const HistogramSnapshot s = h.second->snapshot();
+      uint64_t seen = 0;
+      for (int i = 0; i < HistogramSnapshot::kNumBuckets - 1; ++i) {
+        seen += s.buckets[i];
+        // Bucket i holds the integers below 2^(i+1).
+        const std::string le =
+            "le=\"" + std::to_string((uint64_t(2) << i) - 1) + "\"";
+        ss << key(name + "_bucket", join(h.first, le)) << " " << seen << "\n";
+      }
+      ss << key(name + "_bucket", join(h.first, "le=\"+Inf\"")) << " "
+         << s.count << "\n";
+      ss << key(name + "_sum", h.first) << " " << s.sum << "\n";
+      ss << key(name + "_count", h.first) << " " << s.count << "\n";
+    }
+  }
+  return ss.str();
+}
+
+Registry::Family& Registry::family(
+    const std::string& name,
+    const std::string& help,
+    Type type) {
+  auto res = families_.emplace(name, Family());
+  Family& f = res.first->second;
+  if (res.second) {
+    f.type = type;
+    f.help = help;
+  } else if (f.type != type) {
+    throw std::invalid_argument(
+        "Registry: " + name + " is a " + typeName(f.type) + ", not a " +
+        typeName(type));
+  }
+  return f;
+}
+
+std::string Registry::formatLabels(const Labels& labels) {
+  std::string res;
+  for (const auto& l : labels) {
+    if (!res.empty()) {
+      res += ",";
+    }
+    res += l.first + "=\"" + escape(l.second, true) + "\"";
+  }
+  return res;
+}
+
+} // namespace metrics
+} // namespace elf
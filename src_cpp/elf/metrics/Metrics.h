@@ -0,0 +1,221 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Metrics of the process (counters, gauges and histograms), registered by
+ * name from any module and exported together: as a snapshot for Python, and
+ * in the text format of Prometheus (e.g. for a ScrapeServer).
+ *
+ * Metrics are made once, typically at a call site or in a constructor, and
+ * live as long as the process; updating them takes no lock:
+ *
+ *   static auto* batches = elf::metrics::Registry::global().counter(
+ *       "elf_batches_total", "Batches sent to the model");
+ *   batches->add();
+ *
+ * Counters and histograms are sharded per thread, so that threads updating
+ * the same one do not share a cache line.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elf/distributed/ingest_stats.h"
+
+namespace elf {
+namespace metrics {
+
+using HistogramSnapshot = elf::shared::HistogramSnapshot;
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+constexpr size_t kNumShards = 16;
+
+// Shard of the calling thread: threads take the shards in turn.
+inline size_t threadShard() {
+  static std::atomic<size_t> next{0};
+  thread_local const size_t shard = next++ % kNumShards;
+  return shard;
+}
+
+class Counter {
+ public:
+  void add(uint64_t n = 1) {
+    shards_[threadShard()].v.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const {
+    uint64_t v = 0;
+    for (const auto& s : shards_) {
+      v += s.v.load(std::memory_order_relaxed);
+    }
+    return v;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> v{0};
+  };
+  Shard shards_[kNumShards];
+};
+
+class Gauge {
+ public:
+  void set(double v) {
+    v_.store(v, std::memory_order_relaxed);
+  }
+
+  void add(double d) {
+    double v = v_.load(std::memory_order_relaxed);
+    while (!v_.compare_exchange_weak(v, v + d, std::memory_order_relaxed)) {
+    }
+  }
+
+  double value() const {
+    return v_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<double> v_{0.0};
+};
+
+// Of non negative integers, in power of two buckets (see Log2Histogram).
+class Histogram {
+ public:
+  void add(uint64_t v) {
+    shards_[threadShard()].h.add(v);
+  }
+
+  HistogramSnapshot snapshot() const {
+    HistogramSnapshot s;
+    for (const auto& shard : shards_) {
+      s.merge(shard.h.snapshot());
+    }
+    return s;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    elf::shared::Log2Histogram h;
+  };
+  Shard shards_[kNumShards];
+};
+
+// Values of all the metrics, keyed by name{labels}.
+struct Snapshot {
+  std::map<std::string, uint64_t> counters;
+  std::map<std::string, double> gauges;
+  std::map<std::string, HistogramSnapshot> histograms;
+};
+
+// Thread safe.
+class Registry {
+ public:
+  using GaugeFunc = std::function<double()>;
+
+  // Unregisters a gauge function when destroyed (see addGauge()).
+  class Registration {
+   public:
+    Registration() = default;
+    Registration(Registry* registry, std::string name, std::string labels)
+        : registry_(registry),
+          name_(std::move(name)),
+          labels_(std::move(labels)) {}
+    Registration(Registration&& other) {
+      *this = std::move(other);
+    }
+    Registration& operator=(Registration&& other) {
+      reset();
+      std::swap(registry_, other.registry_);
+      name_ = std::move(other.name_);
+      labels_ = std::move(other.labels_);
+      return *this;
+    }
+    ~Registration() {
+      reset();
+    }
+
+    void reset() {
+      if (registry_ != nullptr) {
+        registry_->removeGauge(name_, labels_);
+        registry_ = nullptr;
+      }
+    }
+
+   private:
+    Registry* registry_ = nullptr;
+    std::string name_;
+    std::string labels_;
+  };
+
+  // The registry of the process.
+  static Registry& global();
+
+  // The metric of name and labels, made on the first call. Throws
+  // std::invalid_argument if name is already used by another type of metric.
+  // help is that of the first call.
+  Counter* counter(
+      const std::string& name,
+      const std::string& help,
+      const Labels& labels = Labels());
+  Gauge* gauge(
+      const std::string& name,
+      const std::string& help,
+      const Labels& labels = Labels());
+  Histogram* histogram(
+      const std::string& name,
+      const std::string& help,
+      const Labels& labels = Labels());
+
+  // A gauge read with f() on export, e.g. the size of a queue, until the
+  // returned Registration is destroyed. Replaces the gauge of the same name
+  // and labels, if any.
+  Registration addGauge(
+      const std::string& name,
+      const std::string& help,
+      const Labels& labels,
+      GaugeFunc f);
+
+  Snapshot snapshot() const;
+
+  // In the text format of Prometheus.
+  std::string scrape() const;
+
+ private:
+  enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+  struct Family {
+    Type type;
+    std::string help;
+    // By formatted labels.
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, GaugeFunc> gauge_funcs;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  };
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Family> families_;
+
+  Family& family(const std::string& name, const std::string& help, Type type);
+  void removeGauge(const std::string& name, const std::string& labels);
+
+  static std::string formatLabels(const Labels& labels);
+};
+
+} // namespace metrics
+} // namespace elf
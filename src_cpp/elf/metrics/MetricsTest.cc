@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Metrics.h"
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace metrics {
+
+TEST(MetricsTest, CountsAcrossThreads) {
+  Registry registry;
+  Counter* c = registry.counter("test_total", "Test");
+  EXPECT_EQ(registry.counter("test_total", "Other help"), c);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([c]() {
+      for (int j = 0; j < 1000; ++j) {
+        c->add();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(c->value(), 8000u);
+  EXPECT_EQ(registry.snapshot().counters.at("test_total"), 8000u);
+}
+
+TEST(MetricsTest, RejectsOtherType) {
+  Registry registry;
+  registry.counter("test", "");
+  EXPECT_THROW(registry.gauge("test", ""), std::invalid_argument);
+}
+
+TEST(MetricsTest, GaugesAndRegistrations) {
+  Registry registry;
+  registry.gauge("test_depth", "", {{"queue", "a"}})->set(3);
+  registry.gauge("test_depth", "", {{"queue", "a"}})->add(1.5);
+  double size = 7;
+  {
+    Registry::Registration r = registry.addGauge(
+        "test_depth", "", {{"queue", "b"}}, [&]() { return size; });
+    Snapshot s = registry.snapshot();
+    EXPECT_EQ(s.gauges.at("test_depth{queue=\"a\"}"), 4.5);
+    EXPECT_EQ(s.gauges.at("test_depth{queue=\"b\"}"), 7);
+  }
+  EXPECT_EQ(registry.snapshot().gauges.count("test_depth{queue=\"b\"}"), 0u);
+}
+
+TEST(MetricsTest, Scrapes) {
+  Registry registry;
+  registry.counter("test_total", "Things\ndone")->add(3);
+  Histogram* h = registry.histogram("test_usec", "", {{"label", "x\"y"}});
+  h->add(1);
+  h->add(5);
+  h->add(6);
+  EXPECT_EQ(h->snapshot().count, 3u);
+  EXPECT_EQ(h->snapshot().sum, 12u);
+
+  const std::string text = registry.scrape();
+  for (const char* line : {
+           "# HELP test_total Things\\ndone\n",
+           "# TYPE test_total counter\n",
+           "test_total 3\n",
+           "# TYPE test_usec histogram\n",
+           "test_usec_bucket{label=\"x\\\"y\",le=\"1\"} 1\n",
+           "test_usec_bucket{label=\"x\\\"y\",le=\"3\"} 1\n",
+           "test_usec_bucket{label=\"x\\\"y\",le=\"7\"} 3\n",
+           "test_usec_bucket{label=\"x\\\"y\",le=\"+Inf\"} 3\n",
+           "test_usec_sum{label=\"x\\\"y\"} 12\n",
+           "test_usec_count{label=\"x\\\"y\"} 3\n",
+       }) {
+    EXPECT_NE(text.find(line), std::string::npos) << line;
+  }
+}
+
+} // namespace metrics
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <pybind11/stl.h>
+#include <pybind11/stl_bind.h>
+
+#include "Pybind.h"
+
+#include <memory>
+#include <mutex>
+
+#include "Memory.h"
+#include "Metrics.h"
+#include "elf/distributed/scrape_server.h"
+
+namespace elf {
+namespace metrics {
+
+namespace {
+
+std::mutex serverMutex;
+std::unique_ptr<elf::shared::ScrapeServer> server;
+
+} // namespace
+
+void registerPy(pybind11::module& m) {
+  namespace py = pybind11;
+
+  // Plain dicts, so that HistogramSnapshot stays with the game modules that
+  // register it.
+  m.def("snapshot", []() {
+    const Snapshot s = Registry::global().snapshot();
+    py::dict histograms;
+    for (const auto& h : s.histograms) {
+      py::dict d;
+      d["count"] = h.second.count;
+      d["sum"] = h.second.sum;
+      d["buckets"] = h.second.buckets;
+      histograms[py::str(h.first)] = d;
+    }
+    py::dict res;
+    res["counters"] = s.counters;
+    res["gauges"] = s.gauges;
+    res["histograms"] = histograms;
+    return res;
+  });
+
+  m.def("scrape", []() { return Registry::global().scrape(); });
+
+  // Bytes held per subsystem (see MemoryAccount).
+  m.def("memory_usage", &MemoryAccount::usage);
+
+  // Budget of a subsystem in bytes, 0 for none.
+  m.def("set_memory_budget", [](const std::string& subsystem, int64_t bytes) {
+    MemoryAccount::get(subsystem).setBudget(bytes);
+  });
+
+  m.def("memory_budget", [](const std::string& subsystem) {
+    return MemoryAccount::get(subsystem).budget();
+  });
+
+  // Serves scrape() over HTTP on port, until stop_http_server().
+  m.def("start_http_server", [](int port) {
+    std::lock_guard<std::mutex> lock(serverMutex);
+    server.reset();
+    server.reset(new elf::shared::ScrapeServer(
+        port, []() { return Registry::global().scrape(); }));
+  });
+
+  m.def("stop_http_server", []() {
+    std::lock_guard<std::mutex> lock(serverMutex);
+    server.reset();
+  });
+}
+
+} // namespace metrics
+} // namespace elf
@@ -0,0 +1,19 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <pybind11/pybind11.h>
+
+namespace elf {
+namespace metrics {
+
+void registerPy(pybind11::module& m);
+
+} // namespace metrics
+} // namespace elf
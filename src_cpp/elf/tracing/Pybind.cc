@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <pybind11/stl.h>
+
+#include "Pybind.h"
+
+#include "Trace.h"
+
+namespace elf {
+namespace tracing {
+
+void registerPy(pybind11::module& m) {
+  namespace py = pybind11;
+
+  m.def(
+      "enable",
+      [](size_t capacity) { Tracer::global().enable(capacity); },
+      py::arg("capacity") = Tracer::kDefaultCapacity);
+  m.def("disable", []() { Tracer::global().disable(); });
+  m.def("enabled", &Tracer::enabled);
+  m.def("clear", []() { Tracer::global().clear(); });
+  m.def("set_thread_name", [](const std::string& name) {
+    Tracer::global().setThreadName(name);
+  });
+  m.def("dump_json", []() { return Tracer::global().dumpJson(); });
+  m.def(
+      "dump",
+      [](const std::string& path) { return Tracer::global().dump(path); },
+      py::call_guard<py::gil_scoped_release>());
+}
+
+} // namespace tracing
+} // namespace elf
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Trace.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace elf {
+namespace tracing {
+
+namespace {
+
+struct Event {
+  const char* cat;
+  const char* name;
+  uint64_t start_usec;
+  uint64_t dur_usec;
+  int64_t arg;
+};
+
+// The ring of a thread. Its mutex is only contended by dumps.
+struct ThreadBuffer {
+  std::mutex mutex;
+  uint64_t tid;
+  std::string name;
+  std::vector<Event> events;
+  // Total number recorded; the ring holds the last events.size() of them.
+  uint64_t num_recorded = 0;
+
+  void reset(size_t capacity) {
+    events.assign(capacity, Event());
+    num_recorded = 0;
+  }
+};
+
+std::mutex buffersMutex;
+std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+size_t capacity = Tracer::kDefaultCapacity;
+uint64_t nextTid = 0;
+
+// Kept by the registry after the thread exits.
+ThreadBuffer* threadBuffer() {
+  thread_local std::shared_ptr<ThreadBuffer> buffer;
+  if (buffer == nullptr) {
+    buffer = std::make_shared<ThreadBuffer>();
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffer->tid = nextTid++;
+    buffer->reset(capacity);
+    buffers.push_back(buffer);
+  }
+  return buffer.get();
+}
+
+std::string escape(const std::string& s) {
+  std::string res;
+  for (char c : s) {
+    if (c == '\\' || c == '"') {
+      res += '\\';
+      res += c;
+    } else if ((unsigned char)c >= 0x20) {
+      res += c;
+    }
+  }
+  return res;
+}
+
+} // namespace
+
+std::atomic<bool> Tracer::enabled_{false};
+
+Tracer& Tracer::global() {
+  static Tracer tracer;
+  return tracer;
+}
+
+uint64_t Tracer::nowUsec() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::enable(size_t cap) {
+  {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    if (cap > 0 && cap != capacity) {
+      capacity = cap;
+      for (auto& b : buffers) {
+        std::lock_guard<std::mutex> block(b->mutex);
+        b->reset(capacity);
+      }
+    }
+  }
+  enabled_ = true;
+}
+
+void Tracer::disable() {
+  enabled_ = false;
+}
+
+void Tracer::clear() {
+  std::lock_guard<std::mutex> lock(buffersMutex);
+  for (auto& b : buffers) {
+    std::lock_guard<std::mutex> block(b->mutex);
+    b->reset(capacity);
+  }
+}
+
+void Tracer::record(
+    const char* cat,
+    const char* name,
+    uint64_t start_usec,
+    uint64_t end_usec,
+    int64_t arg) {
+  ThreadBuffer* b = threadBuffer();
+  std::lock_guard<std::mutex> lock(b->mutex);
+  if (b->events.empty()) {
+    return;
+  }
+  b->events[b->num_recorded % b->events.size()] =
+      Event{cat, name, start_usec, end_usec - start_usec, arg};
+  b->num_recorded++;
+}
+
+void Tracer::setThreadName(const std::string& name) {
+  ThreadBuffer* b = threadBuffer();
+  std::lock_guard<std::mutex> lock(b->mutex);
+  b->name = name;
+}
+
+std::string Tracer::dumpJson() const {
+  const int pid = getpid();
+  std::vector<std::shared_ptr<ThreadBuffer>> bs;
+  {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    bs = buffers;
+  }
+
+  std::stringstream ss;
+  ss << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  auto sep = [&]() {
+    if (!first) {
+      ss << ",\n";
+    }
+    first = false;
+  };
+  for (const auto& b : bs) {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    if (!b->name.empty()) {
+      sep();
+      ss << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+         << ",\"tid\":" << b->tid << ",\"args\":{\"name\":\""
+         << escape(b->name) << "\"}}";
+    }
+    const uint64_t n = b->events.size();
+    const uint64_t begin = b->num_recorded > n ? b->num_recorded - n : 0;
+    for (uint64_t i = begin; i < b->num_recorded; ++i) {
+      const Event& e = b->events[i % n];
+      sep();
+      ss << "{\"cat\":\"" << e.cat << "\",\"name\":\"" << e.name
+         << "\",\"ph\":\"X\",\"ts\":" << e.start_usec
+         << ",\"dur\":" << e.dur_usec << ",\"pid\":" << pid
+         << ",\"tid\":" << b->tid;
+      if (e.arg >= 0) {
+        ss << ",\"args\":{\"n\":" << e.arg << "}";
+      }
+      ss << "}";
+    }
+  }
+  ss << "]}\n";
+  return ss.str();
+}
+
+bool Tracer::dump(const std::string& path) const {
+  std::ofstream oo(path);
+  oo << dumpJson();
+  return oo.good();
+}
+
+} // namespace tracing
+} // namespace elf
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+/**
+ * Opt-in recording of spans (e.g. the stages of a request from a game thread
+ * to the model and back), dumped in the Chrome trace event format, which
+ * chrome://tracing and Perfetto open:
+ *
+ *   {
+ *     ELF_TRACE_SPAN("comm", "waitBatch");
+ *     ...
+ *   }
+ *
+ * Each thread records in a ring of its own, holding its most recent events.
+ * While recording is off (the default), a span costs a relaxed atomic load.
+ * cat and name must be string literals (or otherwise outlive the tracer).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#define ELF_TRACE_CONCAT_(a, b) a##b
+#define ELF_TRACE_CONCAT(a, b) ELF_TRACE_CONCAT_(a, b)
+
+#define ELF_TRACE_SPAN(cat, name) \
+  ::elf::tracing::Span ELF_TRACE_CONCAT(elf_trace_span_, __LINE__)(cat, name)
+
+namespace elf {
+namespace tracing {
+
+class Tracer {
+ public:
+  static constexpr size_t kDefaultCapacity = 1 << 16;
+
+  static Tracer& global();
+
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Microseconds on a steady clock.
+  static uint64_t nowUsec();
+
+  // Starts recording, capacity events per thread; drops the events so far
+  // if capacity changes.
+  void enable(size_t capacity = kDefaultCapacity);
+  void disable();
+  // Drops the events so far.
+  void clear();
+
+  // A complete event. arg < 0 for none.
+  void record(
+      const char* cat,
+      const char* name,
+      uint64_t start_usec,
+      uint64_t end_usec,
+      int64_t arg = -1);
+
+  // Name of the calling thread in the dumps.
+  void setThreadName(const std::string& name);
+
+  // The events of all threads, oldest first, in the Chrome trace JSON format.
+  std::string dumpJson() const;
+  // Writes dumpJson() to path; false if it cannot.
+  bool dump(const std::string& path) const;
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records the time from its construction to its destruction, if recording
+// was on when constructed.
+class Span {
+ public:
+  Span(const char* cat, const char* name, int64_t arg = -1)
+      : cat_(cat),
+        name_(name),
+        arg_(arg),
+        start_(Tracer::enabled() ? Tracer::nowUsec() : 0) {}
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  ~Span() {
+    if (start_ > 0) {
+      Tracer::global().record(cat_, name_, start_, Tracer::nowUsec(), arg_);
+    }
+  }
+
+  // E.g. a batch size known at the end of the span.
+  void setArg(int64_t arg) {
+    arg_ = arg;
+  }
+
+ private:
+  const char* cat_;
+  const char* name_;
+  int64_t arg_;
+  const uint64_t start_;
+};
+
+} // namespace tracing
+} // namespace elf
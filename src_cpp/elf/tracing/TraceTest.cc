@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "Trace.h"
+
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace elf {
+namespace tracing {
+
+namespace {
+
+size_t count(const std::string& s, const std::string& sub) {
+  size_t n = 0;
+  for (size_t pos = s.find(sub); pos != std::string::npos;
+       pos = s.find(sub, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+} // namespace
+
+TEST(TraceTest, RecordsOnlyWhenEnabled) {
+  Tracer& tracer = Tracer::global();
+  tracer.clear();
+  { ELF_TRACE_SPAN("test", "off"); }
+
+  tracer.enable();
+  tracer.setThreadName("main \"thread\"");
+  {
+    Span span("test", "batch");
+    span.setArg(7);
+    ELF_TRACE_SPAN("test", "inner");
+  }
+  std::thread([]() { ELF_TRACE_SPAN("test", "other"); }).join();
+  tracer.disable();
+  { ELF_TRACE_SPAN("test", "off"); }
+
+  const std::string json = tracer.dumpJson();
+  EXPECT_EQ(json.find("\"off\""), std::string::npos);
+  EXPECT_EQ(count(json, "\"ph\":\"X\""), 3u);
+  EXPECT_NE(json.find("\"name\":\"batch\""), std::string::npos);
+  EXPECT_NE(json.find("\"args\":{\"n\":7}"), std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"main \\\"thread\\\"\""), std::string::npos);
+}
+
+TEST(TraceTest, KeepsMostRecent) {
+  Tracer& tracer = Tracer::global();
+  tracer.enable(4);
+  for (int i = 0; i < 10; ++i) {
+    Span span("test", "loop", i);
+  }
+  tracer.disable();
+
+  const std::string json = tracer.dumpJson();
+  EXPECT_EQ(count(json, "\"name\":\"loop\""), 4u);
+  EXPECT_EQ(json.find("\"n\":5}"), std::string::npos);
+  EXPECT_NE(json.find("\"n\":6}"), std::string::npos);
+  EXPECT_NE(json.find("\"n\":9}"), std::string::npos);
+  EXPECT_LT(json.find("\"n\":6}"), json.find("\"n\":9}"));
+
+  tracer.clear();
+  EXPECT_EQ(count(tracer.dumpJson(), "\"ph\":\"X\""), 0u);
+  tracer.enable(Tracer::kDefaultCapacity);
+  tracer.disable();
+}
+
+} // namespace tracing
+} // namespace elf
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
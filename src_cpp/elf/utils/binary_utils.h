@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace elf_utils {
+
+// Flat binary encoding, the counterpart of json_utils.h: scalars in the byte
+// order of the host, strings and vectors of scalars with a uint32_t length
+// and their bytes in one block. An object is a block with its byte length up
+// front, so that a reader may skip it, or stop at its end (fields appended
+// later are then ignored by older readers, and optional for newer ones).
+class BinaryWriter {
+ public:
+  explicit BinaryWriter(std::string* buf) : buf_(buf) {}
+
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type write(T v) {
+    writeBytes(&v, sizeof(T));
+  }
+
+  void write(const std::string& s) {
+    write<uint32_t>(s.size());
+    writeBytes(s.data(), s.size());
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type write(
+      const std::vector<T>& v) {
+    write<uint32_t>(v.size());
+    writeBytes(v.data(), v.size() * sizeof(T));
+  }
+
+  void writeBytes(const void* p, size_t n) {
+    buf_->append(static_cast<const char*>(p), n);
+  }
+
+  // f() writes the fields of the object.
+  template <typename F>
+  void writeBlock(F f) {
+    const size_t pos = buf_->size();
+    write<uint32_t>(0);
+    f();
+    const uint32_t n = buf_->size() - pos - sizeof(uint32_t);
+    memcpy(&(*buf_)[pos], &n, sizeof(n));
+  }
+
+ private:
+  std::string* buf_;
+};
+
+// Reads what BinaryWriter wrote, straight from the buffer (which has to
+// outlive the reader); throws std::runtime_error past its end.
+class BinaryReader {
+ public:
+  BinaryReader(const char* p, size_t n) : p_(p), end_(p + n) {}
+  explicit BinaryReader(const std::string& s)
+      : BinaryReader(s.data(), s.size()) {}
+
+  bool empty() const {
+    return p_ == end_;
+  }
+
+  size_t remaining() const {
+    return end_ - p_;
+  }
+
+  // Version of the encoding, for objects whose layout changed with it; passed
+  // on to the readers of blocks.
+  int version() const {
+    return version_;
+  }
+
+  void setVersion(int version) {
+    version_ = version;
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type read(T* v) {
+    memcpy(v, readBytes(sizeof(T)), sizeof(T));
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value, T>::type read() {
+    T v;
+    read(&v);
+    return v;
+  }
+
+  void read(std::string* s) {
+    const uint32_t n = read<uint32_t>();
+    s->assign(readBytes(n), n);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_arithmetic<T>::value>::type read(
+      std::vector<T>* v) {
+    const uint32_t n = read<uint32_t>();
+    const char* p = readBytes((size_t)n * sizeof(T));
+    v->resize(n);
+    memcpy(v->data(), p, (size_t)n * sizeof(T));
+  }
+
+  // A view of the next n bytes.
+  const char* readBytes(size_t n) {
+    if (n > remaining()) {
+      throw std::runtime_error("BinaryReader: truncated input");
+    }
+    const char* p = p_;
+    p_ += n;
+    return p;
+  }
+
+  // A reader of the next object, which is skipped by this one.
+  BinaryReader readBlock() {
+    const uint32_t n = read<uint32_t>();
+    const char* p = readBytes(n);
+    BinaryReader r(p, n);
+    r.setVersion(version_);
+    return r;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+  int version_ = 0;
+};
+
+} // namespace elf_utils
+
+#define BIN_SAVE(w, field) w.write(field);
+
+#define BIN_SAVE_ENUM(w, field) w.write<int32_t>(field);
+
+#define BIN_SAVE_OBJ(w, field) \
+  w.writeBlock([&]() { field.setBinaryFields(w); });
+
+#define BIN_LOAD(target, r, field) r.read(&target.field);
+
+#define BIN_LOAD_ENUM(target, r, field) \
+  target.field = static_cast<decltype(target.field)>(r.read<int32_t>());
+
+// For the fields appended to an object after the first version.
+#define BIN_LOAD_OPTIONAL(target, r, field) \
+  if (!r.empty()) {                         \
+    r.read(&target.field);                  \
+  }
+
+#define BIN_LOAD_OBJ(target, r, field)                 \
+  {                                                    \
+    elf_utils::BinaryReader sub = r.readBlock();       \
+    target.field = target.field.createFromBinary(sub); \
+  }
@@ -0,0 +1,142 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <stdexcept>
+
+namespace elf_utils {
+
+// Splits JSON text without parsing it: only strings and nesting are tracked,
+// so that a large array can be cut into its elements, to be parsed one by one
+// (and in parallel). Strings are skipped with memchr(), vectorized by libc.
+class JsonScanner {
+ public:
+  // Calls f(p, n) on the text of each element of the JSON array in
+  // [p, p + n). Returns the number of elements; throws std::runtime_error if
+  // the text is not an array (after the elements before the error).
+  template <typename F>
+  static size_t forEachArrayElement(const char* p, size_t n, F f) {
+    const char* end = p + n;
+    p = skipSpace(p, end);
+    if (p == end || *p != '[') {
+      throw std::runtime_error("JsonScanner: not an array");
+    }
+    p = skipSpace(p + 1, end);
+    if (p < end && *p == ']') {
+      return 0;
+    }
+    size_t count = 0;
+    while (true) {
+      const char* begin = p;
+      p = skipValue(p, end);
+      if (p == begin) {
+        throw std::runtime_error("JsonScanner: missing element");
+      }
+      f(begin, size_t(p - begin));
+      count++;
+      p = skipSpace(p, end);
+      if (p == end) {
+        throw std::runtime_error("JsonScanner: truncated array");
+      }
+      if (*p == ']') {
+        return count;
+      }
+      if (*p != ',') {
+        throw std::runtime_error("JsonScanner: expected ','");
+      }
+      p = skipSpace(p + 1, end);
+    }
+  }
+
+  // Past the value at p.
+  static const char* skipValue(const char* p, const char* end) {
+    if (p == end) {
+      return p;
+    }
+    if (*p == '"') {
+      return skipString(p + 1, end);
+    }
+    if (*p != '{' && *p != '[') {
+      // A number or a literal.
+      while (p < end && !isDelimiter(*p)) {
+        ++p;
+      }
+      return p;
+    }
+    int depth = 0;
+    while (p < end) {
+      // Most of the text (numbers, commas) is skipped here.
+      while (p < end && !isStructural(*p)) {
+        ++p;
+      }
+      if (p == end) {
+        break;
+      }
+      switch (*p) {
+        case '"':
+          p = skipString(p + 1, end);
+          continue;
+        case '{':
+        case '[':
+          depth++;
+          break;
+        default:
+          if (--depth == 0) {
+            return p + 1;
+          }
+      }
+      ++p;
+    }
+    throw std::runtime_error("JsonScanner: truncated value");
+  }
+
+ private:
+  static bool isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  static bool isDelimiter(char c) {
+    return isSpace(c) || c == ',' || c == ']' || c == '}';
+  }
+
+  static bool isStructural(char c) {
+    return c == '"' || c == '{' || c == '}' || c == '[' || c == ']';
+  }
+
+  static const char* skipSpace(const char* p, const char* end) {
+    while (p < end && isSpace(*p)) {
+      ++p;
+    }
+    return p;
+  }
+
+  // Past the closing quote of the string whose content starts at p.
+  static const char* skipString(const char* p, const char* end) {
+    while (true) {
+      const char* q =
+          static_cast<const char*>(memchr(p, '"', size_t(end - p)));
+      if (q == nullptr) {
+        throw std::runtime_error("JsonScanner: truncated string");
+      }
+      // Escaped if preceded by an odd number of backslashes.
+      const char* b = q;
+      while (b > p && b[-1] == '\\') {
+        --b;
+      }
+      if ((q - b) % 2 == 0) {
+        return q + 1;
+      }
+      p = q + 1;
+    }
+  }
+};
+
+} // namespace elf_utils
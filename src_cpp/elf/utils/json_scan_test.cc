@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "json_scan.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace elf_utils {
+
+namespace {
+
+std::vector<std::string> split(const std::string& s) {
+  std::vector<std::string> res;
+  JsonScanner::forEachArrayElement(
+      s.data(), s.size(), [&](const char* p, size_t n) {
+        res.emplace_back(p, n);
+      });
+  return res;
+}
+
+} // namespace
+
+TEST(JsonScannerTest, SplitsArray) {
+  EXPECT_EQ(split(" [ ] "), std::vector<std::string>());
+  EXPECT_EQ(
+      split("[1, -2.5e3,true , null,\"a,]\"]"),
+      std::vector<std::string>({"1", "-2.5e3", "true", "null", "\"a,]\""}));
+  EXPECT_EQ(
+      split("[{\"a\": [1, {\"b\": \"}]\\\"\"}]},\n[[], {}], \"\\\\\"]"),
+      std::vector<std::string>(
+          {"{\"a\": [1, {\"b\": \"}]\\\"\"}]}", "[[], {}]", "\"\\\\\""}));
+}
+
+TEST(JsonScannerTest, ThrowsOnMalformedText) {
+  std::vector<std::string> seen;
+  auto f = [&](const char* p, size_t n) { seen.emplace_back(p, n); };
+  for (const std::string s :
+       {"", "{}", "[1,", "[1 2]", "[{\"a\": 1]", "[\"abc]", "[1,,2]"}) {
+    EXPECT_THROW(
+        JsonScanner::forEachArrayElement(s.data(), s.size(), f),
+        std::runtime_error)
+        << s;
+  }
+  // The elements before the error.
+  seen.clear();
+  const std::string s = "[{}, [1], {\"a\"";
+  EXPECT_THROW(
+      JsonScanner::forEachArrayElement(s.data(), s.size(), f),
+      std::runtime_error);
+  EXPECT_EQ(seen, std::vector<std::string>({"{}", "[1]"}));
+}
+
+} // namespace elf_utils
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -6,6 +6,7 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
@@ -29,8 +30,25 @@ void registerPy(pybind11::module& m) {
       .def("setInitialVersion", &GameContext::setInitialVersion)
       .def("setRequest", &GameContext::setRequest)
       .def("setEvalMode", &GameContext::setEvalMode)
+      .def("getIngestStats", &GameContext::getIngestStats)
+      .def("getEvalCacheInfo", &GameContext::getEvalCacheInfo)
+      .def("getOpeningBookInfo", &GameContext::getOpeningBookInfo)
+      .def(
+          "analysis",
+          &GameContext::analysis,
+          py::arg("line"),
+          py::arg("progress") = nullptr,
+          py::call_guard<py::gil_scoped_release>())
+      .def("getAnalysisInfo", &GameContext::getAnalysisInfo)
       .def("getGameStats", &GameContext::getGameStats, ref);
 
+  m.def(
+      "convertToDataset",
+      &GameDatasetWriter::convert,
+      py::arg("files"),
+      py::arg("path"),
+      py::arg("num_threads") = 16);
+
   // Also register other objects.
   PYCLASS_WITH_FIELDS(m, ContextOptions)
       .def(py::init<>())
@@ -42,8 +60,28 @@ void registerPy(pybind11::module& m) {
 
   PYCLASS_WITH_FIELDS(m, WinRateStats).def(py::init<>());
 
+  using elf::ai::tree_search::SearchPhaseStats;
+  PYCLASS_WITH_FIELDS(m, SearchPhaseStats)
+      .def(py::init<>())
+      .def("info", &SearchPhaseStats::info)
+      .def("quantileNsec", &SearchPhaseStats::quantileNsec);
+
+  using elf::shared::ClientStats;
+  using elf::shared::HistogramSnapshot;
+  using elf::shared::IngestStats;
+  PYCLASS_WITH_FIELDS(m, HistogramSnapshot)
+      .def(py::init<>())
+      .def("info", &HistogramSnapshot::info)
+      .def("quantile", &HistogramSnapshot::quantile);
+  PYCLASS_WITH_FIELDS(m, ClientStats).def(py::init<>());
+  PYCLASS_WITH_FIELDS(m, IngestStats)
+      .def(py::init<>())
+      .def("info", &IngestStats::info)
+      .def("scrape", &IngestStats::scrape);
+
   py::class_<GameStats>(m, "GameStats")
       .def("getWinRateStats", &GameStats::getWinRateStats)
+      .def("getSearchStats", &GameStats::getSearchStats)
       //.def("AllGamesFinished", &GameStats::AllGamesFinished)
       //.def("restartAllGames", &GameStats::restartAllGames)
       .def("getPlayedGames", &GameStats::getPlayedGames);
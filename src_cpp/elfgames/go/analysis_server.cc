@@ -0,0 +1,343 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "analysis_server.h"
+
+#include <algorithm>
+#include <future>
+#include <sstream>
+
+#include "mcts/ai.h"
+#include "sgf/sgf.h"
+
+namespace {
+
+using MCTSSnapshot = MCTSGoAI::TreeSearch::MCTSSnapshot;
+
+std::vector<std::string> tokenize(const std::string& line) {
+  std::vector<std::string> tokens;
+  std::istringstream iss(line);
+  std::string t;
+  while (iss >> t) {
+    tokens.push_back(t);
+  }
+  return tokens;
+}
+
+// Non negative integer, or -1.
+int64_t parseCount(const std::string& s) {
+  if (s.empty() || s.size() > 18 ||
+      !std::all_of(s.begin(), s.end(), ::isdigit)) {
+    return -1;
+  }
+  return std::stoll(s);
+}
+
+bool parseColor(const std::string& s, Stone* player) {
+  std::string c(s);
+  std::transform(c.begin(), c.end(), c.begin(), ::tolower);
+  if (c == "b" || c == "black") {
+    *player = S_BLACK;
+  } else if (c == "w" || c == "white") {
+    *player = S_WHITE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string success(const std::string& result = "") {
+  return "= " + result;
+}
+
+std::string failure(const std::string& error) {
+  return "? " + error;
+}
+
+std::string format(const MCTSSnapshot& snapshot) {
+  std::stringstream ss;
+  ss << "value " << snapshot.value << " visits " << snapshot.total_visits;
+  for (size_t i = 0; i < snapshot.moves.size(); ++i) {
+    const auto& e = snapshot.moves[i].second;
+    ss << " info move " << coord2str2(snapshot.moves[i].first) << " visits "
+       << e.num_visits << " q " << (e.num_visits > 0 ? e.getQSA() : 0)
+       << " prior " << e.prior_probability << " order " << i << " pv";
+    for (Coord c : snapshot.pvs[i]) {
+      ss << " " << coord2str2(c);
+    }
+  }
+  return ss.str();
+}
+
+} // namespace
+
+AnalysisServer::AnalysisServer(
+    elf::GameClient* client,
+    const elf::ai::tree_search::TSOptions& mcts_options,
+    const GameOptions& options)
+    : client_(client), mcts_options_(mcts_options), options_(options) {}
+
+AnalysisServer::~AnalysisServer() {
+  std::vector<Callback> failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& p : sessions_) {
+      for (auto& r : p.second->pending) {
+        failed.push_back(std::move(r.cb));
+      }
+    }
+  }
+  for (auto& cb : failed) {
+    cb(failure("server stopped"));
+  }
+}
+
+void AnalysisServer::submit(
+    const std::string& line,
+    Callback cb,
+    Progress progress) {
+  std::vector<std::string> tokens = tokenize(line);
+  if (tokens.size() < 2) {
+    cb(failure("expected: <session> <command> [args...]"));
+    return;
+  }
+  const std::string id = tokens[0];
+  tokens.erase(tokens.begin());
+
+  std::string reply;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    numRequests_++;
+    if (tokens[0] == "open") {
+      reply = open(id, tokens);
+    } else {
+      auto it = sessions_.find(id);
+      if (it == sessions_.end()) {
+        reply = failure("unknown session " + id);
+      } else {
+        Session* s = it->second.get();
+        s->pending.push_back(
+            Pending{std::move(tokens), std::move(cb), std::move(progress)});
+        if (!s->scheduled) {
+          s->scheduled = true;
+          ready_.push_back(id);
+          cv_.notify_one();
+        }
+        return;
+      }
+    }
+  }
+  cb(reply);
+}
+
+std::string AnalysisServer::request(
+    const std::string& line,
+    Progress progress) {
+  std::promise<std::string> reply;
+  std::future<std::string> f = reply.get_future();
+  submit(
+      line,
+      [&reply](const std::string& r) { reply.set_value(r); },
+      std::move(progress));
+  return f.get();
+}
+
+bool AnalysisServer::serveOne(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!cv_.wait_for(lock, timeout, [this]() { return !ready_.empty(); })) {
+    lock.unlock();
+    if (client_->checkPrepareToStop()) {
+      // The collectors see the stop with a request only, which idle workers
+      // would never send (as in GoGameSelfPlay).
+      GoState s;
+      BoardFeature bf(s);
+      GoReply reply(bf);
+      AI ai(client_, {"actor_black"});
+      ai.act(bf, &reply);
+    }
+    return false;
+  }
+  const std::string id = ready_.front();
+  ready_.pop_front();
+  Session* s = sessions_.at(id).get();
+  Pending p = std::move(s->pending.front());
+  s->pending.pop_front();
+  lock.unlock();
+
+  const std::string reply = run(s, p);
+
+  std::unique_ptr<Session> closed;
+  lock.lock();
+  if (s->closed) {
+    closed = std::move(sessions_.at(id));
+    sessions_.erase(id);
+  } else if (!s->pending.empty()) {
+    // Behind the sessions that waited meanwhile.
+    ready_.push_back(id);
+    cv_.notify_one();
+  } else {
+    s->scheduled = false;
+  }
+  lock.unlock();
+
+  p.cb(reply);
+  if (closed != nullptr) {
+    for (auto& r : closed->pending) {
+      r.cb(failure("session closed"));
+    }
+  }
+  return true;
+}
+
+std::string AnalysisServer::info() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::stringstream ss;
+  ss << "AnalysisServer: sessions: " << sessions_.size()
+     << " (opened: " << numSessionsOpened_ << "), ready: " << ready_.size()
+     << ", requests: " << numRequests_ << ", searches: " << numSearches_;
+  return ss.str();
+}
+
+std::string AnalysisServer::open(
+    const std::string& id,
+    const std::vector<std::string>& args) {
+  if (sessions_.count(id) > 0) {
+    return failure("session " + id + " exists");
+  }
+  const int64_t rollouts = args.size() > 1 ? parseCount(args[1]) : 0;
+  const int64_t budget = args.size() > 2 ? parseCount(args[2]) : 0;
+  if (rollouts < 0 || budget < 0 || args.size() > 3) {
+    return failure("expected: open [rollouts [budget]]");
+  }
+
+  std::unique_ptr<Session> s(new Session);
+  s->mcts_options = mcts_options_;
+  const int num_threads = std::max(mcts_options_.num_threads, 1);
+  if (rollouts > 0) {
+    s->mcts_options.num_rollouts_per_thread =
+        std::max<int64_t>(1, (rollouts + num_threads - 1) / num_threads);
+  }
+  s->rollouts = (int64_t)s->mcts_options.num_rollouts_per_thread * num_threads;
+  s->budget = budget;
+  s->seed = std::hash<std::string>{}(id) ^ numSessionsOpened_;
+  sessions_[id] = std::move(s);
+  numSessionsOpened_++;
+  return success();
+}
+
+std::string AnalysisServer::run(Session* s, const Pending& p) {
+  const std::vector<std::string>& args = p.args;
+  const std::string& cmd = args[0];
+  if (cmd == "play" || cmd == "genmove") {
+    Stone player;
+    if (args.size() != (cmd == "play" ? 3u : 2u) ||
+        !parseColor(args[1], &player)) {
+      return failure(
+          cmd == "play" ? "expected: play <b|w> <move>"
+                        : "expected: genmove <b|w>");
+    }
+    if (player != s->state.nextPlayer()) {
+      return failure("not the turn of " + args[1]);
+    }
+    Coord c = M_INVALID;
+    if (cmd == "play") {
+      c = str2coord2(args[2]);
+      if (c == M_INVALID) {
+        return failure("invalid move " + args[2]);
+      }
+    } else {
+      const std::string error = search(s, &c);
+      if (!error.empty()) {
+        return error;
+      }
+    }
+    if (!s->state.forward(c)) {
+      return failure("illegal move " + coord2str2(c));
+    }
+    return success(cmd == "genmove" ? coord2str2(c) : "");
+  }
+  if (cmd == "analyze") {
+    const int64_t k = args.size() > 1 ? parseCount(args[1]) : 5;
+    const int64_t interval = args.size() > 2 ? parseCount(args[2]) : 0;
+    if (k < 0 || interval < 0 || args.size() > 3) {
+      return failure("expected: analyze [k [interval]]");
+    }
+    return analyze(s, k, std::chrono::milliseconds(interval), p.progress);
+  }
+  if (cmd == "showboard") {
+    return success("\n" + s->state.showBoard());
+  }
+  if (cmd == "clear") {
+    s->state.reset();
+    if (s->ai != nullptr) {
+      s->ai->endGame(s->state);
+    }
+    return success();
+  }
+  if (cmd == "close") {
+    s->closed = true;
+    return success();
+  }
+  return failure("unknown command " + cmd);
+}
+
+MCTSGoAI* AnalysisServer::getAI(Session* s) {
+  if (s->ai == nullptr) {
+    MCTSActorParams params;
+    params.actor_name = "actor_black";
+    params.seed = s->seed;
+    params.ply_pass_enabled = options_.ply_pass_enabled;
+    params.komi = options_.komi;
+    params.d4_ensemble = options_.d4_ensemble;
+    params.resolve_without_nn = options_.resolve_without_nn;
+    // Users wait on analysis.
+    params.priority = comm::PRIORITY_HIGH;
+    elf::GameClient* client = client_;
+    s->ai.reset(new MCTSGoAI(s->mcts_options, [client, params](int i) {
+      MCTSActorParams p = params;
+      p.seed += i;
+      return new MCTSActor(client, p);
+    }));
+  }
+  return s->ai.get();
+}
+
+std::string AnalysisServer::search(Session* s, Coord* c) {
+  if (s->state.terminated()) {
+    return failure("game over");
+  }
+  if (s->budget > 0 && s->used + s->rollouts > s->budget) {
+    return failure("rollout budget used up");
+  }
+  getAI(s)->act(s->state, c);
+  s->used += s->rollouts;
+  std::lock_guard<std::mutex> lock(mutex_);
+  numSearches_++;
+  return "";
+}
+
+std::string AnalysisServer::analyze(
+    Session* s,
+    int k,
+    std::chrono::milliseconds interval,
+    const Progress& progress) {
+  auto* engine = getAI(s)->getEngine();
+  if (interval.count() > 0 && progress != nullptr) {
+    engine->setSnapshotCallback(
+        interval, k, [&progress](const MCTSSnapshot& snapshot) {
+          return progress(format(snapshot));
+        });
+  }
+  Coord c;
+  const std::string error = search(s, &c);
+  engine->setSnapshotCallback(std::chrono::milliseconds(0), 0, nullptr);
+  if (!error.empty()) {
+    return error;
+  }
+  return success(format(engine->getSnapshot(k)));
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "elf/ai/tree_search/tree_search_options.h"
+#include "elf/base/context.h"
+
+#include "game_base.h"
+#include "go_game_specific.h"
+#include "mcts/mcts.h"
+
+// Hosts many independent analysis sessions in one process, each a board and
+// its own MCTSGoAI. Their searches run on the workers (the games of the
+// context, see GoGameAnalysis) and their actors all send to "actor_black",
+// so that one GPU evaluates the positions of all the sessions in the same
+// batches.
+//
+// Requests are lines of text, "<session> <command> [args...]", replied to
+// as in GTP: "= [result]" or "? <error>".
+//
+//   open [rollouts [budget]]  New session, searching rollouts per move (0:
+//                             those of the MCTS options) and at most budget
+//                             rollouts in all (0: no limit).
+//   play <b|w> <move>         Plays the move (e.g. D4, pass).
+//   genmove <b|w>             Searches, plays and returns the move.
+//   analyze [k [interval]]    Searches without playing: the root value and
+//                             the k most visited moves (5 by default), as
+//                             "value <v> visits <n> info move <m> visits <n>
+//                             q <q> prior <p> order <i> pv <m> <m>... info
+//                             move ...". Every interval ms (0: never) of the
+//                             search, the same for the search so far goes to
+//                             the progress callback of the request.
+//   showboard
+//   clear                     New game.
+//   close
+//
+// Scheduling is fair: a session runs one request at a time, and the
+// sessions with pending requests take turns, so that one queuing many
+// searches does not hold the workers from the others.
+class AnalysisServer {
+ public:
+  using Callback = std::function<void(const std::string&)>;
+  // Returns false to stop the search (which then replies with the result so
+  // far).
+  using Progress = std::function<bool(const std::string&)>;
+
+  AnalysisServer(
+      elf::GameClient* client,
+      const elf::ai::tree_search::TSOptions& mcts_options,
+      const GameOptions& options);
+
+  // Fails the pending requests.
+  ~AnalysisServer();
+
+  // cb gets the reply, on the worker that ran the request (or this thread,
+  // for requests that need no search); progress, on that worker too, the
+  // snapshots of analyze.
+  void submit(
+      const std::string& line,
+      Callback cb,
+      Progress progress = nullptr);
+
+  // Waits for the reply.
+  std::string request(
+      const std::string& line,
+      Progress progress = nullptr);
+
+  // Runs the next request, waiting up to timeout for one; false if there
+  // was none. Called by the workers, until DoStopGames().
+  bool serveOne(std::chrono::milliseconds timeout);
+
+  std::string info() const;
+
+ private:
+  struct Pending {
+    std::vector<std::string> args;
+    Callback cb;
+    Progress progress;
+  };
+
+  struct Session {
+    GoState state;
+    // Made on the first search.
+    std::unique_ptr<MCTSGoAI> ai;
+    elf::ai::tree_search::TSOptions mcts_options;
+    int64_t rollouts = 0;
+    int64_t budget = 0;
+    int64_t used = 0;
+    uint64_t seed = 0;
+    std::deque<Pending> pending;
+    // Waiting in ready_, or running.
+    bool scheduled = false;
+    bool closed = false;
+  };
+
+  elf::GameClient* client_;
+  const elf::ai::tree_search::TSOptions mcts_options_;
+  const GameOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, std::unique_ptr<Session>> sessions_;
+  // Sessions with pending requests, in turn.
+  std::deque<std::string> ready_;
+  uint64_t numSessionsOpened_ = 0;
+  uint64_t numRequests_ = 0;
+  uint64_t numSearches_ = 0;
+
+  // Replies to open, under mutex_.
+  std::string open(const std::string& id, const std::vector<std::string>& a);
+  // Runs a request of the session, which only this worker uses meanwhile.
+  std::string run(Session* s, const Pending& p);
+  MCTSGoAI* getAI(Session* s);
+  std::string search(Session* s, Coord* c);
+  std::string analyze(
+      Session* s,
+      int k,
+      std::chrono::milliseconds interval,
+      const Progress& progress);
+};
+
+// A worker of the AnalysisServer.
+class GoGameAnalysis : public GoGameBase {
+ public:
+  GoGameAnalysis(
+      int game_idx,
+      elf::GameClient* client,
+      const ContextOptions& context_options,
+      const GameOptions& options,
+      AnalysisServer* server)
+      : GoGameBase(game_idx, client, context_options, options),
+        server_(server) {}
+
+  // Back to the stop flag between requests.
+  void act() override {
+    server_->serveOne(std::chrono::milliseconds(100));
+  }
+
+ private:
+  AnalysisServer* server_;
+};
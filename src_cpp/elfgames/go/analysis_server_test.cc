@@ -0,0 +1,222 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "analysis_server.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "game_feature.h"
+#include "sgf/sgf.h"
+
+namespace {
+
+// A uniform policy and an even value, for all the sessions at once.
+class UniformBackend : public elf::InferenceBackend {
+ public:
+  explicit UniformBackend(std::atomic<int>* max_batchsize)
+      : maxBatchsize_(max_batchsize) {}
+
+  comm::ReplyStatus process(elf::SharedMem& smem) override {
+    const int n = smem.getEffectiveBatchSize();
+    for (int i = 0; i < n; ++i) {
+      *smem["V"]->getAddress<float>(i) = 0;
+      *smem["a"]->getAddress<int64_t>(i) = 0;
+      *smem["rv"]->getAddress<int64_t>(i) = 0;
+      float* pi = smem["pi"]->getAddress<float>(i);
+      std::fill(pi, pi + BOARD_NUM_ACTION, 1.0 / BOARD_NUM_ACTION);
+    }
+    int m = maxBatchsize_->load();
+    while (n > m && !maxBatchsize_->compare_exchange_weak(m, n)) {
+    }
+    return comm::SUCCESS;
+  }
+
+ private:
+  std::atomic<int>* maxBatchsize_;
+};
+
+// Sessions on the workers of a context whose "actor_black" batches are
+// served by UniformBackend.
+class AnalysisServerTest : public ::testing::Test {
+ protected:
+  static constexpr int kBatchSize = 16;
+  static constexpr int kNumWorkers = 8;
+
+  void SetUp() override {
+    GameOptions options;
+    GoFeature feature(options);
+    feature.registerExtractor(kBatchSize, ctx_.getExtractor());
+    // Batches of whatever the sessions have sent within 100 usec.
+    elf::SharedMemOptions smem_options =
+        ctx_.createSharedMemOptions("actor_black", kBatchSize);
+    smem_options.setTimeout(100);
+    elf::SharedMem& smem = ctx_.allocateSharedMem(
+        smem_options, {"s", "pi", "V", "a", "rv"});
+    for (const std::string key : {"s", "pi", "V", "a", "rv"}) {
+      elf::AnyP* p = smem[key];
+      const elf::Size& sz = p->field().getSize();
+      const size_t type_size = p->field().getSizeOfType();
+      buffers_.emplace_back(sz.nelement() * type_size);
+      p->setAddress(
+          (uint64_t)buffers_.back().data(),
+          sz.getContinuousStrides(type_size).vec());
+    }
+    ctx_.setInferenceBackend("actor_black", [this](const elf::SharedMem&) {
+      return std::unique_ptr<elf::InferenceBackend>(
+          new UniformBackend(&maxBatchsize_));
+    });
+
+    elf::ai::tree_search::TSOptions mcts_options;
+    mcts_options.num_threads = 2;
+    mcts_options.num_rollouts_per_thread = 8;
+    mcts_options.num_rollouts_per_batch = 4;
+    server_.reset(
+        new AnalysisServer(ctx_.getClient(), mcts_options, options));
+    ctx_.setStartCallback(kNumWorkers, [this](int, elf::GameClient* client) {
+      while (!client->DoStopGames()) {
+        server_->serveOne(std::chrono::milliseconds(10));
+      }
+    });
+    ctx_.start();
+  }
+
+  void TearDown() override {
+    ctx_.stop();
+    server_.reset();
+  }
+
+  elf::Context ctx_;
+  std::vector<std::vector<char>> buffers_;
+  std::atomic<int> maxBatchsize_{0};
+  std::unique_ptr<AnalysisServer> server_;
+};
+
+TEST_F(AnalysisServerTest, PlayGenmoveAnalyze) {
+  EXPECT_EQ(server_->request("a open"), "= ");
+  EXPECT_EQ(server_->request("a open"), "? session a exists");
+  EXPECT_EQ(server_->request("b play b D4"), "? unknown session b");
+  EXPECT_EQ(server_->request("a play w D4"), "? not the turn of w");
+  EXPECT_EQ(server_->request("a play b Z4"), "? invalid move Z4");
+  EXPECT_EQ(server_->request("a play b D4"), "= ");
+  EXPECT_EQ(server_->request("a play w D4"), "? illegal move D4");
+
+  const std::string move = server_->request("a genmove w");
+  ASSERT_EQ(move.substr(0, 2), "= ");
+  EXPECT_NE(str2coord2(move.substr(2)), M_INVALID);
+
+  const std::string analysis = server_->request("a analyze 3");
+  EXPECT_EQ(analysis.substr(0, 8), "= value ");
+  EXPECT_NE(analysis.find(" order 2"), std::string::npos) << analysis;
+  EXPECT_EQ(analysis.find(" order 3"), std::string::npos) << analysis;
+
+  EXPECT_EQ(server_->request("a clear"), "= ");
+  EXPECT_EQ(server_->request("a play b D4"), "= ");
+  EXPECT_EQ(server_->request("a close"), "= ");
+  EXPECT_EQ(server_->request("a play w C3"), "? unknown session a");
+}
+
+// Snapshots of the search come meanwhile, and the client may stop it.
+TEST_F(AnalysisServerTest, StreamsSnapshots) {
+  EXPECT_EQ(server_->request("a open 100000"), "= ");
+  std::vector<std::string> snapshots;
+  const std::string reply =
+      server_->request("a analyze 2 5", [&](const std::string& snapshot) {
+        snapshots.push_back(snapshot);
+        return snapshots.size() < 2;
+      });
+  ASSERT_EQ(snapshots.size(), 2u);
+  for (const std::string& snapshot : snapshots) {
+    EXPECT_EQ(snapshot.substr(0, 6), "value ") << snapshot;
+    EXPECT_NE(snapshot.find(" order 1 pv "), std::string::npos) << snapshot;
+  }
+  // Stopped early, with the result so far.
+  ASSERT_EQ(reply.substr(0, 8), "= value ");
+  EXPECT_NE(reply.find(" order 1 pv "), std::string::npos) << reply;
+  const int visits = std::stoi(reply.substr(reply.find("visits ") + 7));
+  EXPECT_GT(visits, 0);
+  EXPECT_LT(visits, 100000);
+  EXPECT_EQ(server_->request("a close"), "= ");
+
+  // Without an interval, no snapshots.
+  EXPECT_EQ(server_->request("b open"), "= ");
+  EXPECT_EQ(
+      server_
+          ->request(
+              "b analyze 2",
+              [&](const std::string&) {
+                ADD_FAILURE();
+                return true;
+              })
+          .substr(0, 8),
+      "= value ");
+}
+
+// Each session gets its rollouts per search, until its budget is used up.
+TEST_F(AnalysisServerTest, RolloutBudgets) {
+  EXPECT_EQ(server_->request("a open 32 64"), "= ");
+  EXPECT_EQ(server_->request("a open 1 2 3"), "? session a exists");
+  EXPECT_NE(server_->request("b open x").substr(0, 2), "= ");
+  EXPECT_EQ(server_->request("a analyze 0").substr(0, 8), "= value ");
+  EXPECT_EQ(server_->request("a genmove b").substr(0, 2), "= ");
+  EXPECT_EQ(server_->request("a genmove w"), "? rollout budget used up");
+  EXPECT_EQ(server_->request("a play w pass"), "= ");
+}
+
+// Many sessions search at once, their positions in the same batches.
+TEST_F(AnalysisServerTest, SessionsShareBatches) {
+  constexpr int kNumSessions = 16;
+  constexpr int kNumMoves = 4;
+  std::atomic<int> num_ok(0);
+  std::vector<std::thread> users;
+  for (int i = 0; i < kNumSessions; ++i) {
+    users.emplace_back([this, i, &num_ok]() {
+      const std::string id = "s" + std::to_string(i);
+      if (server_->request(id + " open") != "= ") {
+        return;
+      }
+      for (int m = 0; m < kNumMoves; ++m) {
+        const char* color = m % 2 == 0 ? " genmove b" : " genmove w";
+        if (server_->request(id + color).substr(0, 2) == "= ") {
+          num_ok++;
+        }
+      }
+    });
+  }
+  for (auto& th : users) {
+    th.join();
+  }
+  EXPECT_EQ(num_ok.load(), kNumSessions * kNumMoves);
+  EXPECT_GT(maxBatchsize_.load(), 4);
+}
+
+// A session with many pending requests does not hold the workers: the
+// requests of another one get their turn.
+TEST_F(AnalysisServerTest, FairScheduling) {
+  EXPECT_EQ(server_->request("busy open"), "= ");
+  EXPECT_EQ(server_->request("quick open"), "= ");
+  std::atomic<int> num_busy(0);
+  for (int i = 0; i < 20; ++i) {
+    server_->submit(
+        "busy analyze", [&num_busy](const std::string&) { num_busy++; });
+  }
+  EXPECT_EQ(server_->request("quick analyze").substr(0, 8), "= value ");
+  EXPECT_LT(num_busy.load(), 20);
+  EXPECT_EQ(server_->request("busy close"), "= ");
+  EXPECT_EQ(num_busy.load(), 20);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "elf/distributed/compression.h"
+#include "elf/utils/utils.h"
+
+struct ArtifactWriterOptions {
+  // Archives are <prefix>-<YYYYmmdd-HH>.arc, by the UTC hour they were
+  // written in.
+  std::string prefix;
+  // zstd level of the artifacts (see elf::distri::Compressor); 0 to store
+  // them as they are.
+  int zstd_level = 0;
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "ArtifactWriter [prefix=" << prefix << "][zstd_level=" << zstd_level
+       << "]";
+    return ss.str();
+  }
+};
+
+// Debug artifacts (SGF of games, dumps of search trees) written on a thread
+// of their own, so that game threads do not wait for the file system, and
+// appended to one archive per hour instead of a file each. An archive has an
+// index next to it (<archive>.idx), a line per artifact:
+//
+//   <offset> <size> <zstd: 0 or 1> <name, without spaces>
+//
+// written after the artifact, so that the index of a process that crashed
+// only lists complete ones. Each artifact is compressed on its own and may be
+// read without the others (see load()).
+class ArtifactWriter {
+ public:
+  explicit ArtifactWriter(
+      const ArtifactWriterOptions& options,
+      std::function<uint64_t()> timer = elf_utils::sec_since_epoch_from_now)
+      : options_(options), timer_(timer), compressor_(options.zstd_level, "") {
+    if (options_.zstd_level > 0 && !elf::distri::Compressor::available()) {
+      std::cout << "ArtifactWriter: built without zstd, artifacts are not "
+                << "compressed" << std::endl;
+    }
+    writer_ = std::thread([this]() { writeLoop(); });
+  }
+
+  ArtifactWriter(const ArtifactWriter&) = delete;
+  ArtifactWriter& operator=(const ArtifactWriter&) = delete;
+
+  // Writes the pending artifacts.
+  ~ArtifactWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    closeArchive();
+  }
+
+  void write(std::string name, std::string content) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.emplace_back(std::move(name), std::move(content));
+    }
+    cv_.notify_all();
+  }
+
+  // Waits until the artifacts given so far are written.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushed_cv_.wait(lock, [this]() { return pending_.empty() && !busy_; });
+  }
+
+  // Path of the archive of the hour of timestamp (seconds since epoch).
+  std::string archivePath(uint64_t timestamp) const {
+    const time_t t = timestamp;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char hour[32];
+    strftime(hour, sizeof(hour), "%Y%m%d-%H", &tm);
+    return options_.prefix + "-" + hour + ".arc";
+  }
+
+  // Calls f(name, content) on the artifacts of the archive at path, in the
+  // order they were written. Returns the number of artifacts.
+  static size_t load(
+      const std::string& path,
+      std::function<void(const std::string&, const std::string&)> f) {
+    std::ifstream index(path + ".idx");
+    std::ifstream archive(path, std::ios::binary);
+    if (!index || !archive) {
+      throw std::runtime_error("ArtifactWriter: cannot read " + path);
+    }
+    elf::distri::Compressor compressor(0, "");
+    size_t n = 0;
+    uint64_t offset, size;
+    int zstd;
+    std::string name, data, content;
+    while (index >> offset >> size >> zstd >> name) {
+      data.resize(size);
+      archive.seekg(offset);
+      if (!archive.read(&data[0], size)) {
+        throw std::runtime_error("ArtifactWriter: " + path + " is truncated");
+      }
+      if (zstd && !compressor.decompress(data, &content)) {
+        throw std::runtime_error(
+            "ArtifactWriter: cannot decompress " + name + " of " + path);
+      }
+      f(name, zstd ? content : data);
+      n++;
+    }
+    return n;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << options_.info() << ", #written: " << num_written_.load()
+       << ", #bytes: " << num_bytes_.load();
+    return ss.str();
+  }
+
+ private:
+  const ArtifactWriterOptions options_;
+  std::function<uint64_t()> timer_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable flushed_cv_;
+  std::deque<std::pair<std::string, std::string>> pending_;
+  // Whether the writer is writing an artifact out of pending_.
+  bool busy_ = false;
+  bool done_ = false;
+  std::thread writer_;
+
+  // Used by the writer only.
+  elf::distri::Compressor compressor_;
+  std::string path_;
+  FILE* archive_ = nullptr;
+  FILE* index_ = nullptr;
+  std::string buf_;
+
+  std::atomic<uint64_t> num_written_{0};
+  std::atomic<uint64_t> num_bytes_{0};
+
+  void writeLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return done_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      auto artifact = std::move(pending_.front());
+      pending_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      writeArtifact(artifact.first, artifact.second);
+      lock.lock();
+      busy_ = false;
+      if (pending_.empty()) {
+        flushed_cv_.notify_all();
+      }
+    }
+  }
+
+  void writeArtifact(const std::string& name, const std::string& content) {
+    if (!openArchive(archivePath(timer_()))) {
+      return;
+    }
+    const bool zstd = options_.zstd_level > 0 &&
+        compressor_.compress(content, &buf_, false);
+    const std::string& data = zstd ? buf_ : content;
+
+    fseek(archive_, 0, SEEK_END);
+    const long offset = ftell(archive_);
+    const bool written = offset >= 0 &&
+        fwrite(data.data(), 1, data.size(), archive_) == data.size() &&
+        fflush(archive_) == 0;
+    if (!written) {
+      std::cout << "ArtifactWriter: cannot write " << name << " to " << path_
+                << ": " << strerror(errno) << std::endl;
+      return;
+    }
+    fprintf(
+        index_,
+        "%llu %llu %d %s\n",
+        (unsigned long long)offset,
+        (unsigned long long)data.size(),
+        (int)zstd,
+        name.c_str());
+    fflush(index_);
+    num_written_++;
+    num_bytes_ += data.size();
+  }
+
+  // Appends to path from now on, unless it is the current archive.
+  bool openArchive(const std::string& path) {
+    if (path == path_ && archive_ != nullptr) {
+      return true;
+    }
+    closeArchive();
+    archive_ = fopen(path.c_str(), "ab");
+    index_ = fopen((path + ".idx").c_str(), "a");
+    if (archive_ == nullptr || index_ == nullptr) {
+      std::cout << "ArtifactWriter: cannot open " << path << ": "
+                << strerror(errno) << std::endl;
+      closeArchive();
+      return false;
+    }
+    path_ = path;
+    return true;
+  }
+
+  void closeArchive() {
+    if (archive_ != nullptr) {
+      fclose(archive_);
+      archive_ = nullptr;
+    }
+    if (index_ != nullptr) {
+      fclose(index_);
+      index_ = nullptr;
+    }
+    path_.clear();
+  }
+};
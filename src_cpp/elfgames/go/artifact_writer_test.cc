@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "elfgames/go/artifact_writer.h"
+
+namespace {
+
+using Artifacts = std::vector<std::pair<std::string, std::string>>;
+
+class ArtifactWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    options_.prefix = "artifact_writer_test_" + std::to_string(getpid());
+  }
+
+  void TearDown() override {
+    for (const auto& path : paths_) {
+      unlink(path.c_str());
+      unlink((path + ".idx").c_str());
+    }
+  }
+
+  Artifacts load(const std::string& path) {
+    paths_.push_back(path);
+    Artifacts artifacts;
+    const size_t n = ArtifactWriter::load(
+        path, [&](const std::string& name, const std::string& content) {
+          artifacts.emplace_back(name, content);
+        });
+    EXPECT_EQ(n, artifacts.size());
+    return artifacts;
+  }
+
+  ArtifactWriterOptions options_;
+  std::vector<std::string> paths_;
+};
+
+} // namespace
+
+TEST_F(ArtifactWriterTest, RollsOverHourly) {
+  // 2018-01-01 00:59:59 UTC.
+  std::atomic<uint64_t> now(1514768399);
+  std::string first, second;
+  {
+    ArtifactWriter writer(options_, [&]() { return now.load(); });
+    first = writer.archivePath(now);
+    EXPECT_EQ(first, options_.prefix + "-20180101-00.arc");
+    writer.write("0_0_B.sgf", "(;GM[1])\n");
+    writer.write("0_0_1.tree", std::string(1000, 'x'));
+    writer.flush();
+    now += 1;
+    second = writer.archivePath(now);
+    EXPECT_EQ(second, options_.prefix + "-20180101-01.arc");
+    writer.write("1_0_W.sgf", "");
+  }
+
+  Artifacts expected = {{"0_0_B.sgf", "(;GM[1])\n"},
+                        {"0_0_1.tree", std::string(1000, 'x')}};
+  EXPECT_EQ(load(first), expected);
+  expected = {{"1_0_W.sgf", ""}};
+  EXPECT_EQ(load(second), expected);
+
+  // A later run appends to the archive of the hour.
+  {
+    ArtifactWriter writer(options_, [&]() { return now.load(); });
+    writer.write("2_0_B.sgf", "(;)");
+  }
+  expected.emplace_back("2_0_B.sgf", "(;)");
+  EXPECT_EQ(load(second), expected);
+}
+
+TEST_F(ArtifactWriterTest, Compresses) {
+  options_.zstd_level = 3;
+  const uint64_t now = 1514768399;
+  const std::string content(10000, 'x');
+  std::string path;
+  {
+    ArtifactWriter writer(options_, [&]() { return now; });
+    path = writer.archivePath(now);
+    writer.write("0_0_B.sgf", content);
+  }
+  Artifacts expected = {{"0_0_B.sgf", content}};
+  EXPECT_EQ(load(path), expected);
+
+  std::ifstream archive(path, std::ios::binary | std::ios::ate);
+  if (elf::distri::Compressor::available()) {
+    EXPECT_LT((size_t)archive.tellg(), content.size() / 10);
+  } else {
+    EXPECT_EQ((size_t)archive.tellg(), content.size());
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
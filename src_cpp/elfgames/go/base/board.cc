@@ -8,8 +8,11 @@
 
 #include "board.h"
 #include <iostream>
+#include <string>
 #include <vector>
 
+#include "elf/metrics/Metrics.h"
+
 #define assert(p, text) \
   do {                  \
     if (!(p)) {         \
@@ -21,6 +24,8 @@
 
 #pragma message "BOARD_SIZE = " __STR(__MACRO_BOARD_SIZE)
 
+GO_BOARD_NAMESPACE_BEGIN
+
 uint64_t transform_hash(uint64_t h, Stone s) {
   switch (s) {
     case S_EMPTY:
@@ -35,6 +40,78 @@ uint64_t transform_hash(uint64_t h, Stone s) {
   }
 }
 
+// (x, y) under a D4 code, as in BoardFeature::Transform().
+static constexpr Coord d4_coord(int code, int x, int y) {
+  const int rot = code % 4;
+  int tx = x, ty = y;
+  if (rot == 1) {
+    tx = y;
+    ty = BOARD_SIZE - x - 1;
+  } else if (rot == 2) {
+    tx = BOARD_SIZE - x - 1;
+    ty = BOARD_SIZE - y - 1;
+  } else if (rot == 3) {
+    tx = BOARD_SIZE - y - 1;
+    ty = x;
+  }
+  return (code >> 2) == 1 ? OFFSETXY(ty, tx) : OFFSETXY(tx, ty);
+}
+
+// Of every symmetry: where each point goes, and its Zobrist key there. The
+// 8 keys of a point are contiguous, so that set_color() updates the 8
+// hashes in one pass over them.
+struct SymmetryTables {
+  Coord coords[8][BOUND_COORD];
+  uint64_t keys[BOUND_COORD][8];
+};
+
+static constexpr SymmetryTables make_symmetry_tables() {
+  SymmetryTables t{};
+  for (int code = 0; code < 8; ++code) {
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        const Coord c = d4_coord(code, x, y);
+        t.coords[code][OFFSETXY(x, y)] = c;
+        t.keys[OFFSETXY(x, y)][code] = _board_hash[c];
+      }
+    }
+  }
+  return t;
+}
+
+static constexpr SymmetryTables kSymmetryTables = make_symmetry_tables();
+
+Coord getSymmetricCoord(Coord c, int code) {
+  return c == M_PASS ? M_PASS : kSymmetryTables.coords[code][c];
+}
+
+uint64_t getCanonicalHash(const Board* board, int* code) {
+  int best = 0;
+  for (int i = 1; i < 8; ++i) {
+    if (board->_sym_hash[i] < board->_sym_hash[best]) {
+      best = i;
+    }
+  }
+  if (code != nullptr) {
+    *code = best;
+  }
+  return board->_sym_hash[best];
+}
+
+// hashes[i] ^= transform_hash(keys[i], s), for a stone s.
+static inline void
+xor_stone_keys(uint64_t* hashes, const uint64_t* keys, Stone s) {
+  if (s == S_BLACK) {
+    for (int i = 0; i < 8; ++i) {
+      hashes[i] ^= keys[i];
+    }
+  } else {
+    for (int i = 0; i < 8; ++i) {
+      hashes[i] ^= (keys[i] >> 32) | (keys[i] << 32);
+    }
+  }
+}
+
 inline void set_color(Board* board, Coord c, Stone s) {
   Stone old_s = board->_infos[c].color;
   board->_infos[c].color = s;
@@ -48,6 +125,82 @@ inline void set_color(Board* board, Coord c, Stone s) {
 
   board->_hash ^= transform_hash(h, old_s);
   board->_hash ^= transform_hash(h, s);
+  if (HAS_STONE(old_s))
+    xor_stone_keys(board->_sym_hash, kSymmetryTables.keys[c], old_s);
+  if (HAS_STONE(s))
+    xor_stone_keys(board->_sym_hash, kSymmetryTables.keys[c], s);
+
+  if (HAS_STONE(old_s))
+    board->_stone_bits[old_s - 1].reset(c);
+  if (HAS_STONE(s))
+    board->_stone_bits[s - 1].set(c);
+}
+
+static BitBoard computeOnBoardBits() {
+  BitBoard bits;
+  bits.clear();
+  for (int x = 0; x < BOARD_SIZE; ++x) {
+    for (int y = 0; y < BOARD_SIZE; ++y) {
+      bits.set(OFFSETXY(x, y));
+    }
+  }
+  return bits;
+}
+
+const BitBoard& getOnBoardBits() {
+  static const BitBoard bits = computeOnBoardBits();
+  return bits;
+}
+
+BitBoard getStoneBits(const Board* board, Stone player) {
+  if (HAS_STONE(player))
+    return board->_stone_bits[player - 1];
+  return getOnBoardBits().andNot(
+      board->_stone_bits[0] | board->_stone_bits[1]);
+}
+
+void getGroupBits(const Board* board, short id, BitBoard* bits) {
+  bits->clear();
+  TRAVERSE(board, id, c) {
+    bits->set(c);
+  }
+  ENDTRAVERSE
+}
+
+int countGroupLiberties(const Board* board, short id) {
+  BitBoard group;
+  getGroupBits(board, id, &group);
+  return (group.neighbors() & getStoneBits(board, S_EMPTY)).count();
+}
+
+void computeLegalBits(const Board* board, Stone player, BitBoard* legal) {
+  // An empty point is playable if it keeps a liberty: it touches another
+  // empty point, an own group not in atari, or an opponent group in atari
+  // (which it captures).
+  BitBoard own_atari, opponent_atari;
+  own_atari.clear();
+  opponent_atari.clear();
+  for (int i = 1; i < board->_num_groups; ++i) {
+    const Group* g = &board->_groups[i];
+    if (g->liberties != 1)
+      continue;
+    BitBoard* atari = g->color == player ? &own_atari : &opponent_atari;
+    TRAVERSE(board, i, c) {
+      atari->set(c);
+    }
+    ENDTRAVERSE
+  }
+  const BitBoard empty = getStoneBits(board, S_EMPTY);
+  const BitBoard own_safe = board->_stone_bits[player - 1].andNot(own_atari);
+  *legal = empty &
+      (empty.neighbors() | own_safe.neighbors() | opponent_atari.neighbors());
+  if (board->_ko_age == 0 && board->_simple_ko_color == player &&
+      board->_simple_ko != M_PASS)
+    legal->reset(board->_simple_ko);
+}
+
+const BitBoard& getLegalBits(const Board* board) {
+  return board->_legal_bits;
 }
 
 bool isBitsEqual(const Board::Bits bits1, const Board::Bits bits2) {
@@ -104,6 +257,7 @@ void clearBoard(Board* board) {
   board->_num_groups = 1;
   // The initial ply number is 1.
   board->_ply = 1;
+  computeLegalBits(board, board->_next_player, &board->_legal_bits);
 }
 
 bool PlaceHandicap(Board* board, int x, int y, Stone player) {
@@ -128,15 +282,18 @@ bool PlaceHandicap(Board* board, int x, int y, Stone player) {
 void copyBoard(Board* dst, const Board* src) {
   assert(dst, "dst cannot be nullptr");
   assert(src, "src cannot be nullptr");
-  memcpy(dst, src, sizeof(Board));
+  memcpy(dst, src, usedBoardBytes(src));
 }
 
 bool compareBoard(const Board* b1, const Board* b2) {
-  // Compare them per byte.
+  // Compare them per byte, up to the live groups.
   unsigned char* p1 = (unsigned char*)b1;
   unsigned char* p2 = (unsigned char*)b2;
 
-  for (size_t i = 0; i < sizeof(Board); ++i) {
+  const size_t n = usedBoardBytes(b1);
+  if (n != usedBoardBytes(b2))
+    return false;
+  for (size_t i = 0; i < n; ++i) {
     if (p1[i] != p2[i])
       return false;
   }
@@ -473,6 +630,44 @@ Coord getSimpleKoLocation(const Board* board, Stone* player) {
   }
 }
 
+// Results of the expensive ladder search, per thread and direct-mapped. The
+// key is the stones' Zobrist hash mixed with the victim's move, so the ladder
+// read at one node is reused by the other search nodes reaching the same
+// position.
+#define LADDER_CACHE_SIZE 4096
+typedef struct {
+  uint64_t key;
+  int depth;
+} LadderCacheEntry;
+
+static thread_local LadderCacheEntry ladder_cache[LADDER_CACHE_SIZE];
+// Sharded by thread, so that the search threads do not share a cache line.
+static elf::metrics::Counter* const ladder_cache_lookups =
+    elf::metrics::Registry::global().counter(
+        "elf_go_ladder_cache_lookups_total",
+        "Ladder searches looked up in the ladder cache",
+        {{"board", std::to_string(BOARD_SIZE)}});
+static elf::metrics::Counter* const ladder_cache_hits =
+    elf::metrics::Registry::global().counter(
+        "elf_go_ladder_cache_hits_total",
+        "Ladder searches found in the ladder cache",
+        {{"board", std::to_string(BOARD_SIZE)}});
+
+static inline uint64_t ladder_cache_key(const Board* board, Coord c, Stone p) {
+  uint64_t key =
+      board->_hash ^ ((((uint64_t)c << 2) | p) * 0x9E3779B97F4A7C15ULL);
+  return key == 0 ? 1 : key;
+}
+
+void getLadderCacheStats(uint64_t* num_lookups, uint64_t* num_hits) {
+  *num_lookups = ladder_cache_lookups->value();
+  *num_hits = ladder_cache_hits->value();
+}
+
+void clearLadderCache() {
+  memset(ladder_cache, 0, sizeof(ladder_cache));
+}
+
 // Simple ladder check.
 // Return 0 if there is no ladder, otherwise return the depth of the ladder.
 int checkLadder(const Board* board, const GroupId4* ids, Stone player) {
@@ -508,7 +703,14 @@ int checkLadder(const Board* board, const GroupId4* ids, Stone player) {
     }
   }
   if (one_enemy_three && one_in_atari) {
-    // Then we do expensive check.
+    // Then we do expensive check, unless it has been done already.
+    const uint64_t key = ladder_cache_key(board, ids->c, player);
+    LadderCacheEntry* entry = &ladder_cache[key % LADDER_CACHE_SIZE];
+    ladder_cache_lookups->add();
+    if (entry->key == key) {
+      ladder_cache_hits->add();
+      return entry->depth;
+    }
     // printf("isLadder: Expensive check start...\n");
     Board b_next;
     copyBoard(&b_next, board);
@@ -518,7 +720,9 @@ int checkLadder(const Board* board, const GroupId4* ids, Stone player) {
     // Check whether it will lead to ladder.
     int num_call = 0;
     int depth = 1;
-    return checkLadderUseSearch(&b_next, player, &num_call, depth);
+    entry->key = key;
+    entry->depth = checkLadderUseSearch(&b_next, player, &num_call, depth);
+    return entry->depth;
   }
   return 0;
 }
@@ -752,33 +956,11 @@ MergeGroups(Board* board, unsigned short id1, unsigned short id2) {
 }
 
 bool RecomputeGroupLiberties(Board* board, unsigned short id) {
-  // Put all neighboring spaces into a set, and count the number.
-  // Borrowing _info.next for counting. No extra space needed.
+  // Neighbors of the group's stones that are empty, as one set.
   if (id == 0)
     return false;
-  short liberty = 0;
-  TRAVERSE(board, id, c){FOR4(c, _, c4){Info* info = &board->_infos[c4];
-  if (G_EMPTY(info->id) && info->next == 0) {
-    // printf("RecomputeGroupLiberties: liberties of Group %d at (%d, %d)",
-    // id, X(c4), Y(c4));
-    info->next = 1;
-    liberty++;
-  }
-}
-ENDFOR4
-}
-ENDTRAVERSE
-// Second traverse to set all .next to be zero.
-TRAVERSE(board, id, c){FOR4(c, _, c4){Info* info = &board->_infos[c4];
-if (G_EMPTY(info->id))
-  info->next = 0;
-}
-ENDFOR4
-}
-ENDTRAVERSE
-
-board->_groups[id].liberties = liberty;
-return true;
+  board->_groups[id].liberties = countGroupLiberties(board, id);
+  return true;
 }
 
 bool TryPlay2(const Board* board, Coord m, GroupId4* ids) {
@@ -947,22 +1129,18 @@ void FindAllCandidateMovesInRegion(
 }
 
 void FindAllValidMoves(const Board* board, Stone player, AllMoves* all_moves) {
-  GroupId4 ids;
-  Coord c;
+  BitBoard computed;
+  if (player != board->_next_player)
+    computeLegalBits(board, player, &computed);
+  const BitBoard& legal =
+      player == board->_next_player ? getLegalBits(board) : computed;
   all_moves->board = board;
   all_moves->num_moves = 0;
   for (int x = 0; x < BOARD_SIZE; ++x) {
     for (int y = 0; y < BOARD_SIZE; ++y) {
-      c = OFFSETXY(x, y);
-      if (!EMPTY(board->_infos[c].color))
-        continue;
-      StoneLibertyAnalysis(board, player, c, &ids);
-      if (isSimpleKoViolation(board, c, player))
-        continue;
-      if (isSuicideMove(&ids))
-        continue;
-
-      all_moves->moves[all_moves->num_moves++] = c;
+      Coord c = OFFSETXY(x, y);
+      if (legal.test(c))
+        all_moves->moves[all_moves->num_moves++] = c;
     }
   }
 }
@@ -984,22 +1162,14 @@ void FindAllValidMovesInRegion(
     bottom = r->bottom;
   }
 
-  GroupId4 ids;
-  Coord c;
+  const BitBoard& legal = getLegalBits(board);
   all_moves->board = board;
   all_moves->num_moves = 0;
   for (int x = left; x < right; ++x) {
     for (int y = top; y < bottom; ++y) {
-      c = OFFSETXY(x, y);
-      if (!EMPTY(board->_infos[c].color))
-        continue;
-      StoneLibertyAnalysis(board, board->_next_player, c, &ids);
-      if (isSimpleKoViolation(board, c, board->_next_player))
-        continue;
-      if (isSuicideMove(&ids))
-        continue;
-
-      all_moves->moves[all_moves->num_moves++] = c;
+      Coord c = OFFSETXY(x, y);
+      if (legal.test(c))
+        all_moves->moves[all_moves->num_moves++] = c;
     }
   }
 }
@@ -1220,6 +1390,24 @@ bool OneGroupLives(const Board* board, Stone player, const Region* r) {
   return false;
 }
 
+bool isScoreDecided(const Board* board) {
+  if (board->_num_groups <= 1)
+    return false;
+  for (int i = 1; i < board->_num_groups; ++i) {
+    if (!GivenGroupLives(board, i))
+      return false;
+  }
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Coord c = OFFSETXY(i, j);
+      if (board->_infos[c].color == S_EMPTY &&
+          getEyeColor(board, c) == S_EMPTY)
+        return false;
+    }
+  }
+  return true;
+}
+
 #define MOVE_HASH(c, player, ply) (((ply) << 24) + ((player) << 16) + (c))
 
 static inline void update_next_move(Board* board, Coord c, Stone player) {
@@ -1235,6 +1423,7 @@ static inline void update_next_move(Board* board, Coord c, Stone player) {
   // board->hash ^= fast_random64(&seed);
 
   board->_ply++;
+  computeLegalBits(board, board->_next_player, &board->_legal_bits);
 }
 
 static inline void update_undo(Board* board) {
@@ -1244,6 +1433,7 @@ static inline void update_undo(Board* board) {
   board->_last_move3 = board->_last_move4;
   board->_next_player = OPPONENT(board->_next_player);
   board->_ply--;
+  computeLegalBits(board, board->_next_player, &board->_legal_bits);
 
   // unsigned long seed = MOVE_HASH(c, board->_next_player, board->_ply);
   // board->hash ^= fast_random64(&seed);
@@ -1721,6 +1911,17 @@ void VerifyBoard(Board* board) {
       if (HAS_STONE(board->_infos[c].color)) {
         group_size[info->id]++;
       }
+      for (Stone s = S_BLACK; s <= S_WHITE; ++s) {
+        if (board->_stone_bits[s - 1].test(c) != (info->color == s)) {
+          printf(
+              "[VerifyError]: stone bits of color %d and stone [%d] mismatch "
+              "at (%d, %d)\n",
+              s,
+              info->color,
+              X(c),
+              Y(c));
+        }
+      }
     }
   }
 
@@ -1951,125 +2152,68 @@ float getFastScore(const Board* board, const int rule) {
   return cnScore;
 }
 
-float getTrompTaylorScore(
-    const Board* board,
-    const Stone* group_stats,
-    Stone* territory) {
-  Stone* internal_territory = nullptr;
-  if (territory == nullptr) {
-    internal_territory = new Stone[BOARD_SIZE * BOARD_SIZE];
-    territory = internal_territory;
+// Points reachable from stones through empty points, stones included.
+static BitBoard reach_through_empty(
+    const BitBoard& stones,
+    const BitBoard& empty) {
+  BitBoard reached = stones;
+  while (true) {
+    BitBoard next = reached | (reached.neighbors() & empty);
+    if (next == reached)
+      return reached;
+    reached = next;
   }
-  ::memset(territory, S_EMPTY, BOARD_SIZE * BOARD_SIZE * sizeof(Stone));
-
-  //
-  Coord queue[BOARD_SIZE * BOARD_SIZE];
-  int territories[4] = {0, 0, 0, 0};
+}
 
-  // Flood fill, starts with an empty location and expand.
-  // The output territory is 1 = BLACK, 2 = WHITE, and 3 = DAME
-  for (int i = 0; i < BOARD_SIZE; ++i) {
-    for (int j = 0; j < BOARD_SIZE; ++j) {
-      Coord c = OFFSETXY(i, j);
-      Stone s = board->_infos[c].color;
+// A point belongs to a color if it reaches only that color's stones.
+static int area_score(
+    const Board* board,
+    const BitBoard& black,
+    const BitBoard& white,
+    Stone* ownership) {
+  const BitBoard empty = getStoneBits(board, S_EMPTY);
+  const BitBoard black_area = reach_through_empty(black, empty);
+  const BitBoard white_area = reach_through_empty(white, empty);
+  const BitBoard black_only = black_area.andNot(white_area);
+  const BitBoard white_only = white_area.andNot(black_area);
+  if (ownership != nullptr) {
+    ::memset(ownership, S_DAME, BOARD_SIZE * BOARD_SIZE * sizeof(Stone));
+    black_only.forEach(
+        [&](Coord c) { ownership[EXPORT_OFFSET(c)] = S_BLACK; });
+    white_only.forEach(
+        [&](Coord c) { ownership[EXPORT_OFFSET(c)] = S_WHITE; });
+  }
+  return black_only.count() - white_only.count();
+}
 
-      // printf("Check %s ... \n", get_move_str(c, s));
-      // Skip any stone.
-      if (s != S_EMPTY) {
-        Stone* t = &territory[EXPORT_OFFSET(c)];
-        if (*t == S_EMPTY) {
-          // Get the true color of the stone
-          unsigned char id = board->_infos[c].id;
-          if (group_stats != nullptr && (group_stats[id] & S_DEAD))
-            s = OPPONENT(s);
-          *t = s;
-          territories[s]++;
-        }
-        continue;
-      }
+int getAreaScore(const Board* board, Stone* ownership) {
+  return area_score(
+      board, board->_stone_bits[0], board->_stone_bits[1], ownership);
+}
 
-      // It is visited.
-      if (territory[EXPORT_OFFSET_XY(i, j)] != S_EMPTY)
+float getTrompTaylorScore(
+    const Board* board,
+    const Stone* group_stats,
+    Stone* territory) {
+  // Dead stones count for the opponent.
+  BitBoard black = board->_stone_bits[0];
+  BitBoard white = board->_stone_bits[1];
+  if (group_stats != nullptr) {
+    for (int i = 1; i < board->_num_groups; ++i) {
+      if (!(group_stats[i] & S_DEAD))
         continue;
-
-      // Empty space and it is not visited.
-      // Do DFS
-      Stone owner = S_EMPTY;
-      int q_start = 0, q_end = 0;
-      queue[q_end++] = c;
-      territory[EXPORT_OFFSET(c)] = S_DAME;
-
-      // printf("Start DFS ...\n");
-      // fflush(stdout);
-      while (q_end - q_start > 0) {
-        Coord cc = queue[q_start++];
-
-        // printf("Visited %s..owner = %d\n", get_move_str(cc,
-        // board->_infos[cc].color), owner);
-        // fflush(stdout);
-
-        // Put its neighbor into the queue
-        FOR4(cc, _, ccc) {
-          Stone sss = board->_infos[ccc].color;
-          if (sss != S_EMPTY) {
-            if (sss != S_OFF_BOARD && owner != S_DAME) {
-              Stone* t = &territory[EXPORT_OFFSET(ccc)];
-              if (*t == S_EMPTY) {
-                // Get the true color of the stone
-                unsigned char id = board->_infos[ccc].id;
-                if (group_stats != nullptr && (group_stats[id] & S_DEAD))
-                  sss = OPPONENT(sss);
-                *t = sss;
-                territories[sss]++;
-              }
-
-              if (owner == S_EMPTY)
-                owner = *t;
-              else if (owner != *t)
-                owner = S_DAME;
-              // printf("sss = %d, owner = %d\n", *t, owner);
-              // fflush(stdout);
-            }
-          } else if (territory[EXPORT_OFFSET(ccc)] == S_EMPTY) {
-            // Make it visited with S_DAME
-            territory[EXPORT_OFFSET(ccc)] = S_DAME;
-            // Empty slot and empty territory, put them in.
-            queue[q_end++] = ccc;
-          }
-        }
-        ENDFOR4
-      }
-      // Finish BFS, then we go through the visited again and set them to owner
-      // (if owner is not S_DAME).
-      if (owner == S_EMPTY) {
-        // Empty board.
-        return 0.0;
-      }
-      if (owner != S_DAME) {
-        for (int i = 0; i < q_end; ++i) {
-          // printf("Deal with %s\n", get_move_str(queue[i], owner));
-          // fflush(stdout);
-          territory[EXPORT_OFFSET(queue[i])] = owner;
-          // Each empty spot only visited once.
-          territories[owner]++;
-        }
+      BitBoard dead;
+      getGroupBits(board, i, &dead);
+      if (board->_groups[i].color == S_BLACK) {
+        black = black.andNot(dead);
+        white = white | dead;
+      } else {
+        white = white.andNot(dead);
+        black = black | dead;
       }
-      // Check whether we have visited all board locations, if so, just break.
-      if (territories[S_BLACK] + territories[S_WHITE] ==
-          BOARD_SIZE * BOARD_SIZE)
-        break;
-      // fflush(stdout);
     }
   }
-
-  if (internal_territory)
-    delete[] internal_territory;
-
-  // Finally count the score.
-  float raw_score = territories[S_BLACK] - territories[S_WHITE];
-  // std::cout << "black: " << territories[S_BLACK] << ", white: " <<
-  // territories[S_WHITE] << ", score: " << raw_score << std::endl;
-  return raw_score;
+  return area_score(board, black, white, territory);
 }
 
 bool isGameEnd(const Board* board) {
@@ -2117,3 +2261,5 @@ void util_show_move(Coord m, Stone player, char* buf) {
       m,
       get_move_str(m, player, buf));
 }
+
+GO_BOARD_NAMESPACE_END
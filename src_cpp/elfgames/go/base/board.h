@@ -9,6 +9,8 @@
 #pragma once
 
 #include <memory.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "common.h"
 
@@ -26,12 +28,18 @@
   ((((i) == 2 || (i) == 6) && ((j) == 2 || (j) == 6)) || (i == 4 && j == 4))
 #define BOARD9_PROMPT "A B C D E F G H J"
 
-#ifdef BOARD9x9
+#if defined(BOARD9x9)
 
 #define STAR_ON STAR_ON9
 #define BOARD_PROMPT BOARD9_PROMPT
 #define __MACRO_BOARD_SIZE 9
 
+#elif defined(BOARD13x13)
+
+#define STAR_ON STAR_ON13
+#define BOARD_PROMPT BOARD13_PROMPT
+#define __MACRO_BOARD_SIZE 13
+
 #else
 
 #define STAR_ON STAR_ON19
@@ -47,6 +55,19 @@ constexpr int NUM_INTERSECTION = BOARD_SIZE * BOARD_SIZE;
 
 #include "hash_num.h"
 
+// Everything that depends on the board size lives in an inline namespace
+// named after it (board9, board13, board19), so the board libraries of
+// several sizes can be linked into one binary. Code of one translation unit
+// still sees a single size and uses the unqualified names; there is no
+// dispatch on the size at run time.
+#define ELF_GO_BOARD_NS_CAT(n) board##n
+#define ELF_GO_BOARD_NS(n) ELF_GO_BOARD_NS_CAT(n)
+#define GO_BOARD_NAMESPACE_BEGIN \
+  inline namespace ELF_GO_BOARD_NS(__MACRO_BOARD_SIZE) {
+#define GO_BOARD_NAMESPACE_END }
+
+GO_BOARD_NAMESPACE_BEGIN
+
 typedef unsigned char Status;
 typedef unsigned char ShowChoice;
 #define SHOW_NONE 0
@@ -97,6 +118,107 @@ Next step
 // Maximum possible value of coords.
 constexpr int BOUND_COORD = BOARD_EXPAND_SIZE * BOARD_EXPAND_SIZE;
 
+// Set of points, one bit per coord. Shifting by 1 moves every point to its
+// right neighbor, shifting by BOARD_EXPAND_SIZE to the one below; the border
+// keeps the rows apart, so neighbors() of on-board points never wraps onto
+// other on-board points.
+struct BitBoard {
+  static constexpr int kNumWords = (BOUND_COORD + 63) / 64;
+  uint64_t words[kNumWords];
+
+  void clear() {
+    memset(words, 0, sizeof(words));
+  }
+
+  bool test(Coord c) const {
+    return (words[c >> 6] >> (c & 63)) & 1;
+  }
+
+  void set(Coord c) {
+    words[c >> 6] |= (uint64_t)1 << (c & 63);
+  }
+
+  void reset(Coord c) {
+    words[c >> 6] &= ~((uint64_t)1 << (c & 63));
+  }
+
+  bool empty() const {
+    uint64_t v = 0;
+    for (int i = 0; i < kNumWords; ++i)
+      v |= words[i];
+    return v == 0;
+  }
+
+  int count() const {
+    int n = 0;
+    for (int i = 0; i < kNumWords; ++i)
+      n += __builtin_popcountll(words[i]);
+    return n;
+  }
+
+  BitBoard operator|(const BitBoard& b) const {
+    BitBoard r;
+    for (int i = 0; i < kNumWords; ++i)
+      r.words[i] = words[i] | b.words[i];
+    return r;
+  }
+
+  BitBoard operator&(const BitBoard& b) const {
+    BitBoard r;
+    for (int i = 0; i < kNumWords; ++i)
+      r.words[i] = words[i] & b.words[i];
+    return r;
+  }
+
+  // this & ~b
+  BitBoard andNot(const BitBoard& b) const {
+    BitBoard r;
+    for (int i = 0; i < kNumWords; ++i)
+      r.words[i] = words[i] & ~b.words[i];
+    return r;
+  }
+
+  bool operator==(const BitBoard& b) const {
+    for (int i = 0; i < kNumWords; ++i)
+      if (words[i] != b.words[i])
+        return false;
+    return true;
+  }
+
+  // Point c goes to c + k (0 < k < 64).
+  BitBoard shiftUp(int k) const {
+    BitBoard r;
+    r.words[0] = words[0] << k;
+    for (int i = 1; i < kNumWords; ++i)
+      r.words[i] = (words[i] << k) | (words[i - 1] >> (64 - k));
+    return r;
+  }
+
+  // Point c goes to c - k (0 < k < 64).
+  BitBoard shiftDown(int k) const {
+    BitBoard r;
+    for (int i = 0; i < kNumWords - 1; ++i)
+      r.words[i] = (words[i] >> k) | (words[i + 1] << (64 - k));
+    r.words[kNumWords - 1] = words[kNumWords - 1] >> k;
+    return r;
+  }
+
+  // 4-neighbors of all points (may include border points).
+  BitBoard neighbors() const {
+    return shiftUp(1) | shiftDown(1) | shiftUp(BOARD_EXPAND_SIZE) |
+        shiftDown(BOARD_EXPAND_SIZE);
+  }
+
+  // Call f(c) for every point, in increasing coord order.
+  template <typename F>
+  void forEach(F f) const {
+    for (int i = 0; i < kNumWords; ++i) {
+      for (uint64_t w = words[i]; w != 0; w &= w - 1)
+        f((Coord)((i << 6) + __builtin_ctzll(w)));
+    }
+  }
+};
+
 // Board
 typedef struct {
   // Board
@@ -105,9 +227,17 @@ typedef struct {
   typedef unsigned char Bits[BOARD_EXPAND_SIZE * BOARD_EXPAND_SIZE / 4 + 1];
   Bits _bits;
   uint64_t _hash;
+  // Zobrist hash of the board under each symmetry (D4 code, as in
+  // BoardFeature): _sym_hash[code] is the _hash of the board moved by
+  // getSymmetricCoord(., code). _sym_hash[0] == _hash.
+  uint64_t _sym_hash[8];
+
+  // Stones of each color (index S_BLACK - 1 and S_WHITE - 1), kept in sync
+  // with _infos by every stone placement and removal.
+  BitBoard _stone_bits[2];
+  // Legal moves of _next_player (pass excluded), refreshed after every move.
+  BitBoard _legal_bits;
 
-  // Group info
-  Group _groups[MAX_GROUP];
   // Number of groups, including group 0 (empty intersection). So for empty
   // board, _num_groups == 1.
   short _num_groups;
@@ -154,8 +284,17 @@ typedef struct {
   // uint64_t hash for the current board situatons. If we want to enable it,
   // then make MAX_GROUP smaller.
   // uint64_t hash;
+
+  // Group info. Kept last: only the first _num_groups entries are in use, and
+  // copyBoard() / compareBoard() skip the rest.
+  Group _groups[MAX_GROUP];
 } Board;
 
+// Bytes of b that are in use: everything up to the live groups.
+inline size_t usedBoardBytes(const Board* b) {
+  return offsetof(Board, _groups) + b->_num_groups * sizeof(Group);
+}
+
 // Save all candidate moves.
 typedef struct {
   const Board* board;
@@ -286,6 +425,16 @@ extern inline Coord getCoord(int x, int y) {
   return OFFSETXY(x, y);
 }
 
+// The point c moves to under the symmetry of D4 code (as in BoardFeature);
+// M_PASS stays.
+Coord getSymmetricCoord(Coord c, int code);
+// The smallest hash of the symmetries of the board, the same for all the
+// boards equal up to symmetry, and in code (if not null) the D4 code of
+// the symmetry that has it (the lowest, if several do): the board moved by
+// getSymmetricCoord(., *code) is the canonical board, e.g. a policy stored
+// for it gives the policy of this board at getSymmetricCoord(c, *code).
+uint64_t getCanonicalHash(const Board* board, int* code = nullptr);
+
 void clearBoard(Board* board);
 void copyBoard(Board* dst, const Board* src);
 bool compareBoard(const Board* b1, const Board* b2);
@@ -365,6 +514,9 @@ unsigned char BoardIdOld2New(const Board* board, unsigned char id);
 // Check at least one group of player lives within the region.
 // If region == NULL, then search the entire board.
 bool OneGroupLives(const Board* board, Stone player, const Region* region);
+// Whether every group lives with two true eyes and every empty point is an
+// eye, so that the area score (see getFastScore()) can no longer change.
+bool isScoreDecided(const Board* board);
 
 // Some function to check whether a move is valid.
 // If num_stones != NULL, then num_stones will be assigned to the number of
@@ -390,6 +542,10 @@ bool find_two_liberties(const Board* b, short id, Coord m[2]);
 // Ladder check.
 // Return 0 if no ladder. Otherwise return the depth of ladder.
 int checkLadder(const Board* board, const GroupId4* ids, Stone player);
+// Lookups and hits of the ladder search cache, over all threads.
+void getLadderCacheStats(uint64_t* num_lookups, uint64_t* num_hits);
+// Empties the ladder search cache of the calling thread.
+void clearLadderCache();
 // Whether the move will lead to a simple ko.
 bool isMoveGivingSimpleKo(
     const Board* board,
@@ -410,9 +566,26 @@ bool isTrueEye(const Board* board, Coord c, Stone player);
 bool isTrueEyeXY(const Board* board, int x, int y, Stone player);
 Stone getEyeColor(const Board* board, Coord c);
 
+// All on-board points.
+const BitBoard& getOnBoardBits();
+// Stones of player, or the empty points if player == S_EMPTY.
+BitBoard getStoneBits(const Board* board, Stone player);
+// Stones of group id.
+void getGroupBits(const Board* board, short id, BitBoard* bits);
+// Number of distinct empty points next to group id.
+int countGroupLiberties(const Board* board, short id);
+// Points where player may place a stone (no suicide, no simple ko).
+void computeLegalBits(const Board* board, Stone player, BitBoard* legal);
+// computeLegalBits() of the player to move, kept up to date by Play.
+const BitBoard& getLegalBits(const Board* board);
+
 bool isBitsEqual(const Board::Bits bits1, const Board::Bits bits2);
 void copyBits(Board::Bits bits_dst, const Board::Bits bits_src);
 
+inline Stone getBitsColor(const Board::Bits bits, Coord c) {
+  return (Stone)((bits[c >> 2] >> ((c & 3) << 1)) & 3);
+}
+
 typedef int GoRule;
 #define RULE_CHINESE 0
 #define RULE_JAPANESE 1
@@ -443,6 +616,12 @@ float getTrompTaylorScore(
     const Board* board,
     const Stone* group_stats,
     Stone* territory);
+// Area score (black - white, no komi) with all stones alive: a point counts
+// for a color if it is a stone of that color or an empty point from which
+// only stones of that color can be reached. Computed by dilating the stone
+// bitboards through the empty points. If ownership is not NULL, it receives
+// S_BLACK/S_WHITE/S_DAME for every point, indexed by EXPORT_OFFSET.
+int getAreaScore(const Board* board, Stone* ownership);
 
 // Get features.
 bool getLibertyMap(const Board* board, Stone player, float* data);
@@ -456,3 +635,5 @@ bool getDistanceMap(const Board* board, Stone player, float* data);
 // Some utility functions.
 char* get_move_str(Coord m, Stone player, char* buf);
 void util_show_move(Coord m, Stone player, char* buf);
+
+GO_BOARD_NAMESPACE_END
@@ -0,0 +1,241 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Time per call of the board hot paths (Play, GoState::forward, copyBoard,
+// FindAllValidMoves, checkLadder with and without its cache,
+// BoardFeature::extractAGZ and scoring), replaying a fixed corpus of games.
+// The corpus is the SGF files given on the command line (games of another
+// board size or with handicap are skipped), or --games random games from a
+// fixed seed if there is none.
+//
+// Usage: benchmark_cpp_elfgames_go[19]_base_board_benchmark [--games=20]
+//   [--passes=100] [file.sgf ...]
+//
+// Output is CSV, one line per operation:
+//   board_size,op,calls,ns_per_call,checksum
+// The checksum only keeps the calls from being optimized away, but it also
+// changes when an operation starts returning something else.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "elfgames/go/base/board.h"
+#include "elfgames/go/base/board_feature.h"
+#include "elfgames/go/base/go_state.h"
+#include "elfgames/go/sgf/sgf.h"
+
+namespace {
+
+using Game = std::vector<Coord>;
+
+// Moves of the main variation, cut at the first illegal one.
+bool loadSgfGame(const std::string& filename, Game* game) {
+  Sgf sgf;
+  if (!sgf.load(filename) || sgf.getBoardSize() != BOARD_SIZE ||
+      sgf.getHandicapStones() > 0) {
+    return false;
+  }
+  Board b;
+  clearBoard(&b);
+  for (auto iter = sgf.begin(); !iter.done(); ++iter) {
+    SgfMove m = iter.getCurrMove();
+    GroupId4 ids;
+    if (m.player != b._next_player || !TryPlay2(&b, m.move, &ids)) {
+      break;
+    }
+    Play(&b, &ids);
+    game->push_back(m.move);
+  }
+  return !game->empty();
+}
+
+Game randomGame(std::mt19937* rng) {
+  Game game;
+  Board b;
+  clearBoard(&b);
+  for (int ply = 0; ply < 2 * BOARD_SIZE * BOARD_SIZE; ++ply) {
+    AllMoves moves;
+    FindAllValidMoves(&b, b._next_player, &moves);
+    if (moves.num_moves == 0)
+      break;
+    GroupId4 ids;
+    Coord c = moves.moves[(*rng)() % moves.num_moves];
+    TryPlay2(&b, c, &ids);
+    Play(&b, &ids);
+    game.push_back(c);
+  }
+  return game;
+}
+
+struct Corpus {
+  std::vector<Game> games;
+  // Boards (and states, sharing the history) after every move.
+  std::vector<Board> boards;
+  std::vector<GoState> states;
+  // Moves of the next player that checkLadder() does not reject at once.
+  std::vector<std::pair<size_t, GroupId4>> ladder_moves;
+  size_t num_moves = 0;
+
+  void add(const Game& game) {
+    games.push_back(game);
+    GoState s;
+    for (Coord c : game) {
+      s.forward(c);
+      boards.push_back(s.board());
+      states.push_back(s);
+    }
+    num_moves += game.size();
+  }
+
+  void findLadderMoves() {
+    for (size_t i = 0; i < boards.size(); ++i) {
+      const Board& b = boards[i];
+      AllMoves moves;
+      FindAllValidMoves(&b, b._next_player, &moves);
+      for (int j = 0; j < moves.num_moves; ++j) {
+        GroupId4 ids;
+        if (TryPlay2(&b, moves.moves[j], &ids) && ids.liberty == 2) {
+          ladder_moves.emplace_back(i, ids);
+        }
+      }
+    }
+  }
+};
+
+// Calls f(i) for i in [0, n) passes times; f returns a checksum term.
+template <typename F>
+void run(const std::string& op, size_t n, int passes, F f) {
+  int64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (size_t i = 0; i < n; ++i) {
+      checksum += f(i);
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const uint64_t calls = static_cast<uint64_t>(n) * passes;
+  std::cout << BOARD_SIZE << "," << op << "," << calls << ","
+            << (calls > 0 ? elapsed.count() * 1e9 / calls : 0.0) << ","
+            << checksum << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int num_games = 20;
+  int passes = 100;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--games=", 8) == 0) {
+      num_games = atoi(argv[i] + 8);
+    } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+      passes = atoi(argv[i] + 9);
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+
+  Corpus corpus;
+  for (const std::string& f : files) {
+    Game game;
+    if (loadSgfGame(f, &game)) {
+      corpus.add(game);
+    } else {
+      std::cerr << "Skipped " << f << std::endl;
+    }
+  }
+  if (files.empty()) {
+    std::mt19937 rng(0);
+    for (int i = 0; i < num_games; ++i) {
+      corpus.add(randomGame(&rng));
+    }
+  }
+  if (corpus.boards.empty()) {
+    std::cerr << "Empty corpus" << std::endl;
+    return 1;
+  }
+  corpus.findLadderMoves();
+
+  std::cerr << corpus.games.size() << " games, " << corpus.num_moves
+            << " moves, " << corpus.ladder_moves.size()
+            << " ladder candidates, sizeof(Board): " << sizeof(Board)
+            << std::endl;
+  std::cout << "board_size,op,calls,ns_per_call,checksum" << std::endl;
+
+  Board b;
+  run("Play", corpus.games.size(), passes, [&](size_t i) {
+    clearBoard(&b);
+    for (Coord c : corpus.games[i]) {
+      GroupId4 ids;
+      TryPlay2(&b, c, &ids);
+      Play(&b, &ids);
+    }
+    return b._num_groups;
+  });
+  run("GoState::forward", corpus.games.size(), passes, [&](size_t i) {
+    GoState s;
+    for (Coord c : corpus.games[i]) {
+      s.forward(c);
+    }
+    return s.getPly();
+  });
+  run("copyBoard", corpus.boards.size(), passes, [&](size_t i) {
+    copyBoard(&b, &corpus.boards[i]);
+    return b._num_groups;
+  });
+  run("memcpy(sizeof(Board))", corpus.boards.size(), passes, [&](size_t i) {
+    memcpy(&b, &corpus.boards[i], sizeof(Board));
+    return b._num_groups;
+  });
+  run("FindAllValidMoves", corpus.boards.size(), passes, [&](size_t i) {
+    const Board& p = corpus.boards[i];
+    AllMoves moves;
+    FindAllValidMoves(&p, p._next_player, &moves);
+    return moves.num_moves;
+  });
+  auto check_ladder = [&](size_t i) {
+    const auto& m = corpus.ladder_moves[i];
+    const Board& p = corpus.boards[m.first];
+    return checkLadder(&p, &m.second, p._next_player);
+  };
+  // Each pass from an empty ladder cache, then from the cache the previous
+  // pass filled (see getLadderCacheStats()).
+  run("checkLadder", corpus.ladder_moves.size(), passes, [&](size_t i) {
+    if (i == 0) {
+      clearLadderCache();
+    }
+    return check_ladder(i);
+  });
+  run("checkLadder (cached)",
+      corpus.ladder_moves.size(),
+      passes,
+      check_ladder);
+  std::vector<float> features(MAX_NUM_AGZ_FEATURE * BOARD_SIZE * BOARD_SIZE);
+  run("extractAGZ", corpus.states.size(), passes, [&](size_t i) {
+    BoardFeature(corpus.states[i]).extractAGZ(features.data());
+    return features[i % features.size()] != 0;
+  });
+  Stone ownership[BOARD_SIZE * BOARD_SIZE];
+  run("getAreaScore", corpus.boards.size(), passes, [&](size_t i) {
+    return getAreaScore(&corpus.boards[i], ownership);
+  });
+  run("getTrompTaylorScore", corpus.boards.size(), passes, [&](size_t i) {
+    return getTrompTaylorScore(&corpus.boards[i], nullptr, nullptr);
+  });
+  return 0;
+}
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "board.h"
+#include "board_feature.h"
+#include "go_state.h"
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// Reaches positions of recorded games (e.g., to sample training positions)
+// without replaying them from the start each time. The boards of a game are
+// kept every interval moves the first time it is replayed, so that a later
+// position of it is reached by at most interval - 1 moves on a bare board,
+// then the MAX_NUM_AGZ_HISTORY last moves played on the GoState, which the
+// history features need.
+//
+// Thread safe, and shared by the threads sampling positions. Games are keyed
+// by a hash of their moves; those least recently used are dropped beyond
+// capacity bytes of boards.
+class BoardCheckpoints {
+ public:
+  BoardCheckpoints(int interval, size_t capacity)
+      : interval_(std::max(interval, 1)),
+        shard_capacity_(capacity / kNumShards) {}
+
+  // Sets s to the position before move move_to of moves, as replaying them
+  // from the empty board would.
+  void reach(const std::vector<Coord>& moves, size_t move_to, GoState* s) {
+    const size_t history = MAX_NUM_AGZ_HISTORY;
+    if (move_to < history + interval_) {
+      s->reset();
+      for (size_t i = 0; i < move_to; ++i) {
+        s->forward(moves[i]);
+      }
+      return;
+    }
+
+    const size_t bare_to = move_to - history;
+    const uint64_t key = hashMoves(moves);
+    Shard& shard = shards_[key % kNumShards];
+    const EntryP entry = shard.get(key);
+    const size_t k = std::min(
+        bare_to / interval_, entry == nullptr ? 0 : entry->boards.size());
+    (k > 0 ? num_hits_ : num_misses_)++;
+
+    Board b;
+    if (k > 0) {
+      const std::string& snapshot = entry->boards[k - 1];
+      memcpy((void*)&b, snapshot.data(), snapshot.size());
+    } else {
+      clearBoard(&b);
+    }
+    std::vector<std::string> more;
+    for (size_t i = k * interval_; i < bare_to; ++i) {
+      play(&b, moves[i]);
+      if ((i + 1) % interval_ == 0) {
+        more.emplace_back((const char*)&b, usedBoardBytes(&b));
+      }
+    }
+    if (!more.empty()) {
+      shard.extend(key, k, std::move(more), shard_capacity_);
+    }
+
+    s->resetTo(b);
+    for (size_t i = bare_to; i < move_to; ++i) {
+      s->forward(moves[i]);
+    }
+  }
+
+  std::string info() const {
+    size_t num_games = 0, bytes = 0;
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      num_games += shard.entries.size();
+      bytes += shard.bytes;
+    }
+    std::stringstream ss;
+    ss << "BoardCheckpoints: interval: " << interval_
+       << ", #games: " << num_games << ", bytes: " << bytes
+       << ", #hits: " << num_hits_.load()
+       << ", #misses: " << num_misses_.load();
+    return ss.str();
+  }
+
+ private:
+  static constexpr size_t kNumShards = 16;
+
+  // Boards after interval, 2 * interval, ... moves, as the used bytes of
+  // Board (see copyBoard()).
+  struct Entry {
+    std::vector<std::string> boards;
+    size_t bytes = 0;
+  };
+  using EntryP = std::shared_ptr<const Entry>;
+
+  struct Shard {
+    using Lru = std::list<uint64_t>;
+
+    mutable std::mutex mutex;
+    // Most recently used first.
+    Lru lru;
+    std::unordered_map<uint64_t, std::pair<EntryP, Lru::iterator>> entries;
+    size_t bytes = 0;
+
+    EntryP get(uint64_t key) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it == entries.end()) {
+        return nullptr;
+      }
+      lru.splice(lru.begin(), lru, it->second.second);
+      return it->second.first;
+    }
+
+    // Adds the boards from the k-th on, unless another thread did it first.
+    void extend(
+        uint64_t key,
+        size_t k,
+        std::vector<std::string>&& more,
+        size_t capacity) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      const Entry* curr =
+          it == entries.end() ? nullptr : it->second.first.get();
+      const size_t n = curr == nullptr ? 0 : curr->boards.size();
+      if (n < k || n >= k + more.size()) {
+        return;
+      }
+      auto entry = std::make_shared<Entry>();
+      if (curr != nullptr) {
+        *entry = *curr;
+      }
+      for (size_t i = n - k; i < more.size(); ++i) {
+        entry->bytes += more[i].size();
+        entry->boards.push_back(std::move(more[i]));
+      }
+      bytes += entry->bytes;
+      if (curr != nullptr) {
+        bytes -= curr->bytes;
+        it->second.first = std::move(entry);
+        lru.splice(lru.begin(), lru, it->second.second);
+      } else {
+        lru.push_front(key);
+        entries[key] = std::make_pair(std::move(entry), lru.begin());
+      }
+      while (bytes > capacity && lru.size() > 1) {
+        auto last = entries.find(lru.back());
+        bytes -= last->second.first->bytes;
+        entries.erase(last);
+        lru.pop_back();
+      }
+    }
+  };
+
+  const size_t interval_;
+  const size_t shard_capacity_;
+  Shard shards_[kNumShards];
+  std::atomic<uint64_t> num_hits_{0};
+  std::atomic<uint64_t> num_misses_{0};
+
+  static uint64_t hashMoves(const std::vector<Coord>& moves) {
+    // FNV-1a.
+    uint64_t h = 14695981039346656037ULL;
+    for (Coord c : moves) {
+      h = (h ^ c) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  // As GoState::forward(), but without the history: superko is not checked,
+  // which recorded games do not need.
+  static void play(Board* b, Coord c) {
+    if (c == M_INVALID) {
+      throw std::range_error("BoardCheckpoints: move is M_INVALID");
+    }
+    if ((b->_last_move == M_PASS && b->_last_move2 == M_PASS) ||
+        b->_ply >= BOARD_MAX_MOVE) {
+      return;
+    }
+    GroupId4 ids;
+    if (TryPlay2(b, c, &ids)) {
+      Play(b, &ids);
+    }
+  }
+};
+
+GO_BOARD_NAMESPACE_END
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "elfgames/go/base/board_checkpoints.h"
+
+namespace {
+
+// A game of random legal moves, ended by two passes.
+std::vector<Coord> randomGame(std::mt19937* rng) {
+  GoState s;
+  std::vector<Coord> moves;
+  while (!s.terminated() && moves.size() < 150) {
+    std::vector<Coord> legal;
+    getLegalBits(&s.board()).forEach([&](Coord c) { legal.push_back(c); });
+    const Coord c = legal.empty() || (*rng)() % 20 == 0
+        ? M_PASS
+        : legal[(*rng)() % legal.size()];
+    if (s.forward(c)) {
+      moves.push_back(c);
+    }
+  }
+  return moves;
+}
+
+void expectSame(const GoState& s1, const GoState& s2) {
+  EXPECT_EQ(s1.getPly(), s2.getPly());
+  EXPECT_EQ(s1.getNumMoves(), s2.getNumMoves());
+  EXPECT_EQ(s1.getHashCode(), s2.getHashCode());
+  EXPECT_EQ(s1.nextPlayer(), s2.nextPlayer());
+  EXPECT_EQ(s1.lastMove(), s2.lastMove());
+  EXPECT_EQ(s1.terminated(), s2.terminated());
+  std::vector<uint64_t> h1, h2;
+  s1.forEachRecentPosition([&](const GoPosition& p) { h1.push_back(p.hash); });
+  s2.forEachRecentPosition([&](const GoPosition& p) { h2.push_back(p.hash); });
+  EXPECT_EQ(h1, h2);
+
+  std::vector<float> f1, f2;
+  BoardFeature(s1).extractAGZ(&f1);
+  BoardFeature(s2).extractAGZ(&f2);
+  EXPECT_EQ(f1, f2);
+}
+
+} // namespace
+
+TEST(BoardCheckpointsTest, ReachesSamePositionsAsReplay) {
+  std::mt19937 rng(7);
+  std::vector<std::vector<Coord>> games;
+  for (int i = 0; i < 8; ++i) {
+    games.push_back(randomGame(&rng));
+  }
+  // Small enough to drop some games.
+  BoardCheckpoints checkpoints(10, 16 * 3 * sizeof(Board));
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+      std::mt19937 r(t);
+      GoState s;
+      for (int i = 0; i < 200; ++i) {
+        const auto& moves = games[r() % games.size()];
+        const size_t move_to = r() % moves.size();
+        checkpoints.reach(moves, move_to, &s);
+
+        GoState expected;
+        for (size_t k = 0; k < move_to; ++k) {
+          expected.forward(moves[k]);
+        }
+        expectSame(s, expected);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // Some positions came from checkpoints.
+  EXPECT_EQ(checkpoints.info().find("#hits: 0,"), std::string::npos);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+
+  return RUN_ALL_TESTS();
+}
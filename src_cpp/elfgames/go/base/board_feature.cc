@@ -12,7 +12,85 @@
 #include <utility>
 #include "go_state.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #define S_ISA(c1, c2) ((c2 == S_EMPTY) || (c1 == c2))
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// BoardFeature::Transform() of (x, y) under a D4 code, as an export offset.
+static constexpr int d4_offset(int code, int x, int y) {
+  const int rot = code % 4;
+  int tx = x, ty = y;
+  if (rot == BoardFeature::CCW90) {
+    tx = y;
+    ty = BOARD_SIZE - x - 1;
+  } else if (rot == BoardFeature::CCW180) {
+    tx = BOARD_SIZE - x - 1;
+    ty = BOARD_SIZE - y - 1;
+  } else if (rot == BoardFeature::CCW270) {
+    tx = BOARD_SIZE - y - 1;
+    ty = x;
+  }
+  return (code >> 2) == 1 ? EXPORT_OFFSET_XY(ty, tx) : EXPORT_OFFSET_XY(tx, ty);
+}
+
+static constexpr BoardFeature::D4Table make_d4_table() {
+  BoardFeature::D4Table table{};
+  for (int code = 0; code < 8; ++code) {
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        const int offset = d4_offset(code, x, y);
+        table.forward[code][OFFSETXY(x, y)] = offset;
+        table.inverse[code][offset] = OFFSETXY(x, y);
+        table.gather[code][offset] = EXPORT_OFFSET_XY(x, y);
+        table.scatter[code][EXPORT_OFFSET_XY(x, y)] = offset;
+      }
+    }
+  }
+  return table;
+}
+
+static constexpr BoardFeature::D4Table kD4Table = make_d4_table();
+
+const BoardFeature::D4Table& BoardFeature::d4Table() {
+  return kD4Table;
+}
+
+// out[j] = in[index[j]] for j < n.
+static void gather_floats(
+    const float* in,
+    const int* index,
+    int n,
+    float* out) {
+  int j = 0;
+#ifdef __AVX2__
+  for (; j + 8 <= n; j += 8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i*)(index + j));
+    _mm256_storeu_ps(out + j, _mm256_i32gather_ps(in, idx, 4));
+  }
+#endif
+  for (; j < n; ++j) {
+    out[j] = in[index[j]];
+  }
+}
+
+void BoardFeature::transformPlanes(const float* in, float* out, int num_planes)
+    const {
+  const int* gather = d4Table().gather[getD4Code()];
+  for (int i = 0; i < num_planes; ++i) {
+    gather_floats(
+        in + i * kBoardRegion, gather, kBoardRegion, out + i * kBoardRegion);
+  }
+}
+
+void BoardFeature::invTransformPolicy(const float* pi, float* out) const {
+  gather_floats(pi, d4Table().scatter[getD4Code()], kBoardRegion, out);
+  out[BOARD_ACTION_PASS] = pi[BOARD_ACTION_PASS];
+}
+
 // For feature extraction.
 // Distance transform
 static void DistanceTransform(float* arr) {
@@ -118,13 +196,9 @@ bool BoardFeature::getStones(Stone player, float* data) const {
   const Board* _board = &s_.board();
   //
   memset(data, 0, kBoardRegion * sizeof(float));
-  for (int i = 0; i < BOARD_SIZE; ++i) {
-    for (int j = 0; j < BOARD_SIZE; ++j) {
-      Coord c = OFFSETXY(i, j);
-      if (_board->_infos[c].color == player)
-        data[transform(i, j)] = 1;
-    }
-  }
+  getStoneBits(_board, player).forEach([&](Coord c) {
+    data[transform(c)] = 1;
+  });
   return true;
 }
 
@@ -187,6 +261,49 @@ bool BoardFeature::getDistanceMap(Stone player, float* data) const {
   return true;
 }
 
+// Unpacks one GoPosition plane; gather is nullptr for the identity.
+static void unpack_plane(const uint64_t* bits, const int* gather, float* out) {
+  const int n = BOARD_SIZE * BOARD_SIZE;
+  if (gather == nullptr) {
+    for (int j = 0; j < n; ++j) {
+      out[j] = (bits[j >> 6] >> (j & 63)) & 1;
+    }
+  } else {
+    for (int j = 0; j < n; ++j) {
+      const int k = gather[j];
+      out[j] = (bits[k >> 6] >> (k & 63)) & 1;
+    }
+  }
+}
+
+// Same as unpack_plane(), one byte per cell.
+static void unpack_plane(const uint64_t* bits, const int* gather, uint8_t* out) {
+  const int n = BOARD_SIZE * BOARD_SIZE;
+  for (int j = 0; j < n; ++j) {
+    const int k = gather == nullptr ? j : gather[j];
+    out[j] = (bits[k >> 6] >> (k & 63)) & 1;
+  }
+}
+
+// Repacks one GoPosition plane into BoardFeature::kPackedPlaneBytes bytes.
+static void repack_plane(const uint64_t* bits, const int* gather, uint8_t* out) {
+  const int n = BOARD_SIZE * BOARD_SIZE;
+  std::fill(out, out + BoardFeature::kPackedPlaneBytes, 0);
+  for (int j = 0; j < n; ++j) {
+    const int k = gather == nullptr ? j : gather[j];
+    out[j >> 3] |= ((bits[k >> 6] >> (k & 63)) & 1) << (j & 7);
+  }
+}
+
+// Bit-packed plane of all ones (or all zeros).
+static void fill_packed_plane(bool on, uint8_t* out) {
+  const int n = BOARD_SIZE * BOARD_SIZE;
+  std::fill(out, out + BoardFeature::kPackedPlaneBytes, on ? 0xff : 0);
+  if (on && (n & 7) != 0) {
+    out[BoardFeature::kPackedPlaneBytes - 1] = (1 << (n & 7)) - 1;
+  }
+}
+
 static float* board_plane(float* features, int idx) {
   return features + idx * BOARD_SIZE * BOARD_SIZE;
 }
@@ -245,42 +362,79 @@ void BoardFeature::extractAGZ(std::vector<float>* features) const {
 // Of size 18 * N * N
 // store in float* features
 void BoardFeature::extractAGZ(float* features) const {
-  std::fill(features, features + MAX_NUM_AGZ_FEATURE * kBoardRegion, 0.0);
-
   const Board* _board = &s_.board();
-  // get history of type std::deque<BoardHistory>
-  // and BoardHistory is a struct with members:
-  // std::vector<Coord> black;
-  // std::vector<Coord> white;
-  const auto& history = s_.getHistory();
-
   Stone player = _board->_next_player;
+  const int code = getD4Code();
+  const int* gather = code == 0 ? nullptr : d4Table().gather[code];
 
-  assert(history.size() <= MAX_NUM_AGZ_HISTORY);
-
-  // Save the current board state to game state.
+  // Positions after the most recent moves, newest first. Their planes are
+  // packed once per move and shared along the game, so a state only unpacks
+  // them, in output order through the symmetry: every element is written
+  // once and the stores are sequential.
   int i = 0;
-  for (auto it = history.rbegin(); it != history.rend(); ++it) {
-    const std::vector<Coord>* myself = &it->black;
-    const std::vector<Coord>* opponent = &it->white;
-    if (player == S_WHITE)
-      std::swap(myself, opponent);
+  s_.forEachRecentPosition([&](const GoPosition& p) {
+    unpack_plane(p.planes[player - 1], gather, LAYER(i));
+    unpack_plane(p.planes[OPPONENT(player) - 1], gather, LAYER(i + 1));
+    i += 2;
+  });
+  std::fill(LAYER(i), LAYER(2 * MAX_NUM_AGZ_HISTORY), 0.0);
+
+  float* black_indicator = LAYER(2 * MAX_NUM_AGZ_HISTORY);
+  float* white_indicator = LAYER(2 * MAX_NUM_AGZ_HISTORY + 1);
+  std::fill(
+      black_indicator,
+      black_indicator + kBoardRegion,
+      player == S_BLACK ? 1.0 : 0.0);
+  std::fill(
+      white_indicator,
+      white_indicator + kBoardRegion,
+      player == S_WHITE ? 1.0 : 0.0);
+}
 
-    float* plane_myself = LAYER(i);
-    for (Coord c : *myself)
-      plane_myself[transform(c)] = 1.0;
+void BoardFeature::extractAGZ(uint8_t* features) const {
+  const Board* _board = &s_.board();
+  Stone player = _board->_next_player;
+  const int code = getD4Code();
+  const int* gather = code == 0 ? nullptr : d4Table().gather[code];
+  auto layer = [features](int idx) {
+    return features + idx * kBoardRegion;
+  };
 
-    float* plane_opponent = LAYER(i + 1);
-    for (Coord c : *opponent)
-      plane_opponent[transform(c)] = 1.0;
+  int i = 0;
+  s_.forEachRecentPosition([&](const GoPosition& p) {
+    unpack_plane(p.planes[player - 1], gather, layer(i));
+    unpack_plane(p.planes[OPPONENT(player) - 1], gather, layer(i + 1));
+    i += 2;
+  });
+  std::fill(layer(i), layer(2 * MAX_NUM_AGZ_HISTORY), 0);
+
+  uint8_t* black_indicator = layer(2 * MAX_NUM_AGZ_HISTORY);
+  uint8_t* white_indicator = layer(2 * MAX_NUM_AGZ_HISTORY + 1);
+  std::fill(
+      black_indicator, black_indicator + kBoardRegion, player == S_BLACK);
+  std::fill(
+      white_indicator, white_indicator + kBoardRegion, player == S_WHITE);
+}
 
+void BoardFeature::extractAGZBits(uint8_t* features) const {
+  const Board* _board = &s_.board();
+  Stone player = _board->_next_player;
+  const int code = getD4Code();
+  const int* gather = code == 0 ? nullptr : d4Table().gather[code];
+  auto layer = [features](int idx) {
+    return features + idx * kPackedPlaneBytes;
+  };
+
+  int i = 0;
+  s_.forEachRecentPosition([&](const GoPosition& p) {
+    repack_plane(p.planes[player - 1], gather, layer(i));
+    repack_plane(p.planes[OPPONENT(player) - 1], gather, layer(i + 1));
     i += 2;
-  }
+  });
+  std::fill(layer(i), layer(2 * MAX_NUM_AGZ_HISTORY), 0);
 
-  float* black_indicator = LAYER(2 * MAX_NUM_AGZ_HISTORY);
-  float* white_indicator = LAYER(2 * MAX_NUM_AGZ_HISTORY + 1);
-  if (player == S_BLACK)
-    std::fill(black_indicator, black_indicator + kBoardRegion, 1.0);
-  else
-    std::fill(white_indicator, white_indicator + kBoardRegion, 1.0);
+  fill_packed_plane(player == S_BLACK, layer(2 * MAX_NUM_AGZ_HISTORY));
+  fill_packed_plane(player == S_WHITE, layer(2 * MAX_NUM_AGZ_HISTORY + 1));
 }
+
+GO_BOARD_NAMESPACE_END
@@ -36,23 +36,7 @@
 #define MAX_NUM_AGZ_FEATURE 18
 #define MAX_NUM_AGZ_HISTORY 8
 
-struct BoardHistory {
-  std::vector<Coord> black;
-  std::vector<Coord> white;
-
-  BoardHistory(const Board& b) {
-    for (int i = 0; i < BOARD_SIZE; ++i) {
-      for (int j = 0; j < BOARD_SIZE; ++j) {
-        Coord c = OFFSETXY(i, j);
-        Stone s = b._infos[c].color;
-        if (s == S_WHITE)
-          white.push_back(c);
-        else if (s == S_BLACK)
-          black.push_back(c);
-      }
-    }
-  }
-};
+GO_BOARD_NAMESPACE_BEGIN
 
 class GoState;
 
@@ -125,22 +109,50 @@ class BoardFeature {
   int64_t coord2Action(Coord m) const {
     if (m == M_PASS)
       return BOARD_ACTION_PASS;
-    auto p = Transform(std::make_pair(X(m), Y(m)));
-    return EXPORT_OFFSET_XY(p.first, p.second);
+    return d4Table().forward[getD4Code()][m];
   }
 
   Coord action2Coord(int64_t action) const {
     if (action == -1 || action == BOARD_ACTION_PASS)
       return M_PASS;
-    auto p = InvTransform(std::make_pair(EXPORT_X(action), EXPORT_Y(action)));
-    return OFFSETXY(p.first, p.second);
+    return d4Table().inverse[getD4Code()][action];
   }
 
+  // Writes all planes of the given layout to features (e.g. the batch slot
+  // of this state), overwriting every element.
   void extract(std::vector<float>* features) const;
   void extractAGZ(std::vector<float>* features) const;
   void extract(float* features) const;
   void extractAGZ(float* features) const;
 
+  // Every AGZ plane is binary, so it may also be written compactly: one
+  // uint8_t per cell (same layout as extractAGZ()), or bit-packed with
+  // kPackedPlaneBytes per plane, where cell j of a plane is bit (j & 7) of
+  // byte (j >> 3). Padding bits of the last byte are zero.
+  static constexpr int kPackedPlaneBytes = (BOARD_SIZE * BOARD_SIZE + 7) / 8;
+  void extractAGZ(uint8_t* features) const;
+  void extractAGZBits(uint8_t* features) const;
+
+  // Transform() precomputed at compile time for every D4 code: forward maps
+  // a coord to its export offset, inverse maps an export offset back to the
+  // coord; gather maps it to the export offset of that coord without
+  // symmetry, and scatter is the inverse of gather.
+  struct D4Table {
+    int forward[8][BOUND_COORD];
+    Coord inverse[8][BOARD_SIZE * BOARD_SIZE];
+    int gather[8][BOARD_SIZE * BOARD_SIZE];
+    int scatter[8][BOARD_SIZE * BOARD_SIZE];
+  };
+  static const D4Table& d4Table();
+
+  // Applies this symmetry to num_planes planes laid out without symmetry,
+  // e.g. out may be extractAGZ() under this code when in is extractAGZ()
+  // under code 0.
+  void transformPlanes(const float* in, float* out, int num_planes) const;
+  // Maps a policy of BOARD_NUM_ACTION entries predicted for features under
+  // this symmetry back to the orientation without symmetry.
+  void invTransformPolicy(const float* pi, float* out) const;
+
  private:
   const GoState& s_;
   Rot _rot = NONE;
@@ -149,8 +161,7 @@ class BoardFeature {
   static constexpr int64_t kBoardRegion = BOARD_SIZE * BOARD_SIZE;
 
   int transform(int x, int y) const {
-    auto p = Transform(std::make_pair(x, y));
-    return EXPORT_OFFSET_XY(p.first, p.second);
+    return d4Table().forward[getD4Code()][OFFSETXY(x, y)];
   }
 
   int transform(Coord m) const {
@@ -171,3 +182,5 @@ class BoardFeature {
   bool getHistoryExp(Stone player, float* data) const;
   bool getDistanceMap(Stone player, float* data) const;
 };
+
+GO_BOARD_NAMESPACE_END
@@ -100,6 +100,70 @@ TEST(FeatureTest, testAgzFeature) {
   }
 }
 
+// every plane element is rewritten and lands where coord2Action says, for
+// all symmetries
+TEST(FeatureTest, testAgzFeatureSymmetry) {
+  GoState s;
+  for (auto c : {toFlat(2, 3), toFlat(4, 4), toFlat(6, 1), toFlat(0, 8)})
+    s.forward(c);
+
+  for (int code = 0; code < 8; ++code) {
+    BoardFeature bf(s);
+    bf.setD4Code(code);
+    std::vector<float> features(kBoardRegion * 18, -1.0);
+    bf.extractAGZ(features.data());
+    for (float f : features) {
+      EXPECT_TRUE(f == 0.0 || f == 1.0);
+    }
+
+    const Stone player = s.nextPlayer();
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        Coord c = getCoord(x, y);
+        Stone color = s.board()._infos[c].color;
+        int64_t a = bf.coord2Action(c);
+        EXPECT_EQ(features[a], color == player ? 1.0 : 0.0);
+        EXPECT_EQ(features[kBoardRegion + a], color == OPPONENT(player));
+        EXPECT_EQ(BoardFeature::d4Table().inverse[code][a], c);
+      }
+    }
+    // Only 4 positions: the older history planes are empty.
+    for (size_t j = 8 * kBoardRegion; j < 16 * kBoardRegion; ++j) {
+      EXPECT_EQ(features[j], 0.0);
+    }
+  }
+}
+
+// the uint8_t and bit-packed layouts hold the same cells as extractAGZ()
+TEST(FeatureTest, testAgzFeaturePacked) {
+  GoState s;
+  for (auto c : {toFlat(2, 3), toFlat(4, 4), toFlat(6, 1), toFlat(0, 8)})
+    s.forward(c);
+
+  for (int code = 0; code < 8; ++code) {
+    BoardFeature bf(s);
+    bf.setD4Code(code);
+    std::vector<float> expected;
+    bf.extractAGZ(&expected);
+
+    std::vector<uint8_t> bytes(kBoardRegion * 18, 0xff);
+    bf.extractAGZ(bytes.data());
+    const size_t plane_bytes = BoardFeature::kPackedPlaneBytes;
+    std::vector<uint8_t> bits(plane_bytes * 18, 0xff);
+    bf.extractAGZBits(bits.data());
+
+    for (size_t c = 0; c < 18; ++c) {
+      for (size_t j = 0; j < kBoardRegion; ++j) {
+        const float v = expected[c * kBoardRegion + j];
+        EXPECT_EQ(bytes[c * kBoardRegion + j], v);
+        EXPECT_EQ((bits[c * plane_bytes + (j >> 3)] >> (j & 7)) & 1, v);
+      }
+      // Padding bits stay clear.
+      EXPECT_EQ(bits[(c + 1) * plane_bytes - 1] >> (kBoardRegion & 7), 0);
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
 
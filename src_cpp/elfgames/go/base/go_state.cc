@@ -12,6 +12,8 @@
 #include "board_feature.h"
 #include "go_state.h"
 
+GO_BOARD_NAMESPACE_BEGIN
+
 static std::vector<std::string> split(const std::string& s, char delim) {
   std::stringstream ss(s);
   std::string item;
@@ -82,49 +84,50 @@ bool GoState::forward(const Coord& c) {
   if (!TryPlay2(&_board, c, &ids))
     return false;
 
-  _add_board_hash(c);
+  if (_position == nullptr) {
+    // Board before the first move (handicap stones included).
+    _position = std::make_shared<GoPosition>(nullptr, M_INVALID, _board);
+  }
 
   Play(&_board, &ids);
 
-  _moves.push_back(c);
-  _history.emplace_back(_board);
-  if (_history.size() > MAX_NUM_AGZ_HISTORY)
-    _history.pop_front();
+  _position = std::make_shared<GoPosition>(_position, c, _board);
+  _superko = _check_superko();
   return true;
 }
 
 bool GoState::_check_superko() const {
   // Check superko rule.
   // need to check whether last move is pass or not.
-  if (lastMove() == M_PASS)
+  if (lastMove() == M_PASS || _position == nullptr)
     return false;
 
-  uint64_t key = _board._hash;
-  auto it = _board_hash.find(key);
-  if (it != _board_hash.end()) {
-    for (const auto& r : it->second) {
-      if (isBitsEqual(_board._bits, r.bits))
-        return true;
+  // Compare against the board before each non-pass move. A repeated board
+  // has as many stones as the current one, and positions between two
+  // captures never have more stones than the last of them, so whole stretches
+  // of the game are skipped at once.
+  const int num_stones = _position->num_stones;
+  const GoPosition* p = _position.get();
+  while (p->parent != nullptr) {
+    const GoPosition* before = p->parent.get();
+    if (before->num_stones < num_stones) {
+      p = before->last_capture;
+      continue;
     }
+    if (p->move != M_PASS && before->hash == _board._hash &&
+        isBitsEqual(_board._bits, before->bits))
+      return true;
+    p = before;
   }
   return false;
 }
 
-void GoState::_add_board_hash(const Coord& c) {
-  if (c == M_PASS)
-    return;
-
-  uint64_t key = _board._hash;
-  auto& r = _board_hash[key];
-  r.emplace_back();
-  copyBits(r.back().bits, _board._bits);
-}
-
 bool GoState::checkMove(const Coord& c) const {
-  GroupId4 ids;
-  if (c == M_INVALID)
+  if (c == M_PASS || c == M_RESIGN)
+    return true;
+  if (c >= BOUND_COORD)
     return false;
-  return TryPlay2(&_board, c, &ids);
+  return getLegalBits(&_board).test(c);
 }
 
 void GoState::applyHandicap(int handi) {
@@ -133,11 +136,20 @@ void GoState::applyHandicap(int handi) {
 
 void GoState::reset() {
   clearBoard(&_board);
-  _moves.clear();
-  _board_hash.clear();
-  _history.clear();
+  _position.reset();
+  _superko = false;
+  _final_value = 0.0;
+  _has_final_value = false;
+}
+
+void GoState::resetTo(const Board& b) {
+  copyBoard(&_board, &b);
+  _position = std::make_shared<GoPosition>(nullptr, M_INVALID, _board);
+  _superko = false;
   _final_value = 0.0;
   _has_final_value = false;
 }
 
 HandicapTable GoState::_handi_table;
+
+GO_BOARD_NAMESPACE_END
@@ -8,7 +8,9 @@
 
 #pragma once
 
-#include <deque>
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <queue>
 #include <sstream>
 #include <unordered_map>
@@ -19,6 +21,8 @@
 #include "board.h"
 #include "board_feature.h"
 
+GO_BOARD_NAMESPACE_BEGIN
+
 class HandicapTable {
  private:
   // handicap table.
@@ -74,24 +78,62 @@ simple_flood_fill(const Board& b, Stone player, std::ostream* oo = nullptr) {
 
 inline int simple_tt_scoring(const Board& b, std::ostream* oo = nullptr) {
   // No dead stone considered.
-  // [TODO] Can be more efficient with bitset.
-  // if (oo != nullptr) *oo << "In tt scoring" << endl;
-  std::vector<bool> black = simple_flood_fill(b, S_BLACK, oo);
-  std::vector<bool> white = simple_flood_fill(b, S_WHITE, oo);
-
-  int black_v = 0, white_v = 0;
-  for (size_t i = 0; i < black.size(); ++i) {
-    if (black[i] && !white[i])
-      black_v++;
-    else if (white[i] && !black[i])
-      white_v++;
-  }
-
+  const int score = getAreaScore(&b, nullptr);
   if (oo != nullptr)
-    *oo << "black_v: " << black_v << ", white: " << white_v << std::endl;
-  return black_v - white_v;
+    *oo << "black_v - white_v: " << score << std::endl;
+  return score;
 }
 
+// One position of a game. Positions are immutable and linked to their
+// parent, so all states (e.g., search tree nodes) that went through a
+// position share it instead of copying the game history.
+struct GoPosition {
+  static constexpr int kPlaneWords = (BOARD_SIZE * BOARD_SIZE + 63) / 64;
+
+  std::shared_ptr<const GoPosition> parent;
+  // Move that led to this position (M_INVALID for the initial position).
+  Coord move;
+  // #moves played before reaching this position.
+  int num_moves;
+  uint64_t hash;
+  Board::Bits bits;
+  // Stones of S_BLACK (index 0) and S_WHITE (index 1) as packed feature
+  // planes: bit EXPORT_OFFSET_XY(x, y) is set if there is a stone at (x, y).
+  // Built once per move; every later state reuses them as history planes.
+  uint64_t planes[2][kPlaneWords];
+  // Stones on the board.
+  int num_stones;
+  // Nearest position on the way here (this one included) that was reached by
+  // a capture, or the initial position. The positions from there to here
+  // have a non-decreasing number of stones.
+  const GoPosition* last_capture;
+
+  GoPosition(
+      std::shared_ptr<const GoPosition> parent,
+      Coord move,
+      const Board& b)
+      : parent(std::move(parent)), move(move), hash(b._hash) {
+    // A first position need not be the initial one (see GoState::resetTo()).
+    num_moves =
+        this->parent == nullptr ? b._ply - 1 : this->parent->num_moves + 1;
+    copyBits(bits, b._bits);
+    memset(planes, 0, sizeof(planes));
+    for (int i = 0; i < 2; ++i) {
+      b._stone_bits[i].forEach([&](Coord c) {
+        int offset = EXPORT_OFFSET_XY(X(c), Y(c));
+        planes[i][offset >> 6] |= (uint64_t)1 << (offset & 63);
+      });
+    }
+    num_stones = b._stone_bits[0].count() + b._stone_bits[1].count();
+    if (this->parent == nullptr ||
+        num_stones < this->parent->num_stones + (move == M_PASS ? 0 : 1)) {
+      last_capture = this;
+    } else {
+      last_capture = this->parent->last_capture;
+    }
+  }
+};
+
 class GoState {
  public:
   GoState() {
@@ -112,12 +154,15 @@ class GoState {
   }
 
   void reset();
+  // Starts from board b, e.g. a snapshot of a game being replayed: the moves
+  // before it are not known, so history (features, superko) starts there.
+  void resetTo(const Board& b);
   void applyHandicap(int handi);
 
+  // Cheap: the game history is shared with s.
   GoState(const GoState& s)
-      : _history(s._history),
-        _board_hash(s._board_hash),
-        _moves(s._moves),
+      : _position(s._position),
+        _superko(s._superko),
         _final_value(s._final_value),
         _has_final_value(s._has_final_value) {
     copyBoard(&_board, &s._board);
@@ -143,7 +188,7 @@ class GoState {
   }
 
   bool terminated() const {
-    return isTwoPass() || getPly() >= BOARD_MAX_MOVE || _check_superko();
+    return isTwoPass() || getPly() >= BOARD_MAX_MOVE || _superko;
   }
 
   Coord lastMove() const {
@@ -156,16 +201,24 @@ class GoState {
     return _board._next_player;
   }
 
+  size_t getNumMoves() const {
+    return _position == nullptr ? 0 : _position->num_moves;
+  }
+
   bool moves_since(size_t* next_move_number, std::vector<Coord>* moves) const {
-    if (*next_move_number > _moves.size()) {
+    const size_t num_moves = getNumMoves();
+    if (*next_move_number > num_moves) {
       // The move number is not right.
       return false;
     }
     moves->clear();
-    for (size_t i = *next_move_number; i < _moves.size(); ++i) {
-      moves->push_back(_moves[i]);
+    for (const GoPosition* p = _position.get();
+         p != nullptr && (size_t)p->num_moves > *next_move_number;
+         p = p->parent.get()) {
+      moves->push_back(p->move);
     }
-    *next_move_number = _moves.size();
+    std::reverse(moves->begin(), moves->end());
+    *next_move_number = num_moves;
     return true;
   }
 
@@ -173,12 +226,20 @@ class GoState {
     return _board._hash;
   }
 
-  const std::vector<Coord>& getAllMoves() const {
-    return _moves;
+  // The same for the positions equal up to symmetry, see getCanonicalHash().
+  uint64_t getCanonicalHashCode(int* code = nullptr) const {
+    return getCanonicalHash(&_board, code);
+  }
+
+  std::vector<Coord> getAllMoves() const {
+    size_t next_move_number = 0;
+    std::vector<Coord> moves;
+    moves_since(&next_move_number, &moves);
+    return moves;
   }
   std::string getAllMovesString() const {
     std::stringstream ss;
-    for (const Coord& c : _moves) {
+    for (const Coord& c : getAllMoves()) {
       ss << "[" << coord2str2(c) << "] ";
     }
     return ss.str();
@@ -193,7 +254,7 @@ class GoState {
 
   float evaluate(float komi, std::ostream* oo = nullptr) const {
     float final_score = 0.0;
-    if (_check_superko()) {
+    if (_superko) {
       final_score = nextPlayer() == S_BLACK ? 1.0 : -1.0;
     } else {
       final_score = (float)simple_tt_scoring(_board, oo) - komi;
@@ -205,38 +266,50 @@ class GoState {
     return final_score;
   }
 
-  // TODO: not a good design..
-  const std::deque<BoardHistory>& getHistory() const {
-    return _history;
+  // Calls f(const Board::Bits&) on the boards after the most recent moves
+  // (at most MAX_NUM_AGZ_HISTORY), newest first.
+  template <typename F>
+  void forEachRecentBoard(F f) const {
+    forEachRecentPosition([&](const GoPosition& p) { f(p.bits); });
+  }
+
+  // Same as forEachRecentBoard(), with the whole position.
+  template <typename F>
+  void forEachRecentPosition(F f) const {
+    int n = 0;
+    for (const GoPosition* p = _position.get();
+         p != nullptr && p->parent != nullptr && n < MAX_NUM_AGZ_HISTORY;
+         p = p->parent.get(), ++n) {
+      f(*p);
+    }
   }
 
  protected:
   Board _board;
-  std::deque<BoardHistory> _history;
-
-  struct _BoardRecord {
-    Board::Bits bits;
-  };
+  // Current position; nullptr until the first move. Its ancestors are the
+  // earlier positions of the game, used for superko and history features.
+  std::shared_ptr<const GoPosition> _position;
+  // Whether the current board repeats an earlier one (computed in forward()).
+  bool _superko = false;
 
-  std::unordered_map<uint64_t, std::vector<_BoardRecord>> _board_hash;
-
-  std::vector<Coord> _moves;
   float _final_value = 0.0;
   bool _has_final_value = false;
 
   static HandicapTable _handi_table;
 
   bool _check_superko() const;
-  void _add_board_hash(const Coord& c);
 };
 
 struct GoReply {
   const BoardFeature& bf;
   Coord c;
-  std::vector<float> pi;
+  // Fixed size: replies are made for every evaluation, without allocating.
+  std::array<float, BOARD_NUM_ACTION> pi{};
   float value = 0;
   // Model version.
   int64_t version = -1;
 
-  GoReply(const BoardFeature& bf) : bf(bf), pi(BOARD_NUM_ACTION, 0.0) {}
+  GoReply(const BoardFeature& bf) : bf(bf) {}
 };
+
+GO_BOARD_NAMESPACE_END
@@ -13,8 +13,10 @@
  */
 
 #include <gtest/gtest.h>
+#include <random>
 #include <set>
 
+#include "elf/metrics/Metrics.h"
 #include "elfgames/go/base/board.h"
 #include "elfgames/go/base/board_feature.h"
 #include "elfgames/go/base/test_utils.h"
@@ -664,6 +666,225 @@ TEST(GoTest, testReplayPosition) {
   EXPECT_TRUE(boardEqual(b, b2));
 }
 
+// copies share the game history; moves played on a copy do not leak back
+TEST(GoTest, testSharedHistory) {
+  GoState b;
+  b.forward(str2coord("cc"));
+  b.forward(str2coord("gg"));
+
+  GoState b2(b);
+  EXPECT_EQ(b2.getAllMoves(), b.getAllMoves());
+  b2.forward(str2coord("cg"));
+  b2.forward(0);
+
+  EXPECT_EQ(b.getNumMoves(), 2u);
+  EXPECT_EQ(b2.getNumMoves(), 4u);
+  EXPECT_EQ(b2.getAllMoves()[2], str2coord("cg"));
+
+  size_t next_move_number = 1;
+  std::vector<Coord> moves;
+  EXPECT_TRUE(b2.moves_since(&next_move_number, &moves));
+  EXPECT_EQ(next_move_number, 4u);
+  EXPECT_EQ(
+      moves,
+      std::vector<Coord>({str2coord("gg"), str2coord("cg"), (Coord)0}));
+  EXPECT_FALSE(b2.terminated());
+
+  int num_boards = 0;
+  b2.forEachRecentBoard([&](const Board::Bits& bits) {
+    // The newest board is the current one.
+    if (num_boards == 0) {
+      EXPECT_TRUE(isBitsEqual(bits, b2.board()._bits));
+    }
+    num_boards++;
+  });
+  EXPECT_EQ(num_boards, 4);
+}
+
+// a double ko cycle repeats the position, ends the game and loses it
+TEST(GoTest, testSuperko) {
+  std::string str;
+  str += ".XO......";
+  str += "XO.O.....";
+  str += ".XO......";
+  str += ".........";
+  str += ".........";
+  str += ".OX......";
+  str += "OX.X.....";
+  str += ".OX......";
+  str += ".........";
+  GoState s;
+  loadBoard(s, str);
+  giveTurn(s, S_BLACK);
+
+  // Black takes the first ko, white the second; black passes and both
+  // take back.
+  for (Coord c : {toFlat(2, 1), toFlat(2, 6), (Coord)M_PASS, toFlat(1, 1)}) {
+    ASSERT_TRUE(s.forward(c));
+    EXPECT_FALSE(s.terminated());
+  }
+  ASSERT_TRUE(s.forward(toFlat(1, 6)));
+  EXPECT_TRUE(s.terminated());
+  // The player who repeated the position loses.
+  EXPECT_EQ(s.evaluate(7.5), s.nextPlayer() == S_BLACK ? 1.0 : -1.0);
+}
+
+// the ladder search result is cached per position and victim move
+TEST(GoTest, testLadderCache) {
+  std::string str;
+  str += ".........";
+  str += "..X......";
+  str += ".XOX.....";
+  str += "...X.....";
+  str += ".........";
+  str += ".........";
+  str += ".........";
+  str += ".........";
+  str += ".........";
+  GoState s;
+  loadBoard(s, str);
+
+  GroupId4 ids;
+  ASSERT_TRUE(TryPlay(&s.board(), 2, 3, S_WHITE, &ids));
+  uint64_t num_lookups, num_hits;
+  getLadderCacheStats(&num_lookups, &num_hits);
+
+  const int depth = checkLadder(&s.board(), &ids, S_WHITE);
+  EXPECT_GT(depth, 0);
+  EXPECT_EQ(checkLadder(&s.board(), &ids, S_WHITE), depth);
+
+  uint64_t num_lookups2, num_hits2;
+  getLadderCacheStats(&num_lookups2, &num_hits2);
+  EXPECT_EQ(num_lookups2 - num_lookups, 2u);
+  EXPECT_EQ(num_hits2 - num_hits, 1u);
+
+  // Exported with the other metrics.
+  const auto snapshot = elf::metrics::Registry::global().snapshot();
+  const std::string labels = "{board=\"" + std::to_string(BOARD_SIZE) + "\"}";
+  EXPECT_EQ(
+      snapshot.counters.at("elf_go_ladder_cache_lookups_total" + labels),
+      num_lookups2);
+  EXPECT_EQ(
+      snapshot.counters.at("elf_go_ladder_cache_hits_total" + labels),
+      num_hits2);
+}
+
+// Calls f(s) after every move of random games with many captures; one move
+// in 20 is a pass.
+template <typename F>
+static void forEachRandomPosition(int num_games, F f) {
+  std::mt19937 rng(0);
+  for (int game = 0; game < num_games; ++game) {
+    GoState s;
+    for (int ply = 0; ply < 4 * BOARD_SIZE * BOARD_SIZE && !s.terminated();
+         ++ply) {
+      std::vector<Coord> moves;
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        for (int y = 0; y < BOARD_SIZE; ++y) {
+          GroupId4 ids;
+          if (TryPlay2(&s.board(), getCoord(x, y), &ids))
+            moves.push_back(getCoord(x, y));
+        }
+      }
+      if (moves.empty())
+        break;
+      s.forward(rng() % 20 == 0 ? M_PASS : moves[rng() % moves.size()]);
+      f(s);
+    }
+  }
+}
+
+// stone bitboards and bitboard liberties follow _infos and _groups
+TEST(GoTest, testBitBoards) {
+  forEachRandomPosition(20, [](const GoState& s) {
+    const Board* board = &s.board();
+    const BitBoard empty = getStoneBits(board, S_EMPTY);
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        Coord c = getCoord(x, y);
+        Stone color = board->_infos[c].color;
+        ASSERT_EQ(getStoneBits(board, S_BLACK).test(c), color == S_BLACK);
+        ASSERT_EQ(getStoneBits(board, S_WHITE).test(c), color == S_WHITE);
+        ASSERT_EQ(empty.test(c), color == S_EMPTY);
+      }
+    }
+    for (int id = 1; id < board->_num_groups; ++id) {
+      ASSERT_EQ(countGroupLiberties(board, id), board->_groups[id].liberties);
+    }
+  });
+}
+
+// the packed planes of every recent position match its board bits
+TEST(GoTest, testPositionPlanes) {
+  forEachRandomPosition(5, [](const GoState& s) {
+    s.forEachRecentPosition([](const GoPosition& p) {
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        for (int y = 0; y < BOARD_SIZE; ++y) {
+          const int offset = EXPORT_OFFSET_XY(x, y);
+          const Stone color = getBitsColor(p.bits, getCoord(x, y));
+          for (Stone player = S_BLACK; player <= S_WHITE; ++player) {
+            const uint64_t word = p.planes[player - 1][offset >> 6];
+            ASSERT_EQ((word >> (offset & 63)) & 1, color == player);
+          }
+        }
+      }
+    });
+  });
+}
+
+// the bitboard area score and ownership match the flood fill
+TEST(GoTest, testAreaScore) {
+  forEachRandomPosition(10, [](const GoState& s) {
+    const Board* board = &s.board();
+    std::vector<bool> black = simple_flood_fill(*board, S_BLACK);
+    std::vector<bool> white = simple_flood_fill(*board, S_WHITE);
+    Stone ownership[BOARD_SIZE * BOARD_SIZE];
+    int score = getAreaScore(board, ownership);
+
+    int expected = 0;
+    for (size_t i = 0; i < black.size(); ++i) {
+      Stone owner = S_DAME;
+      if (black[i] && !white[i])
+        owner = S_BLACK;
+      else if (white[i] && !black[i])
+        owner = S_WHITE;
+      expected += owner == S_BLACK ? 1 : (owner == S_WHITE ? -1 : 0);
+      ASSERT_EQ(ownership[i], owner);
+    }
+    ASSERT_EQ(score, expected);
+    ASSERT_EQ(getTrompTaylorScore(board, nullptr, nullptr), expected);
+  });
+}
+
+// the legal-move bitboard agrees with TryPlay for both players
+TEST(GoTest, testLegalBits) {
+  GoState empty_board;
+  EXPECT_EQ(getLegalBits(&empty_board.board()), getOnBoardBits());
+
+  int num_illegal = 0;
+  forEachRandomPosition(20, [&](const GoState& s) {
+    const Board* board = &s.board();
+    for (Stone player = S_BLACK; player <= S_WHITE; ++player) {
+      BitBoard legal;
+      computeLegalBits(board, player, &legal);
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        for (int y = 0; y < BOARD_SIZE; ++y) {
+          GroupId4 ids;
+          bool expected = TryPlay(board, x, y, player, &ids);
+          ASSERT_EQ(legal.test(getCoord(x, y)), expected);
+          if (player == board->_next_player) {
+            ASSERT_EQ(s.checkMove(getCoord(x, y)), expected);
+            num_illegal += board->_infos[getCoord(x, y)].color == S_EMPTY &&
+                !expected;
+          }
+        }
+      }
+    }
+  });
+  // Suicide and ko points did come up.
+  EXPECT_GT(num_illegal, 0);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
 
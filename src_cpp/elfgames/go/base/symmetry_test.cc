@@ -12,6 +12,7 @@
  * tests. https://github.com/tensorflow/minigo
  */
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <array>
 #include <vector>
 
@@ -282,6 +283,104 @@ TEST(SymmetryTest, testProperMoveTransform) {
   }
 }
 
+// transforming whole planes gives the features extracted under a symmetry,
+// and the policy of those features maps back to the original orientation
+TEST(SymmetryTest, testBatchedTransform) {
+  GoState s;
+  for (auto c : {toFlat(0, 8), toFlat(1, 7), toFlat(3, 2), toFlat(5, 5)})
+    s.forward(c);
+
+  BoardFeature bf(s);
+  std::vector<float> agzFeat(kBoardRegion * 18);
+  bf.extractAGZ(agzFeat.data());
+
+  std::vector<float> pi(BOARD_NUM_ACTION);
+  for (size_t i = 0; i < pi.size(); ++i)
+    pi[i] = i;
+
+  for (int code = 0; code < 8; ++code) {
+    BoardFeature symmBf(s);
+    symmBf.setD4Code(code);
+    std::vector<float> agzFeatSymm(kBoardRegion * 18);
+    std::vector<float> agzFeatPermuted(kBoardRegion * 18);
+    symmBf.extractAGZ(agzFeatSymm.data());
+    symmBf.transformPlanes(agzFeat.data(), agzFeatPermuted.data(), 18);
+    EXPECT_EQ(agzFeatSymm, agzFeatPermuted);
+
+    // A network that is equivariant under the symmetry.
+    std::vector<float> piSymm(BOARD_NUM_ACTION);
+    for (size_t i = 0; i < kBoardRegion; ++i)
+      piSymm[symmBf.coord2Action(bf.action2Coord(i))] = pi[i];
+    piSymm[BOARD_ACTION_PASS] = pi[BOARD_ACTION_PASS];
+    std::vector<float> piBack(BOARD_NUM_ACTION);
+    symmBf.invTransformPolicy(piSymm.data(), piBack.data());
+    EXPECT_EQ(piBack, pi);
+
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        auto p = symmBf.Transform(std::make_pair(x, y));
+        EXPECT_EQ(
+            symmBf.coord2Action(getCoord(x, y)),
+            EXPORT_OFFSET_XY(p.first, p.second));
+      }
+    }
+  }
+}
+
+// The hashes of the symmetries follow the moves, with captures: all the
+// symmetric games have the same canonical hash.
+TEST(SymmetryTest, testSymmetricHashes) {
+  const std::vector<Coord> moves = {getCoord(2, 3),
+                                    getCoord(2, 2),
+                                    getCoord(1, 2),
+                                    getCoord(3, 3),
+                                    getCoord(3, 2),
+                                    M_PASS,
+                                    getCoord(2, 1),
+                                    getCoord(5, 6)};
+  GoState s;
+  for (Coord m : moves) {
+    ASSERT_TRUE(s.forward(m));
+  }
+  const Board& b = s.board();
+  // Captured.
+  ASSERT_EQ(b._infos[getCoord(2, 2)].color, S_EMPTY);
+  EXPECT_EQ(b._sym_hash[0], b._hash);
+  int code;
+  const uint64_t canonical = getCanonicalHash(&b, &code);
+
+  std::vector<uint64_t> hashes;
+  for (int c = 0; c < 8; ++c) {
+    BoardFeature bf(s);
+    bf.setD4Code(c);
+    GoState symm;
+    for (Coord m : moves) {
+      const Coord sm = getSymmetricCoord(m, c);
+      // As BoardFeature sees it.
+      if (m != M_PASS) {
+        EXPECT_EQ(EXPORT_OFFSET(sm), bf.coord2Action(m));
+      }
+      ASSERT_TRUE(symm.forward(sm));
+    }
+    EXPECT_EQ(symm.board()._hash, b._sym_hash[c]) << c;
+    int symm_code;
+    EXPECT_EQ(getCanonicalHash(&symm.board(), &symm_code), canonical);
+    // The canonical board, from this one.
+    EXPECT_EQ(symm.board()._sym_hash[symm_code], canonical);
+    hashes.push_back(b._sym_hash[c]);
+  }
+  EXPECT_EQ(b._sym_hash[code], canonical);
+  EXPECT_EQ(canonical, *std::min_element(hashes.begin(), hashes.end()));
+  // No symmetry of this position is the position.
+  std::sort(hashes.begin(), hashes.end());
+  EXPECT_EQ(std::unique(hashes.begin(), hashes.end()), hashes.end());
+
+  // The empty board is its own canonical board.
+  GoState empty;
+  EXPECT_EQ(getCanonicalHash(&empty.board(), &code), 0u);
+  EXPECT_EQ(code, 0);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
 
@@ -44,15 +44,25 @@ ClientInfo::ClientInfo(
 }
 
 void ClientInfo::stateUpdate(const ThreadState& ts) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  assert(ts.thread_id >= 0 && ts.thread_id < (int)threads_.size());
-  if (threads_[ts.thread_id]->StateUpdate(ts)) {
-    last_update_ = mgr_.getCurrTimeStamp();
+  bool revive = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(ts.thread_id >= 0 && ts.thread_id < (int)threads_.size());
+    if (threads_[ts.thread_id]->StateUpdate(ts)) {
+      last_update_ = mgr_.getCurrTimeStamp();
+      if (!active_ && !revive_pending_) {
+        revive_pending_ = revive = true;
+      }
+    }
+  }
+  if (revive) {
+    mgr_.revive(this);
   }
 }
 
 ClientInfo::ClientChange ClientInfo::updateActive() {
   std::lock_guard<std::mutex> lock(mutex_);
+  revive_pending_ = false;
   bool curr_active = (mgr_.getCurrTimeStamp() - last_update_ < max_delay_sec_);
 
   if (active_) {
@@ -7,7 +7,14 @@
  */
 
 #pragma once
+
+#include <algorithm>
 #include <atomic>
+#include <utility>
+#include <vector>
+
+#include <tbb/concurrent_hash_map.h>
+
 #include "record.h"
 
 class ClientManager;
@@ -65,6 +72,11 @@ struct ClientInfo {
     return active_;
   }
 
+  uint64_t lastUpdate() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_update_;
+  }
+
   bool IsStuck(uint64_t curr_timestamp, uint64_t* delay = nullptr) const {
     std::lock_guard<std::mutex> lock(mutex_);
     auto last_delay = curr_timestamp - last_update_;
@@ -73,6 +85,14 @@ struct ClientInfo {
     return last_delay >= max_delay_sec_;
   }
 
+  // The client is stuck from then on, unless it is updated.
+  uint64_t deadline() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_update_ + max_delay_sec_;
+  }
+
+  // A dead client that reports is handed to the manager, to be revived by
+  // its next sweep.
   void stateUpdate(const ThreadState& ts);
 
   ClientChange updateActive();
@@ -94,10 +114,17 @@ struct ClientInfo {
   std::atomic<int64_t> seq_;
 
   bool active_ = true;
+  // Handed to the manager since it was last checked.
+  bool revive_pending_ = false;
   uint64_t last_update_ = 0;
   std::vector<std::unique_ptr<State>> threads_;
 };
 
+// Clients are kept in a concurrent hash map, so that getClient() (on every
+// request and every batch of records) does not wait for the liveness sweep
+// nor for each other. Liveness is tracked with a timer wheel of the clients'
+// deadlines: updateClients() only visits the clients whose deadline passed
+// and the dead ones that reported since, not all of them.
 class ClientManager {
  public:
   ClientManager(
@@ -114,10 +141,11 @@ class ClientManager {
         max_client_delay_sec_(max_client_delay_sec),
         timer_(timer) {
     assert(timer_ != nullptr);
+    last_tick_ = timer_();
   }
 
   void setSelfplayOnlyRatio(float ratio) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(type_mutex_);
     selfplay_only_ratio_ = ratio;
   }
 
@@ -125,23 +153,47 @@ class ClientManager {
     std::vector<std::string> newly_dead;
     std::vector<std::string> newly_alive;
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (auto& p : clients_) {
-      auto& c = *p.second;
-      auto status = c.updateActive();
-      if (status == ClientInfo::ALIVE2DEAD) {
-        newly_dead.push_back(p.first);
-        dealloc_type(c.type());
-      } else if (status == ClientInfo::DEAD2ALIVE) {
-        newly_alive.push_back(p.first);
-        c.set_type(alloc_type());
+    {
+      std::lock_guard<std::mutex> lock(liveness_mutex_);
+      const uint64_t now = getCurrTimeStamp();
+      std::vector<ClientInfo*> expired;
+      wheel_.popExpired(last_tick_, now, &expired);
+      last_tick_ = std::max(last_tick_, now);
+
+      for (ClientInfo* c : expired) {
+        auto status = c->updateActive();
+        if (status == ClientInfo::ALIVE2DEAD) {
+          newly_dead.push_back(c->id());
+          std::lock_guard<std::mutex> type_lock(type_mutex_);
+          dealloc_type(c->type());
+        } else {
+          // Updated since it was scheduled.
+          schedule(c);
+        }
+      }
+
+      std::vector<ClientInfo*> revived;
+      {
+        std::lock_guard<std::mutex> revive_lock(revive_mutex_);
+        revived.swap(revived_);
+      }
+      for (ClientInfo* c : revived) {
+        // Dead again if the report was already too old.
+        if (c->updateActive() == ClientInfo::DEAD2ALIVE) {
+          newly_alive.push_back(c->id());
+          {
+            std::lock_guard<std::mutex> type_lock(type_mutex_);
+            c->set_type(alloc_type());
+          }
+          schedule(c);
+        }
       }
     }
 
     if (!newly_dead.empty() || !newly_alive.empty()) {
       std::cout << getCurrTimeStamp()
                 << " Client newly dead: " << newly_dead.size()
-                << ", newly alive: " << newly_alive.size() << ", " << _info()
+                << ", newly alive: " << newly_alive.size() << ", " << info()
                 << std::endl;
       for (const auto& s : newly_dead) {
         std::cout << "Newly dead: " << s << std::endl;
@@ -153,35 +205,49 @@ class ClientManager {
   }
 
   const ClientInfo* getClient(const std::string& identity) const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = clients_.find(identity);
-    if (it != clients_.end()) {
-      return it->second.get();
+    // Clients are never removed, so they outlive the accessor.
+    Clients::const_accessor elem;
+    if (clients_.find(elem, identity)) {
+      return elem->second.get();
     } else {
       return nullptr;
     }
   }
 
   ClientInfo& getClient(const std::string& identity) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = clients_.find(identity);
-    if (it != clients_.end())
-      return *it->second;
+    {
+      Clients::const_accessor elem;
+      if (clients_.find(elem, identity)) {
+        return *elem->second;
+      }
+    }
+
+    ClientInfo* c = nullptr;
+    {
+      Clients::accessor elem;
+      if (!clients_.insert(elem, identity)) {
+        // Added by another thread in the meantime.
+        return *elem->second;
+      }
+      elem->second.reset(new ClientInfo(
+          *this, identity, max_num_threads_, max_client_delay_sec_));
+      c = elem->second.get();
+      std::lock_guard<std::mutex> lock(type_mutex_);
+      c->set_type(alloc_type());
+    }
 
-    auto& e = clients_[identity];
-    e.reset(new ClientInfo(
-        *this, identity, max_num_threads_, max_client_delay_sec_));
-    e->set_type(alloc_type());
-    return *e;
+    std::lock_guard<std::mutex> lock(liveness_mutex_);
+    schedule(c);
+    return *c;
   }
 
   size_t getNumEval() const {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(type_mutex_);
     return num_eval_then_selfplay_;
   }
 
   size_t getExpectedNumEval() const {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(type_mutex_);
     if (num_expected_clients_ > 0) {
       return num_expected_clients_ * (1.0 - selfplay_only_ratio_);
     } else {
@@ -194,11 +260,53 @@ class ClientManager {
   }
 
   std::string info() const {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(type_mutex_);
     return _info();
   }
 
  private:
+  friend struct ClientInfo;
+
+  using Clients =
+      tbb::concurrent_hash_map<std::string, std::unique_ptr<ClientInfo>>;
+
+  // Clients by the second of their deadline, modulo kNumSlots. A client is
+  // scheduled once, at the deadline it had then; it is checked (and
+  // rescheduled if it was updated meanwhile) when the wheel gets there.
+  class TimerWheel {
+   public:
+    void add(ClientInfo* c, uint64_t deadline) {
+      slots_[deadline % kNumSlots].push_back({deadline, c});
+    }
+
+    // Moves the clients of deadline in (from, to] to expired.
+    void popExpired(
+        uint64_t from,
+        uint64_t to,
+        std::vector<ClientInfo*>* expired) {
+      if (to <= from) {
+        return;
+      }
+      const uint64_t n = std::min<uint64_t>(to - from, kNumSlots);
+      for (uint64_t t = to - n + 1; t <= to; ++t) {
+        auto& slot = slots_[t % kNumSlots];
+        for (size_t i = 0; i < slot.size();) {
+          if (slot[i].first <= to) {
+            expired->push_back(slot[i].second);
+            slot[i] = slot.back();
+            slot.pop_back();
+          } else {
+            ++i;
+          }
+        }
+      }
+    }
+
+   private:
+    static constexpr uint64_t kNumSlots = 256;
+    std::vector<std::pair<uint64_t, ClientInfo*>> slots_[kNumSlots];
+  };
+
   float selfplay_only_ratio_;
   const int num_expected_clients_;
   const int max_num_eval_;
@@ -207,11 +315,33 @@ class ClientManager {
 
   std::function<uint64_t()> timer_ = nullptr;
 
-  mutable std::mutex mutex_;
-  std::unordered_map<std::string, std::unique_ptr<ClientInfo>> clients_;
+  Clients clients_;
+
+  // Guards the wheel. Taken before type_mutex_.
+  std::mutex liveness_mutex_;
+  TimerWheel wheel_;
+  uint64_t last_tick_ = 0;
+
+  // Dead clients that reported, from ClientInfo::stateUpdate().
+  mutable std::mutex revive_mutex_;
+  mutable std::vector<ClientInfo*> revived_;
+
+  // Guards the allocation of client types.
+  mutable std::mutex type_mutex_;
   int num_selfplay_only_ = 0;
   int num_eval_then_selfplay_ = 0;
 
+  void revive(ClientInfo* c) const {
+    std::lock_guard<std::mutex> lock(revive_mutex_);
+    revived_.push_back(c);
+  }
+
+  // With liveness_mutex_ held. Past deadlines are checked at the next tick.
+  void schedule(ClientInfo* c) {
+    wheel_.add(
+        c, std::max(c->lastUpdate() + max_client_delay_sec_, last_tick_ + 1));
+  }
+
   std::string _info() const {
     std::stringstream ss;
     int n = num_selfplay_only_ + num_eval_then_selfplay_;
@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "elfgames/go/client_manager.h"
+
+namespace {
+
+constexpr uint64_t kMaxDelay = 300;
+
+// Makes the client update its state at the current time.
+void touch(ClientInfo& c, int seq) {
+  ThreadState ts;
+  ts.thread_id = 0;
+  ts.seq = seq;
+  c.stateUpdate(ts);
+}
+
+} // namespace
+
+TEST(ClientManagerTest, AllocatesTypes) {
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(2, kMaxDelay, -1, 0.5, -1, [&]() { return now.load(); });
+  const ClientManager& cmgr = mgr;
+  EXPECT_EQ(cmgr.getClient("a"), nullptr);
+
+  ClientInfo& a = mgr.getClient("a");
+  EXPECT_EQ(&a, &mgr.getClient("a"));
+  EXPECT_EQ(&a, cmgr.getClient("a"));
+  EXPECT_EQ(a.id(), "a");
+  EXPECT_EQ(a.type(), CLIENT_SELFPLAY_ONLY);
+  EXPECT_EQ(mgr.getClient("b").type(), CLIENT_EVAL_THEN_SELFPLAY);
+  EXPECT_EQ(mgr.getNumEval(), 1u);
+}
+
+TEST(ClientManagerTest, TracksLiveness) {
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(2, kMaxDelay, -1, 0.5, -1, [&]() { return now.load(); });
+  ClientInfo& a = mgr.getClient("a");
+  ClientInfo& b = mgr.getClient("b");
+
+  now += kMaxDelay - 1;
+  touch(a, 1);
+  mgr.updateClients();
+  EXPECT_TRUE(a.IsActive());
+  EXPECT_TRUE(b.IsActive());
+
+  // b is late; a was rescheduled when it updated.
+  now += 1;
+  mgr.updateClients();
+  EXPECT_TRUE(a.IsActive());
+  EXPECT_FALSE(b.IsActive());
+  EXPECT_EQ(mgr.getNumEval(), 0u);
+
+  // Past the span of the wheel.
+  now += 10 * kMaxDelay;
+  touch(b, 1);
+  mgr.updateClients();
+  EXPECT_FALSE(a.IsActive());
+  EXPECT_TRUE(b.IsActive());
+
+  touch(a, 2);
+  mgr.updateClients();
+  EXPECT_TRUE(a.IsActive());
+  EXPECT_TRUE(b.IsActive());
+  EXPECT_EQ(mgr.getNumEval(), 1u);
+}
+
+// Dead clients are only revived when they report, and may die and be
+// revived again.
+TEST(ClientManagerTest, RevivesOnReport) {
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(2, kMaxDelay, -1, 0.5, -1, [&]() { return now.load(); });
+  ClientInfo& a = mgr.getClient("a");
+
+  for (int i = 1; i <= 2; ++i) {
+    now += kMaxDelay;
+    mgr.updateClients();
+    EXPECT_FALSE(a.IsActive());
+    mgr.updateClients();
+    EXPECT_FALSE(a.IsActive());
+
+    touch(a, 2 * i);
+    touch(a, 2 * i + 1);
+    mgr.updateClients();
+    EXPECT_TRUE(a.IsActive());
+    EXPECT_EQ(a.type(), CLIENT_SELFPLAY_ONLY);
+  }
+
+  // Reported, but too long before the sweep.
+  now += kMaxDelay;
+  mgr.updateClients();
+  touch(a, 10);
+  now += kMaxDelay;
+  mgr.updateClients();
+  EXPECT_FALSE(a.IsActive());
+  touch(a, 11);
+  mgr.updateClients();
+  EXPECT_TRUE(a.IsActive());
+}
+
+TEST(ClientManagerTest, ConcurrentClients) {
+  constexpr int kNumThreads = 8;
+  constexpr int kNumClients = 200;
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(2, kMaxDelay, -1, 0.5, -1, [&]() { return now.load(); });
+
+  std::vector<std::vector<ClientInfo*>> seen(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kNumClients; ++i) {
+        ClientInfo& c = mgr.getClient(std::to_string(i));
+        touch(c, t);
+        seen[t].push_back(&c);
+        if (i % 16 == 0) {
+          mgr.updateClients();
+        }
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  for (int t = 1; t < kNumThreads; ++t) {
+    EXPECT_EQ(seen[t], seen[0]);
+  }
+  EXPECT_EQ(mgr.getNumEval(), size_t(kNumClients / 2));
+
+  now += kMaxDelay;
+  mgr.updateClients();
+  EXPECT_EQ(mgr.getNumEval(), 0u);
+  EXPECT_FALSE(seen[0][0]->IsActive());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <fstream>
 #include "client_manager.h"
 #include "ctrl_utils.h"
@@ -42,7 +43,14 @@ class ModelPerf {
         new fair_pick::Pick(num_request, num_eval_machine_per_layer));
     record_.resetPrefix(
         eval_prefix() + "-" + std::to_string(p.black_ver) + "-" +
-        std::to_string(p.white_ver));
+        std::to_string(p.white_ver),
+        options.binary_records);
+    if (options.eval_sprt_margin > 0.0) {
+      sprt_.reset(new fair_pick::Sprt(fair_pick::Sprt::around(
+          options.eval_thres,
+          options.eval_sprt_margin,
+          options.eval_sprt_error)));
+    }
   }
 
   ModelPerf(ModelPerf&&) = default;
@@ -99,6 +107,7 @@ class ModelPerf {
       games_->add(c, r.result.reward);
     }
     record_.feed(r);
+    num_moves_ += r.result.num_move;
     recv_++;
   }
 
@@ -158,6 +167,12 @@ class ModelPerf {
   RecordBuffer record_;
   EvalResult eval_result_ = EVAL_INVALID;
 
+  // Ends the evaluation early if set.
+  std::unique_ptr<fair_pick::Sprt> sprt_;
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  int64_t num_moves_ = 0;
+
   static size_t compute_num_eval_machine(size_t n, size_t max_num_eval) {
     if (max_num_eval == 0)
       return 1;
@@ -185,6 +200,17 @@ class ModelPerf {
         swap_report.n_done() >= half_complete) {
       return wr >= options_.eval_thres ? EVAL_BLACK_PASS : EVAL_BLACK_NOTPASS;
     }
+    // Games of both sides, which registration keeps balanced.
+    if (sprt_ != nullptr && report.n_done() > 0 && swap_report.n_done() > 0) {
+      switch (sprt_->check(n_win(), n_done())) {
+        case fair_pick::WIN:
+          return EVAL_BLACK_PASS;
+        case fair_pick::LOSS:
+          return EVAL_BLACK_NOTPASS;
+        case fair_pick::INCOMPLETE:
+          break;
+      }
+    }
     /*
     auto res = report.CheckWinrateBound(half_complete, options_.eval_thres);
     auto swap_res = swap_report.CheckWinrateBound(half_complete,
@@ -209,6 +235,28 @@ class ModelPerf {
               << record_.prefix_save_counter() << std::endl;
     record_.saveCurrent();
     record_.clear();
+    if (sprt_ != nullptr) {
+      std::cout << "SPRT[" << curr_pair_.info()
+                << "]: " << sprt_->info(n_win(), n_done()) << ", "
+                << savings_info() << std::endl;
+    }
+  }
+
+  // The games the evaluation did not need, and an estimate of the search
+  // (moves) and time of the eval clients they would have taken.
+  std::string savings_info() const {
+    const int n = n_done();
+    const int saved = std::max(options_.eval_num_games - n, 0);
+    const double secs = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start_)
+                            .count();
+    std::stringstream ss;
+    ss << "saved " << saved << "/" << options_.eval_num_games << " games";
+    if (n > 0) {
+      ss << ", ~" << num_moves_ * saved / n << " moves, ~" << secs * saved / n
+         << " sec";
+    }
+    return ss.str();
   }
 };
 
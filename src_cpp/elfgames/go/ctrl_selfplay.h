@@ -10,7 +10,10 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <mutex>
 
 #include "client_manager.h"
 #include "ctrl_utils.h"
@@ -160,7 +163,8 @@ struct SelfPlayRecord {
       : ver_(ver), options_(options) {
     std::string selfplay_prefix =
         "selfplay-" + options_.server_id + "-" + options_.time_signature;
-    records_.resetPrefix(selfplay_prefix + "-" + std::to_string(ver_));
+    records_.resetPrefix(
+        selfplay_prefix + "-" + std::to_string(ver_), options_.binary_records);
   }
 
   void feed(const Record& record) {
@@ -332,6 +336,7 @@ class SelfPlaySubCtrl {
 
     perf->feed(r);
     total_selfplay_++;
+    sample_cv_.notify_all();
     if (total_selfplay_ % 1000 == 0) {
       std::cout << elf_utils::now()
                 << " SelfPlaySubCtrl: #total selfplay feeded: "
@@ -357,6 +362,7 @@ class SelfPlaySubCtrl {
       std::cout << "SelfPlay: " << curr_ver_ << " -> " << ver << std::endl;
       curr_ver_ = ver;
       find_or_create(curr_ver_);
+      sample_cv_.notify_all();
       return true;
     }
     return false;
@@ -364,14 +370,22 @@ class SelfPlaySubCtrl {
 
   CtrlResult needWaitForMoreSample(int64_t selfplay_ver) const {
     std::lock_guard<std::mutex> lock(mutex_);
-    if (selfplay_ver < curr_ver_)
-      return VERSION_OLD;
+    return needWaitForMoreSampleLocked(selfplay_ver);
+  }
 
-    const auto* perf = find_or_null(curr_ver_);
-    if (perf == nullptr)
-      return VERSION_INVALID;
-    return perf->needWaitForMoreSample() ? INSUFFICIENT_SAMPLE
-                                         : SUFFICIENT_SAMPLE;
+  // needWaitForMoreSample(), once it is no longer INSUFFICIENT_SAMPLE or
+  // after timeout.
+  template <typename Rep, typename Period>
+  CtrlResult waitForMoreSample(
+      int64_t selfplay_ver,
+      std::chrono::duration<Rep, Period> timeout) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    CtrlResult res = needWaitForMoreSampleLocked(selfplay_ver);
+    sample_cv_.wait_for(lock, timeout, [&]() {
+      res = needWaitForMoreSampleLocked(selfplay_ver);
+      return res != INSUFFICIENT_SAMPLE;
+    });
+    return res;
   }
 
   void notifyCurrentWeightUpdate() {
@@ -413,7 +427,20 @@ class SelfPlaySubCtrl {
   }
 
  private:
+  CtrlResult needWaitForMoreSampleLocked(int64_t selfplay_ver) const {
+    if (selfplay_ver < curr_ver_)
+      return VERSION_OLD;
+
+    const auto* perf = find_or_null(curr_ver_);
+    if (perf == nullptr)
+      return VERSION_INVALID;
+    return perf->needWaitForMoreSample() ? INSUFFICIENT_SAMPLE
+                                         : SUFFICIENT_SAMPLE;
+  }
+
   mutable std::mutex mutex_;
+  // Notified as samples are fed, or the model changes.
+  mutable std::condition_variable sample_cv_;
 
   GameOptions options_;
   TSOptions mcts_options_;
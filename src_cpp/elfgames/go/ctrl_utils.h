@@ -18,7 +18,8 @@ struct RecordBuffer {
   RecordBuffer(const RecordBuffer&) = delete;
   RecordBuffer(RecordBuffer&&) = default;
 
-  void resetPrefix(const std::string& prefix) {
+  // binary: the segments are saved as Record::dumpBatchBinaryString().
+  void resetPrefix(const std::string& prefix, bool binary = false) {
     std::lock_guard<std::mutex> lock(mutex_);
     if (!records_.empty()) {
       saveCurrent();
@@ -26,6 +27,7 @@ struct RecordBuffer {
     }
     num_saved_ = 0;
     prefix_ = prefix;
+    binary_ = binary;
   }
 
   const std::string& prefix() const {
@@ -53,11 +55,13 @@ struct RecordBuffer {
       auto it2 =
           (n > num_record_per_segment) ? (it + num_record_per_segment) : it_end;
 
-      std::string games = Record::dumpBatchJsonString(it, it2);
+      std::string games = binary_ ? Record::dumpBatchBinaryString(it, it2)
+                                  : Record::dumpBatchJsonString(it, it2);
 
       std::ofstream oo(
           prefix_ + "-" + std::to_string(num_saved_) + "-" +
-          std::to_string(counter) + ".json");
+              std::to_string(counter) + (binary_ ? ".bin" : ".json"),
+          std::ios::binary);
       oo << games;
       counter++;
       it = it2;
@@ -77,6 +81,7 @@ struct RecordBuffer {
   std::vector<Record> offline_records_;
   int num_saved_ = 0;
   std::string prefix_;
+  bool binary_ = false;
 };
 
 enum FeedResult {
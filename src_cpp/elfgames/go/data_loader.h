@@ -8,50 +8,48 @@
 
 #pragma once
 
+#include "elf/distributed/scrape_server.h"
 #include "elf/distributed/shared_rw_buffer2.h"
+#include "elf/metrics/Metrics.h"
 #include "record.h"
+#include "record_loader.h"
 
+// Streams the records of json_files (binary or JSON, see RecordFileLoader)
+// to the queues of rq, in turn.
 class DataOfflineLoaderJSON {
  public:
   using RQ = elf::shared::ReaderQueuesT<Record>;
 
-  DataOfflineLoaderJSON(RQ& rq, const std::vector<std::string>& json_files)
-      : rq_(rq), json_files_(json_files), rng_(time(NULL)) {}
+  DataOfflineLoaderJSON(
+      RQ& rq,
+      const std::vector<std::string>& json_files,
+      int num_threads = 16)
+      : rq_(rq), json_files_(json_files), loader_(num_threads) {}
 
   void start() {
-    std::vector<std::thread> threads;
-    int n = rq_.nqueue();
-    std::atomic<int> count(0);
+    const size_t n = rq_.nqueue();
+    std::atomic<size_t> next(0);
+    const size_t count =
+        loader_.load(json_files_, [&](std::vector<Record>&& records) {
+          for (auto&& r : records) {
+            rq_[next++ % n]->Insert(std::move(r));
+          }
+        });
 
-    for (const auto& f : json_files_) {
-      std::cout << "DataOfflineLoaderJSON: Reading: " << f << std::endl;
-      threads.emplace_back([f, n, this, &count]() {
-        std::vector<Record> records;
-        if (!Record::loadBatchFromJsonFile(f, &records)) {
-          std::cout << "DataOfflineLoaderJSON: Error reading " << f
-                    << std::endl;
-          return;
-        }
-        for (auto&& r : records) {
-          rq_[count.load() % n]->Insert(std::move(r));
-          count++;
-        }
-      });
-    }
-
-    for (auto& t : threads) {
-      t.join();
-    }
-
-    std::cout << "Save the records to ReaderQueues." << std::endl;
+    std::cout << "Save the records to ReaderQueues. #record: " << count
+              << std::endl;
   }
 
  private:
   RQ& rq_;
   std::vector<std::string> json_files_;
-  std::mt19937 rng_;
+  RecordFileLoader loader_;
 };
 
+// A Reader per shard (net_options.num_shards, on consecutive ports), all
+// inserting to rq: start_func and replier are called from the threads of
+// all of them. Their IngestStats are served on net_options.stats_port, with
+// the metrics of the process.
 class DataOnlineLoader {
  public:
   using RQ = elf::shared::RQInterface;
@@ -60,19 +58,49 @@ class DataOnlineLoader {
 
   DataOnlineLoader(RQ& rq, const elf::shared::Options& net_options) : rq_(rq) {
     auto curr_timestamp = time(NULL);
-    const std::string database_name =
-        "data-" + std::to_string(curr_timestamp) + ".db";
-    _reader.reset(new elf::shared::Reader(database_name, net_options));
-    std::cout << _reader->info() << std::endl;
+    const int num_shards = std::max(net_options.num_shards, 1);
+    for (int i = 0; i < num_shards; ++i) {
+      elf::shared::Options options = net_options;
+      options.port = net_options.port + i;
+      std::string database_name = "data-" + std::to_string(curr_timestamp);
+      if (num_shards > 1) {
+        database_name += "-" + std::to_string(i);
+      }
+      _readers.emplace_back(
+          new elf::shared::Reader(database_name + ".db", options));
+      std::cout << _readers.back()->info() << std::endl;
+    }
+    if (net_options.stats_port > 0) {
+      _scrape_server.reset(
+          new elf::shared::ScrapeServer(net_options.stats_port, [this]() {
+            return ingestStats().scrape() +
+                elf::metrics::Registry::global().scrape();
+          }));
+    }
   }
 
   void start(StartFunc start_func = nullptr, ReplyFunc replier = nullptr) {
-    _reader->startReceiving(&rq_, start_func, replier);
+    for (auto& reader : _readers) {
+      reader->startReceiving(&rq_, start_func, replier);
+    }
   }
 
-  ~DataOnlineLoader() {}
+  // Of all the shards.
+  elf::shared::IngestStats ingestStats() const {
+    elf::shared::IngestStats stats;
+    for (const auto& reader : _readers) {
+      stats.merge(reader->stats().snapshot());
+    }
+    return stats;
+  }
+
+  ~DataOnlineLoader() {
+    // Before the readers it reads.
+    _scrape_server.reset(nullptr);
+  }
 
  private:
   RQ& rq_;
-  std::unique_ptr<elf::shared::Reader> _reader;
+  std::vector<std::unique_ptr<elf::shared::Reader>> _readers;
+  std::unique_ptr<elf::shared::ScrapeServer> _scrape_server;
 };
@@ -6,6 +6,16 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#pragma once
+
+#include <math.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
 #include "client_manager.h"
 
 namespace fair_pick {
@@ -110,6 +120,57 @@ struct WinCount {
   int n_win_ = 0;
 };
 
+// Sequential probability ratio test of a win rate p, between H0: p = p0 and
+// H1: p = p1 > p0. WIN accepts H1, LOSS accepts H0; alpha is the probability
+// of WIN under H0, beta that of LOSS under H1. Decides after about
+// log((1 - beta) / alpha) / KL(p1 || p0) games when p = p1, far fewer than a
+// fixed number of games bounding the errors as well.
+class Sprt {
+ public:
+  Sprt(float p0, float p1, float alpha, float beta)
+      : win_(log(p1 / p0)),
+        loss_(log((1 - p1) / (1 - p0))),
+        lower_(log(beta / (1 - alpha))),
+        upper_(log((1 - beta) / alpha)) {}
+
+  // Tests H0: p = thres - margin against H1: p = thres + margin (kept within
+  // (0, 1)), with both error rates equal to error.
+  static Sprt around(float thres, float margin, float error) {
+    const float eps = 1e-3;
+    return Sprt(
+        std::max(thres - margin, eps),
+        std::min(thres + margin, 1 - eps),
+        error,
+        error);
+  }
+
+  // Log likelihood ratio of H1 over H0.
+  double llr(int n_win, int n_done) const {
+    return n_win * win_ + (n_done - n_win) * loss_;
+  }
+
+  WinCountEstimate check(int n_win, int n_done) const {
+    const double r = llr(n_win, n_done);
+    if (r >= upper_)
+      return WIN;
+    if (r <= lower_)
+      return LOSS;
+    return INCOMPLETE;
+  }
+
+  std::string info(int n_win, int n_done) const {
+    std::stringstream ss;
+    ss << "llr: " << llr(n_win, n_done) << " in [" << lower_ << ", " << upper_
+       << "]";
+    return ss.str();
+  }
+
+ private:
+  // Of a win and of a loss to the log likelihood ratio.
+  const double win_, loss_;
+  const double lower_, upper_;
+};
+
 enum RegisterResult {
   NEWLY_REGISTERED,
   REGISTERED_WAITING,
@@ -126,6 +187,10 @@ inline bool release_request(RegisterResult r) {
   return !need_request(r);
 }
 
+// Clients that registered wait in a heap by their deadline (see
+// ClientInfo::deadline()): CheckStuck() only looks at those past it, and
+// reschedules those updated since. It also looks at the stuck clients, which
+// wait again once they are updated.
 class BatchRequest {
  public:
   using Key = std::string;
@@ -140,6 +205,8 @@ class BatchRequest {
         return AT_CAPACITY;
       } else {
         requests_.insert(make_pair(c.id(), Info()));
+        waiting_[c.id()] = &c;
+        deadlines_.push(std::make_pair(c.deadline(), c.id()));
         return NEWLY_REGISTERED;
       }
     } else {
@@ -158,34 +225,54 @@ class BatchRequest {
       // "\" is not registered." << endl;
       return NOT_REGISTERED;
     }
+    const Info::Status status = it->second.status;
     if (!it->second.Add(r)) {
       // cout << hex << "[" << this << "]" << dec << "msg from \"" << c.id() <<
       // "\" overflows and is thus skipped" << endl;
       return OVERFLOW_NOT_ADDED;
     }
 
+    if (status == Info::STUCK) {
+      stucks_.erase(c.id());
+      win_count_.SetNumStuck(stucks_.size());
+    } else {
+      waiting_.erase(c.id());
+    }
     win_count_.Add(r);
 
     return NEWLY_ADDED;
   }
 
   void CheckStuck(const ClientManager& mgr) {
-    auto curr_timestamp = mgr.getCurrTimeStamp();
+    curr_timestamp_ = mgr.getCurrTimeStamp();
 
-    stucks_.clear();
-    nonstuck_zero_.clear();
-    for (auto& p : requests_) {
-      if (p.second.status == Info::SETTLED)
+    for (auto it = stucks_.begin(); it != stucks_.end();) {
+      const ClientInfo* c = it->second;
+      if (c->IsStuck(curr_timestamp_)) {
+        ++it;
         continue;
+      }
+      // Its game goes on.
+      requests_[it->first].status = Info::WAIT;
+      waiting_[it->first] = c;
+      deadlines_.push(std::make_pair(c->deadline(), it->first));
+      it = stucks_.erase(it);
+    }
 
-      uint64_t delay = 0;
-      const ClientInfo* c = mgr.getClient(p.first);
+    while (!deadlines_.empty() && deadlines_.top().first <= curr_timestamp_) {
+      const Key key = deadlines_.top().second;
+      deadlines_.pop();
+      auto it = waiting_.find(key);
+      if (it == waiting_.end())
+        continue;
 
-      if (c == nullptr || c->IsStuck(curr_timestamp, &delay)) {
-        p.second.status = Info::STUCK;
-        stucks_.push_back(p.first);
-      } else if (p.second.status == Info::WAIT) {
-        nonstuck_zero_[p.first] = delay;
+      const ClientInfo* c = it->second;
+      if (c->IsStuck(curr_timestamp_)) {
+        requests_[key].status = Info::STUCK;
+        stucks_[key] = c;
+        waiting_.erase(it);
+      } else {
+        deadlines_.push(std::make_pair(c->deadline(), key));
       }
     }
     win_count_.SetNumStuck(stucks_.size());
@@ -209,12 +296,12 @@ class BatchRequest {
   std::string stuck_info() const {
     std::stringstream ss;
     if (stucks_.size() > 0) {
-      ss << "#st: " << stucks_.size() << ", " << stucks_[0];
+      ss << "#st: " << stucks_.size() << ", " << stucks_.begin()->first;
     }
-    if (nonstuck_zero_.size() > 0) {
-      auto it = nonstuck_zero_.begin();
-      ss << ", #non_st_0: " << nonstuck_zero_.size() << ", " << it->first
-         << ", dl: " << it->second;
+    if (waiting_.size() > 0) {
+      auto it = waiting_.begin();
+      ss << ", #non_st_0: " << waiting_.size() << ", " << it->first
+         << ", dl: " << delay(*it->second);
     }
     return ss.str();
   }
@@ -224,15 +311,15 @@ class BatchRequest {
     ss << std::hex << "BatchRequest Addr: " << this << std::dec << "** ";
     if (stucks_.size() > 0) {
       ss << "#st: " << stucks_.size() << "[";
-      for (const std::string& s : stucks_) {
-        ss << s << ", ";
+      for (const auto& p : stucks_) {
+        ss << p.first << ", ";
       }
       ss << "]";
     }
-    if (nonstuck_zero_.size() > 0) {
-      ss << ", #non_st_0: " << nonstuck_zero_.size() << "[";
-      for (const auto& p : nonstuck_zero_) {
-        ss << p.first << "(dl:" << p.second << "), ";
+    if (waiting_.size() > 0) {
+      ss << ", #non_st_0: " << waiting_.size() << "[";
+      for (const auto& p : waiting_) {
+        ss << p.first << "(dl:" << delay(*p.second) << "), ";
       }
       ss << "]";
     }
@@ -243,10 +330,24 @@ class BatchRequest {
   const size_t max_num_request_;
 
   std::unordered_map<Key, Info> requests_;
-  std::vector<Key> stucks_;
-  std::unordered_map<Key, uint64_t> nonstuck_zero_;
+  // Clients are never removed from the ClientManager.
+  std::unordered_map<Key, const ClientInfo*> stucks_;
+  std::unordered_map<Key, const ClientInfo*> waiting_;
+  // Earliest first. Clients no longer waiting are dropped when they come up.
+  std::priority_queue<
+      std::pair<uint64_t, Key>,
+      std::vector<std::pair<uint64_t, Key>>,
+      std::greater<std::pair<uint64_t, Key>>>
+      deadlines_;
+  uint64_t curr_timestamp_ = 0;
 
   WinCount win_count_;
+
+  // As of the last CheckStuck().
+  uint64_t delay(const ClientInfo& c) const {
+    const uint64_t last = c.lastUpdate();
+    return curr_timestamp_ > last ? curr_timestamp_ - last : 0;
+  }
 };
 
 class Pick {
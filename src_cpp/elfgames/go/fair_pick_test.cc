@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <atomic>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "elfgames/go/fair_pick.h"
+
+namespace {
+
+// Plays games of win rate p until the test decides (or max_games), and
+// returns the decision; *n is the number of games played.
+fair_pick::WinCountEstimate
+run(const fair_pick::Sprt& sprt, float p, int max_games, int seed, int* n) {
+  std::mt19937 rng(seed);
+  std::bernoulli_distribution win(p);
+  int n_win = 0;
+  for (*n = 1; *n <= max_games; ++*n) {
+    n_win += win(rng);
+    auto res = sprt.check(n_win, *n);
+    if (res != fair_pick::INCOMPLETE) {
+      return res;
+    }
+  }
+  return fair_pick::INCOMPLETE;
+}
+
+// Makes the client update its state at the current time.
+void touch(ClientInfo& c, int seq) {
+  ThreadState ts;
+  ts.thread_id = 0;
+  ts.seq = seq;
+  c.stateUpdate(ts);
+}
+
+} // namespace
+
+TEST(FairPickTest, SprtBounds) {
+  // H0: p = 0.5, H1: p = 0.6, and log(19) to cross.
+  const auto sprt = fair_pick::Sprt::around(0.55, 0.05, 0.05);
+  EXPECT_EQ(sprt.check(16, 16), fair_pick::INCOMPLETE);
+  EXPECT_EQ(sprt.check(17, 17), fair_pick::WIN);
+  EXPECT_EQ(sprt.check(0, 13), fair_pick::INCOMPLETE);
+  EXPECT_EQ(sprt.check(0, 14), fair_pick::LOSS);
+  EXPECT_EQ(sprt.check(55, 100), fair_pick::INCOMPLETE);
+  EXPECT_NEAR(sprt.llr(0, 0), 0.0, 1e-9);
+}
+
+TEST(FairPickTest, SprtDecidesEarly) {
+  const auto sprt = fair_pick::Sprt::around(0.55, 0.05, 0.05);
+  constexpr int kRuns = 200;
+  constexpr int kMaxGames = 400;
+  int wrong = 0, total = 0;
+  for (int i = 0; i < kRuns; ++i) {
+    int n = 0;
+    wrong += run(sprt, 0.7, kMaxGames, i, &n) != fair_pick::WIN;
+    total += n;
+    wrong += run(sprt, 0.4, kMaxGames, kRuns + i, &n) != fair_pick::LOSS;
+    total += n;
+  }
+  EXPECT_LE(wrong, 4);
+  EXPECT_LT(total / (2 * kRuns), kMaxGames / 4);
+
+  // Errors within (about) the rates at the bounds of the test.
+  wrong = 0;
+  for (int i = 0; i < kRuns; ++i) {
+    int n = 0;
+    wrong += run(sprt, 0.5, 100000, 2 * kRuns + i, &n) == fair_pick::WIN;
+  }
+  EXPECT_LE(wrong, kRuns / 10);
+}
+
+// Only the clients past their deadline are stuck; a stuck client may still
+// settle its request.
+TEST(FairPickTest, CheckStuck) {
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(1, 100, -1, 0.5, -1, [&]() { return now.load(); });
+  ClientInfo& a = mgr.getClient("a");
+  ClientInfo& b = mgr.getClient("b");
+  ClientInfo& c = mgr.getClient("c");
+  touch(a, 1);
+  touch(b, 1);
+  touch(c, 1);
+
+  fair_pick::BatchRequest request(3);
+  EXPECT_EQ(request.Reg(a), fair_pick::NEWLY_REGISTERED);
+  EXPECT_EQ(request.Reg(b), fair_pick::NEWLY_REGISTERED);
+  EXPECT_EQ(request.Reg(c), fair_pick::NEWLY_REGISTERED);
+  EXPECT_EQ(request.Add(a, 1.0), fair_pick::NEWLY_ADDED);
+
+  now += 99;
+  touch(b, 2);
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 0);
+
+  // a settled, b was updated since.
+  now += 1;
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 1);
+  EXPECT_FALSE(request.IsDone());
+  EXPECT_EQ(request.Reg(c), fair_pick::REGISTERED_SETTLED);
+
+  now += 99;
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 2);
+  EXPECT_TRUE(request.IsDone());
+
+  EXPECT_EQ(request.Add(c, -1.0), fair_pick::NEWLY_ADDED);
+  EXPECT_EQ(request.win_count().n_stuck(), 1);
+  EXPECT_EQ(request.win_count().n_done(), 2);
+  EXPECT_TRUE(request.IsDone());
+}
+
+// A stuck client that is updated again waits for its result, and the round
+// is not done without it.
+TEST(FairPickTest, StuckClientRecovers) {
+  std::atomic<uint64_t> now(1000);
+  ClientManager mgr(1, 100, -1, 0.5, -1, [&]() { return now.load(); });
+  ClientInfo& a = mgr.getClient("a");
+  ClientInfo& b = mgr.getClient("b");
+
+  fair_pick::BatchRequest request(2);
+  EXPECT_EQ(request.Reg(a), fair_pick::NEWLY_REGISTERED);
+  EXPECT_EQ(request.Reg(b), fair_pick::NEWLY_REGISTERED);
+  EXPECT_EQ(request.Add(a, 1.0), fair_pick::NEWLY_ADDED);
+
+  now += 100;
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 1);
+  EXPECT_TRUE(request.IsDone());
+
+  touch(b, 1);
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 0);
+  EXPECT_FALSE(request.IsDone());
+  EXPECT_EQ(request.Reg(b), fair_pick::REGISTERED_WAITING);
+
+  // Stuck again, then settled.
+  now += 100;
+  request.CheckStuck(mgr);
+  EXPECT_EQ(request.win_count().n_stuck(), 1);
+  EXPECT_EQ(request.Add(b, -1.0), fair_pick::NEWLY_ADDED);
+  EXPECT_EQ(request.win_count().n_stuck(), 0);
+  EXPECT_EQ(request.win_count().n_done(), 2);
+  EXPECT_TRUE(request.IsDone());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
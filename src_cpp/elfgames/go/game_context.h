@@ -8,16 +8,23 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 // TODO: Figure out how to remove this (ssengupta@fb)
 #include <time.h>
 
+#include "analysis_server.h"
 #include "base/board_feature.h"
 #include "data_loader.h"
 #include "elf/base/context.h"
+#include "elf/distributed/compression.h"
 #include "elf/legacy/python_options_utils_cpp.h"
 #include "game_selfplay.h"
 #include "game_train.h"
@@ -30,8 +37,27 @@ class GameContext {
  public:
   GameContext(const ContextOptions& context_options, const GameOptions& options)
       : _context_options(context_options), _go_feature(options) {
+    // Before the arenas are allocated.
+    elf::concurrency::setHugePages(
+        elf::concurrency::parseHugePages(context_options.huge_pages));
     _context.reset(new elf::Context);
 
+    int numa_node = context_options.numa_collector_node;
+    if (numa_node < 0 && !context_options.gpu_pci_bus_id.empty()) {
+      numa_node = elf::concurrency::getPciDeviceNumaNode(
+          context_options.gpu_pci_bus_id);
+    }
+    _context->setAffinity(elf::concurrency::AffinityPolicy(numa_node));
+    _context->setNumGameThreads(context_options.num_game_threads);
+    _context->setNumSearchThreads(context_options.num_search_threads);
+    if (!context_options.batch_capture.empty()) {
+      elf::BatchCaptureOptions capture;
+      capture.path = context_options.batch_capture;
+      capture.max_batches = context_options.batch_capture_max;
+      _context->setBatchRecorder(
+          std::make_shared<elf::BatchRecorder>(capture));
+    }
+
     auto net_options = get_net_options(context_options, options);
     auto curr_timestamp = time(NULL);
 
@@ -50,9 +76,19 @@ class GameContext {
     } else if (options.mode == "online") {
       _eval_ctrl.reset(new EvalCtrl(
           _context->getClient(), _writer.get(), options, num_games));
+    } else if (options.mode == "analysis") {
+      _analysis.reset(new AnalysisServer(
+          _context->getClient(), context_options.mcts_options, options));
     } else if (options.mode == "train") {
       init_reader(num_games, options, context_options.mcts_options);
       _online_loader.reset(new DataOnlineLoader(*_reader, net_options));
+      if (net_options.pub_port > 0) {
+        _publisher.reset(new elf::distri::ZMQPublisher(
+            net_options.pub_port, net_options.use_ipv6));
+        _train_ctrl->setOnUpdate([&](const std::string& msg) {
+          _publisher->publish("update", msg);
+        });
+      }
 
       auto start_func = [&]() { _train_ctrl->RegRecordSender(); };
 
@@ -72,10 +108,16 @@ class GameContext {
 
     } else if (options.mode == "offline_train") {
       init_reader(num_games, options, context_options.mcts_options);
-      _offline_loader.reset(
-          new DataOfflineLoaderJSON(*_reader, options.list_files));
-      _offline_loader->start();
-      std::cout << _reader->info() << std::endl;
+      if (!options.dataset.empty()) {
+        // Mapped, not loaded.
+        _dataset.reset(new GameDataset(options.dataset));
+        std::cout << _dataset->info() << std::endl;
+      } else {
+        _offline_loader.reset(
+            new DataOfflineLoaderJSON(*_reader, options.list_files));
+        _offline_loader->start();
+        std::cout << _reader->info() << std::endl;
+      }
       _train_ctrl->RegRecordSender();
       perform_training = true;
 
@@ -90,24 +132,60 @@ class GameContext {
     _go_feature.registerExtractor(batchsize, _context->getExtractor());
 
     if (perform_training) {
-      for (int i = 0; i < num_games; ++i) {
-        _games.emplace_back(new GoGameTrain(
+      if (options.checkpoint_interval > 0) {
+        _checkpoints.reset(new BoardCheckpoints(
+            options.checkpoint_interval,
+            (size_t)options.checkpoint_cache_mb << 20));
+      }
+      make_games(num_games, [&](int i) {
+        return new GoGameTrain(
             i,
             _context->getClient(),
             context_options,
             options,
             _train_ctrl.get(),
-            _reader.get()));
-      }
-    } else {
-      for (int i = 0; i < num_games; ++i) {
-        _games.emplace_back(new GoGameSelfPlay(
+            _reader.get(),
+            _dataset.get(),
+            _checkpoints.get());
+      });
+    } else if (_analysis != nullptr) {
+      make_games(num_games, [&](int i) {
+        return new GoGameAnalysis(
             i,
             _context->getClient(),
             context_options,
             options,
-            _eval_ctrl.get()));
+            _analysis.get());
+      });
+    } else {
+      if (options.eval_cache_mb > 0) {
+        _eval_cache.reset(
+            new EvalCache((size_t)options.eval_cache_mb << 20));
       }
+      if (options.opening_book_plies > 0 && options.mode == "selfplay") {
+        _opening_book.reset(new OpeningBook(
+            options.opening_book_plies,
+            options.opening_book_searches,
+            (size_t)options.opening_book_mb << 20));
+      }
+      if (!options.dump_record_prefix.empty() && options.dump_record_archive) {
+        ArtifactWriterOptions artifact_options;
+        artifact_options.prefix = options.dump_record_prefix;
+        artifact_options.zstd_level = options.dump_record_zstd_level;
+        _artifacts.reset(new ArtifactWriter(artifact_options));
+        std::cout << _artifacts->info() << std::endl;
+      }
+      make_games(num_games, [&](int i) {
+        return new GoGameSelfPlay(
+            i,
+            _context->getClient(),
+            context_options,
+            options,
+            _eval_ctrl.get(),
+            _eval_cache.get(),
+            _artifacts.get(),
+            _opening_book.get());
+      });
     }
 
     _context->setStartCallback(num_games, [this](int i, elf::GameClient*) {
@@ -155,6 +233,37 @@ class GameContext {
     _train_ctrl->setEvalMode(new_ver, old_ver);
   }
 
+  // Of the clients sending to the server (empty on other modes).
+  elf::shared::IngestStats getIngestStats() const {
+    return _online_loader != nullptr ? _online_loader->ingestStats()
+                                     : elf::shared::IngestStats();
+  }
+
+  // Hit rate of the network replies shared by the games (empty if none).
+  std::string getEvalCacheInfo() const {
+    return _eval_cache != nullptr ? _eval_cache->info() : "";
+  }
+
+  // Opening positions played from the book (empty if none).
+  std::string getOpeningBookInfo() const {
+    return _opening_book != nullptr ? _opening_book->info() : "";
+  }
+
+  // A request line to the analysis server, see AnalysisServer. progress
+  // gets the snapshots of "analyze k interval" while it searches.
+  std::string analysis(
+      const std::string& line,
+      AnalysisServer::Progress progress = nullptr) {
+    if (_analysis == nullptr) {
+      return "? not in analysis mode";
+    }
+    return _analysis->request(line, std::move(progress));
+  }
+
+  std::string getAnalysisInfo() const {
+    return _analysis != nullptr ? _analysis->info() : "";
+  }
+
   // Used in client side.
   void setRequest(
       int64_t black_ver,
@@ -193,9 +302,17 @@ class GameContext {
 
     // cout << "Ending writer" << endl;
     _writer.reset(nullptr);
+    _publisher.reset(nullptr);
 
     // cout << "Ending games" << endl;
     _games.clear();
+    _dataset.reset(nullptr);
+    _checkpoints.reset(nullptr);
+    _eval_cache.reset(nullptr);
+    _opening_book.reset(nullptr);
+    _analysis.reset(nullptr);
+    // Writes the pending dumps.
+    _artifacts.reset(nullptr);
 
     // cout << "Ending context" << endl;
     _context.reset(nullptr);
@@ -213,10 +330,19 @@ class GameContext {
   std::unique_ptr<EvalCtrl> _eval_ctrl;
 
   std::unique_ptr<elf::shared::Writer> _writer;
+  // Outlives _reader, which appends to it.
+  std::unique_ptr<elf::shared::SegmentStore> _replay_store;
   std::unique_ptr<elf::shared::ReaderQueuesT<Record>> _reader;
 
   std::unique_ptr<DataOfflineLoaderJSON> _offline_loader;
+  std::unique_ptr<GameDataset> _dataset;
+  std::unique_ptr<BoardCheckpoints> _checkpoints;
+  std::unique_ptr<EvalCache> _eval_cache;
+  std::unique_ptr<OpeningBook> _opening_book;
+  std::unique_ptr<ArtifactWriter> _artifacts;
+  std::unique_ptr<AnalysisServer> _analysis;
   std::unique_ptr<DataOnlineLoader> _online_loader;
+  std::unique_ptr<elf::distri::ZMQPublisher> _publisher;
 
   GoFeature _go_feature;
 
@@ -230,6 +356,14 @@ class GameContext {
     net_options.use_ipv6 = true;
     net_options.verbose = options.verbose;
     net_options.identity = context_options.job_id;
+    net_options.compression_level = options.compression_level;
+    net_options.compression_dict = options.compression_dict;
+    net_options.spill_dir = options.spill_dir;
+    net_options.num_shards = options.num_shards;
+    net_options.shard_addrs = options.shard_addrs;
+    net_options.failover_sec = options.failover_sec;
+    net_options.pub_port = options.pub_port;
+    net_options.stats_port = options.stats_port;
 
     return net_options;
   }
@@ -239,49 +373,27 @@ class GameContext {
       return;
 
     std::atomic<int> count(0);
-    const size_t num_thread = 16;
-
-    auto thread_main = [&options, this, &count, num_thread](size_t idx) {
-      for (size_t k = 0; k * num_thread + idx < options.list_files.size();
-           ++k) {
-        const std::string& f = options.list_files[k * num_thread + idx];
-        std::cout << "Load offline data: Reading: " << f << std::endl;
-
-        std::vector<Record> records;
-        if (!Record::loadBatchFromJsonFile(f, &records)) {
-          std::cout << "Offline data loading: Error reading " << f << std::endl;
-          return;
-        }
-
-        for (auto& r : records) {
-          r.offline = true;
-        }
+    RecordFileLoader loader(16);
+    loader.load(options.list_files, [&](std::vector<Record>&& records) {
+      for (auto& r : records) {
+        r.offline = true;
+      }
 
-        std::vector<FeedResult> res = _train_ctrl->onSelfplayGames(records);
+      std::vector<FeedResult> res = _train_ctrl->onSelfplayGames(records);
 
-        std::mt19937 rng(time(NULL));
+      std::mt19937 rng(time(NULL));
 
-        // If the record does not fit in _train_ctrl,
-        // we should just send it directly to the replay buffer.
-        for (size_t i = 0; i < records.size(); ++i) {
-          if (res[i] == FeedResult::FEEDED ||
-              res[i] == FeedResult::VERSION_MISMATCH) {
-            bool black_win = records[i].result.reward > 0;
-            _reader->InsertWithParity(std::move(records[i]), &rng, black_win);
-            count++;
-          }
+      // If the record does not fit in _train_ctrl,
+      // we should just send it directly to the replay buffer.
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (res[i] == FeedResult::FEEDED ||
+            res[i] == FeedResult::VERSION_MISMATCH) {
+          bool black_win = records[i].result.reward > 0;
+          _reader->InsertWithParity(std::move(records[i]), &rng, black_win);
+          count++;
         }
       }
-    };
-
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < num_thread; ++i) {
-      threads.emplace_back(std::bind(thread_main, i));
-    }
-
-    for (auto& t : threads) {
-      t.join();
-    }
+    });
 
     std::cout << "All offline data are loaded. #record read: " << count
               << " from " << options.list_files.size() << " files."
@@ -289,6 +401,36 @@ class GameContext {
     std::cout << _reader->info() << std::endl;
   }
 
+  // Games are independent until they start: with a thousand of them per
+  // host, building them on all the cores shortens startup.
+  void make_games(int num_games, std::function<GoGameBase*(int)> make) {
+    _games.resize(num_games);
+    const int num_threads = std::max(
+        1, std::min(num_games, (int)std::thread::hardware_concurrency()));
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&]() {
+        for (int i = next++; i < num_games; i = next++) {
+          try {
+            _games[i].reset(make(i));
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            error = std::current_exception();
+          }
+        }
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+
   void init_reader(
       int num_games,
       const GameOptions& options,
@@ -297,29 +439,124 @@ class GameContext {
     ctrl.num_reader = options.num_reader;
     ctrl.ctrl.queue_min_size = options.q_min_size;
     ctrl.ctrl.queue_max_size = options.q_max_size;
+    ctrl.ctrl.sampling = options.sampling;
+    ctrl.ctrl.recency_decay = options.recency_decay;
+    ctrl.ctrl.version_window = options.replay_version_window;
+    const std::string& quotas = options.replay_version_quotas;
+    for (const auto& q : elf_utils::split(quotas, ',')) {
+      if (!q.empty()) {
+        ctrl.ctrl.version_quotas.push_back(std::stod(q));
+      }
+    }
 
-    auto converter =
-        [this](const std::string& s, std::vector<Record>* rs) -> bool {
-      if (rs == nullptr)
-        return false;
+    // Messages are parsed on the decoding threads of the Reader.
+    auto decode = [](const std::string& s, Records* records) -> bool {
       try {
-        _train_ctrl->onReceive(s);
-        rs->clear();
+        *records = Records::createFromString(s);
         return true;
       } catch (...) {
         std::cout << "Data malformed! ..." << std::endl;
-        std::cout << s << std::endl;
         return false;
       }
     };
+    auto apply = [this](Records&& records, std::vector<Record>* rs) -> bool {
+      _train_ctrl->onReceive(records);
+      rs->clear();
+      return true;
+    };
 
     _reader.reset(new elf::shared::ReaderQueuesT<Record>(ctrl));
+    // Records of clients that do not set a priority count as 1.
+    _reader->setPriority(
+        [](const Record& r) -> double { return r.pri > 0 ? r.pri : 1.0; });
+    _reader->setSizeFunc(
+        [](const Record& r) -> size_t { return r.memoryBytes(); });
+    if (options.replay_pack_level > 0) {
+      setReplayPacking(options.replay_pack_level);
+    }
+    // The newest model of the game.
+    auto version = [](const Record& r) -> int64_t {
+      const auto& models = r.result.using_models;
+      return models.empty() ? r.request.vers.black_ver
+                            : *std::max_element(models.begin(), models.end());
+    };
+    _reader->setStratum(version);
+    _reader->setVersion(version);
+
+    if (!options.replay_dir.empty()) {
+      elf::shared::SegmentStoreOptions store_options;
+      store_options.dir = options.replay_dir;
+      store_options.segment_size = (size_t)options.replay_segment_mb << 20;
+      store_options.max_segments = options.replay_max_segments;
+      _replay_store.reset(new elf::shared::SegmentStore(store_options));
+
+      auto decode_record = [](const char* p, size_t n, Record* r) -> bool {
+        try {
+          *r = Record::createFromBinaryString(p, n);
+          return true;
+        } catch (...) {
+          return false;
+        }
+      };
+      const size_t n = _reader->loadStore(
+          *_replay_store, options.replay_load_segments, decode_record);
+      std::cout << "Restored " << n << " records from " << options.replay_dir
+                << std::endl;
+      _reader->setStore(
+          _replay_store.get(), [](const Record& r, std::string* buf) {
+            r.appendBinaryString(buf);
+          });
+      std::cout << _replay_store->info() << std::endl;
+    }
     _train_ctrl.reset(new TrainCtrl(
         num_games, _context->getClient(), _reader.get(), options, mcts_opt));
-    _reader->setConverter(converter);
+    auto timestamps = [](const Records& records, std::vector<uint64_t>* ts) {
+      for (const auto& r : records.records) {
+        ts->push_back(r.timestamp);
+      }
+    };
+    _reader->setConverter<Records>(decode, apply, timestamps);
     std::cout << _reader->info() << std::endl;
   }
 
+  // Records are kept in the replay buffer as binary strings, compressed if
+  // zstd is available, and decoded when sampled. Each thread packs and
+  // unpacks with its own compressor and buffer.
+  void setReplayPacking(int level) {
+    auto compressor = [level]() -> elf::distri::Compressor& {
+      thread_local std::unique_ptr<elf::distri::Compressor> c;
+      if (c == nullptr) {
+        c.reset(new elf::distri::Compressor(level, ""));
+      }
+      return *c;
+    };
+    auto pack = [compressor](const Record& r, std::string* buf) {
+      thread_local std::string raw;
+      raw.clear();
+      r.appendBinaryString(&raw);
+      if (!compressor().compress(raw, buf, false)) {
+        *buf = raw;
+      }
+    };
+    auto unpack = [compressor](const std::string& buf, Record* r) {
+      try {
+        if (isBinary(buf)) {
+          *r = Record::createFromBinaryString(buf.data(), buf.size());
+          return true;
+        }
+        thread_local std::string raw;
+        if (!compressor().decompress(buf, &raw)) {
+          return false;
+        }
+        *r = Record::createFromBinaryString(raw.data(), raw.size());
+        return true;
+      } catch (...) {
+        return false;
+      }
+    };
+    _reader->setPacking(pack, unpack);
+  }
+
   bool _check_game_idx(int game_idx) const {
     return game_idx < 0 || game_idx >= (int)_games.size();
   }
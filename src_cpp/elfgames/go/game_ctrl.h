@@ -9,6 +9,7 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -23,17 +24,20 @@
 #include "ctrl_selfplay.h"
 #include "elf/base/context.h"
 #include "elf/base/ctrl.h"
+#include "elf/concurrency/Broadcast.h"
 #include "elf/concurrency/ConcurrentQueue.h"
 #include "elf/concurrency/Counter.h"
+#include "elf/logging/Logging.h"
 
 #include "game_stats.h"
 #include "go_game_specific.h"
 #include "go_state_ext.h"
 
 using namespace std::chrono_literals;
+// Games may wait on their mailboxes in fibers.
 using ThreadedCtrlBase =
-    elf::ThreadedCtrlBase<elf::concurrency::ConcurrentQueue>;
-using Ctrl = elf::CtrlT<elf::concurrency::ConcurrentQueue>;
+    elf::ThreadedCtrlBase<elf::concurrency::ConcurrentQueueFutex>;
+using Ctrl = elf::CtrlT<elf::concurrency::ConcurrentQueueFutex>;
 using Addr = elf::Addr;
 
 struct CtrlInfo {
@@ -82,68 +86,97 @@ struct CtrlInfo {
 class ThreadedDispatcher : public ThreadedCtrlBase {
  public:
   ThreadedDispatcher(CtrlInfo& info)
-      : ThreadedCtrlBase(info.ctrl, 500), ctrl_info_(info) {
-    start<std::pair<Addr, MsgRestart>, MsgRestart, MsgRequest>();
+      : ThreadedCtrlBase(info.ctrl),
+        ctrl_info_(info),
+        games_(info.num_games) {
+    start<MsgRequest>();
   }
 
   // Called by game threads
   void RegGame(int game_idx) {
-    ctrl_.RegMailbox<MsgRequest, MsgRestart>(
-        "game_" + std::to_string(game_idx));
+    assert(game_idx >= 0 && game_idx < (int)games_.size());
+    // Requests are broadcast (see requests_); the address is for
+    // Ctrl::process().
+    ctrl_.RegMailbox<>("game_" + std::to_string(game_idx));
     // cout << "Register game " << game_idx << endl;
     game_counter_.increment();
   }
 
   MsgRestart BroadcastReceiveIfDifferent(
+      int game_idx,
       const MsgRequest& old_request,
       std::function<MsgRestart(MsgRequest&&)> on_receive) {
-    MsgRequest request = old_request;
-    MsgRestart msg;
-
-    if (!request.vers.wait()) {
-      if (!ctrl_.peekMail(&request, 0)) {
-        return MsgRestart();
-      }
-    } else {
-      ctrl_.waitMail(&request);
+    GameSlot& game = games_[game_idx];
+    Requests::SnapshotP snapshot = old_request.vers.wait()
+        ? requests_.wait(game.version)
+        : requests_.peek(game.version);
+    if (snapshot == nullptr) {
+      return MsgRestart();
+    }
+    game.version = snapshot->version;
+
+    // Games beyond the number used wait.
+    const PublishedRequest& published = snapshot->value;
+    MsgRequest request = published.request;
+    if (game_idx >= published.num_games_used) {
+      request = MsgRequest();
+      request.vers.set_wait();
     }
 
     // Once you receive, you need to send a reply.
-    msg = on_receive(std::move(request));
-    ctrl_.sendMail(addr_, std::make_pair(ctrl_.getAddr(), msg));
+    MsgRestart msg = on_receive(std::move(request));
+    game.reply = msg;
+    replies_.increment();
 
     // Wait for confirm from the other side. If result is nontrivial.
     if (msg.result == RestartReply::UPDATE_MODEL) {
-      // std::cout << "[" << msg.game_idx << "] On receive done. " << endl;
-      MsgRestart msg2;
-      ctrl_.waitMail(&msg2);
-      // std::cout << "[" << msg.game_idx << "] Broadcast update complete. " <<
-      // endl;
+      confirmed_.waitUntilCount(game.version);
     }
     return msg;
   }
 
  protected:
+  struct PublishedRequest {
+    MsgRequest request;
+    int num_games_used;
+  };
+  using Requests = elf::concurrency::Broadcast<PublishedRequest>;
+
+  // Owned by its game thread; reply is read by the dispatcher once all
+  // games have replied.
+  struct GameSlot {
+    int64_t version = 0;
+    MsgRestart reply;
+  };
+
   CtrlInfo& ctrl_info_;
   MsgRequest curr_request_;
   elf::concurrency::Counter<int> game_counter_;
 
+  Requests requests_;
+  std::vector<GameSlot> games_;
+  // Replies of the games to all the requests so far.
+  elf::concurrency::AtomicCounter<int64_t> replies_;
+  int64_t num_replies_ = 0;
+  // Version up to which games updating their model may start.
+  elf::concurrency::AtomicCounter<int64_t> confirmed_;
+
   std::string start_target_ = "game_start";
+  std::shared_ptr<spdlog::logger> logger_ =
+      elf::logging::getIndexedLogger("ThreadedDispatcher-");
 
   void before_loop() override {
     // Wait for all games + this processing thread.
     int num_games = ctrl_info_.num_games;
-    std::cout << "Wait all games[" << num_games << "] to register their mailbox"
-              << std::endl;
+    logger_->info("Wait all games[{}] to register", num_games);
     game_counter_.waitUntilCount(num_games);
     game_counter_.reset();
-    std::cout << "All games [" << num_games << "] registered" << std::endl;
+    logger_->info("All games [{}] registered", num_games);
   }
 
-  void on_thread() override {
-    // cout << "Register Recv threads" << endl;
+  void on_wait(std::chrono::microseconds timeout) override {
     MsgRequest msg;
-    if (ctrl_.peekMail(&msg, 0)) {
+    if (ctrl_.peekMail(&msg, timeout.count())) {
       process_request(msg);
     }
   }
@@ -154,41 +187,27 @@ class ThreadedDispatcher : public ThreadedCtrlBase {
       return false;
     }
 
-    std::cout << elf_utils::now()
-              << ", EvalCtrl get new request: " << request.info() << std::endl;
+    logger_->info("EvalCtrl get new request: {}", request.info());
     curr_request_ = request;
 
-    MsgRequest wait_request;
-    wait_request.vers.set_wait();
-
-    std::vector<Addr> addrs = ctrl_.filterPrefix(std::string("game"));
-    // std::cout << "EvalCtrl: #addrs: " << addrs.size() << std::endl;
-
     // Check request
-    size_t n = curr_request_.client_ctrl.num_game_thread_used < 0
-        ? addrs.size()
+    const int num_games = games_.size();
+    const int n = curr_request_.client_ctrl.num_game_thread_used < 0
+        ? num_games
         : curr_request_.client_ctrl.num_game_thread_used;
 
-    for (size_t i = 0; i < addrs.size(); ++i) {
-      const size_t thread_idx = stoi(addrs[i].label.substr(5));
-      if (thread_idx < n)
-        ctrl_.sendMail(addrs[i], request);
-      else
-        ctrl_.sendMail(addrs[i], wait_request);
-    }
-
-    std::pair<Addr, MsgRestart> msg;
-    std::vector<Addr> addrs_to_reply;
-    bool update_model = false;
+    const int64_t version = requests_.publish({request, n});
 
     // Wait until we get all confirmations.
-    for (size_t i = 0; i < addrs.size(); ++i) {
-      ctrl_.waitMail(&msg);
-      // std::cout << "EvalCtrl: Get confirm from " << msg.second.result << ",
-      // game_idx = " << msg.second.game_idx << std::endl;
-      switch (msg.second.result) {
+    num_replies_ += num_games;
+    replies_.waitUntilCount(num_replies_);
+
+    int num_to_reply = 0;
+    bool update_model = false;
+    for (const GameSlot& game : games_) {
+      switch (game.reply.result) {
         case RestartReply::UPDATE_MODEL:
-          addrs_to_reply.push_back(msg.first);
+          num_to_reply++;
           update_model = true;
           break;
         case RestartReply::UPDATE_MODEL_ASYNC:
@@ -201,18 +220,18 @@ class ThreadedDispatcher : public ThreadedCtrlBase {
 
     if (update_model) {
       // Once it is done, send to Python side.
-      std::cout << elf_utils::now() << " Get actionable request: black_ver = "
-                << request.vers.black_ver
-                << ", white_ver = " << request.vers.white_ver
-                << ", #addrs_to_reply: " << addrs_to_reply.size() << std::endl;
+      logger_->info(
+          "Get actionable request: black_ver = {}, white_ver = {}, "
+          "#addrs_to_reply: {}",
+          request.vers.black_ver,
+          request.vers.white_ver,
+          num_to_reply);
       elf::FuncsWithState funcs = ctrl_info_.client->BindStateToFunctions(
           {start_target_}, &request.vers);
       ctrl_info_.client->sendWait({start_target_}, &funcs);
     }
 
-    for (const auto& addr : addrs_to_reply) {
-      ctrl_.sendMail(addr, MsgRestart());
-    }
+    confirmed_.set(version);
     return true;
   }
 };
@@ -220,18 +239,18 @@ class ThreadedDispatcher : public ThreadedCtrlBase {
 class ThreadedSelfplay : public ThreadedCtrlBase {
  public:
   ThreadedSelfplay(CtrlInfo& info)
-      : ThreadedCtrlBase(info.ctrl, 10000), ctrl_info_(info), rng_(time(NULL)) {
+      : ThreadedCtrlBase(info.ctrl), ctrl_info_(info), rng_(time(NULL)) {
     start<int64_t>();
   }
 
   void waitForSufficientSelfplay(int64_t selfplay_ver) {
+    // Returns as soon as the sample that makes it sufficient is fed.
     SelfPlaySubCtrl::CtrlResult res;
-    while (
-        (res = ctrl_info_.selfplay_ctrl->needWaitForMoreSample(selfplay_ver)) ==
-        SelfPlaySubCtrl::CtrlResult::INSUFFICIENT_SAMPLE) {
+    while ((res = ctrl_info_.selfplay_ctrl->waitForMoreSample(
+                selfplay_ver, 30s)) ==
+           SelfPlaySubCtrl::CtrlResult::INSUFFICIENT_SAMPLE) {
       std::cout << elf_utils::now() << ", Insufficient sample for model "
-                << selfplay_ver << "... waiting 30s" << std::endl;
-      std::this_thread::sleep_for(30s);
+                << selfplay_ver << "... waiting" << std::endl;
     }
 
     if (res == SelfPlaySubCtrl::CtrlResult::SUFFICIENT_SAMPLE) {
@@ -253,9 +272,9 @@ class ThreadedSelfplay : public ThreadedCtrlBase {
 
   std::string train_ctrl_ = "train_ctrl";
 
-  void on_thread() override {
+  void on_wait(std::chrono::microseconds timeout) override {
     int64_t ver;
-    if (!ctrl_.peekMail(&ver, 0))
+    if (!ctrl_.peekMail(&ver, timeout.count()))
       return;
 
     ctrl_info_.eval_ctrl->setBaselineModel(ver);
@@ -289,19 +308,56 @@ class ThreadedSelfplay : public ThreadedCtrlBase {
   }
 };
 
+// Sends the records of the games to the server, in reply to its requests:
+// once there are options.writer_batch_records of them, or the oldest is
+// options.writer_batch_sec old (the thread states alone are sent as often).
 class ThreadedWriterCtrl : public ThreadedCtrlBase {
  public:
   ThreadedWriterCtrl(CtrlInfo& info, const Addr& request_dest)
-      : ThreadedCtrlBase(info.ctrl, 0),
+      : ThreadedCtrlBase(info.ctrl),
         ctrl_info_(info),
         request_destination_(request_dest),
-        records_(info.writer->identity()) {
+        records_(info.writer->identity()),
+        batch_records_(std::max(info.options.writer_batch_records, 1)),
+        batch_age_(std::chrono::seconds(info.options.writer_batch_sec)) {
+    // An update of the server (e.g. a new model) flushes the batch, so that
+    // the reply brings the new request at once.
+    ctrl_info_.writer->setOnUpdate([this](const std::string&) {
+      std::lock_guard<std::mutex> lock(record_mutex_);
+      updated_ = true;
+      batch_cv_.notify_all();
+    });
+    every(std::chrono::seconds(10), [this]() {
+      if (Clock::now() - last_reply_ < std::chrono::seconds(10)) {
+        return;
+      }
+      std::cout << elf_utils::now() << ", WriterCtrl: no message"
+                << (ctrl_info_.writer->busy() ? " (server busy)" : "")
+                << ", #held: " << ctrl_info_.writer->numHeld() << std::endl;
+    });
     start<>();
   }
 
+  // The thread waits on our members.
+  ~ThreadedWriterCtrl() {
+    ctrl_info_.writer->setOnUpdate(nullptr);
+    done_ = true;
+    batch_cv_.notify_all();
+    if (thread_ != nullptr) {
+      thread_->join();
+      thread_.reset();
+    }
+  }
+
   void feed(const GoStateExt& s) {
     std::lock_guard<std::mutex> lock(record_mutex_);
+    if (records_.isRecordEmpty()) {
+      oldest_record_ = std::chrono::steady_clock::now();
+    }
     records_.addRecord(s.dumpRecord());
+    if ((int)records_.records.size() >= batch_records_) {
+      batch_cv_.notify_all();
+    }
   }
 
   void updateState(const ThreadState& ts) {
@@ -315,18 +371,24 @@ class ThreadedWriterCtrl : public ThreadedCtrlBase {
 
   std::mutex record_mutex_;
   Records records_;
+  // When records_ got its first record.
+  std::chrono::steady_clock::time_point oldest_record_;
+  const int batch_records_;
+  const std::chrono::steady_clock::duration batch_age_;
+  std::condition_variable batch_cv_;
+  // Whether the server published an update since the last batch.
+  bool updated_ = false;
   int64_t seq_ = 0;
+  // Binary version of the records the server reads, from its last reply.
+  int wire_version_ = 0;
+  Clock::time_point last_reply_ = Clock::now();
 
-  void on_thread() {
+  void on_wait(std::chrono::microseconds timeout) override {
     std::string smsg;
-    // Will block..
-    if (!ctrl_info_.writer->getReplyNoblock(&smsg)) {
-      std::cout << elf_utils::now()
-                << ", WriterCtrl: no message, sleep for a while .. "
-                << std::endl;
-      std::this_thread::sleep_for(10s);
+    if (!ctrl_info_.writer->getReply(&smsg, timeout)) {
       return;
     }
+    last_reply_ = Clock::now();
 
     std::cout << elf_utils::now() << " In reply func: Message got..."
               << std::endl;
@@ -339,17 +401,21 @@ class ThreadedWriterCtrl : public ThreadedCtrlBase {
                 << "] in the msg is different from " << seq_ << std::endl;
     }
 
+    wire_version_ = msg.wire_version;
     ctrl_.sendMail(request_destination_, msg.request);
 
-    if (msg.request.vers.wait()) {
-      std::this_thread::sleep_for(30s);
-    } else {
-      if (records_.isRecordEmpty())
-        std::this_thread::sleep_for(60s);
-    }
-
-    // Send data.
-    std::lock_guard<std::mutex> lock(record_mutex_);
+    std::unique_lock<std::mutex> lock(record_mutex_);
+    const auto replied = std::chrono::steady_clock::now();
+    // Without records to send (e.g. while the server waits for a model),
+    // the states are sent after batch_age_.
+    batch_cv_.wait_until(
+        lock,
+        (records_.isRecordEmpty() ? replied : oldest_record_) + batch_age_,
+        [this]() {
+          return done_.load() || updated_ ||
+              (int)records_.records.size() >= batch_records_;
+        });
+    updated_ = false;
 
     /*
     std::cout << "Sending state update[" << records_.identity << "][" <<
@@ -362,7 +428,10 @@ class ThreadedWriterCtrl : public ThreadedCtrlBase {
               << "], #records: " << records_.records.size()
               << ", #states: " << records_.states.size() << std::endl;
 
-    ctrl_info_.writer->Insert(records_.dumpJsonString());
+    // Queued to the writer, which sends it on its thread.
+    ctrl_info_.writer->Insert(
+        wire_version_ >= kBinaryVersion ? records_.dumpBinaryString()
+                                        : records_.dumpJsonString());
     records_.clear();
     seq_ = msg.seq + 1;
   }
@@ -410,6 +479,7 @@ class TrainCtrl {
       ctrl_info_.selfplay_ctrl->setCurrModel(
           ctrl_info_.eval_ctrl->getBestModel());
     }
+    notify_update();
     return true;
   }
 
@@ -420,6 +490,7 @@ class TrainCtrl {
     ctrl_info_.eval_ctrl->setBaselineModel(old_ver);
     ctrl_info_.eval_ctrl->addNewModelForEvaluation(old_ver, new_ver);
     eval_mode_ = true;
+    notify_update();
     return true;
   }
 
@@ -428,8 +499,10 @@ class TrainCtrl {
       // And send a message to start the process.
       threaded_selfplay_->template sendToThread<int64_t>(new_version);
       threaded_selfplay_->waitForNewSelfplayModelReady();
+      notify_update();
     } else {
       ctrl_info_.eval_ctrl->addNewModelForEvaluation(selfplay_ver, new_version);
+      notify_update();
       // For offline training, we don't need to wait..
       if (ctrl_info_.options.mode != "offline_train") {
         threaded_selfplay_->waitForSufficientSelfplay(selfplay_ver);
@@ -441,6 +514,12 @@ class TrainCtrl {
     threaded_selfplay_->waitForSufficientSelfplay(selfplay_ver);
   }
 
+  // f(msg) is called when the models to play change, with a json of the
+  // selfplay version and whether a model is evaluated, for the clients.
+  void setOnUpdate(std::function<void(const std::string&)> f) {
+    on_update_ = f;
+  }
+
   // Call by writer thread.
   // Return invalid indices.
   std::vector<FeedResult> onSelfplayGames(const std::vector<Record>& records) {
@@ -469,12 +548,14 @@ class TrainCtrl {
     return res;
   }
 
-  void onReceive(const std::string& s) {
-    Records records = Records::createFromJsonString(s);
+  // Called from the Readers of all the shards.
+  void onReceive(const Records& records) {
+    std::lock_guard<std::mutex> lock(receive_mutex_);
     ctrl_info_.ctrl.process(records);
   }
 
   void onReply(const std::string& identity, std::string* msg) {
+    std::lock_guard<std::mutex> lock(receive_mutex_);
     ClientInfo& info = ctrl_info_.client_mgr->getClient(identity);
 
     if (info.justAllocated()) {
@@ -485,6 +566,7 @@ class TrainCtrl {
     MsgRequestSeq request;
     fill_in_request(info, &request.request);
     request.seq = info.seq();
+    request.wire_version = kBinaryVersion;
     *msg = request.dumpJsonString();
     info.incSeq();
   }
@@ -547,12 +629,23 @@ class TrainCtrl {
     if (new_model >= 0) {
       threaded_selfplay_->template sendToThread<int64_t>(new_model);
       threaded_selfplay_->waitForNewSelfplayModelReady();
+      notify_update();
       return true;
     }
 
     return false;
   }
 
+  void notify_update() {
+    if (on_update_ == nullptr) {
+      return;
+    }
+    json j;
+    j["selfplay_ver"] = ctrl_info_.selfplay_ctrl->getCurrModel();
+    j["eval_mode"] = eval_mode_;
+    on_update_(j.dump());
+  }
+
   void fill_in_request(const ClientInfo& info, MsgRequest* request) {
     request->vers.set_wait();
     request->client_ctrl.client_type = info.type();
@@ -580,8 +673,11 @@ class TrainCtrl {
   bool eval_mode_ = false;
 
   std::unique_ptr<ThreadedSelfplay> threaded_selfplay_;
+  std::function<void(const std::string&)> on_update_;
   int recv_count_ = 0;
   std::mt19937 rng_;
+  // Serializes the messages of the shards.
+  std::mutex receive_mutex_;
 };
 
 // Ctrl for evaluation/selfplay client.
@@ -621,11 +717,12 @@ class EvalCtrl {
   }
 
   MsgRestart BroadcastReceiveIfDifferent(
+      int game_idx,
       const MsgRequest& old_request,
       std::function<MsgRestart(MsgRequest&&)> on_receive) {
     assert(recv_threaded_ctrl_ != nullptr);
     return recv_threaded_ctrl_->BroadcastReceiveIfDifferent(
-        old_request, on_receive);
+        game_idx, old_request, on_receive);
   }
 
   void updateState(const ThreadState& ts) {
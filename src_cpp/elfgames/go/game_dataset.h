@@ -0,0 +1,540 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "elf/concurrency/HugePages.h"
+
+#include "record.h"
+#include "record_loader.h"
+#include "sgf/sgf.h"
+
+// Games for offline training, in columns of a file that is mapped as is: a
+// position is sampled by reading its game's entry, then the moves (packed
+// uint16_t coords), policy and value it needs, without parsing the game.
+//
+// Layout: a Header, then the columns, each at a multiple of 8 bytes:
+//   games:         GameEntry per game, the index of the other columns;
+//   moves:         uint16_t per move, of all the games one after the other;
+//   policy_sizes:  uint16_t per move, its number of policy entries;
+//   values:        float per move, the predicted value (0 if unknown);
+//   policy_coords: uint16_t per policy entry (see CoordRecord);
+//   policy_probs:  uint8_t per policy entry.
+class GameDataset {
+ public:
+  static constexpr uint32_t kMagic = 0x44464c45; // "ELFD"
+  static constexpr uint32_t kVersion = 1;
+
+  enum Column {
+    COL_GAMES = 0,
+    COL_MOVES,
+    COL_POLICY_SIZES,
+    COL_VALUES,
+    COL_POLICY_COORDS,
+    COL_POLICY_PROBS,
+    NUM_COLUMNS
+  };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    // Of the board, which the coords depend on.
+    uint32_t bound_coord;
+    uint32_t reserved;
+    uint64_t num_games;
+    uint64_t num_moves;
+    uint64_t num_policy_entries;
+    // Byte offsets of the columns in the file.
+    uint64_t offsets[NUM_COLUMNS];
+  };
+
+  static constexpr uint32_t kHasPolicies = 1;
+  static constexpr uint32_t kHasValues = 2;
+  // Moves with an empty policy got a fast search, and are not training
+  // targets (see MsgResult::full_search).
+  static constexpr uint32_t kFastMoves = 4;
+
+  struct GameEntry {
+    // Of its first move in the columns of moves, and of its first entry in
+    // those of policy entries.
+    uint64_t move_offset;
+    uint64_t policy_offset;
+    uint32_t num_moves;
+    uint32_t flags;
+    float reward;
+    int32_t seq;
+    int64_t black_ver;
+    int64_t white_ver;
+    uint64_t timestamp;
+  };
+
+  // A game of the dataset, valid while the dataset is.
+  class Game {
+   public:
+    Game(const GameDataset& d, const GameEntry& e) : d_(d), e_(e) {}
+
+    const GameEntry& entry() const {
+      return e_;
+    }
+
+    size_t numMoves() const {
+      return e_.num_moves;
+    }
+
+    Coord move(size_t i) const {
+      return d_.moves_[e_.move_offset + i];
+    }
+
+    void moves(std::vector<Coord>* res) const {
+      const uint16_t* p = d_.moves_ + e_.move_offset;
+      res->assign(p, p + e_.num_moves);
+    }
+
+    float value(size_t i) const {
+      return d_.values_[e_.move_offset + i];
+    }
+
+    void values(std::vector<float>* res) const {
+      if (!(e_.flags & kHasValues)) {
+        res->clear();
+        return;
+      }
+      const float* p = d_.values_ + e_.move_offset;
+      res->assign(p, p + e_.num_moves);
+    }
+
+    bool hasPolicies() const {
+      return e_.flags & kHasPolicies;
+    }
+
+    bool isTarget(size_t i) const {
+      return !(e_.flags & kFastMoves) ||
+          d_.policy_sizes_[e_.move_offset + i] > 0;
+    }
+
+    // Policy of move i: the entries of the moves before it are skipped by
+    // their sizes.
+    void policy(size_t i, CoordRecord* res) const {
+      const uint16_t* sizes = d_.policy_sizes_ + e_.move_offset;
+      uint64_t offset = e_.policy_offset;
+      for (size_t k = 0; k < i; ++k) {
+        offset += sizes[k];
+      }
+      res->entries.resize(sizes[i]);
+      for (size_t k = 0; k < res->entries.size(); ++k) {
+        res->entries[k].coord = d_.policy_coords_[offset + k];
+        res->entries[k].prob = d_.policy_probs_[offset + k];
+      }
+    }
+
+    // The whole game, e.g. to check a conversion.
+    Record toRecord() const {
+      Record r;
+      std::vector<Coord> ms;
+      moves(&ms);
+      r.result.content = coords2sgfstr(ms);
+      r.result.num_move = ms.size();
+      r.result.reward = e_.reward;
+      r.request.vers.black_ver = e_.black_ver;
+      r.request.vers.white_ver = e_.white_ver;
+      r.seq = e_.seq;
+      r.timestamp = e_.timestamp;
+      r.offline = true;
+      if (hasPolicies()) {
+        r.result.policies.resize(ms.size());
+        for (size_t i = 0; i < ms.size(); ++i) {
+          policy(i, &r.result.policies[i]);
+        }
+      }
+      values(&r.result.values);
+      if (e_.flags & kFastMoves) {
+        for (size_t i = 0; i < ms.size(); ++i) {
+          r.result.full_search.push_back(isTarget(i));
+        }
+      }
+      return r;
+    }
+
+   private:
+    const GameDataset& d_;
+    const GameEntry& e_;
+  };
+
+  // Maps path; throws std::runtime_error if it is not a dataset of this
+  // board.
+  explicit GameDataset(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error(
+          "GameDataset: cannot open " + path + ": " + strerror(errno));
+    }
+    size_ = st.st_size;
+    // Positions are read at random: with huge pages, from a copy in them,
+    // rather than from the 4 KB pages of the page cache.
+    void* p = size_ > 0 && readToHugePages(fd) ? region_.data() : MAP_FAILED;
+    if (p == MAP_FAILED && size_ > 0) {
+      p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        madvise(p, size_, MADV_RANDOM);
+      }
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::runtime_error("GameDataset: cannot map " + path);
+    }
+    data_ = static_cast<const char*>(p);
+
+    try {
+      check(path);
+    } catch (...) {
+      unmap();
+      throw;
+    }
+  }
+
+  GameDataset(const GameDataset&) = delete;
+  GameDataset& operator=(const GameDataset&) = delete;
+
+  ~GameDataset() {
+    unmap();
+  }
+
+  size_t numGames() const {
+    return header_.num_games;
+  }
+
+  size_t numMoves() const {
+    return header_.num_moves;
+  }
+
+  Game game(size_t i) const {
+    return Game(*this, games_[i]);
+  }
+
+  // A game with the odds of its number of moves, so that positions are
+  // sampled uniformly.
+  size_t sampleGame(std::mt19937* rng) const {
+    if (numGames() == 0) {
+      throw std::runtime_error("GameDataset: no game");
+    }
+    const uint64_t m =
+        std::uniform_int_distribution<uint64_t>(0, numMoves() - 1)(*rng);
+    // The last game starting at or before m.
+    auto it = std::upper_bound(
+        games_,
+        games_ + numGames(),
+        m,
+        [](uint64_t v, const GameEntry& e) { return v < e.move_offset; });
+    return it - games_ - 1;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "GameDataset: #games: " << numGames() << ", #moves: " << numMoves()
+       << ", #policy entries: " << header_.num_policy_entries
+       << ", size: " << size_ << " bytes";
+    return ss.str();
+  }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  // Holds data_ if read to huge pages, rather than mapped.
+  elf::concurrency::HugePageRegion region_;
+  Header header_;
+
+  const GameEntry* games_ = nullptr;
+  const uint16_t* moves_ = nullptr;
+  const uint16_t* policy_sizes_ = nullptr;
+  const float* values_ = nullptr;
+  const uint16_t* policy_coords_ = nullptr;
+  const uint8_t* policy_probs_ = nullptr;
+
+  // Reads the file to region_, if the huge pages policy is on.
+  bool readToHugePages(int fd) {
+    if (elf::concurrency::getHugePages() == elf::concurrency::HugePages::OFF) {
+      return false;
+    }
+    try {
+      region_ = elf::concurrency::HugePageRegion(size_, "dataset");
+    } catch (const std::bad_alloc&) {
+      return false;
+    }
+    char* buf = static_cast<char*>(region_.data());
+    size_t n = 0;
+    while (n < size_) {
+      const ssize_t r = pread(fd, buf + n, size_ - n, n);
+      if (r <= 0) {
+        region_.reset();
+        return false;
+      }
+      n += r;
+    }
+    return true;
+  }
+
+  void unmap() {
+    if (region_.data() != nullptr) {
+      region_.reset();
+    } else {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  void check(const std::string& path) {
+    if (size_ < sizeof(Header)) {
+      throw std::runtime_error("GameDataset: truncated " + path);
+    }
+    memcpy(&header_, data_, sizeof(header_));
+    if (header_.magic != kMagic || header_.version > kVersion ||
+        header_.bound_coord != BOUND_COORD) {
+      throw std::runtime_error(
+          "GameDataset: " + path + " is not a dataset of this board");
+    }
+    const uint64_t n[NUM_COLUMNS] = {
+        header_.num_games * sizeof(GameEntry),
+        header_.num_moves * sizeof(uint16_t),
+        header_.num_moves * sizeof(uint16_t),
+        header_.num_moves * sizeof(float),
+        header_.num_policy_entries * sizeof(uint16_t),
+        header_.num_policy_entries * sizeof(uint8_t),
+    };
+    for (int c = 0; c < NUM_COLUMNS; ++c) {
+      if (header_.offsets[c] % 8 != 0 || header_.offsets[c] > size_ ||
+          n[c] > size_ - header_.offsets[c]) {
+        throw std::runtime_error("GameDataset: truncated " + path);
+      }
+    }
+    games_ = column<GameEntry>(COL_GAMES);
+    moves_ = column<uint16_t>(COL_MOVES);
+    policy_sizes_ = column<uint16_t>(COL_POLICY_SIZES);
+    values_ = column<float>(COL_VALUES);
+    policy_coords_ = column<uint16_t>(COL_POLICY_COORDS);
+    policy_probs_ = column<uint8_t>(COL_POLICY_PROBS);
+
+    for (size_t i = 0; i < numGames(); ++i) {
+      const GameEntry& e = games_[i];
+      if (e.move_offset + e.num_moves > header_.num_moves ||
+          e.policy_offset > header_.num_policy_entries ||
+          (i > 0 && e.move_offset < games_[i - 1].move_offset)) {
+        throw std::runtime_error("GameDataset: bad game entry in " + path);
+      }
+    }
+  }
+
+  template <typename T>
+  const T* column(Column c) const {
+    return reinterpret_cast<const T*>(data_ + header_.offsets[c]);
+  }
+};
+
+// Writes a GameDataset. Columns are appended to temporary files next to path
+// while games are added, then put together by finish().
+class GameDatasetWriter {
+ public:
+  explicit GameDatasetWriter(const std::string& path) : path_(path) {
+    for (int c = 0; c < GameDataset::NUM_COLUMNS; ++c) {
+      columns_[c].open(tmpPath(c), std::ios::binary | std::ios::trunc);
+      if (!columns_[c]) {
+        throw std::runtime_error("GameDatasetWriter: cannot write " + path);
+      }
+    }
+  }
+
+  GameDatasetWriter(const GameDatasetWriter&) = delete;
+  GameDatasetWriter& operator=(const GameDatasetWriter&) = delete;
+
+  ~GameDatasetWriter() {
+    if (!finished_) {
+      try {
+        finish();
+      } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+      }
+    }
+  }
+
+  // Thread safe. Returns false for a game without moves.
+  bool add(const std::vector<Coord>& moves, const Record& r) {
+    if (moves.empty()) {
+      return false;
+    }
+    std::vector<uint16_t> policy_sizes(moves.size(), 0);
+    std::vector<float> values(moves.size(), 0.0);
+    std::vector<uint16_t> coords;
+    std::vector<uint8_t> probs;
+    const auto& policies = r.result.policies;
+    for (size_t i = 0; i < moves.size() && i < policies.size(); ++i) {
+      policy_sizes[i] = policies[i].entries.size();
+      for (const auto& e : policies[i].entries) {
+        coords.push_back(e.coord);
+        probs.push_back(e.prob);
+      }
+    }
+    std::copy_n(
+        r.result.values.begin(),
+        std::min(moves.size(), r.result.values.size()),
+        values.begin());
+
+    GameDataset::GameEntry e;
+    memset(&e, 0, sizeof(e));
+    e.num_moves = moves.size();
+    e.flags = (policies.empty() ? 0 : GameDataset::kHasPolicies) |
+        (r.result.values.empty() ? 0 : GameDataset::kHasValues) |
+        (r.result.full_search.empty() ? 0 : GameDataset::kFastMoves);
+    e.reward = r.result.reward;
+    e.seq = r.seq;
+    e.black_ver = r.request.vers.black_ver;
+    e.white_ver = r.request.vers.white_ver;
+    e.timestamp = r.timestamp;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    e.move_offset = header_.num_moves;
+    e.policy_offset = header_.num_policy_entries;
+    write(GameDataset::COL_GAMES, &e, 1);
+    const std::vector<uint16_t> packed(moves.begin(), moves.end());
+    write(GameDataset::COL_MOVES, packed.data(), packed.size());
+    write(
+        GameDataset::COL_POLICY_SIZES,
+        policy_sizes.data(),
+        policy_sizes.size());
+    write(GameDataset::COL_VALUES, values.data(), values.size());
+    write(GameDataset::COL_POLICY_COORDS, coords.data(), coords.size());
+    write(GameDataset::COL_POLICY_PROBS, probs.data(), probs.size());
+    header_.num_games++;
+    header_.num_moves += moves.size();
+    header_.num_policy_entries += coords.size();
+    return true;
+  }
+
+  bool add(const Record& r) {
+    return add(sgfstr2coords(r.result.content), r);
+  }
+
+  // The main variation of sgf, as a game of versions -1.
+  bool add(const Sgf& sgf) {
+    std::vector<Coord> moves;
+    for (auto it = sgf.begin();
+         !it.done() && (int)moves.size() < sgf.numMoves();
+         ++it) {
+      moves.push_back(it.getCoord());
+    }
+    Record r;
+    r.request.vers.black_ver = -1;
+    r.request.vers.white_ver = -1;
+    r.result.reward = sgf.getWinner() == S_BLACK ? 1.0 : -1.0;
+    return add(moves, r);
+  }
+
+  // Writes the file. Returns the number of games.
+  uint64_t finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    header_.magic = GameDataset::kMagic;
+    header_.version = GameDataset::kVersion;
+    header_.bound_coord = BOUND_COORD;
+
+    uint64_t offset = align(sizeof(GameDataset::Header));
+    for (int c = 0; c < GameDataset::NUM_COLUMNS; ++c) {
+      columns_[c].close();
+      header_.offsets[c] = offset;
+      offset = align(offset + sizes_[c]);
+    }
+
+    const std::string tmp = path_ + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+      for (int c = 0; c < GameDataset::NUM_COLUMNS; ++c) {
+        pad(out, header_.offsets[c]);
+        std::ifstream in(tmpPath(c), std::ios::binary);
+        if (sizes_[c] > 0) {
+          out << in.rdbuf();
+        }
+      }
+      if (!out) {
+        throw std::runtime_error("GameDatasetWriter: cannot write " + tmp);
+      }
+    }
+    for (int c = 0; c < GameDataset::NUM_COLUMNS; ++c) {
+      remove(tmpPath(c).c_str());
+    }
+    if (rename(tmp.c_str(), path_.c_str()) != 0) {
+      throw std::runtime_error("GameDatasetWriter: cannot write " + path_);
+    }
+    return header_.num_games;
+  }
+
+  // Converts files of records and ".sgf" collections (see RecordFileLoader)
+  // to a dataset at path. Returns the number of games.
+  static uint64_t convert(
+      const std::vector<std::string>& files,
+      const std::string& path,
+      int num_threads = 16) {
+    GameDatasetWriter writer(path);
+    RecordFileLoader(num_threads)
+        .load(files, [&writer](std::vector<Record>&& records) {
+          for (const auto& r : records) {
+            writer.add(r);
+          }
+        });
+    return writer.finish();
+  }
+
+ private:
+  const std::string path_;
+  std::mutex mutex_;
+  std::ofstream columns_[GameDataset::NUM_COLUMNS];
+  uint64_t sizes_[GameDataset::NUM_COLUMNS] = {0};
+  GameDataset::Header header_ = GameDataset::Header();
+  bool finished_ = false;
+
+  std::string tmpPath(int c) const {
+    return path_ + ".col" + std::to_string(c);
+  }
+
+  template <typename T>
+  void write(int c, const T* p, size_t n) {
+    columns_[c].write(reinterpret_cast<const char*>(p), n * sizeof(T));
+    sizes_[c] += n * sizeof(T);
+  }
+
+  static uint64_t align(uint64_t n) {
+    return (n + 7) / 8 * 8;
+  }
+
+  static void pad(std::ofstream& out, uint64_t offset) {
+    while ((uint64_t)out.tellp() < offset) {
+      out.put(0);
+    }
+  }
+};
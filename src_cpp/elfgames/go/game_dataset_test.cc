@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "elfgames/go/game_dataset.h"
+
+namespace {
+
+std::string tmpPath(const std::string& name) {
+  return testing::TempDir() + "game_dataset_test_" + name;
+}
+
+Record makeGame(int seq, int num_moves) {
+  std::vector<Coord> moves;
+  for (int i = 0; i < num_moves; ++i) {
+    moves.push_back(getCoord(i % BOARD_SIZE, i / BOARD_SIZE));
+  }
+  Record r;
+  r.request.vers.black_ver = seq;
+  r.request.vers.white_ver = -1;
+  r.result.content = coords2sgfstr(moves);
+  r.result.num_move = num_moves;
+  r.result.reward = seq % 2 == 0 ? 1.0 : -1.0;
+  r.result.policies.resize(num_moves);
+  r.result.values.resize(num_moves);
+  for (int i = 0; i < num_moves; ++i) {
+    for (int k = 0; k <= i % 3; ++k) {
+      r.result.policies[i].entries.push_back({uint16_t(i + k), uint8_t(k)});
+    }
+    r.result.values[i] = 0.5 * i;
+  }
+  r.timestamp = 1000 + seq;
+  r.seq = seq;
+  return r;
+}
+
+void expectSame(const CoordRecord& p1, const CoordRecord& p2) {
+  unsigned char prob1[BOUND_COORD], prob2[BOUND_COORD];
+  p1.toDense(prob1);
+  p2.toDense(prob2);
+  EXPECT_EQ(0, memcmp(prob1, prob2, BOUND_COORD));
+}
+
+} // namespace
+
+TEST(GameDatasetTest, RoundTrip) {
+  const std::string path = tmpPath("round_trip");
+  std::vector<Record> games = {makeGame(0, 5), makeGame(1, 1)};
+  games.push_back(makeGame(2, 3));
+  games.back().result.policies.clear();
+  games.back().result.values.clear();
+  {
+    GameDatasetWriter writer(path);
+    for (const auto& r : games) {
+      EXPECT_TRUE(writer.add(r));
+    }
+    EXPECT_FALSE(writer.add(Record()));
+    EXPECT_EQ(writer.finish(), 3u);
+  }
+
+  GameDataset d(path);
+  ASSERT_EQ(d.numGames(), 3u);
+  EXPECT_EQ(d.numMoves(), 9u);
+  for (size_t i = 0; i < games.size(); ++i) {
+    const Record r = d.game(i).toRecord();
+    EXPECT_EQ(r.result.content, games[i].result.content);
+    EXPECT_EQ(r.result.num_move, games[i].result.num_move);
+    EXPECT_EQ(r.result.reward, games[i].result.reward);
+    EXPECT_EQ(r.request.vers.black_ver, games[i].request.vers.black_ver);
+    EXPECT_EQ(r.seq, games[i].seq);
+    EXPECT_EQ(r.timestamp, games[i].timestamp);
+    EXPECT_EQ(r.result.values, games[i].result.values);
+    ASSERT_EQ(r.result.policies.size(), games[i].result.policies.size());
+    for (size_t k = 0; k < r.result.policies.size(); ++k) {
+      expectSame(r.result.policies[k], games[i].result.policies[k]);
+    }
+  }
+  const GameDataset::Game g = d.game(0);
+  EXPECT_TRUE(g.hasPolicies());
+  EXPECT_FALSE(d.game(2).hasPolicies());
+  EXPECT_EQ(g.move(4), getCoord(4, 0));
+  EXPECT_EQ(g.value(4), 2.0);
+  CoordRecord policy;
+  g.policy(2, &policy);
+  expectSame(policy, games[0].result.policies[2]);
+  remove(path.c_str());
+}
+
+TEST(GameDatasetTest, KeepsFastMoves) {
+  const std::string path = tmpPath("fast_moves");
+  Record r = makeGame(0, 4);
+  r.result.full_search = {1, 0, 0, 1};
+  r.result.policies[1].entries.clear();
+  r.result.policies[2].entries.clear();
+  {
+    GameDatasetWriter writer(path);
+    writer.add(makeGame(1, 2));
+    writer.add(r);
+    writer.finish();
+  }
+  GameDataset d(path);
+  EXPECT_TRUE(d.game(0).isTarget(0));
+  EXPECT_TRUE(d.game(0).isTarget(1));
+  const GameDataset::Game g = d.game(1);
+  EXPECT_TRUE(g.isTarget(0));
+  EXPECT_FALSE(g.isTarget(1));
+  EXPECT_FALSE(g.isTarget(2));
+  EXPECT_TRUE(g.isTarget(3));
+  EXPECT_EQ(g.toRecord().result.full_search, r.result.full_search);
+  EXPECT_TRUE(d.game(0).toRecord().result.full_search.empty());
+  remove(path.c_str());
+}
+
+TEST(GameDatasetTest, SamplesGamesByMoves) {
+  const std::string path = tmpPath("sample");
+  {
+    GameDatasetWriter writer(path);
+    writer.add(makeGame(0, 1));
+    writer.add(makeGame(1, 9));
+    writer.finish();
+  }
+  GameDataset d(path);
+  std::mt19937 rng(1);
+  int counts[2] = {0, 0};
+  for (int i = 0; i < 1000; ++i) {
+    const size_t k = d.sampleGame(&rng);
+    ASSERT_LT(k, 2u);
+    counts[k]++;
+  }
+  EXPECT_GT(counts[0], 50);
+  EXPECT_LT(counts[0], 150);
+  remove(path.c_str());
+}
+
+// With huge pages, the dataset is read to them rather than mapped.
+TEST(GameDatasetTest, ReadsToHugePages) {
+  const std::string path = tmpPath("huge_pages");
+  {
+    GameDatasetWriter writer(path);
+    writer.add(makeGame(0, 5));
+    writer.add(makeGame(1, 2));
+    writer.finish();
+  }
+  elf::concurrency::setHugePages(elf::concurrency::HugePages::THP);
+  {
+    GameDataset d(path);
+    ASSERT_EQ(d.numGames(), 2u);
+    EXPECT_EQ(d.numMoves(), 7u);
+    EXPECT_EQ(d.game(0).move(4), getCoord(4, 0));
+    EXPECT_EQ(d.game(1).toRecord().result.values, makeGame(1, 2).result.values);
+  }
+  elf::concurrency::setHugePages(elf::concurrency::HugePages::OFF);
+  remove(path.c_str());
+}
+
+TEST(GameDatasetTest, AddsSgf) {
+  const std::string path = tmpPath("sgf");
+  Sgf sgf;
+  ASSERT_TRUE(sgf.load(
+      "", "(;SZ[9]KM[6.5]RE[W+1.5]GM[1];B[fd];W[cf];B[eg];W[dd])"));
+  {
+    GameDatasetWriter writer(path);
+    EXPECT_TRUE(writer.add(sgf));
+    writer.finish();
+  }
+  GameDataset d(path);
+  ASSERT_EQ(d.numGames(), 1u);
+  const GameDataset::Game g = d.game(0);
+  ASSERT_EQ(g.numMoves(), 4u);
+  EXPECT_EQ(g.move(0), str2coord("fd"));
+  EXPECT_EQ(g.move(3), str2coord("dd"));
+  EXPECT_EQ(g.entry().reward, -1.0);
+  EXPECT_FALSE(g.hasPolicies());
+  remove(path.c_str());
+}
+
+TEST(GameDatasetTest, RejectsBadFiles) {
+  const std::string path = tmpPath("bad");
+  EXPECT_THROW(GameDataset(path + ".missing"), std::runtime_error);
+  {
+    std::ofstream out(path, std::ios::binary);
+    out << "[1, 2, 3]";
+  }
+  EXPECT_THROW(GameDataset d(path), std::runtime_error);
+
+  {
+    GameDatasetWriter writer(path);
+    writer.add(makeGame(0, 5));
+    writer.finish();
+  }
+  std::string data;
+  {
+    std::ifstream in(path, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size() - 8);
+  }
+  EXPECT_THROW(GameDataset d(path), std::runtime_error);
+  remove(path.c_str());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
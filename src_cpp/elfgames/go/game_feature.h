@@ -11,14 +11,32 @@
 #include "base/go_state.h"
 #include "go_game_specific.h"
 #include "go_state_ext.h"
+#include "mcts/ai.h"
 
 #include "elf/base/extractor.h"
 
-enum SpecialActionType { SA_SKIP = -100, SA_PASS, SA_RESIGN, SA_CLEAR };
-
 class GoFeature {
  public:
+  // Layout of the "s" planes, reported to Python as params["input_format"].
+  enum InputFormat { INPUT_FLOAT = 0, INPUT_UINT8, INPUT_BITS };
+
   GoFeature(const GameOptions& options) : options_(options) {
+    if (options.input_format == "float") {
+      _input_format = INPUT_FLOAT;
+    } else if (options.input_format == "uint8") {
+      _input_format = INPUT_UINT8;
+    } else if (options.input_format == "bits") {
+      _input_format = INPUT_BITS;
+    } else {
+      throw std::range_error(
+          "Option.input_format not recognized! " + options.input_format);
+    }
+    // DF planes (liberties, history, distances) are not binary.
+    if (options.use_df_feature && _input_format != INPUT_FLOAT) {
+      throw std::range_error(
+          "Option.input_format must be float with use_df_feature");
+    }
+
     if (options.use_df_feature) {
       _num_plane = MAX_NUM_FEATURE;
       _our_stone_plane = OUR_STONES;
@@ -39,35 +57,12 @@ class GoFeature {
     bf.extractAGZ(f);
   }
 
-  static void ReplyValue(GoReply& reply, const float* value) {
-    reply.value = *value;
-  }
-
-  static void ReplyPolicy(GoReply& reply, const float* pi) {
-    copy(pi, pi + reply.pi.size(), reply.pi.begin());
-  }
-
-  static void ReplyAction(GoReply& reply, const int64_t* action) {
-    switch ((SpecialActionType)*action) {
-      case SA_RESIGN:
-        reply.c = M_RESIGN;
-        break;
-      case SA_SKIP:
-        reply.c = M_SKIP;
-        break;
-      case SA_PASS:
-        reply.c = M_PASS;
-        break;
-      case SA_CLEAR:
-        reply.c = M_CLEAR;
-        break;
-      default:
-        reply.c = reply.bf.action2Coord(*action);
-    }
+  static void extractStateAGZUInt8(const BoardFeature& bf, uint8_t* f) {
+    bf.extractAGZ(f);
   }
 
-  static void ReplyVersion(GoReply& reply, const int64_t* ver) {
-    reply.version = *ver;
+  static void extractStateAGZBits(const BoardFeature& bf, uint8_t* f) {
+    bf.extractAGZBits(f);
   }
 
   /////////////
@@ -94,17 +89,32 @@ class GoFeature {
     extractStateAGZ(s._bf, f);
   }
 
+  static void extractStateExtAGZUInt8(
+      const GoStateExtOffline& s,
+      uint8_t* f) {
+    extractStateAGZUInt8(s._bf, f);
+  }
+
+  static void extractStateExtAGZBits(const GoStateExtOffline& s, uint8_t* f) {
+    extractStateAGZBits(s._bf, f);
+  }
+
   static void extractMCTSPi(const GoStateExtOffline& s, float* mcts_scores) {
     const BoardFeature& bf = s._bf;
     const size_t move_to = s._state.getPly() - 1;
+    const std::vector<CoordRecord>& policies = s.policies();
 
     std::fill(mcts_scores, mcts_scores + BOARD_NUM_ACTION, 0.0);
-    if (move_to < s._mcts_policies.size()) {
-      const auto& policy = s._mcts_policies[move_to].prob;
+    // Empty for fast searches (see GoStateExt::addSearchKind()).
+    if (move_to < policies.size() && !policies[move_to].entries.empty()) {
       float sum_v = 0.0;
-      for (size_t i = 0; i < BOARD_NUM_ACTION; ++i) {
-        mcts_scores[i] = policy[bf.action2Coord(i)];
-        sum_v += mcts_scores[i];
+      for (const auto& e : policies[move_to].entries) {
+        const int64_t a = bf.coord2Action(e.coord);
+        // Only the coords of actions.
+        if (bf.action2Coord(a) == e.coord) {
+          mcts_scores[a] = e.prob;
+          sum_v += e.prob;
+        }
       }
       // Then we normalize.
       for (size_t i = 0; i < BOARD_NUM_ACTION; ++i) {
@@ -148,14 +158,29 @@ class GoFeature {
 
   void registerExtractor(int batchsize, elf::Extractor& e) {
     // Register multiple fields.
-    auto& s = e.addField<float>("s").addExtents(
-        batchsize, {batchsize, _num_plane, BOARD_SIZE, BOARD_SIZE});
-    if (options_.use_df_feature) {
-      s.addFunction<BoardFeature>(extractState)
-          .addFunction<GoStateExtOffline>(extractStateExt);
+    if (_input_format == INPUT_UINT8) {
+      e.addField<uint8_t>("s")
+          .addExtents(
+              batchsize, {batchsize, _num_plane, BOARD_SIZE, BOARD_SIZE})
+          .addFunction<BoardFeature>(extractStateAGZUInt8)
+          .addFunction<GoStateExtOffline>(extractStateExtAGZUInt8);
+    } else if (_input_format == INPUT_BITS) {
+      e.addField<uint8_t>("s")
+          .addExtents(
+              batchsize,
+              {batchsize, _num_plane, BoardFeature::kPackedPlaneBytes})
+          .addFunction<BoardFeature>(extractStateAGZBits)
+          .addFunction<GoStateExtOffline>(extractStateExtAGZBits);
     } else {
-      s.addFunction<BoardFeature>(extractStateAGZ)
-          .addFunction<GoStateExtOffline>(extractStateExtAGZ);
+      auto& s = e.addField<float>("s").addExtents(
+          batchsize, {batchsize, _num_plane, BOARD_SIZE, BOARD_SIZE});
+      if (options_.use_df_feature) {
+        s.addFunction<BoardFeature>(extractState)
+            .addFunction<GoStateExtOffline>(extractStateExt);
+      } else {
+        s.addFunction<BoardFeature>(extractStateAGZ)
+            .addFunction<GoStateExtOffline>(extractStateExtAGZ);
+      }
     }
 
     e.addField<int64_t>("a").addExtent(batchsize);
@@ -170,11 +195,7 @@ class GoFeature {
     e.addField<int64_t>({"black_ver", "white_ver", "selfplay_ver"})
         .addExtent(batchsize);
 
-    e.addClass<GoReply>()
-        .addFunction<int64_t>("a", ReplyAction)
-        .addFunction<float>("pi", ReplyPolicy)
-        .addFunction<float>("V", ReplyValue)
-        .addFunction<int64_t>("rv", ReplyVersion);
+    GoReplyFields::Fields::registerTo(&e);
 
     e.addClass<GoStateExtOffline>()
         .addFunction<int32_t>("move_idx", extractMoveIdx)
@@ -200,6 +221,7 @@ class GoFeature {
         {"num_planes", _num_plane},
         {"our_stone_plane", _our_stone_plane},
         {"opponent_stone_plane", _opponent_stone_plane},
+        {"input_format", _input_format},
         {"ACTION_SKIP", SA_SKIP},
         {"ACTION_PASS", SA_PASS},
         {"ACTION_RESIGN", SA_RESIGN},
@@ -210,6 +232,7 @@ class GoFeature {
  private:
   GameOptions options_;
 
+  InputFormat _input_format;
   int _num_plane;
   int _our_stone_plane;
   int _opponent_stone_plane;
@@ -7,11 +7,15 @@
  */
 
 #include "game_selfplay.h"
+#include "elf/concurrency/Fiber.h"
 #include "go_game_specific.h"
 #include "mcts/ai.h"
 #include "mcts/mcts.h"
 
+#include <algorithm>
 #include <fstream>
+#include <random>
+#include <sstream>
 
 ////////////////// GoGame /////////////////////
 GoGameSelfPlay::GoGameSelfPlay(
@@ -19,10 +23,17 @@ GoGameSelfPlay::GoGameSelfPlay(
     elf::GameClient* client,
     const ContextOptions& context_options,
     const GameOptions& options,
-    EvalCtrl* eval_ctrl)
+    EvalCtrl* eval_ctrl,
+    EvalCache* eval_cache,
+    ArtifactWriter* artifacts,
+    OpeningBook* opening_book)
     : GoGameBase(game_idx, client, context_options, options),
       eval_ctrl_(eval_ctrl),
-      _state_ext(game_idx, options) {}
+      eval_cache_(eval_cache),
+      opening_book_(opening_book),
+      _state_ext(game_idx, options) {
+  _state_ext.setArtifactWriter(artifacts);
+}
 
 MCTSGoAI* GoGameSelfPlay::init_ai(
     const std::string& actor_name,
@@ -42,7 +53,16 @@ MCTSGoAI* GoGameSelfPlay::init_ai(
   params.seed = _rng();
   params.ply_pass_enabled = _options.ply_pass_enabled;
   params.komi = _options.komi;
+  params.d4_ensemble = _options.d4_ensemble;
+  params.resolve_without_nn = _options.resolve_without_nn;
   params.required_version = model_ver;
+  // Interactive play goes ahead of evaluation, and evaluation ahead of
+  // selfplay, when they share a process.
+  if (_options.mode == "online") {
+    params.priority = comm::PRIORITY_HIGH;
+  } else if (_options.mode == "selfplay") {
+    params.priority = comm::PRIORITY_LOW;
+  }
 
   elf::ai::tree_search::TSOptions opt = mcts_options;
   if (puct_override > 0.0) {
@@ -63,10 +83,22 @@ MCTSGoAI* GoGameSelfPlay::init_ai(
     opt.num_rollouts_per_thread = mcts_rollout_per_thread_override;
   }
 
-  return new MCTSGoAI(opt, [&](int) { return new MCTSActor(client_, params); });
+  return new MCTSGoAI(opt, [&](int) {
+    MCTSActor* actor = new MCTSActor(client_, params);
+    actor->setEvalCache(eval_cache_);
+    return actor;
+  });
+}
+
+bool GoGameSelfPlay::use_playout_cap() const {
+  return _options.full_search_prob < 1.0 && _options.mode == "selfplay" &&
+      _state_ext.currRequest().vers.is_selfplay();
 }
 
-Coord GoGameSelfPlay::mcts_make_diverse_move(MCTSGoAI* mcts_go_ai, Coord c) {
+Coord GoGameSelfPlay::mcts_make_diverse_move(
+    MCTSGoAI* mcts_go_ai,
+    Coord c,
+    bool full_search) {
   auto policy = mcts_go_ai->getMCTSPolicy();
 
   bool diverse_policy =
@@ -81,21 +113,81 @@ Coord GoGameSelfPlay::mcts_make_diverse_move(MCTSGoAI* mcts_go_ai, Coord c) {
     }
     */
   }
-  if (_options.policy_distri_training_for_all || diverse_policy) {
+  // With playout cap randomization, the policies of all the full searches
+  // are targets, and no other.
+  const bool add_policy = use_playout_cap()
+      ? full_search
+      : (_options.policy_distri_training_for_all || diverse_policy);
+  if (add_policy) {
     // [TODO]: Warning: MCTS Policy might not correspond to move idx.
     _state_ext.addMCTSPolicy(policy);
   }
+  if (full_search && opening_book_version() >= 0) {
+    opening_book_->add(
+        _state_ext.state(),
+        opening_book_version(),
+        policy,
+        mcts_go_ai->getValue());
+  }
 
   return c;
 }
 
+int64_t GoGameSelfPlay::opening_book_version() const {
+  const MsgRequest& request = _state_ext.currRequest();
+  // Async games do not know the model of the replies.
+  if (opening_book_ == nullptr || !request.vers.is_selfplay() ||
+      request.client_ctrl.async) {
+    return -1;
+  }
+  return request.vers.black_ver;
+}
+
+bool GoGameSelfPlay::opening_book_move(Coord* c) {
+  elf::ai::tree_search::MCTSPolicy<Coord> policy;
+  float value;
+  if (!opening_book_->get(
+          _state_ext.state(), opening_book_version(), &policy, &value)) {
+    return false;
+  }
+  // As mcts_make_diverse_move() for a full search.
+  const bool diverse_policy =
+      _state_ext.state().getPly() <= _options.policy_distri_cutoff;
+  if (diverse_policy) {
+    const auto& mcts_opt = _state_ext.currRequest().vers.mcts_opt;
+    *c = OpeningBook::sampleWithNoise(
+        policy, mcts_opt.root_epsilon, mcts_opt.root_alpha, &_rng);
+  } else {
+    *c = std::max_element(
+             policy.policy.begin(),
+             policy.policy.end(),
+             [](const auto& a, const auto& b) { return a.second < b.second; })
+             ->first;
+  }
+  if (use_playout_cap() || _options.policy_distri_training_for_all ||
+      diverse_policy) {
+    _state_ext.addMCTSPolicy(policy);
+  }
+  if (use_playout_cap()) {
+    _state_ext.addSearchKind(true);
+  }
+  _state_ext.addPredictedValue(value);
+  return true;
+}
+
 Coord GoGameSelfPlay::mcts_update_info(MCTSGoAI* mcts_go_ai, Coord c) {
   float predicted_value = mcts_go_ai->getValue();
 
   _state_ext.addPredictedValue(predicted_value);
 
   if (!_options.dump_record_prefix.empty()) {
-    _state_ext.saveCurrentTree(mcts_go_ai->getCurrentTree());
+    if (_options.dump_tree_binary) {
+      std::stringstream ss;
+      mcts_go_ai->saveTree(&ss);
+      _state_ext.saveCurrentTreeBinary(ss.str());
+    } else {
+      _state_ext.saveCurrentTree(mcts_go_ai->getCurrentTree());
+    }
   }
 
   bool we_are_good = _state_ext.state().nextPlayer() == S_BLACK
@@ -114,6 +206,12 @@ Coord GoGameSelfPlay::mcts_update_info(MCTSGoAI* mcts_go_ai, Coord c) {
   return c;
 }
 
+void GoGameSelfPlay::feed_search_stats(MCTSGoAI* ai) {
+  auto* engine = ai->getEngine();
+  eval_ctrl_->getGameStats().feedSearchStats(engine->getPhaseStats());
+  engine->resetPhaseStats();
+}
+
 void GoGameSelfPlay::finish_game(FinishReason reason) {
   if (!_state_ext.currRequest().vers.is_selfplay() &&
       _options.cheat_eval_new_model_wins_half) {
@@ -140,8 +238,10 @@ void GoGameSelfPlay::finish_game(FinishReason reason) {
 
   // reset tree if MCTS_AI, otherwise just do nothing
   _ai->endGame(_state_ext.state());
+  feed_search_stats(_ai.get());
   if (_ai2 != nullptr) {
     _ai2->endGame(_state_ext.state());
+    feed_search_stats(_ai2.get());
   }
 
   // tell python / remote
@@ -200,7 +300,7 @@ void GoGameSelfPlay::check_new_request() {
   MsgRestart msg;
   do {
     msg = eval_ctrl_->BroadcastReceiveIfDifferent(
-        _state_ext.currRequest(), on_recv);
+        _game_idx, _state_ext.currRequest(), on_recv);
   } while (msg.result == RestartReply::ONLY_WAIT);
 
   // Update current state.
@@ -348,7 +448,7 @@ void GoGameSelfPlay::act() {
       client_->sendWait({"game_end"}, &funcs);
 
       // std::cout << "Got prepare to stop .. " << endl;
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+      elf::concurrency::sleepFor(std::chrono::seconds(1));
       return;
     }
   }
@@ -362,14 +462,30 @@ void GoGameSelfPlay::act() {
   MCTSGoAI* curr_ai =
       ((_ai2 != nullptr && player == S_WHITE) ? _ai2.get() : _ai.get());
 
-  if (use_policy_network_only) {
+  const bool from_book = !use_policy_network_only &&
+      opening_book_version() >= 0 && opening_book_move(&c);
+  if (from_book) {
+    // The searches were made by other games.
+  } else if (use_policy_network_only) {
     // Then we only use policy network to move.
     curr_ai->actPolicyOnly(s, &c);
+  } else if (use_playout_cap()) {
+    const bool full_search = std::uniform_real_distribution<float>(
+                                 0.0, 1.0)(_rng) < _options.full_search_prob;
+    if (full_search) {
+      curr_ai->act(s, &c);
+    } else {
+      curr_ai->actFast(s, &c, _options.fast_rollouts_per_thread);
+    }
+    c = mcts_make_diverse_move(curr_ai, c, full_search);
+    _state_ext.addSearchKind(full_search);
   } else {
     curr_ai->act(s, &c);
-    c = mcts_make_diverse_move(curr_ai, c);
+    c = mcts_make_diverse_move(curr_ai, c, true);
+  }
+  if (!from_book) {
+    c = mcts_update_info(curr_ai, c);
   }
-  c = mcts_update_info(curr_ai, c);
 
   if (show_board) {
     std::cout << "Current board: " << std::endl;
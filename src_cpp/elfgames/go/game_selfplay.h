@@ -19,6 +19,7 @@
 #include "game_feature.h"
 #include "game_stats.h"
 #include "mcts/mcts.h"
+#include "mcts/opening_book.h"
 #include "sgf/sgf.h"
 
 // Game interface for Go.
@@ -29,7 +30,10 @@ class GoGameSelfPlay : public GoGameBase {
       elf::GameClient* client,
       const ContextOptions& context_options,
       const GameOptions& options,
-      EvalCtrl* eval_ctrl);
+      EvalCtrl* eval_ctrl,
+      EvalCache* eval_cache = nullptr,
+      ArtifactWriter* artifacts = nullptr,
+      OpeningBook* opening_book = nullptr);
 
   void act() override;
 
@@ -52,6 +56,10 @@ class GoGameSelfPlay : public GoGameBase {
 
  private:
   EvalCtrl* eval_ctrl_ = nullptr;
+  // Shared by the games of the process; may be nullptr.
+  EvalCache* eval_cache_ = nullptr;
+  // Shared by the games of the process; may be nullptr.
+  OpeningBook* opening_book_ = nullptr;
 
   GoStateExt _state_ext;
 
@@ -75,8 +83,18 @@ class GoGameSelfPlay : public GoGameBase {
       int second_mcts_rollout_per_batch,
       int second_mcts_rollout_per_thread,
       int64_t model_ver);
-  Coord mcts_make_diverse_move(MCTSGoAI* curr_ai, Coord c);
+  // Whether moves get a full or a fast search at random (see
+  // GameOptions::full_search_prob).
+  bool use_playout_cap() const;
+  Coord mcts_make_diverse_move(MCTSGoAI* curr_ai, Coord c, bool full_search);
   Coord mcts_update_info(MCTSGoAI* mcts_go_ai, Coord c);
+  // The model version of the opening book for the current request, or -1
+  // if the games of the request do not use it.
+  int64_t opening_book_version() const;
+  // Plays the position from the opening book, if there: the move and the
+  // training target of the searches it has.
+  bool opening_book_move(Coord* c);
+  void feed_search_stats(MCTSGoAI* ai);
 
   void restart();
   void finish_game(FinishReason reason);
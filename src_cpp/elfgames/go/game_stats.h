@@ -15,6 +15,7 @@
 #include <thread>
 #include <vector>
 
+#include "elf/ai/tree_search/tree_search_stats.h"
 #include "elfgames/go/game_utils.h"
 
 class GameStats {
@@ -53,9 +54,21 @@ class GameStats {
     return _sgfs;
   }
 
+  void feedSearchStats(const elf::ai::tree_search::SearchPhaseStats& stats) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _search_stats.merge(stats);
+  }
+
+  // MCTS counters of all finished games.
+  elf::ai::tree_search::SearchPhaseStats getSearchStats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _search_stats;
+  }
+
  private:
   std::mutex _mutex;
   Ranking _move_ranking;
   WinRateStats _win_rate_stats;
   std::vector<std::string> _sgfs;
+  elf::ai::tree_search::SearchPhaseStats _search_stats;
 };
@@ -14,35 +14,41 @@ GoGameTrain::GoGameTrain(
     const ContextOptions& context_options,
     const GameOptions& options,
     TrainCtrl* train_ctrl,
-    elf::shared::ReaderQueuesT<Record>* reader)
+    elf::shared::ReaderQueuesT<Record>* reader,
+    const GameDataset* dataset,
+    BoardCheckpoints* checkpoints)
     : GoGameBase(game_idx, client, context_options, options),
       train_ctrl_(train_ctrl),
       reader_(reader),
-      _state_ext(game_idx, options) {}
+      dataset_(dataset),
+      _state_ext(game_idx, options, checkpoints) {}
 
 void GoGameTrain::act() {
   // Train a model directly.
-  while (true) {
-    int q_idx = _rng() % reader_->nqueue();
-    /*
-    static mutex s_mutex;
-    {
-    lock_guard<mutex> lock(s_mutex);
-    std::cout << "[" << _game_idx << "] Get Sampler, q_idx: " << q_idx << "/" <<
-    _reader->nqueue() << std::endl;
-    }
-    */
-    // cout << "[" << _game_idx << "] Before get sampler " << endl;
+  while (dataset_ != nullptr) {
+    const GameDataset::Game g = dataset_->game(dataset_->sampleGame(&_rng));
+    const int num_moves = g.numMoves();
+    if (num_moves <= _options.num_future_actions - 1)
+      continue;
+    const size_t move_to =
+        _rng() % (num_moves - _options.num_future_actions + 1);
+    if (!g.isTarget(move_to))
+      continue;
+    _state_ext.fromGame(g, move_to);
+    break;
+  }
+  // Each game thread samples on its own: the reader queues take no lock to
+  // sample, _rng is per game, and positions are reached concurrently (see
+  // BoardCheckpoints).
+  while (dataset_ == nullptr) {
+    int q_idx = reader_->pickQueue(&_rng);
     auto sampler = reader_->getSampler(q_idx, &_rng);
-    const Record* r = sampler.sample();
-    // std::cout << "[" << _game_idx << "] Get Sampler, q_idx: " << q_idx << "/"
-    // << _reader->nqueue() << std::endl;
+    auto r = sampler.sampleShared();
     if (r == nullptr) {
       // std::cout << "No data, wait.." << endl;
       continue;
     }
-    // std::cout << "Has data.." << endl;
-    _state_ext.fromRecord(*r);
+    _state_ext.fromRecord(std::move(r));
 
     // Random pick one ply.
     if (_state_ext.switchRandomMove(&_rng))
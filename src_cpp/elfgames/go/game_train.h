@@ -17,13 +17,17 @@ class GoGameTrain : public GoGameBase {
       const ContextOptions& context_options,
       const GameOptions& options,
       TrainCtrl* train_ctrl,
-      elf::shared::ReaderQueuesT<Record>* reader);
+      elf::shared::ReaderQueuesT<Record>* reader,
+      const GameDataset* dataset = nullptr,
+      BoardCheckpoints* checkpoints = nullptr);
 
   void act() override;
 
  private:
   TrainCtrl* train_ctrl_ = nullptr;
   elf::shared::ReaderQueuesT<Record>* reader_ = nullptr;
+  // If set, positions are sampled from it instead of reader_.
+  const GameDataset* dataset_ = nullptr;
 
   GoStateExtOffline _state_ext;
 };
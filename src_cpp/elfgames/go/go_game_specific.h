@@ -63,6 +63,11 @@ struct GameOptions {
   // Cutoff ply for mcts policy / best a
   int policy_distri_cutoff = 20;
   bool policy_distri_training_for_all = false;
+  // Playout cap randomization of selfplay: a move gets the full search, and
+  // is a training target, with this probability; otherwise a fast search of
+  // fast_rollouts_per_thread rollouts per thread, without noise.
+  float full_search_prob = 1.0;
+  int fast_rollouts_per_thread = 100;
 
   float resign_thres = 0.05;
   float resign_prob_never = 0.1;
@@ -75,10 +80,34 @@ struct GameOptions {
   int preload_sgf_move_to = -1;
 
   bool use_df_feature = false;
+  // Layout of the input planes: "float", "uint8" (one byte per cell) or
+  // "bits" (bit-packed planes). The packed layouts need AGZ features.
+  std::string input_format = "float";
 
   int q_min_size = 10;
   int q_max_size = 1000;
   int num_reader = 50;
+  // Sampling of the replay buffer, see elf::shared::ReaderCtrl.
+  std::string sampling = "uniform";
+  float recency_decay = 0.999;
+  // Directory of the segments (see elf::shared::SegmentStore) the replay
+  // buffer is persisted to, and restored from on startup; empty: none.
+  std::string replay_dir;
+  int replay_segment_mb = 64;
+  // Segments kept on disk.
+  int replay_max_segments = 16;
+  // Segments restored on startup.
+  int replay_load_segments = 4;
+  // If positive, the replay buffer keeps its records packed (compressed at
+  // this zstd level, if available), and decodes them when sampled.
+  int replay_pack_level = 0;
+  // Replay records by the version of the model that played them (see
+  // elf::shared::ReaderCtrl): only those of the last replay_version_window
+  // versions are kept (0 = all), and replay_version_quotas ("1,0.3,0.1")
+  // caps the share of the samples of the newest, second newest, ... and
+  // older versions (empty = none).
+  int replay_version_window = 0;
+  std::string replay_version_quotas;
 
   float komi = 7.5;
   int ply_pass_enabled = 0;
@@ -90,6 +119,11 @@ struct GameOptions {
 
   int eval_num_games = 400;
   float eval_thres = 0.55;
+  // If > 0, evaluations are sequential tests (see fair_pick::Sprt) of the win
+  // rate between eval_thres -/+ this margin, with both error rates
+  // eval_sprt_error: they end as soon as either side is accepted.
+  float eval_sprt_margin = 0.0;
+  float eval_sprt_error = 0.05;
 
   // Default it is 20 min. During intergration test we could make it shorter.
   int client_max_delay_sec = 1200;
@@ -105,6 +139,22 @@ struct GameOptions {
   // When playing with human (or other programs), if human pass, we also pass.
   bool following_pass = false;
 
+  // Evaluate every MCTS leaf under all 8 board symmetries and average them.
+  bool d4_ensemble = false;
+  // Replies of the network kept for the games of the process to share (see
+  // EvalCache), in MB; 0 to always ask the network.
+  int eval_cache_mb = 0;
+  // Selfplay plays the positions of the first opening_book_plies moves (0:
+  // none) from the root policies of opening_book_searches earlier searches
+  // of the same model, kept for the games of the process to share (see
+  // OpeningBook) in at most opening_book_mb MB.
+  int opening_book_plies = 0;
+  int opening_book_searches = 8;
+  int opening_book_mb = 64;
+  // Resolve the leaves of exact value (score decided, forced moves) without
+  // the network.
+  bool resolve_without_nn = true;
+
   bool cheat_eval_new_model_wins_half = false;
   bool cheat_selfplay_random_result = false;
 
@@ -115,12 +165,53 @@ struct GameOptions {
 
   // A list file containing the files to load.
   std::vector<std::string> list_files;
+  // A GameDataset to train on offline, instead of list_files.
+  std::string dataset;
+  // Training positions are reached from boards kept every
+  // checkpoint_interval moves of the games (see BoardCheckpoints), in at
+  // most checkpoint_cache_mb MB; 0 to replay games from the start.
+  int checkpoint_interval = 16;
+  int checkpoint_cache_mb = 256;
   std::string server_addr;
   std::string server_id;
   int port;
+  // Shards of the server (see elf::shared::Options): the server listens on
+  // num_shards ports from port, the clients send to one of those, or of
+  // shard_addrs ("host:port,..."), and fail over to another after
+  // failover_sec without answer.
+  int num_shards = 1;
+  std::string shard_addrs;
+  int failover_sec = 120;
+  // Port (0: none) on which the server publishes its model updates, so that
+  // clients ask for their new request at once.
+  int pub_port = 0;
+  // Port (0: none) of the HTTP endpoint with the ingest stats of the server
+  // (see elf::shared::IngestStats), for Prometheus.
+  int stats_port = 0;
+  // zstd compression of the records sent to the server (0: none), offered
+  // by servers with a level > 0 to their clients, with an optional
+  // dictionary file shared by both.
+  int compression_level = 0;
+  std::string compression_dict;
+  // Clients send their records once they have writer_batch_records of them,
+  // or their oldest is writer_batch_sec old; those held back while the
+  // server is busy are kept in spill_dir (empty: in memory).
+  int writer_batch_records = 32;
+  int writer_batch_sec = 10;
+  std::string spill_dir;
   bool verbose = false;
   bool print_result = false;
   std::string dump_record_prefix;
+  // Dumps go to hourly archives (see ArtifactWriter), written on a thread of
+  // their own, rather than to a file each.
+  bool dump_record_archive = true;
+  // zstd level of the archived dumps, 0 to store them as they are.
+  int dump_record_zstd_level = 0;
+  // Dump the search trees in the binary form of SearchTreeT::save() (see
+  // tree_search_io.h) rather than as text.
+  bool dump_tree_binary = false;
+  // Save the selfplay / eval records of the server in the binary format.
+  bool binary_records = false;
 
   std::string time_signature;
 
@@ -146,7 +237,13 @@ struct GameOptions {
     ss << "MoveCutOff: " << move_cutoff << std::endl;
     ss << "Use DF feature: " << elf_utils::print_bool(use_df_feature)
        << std::endl;
+    ss << "Input format: " << input_format << std::endl;
     ss << "PolicyDistriCutOff: " << policy_distri_cutoff << std::endl;
+    if (full_search_prob < 1.0) {
+      ss << "Full search prob: " << full_search_prob
+         << ", fast rollouts per thread: " << fast_rollouts_per_thread
+         << std::endl;
+    }
 
     if (expected_num_clients > 0) {
       ss << "Expected #client: " << expected_num_clients << std::endl;
@@ -159,11 +256,44 @@ struct GameOptions {
       }
       ss << std::endl;
     }
+    if (!dataset.empty()) {
+      ss << "Dataset: " << dataset << std::endl;
+    }
+    if (checkpoint_interval > 0) {
+      ss << "Checkpoints: every " << checkpoint_interval << " moves, "
+         << checkpoint_cache_mb << " MB" << std::endl;
+    }
 
     ss << "Server_addr: " << server_addr << ", server_id: " << server_id
        << ", port: " << port << std::endl;
+    if (num_shards > 1 || !shard_addrs.empty()) {
+      ss << "Shards: " << num_shards << " " << shard_addrs
+         << ", failover: " << failover_sec << " sec" << std::endl;
+    }
+    if (pub_port > 0) {
+      ss << "Pub_port: " << pub_port << std::endl;
+    }
+    if (stats_port > 0) {
+      ss << "Stats_port: " << stats_port << std::endl;
+    }
     ss << "#Reader: " << num_reader << ", Qmin_sz: " << q_min_size
        << ", Qmax_sz: " << q_max_size << std::endl;
+    ss << "Sampling: " << sampling;
+    if (sampling == "recency")
+      ss << ", decay: " << recency_decay;
+    ss << std::endl;
+    if (!replay_dir.empty()) {
+      ss << "Replay dir: " << replay_dir << ", segment: " << replay_segment_mb
+         << "MB, keep: " << replay_max_segments
+         << ", load: " << replay_load_segments << std::endl;
+    }
+    if (replay_pack_level > 0) {
+      ss << "Replay pack level: " << replay_pack_level << std::endl;
+    }
+    if (replay_version_window > 0 || !replay_version_quotas.empty()) {
+      ss << "Replay versions: " << replay_version_window
+         << ", quotas: " << replay_version_quotas << std::endl;
+    }
     ss << "Verbose: " << elf_utils::print_bool(verbose) << std::endl;
     ss << "Policy distri training for all moves: "
        << elf_utils::print_bool(verbose) << std::endl;
@@ -172,9 +302,36 @@ struct GameOptions {
     if (print_result)
       ss << "PrintResult: " << elf_utils::print_bool(print_result) << std::endl;
     if (!dump_record_prefix.empty())
-      ss << "dumpRecord: " << dump_record_prefix << std::endl;
+      ss << "dumpRecord: " << dump_record_prefix
+         << (dump_record_archive ? " (archived)" : "")
+         << (dump_tree_binary ? " (binary trees)" : "") << std::endl;
+    if (binary_records)
+      ss << "Binary records is true" << std::endl;
+    if (compression_level > 0) {
+      ss << "Compression level: " << compression_level << std::endl;
+      if (!compression_dict.empty())
+        ss << "Compression dict: " << compression_dict << std::endl;
+    }
+    ss << "Writer batch: " << writer_batch_records << " records, "
+       << writer_batch_sec << " sec" << std::endl;
+    if (!spill_dir.empty()) {
+      ss << "Spill dir: " << spill_dir << std::endl;
+    }
     if (following_pass)
       ss << "Following pass is true" << std::endl;
+    if (d4_ensemble)
+      ss << "D4 ensemble evaluation is true" << std::endl;
+    if (eval_cache_mb > 0)
+      ss << "Eval cache: " << eval_cache_mb << " MB" << std::endl;
+    if (opening_book_plies > 0)
+      ss << "Opening book: " << opening_book_plies << " plies, "
+         << opening_book_searches << " searches, " << opening_book_mb << " MB"
+         << std::endl;
+    if (!resolve_without_nn)
+      ss << "Resolve without NN is false" << std::endl;
+    if (eval_sprt_margin > 0.0)
+      ss << "Eval SPRT: margin: " << eval_sprt_margin
+         << ", error: " << eval_sprt_error << std::endl;
     ss << "Reset move ranking after " << num_reset_ranking << " actions"
        << std::endl;
 
@@ -211,53 +368,103 @@ struct GameOptions {
     return ss.str();
   }
 
-  REGISTER_PYBIND_FIELDS(
-      seed,
-      mode,
-      data_aug,
-      start_ratio_pre_moves,
-      ratio_pre_moves,
-      move_cutoff,
-      num_future_actions,
-      list_files,
-      verbose,
-      num_games_per_thread,
-      use_mcts,
-      server_addr,
-      server_id,
-      port,
-      policy_distri_cutoff,
-      client_max_delay_sec,
-      q_min_size,
-      q_max_size,
-      num_reader,
-      dump_record_prefix,
-      use_mcts_ai2,
-      resign_thres,
-      preload_sgf,
-      preload_sgf_move_to,
-      komi,
-      print_result,
-      resign_thres,
-      resign_prob_never,
-      resign_target_fp_rate,
-      num_reset_ranking,
-      ply_pass_enabled,
-      following_pass,
-      use_df_feature,
-      policy_distri_training_for_all,
-      black_use_policy_network_only,
-      white_use_policy_network_only,
-      cheat_eval_new_model_wins_half,
-      cheat_selfplay_random_result,
-      eval_num_games,
-      selfplay_init_num,
-      selfplay_update_num,
-      selfplay_async,
-      white_puct,
-      white_mcts_rollout_per_batch,
-      white_mcts_rollout_per_thread,
-      eval_thres,
-      keep_prev_selfplay,
-      expected_num_clients);
+  // More fields than MM_APPLY expands at once (49), registered in groups.
+  template <typename Class>
+  static Class& register_fields(Class&& mod) {
+    // The game and the dataset.
+    ADD_PYBIND_FIELDS(
+        mod,
+        seed,
+        mode,
+        data_aug,
+        start_ratio_pre_moves,
+        ratio_pre_moves,
+        move_cutoff,
+        num_future_actions,
+        list_files,
+        dataset,
+        checkpoint_interval,
+        checkpoint_cache_mb,
+        verbose,
+        num_games_per_thread,
+        use_mcts);
+    // The server, its clients and the replay buffer.
+    ADD_PYBIND_FIELDS(
+        mod,
+        server_addr,
+        server_id,
+        port,
+        num_shards,
+        shard_addrs,
+        failover_sec,
+        pub_port,
+        stats_port,
+        compression_level,
+        compression_dict,
+        writer_batch_records,
+        writer_batch_sec,
+        spill_dir,
+        policy_distri_cutoff,
+        client_max_delay_sec,
+        q_min_size,
+        q_max_size,
+        num_reader,
+        sampling,
+        recency_decay,
+        replay_dir,
+        replay_segment_mb,
+        replay_max_segments,
+        replay_load_segments,
+        replay_pack_level,
+        replay_version_window,
+        replay_version_quotas);
+    // Records, selfplay and evaluation.
+    ADD_PYBIND_FIELDS(
+        mod,
+        dump_record_prefix,
+        dump_record_archive,
+        dump_record_zstd_level,
+        dump_tree_binary,
+        binary_records,
+        use_mcts_ai2,
+        resign_thres,
+        preload_sgf,
+        preload_sgf_move_to,
+        komi,
+        print_result,
+        resign_thres,
+        resign_prob_never,
+        resign_target_fp_rate,
+        num_reset_ranking,
+        ply_pass_enabled,
+        following_pass,
+        d4_ensemble,
+        eval_cache_mb,
+        opening_book_plies,
+        opening_book_searches,
+        opening_book_mb,
+        resolve_without_nn,
+        use_df_feature,
+        input_format,
+        policy_distri_training_for_all,
+        full_search_prob,
+        fast_rollouts_per_thread,
+        black_use_policy_network_only,
+        white_use_policy_network_only,
+        cheat_eval_new_model_wins_half,
+        cheat_selfplay_random_result,
+        eval_num_games,
+        selfplay_init_num,
+        selfplay_update_num,
+        selfplay_async,
+        white_puct,
+        white_mcts_rollout_per_batch,
+        white_mcts_rollout_per_thread,
+        eval_thres,
+        eval_sprt_margin,
+        eval_sprt_error,
+        keep_prev_selfplay,
+        expected_num_clients);
+    return mod;
+  }
 };
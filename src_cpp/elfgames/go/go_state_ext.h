@@ -11,14 +11,19 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <random>
 #include <set>
+#include "artifact_writer.h"
+#include "base/board_checkpoints.h"
 #include "base/go_state.h"
+#include "game_dataset.h"
 #include "game_utils.h"
 #include "go_game_specific.h"
 #include "record.h"
 
 #include "elf/ai/tree_search/tree_search_base.h"
+#include "elf/metrics/Memory.h"
 
 enum FinishReason {
   FR_RESIGN = 0,
@@ -41,12 +46,23 @@ struct GoStateExt {
     restart();
   }
 
+  // Dumps go to artifacts if set (shared with other threads), to a file each
+  // otherwise.
+  void setArtifactWriter(ArtifactWriter* artifacts) {
+    _artifacts = artifacts;
+  }
+
   std::string dumpSgf(const std::string& filename) const;
   void dumpSgf() const {
-    std::string filename = _options.dump_record_prefix + "_" +
-        std::to_string(_game_idx) + "_" + std::to_string(_seq) + "_" +
+    std::string name = std::to_string(_game_idx) + "_" +
+        std::to_string(_seq) + "_" +
         (_state.getFinalValue() > 0 ? "B" : "W") + ".sgf";
+    std::string filename = _options.dump_record_prefix + "_" + name;
     std::string sgf_record = dumpSgf(filename);
+    if (_artifacts != nullptr) {
+      _artifacts->write(std::move(name), sgf_record + "\n");
+      return;
+    }
     std::ofstream oo(filename);
     oo << sgf_record << std::endl;
   }
@@ -112,6 +128,8 @@ struct GoStateExt {
     _state.reset();
     _mcts_policies.clear();
     _predicted_values.clear();
+    _full_search.clear();
+    _history_memory.set(0);
 
     using_models_.clear();
 
@@ -138,6 +156,7 @@ struct GoStateExt {
     r.result.policies = _mcts_policies;
     r.result.num_move = _state.getPly() - 1;
     r.result.values = _predicted_values;
+    r.result.full_search = _full_search;
 
     return r;
   }
@@ -153,14 +172,32 @@ struct GoStateExt {
   }
   void saveCurrentTree(const std::string& tree_info) const {
     // Dump the tree as well.
-    std::string filename = _options.dump_record_prefix + "_" +
-        std::to_string(_game_idx) + "_" + std::to_string(_seq) + "_" +
-        std::to_string(_state.getPly()) + ".tree";
-    std::ofstream oo(filename);
+    std::string name = std::to_string(_game_idx) + "_" +
+        std::to_string(_seq) + "_" + std::to_string(_state.getPly()) + ".tree";
+    if (_artifacts != nullptr) {
+      _artifacts->write(std::move(name), _state.showBoard() + "\n" + tree_info);
+      return;
+    }
+    std::ofstream oo(_options.dump_record_prefix + "_" + name);
     oo << _state.showBoard() << std::endl;
     oo << tree_info;
   }
 
+  // Same, with the tree saved by MCTSAI_T::saveTree(); without the board, as
+  // the moves to the position are those of the game.
+  void saveCurrentTreeBinary(std::string tree) const {
+    std::string name = std::to_string(_game_idx) + "_" +
+        std::to_string(_seq) + "_" + std::to_string(_state.getPly()) +
+        ".tree.bin";
+    if (_artifacts != nullptr) {
+      _artifacts->write(std::move(name), std::move(tree));
+      return;
+    }
+    std::ofstream oo(
+        _options.dump_record_prefix + "_" + name, std::ios::binary);
+    oo << tree;
+  }
+
   float getLastGameFinalValue() const {
     return _last_value;
   }
@@ -177,20 +214,36 @@ struct GoStateExt {
     }
 
     _mcts_policies.emplace_back();
-    std::fill(
-        _mcts_policies.back().prob,
-        _mcts_policies.back().prob + BOUND_COORD,
-        0);
+    auto& entries = _mcts_policies.back().entries;
+    entries.reserve(policy.size());
     for (size_t k = 0; k < policy.size(); k++) {
       const auto& entry = policy[k];
       unsigned char c =
           static_cast<unsigned char>(entry.second / max_val * 255);
-      _mcts_policies.back().prob[entry.first] = c;
+      if (c > 0) {
+        entries.push_back(
+            CoordRecord::Entry{static_cast<uint16_t>(entry.first), c});
+      }
+    }
+    _history_memory.add(
+        sizeof(CoordRecord) + entries.capacity() * sizeof(CoordRecord::Entry));
+  }
+
+  // With playout cap randomization, marks the last move as searched fully
+  // (its policy added by addMCTSPolicy()) or fast: the latter gets an empty
+  // policy, so that the policies stay aligned with the moves.
+  void addSearchKind(bool full) {
+    if (!full) {
+      _mcts_policies.emplace_back();
+      _history_memory.add(sizeof(CoordRecord));
     }
+    _full_search.push_back(full);
+    _history_memory.add(sizeof(uint8_t));
   }
 
   void addPredictedValue(float predicted_value) {
     _predicted_values.push_back(predicted_value);
+    _history_memory.add(sizeof(float));
   }
 
   float getLastPredictedValue() const {
@@ -245,31 +298,63 @@ struct GoStateExt {
 
   ResignCheck _resign_check;
   GameOptions _options;
+  ArtifactWriter* _artifacts = nullptr;
 
   std::vector<CoordRecord> _mcts_policies;
   std::vector<float> _predicted_values;
+  std::vector<uint8_t> _full_search;
+  // Of the three above, charged to the "game" memory account.
+  elf::metrics::MemoryCharge _history_memory{"game"};
 };
 
 class GoStateExtOffline {
  public:
   friend class GoFeature;
 
-  GoStateExtOffline(int game_idx, const GameOptions& options)
-      : _game_idx(game_idx), _bf(_state), _options(options) {}
+  // Positions are reached through checkpoints if set (shared with other
+  // threads).
+  GoStateExtOffline(
+      int game_idx,
+      const GameOptions& options,
+      BoardCheckpoints* checkpoints = nullptr)
+      : _game_idx(game_idx),
+        _bf(_state),
+        _options(options),
+        _checkpoints(checkpoints) {}
 
-  void fromRecord(const Record& r) {
+  // r is kept rather than copied (its policies are read by the features)
+  // until the next game.
+  void fromRecord(std::shared_ptr<const Record> r) {
     // std::cout << "Convert to moves: " << r.content << std::endl;
-    _offline_all_moves = sgfstr2coords(r.result.content);
-    _offline_winner = r.result.reward > 0 ? 1.0 : -1.0;
+    _offline_all_moves = sgfstr2coords(r->result.content);
+    _offline_winner = r->result.reward > 0 ? 1.0 : -1.0;
     // std::cout << "Convert complete, #move = " << moves.size() << std::endl;
 
-    _mcts_policies = r.result.policies;
-    curr_request_ = r.request;
-    _seq = r.seq;
-    _predicted_values = r.result.values;
+    curr_request_ = r->request;
+    _seq = r->seq;
+    _record = std::move(r);
     _state.reset();
   }
 
+  // The position before move move_to of g, with the policy of that move
+  // only, which is all the features read.
+  void fromGame(const GameDataset::Game& g, size_t move_to) {
+    g.moves(&_offline_all_moves);
+    _offline_winner = g.entry().reward > 0 ? 1.0 : -1.0;
+
+    _record.reset();
+    _mcts_policies.clear();
+    if (g.hasPolicies()) {
+      _mcts_policies.resize(move_to + 1);
+      g.policy(move_to, &_mcts_policies[move_to]);
+    }
+    curr_request_ = MsgRequest();
+    curr_request_.vers.black_ver = g.entry().black_ver;
+    curr_request_.vers.white_ver = g.entry().white_ver;
+    _seq = g.entry().seq;
+    switchBeforeMove(move_to);
+  }
+
   bool switchRandomMove(std::mt19937* rng) {
     // Random sample one move
     if ((int)_offline_all_moves.size() <= _options.num_future_actions - 1) {
@@ -277,8 +362,22 @@ class GoStateExtOffline {
                 << _options.num_future_actions << " - 1" << std::endl;
       return false;
     }
-    size_t move_to = (*rng)() %
-        (_offline_all_moves.size() - _options.num_future_actions + 1);
+    const size_t n =
+        _offline_all_moves.size() - _options.num_future_actions + 1;
+    size_t move_to = (*rng)() % n;
+    if (_record != nullptr && !_record->result.full_search.empty()) {
+      // Only the moves that are training targets.
+      _targets.clear();
+      for (size_t i = 0; i < n; ++i) {
+        if (_record->result.isTarget(i)) {
+          _targets.push_back(i);
+        }
+      }
+      if (_targets.empty()) {
+        return false;
+      }
+      move_to = _targets[(*rng)() % _targets.size()];
+    }
     switchBeforeMove(move_to);
     return true;
   }
@@ -287,9 +386,18 @@ class GoStateExtOffline {
     _bf.setD4Code((*rng)() % 8);
   }
 
+  // MCTS policies of the moves of the game (those known).
+  const std::vector<CoordRecord>& policies() const {
+    return _record != nullptr ? _record->result.policies : _mcts_policies;
+  }
+
   void switchBeforeMove(size_t move_to) {
     assert(move_to < _offline_all_moves.size());
 
+    if (_checkpoints != nullptr) {
+      _checkpoints->reach(_offline_all_moves, move_to, &_state);
+      return;
+    }
     _state.reset();
     for (size_t i = 0; i < move_to; ++i) {
       _state.forward(_offline_all_moves[i]);
@@ -301,6 +409,7 @@ class GoStateExtOffline {
   GoState _state;
   BoardFeature _bf;
   GameOptions _options;
+  BoardCheckpoints* _checkpoints;
 
   int _seq;
   MsgRequest curr_request_;
@@ -308,6 +417,9 @@ class GoStateExtOffline {
   std::vector<Coord> _offline_all_moves;
   float _offline_winner;
 
+  // The record of the game, or its policies from a GameDataset.
+  std::shared_ptr<const Record> _record;
   std::vector<CoordRecord> _mcts_policies;
-  std::vector<float> _predicted_values;
+  // Candidates of switchRandomMove().
+  std::vector<size_t> _targets;
 };
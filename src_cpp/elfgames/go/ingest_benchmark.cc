@@ -0,0 +1,309 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Ingest capacity of the server: an elf::shared::Reader inserting into the
+// replay queues, fed by simulated clients (elf::shared::Writer) sending
+// synthetic selfplay Records over loopback TCP, or Unix sockets with --ipc=1.
+// Reports messages/sec, MB/sec, the end-to-end latency of the messages (from
+// before they are encoded to their insertion) and the CPU the Reader uses.
+//
+// The clients run in child processes, forked before the Reader starts, so
+// that the CPU time of this process is that of the Reader alone.
+//
+// Usage: benchmark_cpp_elfgames_go_ingest_benchmark [--clients=8]
+//   [--msgs=200] [--records=16] [--moves=0] [--policy_entries=30]
+//   [--binary=1] [--zstd=0] [--ipc=0] [--rate=0] [--decode_threads=4]
+//   [--port=5700]
+//
+// --msgs is per client, --records per message, --moves per game (0: 2/3 of
+// the board), --rate in messages/sec per client (0: as fast as possible).
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "elf/distributed/compression.h"
+#include "elf/distributed/shared_reader.h"
+#include "elf/distributed/shared_rw_buffer2.h"
+#include "elfgames/go/record.h"
+#include "elfgames/go/sgf/sgf.h"
+
+namespace {
+
+using Args = std::map<std::string, int>;
+
+// Monotonic, the same in all the processes of the host.
+uint64_t nowUsec() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double cpuSec() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// A selfplay game of num_moves random moves, with a policy of
+// policy_entries coords and a value per move.
+Record makeRecord(std::mt19937* rng, int num_moves, int policy_entries) {
+  std::uniform_int_distribution<int> xy(0, BOARD_SIZE - 1);
+  std::uniform_int_distribution<int> prob(1, 255);
+  std::uniform_real_distribution<float> value(-1, 1);
+
+  Record r;
+  r.request.vers.black_ver = 1;
+  r.request.vers.white_ver = -1;
+  r.result.num_move = num_moves;
+  r.result.reward = (*rng)() % 2 ? 1.0 : -1.0;
+  r.result.using_models = {1};
+  std::vector<Coord> moves;
+  for (int i = 0; i < num_moves; ++i) {
+    moves.push_back(getCoord(xy(*rng), xy(*rng)));
+    unsigned char dense[BOUND_COORD] = {0};
+    for (int k = 0; k < policy_entries; ++k) {
+      dense[getCoord(xy(*rng), xy(*rng))] = prob(*rng);
+    }
+    r.result.policies.emplace_back();
+    r.result.policies.back().fromDense(dense);
+    r.result.values.push_back(value(*rng));
+  }
+  r.result.content = coords2sgfstr(moves);
+  r.timestamp = elf_utils::sec_since_epoch_from_now();
+  return r;
+}
+
+elf::shared::Options transportOptions(const Args& args) {
+  elf::shared::Options options;
+  options.addr = "127.0.0.1";
+  options.port = args.at("port");
+  options.use_ipv6 = false;
+  options.compression_level = args.at("zstd");
+  options.num_decode_threads = args.at("decode_threads");
+  if (args.at("ipc")) {
+    options.ipc_dir = "/tmp";
+  }
+  return options;
+}
+
+// Sends the messages of a client, stamped with the time before they are
+// encoded (in the timestamp of their first record), and waits for the Reader
+// to have inserted them all (one reply each).
+int runClient(const Args& args, int idx, Records records) {
+  elf::shared::Options options = transportOptions(args);
+  options.identity = "client-" + std::to_string(idx);
+  elf::shared::Writer writer(options);
+
+  const int num_msgs = args.at("msgs");
+  const int rate = args.at("rate");
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_msgs; ++i) {
+    if (rate > 0) {
+      std::this_thread::sleep_until(
+          start + std::chrono::microseconds((int64_t)i * 1000000 / rate));
+    }
+    records.records[0].timestamp = nowUsec();
+    writer.Insert(
+        args.at("binary") ? records.dumpBinaryString()
+                          : records.dumpJsonString());
+  }
+
+  int num_replies = 0;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::minutes(2);
+  std::string reply;
+  while (num_replies < num_msgs &&
+         std::chrono::steady_clock::now() < deadline) {
+    if (writer.getReply(&reply, std::chrono::milliseconds(100))) {
+      num_replies++;
+    }
+  }
+  return num_replies == num_msgs ? 0 : 1;
+}
+
+double percentile(std::vector<uint64_t>* v, double p) {
+  if (v->empty()) {
+    return 0;
+  }
+  const size_t k = std::min(v->size() - 1, (size_t)(p * v->size()));
+  std::nth_element(v->begin(), v->begin() + k, v->end());
+  return (*v)[k];
+}
+
+Args parseArgs(int argc, char** argv) {
+  Args args = {{"clients", 8},
+               {"msgs", 200},
+               {"records", 16},
+               {"moves", 0},
+               {"policy_entries", 30},
+               {"binary", 1},
+               {"zstd", 0},
+               {"ipc", 0},
+               {"rate", 0},
+               {"decode_threads", 4},
+               {"port", 5700}};
+  for (int i = 1; i < argc; ++i) {
+    const char* eq = strchr(argv[i], '=');
+    if (strncmp(argv[i], "--", 2) != 0 || eq == nullptr) {
+      std::cerr << "Unknown argument " << argv[i] << std::endl;
+      exit(1);
+    }
+    const std::string key(argv[i] + 2, eq - argv[i] - 2);
+    if (args.find(key) == args.end()) {
+      std::cerr << "Unknown option --" << key << std::endl;
+      exit(1);
+    }
+    args[key] = atoi(eq + 1);
+  }
+  if (args["moves"] <= 0) {
+    args["moves"] = BOARD_SIZE * BOARD_SIZE * 2 / 3;
+  }
+  return args;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const Args args = parseArgs(argc, argv);
+  const int num_clients = args.at("clients");
+  const uint64_t num_msgs = (uint64_t)num_clients * args.at("msgs");
+
+  std::mt19937 rng(0);
+  Records records("client");
+  for (int i = 0; i < args.at("records"); ++i) {
+    records.addRecord(
+        makeRecord(&rng, args.at("moves"), args.at("policy_entries")));
+  }
+  const size_t msg_bytes = args.at("binary")
+      ? records.dumpBinaryString().size()
+      : records.dumpJsonString().size();
+
+  std::cout << "Board: " << BOARD_SIZE << "x" << BOARD_SIZE
+            << ", clients: " << num_clients << ", msgs/client: "
+            << args.at("msgs") << ", records/msg: " << args.at("records")
+            << ", moves: " << args.at("moves")
+            << ", encoding: " << (args.at("binary") ? "binary" : "json")
+            << ", msg size: " << msg_bytes << " bytes"
+            << ", transport: " << (args.at("ipc") ? "ipc" : "tcp")
+            << std::endl;
+  if (args.at("zstd") > 0 && !elf::distri::Compressor::available()) {
+    std::cout << "Built without zstd: messages are sent uncompressed"
+              << std::endl;
+  }
+
+  // No socket (nor thread) exists yet in this process.
+  std::vector<pid_t> clients;
+  for (int i = 0; i < num_clients; ++i) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      _exit(runClient(args, i, records));
+    }
+    clients.push_back(pid);
+  }
+
+  elf::shared::RQCtrl ctrl;
+  ctrl.num_reader = 2;
+  ctrl.ctrl.queue_min_size = 1;
+  ctrl.ctrl.queue_max_size = 10000;
+  elf::shared::ReaderQueuesT<Record> rq(ctrl);
+
+  std::mutex latency_mutex;
+  std::vector<uint64_t> latency_usec;
+  std::function<bool(const std::string&, Records*)> decode =
+      [](const std::string& s, Records* rs) {
+        try {
+          *rs = Records::createFromString(s);
+          return !rs->records.empty();
+        } catch (...) {
+          return false;
+        }
+      };
+  std::function<bool(Records&&, std::vector<Record>*)> apply =
+      [&](Records&& rs, std::vector<Record>* vs) {
+        const uint64_t now = nowUsec();
+        {
+          std::lock_guard<std::mutex> lock(latency_mutex);
+          latency_usec.push_back(now - rs.records[0].timestamp);
+        }
+        *vs = std::move(rs.records);
+        return true;
+      };
+  rq.setConverter<Records>(decode, apply);
+
+  auto replier = [](elf::shared::Reader*, const std::string&, std::string* r) {
+    *r = "ok";
+    return true;
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  const double cpu_start = cpuSec();
+  double sec = 0;
+  double cpu = 0;
+  uint64_t wire_bytes = 0;
+  uint64_t raw_bytes = 0;
+  {
+    elf::shared::Reader reader("ingest_benchmark", transportOptions(args));
+    reader.startReceiving(&rq, nullptr, replier);
+    const auto deadline = start + std::chrono::minutes(2);
+    while ((uint64_t)reader.stats().msg_count.load() +
+                   reader.stats().failed_count.load() <
+               num_msgs &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    sec = std::chrono::duration<double>(
+              std::chrono::steady_clock::now() - start)
+              .count();
+    cpu = cpuSec() - cpu_start;
+    wire_bytes = reader.stats().total_wire_size;
+    raw_bytes = reader.stats().total_raw_size;
+    std::cout << reader.stats().info() << std::endl;
+
+    int num_failed_clients = 0;
+    for (pid_t pid : clients) {
+      int status = 0;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        num_failed_clients++;
+      }
+    }
+    if (num_failed_clients > 0) {
+      std::cout << num_failed_clients << " clients did not get all replies"
+                << std::endl;
+    }
+  }
+
+  const uint64_t num_inserted = latency_usec.size();
+  std::cout << "Messages/sec: " << num_inserted / sec << " (" << num_inserted
+            << "/" << num_msgs << " in " << sec << " sec)" << std::endl;
+  std::cout << "Records/sec: " << num_inserted * args.at("records") / sec
+            << std::endl;
+  std::cout << "MB/sec: " << wire_bytes / sec / (1 << 20)
+            << " on the wire, " << raw_bytes / sec / (1 << 20)
+            << " decoded" << std::endl;
+  std::cout << "Latency: p50 " << percentile(&latency_usec, 0.5) / 1000
+            << " ms, p99 " << percentile(&latency_usec, 0.99) / 1000 << " ms"
+            << std::endl;
+  std::cout << "Reader CPU: " << cpu << " sec, " << 100 * cpu / sec
+            << "% of a core" << std::endl;
+  return num_inserted == num_msgs ? 0 : 1;
+}
@@ -13,7 +13,69 @@
 
 #include "elfgames/go/base/go_state.h"
 
-using AI = elf::ai::AIClientT<BoardFeature, GoReply>;
+enum SpecialActionType { SA_SKIP = -100, SA_PASS, SA_RESIGN, SA_CLEAR };
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// The replies of the network to a BoardFeature.
+struct GoReplyFields {
+  struct Action {
+    static constexpr const char* key = "a";
+    using type = int64_t;
+
+    static void fromMem(GoReply& reply, const int64_t* action) {
+      switch ((SpecialActionType)*action) {
+        case SA_RESIGN:
+          reply.c = M_RESIGN;
+          break;
+        case SA_SKIP:
+          reply.c = M_SKIP;
+          break;
+        case SA_PASS:
+          reply.c = M_PASS;
+          break;
+        case SA_CLEAR:
+          reply.c = M_CLEAR;
+          break;
+        default:
+          reply.c = reply.bf.action2Coord(*action);
+      }
+    }
+  };
+
+  struct Policy {
+    static constexpr const char* key = "pi";
+    using type = float;
+
+    static void fromMem(GoReply& reply, const float* pi) {
+      std::copy(pi, pi + reply.pi.size(), reply.pi.begin());
+    }
+  };
+
+  struct Value {
+    static constexpr const char* key = "V";
+    using type = float;
+
+    static void fromMem(GoReply& reply, const float* value) {
+      reply.value = *value;
+    }
+  };
+
+  struct Version {
+    static constexpr const char* key = "rv";
+    using type = int64_t;
+
+    static void fromMem(GoReply& reply, const int64_t* ver) {
+      reply.version = *ver;
+    }
+  };
+
+  using Fields = elf::StaticFieldsT<GoReply, Action, Policy, Value, Version>;
+};
+
+using AI = elf::ai::AIClientT<BoardFeature, GoReply, GoReplyFields::Fields>;
+
+GO_BOARD_NAMESPACE_END
 
 namespace elf {
 namespace ai {
@@ -47,6 +109,27 @@ struct StateTrait<GoState, Coord> {
       std::vector<Coord>* moves) {
     return s.moves_since(next_move_number, moves);
   }
+
+  // The board hash alone does not tell whose turn it is, nor which point is
+  // forbidden by simple ko or whether a pass ends the game. History planes
+  // and superko are not part of the key; that approximation is accepted.
+  // Terminal states are cheap to score and are not shared.
+  static bool hash(const GoState& s, uint64_t* key) {
+    if (s.terminated()) {
+      return false;
+    }
+    const Board& b = s.board();
+    uint64_t extra = (uint64_t)s.nextPlayer();
+    extra = extra * 0x10001 + (uint64_t)b._simple_ko;
+    extra = extra * 2 + (s.lastMove() == M_PASS ? 1 : 0);
+    // splitmix64 finalizer so that small differences flip many bits.
+    extra += 0x9e3779b97f4a7c15ULL;
+    extra = (extra ^ (extra >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    extra = (extra ^ (extra >> 27)) * 0x94d049bb133111ebULL;
+    extra ^= extra >> 31;
+    *key = s.getHashCode() ^ extra;
+    return true;
+  }
 };
 
 } // namespace tree_search
@@ -0,0 +1,183 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "elfgames/go/base/board_feature.h"
+#include "elfgames/go/base/go_state.h"
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// Replies of the neural network (policy and value) of recent positions,
+// shared by all the games and searches of a process: openings recur across
+// games, and transpositions within a tree. Keyed by the position and its
+// history (what the features see), the side to move, the ko point, how the
+// position was evaluated (see View) and the model version.
+//
+// Thread safe. Sharded, each shard an LRU list under its own mutex held for a
+// lookup or an insertion only; those least recently used are dropped beyond
+// capacity bytes. Entries of older models are dropped when a newer model
+// version is seen (see setVersion()).
+class EvalCache {
+ public:
+  // How the replies were obtained.
+  enum View {
+    // Features without symmetry.
+    VIEW_IDENTITY = 0,
+    // Under a random symmetry.
+    VIEW_RANDOM = 1,
+    // Average over the 8 symmetries.
+    VIEW_ENSEMBLE = 2,
+  };
+
+  struct Key {
+    uint64_t hash;
+    int64_t version;
+
+    bool operator==(const Key& k) const {
+      return hash == k.hash && version == k.version;
+    }
+  };
+
+  // The policy is in the orientation without symmetry.
+  struct Entry {
+    float pi[BOARD_NUM_ACTION];
+    float value;
+  };
+
+  explicit EvalCache(size_t capacity)
+      : shard_capacity_(capacity / kNumShards) {}
+
+  static Key key(const GoState& s, View view, int64_t version) {
+    const Board& b = s.board();
+    // FNV-1a over the fields.
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&](uint64_t v) { h = (h ^ v) * 1099511628211ULL; };
+    mix(b._hash);
+    s.forEachRecentPosition([&](const GoPosition& p) { mix(p.hash); });
+    mix(b._next_player);
+    mix(b._ko_age == 0 ? b._simple_ko : M_INVALID);
+    mix(view);
+    return Key{h, version};
+  }
+
+  // The most recent model version seen.
+  int64_t version() const {
+    return version_.load();
+  }
+
+  // Drops all the entries if version is newer than any seen so far.
+  void setVersion(int64_t version) {
+    int64_t curr = version_.load();
+    while (version > curr) {
+      if (version_.compare_exchange_weak(curr, version)) {
+        clear();
+        return;
+      }
+    }
+  }
+
+  bool get(const Key& k, Entry* e) {
+    if (k.version < 0) {
+      return false;
+    }
+    Shard& shard = shards_[k.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(k);
+    if (it == shard.entries.end()) {
+      num_misses_++;
+      return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    *e = it->second->second;
+    num_hits_++;
+    return true;
+  }
+
+  void put(const Key& k, const Entry& e) {
+    if (k.version < 0 || k.version < version_.load()) {
+      return;
+    }
+    Shard& shard = shards_[k.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.entries.count(k) > 0) {
+      return;
+    }
+    shard.lru.emplace_front(k, e);
+    shard.entries[k] = shard.lru.begin();
+    while (shard.lru.size() * kEntryBytes > shard_capacity_ &&
+           shard.lru.size() > 1) {
+      shard.entries.erase(shard.lru.back().first);
+      shard.lru.pop_back();
+    }
+  }
+
+  void clear() {
+    for (auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.entries.clear();
+      shard.lru.clear();
+    }
+  }
+
+  std::string info() const {
+    size_t n = 0;
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      n += shard.lru.size();
+    }
+    const uint64_t hits = num_hits_.load();
+    const uint64_t lookups = hits + num_misses_.load();
+    std::stringstream ss;
+    ss << "EvalCache: version: " << version_.load() << ", #entries: " << n
+       << ", bytes: " << n * kEntryBytes << ", #hits: " << hits << "/"
+       << lookups << " ("
+       << (lookups > 0 ? 100.0 * hits / lookups : 0.0) << "%)";
+    return ss.str();
+  }
+
+ private:
+  static constexpr size_t kNumShards = 64;
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return k.hash ^ (uint64_t(k.version) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+
+  using Lru = std::list<std::pair<Key, Entry>>;
+  // An entry with its list node and (about) its hash map node.
+  static constexpr size_t kEntryBytes =
+      sizeof(Lru::value_type) + 4 * sizeof(void*) + sizeof(Key) + 16;
+
+  struct Shard {
+    mutable std::mutex mutex;
+    // Most recently used first.
+    Lru lru;
+    std::unordered_map<Key, Lru::iterator, KeyHash> entries;
+  };
+
+  const size_t shard_capacity_;
+  Shard shards_[kNumShards];
+  std::atomic<int64_t> version_{-1};
+  std::atomic<uint64_t> num_hits_{0};
+  std::atomic<uint64_t> num_misses_{0};
+};
+
+GO_BOARD_NAMESPACE_END
@@ -8,10 +8,19 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <memory>
 
 #include "elf/ai/tree_search/mcts.h"
+#include "elf/logging/Logging.h"
 #include "elfgames/go/mcts/ai.h"
+#include "elfgames/go/mcts/eval_cache.h"
+#include "elfgames/go/mcts/pre_eval.h"
+
+GO_BOARD_NAMESPACE_BEGIN
 
 struct MCTSActorParams {
   std::string actor_name;
@@ -23,14 +32,25 @@ struct MCTSActorParams {
   int64_t required_version = -1;
   bool remove_pass_if_dangerous = true;
   bool rotation_flip = true;
+  // Evaluate every state under all 8 symmetries and average the replies
+  // (8x the network work, for analysis). Overrides rotation_flip.
+  bool d4_ensemble = false;
   float komi = 7.5;
+  // Resolve positions of exact value (score decided, forced moves) without
+  // the neural network (see PreEvalRules). Terminal ones always are.
+  bool resolve_without_nn = true;
+  // comm::Priority of the requests to the neural network.
+  int priority = comm::PRIORITY_NORMAL;
 
   std::string info() const {
     std::stringstream ss;
     ss << "[name=" << actor_name << "][ply_pass_enabled=" << ply_pass_enabled
        << "][seed=" << seed << "][requred_ver=" << required_version
        << "][remove_pass_if_dangerous=" << remove_pass_if_dangerous
-       << "][rotation_flip=" << rotation_flip << "][komi=" << komi << "]";
+       << "][rotation_flip=" << rotation_flip
+       << "][d4_ensemble=" << d4_ensemble << "][komi=" << komi
+       << "][resolve_without_nn=" << resolve_without_nn
+       << "][priority=" << priority << "]";
     return ss.str();
   }
 };
@@ -43,21 +63,54 @@ class MCTSActor {
 
   enum PreEvalResult { EVAL_DONE, EVAL_NEED_NN };
 
+  // A batch sent to the neural network by evaluateAsync().
+  struct AsyncEval {
+    std::vector<BoardFeature> sel_bfs;
+    std::vector<size_t> sel_indices;
+    std::vector<GoReply> replies;
+    std::vector<NodeResponse>* resps = nullptr;
+    std::future<bool> done;
+  };
+  using AsyncHandle = std::unique_ptr<AsyncEval>;
+
   MCTSActor(elf::GameClient* client, const MCTSActorParams& params)
       : params_(params), rng_(params.seed) {
-    ai_.reset(new AI(client, {params_.actor_name}));
+    ai_.reset(new AI(client, {params_.actor_name}, params_.priority));
+    // Collectors partitioning by key batch the requests of a model version
+    // together.
+    ai_->setKey(params_.required_version);
+
+    rules_.add("terminal", PreEvalRules::terminal(params_.komi));
+    if (params_.resolve_without_nn) {
+      rules_.add("decided", PreEvalRules::decided(params_.komi));
+      rules_.setForced(params_.ply_pass_enabled, kForcedDepth);
+    }
   }
 
   std::string info() const {
     return params_.info();
   }
 
+  const PreEvalRules& preEvalRules() const {
+    return rules_;
+  }
+
   void set_ostream(std::ostream* oo) {
     oo_ = oo;
   }
 
   void setRequiredVersion(int64_t ver) {
     params_.required_version = ver;
+    ai_->setKey(ver);
+    if (cache_ != nullptr) {
+      cache_->setVersion(ver);
+    }
+  }
+
+  // Replies of the neural network are looked up in (and added to) cache,
+  // which may be shared with other actors; nullptr to always ask the network.
+  void setEvalCache(EvalCache* cache) {
+    cache_ = cache;
   }
 
   std::mt19937* rng() {
@@ -71,61 +124,107 @@ class MCTSActor {
     if (states.empty())
       return;
 
-    if (oo_ != nullptr)
-      *oo_ << "Evaluating batch state. #states: " << states.size() << std::endl;
+    ELF_LOG(
+        logger_, trace, "Evaluating batch state. #states: {}", states.size());
 
     auto& resps = *p_resps;
 
     resps.resize(states.size());
-    std::vector<BoardFeature> sel_bfs;
-    std::vector<size_t> sel_indices;
+    EvalScratch& sc = scratch_;
+    sc.sel_bfs.clear();
+    sc.sel_indices.clear();
 
     for (size_t i = 0; i < states.size(); i++) {
       assert(states[i] != nullptr);
       PreEvalResult res = pre_evaluate(*states[i], &resps[i]);
-      if (res == EVAL_NEED_NN) {
-        sel_bfs.push_back(get_extractor(*states[i]));
-        sel_indices.push_back(i);
+      if (res == EVAL_NEED_NN && !lookup_cache(*states[i], &resps[i])) {
+        add_extractors(*states[i], &sc.sel_bfs);
+        sc.sel_indices.push_back(i);
       }
     }
 
-    if (sel_bfs.empty())
+    if (sc.sel_bfs.empty())
       return;
 
-    std::vector<GoReply> replies;
-    for (size_t i = 0; i < sel_bfs.size(); ++i) {
-      replies.emplace_back(sel_bfs[i]);
+    get_reply_pointers(sc.sel_bfs, &sc.replies, &sc.p_bfs, &sc.p_replies);
+
+    // cout << "About to send situation to " << params_.actor_name << endl;
+    // cout << s.showBoard() << endl;
+    if (!ai_->act_batch(sc.p_bfs, sc.p_replies)) {
+      ELF_LOG_EVERY_SEC(logger_, warn, 1, "act unsuccessful!");
+    } else {
+      for (size_t i = 0; i < sc.sel_indices.size(); i++) {
+        post_nn_results(
+            &sc.replies[i * num_views()], &resps[sc.sel_indices[i]]);
+      }
     }
+  }
+
+  // Asynchronous batch evaluate. Pre-evaluation and feature extraction run
+  // on the calling thread, the neural network request is sent in the
+  // background. *p_resps is filled by collectEvaluation(), which must be
+  // called from the same thread.
+  AsyncHandle evaluateAsync(
+      const std::vector<const GoState*>& states,
+      std::vector<NodeResponse>* p_resps) {
+    AsyncHandle h(new AsyncEval);
+    h->resps = p_resps;
+    p_resps->resize(states.size());
+
+    for (size_t i = 0; i < states.size(); i++) {
+      assert(states[i] != nullptr);
+      PreEvalResult res = pre_evaluate(*states[i], &(*p_resps)[i]);
+      if (res == EVAL_NEED_NN && !lookup_cache(*states[i], &(*p_resps)[i])) {
+        add_extractors(*states[i], &h->sel_bfs);
+        h->sel_indices.push_back(i);
+      }
+    }
+
+    if (h->sel_bfs.empty())
+      return h;
 
-    // Get all pointers.
     std::vector<GoReply*> p_replies;
     std::vector<const BoardFeature*> p_bfs;
+    get_reply_pointers(h->sel_bfs, &h->replies, &p_bfs, &p_replies);
+    h->done = ai_->act_batch_async(p_bfs, p_replies);
+    return h;
+  }
 
-    for (size_t i = 0; i < sel_bfs.size(); ++i) {
-      p_bfs.push_back(&sel_bfs[i]);
-      p_replies.push_back(&replies[i]);
-    }
+  bool isEvaluationReady(const AsyncHandle& h) const {
+    return !h->done.valid() ||
+        h->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
 
-    // cout << "About to send situation to " << params_.actor_name << endl;
-    // cout << s.showBoard() << endl;
-    if (!ai_->act_batch(p_bfs, p_replies)) {
-      std::cout << "act unsuccessful! " << std::endl;
+  void collectEvaluation(AsyncHandle& h) {
+    if (!h->done.valid())
+      return;
+
+    if (!h->done.get()) {
+      ELF_LOG_EVERY_SEC(logger_, warn, 1, "act unsuccessful!");
     } else {
-      for (size_t i = 0; i < sel_indices.size(); i++) {
-        post_nn_result(replies[i], &resps[sel_indices[i]]);
+      for (size_t i = 0; i < h->sel_indices.size(); i++) {
+        post_nn_results(
+            &h->replies[i * num_views()], &(*h->resps)[h->sel_indices[i]]);
       }
     }
   }
 
   void evaluate(const GoState& s, NodeResponse* resp) {
-    if (oo_ != nullptr)
-      *oo_ << "Evaluating state at " << std::hex << &s << std::dec << std::endl;
+    ELF_LOG(logger_, trace, "Evaluating state at {}", (const void*)&s);
+
+    if (params_.d4_ensemble) {
+      // All symmetries go in one batch.
+      scratch_.states.assign(1, &s);
+      evaluate(scratch_.states, &scratch_.resps);
+      std::swap(*resp, scratch_.resps[0]);
+      return;
+    }
 
     // if terminated(), get results, res = done
     // else res = EVAL_NEED_NN
     PreEvalResult res = pre_evaluate(s, resp);
 
-    if (res == EVAL_NEED_NN) {
+    if (res == EVAL_NEED_NN && !lookup_cache(s, resp)) {
       BoardFeature bf = get_extractor(s);
       // GoReply struct initialization
       // members containing:
@@ -137,7 +236,7 @@ class MCTSActor {
       // AI-Client will run a one-step neural network
       if (!ai_->act(bf, &reply)) {
         // This happens when the game is about to end,
-        std::cout << "act unsuccessful! " << std::endl;
+        ELF_LOG_EVERY_SEC(logger_, warn, 1, "act unsuccessful!");
       } else {
         // call pi2response()
         // action will be inv-transformed
@@ -145,9 +244,7 @@ class MCTSActor {
       }
     }
 
-    if (oo_ != nullptr)
-      *oo_ << "Finish evaluating state at " << std::hex << &s << std::dec
-           << std::endl;
+    ELF_LOG(logger_, trace, "Finish evaluating state at {}", (const void*)&s);
   }
 
   bool forward(GoState& s, Coord a) {
@@ -165,8 +262,49 @@ class MCTSActor {
  protected:
   MCTSActorParams params_;
   std::unique_ptr<AI> ai_;
+  // For the dumps asked with set_ostream().
   std::ostream* oo_ = nullptr;
+  std::shared_ptr<spdlog::logger> logger_ =
+      elf::logging::getIndexedLogger("MCTSActor-");
   std::mt19937 rng_;
+  EvalCache* cache_ = nullptr;
+  PreEvalRules rules_;
+
+  // Forced moves looked through by the rules: a pass answered by a pass.
+  static constexpr int kForcedDepth = 2;
+
+  // Buffers of evaluate(), reused from call to call (an actor serves one
+  // search thread): once they have grown to the largest batch, evaluations
+  // allocate nothing but the policies of the responses.
+  struct EvalScratch {
+    std::vector<BoardFeature> sel_bfs;
+    std::vector<size_t> sel_indices;
+    std::vector<GoReply> replies;
+    std::vector<const BoardFeature*> p_bfs;
+    std::vector<GoReply*> p_replies;
+    // Of evaluate() for a single state.
+    std::vector<const GoState*> states;
+    std::vector<NodeResponse> resps;
+  };
+  EvalScratch scratch_;
+
+  static void get_reply_pointers(
+      const std::vector<BoardFeature>& sel_bfs,
+      std::vector<GoReply>* replies,
+      std::vector<const BoardFeature*>* p_bfs,
+      std::vector<GoReply*>* p_replies) {
+    replies->clear();
+    p_bfs->clear();
+    p_replies->clear();
+    replies->reserve(sel_bfs.size());
+    for (size_t i = 0; i < sel_bfs.size(); ++i) {
+      replies->emplace_back(sel_bfs[i]);
+    }
+    for (size_t i = 0; i < sel_bfs.size(); ++i) {
+      p_bfs->push_back(&sel_bfs[i]);
+      p_replies->push_back(&(*replies)[i]);
+    }
+  }
 
   BoardFeature get_extractor(const GoState& s) {
     // RandomShuffle: static
@@ -178,24 +316,54 @@ class MCTSActor {
       return BoardFeature(s);
   }
 
+  // Number of replies per state.
+  size_t num_views() const {
+    return params_.d4_ensemble ? 8 : 1;
+  }
+
+  void add_extractors(const GoState& s, std::vector<BoardFeature>* bfs) {
+    if (!params_.d4_ensemble) {
+      bfs->push_back(get_extractor(s));
+      return;
+    }
+    for (int code = 0; code < 8; ++code) {
+      bfs->emplace_back(s);
+      bfs->back().setD4Code(code);
+    }
+  }
+
+  // Fills resp from the num_views() replies of one state. Ensemble replies
+  // are averaged after mapping each policy back to the untransformed board.
+  void post_nn_results(const GoReply* replies, NodeResponse* resp) {
+    if (!params_.d4_ensemble) {
+      post_nn_result(replies[0], resp);
+      return;
+    }
+    const BoardFeature bf(replies[0].bf.state());
+    GoReply merged(bf);
+    merged.version = replies[0].version;
+    std::array<float, BOARD_NUM_ACTION> pi;
+    for (size_t k = 0; k < num_views(); ++k) {
+      replies[k].bf.invTransformPolicy(replies[k].pi.data(), pi.data());
+      for (size_t i = 0; i < pi.size(); ++i) {
+        merged.pi[i] += pi[i] / num_views();
+      }
+      merged.value += replies[k].value / num_views();
+    }
+    post_nn_result(merged, resp);
+  }
+
   PreEvalResult pre_evaluate(const GoState& s, NodeResponse* resp) {
     resp->q_flip = s.nextPlayer() == S_WHITE;
 
-    if (s.terminated()) {
+    if (rules_.resolve(s, resp)) {
       if (oo_ != nullptr) {
-        *oo_ << "Terminal state at " << s.getPly() << " Use TT evaluator"
-             << std::endl;
+        *oo_ << "State at " << s.getPly() << " resolved without the network"
+             << ", value: " << resp->value << std::endl;
         *oo_ << "Moves[" << s.getAllMoves().size()
              << "]: " << s.getAllMovesString() << std::endl;
         *oo_ << s.showBoard() << std::endl;
       }
-      float final_value = s.evaluate(params_.komi);
-      if (oo_ != nullptr)
-        *oo_ << "Terminal state. Get raw score (no komi): " << final_value
-             << std::endl;
-      resp->value = final_value > 0 ? 1.0 : -1.0;
-      // No further action.
-      resp->pi.clear();
       return EVAL_DONE;
     } else {
       return EVAL_NEED_NN;
@@ -208,21 +376,66 @@ class MCTSActor {
       const std::string msg = "model version " + std::to_string(reply.version) +
           " and required version " + std::to_string(params_.required_version) +
           " are not consistent";
-      std::cout << msg << std::endl;
+      logger_->error(msg);
       throw std::runtime_error(msg);
     }
 
-    if (oo_ != nullptr)
-      *oo_ << "Got information from neural network" << std::endl;
-    resp->value = reply.value;
+    ELF_LOG(logger_, trace, "Got information from neural network");
+    post_result(reply.bf, reply.pi.data(), reply.value, resp);
+    store_cache(reply);
+  }
 
-    const GoState& s = reply.bf.state();
+  void post_result(
+      const BoardFeature& bf,
+      const float* pi,
+      float value,
+      NodeResponse* resp) {
+    resp->value = value;
+
+    const GoState& s = bf.state();
 
     bool pass_enabled = s.getPly() >= params_.ply_pass_enabled;
     if (params_.remove_pass_if_dangerous) {
       remove_pass_if_dangerous(s, &pass_enabled);
     }
-    pi2response(reply.bf, reply.pi, pass_enabled, &resp->pi, oo_);
+    pi2response(bf, pi, pass_enabled, &resp->pi, oo_);
+  }
+
+  EvalCache::View cache_view() const {
+    if (params_.d4_ensemble) {
+      return EvalCache::VIEW_ENSEMBLE;
+    }
+    return params_.rotation_flip ? EvalCache::VIEW_RANDOM
+                                 : EvalCache::VIEW_IDENTITY;
+  }
+
+  // Fills resp as post_nn_result() would if the cache has the reply of s for
+  // the required model (the most recent one if any will do).
+  bool lookup_cache(const GoState& s, NodeResponse* resp) {
+    if (cache_ == nullptr) {
+      return false;
+    }
+    const int64_t version = params_.required_version >= 0
+        ? params_.required_version
+        : cache_->version();
+    EvalCache::Entry e;
+    if (!cache_->get(EvalCache::key(s, cache_view(), version), &e)) {
+      return false;
+    }
+    post_result(BoardFeature(s), e.pi, e.value, resp);
+    return true;
+  }
+
+  void store_cache(const GoReply& reply) {
+    if (cache_ == nullptr || reply.version < 0) {
+      return;
+    }
+    cache_->setVersion(reply.version);
+    EvalCache::Entry e;
+    reply.bf.invTransformPolicy(reply.pi.data(), e.pi);
+    e.value = reply.value;
+    cache_->put(
+        EvalCache::key(reply.bf.state(), cache_view(), reply.version), e);
   }
 
   void remove_pass_if_dangerous(const GoState& s, bool* pass_enabled) {
@@ -249,19 +462,23 @@ class MCTSActor {
     }
   }
 
+  // pi has BOARD_NUM_ACTION entries.
   static void pi2response(
       const BoardFeature& bf,
-      const std::vector<float>& pi,
+      const float* pi,
       bool pass_enabled,
       std::vector<std::pair<Coord, float>>* output_pi,
       std::ostream* oo = nullptr) {
     const GoState& s = bf.state();
 
     if (oo != nullptr) {
-      *oo << "In get_last_pi, #move returned " << pi.size() << std::endl;
+      *oo << "In get_last_pi, #move returned " << BOARD_NUM_ACTION
+          << std::endl;
       *oo << s.showBoard() << std::endl << std::endl;
     }
 
+    // Sorted and filtered in place: a response that is reused allocates
+    // nothing.
     output_pi->clear();
 
     // No action for terminated state.
@@ -271,14 +488,15 @@ class MCTSActor {
       return;
     }
 
-    for (size_t i = 0; i < pi.size(); ++i) {
+    output_pi->reserve(BOARD_NUM_ACTION);
+    for (size_t i = 0; i < BOARD_NUM_ACTION; ++i) {
       // Inv random transform will be applied
       Coord m = bf.action2Coord(i);
       if (oo != nullptr)
         *oo << "  Action " << i << " to Coord "
             << elf::ai::tree_search::ActionTrait<Coord>::to_string(m)
             << std::endl;
-      output_pi->push_back(std::make_pair(m, pi[i]));
+      output_pi->emplace_back(m, pi[i]);
     }
     // sorting..
     using data_type = std::pair<Coord, float>;
@@ -294,17 +512,14 @@ class MCTSActor {
     if (oo != nullptr)
       *oo << "After sorting" << std::endl;
 
-    std::vector<data_type> tmp;
-    int i = 0;
-    while (true) {
-      if (i >= (int)output_pi->size())
-        break;
-      const data_type& v = output_pi->at(i);
+    size_t num_valid = 0;
+    for (size_t i = 0; i < output_pi->size(); ++i) {
+      const data_type v = (*output_pi)[i];
       // Check whether this move is right.
       bool valid = (v.first == M_PASS && pass_enabled) ||
           (v.first != M_PASS && s.checkMove(v.first));
       if (valid) {
-        tmp.push_back(v);
+        (*output_pi)[num_valid++] = v;
       }
 
       if (oo != nullptr) {
@@ -315,19 +530,20 @@ class MCTSActor {
         else
           *oo << " invalid" << std::endl;
       }
-      i++;
     }
-    if (tmp.empty() && !pass_enabled) {
+    output_pi->resize(num_valid);
+    if (output_pi->empty() && !pass_enabled) {
       // Add pass if there is no valid move.
-      tmp.push_back(std::make_pair(M_PASS, 1.0));
+      output_pi->emplace_back(M_PASS, 1.0);
     }
-    *output_pi = tmp;
     normalize(output_pi);
     if (oo != nullptr)
       *oo << "#Valid move: " << output_pi->size() << std::endl;
   }
 };
 
+GO_BOARD_NAMESPACE_END
+
 namespace elf {
 namespace ai {
 namespace tree_search {
@@ -344,6 +560,8 @@ struct ActorTrait<MCTSActor> {
 } // namespace ai
 } // namespace elf
 
+GO_BOARD_NAMESPACE_BEGIN
+
 class MCTSGoAI : public elf::ai::tree_search::MCTSAI_T<MCTSActor> {
  public:
   MCTSGoAI(
@@ -376,3 +594,5 @@ class MCTSGoAI : public elf::ai::tree_search::MCTSAI_T<MCTSActor> {
     }
   }
 };
+
+GO_BOARD_NAMESPACE_END
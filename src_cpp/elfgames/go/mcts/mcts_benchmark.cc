@@ -0,0 +1,222 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Rollouts/sec of TreeSearchT<GoState, Coord, Actor> against a synthetic
+// actor whose batch evaluation takes a constant time, so that search-side
+// scaling can be measured without a GPU or the Python stack.
+//
+// Usage: benchmark_cpp_elfgames_go[19]_mcts_mcts_benchmark [--threads=16]
+//   [--rollouts=100] [--batch=8] [--virtual_loss=1] [--latency_us=500]
+//   [--pipelined=1] [--searches=5] [--threads_per_tree=0]
+//
+// The board size is fixed at compile time: the elfgames_go9 target builds
+// the 9x9 benchmark, elfgames_go the 19x19 one.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "elf/ai/tree_search/tree_search.h"
+#include "elfgames/go/base/go_state.h"
+#include "elfgames/go/mcts/ai.h"
+
+using elf::ai::tree_search::NodeResponseT;
+using elf::ai::tree_search::TSOptions;
+
+namespace {
+
+class ConstantLatencyActor {
+ public:
+  using State = GoState;
+  using Action = Coord;
+  using NodeResponse = NodeResponseT<Coord>;
+
+  struct AsyncEval {
+    std::future<void> done;
+  };
+  using AsyncHandle = std::unique_ptr<AsyncEval>;
+
+  ConstantLatencyActor(int seed, int latency_us)
+      : rng_(seed), latency_(latency_us) {}
+
+  std::string info() const {
+    return "";
+  }
+
+  std::mt19937* rng() {
+    return &rng_;
+  }
+
+  bool forward(GoState& s, Coord a) {
+    return s.forward(a);
+  }
+
+  void evaluate(const GoState& s, NodeResponse* resp) {
+    std::uniform_real_distribution<float> unit(0, 1);
+    resp->q_flip = s.nextPlayer() == S_WHITE;
+    resp->value = 2 * unit(rng_) - 1;
+    resp->pi.clear();
+    if (s.terminated()) {
+      return;
+    }
+    for (int y = 0; y < BOARD_SIZE; ++y) {
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        Coord c = getCoord(x, y);
+        if (s.checkMove(c)) {
+          resp->pi.push_back(std::make_pair(c, unit(rng_)));
+        }
+      }
+    }
+    resp->pi.push_back(std::make_pair(M_PASS, unit(rng_)));
+  }
+
+  void evaluate(
+      const std::vector<const GoState*>& states,
+      std::vector<NodeResponse>* resps) {
+    if (states.empty()) {
+      return;
+    }
+    numBatches_++;
+    numStates_ += states.size();
+    std::this_thread::sleep_for(latency_);
+    resps->resize(states.size());
+    for (size_t i = 0; i < states.size(); ++i) {
+      evaluate(*states[i], &(*resps)[i]);
+    }
+  }
+
+  AsyncHandle evaluateAsync(
+      const std::vector<const GoState*>& states,
+      std::vector<NodeResponse>* resps) {
+    AsyncHandle h(new AsyncEval);
+    h->done = std::async(std::launch::async, [this, states, resps]() {
+      evaluate(states, resps);
+    });
+    return h;
+  }
+
+  bool isEvaluationReady(const AsyncHandle& h) const {
+    return h->done.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready;
+  }
+
+  void collectEvaluation(AsyncHandle& h) {
+    h->done.get();
+  }
+
+  uint64_t numBatches() const {
+    return numBatches_;
+  }
+
+  uint64_t numStates() const {
+    return numStates_;
+  }
+
+ private:
+  std::mt19937 rng_;
+  std::chrono::microseconds latency_;
+  std::atomic<uint64_t> numBatches_{0};
+  std::atomic<uint64_t> numStates_{0};
+};
+
+using TreeSearch =
+    elf::ai::tree_search::TreeSearchT<GoState, Coord, ConstantLatencyActor>;
+
+std::map<std::string, int> parseArgs(int argc, char** argv) {
+  std::map<std::string, int> args = {{"threads", 16},
+                                     {"rollouts", 100},
+                                     {"batch", 8},
+                                     {"virtual_loss", 1},
+                                     {"latency_us", 500},
+                                     {"pipelined", 1},
+                                     {"searches", 5},
+                                     {"threads_per_tree", 0}};
+  for (int i = 1; i < argc; ++i) {
+    const char* eq = strchr(argv[i], '=');
+    if (strncmp(argv[i], "--", 2) != 0 || eq == nullptr) {
+      std::cerr << "Unknown argument " << argv[i] << std::endl;
+      exit(1);
+    }
+    const std::string key(argv[i] + 2, eq - argv[i] - 2);
+    if (args.find(key) == args.end()) {
+      std::cerr << "Unknown option --" << key << std::endl;
+      exit(1);
+    }
+    args[key] = atoi(eq + 1);
+  }
+  return args;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  auto args = parseArgs(argc, argv);
+  const int latency_us = args["latency_us"];
+
+  TSOptions options;
+  options.num_threads = args["threads"];
+  options.num_rollouts_per_thread = args["rollouts"];
+  options.num_rollouts_per_batch = args["batch"];
+  options.virtual_loss = args["virtual_loss"];
+  options.num_pipelined_batches = args["pipelined"];
+  options.num_threads_per_tree = args["threads_per_tree"];
+
+  std::cout << "Board: " << BOARD_SIZE << "x" << BOARD_SIZE
+            << ", latency: " << latency_us << "us" << std::endl;
+  std::cout << options.info(true);
+
+  TreeSearch ts(options, [=](int i) {
+    return new ConstantLatencyActor(i, latency_us);
+  });
+
+  GoState s;
+  int64_t total_visits = 0;
+  size_t total_nodes = 0;
+  double total_sec = 0;
+  for (int i = 0; i < args["searches"]; ++i) {
+    ts.clear();
+    auto start = std::chrono::steady_clock::now();
+    auto result = ts.run(s);
+    total_sec += std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    total_visits += result.total_visits;
+    total_nodes += ts.getTreeSize();
+  }
+
+  uint64_t num_batches = 0;
+  uint64_t num_states = 0;
+  for (size_t i = 0; i < ts.getNumActors(); ++i) {
+    num_batches += ts.getActor(i).numBatches();
+    num_states += ts.getActor(i).numStates();
+  }
+
+  std::cout << "Rollouts/sec: " << total_visits / total_sec << std::endl;
+  std::cout << "Batch fill rate: "
+            << (num_batches > 0 ? 100.0 * num_states /
+                     (num_batches * options.num_rollouts_per_batch)
+                                : 0.0)
+            << "% (" << num_batches << " batches, " << num_states
+            << " states)" << std::endl;
+  std::cout << ts.getWaitStats().info() << std::endl;
+  std::cout << ts.getPhaseStats().info() << std::endl;
+  std::cout << "Nodes allocated per search: "
+            << total_nodes / std::max(1, args["searches"]) << std::endl;
+
+  ts.stop();
+  return 0;
+}
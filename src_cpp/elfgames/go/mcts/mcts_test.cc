@@ -12,14 +12,32 @@
  * tests. https://github.com/tensorflow/minigo
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <memory>
+#include <random>
+#include <thread>
+
 #include <gtest/gtest.h>
 
+#include "elf/ai/tree_search/tree_search.h"
+#include "elf/ai/tree_search/tree_search_alg.h"
 #include "elf/ai/tree_search/tree_search_base.h"
 #include "elf/ai/tree_search/tree_search_node.h"
 #include "elf/ai/tree_search/tree_search_options.h"
+#include "elf/concurrency/Fiber.h"
 #include "elfgames/go/base/board.h"
 #include "elfgames/go/base/go_state.h"
 #include "elfgames/go/base/test_utils.h"
+#include "elfgames/go/mcts/ai.h"
+#include "elfgames/go/mcts/eval_cache.h"
+#include "elfgames/go/mcts/mcts.h"
+#include "elfgames/go/mcts/opening_book.h"
+#include "elfgames/go/mcts/pre_eval.h"
 #include "elfgames/go/sgf/sgf.h"
 
 using State = GoState;
@@ -30,56 +48,60 @@ using SearchTree = elf::ai::tree_search::SearchTreeT<State, Action>;
 using SearchAlgoOptions = elf::ai::tree_search::SearchAlgoOptions;
 using EdgeInfo = elf::ai::tree_search::EdgeInfo;
 using NodeResponse = elf::ai::tree_search::NodeResponseT<Coord>;
+using TSOptions = elf::ai::tree_search::TSOptions;
 
 namespace elf {
 namespace ai {
 namespace tree_search {
 class NodeTest : public Node {
  public:
-  NodeTest(float unsigned_parent_q, EdgeInfo* parEdge = nullptr)
-      : Node(unsigned_parent_q), edgeInfo(parEdge) {}
-
-  // enable modifying the StateAction pairs for unit-testing only
-  std::unordered_map<Action, EdgeInfo>& getPublicStateActions() {
-    return stateActions_;
-  }
+  NodeTest(
+      float unsigned_parent_q,
+      NodeTest* parent = nullptr,
+      Action parent_action = 0)
+      : Node(unsigned_parent_q), parent(parent), parentAction(parent_action) {}
 
-  std::unordered_map<Action, std::unique_ptr<std::mutex>>&
-  getPublicLockStateActions() {
-    return lockStateActions_;
+  // enable modifying the priors for unit-testing only
+  void setPrior(Action a, float p) {
+    int i = edges_.find(a);
+    assert(i >= 0);
+    edges_.setPrior(i, p);
   }
 
   void visit(float v) {
     V_ = v;
     visited_ = true;
     numVisits_++;
-    if (edgeInfo != nullptr)
-      edgeInfo->num_visits++;
+    if (parent != nullptr)
+      parent->edges_.update(parent->edges_.find(parentAction), 0., 0.);
   }
 
   // parent edge info
-  EdgeInfo* edgeInfo;
+  NodeTest* parent;
+  Action parentAction;
 
-  EdgeInfo& getParEdge() {
-    return *edgeInfo;
+  EdgeInfo getParEdge() {
+    return parent->getEdge(parentAction);
   }
 
-  EdgeInfo& getEdge(Action a) {
-    return stateActions_.at(a);
+  EdgeInfo getEdge(Action a) {
+    int i = edges_.find(a);
+    assert(i >= 0);
+    return edges_.get(i);
   }
 
-  // insert action
+  // insert action (edges are sized once, so rebuild them)
   void insertAction(Action a, float p) {
-    EdgeInfo* tmp_info = new EdgeInfo(p);
-    stateActions_.insert(std::make_pair(a, *tmp_info));
-    lockStateActions_[a].reset(new std::mutex());
+    pi.push_back(std::make_pair(a, p));
+    edges_.reset(pi);
   }
 
   // get Q value of self by saving parent
   float Q() {
-    assert(edgeInfo != nullptr);
-    float reward = edgeInfo->reward;
-    int num_visits = edgeInfo->num_visits;
+    assert(parent != nullptr);
+    EdgeInfo edge = getParEdge();
+    float reward = edge.reward;
+    int num_visits = edge.num_visits;
     return reward / num_visits;
   }
 
@@ -87,6 +109,9 @@ class NodeTest : public Node {
   void set_flip(bool flip) {
     flipQSign_ = flip;
   }
+
+ private:
+  std::vector<std::pair<Action, float>> pi;
 };
 
 class TestActor {
@@ -101,10 +126,86 @@ class TestActor {
   }
 };
 
+// Actor with a uniform policy over the first few legal moves. The batch
+// interface answers asynchronously after a short delay.
+class TestAsyncActor {
+ public:
+  using State = GoState;
+  using Action = Coord;
+
+  struct AsyncEval {
+    std::future<void> done;
+  };
+  using AsyncHandle = std::unique_ptr<AsyncEval>;
+
+  // The first candidate move gets `skew` times the prior of the others.
+  explicit TestAsyncActor(float skew = 1.0) : skew_(skew) {}
+
+  std::string info() const {
+    return "";
+  }
+
+  std::mt19937* rng() {
+    return &rng_;
+  }
+
+  bool forward(GoState& s, Coord a) {
+    return s.forward(a);
+  }
+
+  void evaluate(const GoState& s, NodeResponse* resp) {
+    resp->q_flip = s.nextPlayer() == S_WHITE;
+    resp->value = 0.;
+    for (int x = 0; x < BOARD_SIZE && resp->pi.size() < 5; ++x) {
+      Coord c = getCoord(x, 0);
+      if (s.checkMove(c)) {
+        resp->pi.push_back(std::make_pair(c, resp->pi.empty() ? skew_ : 1.));
+      }
+    }
+  }
+
+  void evaluate(
+      const std::vector<const GoState*>& states,
+      std::vector<NodeResponse>* resps) {
+    resps->resize(states.size());
+    for (size_t i = 0; i < states.size(); ++i) {
+      evaluate(*states[i], &(*resps)[i]);
+    }
+  }
+
+  AsyncHandle evaluateAsync(
+      const std::vector<const GoState*>& states,
+      std::vector<NodeResponse>* resps) {
+    AsyncHandle h(new AsyncEval);
+    h->done = std::async(std::launch::async, [this, states, resps]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      evaluate(states, resps);
+    });
+    return h;
+  }
+
+  bool isEvaluationReady(const AsyncHandle& h) const {
+    return h->done.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready;
+  }
+
+  void collectEvaluation(AsyncHandle& h) {
+    h->done.get();
+  }
+
+ private:
+  float skew_;
+  std::mt19937 rng_;
+};
+
 } // namespace tree_search
 } // namespace ai
 } // namespace elf
 
+using TestAsyncActor = elf::ai::tree_search::TestAsyncActor;
+using TreeSearch =
+    elf::ai::tree_search::TreeSearchT<State, Action, TestAsyncActor>;
+
 using NodeTest = elf::ai::tree_search::NodeTest;
 using TestActor = elf::ai::tree_search::TestActor;
 
@@ -121,13 +222,12 @@ TEST(MctsTest, testSelectLeaf) {
   NodeTest* root = new NodeTest(0.);
 
   // uniform initialization
-  auto& saPairs = root->getPublicStateActions();
   for (int i = 0; i < 20; ++i) {
     root->insertAction(i + 1, .02);
   }
 
   // modify 1 node
-  saPairs.at(3).prior_probability = 0.4;
+  root->setPrior(3, 0.4);
 
   SearchAlgoOptions algOpt;
   Action action;
@@ -154,7 +254,7 @@ TEST(MctsTest, testBackupIncorporateResults) {
   NodeTest dummy(0.);
   dummy.insertAction(0, 0.);
 
-  NodeTest root(0., &dummy.getEdge(0));
+  NodeTest root(0., &dummy, 0);
   EXPECT_EQ(root.getNumVisits(), 0);
 
   // EdgeInfo to udpate
@@ -186,7 +286,7 @@ TEST(MctsTest, testBackupIncorporateResults) {
          leaf2
      which happens in this test because root is W to play and leaf was a W win.
   */
-  NodeTest leaf(0., &root.getEdge(action));
+  NodeTest leaf(0., &root, action);
   Action action2 = 5;
   leaf.insertAction(action2, 1.);
   EXPECT_TRUE(leaf.updateEdgeStats(action2, -.2, 0.));
@@ -229,9 +329,7 @@ TEST(MctsTest, testAddChild) {
     actor.evaluate(s, resp);
   };
   root->expandIfNecessary(func);
-  auto& stateActions = root->getStateActions();
-  auto it = stateActions.find(17);
-  EXPECT_NE(it, stateActions.end());
+  EXPECT_GE(root->getEdges().find(17), 0);
   NodeId id = root->followEdge(17, tree);
   EXPECT_EQ(id, 1);
 }
@@ -267,6 +365,831 @@ TEST(MctsTest, testAddChildIdempotency) {
   EXPECT_EQ(id, 1);
 }
 
+// node ids are dense and slabs are reused after the tree is advanced
+TEST(MctsTest, testTreeAdvanceRecyclesNodes) {
+  SearchTree tree;
+  TestActor actor;
+  State s;
+  auto func = [&](const Node* n, NodeResponse* resp) {
+    assert(n != nullptr);
+    actor.evaluate(s, resp);
+  };
+
+  Node* root = tree.getRootNode();
+  root->expandIfNecessary(func);
+  NodeId child = root->followEdge(17, tree);
+  EXPECT_EQ(child, 1);
+  EXPECT_EQ(tree.size(), 2u);
+
+  tree.treeAdvance(17);
+  EXPECT_EQ(tree.getRootNode(), tree[child]);
+  tree.waitForReclaim();
+  EXPECT_EQ(tree[0], nullptr);
+  EXPECT_EQ(tree.size(), 1u);
+
+  // Advancing along an unexpanded edge frees everything and allocates a
+  // fresh root.
+  tree.treeAdvance(17);
+  tree.waitForReclaim();
+  EXPECT_EQ(tree.size(), 1u);
+  EXPECT_NE(tree.getRootNode(), nullptr);
+
+  tree.clear();
+  EXPECT_NE(tree.getRootNode(), nullptr);
+  tree.waitForReclaim();
+  EXPECT_EQ(tree.size(), 1u);
+}
+
+// the new root is searchable while the old tree is being freed, and the
+// freed slabs are reused on later moves
+TEST(MctsTest, testDeferredTreeFree) {
+  SearchTree tree;
+  auto func = [&](const Node* n, NodeResponse* resp) {
+    assert(n != nullptr);
+    for (int i = 0; i < 20; ++i) {
+      resp->pi.push_back(std::make_pair(i, .05));
+    }
+    resp->value = 0.;
+  };
+
+  for (int move = 0; move < 20; ++move) {
+    // Grow a two-level tree of 400 nodes under the root.
+    Node* root = tree.getRootNode();
+    root->expandIfNecessary(func);
+    for (size_t i = 0; i < root->getEdges().size(); ++i) {
+      Node* child =
+          tree[root->followEdge(root->getEdges().action(i), tree)];
+      child->expandIfNecessary(func);
+      for (size_t j = 0; j < child->getEdges().size(); ++j) {
+        child->followEdge(child->getEdges().action(j), tree);
+      }
+    }
+
+    tree.treeAdvance(root->getEdges().action(0));
+    ASSERT_NE(tree.getRootNode(), nullptr);
+    EXPECT_TRUE(tree.getRootNode()->isVisited());
+  }
+  tree.waitForReclaim();
+  // The new root and its unexpanded children.
+  EXPECT_EQ(tree.size(), 21u);
+}
+
+// a thread waiting on a leaf is woken once another thread evaluates it
+TEST(MctsTest, testWaitForEvaluation) {
+  Node leaf(0.);
+  elf::ai::tree_search::EvalWaitStats stats;
+  EXPECT_TRUE(leaf.lockNodeForEvaluation());
+
+  std::thread waiter([&]() { leaf.waitForEvaluation(&stats); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  NodeResponse resp;
+  resp.pi.push_back(std::make_pair(17, 1.));
+  resp.value = 0.5;
+  EXPECT_TRUE(leaf.setNodeEvaluationAndUnlock(resp));
+  waiter.join();
+
+  EXPECT_TRUE(leaf.isVisited());
+  EXPECT_EQ(stats.num_waits.load(), 1u);
+  EXPECT_GT(stats.total_wait_usec.load(), 0u);
+
+  // No wait is recorded once the node is visited.
+  leaf.waitForEvaluation(&stats);
+  EXPECT_EQ(stats.num_waits.load(), 1u);
+}
+
+// concurrent backprop gives the same stats on the lock-free and locked paths
+TEST(MctsTest, testConcurrentEdgeUpdates) {
+  for (bool lock_free : {true, false}) {
+    NodeTest node(0.);
+    node.insertAction(3, 1.);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([&]() {
+        for (int i = 0; i < 1000; ++i) {
+          node.addVirtualLoss(3, 1., lock_free);
+          node.updateEdgeStats(3, 0.5, 1., lock_free);
+        }
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+
+    EdgeInfo edge = node.getEdge(3);
+    EXPECT_EQ(edge.num_visits, 8000);
+    EXPECT_FLOAT_EQ(edge.reward, 4000.);
+    EXPECT_FLOAT_EQ(edge.virtual_loss, 0.);
+    EXPECT_EQ(node.getNumVisits(), 8000);
+  }
+}
+
+// pipelined search runs at least as many rollouts as requested and releases
+// every leaf it locked
+TEST(MctsTest, testPipelinedRollouts) {
+  for (int num_pipelined : {1, 3}) {
+    TSOptions options;
+    options.num_threads = 4;
+    options.num_rollouts_per_thread = 50;
+    options.num_rollouts_per_batch = 4;
+    options.num_pipelined_batches = num_pipelined;
+    options.virtual_loss = 1;
+
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    State s;
+    auto result = ts.run(s);
+    // Expanding the root counts as a rollout, but visits no edge (see
+    // testRolloutVisits). Rollouts ending at a leaf another thread is
+    // evaluating are backed up without counting, hence not exact.
+    EXPECT_GE(
+        result.total_visits,
+        options.num_threads * options.num_rollouts_per_thread - 1);
+    EXPECT_NE(result.best_action, M_INVALID);
+    ts.stop();
+  }
+}
+
+// a single thread backs up every rollout but the first, which expands the
+// root: it is a rollout (an evaluation), but there is no edge to visit yet.
+// A batch that expands a leaf from the transposition table may go on to
+// evaluate another one, and so run one rollout more than asked for.
+TEST(MctsTest, testRolloutVisits) {
+  for (int tt_size : {0, 1024}) {
+    SCOPED_TRACE(tt_size);
+    TSOptions options;
+    options.num_threads = 1;
+    options.num_rollouts_per_thread = 300;
+    options.transposition_table_size = tt_size;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    State s;
+    auto result = ts.run(s);
+    // Of all the runs.
+    int num_rollouts = ts.getPhaseStats().num_rollouts;
+    EXPECT_EQ(result.total_visits, num_rollouts - 1);
+    if (tt_size == 0) {
+      EXPECT_EQ(num_rollouts, options.num_rollouts_per_thread);
+    }
+    // The root is expanded already.
+    result = ts.run(s);
+    num_rollouts = ts.getPhaseStats().num_rollouts;
+    EXPECT_EQ(result.total_visits, num_rollouts - 1);
+    if (tt_size == 0) {
+      EXPECT_EQ(num_rollouts, 2 * options.num_rollouts_per_thread);
+    }
+    ts.stop();
+  }
+}
+
+// a fast search runs its own rollout count, regardless of the options
+TEST(MctsTest, testFastSearch) {
+  TSOptions options;
+  options.num_threads = 2;
+  options.num_rollouts_per_thread = 200;
+  options.root_epsilon = 0.25;
+  options.root_alpha = 0.03;
+  TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+  State s;
+  auto result = ts.runFast(s, 10);
+  EXPECT_GE(result.total_visits, 2 * 10 - 1);
+  EXPECT_LE(result.total_visits, 2 * 10);
+  EXPECT_NE(result.best_action, M_INVALID);
+  ts.stop();
+}
+
+// the table is bounded, replaces entries of older searches first and counts
+// hits
+TEST(MctsTest, testTranspositionTable) {
+  elf::ai::tree_search::TranspositionTableT<Action> tt(4);
+  EXPECT_EQ(tt.capacity(), 4u);
+
+  NodeResponse resp;
+  resp.value = 0.5;
+  resp.pi.push_back(std::make_pair(3, 1.));
+  EXPECT_FALSE(tt.lookup(1, &resp));
+  tt.insert(1, resp);
+
+  NodeResponse out;
+  EXPECT_TRUE(tt.lookup(1, &out));
+  EXPECT_EQ(out.value, 0.5);
+  EXPECT_EQ(out.pi.size(), 1u);
+
+  // 1, 3 and 5 share a bucket; 3 is the oldest when 5 comes in.
+  tt.newGeneration();
+  tt.insert(3, resp);
+  tt.newGeneration();
+  tt.insert(1, resp);
+  tt.insert(5, resp);
+  EXPECT_TRUE(tt.lookup(1, &out));
+  EXPECT_FALSE(tt.lookup(3, &out));
+  EXPECT_TRUE(tt.lookup(5, &out));
+  EXPECT_EQ(tt.getStats().replacements.load(), 1u);
+  EXPECT_EQ(tt.getStats().hits.load(), 3u);
+  EXPECT_EQ(tt.getStats().lookups.load(), 5u);
+
+  // Transpositions of the first few moves are found during a search.
+  TSOptions options;
+  options.num_threads = 2;
+  options.num_rollouts_per_thread = 100;
+  options.transposition_table_size = 1024;
+  TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+  State s;
+  auto result = ts.run(s);
+  // As in testPipelinedRollouts.
+  EXPECT_GE(
+      result.total_visits,
+      options.num_threads * options.num_rollouts_per_thread - 1);
+  EXPECT_GT(ts.getTranspositionTable()->getStats().hits.load(), 0u);
+  ts.stop();
+}
+
+// the vectorized PUCT kernels agree with the scalar one, including the
+// first-index tie break and the tail that does not fill a vector
+TEST(MctsTest, testPUCTKernels) {
+  using elf::ai::tree_search::PUCTParams;
+  using elf::ai::tree_search::PUCTResult;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0, 1);
+
+  for (size_t n : {1, 7, 8, 17, 33, 82, 362}) {
+    for (int trial = 0; trial < 20; ++trial) {
+      std::vector<float> prior(n), reward(n), num_visits(n), virtual_loss(n);
+      for (size_t i = 0; i < n; ++i) {
+        prior[i] = trial % 5 == 0 ? 0.1 : unit(rng);
+        num_visits[i] = rng() % 3 == 0 ? 0 : rng() % 20;
+        reward[i] = num_visits[i] * (2 * unit(rng) - 1);
+        virtual_loss[i] = rng() % 4 == 0 ? 1 : 0;
+      }
+      PUCTParams params;
+      params.use_prior = trial % 4 != 0;
+      params.flip_q_sign = trial % 2 == 0;
+      params.sqrt_parent_visits = 1 + trial;
+      params.unsigned_default_q = 0.25;
+
+      const PUCTResult expected = elf::ai::tree_search::PUCTSelectScalar(
+          prior.data(),
+          reward.data(),
+          num_visits.data(),
+          virtual_loss.data(),
+          n,
+          params);
+      const PUCTResult res = elf::ai::tree_search::PUCTSelect(
+          prior.data(),
+          reward.data(),
+          num_visits.data(),
+          virtual_loss.data(),
+          n,
+          params);
+      EXPECT_EQ(res.best, expected.best);
+      EXPECT_NEAR(res.max_score, expected.max_score, 1e-5);
+      EXPECT_NEAR(res.total_unsigned_q, expected.total_unsigned_q, 1e-4);
+      EXPECT_EQ(res.total_visits, expected.total_visits);
+#ifdef __AVX2__
+      const PUCTResult res2 = elf::ai::tree_search::PUCTSelectAVX2(
+          prior.data(),
+          reward.data(),
+          num_visits.data(),
+          virtual_loss.data(),
+          n,
+          params);
+      EXPECT_EQ(res2.best, expected.best);
+      EXPECT_EQ(res2.total_visits, expected.total_visits);
+#endif
+    }
+  }
+}
+
+// the kernels pick the child NodeT::UCT picks with EdgeInfo::getScore(),
+// which counts visits with virtual loss as a whole number, also for
+// fractional virtual losses
+TEST(MctsTest, testPUCTKernelsMatchEdgeScore) {
+  using elf::ai::tree_search::EdgeInfo;
+  using elf::ai::tree_search::PUCTParams;
+  using elf::ai::tree_search::PUCTResult;
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> unit(0, 1);
+  const float kVirtualLosses[] = {0, 0, 0.5, 1, 1.5, -0.5};
+
+  for (size_t n : {5, 8, 19, 82}) {
+    for (int trial = 0; trial < 20; ++trial) {
+      std::vector<float> prior(n), reward(n), num_visits(n), virtual_loss(n);
+      std::vector<EdgeInfo> edges;
+      for (size_t i = 0; i < n; ++i) {
+        prior[i] = unit(rng);
+        num_visits[i] = rng() % 3 == 0 ? 0 : rng() % 5;
+        reward[i] = num_visits[i] * (2 * unit(rng) - 1);
+        virtual_loss[i] = kVirtualLosses[rng() % 6];
+        edges.emplace_back(prior[i]);
+        edges.back().reward = reward[i];
+        edges.back().num_visits = num_visits[i];
+        edges.back().virtual_loss = virtual_loss[i];
+      }
+      PUCTParams params;
+      params.flip_q_sign = trial % 2 == 0;
+      params.sqrt_parent_visits = std::sqrt(1.0f + trial);
+      params.unsigned_default_q = 0.25;
+
+      int best = -1;
+      float max_score = std::numeric_limits<float>::lowest();
+      int total_visits = 0;
+      for (size_t i = 0; i < n; ++i) {
+        const auto s = edges[i].getScore(
+            params.flip_q_sign, 1 + trial, params.unsigned_default_q);
+        const float score = s.prior_probability * params.c_puct + s.q;
+        if (score > max_score) {
+          max_score = score;
+          best = i;
+        }
+        total_visits += !s.first_visit;
+      }
+
+      for (const PUCTResult& res :
+           {elf::ai::tree_search::PUCTSelectScalar(
+                prior.data(),
+                reward.data(),
+                num_visits.data(),
+                virtual_loss.data(),
+                n,
+                params),
+            elf::ai::tree_search::PUCTSelect(
+                prior.data(),
+                reward.data(),
+                num_visits.data(),
+                virtual_loss.data(),
+                n,
+                params)}) {
+        EXPECT_EQ(res.best, best);
+        EXPECT_NEAR(res.max_score, max_score, 1e-5);
+        EXPECT_EQ(res.total_visits, total_visits);
+      }
+    }
+  }
+}
+
+// search stops on its wall-clock budget, stops early once the most visited
+// move is decided, and pondering deepens the tree reused by the next search
+TEST(MctsTest, testTimeManagedSearch) {
+  State s;
+  {
+    TSOptions options;
+    options.num_threads = 2;
+    options.num_rollouts_per_thread = 0;
+    options.time_budget_ms = 30;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    auto start = std::chrono::steady_clock::now();
+    auto result = ts.run(s);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_GE(elapsed, std::chrono::milliseconds(30));
+    EXPECT_LT(elapsed, std::chrono::seconds(5));
+    EXPECT_GT(result.total_visits, 0);
+    ts.stop();
+  }
+  {
+    TSOptions options;
+    // Evaluations take 1ms, so that the budget check keeps up.
+    options.num_threads = 1;
+    options.num_rollouts_per_thread = 300;
+    options.num_rollouts_per_batch = 1;
+    options.num_pipelined_batches = 2;
+    options.early_stop = true;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(100.0); });
+    auto result = ts.run(s);
+    EXPECT_LT(result.total_visits, options.num_rollouts_per_thread);
+    EXPECT_EQ(result.best_action, getCoord(0, 0));
+    ts.stop();
+  }
+  {
+    TSOptions options;
+    options.num_threads = 2;
+    options.num_rollouts_per_thread = 20;
+    options.persistent_tree = true;
+    options.ponder_rollouts_per_thread = 200;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    auto result = ts.run(s);
+    State next(s);
+    next.forward(result.best_action);
+    ts.treeAdvance(result.best_action);
+    ts.ponder(next);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    result = ts.run(next);
+    // Visits from pondered rollouts are kept.
+    EXPECT_GT(
+        result.total_visits,
+        options.num_threads * options.num_rollouts_per_thread);
+    ts.stop();
+  }
+}
+
+// snapshots come while the search runs, and may stop it early
+TEST(MctsTest, testSearchSnapshots) {
+  State s;
+  TSOptions options;
+  options.num_threads = 2;
+  options.num_rollouts_per_thread = 100;
+  // Evaluations take 1ms: the search lasts long enough for a few snapshots.
+  options.num_rollouts_per_batch = 1;
+  options.num_pipelined_batches = 2;
+  TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+
+  using MCTSSnapshot = TreeSearch::MCTSSnapshot;
+  std::vector<MCTSSnapshot> snapshots;
+  ts.setSnapshotCallback(
+      std::chrono::milliseconds(5), 3, [&](const MCTSSnapshot& snapshot) {
+        snapshots.push_back(snapshot);
+        return true;
+      });
+  auto result = ts.run(s);
+  ASSERT_GE(snapshots.size(), 2u);
+  for (size_t i = 0; i < snapshots.size(); ++i) {
+    const MCTSSnapshot& snapshot = snapshots[i];
+    ASSERT_LE(snapshot.moves.size(), 3u);
+    ASSERT_EQ(snapshot.pvs.size(), snapshot.moves.size());
+    for (size_t j = 0; j < snapshot.moves.size(); ++j) {
+      EXPECT_EQ(snapshot.pvs[j][0], snapshot.moves[j].first);
+      if (j > 0) {
+        EXPECT_GE(
+            snapshot.moves[j - 1].second.num_visits,
+            snapshot.moves[j].second.num_visits);
+      }
+    }
+    if (i > 0) {
+      EXPECT_GE(snapshot.total_visits, snapshots[i - 1].total_visits);
+      EXPECT_GT(snapshot.elapsed, snapshots[i - 1].elapsed);
+    }
+  }
+  EXPECT_LT(snapshots.front().total_visits, result.total_visits);
+  // The same, between searches.
+  const MCTSSnapshot last = ts.getSnapshot(1);
+  EXPECT_EQ(last.total_visits, result.total_visits);
+  ASSERT_EQ(last.moves.size(), 1u);
+  EXPECT_EQ(last.moves[0].first, result.best_action);
+  EXPECT_GT(last.pvs[0].size(), 1u);
+
+  ts.clear();
+  int num_snapshots = 0;
+  ts.setSnapshotCallback(
+      std::chrono::milliseconds(5), 3, [&](const MCTSSnapshot&) {
+        return ++num_snapshots < 2;
+      });
+  result = ts.run(s);
+  EXPECT_EQ(num_snapshots, 2);
+  EXPECT_LT(
+      result.total_visits,
+      options.num_threads * options.num_rollouts_per_thread);
+  ts.stop();
+}
+
+// a full tree keeps refining its nodes, and is pruned (keeping the edge
+// statistics) before the next search
+TEST(MctsTest, testNodeBudget) {
+  TSOptions options;
+  options.num_threads = 2;
+  options.num_rollouts_per_thread = 300;
+  options.num_rollouts_per_batch = 4;
+  options.max_num_nodes = 100;
+  TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+  State s;
+  auto result = ts.run(s);
+  const int num_rollouts =
+      options.num_threads * options.num_rollouts_per_thread;
+  EXPECT_GE(result.total_visits, num_rollouts - 1);
+  // Threads may each overshoot by one batch.
+  const size_t max_size =
+      options.max_num_nodes +
+      options.num_threads * options.num_rollouts_per_batch;
+  EXPECT_LE(result.tree_num_nodes, max_size);
+  EXPECT_GE(result.tree_num_nodes, (size_t)options.max_num_nodes);
+  EXPECT_EQ(result.tree_num_nodes, ts.getTreeSize());
+  EXPECT_GT(result.tree_bytes, result.tree_num_nodes * sizeof(Node));
+
+  result = ts.run(s);
+  EXPECT_GE(result.total_visits, 2 * num_rollouts - 1);
+  EXPECT_LE(result.tree_num_nodes, max_size);
+  ts.stop();
+}
+
+// trees charge their slabs, states and edges to the "tree" memory account,
+// and stop growing over its budget
+TEST(MctsTest, testMemoryBudget) {
+  auto& account = elf::ai::tree_search::treeMemory();
+  const int64_t baseline = account.bytes();
+  {
+    SearchTree tree;
+    const int64_t empty = account.bytes();
+    EXPECT_GT(empty, baseline);
+    Node* root = tree.getRootNode();
+    root->expandIfNecessary([](const Node*, NodeResponse* resp) {
+      for (int i = 0; i < 20; ++i) {
+        resp->pi.push_back(std::make_pair(i, .05));
+      }
+    });
+    EXPECT_EQ(account.bytes(), empty + (int64_t)root->memoryBytes());
+  }
+  EXPECT_EQ(account.bytes(), baseline);
+
+  TSOptions options;
+  options.num_threads = 2;
+  options.num_rollouts_per_thread = 300;
+  options.num_rollouts_per_batch = 4;
+  const int num_rollouts =
+      options.num_threads * options.num_rollouts_per_thread;
+  auto gen = [](int) { return new TestAsyncActor(); };
+  State s;
+
+  size_t unconstrained_nodes;
+  int64_t unconstrained_bytes;
+  {
+    TreeSearch ts(options, gen);
+    const int64_t start = account.bytes();
+    unconstrained_nodes = ts.run(s).tree_num_nodes;
+    unconstrained_bytes = account.bytes() - start;
+    ts.stop();
+  }
+
+  TreeSearch ts(options, gen);
+  account.setBudget(account.bytes() + unconstrained_bytes / 4);
+  for (int i = 0; i < 2; ++i) {
+    auto result = ts.run(s);
+    EXPECT_GE(result.total_visits, (i + 1) * num_rollouts - 1);
+    EXPECT_LT(result.tree_num_nodes, unconstrained_nodes / 2);
+  }
+  account.setBudget(0);
+  ts.stop();
+}
+
+// the running byte count of a tree matches a walk of the tree as it grows,
+// advances and is cleared
+TEST(MctsTest, testTreeBytesRunningCount) {
+  auto expand = [](const Node*, NodeResponse* resp) {
+    for (int i = 0; i < 20; ++i) {
+      resp->pi.push_back(std::make_pair(i, .05));
+    }
+  };
+  SearchTree tree;
+  Node* root = tree.getRootNode();
+  root->setStateIfUnset([]() { return new State(); });
+  root->expandIfNecessary(expand);
+  for (size_t i = 0; i < 3; ++i) {
+    Node* child = tree[root->followEdgeAt(i, tree)];
+    child->setStateIfUnset([]() { return new State(); });
+    child->expandIfNecessary(expand);
+  }
+  EXPECT_GT(tree.memoryBytes(), sizeof(State));
+  EXPECT_EQ(tree.memoryBytes(), tree.reachableMemoryBytes());
+
+  tree.treeAdvance(0);
+  tree.waitForReclaim();
+  EXPECT_EQ(tree.memoryBytes(), tree.reachableMemoryBytes());
+
+  tree.clear();
+  tree.waitForReclaim();
+  EXPECT_EQ(tree.memoryBytes(), tree.reachableMemoryBytes());
+}
+
+// a saved tree is loaded back the same, and one of its subtrees seeds the
+// search of its position
+TEST(MctsTest, testSaveLoadTree) {
+  using TreeFile = elf::ai::tree_search::TreeFileT<Action>;
+  TSOptions options;
+  options.num_threads = 1;
+  options.num_rollouts_per_thread = 200;
+  auto gen = [](int) { return new TestAsyncActor(); };
+  State s;
+
+  TreeSearch ts(options, gen);
+  auto result = ts.run(s);
+  std::stringstream ss;
+  ASSERT_TRUE(ts.saveTree(&ss));
+  const std::string saved = ss.str();
+  TreeFile file(saved.data(), saved.size());
+  ASSERT_TRUE(file.valid());
+  EXPECT_EQ(file.numNodes(), ts.getTreeSize());
+
+  SearchTree tree;
+  ASSERT_TRUE(tree.load(file));
+  tree.waitForReclaim();
+  EXPECT_EQ(tree.size(), file.numNodes());
+  std::stringstream ss2;
+  ASSERT_TRUE(tree.save(&ss2));
+  EXPECT_EQ(ss2.str(), saved);
+
+  // Low visit subtrees left out.
+  std::stringstream ss3;
+  ASSERT_TRUE(tree.save(&ss3, 20));
+  const std::string pruned = ss3.str();
+  TreeFile pruned_file(pruned.data(), pruned.size());
+  ASSERT_TRUE(pruned_file.valid());
+  EXPECT_LT(pruned_file.numNodes(), file.numNodes());
+
+  const int64_t child = file.find({result.best_action});
+  ASSERT_GT(child, 0);
+  EXPECT_EQ(file.find({result.best_action, M_INVALID}), -1);
+  int child_visits = 0;
+  for (size_t j = 0; j < file.node(child).num_edges; ++j) {
+    child_visits += file.edge(child, j).num_visits;
+  }
+  ASSERT_GT(child_visits, 0);
+
+  State next(s);
+  ASSERT_TRUE(next.forward(result.best_action));
+  TreeSearch ts2(options, gen);
+  ASSERT_TRUE(ts2.loadTree(file, child));
+  auto next_result = ts2.run(next);
+  EXPECT_GE(
+      next_result.total_visits,
+      child_visits + options.num_rollouts_per_thread);
+  ts.stop();
+  ts2.stop();
+
+  EXPECT_FALSE(TreeFile(saved.data(), saved.size() - 1).valid());
+}
+
+// every phase is timed, histograms add up to the sample counts, and the
+// counters are reset between games
+TEST(MctsTest, testPhaseStats) {
+  for (int num_pipelined : {1, 2}) {
+    TSOptions options;
+    options.num_threads = 2;
+    options.num_rollouts_per_thread = 50;
+    options.num_rollouts_per_batch = 4;
+    options.num_pipelined_batches = num_pipelined;
+    options.virtual_loss = 1;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    State s;
+    ts.run(s);
+
+    auto stats = ts.getPhaseStats();
+    EXPECT_GE(
+        stats.num_rollouts,
+        (uint64_t)options.num_threads * options.num_rollouts_per_thread);
+    EXPECT_GT(stats.num_batches, 0u);
+    EXPECT_GT(stats.num_evaluated, 0u);
+    EXPECT_GT(stats.total_depth, 0u);
+    for (int p = 0; p < elf::ai::tree_search::NUM_SEARCH_PHASES; ++p) {
+      EXPECT_GT(stats.num_samples[p], 0u);
+      uint64_t n = 0;
+      for (uint64_t c : stats.histograms[p]) {
+        n += c;
+      }
+      EXPECT_EQ(n, stats.num_samples[p]);
+      EXPECT_GE(stats.quantileNsec(p, 0.99), stats.quantileNsec(p, 0.5));
+    }
+    if (num_pipelined > 1) {
+      // Asynchronous evaluations take 1ms.
+      EXPECT_GE(
+          stats.quantileNsec(elf::ai::tree_search::PHASE_EVALUATE, 0.5),
+          1000000u);
+    }
+
+    ts.resetPhaseStats();
+    stats = ts.getPhaseStats();
+    EXPECT_EQ(stats.num_rollouts, 0u);
+    EXPECT_EQ(stats.num_samples[elf::ai::tree_search::PHASE_SELECT], 0u);
+    ts.stop();
+  }
+}
+
+// large batches fill up with retries and a growing virtual loss, which is
+// all taken off by the backups
+TEST(MctsTest, testCollisionRetries) {
+  auto search = [](float growth, int retries) {
+    TSOptions options;
+    options.num_threads = 1;
+    options.num_rollouts_per_thread = 400;
+    options.num_rollouts_per_batch = 16;
+    options.virtual_loss = 1;
+    options.virtual_loss_growth = growth;
+    options.max_collision_retries = retries;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    State s;
+    auto result = ts.run(s);
+    // The last batch may overshoot the rollout count.
+    EXPECT_GE(result.total_visits, options.num_rollouts_per_thread - 1);
+    auto stats = ts.getPhaseStats();
+    EXPECT_LE(stats.num_retries, stats.num_batches * retries);
+    EXPECT_LE(
+        stats.num_retries, stats.num_collisions + stats.num_duplicates);
+    for (const auto& p : result.action_edge_pairs) {
+      EXPECT_EQ(p.second.virtual_loss, 0);
+    }
+    ts.stop();
+    return stats;
+  };
+
+  const auto constant = search(0, 0);
+  EXPECT_EQ(constant.num_retries, 0u);
+  EXPECT_GT(constant.collisionRate(), 0);
+  const auto adaptive = search(1, 16);
+  EXPECT_GT(adaptive.num_retries, 0u);
+  EXPECT_GT(
+      (double)adaptive.num_evaluated / adaptive.num_batches,
+      (double)constant.num_evaluated / constant.num_batches);
+}
+
+// root-parallel and hybrid searches merge the visits of all trees
+TEST(MctsTest, testRootParallelSearch) {
+  for (int threads_per_tree : {1, 2}) {
+    TSOptions options;
+    options.num_threads = 4;
+    options.num_threads_per_tree = threads_per_tree;
+    options.num_rollouts_per_thread = 50;
+    options.num_rollouts_per_batch = 4;
+    options.virtual_loss = 1;
+    options.persistent_tree = true;
+    TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+    const size_t num_trees = options.num_threads / threads_per_tree;
+    EXPECT_EQ(ts.getNumTrees(), num_trees);
+
+    State s;
+    auto result = ts.run(s);
+    const int num_rollouts =
+        options.num_threads * options.num_rollouts_per_thread;
+    // Each root expansion counts as a rollout, but visits no edge.
+    EXPECT_GE(result.total_visits, num_rollouts - (int)num_trees);
+    // The last batch of each thread may overshoot.
+    EXPECT_LE(
+        result.total_visits,
+        num_rollouts + options.num_threads * options.num_rollouts_per_batch);
+    EXPECT_NE(result.best_action, M_INVALID);
+    EXPECT_EQ(result.tree_num_nodes, ts.getTreeSize());
+
+    State next(s);
+    next.forward(result.best_action);
+    ts.treeAdvance(result.best_action);
+    result = ts.run(next);
+    EXPECT_GE(result.total_visits, num_rollouts - (int)num_trees);
+    ts.stop();
+  }
+}
+
+// Searches created in fibers run their threads as fibers of the same pool,
+// many more of them than threads.
+TEST(MctsTest, testSearchInFibers) {
+  const int kNumGames = 8;
+  std::atomic<int> num_done(0);
+  {
+    elf::concurrency::FiberPool pool(2);
+    for (int i = 0; i < kNumGames; ++i) {
+      pool.spawn([&num_done]() {
+        TSOptions options;
+        options.num_threads = 4;
+        options.num_threads_per_tree = 2;
+        options.num_rollouts_per_thread = 20;
+        options.num_rollouts_per_batch = 2;
+        options.virtual_loss = 1;
+        options.persistent_tree = true;
+        TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+        State s;
+        for (int move = 0; move < 2; ++move) {
+          auto result = ts.run(s);
+          EXPECT_NE(result.best_action, M_INVALID);
+          EXPECT_GE(result.total_visits, 80 - 2);
+          s.forward(result.best_action);
+          ts.treeAdvance(result.best_action);
+        }
+        ts.stop();
+        num_done++;
+      });
+    }
+    pool.join();
+  }
+  EXPECT_EQ(num_done, kNumGames);
+}
+
+// Games on threads of their own share a search pool that steals work, some
+// of them searching much more than the others.
+TEST(MctsTest, testSharedSearchPool) {
+  const int kNumGames = 6;
+  std::atomic<int> num_done(0);
+  elf::concurrency::FiberPool pool(
+      3, elf::concurrency::FiberPool::kDefaultStackSize, nullptr, true);
+  std::vector<std::thread> games;
+  for (int i = 0; i < kNumGames; ++i) {
+    games.emplace_back([&pool, &num_done, i]() {
+      elf::concurrency::FiberPool::setSpawnPool(&pool);
+      TSOptions options;
+      options.num_threads = 2;
+      options.num_rollouts_per_thread = i % 2 == 0 ? 100 : 5;
+      options.num_rollouts_per_batch = 1;
+      options.virtual_loss = 1;
+      TreeSearch ts(options, [](int) { return new TestAsyncActor(); });
+      State s;
+      for (int move = 0; move < 3; ++move) {
+        auto result = ts.run(s);
+        EXPECT_NE(result.best_action, M_INVALID);
+        s.forward(result.best_action);
+        ts.treeAdvance(result.best_action);
+      }
+      ts.stop();
+      num_done++;
+    });
+  }
+  for (auto& th : games) {
+    th.join();
+  }
+  EXPECT_EQ(num_done, kNumGames);
+}
+
 TEST(MctsTest, testDontPickUnexpandedChild) {
   // SearchTree tree;
   NodeTest root(0.);
@@ -277,8 +1200,7 @@ TEST(MctsTest, testDontPickUnexpandedChild) {
   }
 
   // modify 1 node
-  auto& saPairs = root.getPublicStateActions();
-  saPairs.at(17).prior_probability = 0.999;
+  root.setPrior(17, 0.999);
 
   SearchAlgoOptions algOpt;
   Action action;
@@ -295,13 +1217,47 @@ TEST(MctsTest, testDontPickUnexpandedChild) {
   EXPECT_EQ(action2, 17);
 }
 
-// not test-friendly in ELF
+namespace {
+
+struct PolicyActor : public MCTSActor {
+  using MCTSActor::pi2response;
+};
+
+} // namespace
+
+// pi2response() drops the illegal moves (and pass if disabled), sorts and
+// normalizes the rest, in the buffer it is given.
 TEST(MctsTest, testNeverSelectIllegalMoves) {
-  // in elfgames/go/mcts.h
-  // class MCTSActor
-  // has member function bool pi2response()
-  // bool valid = s.checkMove(v.first))
-  // will not be added in NodeResponse
+  State s;
+  s.forward(getCoord(2, 2));
+  s.forward(getCoord(3, 3));
+  BoardFeature bf(s);
+  std::vector<float> pi(BOARD_NUM_ACTION);
+  for (size_t i = 0; i < BOARD_NUM_ACTION; ++i) {
+    pi[i] = 1.0 + i % 7;
+  }
+
+  std::vector<std::pair<Coord, float>> out;
+  out.reserve(BOARD_NUM_ACTION);
+  const auto* data = out.data();
+  PolicyActor::pi2response(bf, pi.data(), false, &out);
+  EXPECT_EQ(out.data(), data);
+  EXPECT_EQ(out.size(), BOARD_NUM_ACTION - 3);
+  float total = 0;
+  for (size_t i = 0; i < out.size(); ++i) {
+    EXPECT_NE(out[i].first, getCoord(2, 2));
+    EXPECT_NE(out[i].first, getCoord(3, 3));
+    EXPECT_NE(out[i].first, M_PASS);
+    if (i > 0) {
+      EXPECT_GE(out[i - 1].second, out[i].second);
+    }
+    total += out[i].second;
+  }
+  EXPECT_NEAR(total, 1.0, 1e-4);
+
+  PolicyActor::pi2response(bf, pi.data(), true, &out);
+  EXPECT_EQ(out.data(), data);
+  EXPECT_EQ(out.size(), BOARD_NUM_ACTION - 2);
 }
 
 TEST(MctsTest, testDoNotExplorePastFinish) {
@@ -326,6 +1282,230 @@ TEST(MctsTest, testDoNotExplorePastFinish) {
   // resp.pi will be empty
   // so findmove() has no more childen to expand
 }
+
+// The static reply fields only bind the keys they were built with, and
+// registerTo() also makes them available to the dynamic path.
+TEST(MctsTest, testStaticReplyFields) {
+  const int batchsize = 2;
+  elf::Extractor e;
+  e.addField<int64_t>({"a", "rv"}).addExtent(batchsize);
+  e.addField<float>("V").addExtent(batchsize);
+  e.addField<float>("pi").addExtents(batchsize, {batchsize, BOARD_NUM_ACTION});
+  GoReplyFields::Fields::registerTo(&e);
+
+  std::vector<int64_t> a = {SA_PASS, 3};
+  std::vector<int64_t> rv = {7, 8};
+  std::vector<float> v = {0.5, -0.25};
+  std::vector<float> pi(batchsize * BOARD_NUM_ACTION, 0.125);
+  auto anyps = e.getAnyP({"a", "rv", "V", "pi"});
+  anyps.at("a").setAddress((uint64_t)a.data(), {sizeof(int64_t)});
+  anyps.at("rv").setAddress((uint64_t)rv.data(), {sizeof(int64_t)});
+  anyps.at("V").setAddress((uint64_t)v.data(), {sizeof(float)});
+  anyps.at("pi").setAddress(
+      (uint64_t)pi.data(), {BOARD_NUM_ACTION * sizeof(float), sizeof(float)});
+  elf::SharedMem smem(0, elf::SharedMemOptions("actor", batchsize), anyps);
+
+  GoState s;
+  BoardFeature bf(s);
+  GoReply reply(bf);
+  GoReplyFields::Fields fields({"a", "V"});
+  elf::FuncsWithState funcs;
+  fields.bind(reply, &funcs);
+  funcs.mem_to_state_funcs.transfer(1, smem);
+  EXPECT_EQ(reply.c, bf.action2Coord(3));
+  EXPECT_EQ(reply.value, -0.25);
+  EXPECT_EQ(reply.version, -1);
+  EXPECT_EQ(reply.pi[0], 0.0);
+
+  elf::FuncsWithState dynamic;
+  dynamic.mem_to_state_funcs.addFunction(
+      "rv", e.getFunctions("rv")->BindStateToMemToStateFunc(reply));
+  dynamic.mem_to_state_funcs.transfer(0, smem);
+  EXPECT_EQ(reply.version, 7);
+}
+
+// Replies are found again for the same position, history, view and model
+// only, and dropped when a newer model is seen.
+TEST(MctsTest, testEvalCache) {
+  EvalCache cache(1 << 20);
+  cache.setVersion(3);
+  EvalCache::Entry e, out;
+  for (size_t i = 0; i < BOARD_NUM_ACTION; ++i) {
+    e.pi[i] = i;
+  }
+  e.value = 0.25;
+
+  State s;
+  s.forward(getCoord(2, 2));
+  const auto k = EvalCache::key(s, EvalCache::VIEW_RANDOM, 3);
+  EXPECT_FALSE(cache.get(k, &out));
+  cache.put(k, e);
+  ASSERT_TRUE(cache.get(k, &out));
+  EXPECT_EQ(out.value, 0.25);
+  EXPECT_EQ(out.pi[5], 5.0);
+
+  // Same board, other history.
+  State s2;
+  s2.forward(getCoord(3, 3));
+  s2.forward(getCoord(4, 4));
+  s2.forward(getCoord(2, 2));
+  State s3 = s;
+  s3.forward(getCoord(4, 4));
+  s3.forward(getCoord(3, 3));
+  EXPECT_EQ(s2.getHashCode(), s3.getHashCode());
+  EXPECT_NE(
+      EvalCache::key(s2, EvalCache::VIEW_RANDOM, 3).hash,
+      EvalCache::key(s3, EvalCache::VIEW_RANDOM, 3).hash);
+  EXPECT_FALSE(cache.get(EvalCache::key(s, EvalCache::VIEW_ENSEMBLE, 3), &out));
+  EXPECT_FALSE(cache.get(EvalCache::key(s, EvalCache::VIEW_RANDOM, 4), &out));
+
+  cache.setVersion(2);
+  EXPECT_TRUE(cache.get(k, &out));
+  cache.setVersion(4);
+  EXPECT_EQ(cache.version(), 4);
+  EXPECT_FALSE(cache.get(k, &out));
+  // Replies of older models are not kept.
+  cache.put(k, e);
+  EXPECT_FALSE(cache.get(k, &out));
+}
+
+// At most the capacity is kept, the least recently used dropped first.
+TEST(MctsTest, testEvalCacheCapacity) {
+  EvalCache cache(256 * sizeof(EvalCache::Entry));
+  EvalCache::Entry e = {};
+  std::vector<EvalCache::Key> keys;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    keys.push_back({i, 0});
+    cache.put(keys.back(), e);
+    ASSERT_TRUE(cache.get(keys[0], &e));
+  }
+  int num_kept = 0;
+  for (const auto& k : keys) {
+    num_kept += cache.get(k, &e);
+  }
+  EXPECT_LT(num_kept, 256);
+  EXPECT_GT(num_kept, 64);
+  EXPECT_TRUE(cache.get(keys[0], &e));
+}
+
+// The searches of a position count for all its symmetries, in their own
+// orientation, once there are enough of them.
+TEST(MctsTest, testOpeningBook) {
+  OpeningBook book(2, 2, 1 << 20);
+  const int code = 5;
+  State s, s2;
+  s.forward(getCoord(2, 1));
+  s2.forward(getSymmetricCoord(getCoord(2, 1), code));
+  OpeningBook::Policy p, p2, out;
+  p.addAction(getCoord(6, 6), 0.75);
+  p.addAction(M_PASS, 0.25);
+  p2.addAction(getSymmetricCoord(getCoord(6, 6), code), 0.75);
+  p2.addAction(M_PASS, 0.25);
+  float value;
+
+  book.add(s, 3, p, 0.5);
+  EXPECT_FALSE(book.get(s, 3, &out, &value));
+  book.add(s2, 3, p2, 0.0);
+  for (const auto& sp : {std::make_pair(s, p), std::make_pair(s2, p2)}) {
+    ASSERT_TRUE(book.get(sp.first, 3, &out, &value));
+    EXPECT_EQ(value, 0.25);
+    ASSERT_EQ(out.policy.size(), 2u);
+    for (const auto& e : sp.second.policy) {
+      auto it = std::find_if(
+          out.policy.begin(), out.policy.end(), [&](const auto& o) {
+            return o.first == e.first;
+          });
+      ASSERT_NE(it, out.policy.end());
+      EXPECT_FLOAT_EQ(it->second, e.second);
+    }
+  }
+  std::mt19937 rng(1);
+  for (int i = 0; i < 100; ++i) {
+    const Coord c = OpeningBook::sampleWithNoise(p, 0.25, 0.03, &rng);
+    EXPECT_TRUE(c == getCoord(6, 6) || c == M_PASS);
+  }
+
+  // Not of other models, nor beyond the opening.
+  EXPECT_FALSE(book.get(s, 2, &out, &value));
+  State s3 = s;
+  s3.forward(getCoord(6, 6));
+  book.add(s3, 3, p, 0.5);
+  book.add(s3, 3, p, 0.5);
+  EXPECT_FALSE(book.get(s3, 3, &out, &value));
+  // Those of older models are dropped.
+  book.add(s, 4, p, 0.5);
+  EXPECT_FALSE(book.get(s, 3, &out, &value));
+  book.add(s, 3, p, 0.5);
+  book.add(s, 4, p, 0.5);
+  EXPECT_FALSE(book.get(s, 3, &out, &value));
+  EXPECT_TRUE(book.get(s, 4, &out, &value));
+}
+
+// Black holds the four left columns, White the others, each with three eyes:
+// White wins by 9 - 7.5 whatever is played.
+TEST(MctsTest, testPreEvalDecided) {
+  PreEvalRules rules;
+  rules.add("terminal", PreEvalRules::terminal(7.5));
+  rules.add("decided", PreEvalRules::decided(7.5));
+  NodeResponse resp;
+
+  State s;
+  EXPECT_FALSE(rules.resolve(s, &resp));
+  std::string str;
+  for (int y = 0; y < 9; ++y) {
+    const bool eye = y % 3 == 1;
+    str += eye ? "X.XXOO.OO" : "XXXXOOOOO";
+  }
+  loadBoard(s, str);
+  ASSERT_TRUE(rules.resolve(s, &resp));
+  EXPECT_EQ(resp.value, -1.0);
+  ASSERT_EQ(resp.pi.size(), 1u);
+  EXPECT_EQ(resp.pi[0].first, M_PASS);
+
+  // Filling an eye leaves two.
+  s.forward(toFlat(1, 1));
+  EXPECT_TRUE(rules.resolve(s, &resp));
+  s.forward(toFlat(6, 1));
+  s.forward(toFlat(1, 4));
+  EXPECT_FALSE(rules.resolve(s, &resp));
+  EXPECT_EQ(rules.numHits("decided"), 2u);
+  EXPECT_EQ(rules.numHits("terminal"), 0u);
+}
+
+// A position is resolved through a forced move when the one after it is.
+TEST(MctsTest, testPreEvalForced) {
+  PreEvalRules rules;
+  rules.add("after_pass", [](const State& s, NodeResponse* resp) {
+    if (s.lastMove() != M_PASS) {
+      return false;
+    }
+    resp->value = 0.5;
+    resp->pi.clear();
+    return true;
+  });
+  rules.setForced(0, 1);
+  NodeResponse resp;
+
+  // Every empty point is an eye of Black: White can only pass.
+  std::string str;
+  for (int y = 0; y < 9; ++y) {
+    const bool eye = y % 3 == 1;
+    str += eye ? "X.XX.XX.X" : "XXXXXXXXX";
+  }
+  State s;
+  loadBoard(s, str);
+  ASSERT_EQ(s.nextPlayer(), S_WHITE);
+  ASSERT_TRUE(rules.resolve(s, &resp));
+  EXPECT_EQ(resp.value, 0.5);
+  ASSERT_EQ(resp.pi.size(), 1u);
+  EXPECT_EQ(resp.pi[0].first, M_PASS);
+  EXPECT_EQ(rules.numHits("forced"), 1u);
+  EXPECT_EQ(rules.numHits("after_pass"), 0u);
+
+  // Passing is not allowed yet, and White has no point to play.
+  rules.setForced(1000, 1);
+  EXPECT_FALSE(rules.resolve(s, &resp));
+}
 } // anonymous namespace
 
 int main(int argc, char** argv) {
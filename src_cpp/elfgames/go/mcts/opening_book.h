@@ -0,0 +1,249 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "elf/ai/tree_search/tree_search_base.h"
+#include "elfgames/go/base/go_state.h"
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// Root visit distributions of the searches of the first moves, shared by the
+// games of a process: every selfplay game of a model searches the same
+// openings again. Keyed by the position up to symmetry (see
+// getCanonicalHash()), the side to move and the model version. Once
+// min_searches searches of a position are in, the games play it from the
+// book instead of searching.
+//
+// Thread safe. Sharded, each shard a hash map under its own mutex held for a
+// lookup or an addition only; new positions are dropped beyond capacity
+// bytes. Entries of older models are dropped when a newer model version is
+// seen (see setVersion()).
+class OpeningBook {
+ public:
+  using Policy = elf::ai::tree_search::MCTSPolicy<Coord>;
+
+  struct Key {
+    uint64_t hash;
+    int64_t version;
+
+    bool operator==(const Key& k) const {
+      return hash == k.hash && version == k.version;
+    }
+  };
+
+  // Summed over the searches, in the orientation of the canonical board.
+  struct Entry {
+    float visits[BOUND_COORD];
+    float value;
+    int num_searches;
+  };
+
+  // The positions of the first num_plies moves.
+  OpeningBook(int num_plies, int min_searches, size_t capacity)
+      : num_plies_(num_plies),
+        min_searches_(std::max(min_searches, 1)),
+        shard_capacity_(capacity / kNumShards) {}
+
+  // Whether s is in the opening (and not in a ko, which the canonical board
+  // does not see).
+  bool covers(const GoState& s) const {
+    const Board& b = s.board();
+    return s.getPly() <= num_plies_ &&
+        !(b._ko_age == 0 && b._simple_ko != M_PASS);
+  }
+
+  // Drops all the entries if version is newer than any seen so far.
+  void setVersion(int64_t version) {
+    int64_t curr = version_.load();
+    while (version > curr) {
+      if (version_.compare_exchange_weak(curr, version)) {
+        clear();
+        return;
+      }
+    }
+  }
+
+  // Adds a search of s: its normalized root policy and its value.
+  void add(
+      const GoState& s,
+      int64_t version,
+      const Policy& policy,
+      float value) {
+    if (version < 0 || !covers(s)) {
+      return;
+    }
+    setVersion(version);
+    if (version < version_.load()) {
+      return;
+    }
+    int code;
+    const Key k = key(s, version, &code);
+    Shard& shard = shards_[k.hash % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(k);
+    if (it == shard.entries.end()) {
+      if ((shard.entries.size() + 1) * kEntryBytes > shard_capacity_) {
+        num_dropped_++;
+        return;
+      }
+      it = shard.entries.emplace(k, Entry{}).first;
+    }
+    Entry& e = it->second;
+    for (const auto& p : policy.policy) {
+      e.visits[getSymmetricCoord(p.first, code)] += p.second;
+    }
+    e.value += value;
+    e.num_searches++;
+    num_added_++;
+  }
+
+  // The mean policy of the searches of s (in its orientation, its legal
+  // moves only) and their mean value, if there were min_searches of them.
+  bool get(const GoState& s, int64_t version, Policy* policy, float* value) {
+    if (version < 0 || !covers(s)) {
+      return false;
+    }
+    int code;
+    const Key k = key(s, version, &code);
+    Entry e;
+    {
+      Shard& shard = shards_[k.hash % kNumShards];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.entries.find(k);
+      if (it == shard.entries.end() ||
+          it->second.num_searches < min_searches_) {
+        num_misses_++;
+        return false;
+      }
+      e = it->second;
+    }
+    policy->policy.clear();
+    float sum = 0;
+    auto add_move = [&](Coord c) {
+      const float v = e.visits[getSymmetricCoord(c, code)];
+      if (v > 0 && s.checkMove(c)) {
+        policy->addAction(c, v);
+        sum += v;
+      }
+    };
+    for (int y = 0; y < BOARD_SIZE; ++y) {
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        add_move(getCoord(x, y));
+      }
+    }
+    add_move(M_PASS);
+    if (sum <= 0) {
+      num_misses_++;
+      return false;
+    }
+    for (auto& p : policy->policy) {
+      p.second /= sum;
+    }
+    *value = e.value / e.num_searches;
+    num_hits_++;
+    return true;
+  }
+
+  // A move of policy, mixed with Dirichlet noise (alpha) with weight epsilon
+  // as the root of a search would be.
+  static Coord sampleWithNoise(
+      const Policy& policy,
+      float epsilon,
+      float alpha,
+      std::mt19937* rng) {
+    if (epsilon <= 0.0 || alpha <= 0.0) {
+      return policy.sampleAction(rng);
+    }
+    std::gamma_distribution<> dis(alpha);
+    std::vector<float> etas(policy.policy.size());
+    float Z = 1e-10;
+    for (size_t i = 0; i < etas.size(); ++i) {
+      etas[i] = dis(*rng);
+      Z += etas[i];
+    }
+    Policy noisy;
+    for (size_t i = 0; i < etas.size(); ++i) {
+      noisy.addAction(
+          policy.policy[i].first,
+          (1 - epsilon) * policy.policy[i].second + epsilon * etas[i] / Z);
+    }
+    return noisy.sampleAction(rng);
+  }
+
+  void clear() {
+    for (auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.entries.clear();
+    }
+  }
+
+  std::string info() const {
+    size_t n = 0;
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      n += shard.entries.size();
+    }
+    const uint64_t hits = num_hits_.load();
+    const uint64_t lookups = hits + num_misses_.load();
+    std::stringstream ss;
+    ss << "OpeningBook: version: " << version_.load() << ", #positions: " << n
+       << ", bytes: " << n * kEntryBytes
+       << ", #searches: " << num_added_.load()
+       << " (dropped: " << num_dropped_.load() << "), #hits: " << hits << "/"
+       << lookups << " (" << (lookups > 0 ? 100.0 * hits / lookups : 0.0)
+       << "%)";
+    return ss.str();
+  }
+
+ private:
+  static constexpr size_t kNumShards = 16;
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return k.hash ^ (uint64_t(k.version) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+
+  // An entry with (about) its hash map node.
+  static constexpr size_t kEntryBytes =
+      sizeof(Key) + sizeof(Entry) + 3 * sizeof(void*);
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+  };
+
+  const int num_plies_;
+  const int min_searches_;
+  const size_t shard_capacity_;
+  Shard shards_[kNumShards];
+  std::atomic<int64_t> version_{-1};
+  std::atomic<uint64_t> num_added_{0};
+  std::atomic<uint64_t> num_dropped_{0};
+  std::atomic<uint64_t> num_hits_{0};
+  std::atomic<uint64_t> num_misses_{0};
+
+  static Key key(const GoState& s, int64_t version, int* code) {
+    const uint64_t h = s.getCanonicalHashCode(code);
+    return Key{(h ^ s.nextPlayer()) * 1099511628211ULL, version};
+  }
+};
+
+GO_BOARD_NAMESPACE_END
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elf/ai/tree_search/tree_search_base.h"
+#include "elfgames/go/base/board.h"
+#include "elfgames/go/base/go_state.h"
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// Rules that evaluate a position without the neural network when its value
+// is exact, tried in the order they were added. A position resolved this way
+// costs no slot in a batch sent to the network: late in selfplay games, most
+// of the leaves are.
+//
+// Not thread safe (counts hits); one per actor.
+class PreEvalRules {
+ public:
+  using NodeResponse = elf::ai::tree_search::NodeResponseT<Coord>;
+  // Fills the value (Black's, whoever is to move) and the policy, and
+  // returns true if it resolves s.
+  using Rule = std::function<bool(const GoState& s, NodeResponse* resp)>;
+
+  void add(const std::string& name, Rule rule) {
+    rules_.push_back({name, std::move(rule), 0});
+  }
+
+  // A position where the player to move has a single move (pass if no point
+  // is legal, or the only legal point while passing is not allowed before
+  // ply_pass_enabled) is resolved if the position after it is, within depth
+  // such moves.
+  void setForced(int ply_pass_enabled, int depth) {
+    ply_pass_enabled_ = ply_pass_enabled;
+    forced_depth_ = depth;
+  }
+
+  bool resolve(const GoState& s, NodeResponse* resp) {
+    return resolve(s, forced_depth_, true, resp);
+  }
+
+  uint64_t numHits(const std::string& name) const {
+    if (name == "forced") {
+      return num_forced_;
+    }
+    for (const auto& r : rules_) {
+      if (r.name == name) {
+        return r.num_hits;
+      }
+    }
+    return 0;
+  }
+
+  std::string info() const {
+    std::stringstream ss;
+    ss << "PreEvalRules:";
+    for (const auto& r : rules_) {
+      ss << " " << r.name << ": " << r.num_hits;
+    }
+    ss << " forced: " << num_forced_;
+    return ss.str();
+  }
+
+  // The game is over (two passes, superko or too many moves): no further
+  // action.
+  static Rule terminal(float komi) {
+    return [komi](const GoState& s, NodeResponse* resp) {
+      if (!s.terminated()) {
+        return false;
+      }
+      resp->value = s.evaluate(komi) > 0 ? 1.0 : -1.0;
+      resp->pi.clear();
+      return true;
+    };
+  }
+
+  // All the groups live and the empty points are their eyes (see
+  // isScoreDecided()): nothing is left to play but passes.
+  static Rule decided(float komi) {
+    return [komi](const GoState& s, NodeResponse* resp) {
+      const Board* b = &s.board();
+      if (!isScoreDecided(b)) {
+        return false;
+      }
+      resp->value = getFastScore(b, RULE_CHINESE) - komi > 0 ? 1.0 : -1.0;
+      resp->pi.assign(1, std::make_pair(M_PASS, 1.0f));
+      return true;
+    };
+  }
+
+ private:
+  struct Entry {
+    std::string name;
+    Rule rule;
+    uint64_t num_hits;
+  };
+  std::vector<Entry> rules_;
+  int ply_pass_enabled_ = 0;
+  int forced_depth_ = 0;
+  uint64_t num_forced_ = 0;
+
+  bool resolve(const GoState& s, int depth, bool count, NodeResponse* resp) {
+    for (auto& r : rules_) {
+      if (r.rule(s, resp)) {
+        r.num_hits += count;
+        return true;
+      }
+    }
+    Coord m;
+    if (depth <= 0 || !forcedMove(s, &m)) {
+      return false;
+    }
+    GoState next(s);
+    NodeResponse next_resp;
+    if (!next.forward(m) || !resolve(next, depth - 1, false, &next_resp)) {
+      return false;
+    }
+    resp->value = next_resp.value;
+    resp->pi.assign(1, std::make_pair(m, 1.0f));
+    num_forced_ += count;
+    return true;
+  }
+
+  bool forcedMove(const GoState& s, Coord* m) const {
+    const BitBoard& legal = getLegalBits(&s.board());
+    if (s.getPly() >= ply_pass_enabled_) {
+      *m = M_PASS;
+      return legal.empty();
+    }
+    if (legal.count() != 1) {
+      return false;
+    }
+    legal.forEach([&](Coord c) { *m = c; });
+    return true;
+  }
+};
+
+GO_BOARD_NAMESPACE_END
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Selections/sec of the PUCT child-selection kernels on a 19x19-sized node.
+//
+// Usage: benchmark_cpp_elfgames_go_mcts_puct_benchmark [num_children]
+//   [num_iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "elf/ai/tree_search/tree_search_alg.h"
+
+using elf::ai::tree_search::PUCTParams;
+using elf::ai::tree_search::PUCTResult;
+
+namespace {
+
+struct Children {
+  std::vector<float> prior;
+  std::vector<float> reward;
+  std::vector<float> num_visits;
+  std::vector<float> virtual_loss;
+};
+
+Children makeChildren(size_t n, std::mt19937* rng) {
+  std::uniform_real_distribution<float> unit(0, 1);
+  std::uniform_int_distribution<int> visits(0, 50);
+  Children c;
+  for (size_t i = 0; i < n; ++i) {
+    c.prior.push_back(unit(*rng) / n);
+    c.num_visits.push_back(i % 3 == 0 ? 0 : visits(*rng));
+    c.reward.push_back(c.num_visits.back() * (2 * unit(*rng) - 1));
+    c.virtual_loss.push_back(i % 7 == 0 ? 1 : 0);
+  }
+  return c;
+}
+
+template <typename Kernel>
+void run(
+    const std::string& name,
+    Kernel kernel,
+    Children& c,
+    const PUCTParams& params,
+    int num_iterations) {
+  int checksum = 0;
+  const size_t n = c.prior.size();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_iterations; ++i) {
+    // Touch the input so that the call is not hoisted out of the loop.
+    c.reward[i % n] += 1e-6f;
+    PUCTResult res = kernel(
+        c.prior.data(),
+        c.reward.data(),
+        c.num_visits.data(),
+        c.virtual_loss.data(),
+        n,
+        params);
+    checksum += res.best;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << name << ": " << num_iterations / elapsed.count() / 1e6
+            << " M selections/sec, " << elapsed.count() * 1e9 / num_iterations
+            << " ns/selection (checksum " << checksum << ")" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const size_t n = argc > 1 ? std::atoi(argv[1]) : 362;
+  const int num_iterations = argc > 2 ? std::atoi(argv[2]) : 1000000;
+
+  std::mt19937 rng(0);
+  Children c = makeChildren(n, &rng);
+  PUCTParams params;
+  params.sqrt_parent_visits = 100;
+  params.unsigned_default_q = 0.1;
+
+  std::cout << "#children: " << n << ", #iterations: " << num_iterations
+            << std::endl;
+  run("scalar",
+      elf::ai::tree_search::PUCTSelectScalar,
+      c,
+      params,
+      num_iterations);
+#ifdef __AVX2__
+  run("avx2", elf::ai::tree_search::PUCTSelectAVX2, c, params, num_iterations);
+#endif
+#ifdef __AVX512F__
+  run("avx512",
+      elf::ai::tree_search::PUCTSelectAVX512,
+      c,
+      params,
+      num_iterations);
+#endif
+  return 0;
+}
@@ -8,6 +8,9 @@
 
 #pragma once
 
+#include <string.h>
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -17,6 +20,7 @@
 #include <nlohmann/json.hpp>
 
 #include "elf/ai/tree_search/tree_search_options.h"
+#include "elf/utils/binary_utils.h"
 #include "elf/utils/json_utils.h"
 
 #include "base/board.h"
@@ -24,6 +28,50 @@
 
 using json = nlohmann::json;
 
+// Binary encoding of Records and record files (see elf/utils/binary_utils.h):
+// kBinaryMagic, the version and BOUND_COORD, then the payload. The server
+// advertises its version in MsgRequestSeq::wire_version; clients send JSON
+// to servers that do not.
+constexpr uint32_t kBinaryMagic = 0x52464c45; // "ELFR"
+// 2: sparse policies.
+constexpr uint16_t kBinaryVersion = 2;
+
+inline void writeBinaryHeader(elf_utils::BinaryWriter& w) {
+  w.write(kBinaryMagic);
+  w.write(kBinaryVersion);
+  w.write<uint16_t>(BOUND_COORD);
+}
+
+inline bool isBinary(const char* p, size_t n) {
+  uint32_t magic = 0;
+  if (n >= sizeof(magic)) {
+    memcpy(&magic, p, sizeof(magic));
+  }
+  return magic == kBinaryMagic;
+}
+
+inline bool isBinary(const std::string& s) {
+  return isBinary(s.data(), s.size());
+}
+
+inline elf_utils::BinaryReader readBinaryHeader(const char* p, size_t n) {
+  elf_utils::BinaryReader r(p, n);
+  r.read<uint32_t>();
+  const uint16_t version = r.read<uint16_t>();
+  const uint16_t bound_coord = r.read<uint16_t>();
+  if (version > kBinaryVersion || bound_coord != BOUND_COORD) {
+    throw std::runtime_error(
+        "Binary records of version " + std::to_string(version) +
+        ", BOUND_COORD " + std::to_string(bound_coord) + " not supported");
+  }
+  r.setVersion(version);
+  return r;
+}
+
+inline elf_utils::BinaryReader readBinaryHeader(const std::string& s) {
+  return readBinaryHeader(s.data(), s.size());
+}
+
 enum ClientType {
   CLIENT_INVALID,
   CLIENT_SELFPLAY_ONLY,
@@ -70,6 +118,28 @@ struct ClientCtrl {
     return ctrl;
   }
 
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE_ENUM(w, client_type);
+    BIN_SAVE(w, num_game_thread_used);
+    BIN_SAVE(w, black_resign_thres);
+    BIN_SAVE(w, white_resign_thres);
+    BIN_SAVE(w, never_resign_prob);
+    BIN_SAVE(w, player_swap);
+    BIN_SAVE(w, async);
+  }
+
+  static ClientCtrl createFromBinary(elf_utils::BinaryReader& r) {
+    ClientCtrl ctrl;
+    BIN_LOAD_ENUM(ctrl, r, client_type);
+    BIN_LOAD(ctrl, r, num_game_thread_used);
+    BIN_LOAD(ctrl, r, black_resign_thres);
+    BIN_LOAD(ctrl, r, white_resign_thres);
+    BIN_LOAD(ctrl, r, never_resign_prob);
+    BIN_LOAD(ctrl, r, player_swap);
+    BIN_LOAD(ctrl, r, async);
+    return ctrl;
+  }
+
   std::string info() const {
     std::stringstream ss;
     ss << "[client=" << client_type << "][async=" << async << "]"
@@ -146,6 +216,20 @@ struct ModelPair {
     // cout << "extract MCTS complete" << endl;
     return p;
   }
+
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, black_ver);
+    BIN_SAVE(w, white_ver);
+    BIN_SAVE_OBJ(w, mcts_opt);
+  }
+
+  static ModelPair createFromBinary(elf_utils::BinaryReader& r) {
+    ModelPair p;
+    BIN_LOAD(p, r, black_ver);
+    BIN_LOAD(p, r, white_ver);
+    BIN_LOAD_OBJ(p, r, mcts_opt);
+    return p;
+  }
 };
 
 namespace std {
@@ -199,6 +283,18 @@ struct MsgRequest {
     return request;
   }
 
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE_OBJ(w, vers);
+    BIN_SAVE_OBJ(w, client_ctrl);
+  }
+
+  static MsgRequest createFromBinary(elf_utils::BinaryReader& r) {
+    MsgRequest request;
+    BIN_LOAD_OBJ(request, r, vers);
+    BIN_LOAD_OBJ(request, r, client_ctrl);
+    return request;
+  }
+
   std::string setJsonFields() const {
     json j;
     setJsonFields(j);
@@ -223,16 +319,20 @@ struct MsgRequest {
 struct MsgRequestSeq {
   int64_t seq = -1;
   MsgRequest request;
+  // Highest binary version the server reads (0: JSON only).
+  int wire_version = 0;
 
   void setJsonFields(json& j) const {
     JSON_SAVE_OBJ(j, request);
     JSON_SAVE(j, seq);
+    JSON_SAVE(j, wire_version);
   }
 
   static MsgRequestSeq createFromJson(const json& j) {
     MsgRequestSeq s;
     JSON_LOAD_OBJ(s, j, request);
     JSON_LOAD(s, j, seq);
+    JSON_LOAD_OPTIONAL(s, j, wire_version);
     return s;
   }
   std::string dumpJsonString() const {
@@ -248,8 +348,54 @@ struct MsgRequestSeq {
   }
 };
 
+// The MCTS policy of a move: the coords with visits, with their visit counts
+// relative to the most visited one (255). The dense form has prob at these
+// coords and 0 elsewhere.
 struct CoordRecord {
-  unsigned char prob[BOUND_COORD];
+  struct Entry {
+    uint16_t coord;
+    unsigned char prob;
+  };
+  std::vector<Entry> entries;
+
+  void fromDense(const unsigned char* prob) {
+    entries.clear();
+    for (int c = 0; c < BOUND_COORD; ++c) {
+      if (prob[c] > 0) {
+        entries.push_back(Entry{static_cast<uint16_t>(c), prob[c]});
+      }
+    }
+  }
+
+  void toDense(unsigned char* prob) const {
+    std::fill(prob, prob + BOUND_COORD, 0);
+    for (const Entry& e : entries) {
+      prob[e.coord] = e.prob;
+    }
+  }
+
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    w.write<uint16_t>(entries.size());
+    for (const Entry& e : entries) {
+      w.write(e.coord);
+      w.write(e.prob);
+    }
+  }
+
+  static CoordRecord createFromBinary(elf_utils::BinaryReader& r) {
+    CoordRecord record;
+    if (r.version() < 2) {
+      record.fromDense(
+          reinterpret_cast<const unsigned char*>(r.readBytes(BOUND_COORD)));
+      return record;
+    }
+    record.entries.resize(r.read<uint16_t>());
+    for (Entry& e : record.entries) {
+      r.read(&e.coord);
+      r.read(&e.prob);
+    }
+    return record;
+  }
 };
 
 struct MsgResult {
@@ -262,6 +408,25 @@ struct MsgResult {
   std::string content;
   std::vector<CoordRecord> policies;
   std::vector<float> values;
+  // Per move, 1 if it got the full search and is a training target, 0 if a
+  // fast one (its policy is then empty); empty if all moves are targets.
+  std::vector<uint8_t> full_search;
+
+  // Whether move i is a training target.
+  bool isTarget(size_t i) const {
+    return i >= full_search.size() || full_search[i];
+  }
+
+  // Heap memory of the fields.
+  size_t memoryBytes() const {
+    size_t n = using_models.capacity() * sizeof(int64_t) + content.capacity() +
+        policies.capacity() * sizeof(CoordRecord) +
+        values.capacity() * sizeof(float) + full_search.capacity();
+    for (const CoordRecord& p : policies) {
+      n += p.entries.capacity() * sizeof(CoordRecord::Entry);
+    }
+    return n;
+  }
 
   std::string info() const {
     std::stringstream ss;
@@ -284,15 +449,21 @@ struct MsgResult {
     JSON_SAVE(j, using_models);
     JSON_SAVE(j, content);
 
+    // Dense, as read by older servers.
+    unsigned char prob[BOUND_COORD];
     for (size_t i = 0; i < policies.size(); i++) {
       json j1;
-      for (unsigned char c : policies[i].prob) {
+      policies[i].toDense(prob);
+      for (unsigned char c : prob) {
         j1.push_back(c);
       }
       j["policies"].push_back(j1);
     }
 
     JSON_SAVE(j, values);
+    if (!full_search.empty()) {
+      JSON_SAVE(j, full_search);
+    }
   }
 
   static MsgResult createFromJson(const json& j) {
@@ -306,18 +477,22 @@ struct MsgResult {
     JSON_LOAD(res, j, white_never_resign);
     JSON_LOAD_VEC_OPTIONAL(res, j, using_models);
     JSON_LOAD_VEC(res, j, values);
+    JSON_LOAD_VEC_OPTIONAL(res, j, full_search);
 
     if (j.find("policies") != j.end()) {
       // cout << "extract policies" << endl;
       size_t num_policies = j["policies"].size();
       // cout << "Content: " << r.content << endl;
       //
+      unsigned char prob[BOUND_COORD];
       for (size_t i = 0; i < num_policies; i++) {
         json j1 = j["policies"][i];
-        res.policies.emplace_back();
-        for (size_t k = 0; k < j1.size(); k++) {
-          res.policies.back().prob[k] = j1[k];
+        std::fill(prob, prob + BOUND_COORD, 0);
+        for (size_t k = 0; k < j1.size() && k < BOUND_COORD; k++) {
+          prob[k] = j1[k];
         }
+        res.policies.emplace_back();
+        res.policies.back().fromDense(prob);
       }
       // cout << "extract policies complete: " << num_policies << endl;
     }
@@ -326,6 +501,39 @@ struct MsgResult {
     //     endl;
     return res;
   }
+
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, num_move);
+    BIN_SAVE(w, reward);
+    BIN_SAVE(w, black_never_resign);
+    BIN_SAVE(w, white_never_resign);
+    BIN_SAVE(w, using_models);
+    BIN_SAVE(w, content);
+    w.write<uint32_t>(policies.size());
+    for (const CoordRecord& p : policies) {
+      p.setBinaryFields(w);
+    }
+    BIN_SAVE(w, values);
+    BIN_SAVE(w, full_search);
+  }
+
+  static MsgResult createFromBinary(elf_utils::BinaryReader& r) {
+    MsgResult res;
+    BIN_LOAD(res, r, num_move);
+    BIN_LOAD(res, r, reward);
+    BIN_LOAD(res, r, black_never_resign);
+    BIN_LOAD(res, r, white_never_resign);
+    BIN_LOAD(res, r, using_models);
+    BIN_LOAD(res, r, content);
+    const uint32_t num_policies = r.read<uint32_t>();
+    res.policies.reserve(num_policies);
+    for (uint32_t i = 0; i < num_policies; ++i) {
+      res.policies.push_back(CoordRecord::createFromBinary(r));
+    }
+    BIN_LOAD(res, r, values);
+    BIN_LOAD_OPTIONAL(res, r, full_search);
+    return res;
+  }
 };
 
 struct Record {
@@ -338,6 +546,11 @@ struct Record {
   float pri = 0.0;
   bool offline = false;
 
+  // Memory held by the record, e.g. in the replay buffer.
+  size_t memoryBytes() const {
+    return sizeof(Record) + result.memoryBytes();
+  }
+
   std::string info() const {
     std::stringstream ss;
     ss << "[t=" << timestamp << "][id=" << thread_id << "][seq=" << seq
@@ -370,6 +583,28 @@ struct Record {
     return r;
   }
 
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE_OBJ(w, request);
+    BIN_SAVE_OBJ(w, result);
+    BIN_SAVE(w, timestamp);
+    BIN_SAVE(w, thread_id);
+    BIN_SAVE(w, seq);
+    BIN_SAVE(w, pri);
+    BIN_SAVE(w, offline);
+  }
+
+  static Record createFromBinary(elf_utils::BinaryReader& r) {
+    Record rec;
+    BIN_LOAD_OBJ(rec, r, request);
+    BIN_LOAD_OBJ(rec, r, result);
+    BIN_LOAD(rec, r, timestamp);
+    BIN_LOAD(rec, r, thread_id);
+    BIN_LOAD(rec, r, seq);
+    BIN_LOAD(rec, r, pri);
+    BIN_LOAD(rec, r, offline);
+    return rec;
+  }
+
   // Extra serialization.
   static std::vector<Record> createBatchFromJson(const std::string& json_str) {
     auto j = json::parse(json_str);
@@ -384,20 +619,37 @@ struct Record {
     return records;
   }
 
-  static bool loadBatchFromJsonFile(
+  // As createBatchFromJson(), skipping the records that do not parse.
+  static std::vector<Record> createBatchFromBinary(const std::string& s) {
+    elf_utils::BinaryReader r = readBinaryHeader(s);
+    std::vector<Record> records;
+    const uint32_t n = r.read<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i) {
+      elf_utils::BinaryReader sub = r.readBlock();
+      try {
+        records.push_back(createFromBinary(sub));
+      } catch (...) {
+      }
+    }
+    return records;
+  }
+
+  // Binary (dumpBatchBinaryString()) or JSON files.
+  static bool loadBatchFromFile(
       const std::string& f,
       std::vector<Record>* records) {
     assert(records != nullptr);
 
     try {
-      std::ifstream iFile(f.c_str());
+      std::ifstream iFile(f.c_str(), std::ios::binary);
       iFile.seekg(0, std::ios::end);
       size_t size = iFile.tellg();
       std::string buffer(size, ' ');
       iFile.seekg(0);
       iFile.read(&buffer[0], size);
 
-      *records = createBatchFromJson(buffer);
+      *records = isBinary(buffer) ? createBatchFromBinary(buffer)
+                                  : createBatchFromJson(buffer);
       return true;
     } catch (...) {
       return false;
@@ -415,6 +667,32 @@ struct Record {
     }
     return j.dump();
   }
+
+  static std::string dumpBatchBinaryString(
+      std::vector<Record>::const_iterator b,
+      std::vector<Record>::const_iterator e) {
+    std::string s;
+    elf_utils::BinaryWriter w(&s);
+    writeBinaryHeader(w);
+    w.write<uint32_t>(e - b);
+    for (auto it = b; it != e; ++it) {
+      w.writeBlock([&]() { it->setBinaryFields(w); });
+    }
+    return s;
+  }
+
+  // One record with the binary header, e.g. in a replay store.
+  void appendBinaryString(std::string* s) const {
+    elf_utils::BinaryWriter w(s);
+    writeBinaryHeader(w);
+    w.writeBlock([&]() { setBinaryFields(w); });
+  }
+
+  static Record createFromBinaryString(const char* p, size_t n) {
+    elf_utils::BinaryReader r = readBinaryHeader(p, n);
+    elf_utils::BinaryReader sub = r.readBlock();
+    return createFromBinary(sub);
+  }
 };
 
 struct ThreadState {
@@ -445,6 +723,24 @@ struct ThreadState {
     return state;
   }
 
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, thread_id);
+    BIN_SAVE(w, seq);
+    BIN_SAVE(w, move_idx);
+    BIN_SAVE(w, black);
+    BIN_SAVE(w, white);
+  }
+
+  static ThreadState createFromBinary(elf_utils::BinaryReader& r) {
+    ThreadState state;
+    BIN_LOAD(state, r, thread_id);
+    BIN_LOAD(state, r, seq);
+    BIN_LOAD(state, r, move_idx);
+    BIN_LOAD(state, r, black);
+    BIN_LOAD(state, r, white);
+    return state;
+  }
+
   friend bool operator==(const ThreadState& t1, const ThreadState& t2) {
     return t1.thread_id == t2.thread_id && t1.seq == t2.seq &&
         t1.move_idx == t2.move_idx && t1.black == t2.black &&
@@ -532,4 +828,51 @@ struct Records {
   static Records createFromJsonString(const std::string& s) {
     return createFromJson(json::parse(s));
   }
+
+  void setBinaryFields(elf_utils::BinaryWriter& w) const {
+    BIN_SAVE(w, identity);
+    w.write<uint32_t>(states.size());
+    for (const auto& t : states) {
+      w.writeBlock([&]() { t.second.setBinaryFields(w); });
+    }
+    w.write<uint32_t>(records.size());
+    for (const Record& r : records) {
+      w.writeBlock([&]() { r.setBinaryFields(w); });
+    }
+  }
+
+  static Records createFromBinary(elf_utils::BinaryReader& r) {
+    Records rs;
+    BIN_LOAD(rs, r, identity);
+    const uint32_t num_states = r.read<uint32_t>();
+    for (uint32_t i = 0; i < num_states; ++i) {
+      elf_utils::BinaryReader sub = r.readBlock();
+      ThreadState t = ThreadState::createFromBinary(sub);
+      rs.states[t.thread_id] = t;
+    }
+    const uint32_t num_records = r.read<uint32_t>();
+    rs.records.reserve(num_records);
+    for (uint32_t i = 0; i < num_records; ++i) {
+      elf_utils::BinaryReader sub = r.readBlock();
+      rs.records.push_back(Record::createFromBinary(sub));
+    }
+    return rs;
+  }
+
+  std::string dumpBinaryString() const {
+    std::string s;
+    elf_utils::BinaryWriter w(&s);
+    writeBinaryHeader(w);
+    setBinaryFields(w);
+    return s;
+  }
+
+  // Binary (dumpBinaryString()) or JSON (dumpJsonString()).
+  static Records createFromString(const std::string& s) {
+    if (isBinary(s)) {
+      elf_utils::BinaryReader r = readBinaryHeader(s);
+      return createFromBinary(r);
+    }
+    return createFromJsonString(s);
+  }
 };
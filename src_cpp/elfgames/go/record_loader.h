@@ -0,0 +1,260 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "elf/concurrency/ConcurrentQueue.h"
+#include "elf/utils/json_scan.h"
+#include "record.h"
+#include "sgf/sgf_scan.h"
+
+// Loads record files (binary, or JSON arrays of records as written by
+// Record::dumpBatch*String()) and SGF collections (".sgf") without reading
+// them whole: each file is mapped and cut into its records or games (see
+// elf_utils::JsonScanner and SgfScanner) on a scanning thread, a few files at
+// a time, and they are parsed one by one on num_threads threads. At most
+// queue_capacity chunks of chunk_records records wait to be parsed, so that
+// memory stays bounded whatever the size of the files.
+class RecordFileLoader {
+ public:
+  // Called from the parsing threads, with the records of a chunk.
+  using Sink = std::function<void(std::vector<Record>&&)>;
+
+  explicit RecordFileLoader(
+      int num_threads,
+      size_t chunk_records = 64,
+      size_t queue_capacity = 64)
+      : num_threads_(std::max(num_threads, 1)),
+        chunk_records_(std::max<size_t>(chunk_records, 1)),
+        queue_capacity_(queue_capacity) {}
+
+  // Returns the number of records given to sink. Records that do not parse
+  // are skipped, and so is the rest of a file that is malformed. An SGF game
+  // is given as the record of its main variation (see fromSgf()); games of
+  // other boards are skipped.
+  size_t load(const std::vector<std::string>& files, Sink sink) const {
+    Queue q(queue_capacity_);
+    std::atomic<size_t> next_file(0);
+    std::atomic<int> num_scanning(
+        std::min<int>(files.size(), std::max(num_threads_ / 4, 1)));
+    std::atomic<size_t> count(0);
+
+    std::vector<std::thread> threads;
+    for (int i = num_scanning.load(); i > 0; --i) {
+      threads.emplace_back([&]() {
+        for (size_t k = next_file++; k < files.size(); k = next_file++) {
+          scan(files[k], &q);
+        }
+        num_scanning--;
+      });
+    }
+    for (int i = 0; i < num_threads_; ++i) {
+      threads.emplace_back([&]() {
+        ChunkP chunk;
+        while (true) {
+          if (q.pop(&chunk, std::chrono::milliseconds(100))) {
+            count += parse(*chunk, sink);
+          } else if (num_scanning.load() == 0) {
+            while (q.tryPop(&chunk)) {
+              count += parse(*chunk, sink);
+            }
+            return;
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    return count;
+  }
+
+ private:
+  // A read-only mapping of a file.
+  class MappedFile {
+   public:
+    explicit MappedFile(const std::string& f) {
+      const int fd = open(f.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          madvise(p, st.st_size, MADV_SEQUENTIAL);
+          data_ = static_cast<const char*>(p);
+          size_ = st.st_size;
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+      if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+      }
+    }
+
+    const char* data() const {
+      return data_;
+    }
+    size_t size() const {
+      return size_;
+    }
+
+   private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  // Records of a file, as binary blocks, JSON texts or SGF game trees; they
+  // point into the file, which the chunk keeps mapped.
+  struct Chunk {
+    std::shared_ptr<const MappedFile> file;
+    std::vector<elf_utils::BinaryReader> blocks;
+    std::vector<std::pair<const char*, size_t>> texts;
+    std::vector<std::pair<const char*, size_t>> games;
+
+    size_t size() const {
+      return blocks.size() + texts.size() + games.size();
+    }
+  };
+  using ChunkP = std::shared_ptr<Chunk>;
+  using Queue = elf::concurrency::ConcurrentQueueRing<ChunkP>;
+
+  const int num_threads_;
+  const size_t chunk_records_;
+  const size_t queue_capacity_;
+
+  void scan(const std::string& f, Queue* q) const {
+    // SGF collections tend to be many small files.
+    if (!isSgf(f)) {
+      std::cout << "RecordFileLoader: Reading: " << f << std::endl;
+    }
+    auto file = std::make_shared<const MappedFile>(f);
+    if (file->data() == nullptr) {
+      std::cout << "RecordFileLoader: Error reading " << f << std::endl;
+      return;
+    }
+
+    ChunkP chunk = std::make_shared<Chunk>();
+    chunk->file = file;
+    auto flush = [&]() {
+      if (chunk->size() > 0) {
+        q->push(chunk);
+        chunk = std::make_shared<Chunk>();
+        chunk->file = file;
+      }
+    };
+
+    try {
+      if (isSgf(f)) {
+        SgfScanner::forEachGame(
+            file->data(), file->size(), [&](const char* p, size_t n) {
+              chunk->games.emplace_back(p, n);
+              if (chunk->size() >= chunk_records_) {
+                flush();
+              }
+            });
+      } else if (isBinary(file->data(), file->size())) {
+        elf_utils::BinaryReader r =
+            readBinaryHeader(file->data(), file->size());
+        const uint32_t n = r.read<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i) {
+          chunk->blocks.push_back(r.readBlock());
+          if (chunk->size() >= chunk_records_) {
+            flush();
+          }
+        }
+      } else {
+        elf_utils::JsonScanner::forEachArrayElement(
+            file->data(), file->size(), [&](const char* p, size_t n) {
+              chunk->texts.emplace_back(p, n);
+              if (chunk->size() >= chunk_records_) {
+                flush();
+              }
+            });
+      }
+    } catch (const std::exception& e) {
+      std::cout << "RecordFileLoader: Error reading " << f << ": " << e.what()
+                << std::endl;
+    }
+    flush();
+  }
+
+  static bool isSgf(const std::string& f) {
+    return f.size() >= 4 &&
+        (f.compare(f.size() - 4, 4, ".sgf") == 0 ||
+         f.compare(f.size() - 4, 4, ".SGF") == 0);
+  }
+
+  // As a game of versions -1, with the winner as reward (0 if unknown).
+  static Record fromSgf(const SgfGame& game) {
+    Record r;
+    r.request.vers.black_ver = -1;
+    r.request.vers.white_ver = -1;
+    r.result.content = coords2sgfstr(game.moves);
+    r.result.num_move = game.moves.size();
+    r.result.reward = game.winner == S_BLACK
+        ? 1.0
+        : (game.winner == S_WHITE ? -1.0 : 0.0);
+    return r;
+  }
+
+  static size_t parse(const Chunk& chunk, const Sink& sink) {
+    std::vector<Record> records;
+    records.reserve(chunk.size());
+    for (elf_utils::BinaryReader r : chunk.blocks) {
+      try {
+        records.push_back(Record::createFromBinary(r));
+      } catch (...) {
+      }
+    }
+    for (const auto& text : chunk.texts) {
+      try {
+        records.push_back(Record::createFromJson(
+            json::parse(text.first, text.first + text.second)));
+      } catch (...) {
+      }
+    }
+    SgfGame game;
+    for (const auto& text : chunk.games) {
+      try {
+        SgfScanner::parse(text.first, text.second, &game);
+        if (game.size == BOARD_SIZE && !game.moves.empty()) {
+          records.push_back(fromSgf(game));
+        }
+      } catch (...) {
+      }
+    }
+    const size_t n = records.size();
+    if (n > 0) {
+      sink(std::move(records));
+    }
+    return n;
+  }
+};
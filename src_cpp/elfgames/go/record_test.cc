@@ -0,0 +1,339 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "elfgames/go/record.h"
+#include "elfgames/go/record_loader.h"
+
+namespace {
+
+Record makeRecord(int seq) {
+  Record r;
+  r.request.vers.black_ver = 3;
+  r.request.vers.white_ver = -1;
+  r.request.vers.mcts_opt.num_rollouts_per_thread = 40 + seq;
+  r.request.vers.mcts_opt.alg_opt.c_puct = 0.85;
+  r.request.client_ctrl.client_type = CLIENT_EVAL_THEN_SELFPLAY;
+  r.request.client_ctrl.black_resign_thres = 0.05;
+  r.result.num_move = 2;
+  r.result.reward = -1.0;
+  r.result.using_models = {3, 4};
+  r.result.content = "BB;W[aa]";
+  r.result.policies.resize(2);
+  unsigned char prob[BOUND_COORD] = {0};
+  prob[0] = 255;
+  prob[BOUND_COORD - 1] = 3;
+  r.result.policies[0].fromDense(prob);
+  r.result.policies[1].entries = {{42, 255}, {7, 1}};
+  r.result.values = {0.25, -0.5};
+  r.timestamp = 1234567;
+  r.thread_id = 7;
+  r.seq = seq;
+  r.pri = 0.5;
+  return r;
+}
+
+void expectSame(const Record& r1, const Record& r2) {
+  EXPECT_EQ(r1.request.vers, r2.request.vers);
+  EXPECT_EQ(
+      r1.request.client_ctrl.client_type, r2.request.client_ctrl.client_type);
+  EXPECT_EQ(
+      r1.request.client_ctrl.black_resign_thres,
+      r2.request.client_ctrl.black_resign_thres);
+  EXPECT_EQ(r1.result.num_move, r2.result.num_move);
+  EXPECT_EQ(r1.result.reward, r2.result.reward);
+  EXPECT_EQ(r1.result.using_models, r2.result.using_models);
+  EXPECT_EQ(r1.result.content, r2.result.content);
+  ASSERT_EQ(r1.result.policies.size(), r2.result.policies.size());
+  for (size_t i = 0; i < r1.result.policies.size(); ++i) {
+    unsigned char prob1[BOUND_COORD], prob2[BOUND_COORD];
+    r1.result.policies[i].toDense(prob1);
+    r2.result.policies[i].toDense(prob2);
+    EXPECT_EQ(0, memcmp(prob1, prob2, BOUND_COORD));
+  }
+  EXPECT_EQ(r1.result.values, r2.result.values);
+  EXPECT_EQ(r1.result.full_search, r2.result.full_search);
+  EXPECT_EQ(r1.timestamp, r2.timestamp);
+  EXPECT_EQ(r1.thread_id, r2.thread_id);
+  EXPECT_EQ(r1.seq, r2.seq);
+  EXPECT_EQ(r1.pri, r2.pri);
+}
+
+} // namespace
+
+TEST(RecordTest, RecordsBinaryRoundTrip) {
+  Records rs("client-1");
+  rs.addRecord(makeRecord(0));
+  rs.addRecord(makeRecord(1));
+  ThreadState ts;
+  ts.thread_id = 2;
+  ts.seq = 5;
+  ts.move_idx = 17;
+  ts.black = 3;
+  rs.updateState(ts);
+
+  const std::string s = rs.dumpBinaryString();
+  EXPECT_LT(s.size(), rs.dumpJsonString().size());
+
+  Records rs2 = Records::createFromString(s);
+  EXPECT_EQ(rs2.identity, "client-1");
+  ASSERT_EQ(rs2.records.size(), 2u);
+  expectSame(rs.records[0], rs2.records[0]);
+  expectSame(rs.records[1], rs2.records[1]);
+  ASSERT_EQ(rs2.states.count(2), 1u);
+  EXPECT_EQ(rs2.states[2].seq, 5);
+  EXPECT_EQ(rs2.states[2].move_idx, 17);
+  EXPECT_EQ(rs2.states[2].black, 3);
+
+  // Messages of older clients.
+  Records rs3 = Records::createFromString(rs.dumpJsonString());
+  ASSERT_EQ(rs3.records.size(), 2u);
+  expectSame(rs.records[1], rs3.records[1]);
+}
+
+// Playout cap randomization: the second move got a fast search.
+TEST(RecordTest, FullSearchRoundTrip) {
+  Records rs("client-1");
+  rs.addRecord(makeRecord(0));
+  rs.records[0].result.policies[1].entries.clear();
+  rs.records[0].result.full_search = {1, 0};
+  EXPECT_TRUE(rs.records[0].result.isTarget(0));
+  EXPECT_FALSE(rs.records[0].result.isTarget(1));
+
+  Records rs2 = Records::createFromString(rs.dumpBinaryString());
+  ASSERT_EQ(rs2.records.size(), 1u);
+  expectSame(rs.records[0], rs2.records[0]);
+  Records rs3 = Records::createFromString(rs.dumpJsonString());
+  ASSERT_EQ(rs3.records.size(), 1u);
+  expectSame(rs.records[0], rs3.records[0]);
+
+  // All the moves are targets without it.
+  EXPECT_TRUE(makeRecord(0).result.isTarget(1));
+}
+
+TEST(RecordTest, SparsePolicyDenseRoundTrip) {
+  unsigned char prob[BOUND_COORD];
+  for (int i = 0; i < BOUND_COORD; ++i) {
+    prob[i] = i % 5 == 0 ? 0 : i % 256;
+  }
+  CoordRecord p;
+  p.fromDense(prob);
+  for (const auto& e : p.entries) {
+    EXPECT_GT(e.prob, 0);
+  }
+  unsigned char prob2[BOUND_COORD];
+  memset(prob2, 0xff, BOUND_COORD);
+  p.toDense(prob2);
+  EXPECT_EQ(0, memcmp(prob, prob2, BOUND_COORD));
+}
+
+// Version 1 has dense policies.
+TEST(RecordTest, ReadsDensePoliciesOfVersion1) {
+  std::string s;
+  elf_utils::BinaryWriter w(&s);
+  w.write(kBinaryMagic);
+  w.write<uint16_t>(1);
+  w.write<uint16_t>(BOUND_COORD);
+  w.write(std::string("client-1"));
+  w.write<uint32_t>(0);
+  w.write<uint32_t>(1);
+  w.writeBlock([&]() {
+    Record r;
+    BIN_SAVE_OBJ(w, r.request);
+    w.writeBlock([&]() {
+      BIN_SAVE(w, r.result.num_move);
+      BIN_SAVE(w, r.result.reward);
+      BIN_SAVE(w, r.result.black_never_resign);
+      BIN_SAVE(w, r.result.white_never_resign);
+      BIN_SAVE(w, r.result.using_models);
+      BIN_SAVE(w, r.result.content);
+      unsigned char prob[BOUND_COORD] = {0};
+      prob[5] = 255;
+      prob[9] = 17;
+      w.write<uint32_t>(1);
+      w.writeBytes(prob, BOUND_COORD);
+      BIN_SAVE(w, r.result.values);
+    });
+    BIN_SAVE(w, r.timestamp);
+    BIN_SAVE(w, r.thread_id);
+    BIN_SAVE(w, r.seq);
+    BIN_SAVE(w, r.pri);
+    BIN_SAVE(w, r.offline);
+  });
+
+  Records rs = Records::createFromString(s);
+  ASSERT_EQ(rs.records.size(), 1u);
+  ASSERT_EQ(rs.records[0].result.policies.size(), 1u);
+  const auto& entries = rs.records[0].result.policies[0].entries;
+  ASSERT_EQ(entries.size(), 2u);
+  EXPECT_EQ(entries[0].coord, 5);
+  EXPECT_EQ(entries[0].prob, 255);
+  EXPECT_EQ(entries[1].coord, 9);
+  EXPECT_EQ(entries[1].prob, 17);
+}
+
+TEST(RecordTest, SingleRecordBinaryRoundTrip) {
+  const Record r = makeRecord(3);
+  std::string s = "prefix";
+  r.appendBinaryString(&s);
+  expectSame(r, Record::createFromBinaryString(s.data() + 6, s.size() - 6));
+}
+
+TEST(RecordTest, RejectsTruncatedOrForeignInput) {
+  Records rs("client-1");
+  rs.addRecord(makeRecord(0));
+  const std::string s = rs.dumpBinaryString();
+  EXPECT_THROW(
+      Records::createFromString(s.substr(0, s.size() - 1)), std::runtime_error);
+
+  // Another BOUND_COORD.
+  std::string other = s;
+  other[6] ^= 1;
+  EXPECT_THROW(Records::createFromString(other), std::runtime_error);
+}
+
+TEST(RecordTest, LoadsBinaryAndJsonFiles) {
+  std::vector<Record> records = {makeRecord(0), makeRecord(1), makeRecord(2)};
+  const std::string prefix = "record_test_" + std::to_string(getpid());
+  for (bool binary : {true, false}) {
+    const std::string f = prefix + (binary ? ".bin" : ".json");
+    {
+      std::ofstream oo(f, std::ios::binary);
+      oo << (binary
+                 ? Record::dumpBatchBinaryString(records.begin(), records.end())
+                 : Record::dumpBatchJsonString(records.begin(), records.end()));
+    }
+    std::vector<Record> loaded;
+    EXPECT_TRUE(Record::loadBatchFromFile(f, &loaded));
+    ASSERT_EQ(loaded.size(), records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+      expectSame(records[i], loaded[i]);
+    }
+    remove(f.c_str());
+  }
+}
+
+// Several files, with a malformed record and a truncated file.
+TEST(RecordTest, StreamsFilesInChunks) {
+  std::vector<Record> records;
+  for (int i = 0; i < 50; ++i) {
+    records.push_back(makeRecord(i));
+  }
+  const std::string prefix = "record_test_" + std::to_string(getpid());
+  std::vector<std::string> files;
+  for (int k = 0; k < 4; ++k) {
+    files.push_back(prefix + "_" + std::to_string(k));
+    std::ofstream oo(files.back(), std::ios::binary);
+    if (k % 2 == 0) {
+      oo << Record::dumpBatchBinaryString(records.begin(), records.end());
+    } else {
+      std::string s =
+          Record::dumpBatchJsonString(records.begin(), records.end());
+      if (k == 1) {
+        // The first record lacks its result.
+        const size_t pos = s.find("\"result\"");
+        s[pos + 1] = 'X';
+      } else {
+        // Cut in the 50th record.
+        s.resize(s.size() - 100);
+      }
+      oo << s;
+    }
+  }
+  files.push_back(prefix + "_missing");
+
+  std::mutex mutex;
+  std::vector<int> seen(records.size(), 0);
+  size_t num_calls = 0;
+  RecordFileLoader loader(4, 8, 2);
+  const size_t n = loader.load(files, [&](std::vector<Record>&& rs) {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_LE(rs.size(), 8u);
+    num_calls++;
+    for (const Record& r : rs) {
+      const int i = r.request.vers.mcts_opt.num_rollouts_per_thread - 40;
+      ASSERT_GE(i, 0);
+      ASSERT_LT(i, 50);
+      expectSame(records[i], r);
+      seen[i]++;
+    }
+  });
+  EXPECT_EQ(n, 50u * 4 - 2);
+  EXPECT_GE(num_calls, n / 8);
+  EXPECT_EQ(seen[0], 3);
+  EXPECT_EQ(seen[1], 4);
+  EXPECT_EQ(seen[49], 3);
+  for (const auto& f : files) {
+    remove(f.c_str());
+  }
+}
+
+// A collection of games, with one of another board and a broken one, and a
+// file of a single game.
+TEST(RecordTest, LoadsSgfFiles) {
+  const std::string prefix = "record_test_" + std::to_string(getpid());
+  const std::vector<std::string> files = {prefix + "_1.sgf",
+                                          prefix + "_2.SGF"};
+  {
+    std::ofstream oo(files[0]);
+    for (int i = 0; i < 20; ++i) {
+      oo << "(;GM[1]SZ[" << BOARD_SIZE << "]RE[" << (i % 2 == 0 ? "B" : "W")
+         << "+R];B[aa];W[" << coord2str(getCoord(i % BOARD_SIZE, 1))
+         << "])\n";
+    }
+    oo << "(;SZ[" << BOARD_SIZE + 1 << "];B[aa])";
+    oo << "(;SZ[" << BOARD_SIZE << "];B[aa];W)";
+  }
+  {
+    std::ofstream oo(files[1]);
+    oo << "(;SZ[" << BOARD_SIZE << "]RE[0];B[bb])";
+  }
+
+  std::mutex mutex;
+  std::vector<Record> loaded;
+  const size_t n = RecordFileLoader(4, 8, 2).load(
+      files, [&](std::vector<Record>&& rs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded.insert(loaded.end(), rs.begin(), rs.end());
+      });
+  EXPECT_EQ(n, 21u);
+  ASSERT_EQ(loaded.size(), 21u);
+  int num_black_wins = 0;
+  for (const Record& r : loaded) {
+    const std::vector<Coord> moves = sgfstr2coords(r.result.content);
+    EXPECT_EQ(r.result.num_move, (int)moves.size());
+    EXPECT_EQ(r.request.vers.black_ver, -1);
+    if (moves.size() == 1) {
+      EXPECT_EQ(moves[0], str2coord("bb"));
+      EXPECT_EQ(r.result.reward, 0.0);
+    } else {
+      ASSERT_EQ(moves.size(), 2u);
+      EXPECT_EQ(moves[0], str2coord("aa"));
+      EXPECT_EQ(Y(moves[1]), 1);
+      EXPECT_NE(r.result.reward, 0.0);
+      num_black_wins += r.result.reward > 0;
+    }
+  }
+  EXPECT_EQ(num_black_wins, 10);
+  for (const auto& f : files) {
+    remove(f.c_str());
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
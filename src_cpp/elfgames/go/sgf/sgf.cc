@@ -12,6 +12,8 @@
 #include <functional>
 #include <sstream>
 
+GO_BOARD_NAMESPACE_BEGIN
+
 static std::string trim(const std::string& str) {
   int l = 0;
   while (l < (int)str.size() && (str[l] == ' ' || str[l] == '\n'))
@@ -284,3 +286,5 @@ std::string Sgf::printMainVariation() {
   }
   return ss.str();
 }
+
+GO_BOARD_NAMESPACE_END
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <cctype>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -17,23 +18,25 @@
 #include "elfgames/go/base/board.h"
 #include "elfgames/go/base/common.h"
 
+GO_BOARD_NAMESPACE_BEGIN
+
 // Load the remaining part.
-inline Coord str2coord(const std::string& s) {
+inline Coord str2coord(const char* s, size_t n) {
   // cout << "coord:" << s << endl;
   //
-  if (s.size() < 2)
+  if (n < 2)
     return M_PASS;
   size_t i = 0;
-  while (i < s.size() && (s[i] == '\n' || s[i] == ' '))
+  while (i < n && (s[i] == '\n' || s[i] == ' '))
     i++;
-  if (i == s.size())
+  if (i == n)
     return M_INVALID;
   int x = s[i] - 'a';
 
   i++;
-  while (i < s.size() && (s[i] == '\n' || s[i] == ' '))
+  while (i < n && (s[i] == '\n' || s[i] == ' '))
     i++;
-  if (i == s.size())
+  if (i == n)
     return M_INVALID;
   // if (x >= 9) x --;
   int y = s[i] - 'a';
@@ -46,6 +49,10 @@ inline Coord str2coord(const std::string& s) {
   return OFFSETXY(x, y);
 }
 
+inline Coord str2coord(const std::string& s) {
+  return str2coord(s.data(), s.size());
+}
+
 inline std::string coord2str(Coord c) {
   if (c == M_PASS)
     return "";
@@ -86,6 +93,39 @@ inline std::string coord2str2(Coord c) {
   return s + std::to_string(y + 1);
 }
 
+// The inverse of coord2str2() (e.g. "D4", "pass"; case insensitive),
+// M_INVALID if s is not a move of the board.
+inline Coord str2coord2(const std::string& s) {
+  if (s.size() == 4 && tolower(s[0]) == 'p' && tolower(s[1]) == 'a' &&
+      tolower(s[2]) == 's' && tolower(s[3]) == 's') {
+    return M_PASS;
+  }
+  if (s.size() < 2) {
+    return M_INVALID;
+  }
+  const char col = toupper(s[0]);
+  if (col < 'A' || col > 'Z' || col == 'I') {
+    return M_INVALID;
+  }
+  int x = col - 'A';
+  if (x >= 9)
+    x--;
+  int y = 0;
+  for (size_t i = 1; i < s.size(); ++i) {
+    if (!isdigit(s[i])) {
+      return M_INVALID;
+    }
+    y = y * 10 + (s[i] - '0');
+    if (y > BOARD_SIZE) {
+      return M_INVALID;
+    }
+  }
+  y--;
+  if (!ON_BOARD(x, y))
+    return M_INVALID;
+  return OFFSETXY(x, y);
+}
+
 inline std::string coords2sgfstr(const std::vector<Coord>& moves) {
   std::string sgf = "(";
   for (size_t i = 0; i < moves.size(); i++) {
@@ -287,3 +327,5 @@ class Sgf {
   std::string printHeader() const;
   std::string printMainVariation();
 };
+
+GO_BOARD_NAMESPACE_END
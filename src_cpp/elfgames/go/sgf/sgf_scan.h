@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "sgf.h"
+
+GO_BOARD_NAMESPACE_BEGIN
+
+// The main variation of an SGF game, and what of its header training needs.
+struct SgfGame {
+  int size = BOARD_SIZE;
+  float komi = 7.5;
+  int handi = 0;
+  // S_OFF_BOARD if unknown (or a draw).
+  Stone winner = S_OFF_BOARD;
+  std::vector<Coord> moves;
+
+  // Keeps the capacity of moves.
+  void reset() {
+    size = BOARD_SIZE;
+    komi = 7.5;
+    handi = 0;
+    winner = S_OFF_BOARD;
+    moves.clear();
+  }
+};
+
+// Parses SGF text in a single pass, without building the game tree: unlike
+// Sgf, no node or std::string is allocated, only the moves of the main
+// variation are kept. Like Sgf, they stop before a second pass in a row.
+class SgfScanner {
+ public:
+  // Calls f(p, n) on the text of each game tree of the collection in
+  // [p, p + n), e.g. to parse them in parallel. Returns the number of games;
+  // throws std::runtime_error if a game tree is truncated (after the games
+  // before it).
+  template <typename F>
+  static size_t forEachGame(const char* p, size_t n, F f) {
+    const char* end = p + n;
+    size_t count = 0;
+    while ((p = findGame(p, end)) != nullptr) {
+      const char* next = skipGame(p, end);
+      f(p, size_t(next - p));
+      count++;
+      p = next;
+    }
+    return count;
+  }
+
+  // Parses the first game tree in [p, p + n) into g. Throws
+  // std::runtime_error if there is none, or if it is malformed.
+  static void parse(const char* p, size_t n, SgfGame* g) {
+    const char* end = p + n;
+    g->reset();
+    p = findGame(p, end);
+    if (p == nullptr) {
+      throw std::runtime_error("SgfScanner: no game");
+    }
+    // The main variation ends at the first ')', whatever the variations
+    // opened before it.
+    int node = -1;
+    Coord last = M_INVALID;
+    bool ended = false;
+    for (++p; p < end; ++p) {
+      const char c = *p;
+      if (c == ')') {
+        return;
+      } else if (c == ';') {
+        node++;
+      } else if (c >= 'A' && c <= 'Z') {
+        char key[2] = {0, 0};
+        int key_len = 0;
+        while (p < end && isKeyChar(*p)) {
+          if (*p >= 'A' && *p <= 'Z' && key_len < 3) {
+            if (key_len < 2) {
+              key[key_len] = *p;
+            }
+            key_len++;
+          }
+          ++p;
+        }
+        p = skipSpace(p, end);
+        if (p == end || *p != '[') {
+          throw std::runtime_error("SgfScanner: property without value");
+        }
+        while (p < end && *p == '[') {
+          const char* v = p + 1;
+          p = skipValue(v, end);
+          if (node == 0) {
+            header(key, key_len, v, size_t(p - v), g);
+          } else if (
+              node > 0 && !ended && key_len == 1 &&
+              (key[0] == 'B' || key[0] == 'W')) {
+            const Coord m = str2coord(v, size_t(p - v));
+            if (m == M_PASS && last == M_PASS) {
+              ended = true;
+            } else {
+              g->moves.push_back(m);
+              last = m;
+            }
+          }
+          p = skipSpace(p + 1, end);
+        }
+        // Back on the character after the values.
+        --p;
+      } else if (c == '[') {
+        throw std::runtime_error("SgfScanner: value without property");
+      }
+    }
+    throw std::runtime_error("SgfScanner: truncated game");
+  }
+
+ private:
+  static bool isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  // Keys are upper case, but FF[3] allows lower case letters in them.
+  static bool isKeyChar(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+  }
+
+  static const char* skipSpace(const char* p, const char* end) {
+    while (p < end && isSpace(*p)) {
+      ++p;
+    }
+    return p;
+  }
+
+  static const char* findGame(const char* p, const char* end) {
+    return static_cast<const char*>(memchr(p, '(', size_t(end - p)));
+  }
+
+  // The closing ']' of the value whose content starts at p.
+  static const char* skipValue(const char* p, const char* end) {
+    while (true) {
+      const char* q =
+          static_cast<const char*>(memchr(p, ']', size_t(end - p)));
+      if (q == nullptr) {
+        throw std::runtime_error("SgfScanner: truncated value");
+      }
+      // Escaped if preceded by an odd number of backslashes.
+      const char* b = q;
+      while (b > p && b[-1] == '\\') {
+        --b;
+      }
+      if ((q - b) % 2 == 0) {
+        return q;
+      }
+      p = q + 1;
+    }
+  }
+
+  // Past the game tree starting at the '(' at p.
+  static const char* skipGame(const char* p, const char* end) {
+    int depth = 0;
+    for (; p < end; ++p) {
+      if (*p == '[') {
+        p = skipValue(p + 1, end);
+      } else if (*p == '(') {
+        depth++;
+      } else if (*p == ')' && --depth == 0) {
+        return p + 1;
+      }
+    }
+    throw std::runtime_error("SgfScanner: truncated game");
+  }
+
+  static void header(
+      const char* key,
+      int key_len,
+      const char* v,
+      size_t n,
+      SgfGame* g) {
+    if (key_len != 2) {
+      return;
+    }
+    // Numbers are short; copied to be terminated.
+    char num[32];
+    const size_t len = std::min(n, sizeof(num) - 1);
+    memcpy(num, v, len);
+    num[len] = 0;
+    if (key[0] == 'S' && key[1] == 'Z') {
+      g->size = atoi(num);
+    } else if (key[0] == 'K' && key[1] == 'M') {
+      g->komi = strtof(num, nullptr);
+    } else if (key[0] == 'H' && key[1] == 'A') {
+      g->handi = atoi(num);
+    } else if (key[0] == 'R' && key[1] == 'E') {
+      const char* q = skipSpace(v, v + n);
+      if (q < v + n && (*q == 'B' || *q == 'b')) {
+        g->winner = S_BLACK;
+      } else if (q < v + n && (*q == 'W' || *q == 'w')) {
+        g->winner = S_WHITE;
+      }
+    }
+  }
+};
+
+GO_BOARD_NAMESPACE_END
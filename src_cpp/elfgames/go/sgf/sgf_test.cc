@@ -16,6 +16,7 @@
 #include "elfgames/go/base/go_state.h"
 #include "elfgames/go/base/test_utils.h"
 #include "elfgames/go/sgf/sgf.h"
+#include "elfgames/go/sgf/sgf_scan.h"
 
 // notice we have different translate system
 // we do not have a separate function for this
@@ -26,6 +27,21 @@ TEST(SgfTest, testTranslateSgfMove) {
   EXPECT_EQ(str2coord(""), 0);
 }
 
+// GTP moves: column letters skip I.
+TEST(SgfTest, testTranslateGtpMove) {
+  EXPECT_EQ(str2coord2("A1"), toFlat(0, 0));
+  EXPECT_EQ(str2coord2("j2"), toFlat(8, 1));
+  EXPECT_EQ(str2coord2("Pass"), M_PASS);
+  EXPECT_EQ(str2coord2("I3"), M_INVALID);
+  EXPECT_EQ(str2coord2("A0"), M_INVALID);
+  EXPECT_EQ(str2coord2("A99"), M_INVALID);
+  EXPECT_EQ(str2coord2("A"), M_INVALID);
+  for (int x = 0; x < BOARD_SIZE; ++x) {
+    const Coord c = toFlat(x, BOARD_SIZE - 1);
+    EXPECT_EQ(str2coord2(coord2str2(c)), c);
+  }
+}
+
 // in Mini-Go, string -> sgf -> string is tested
 // we just test the end status
 // TODO: do we have a save or tostring function?
@@ -151,6 +167,69 @@ TEST(SgfTest, testChineseHandicap) {
   boardEqual(b, final_b);
 }
 
+TEST(SgfTest, testScannerMatchesSgf) {
+  std::string sgfSample = "";
+  sgfSample += "(;GM[1]FF[4]C[a comment \\] with ( and ;]SZ[9]HA[2]";
+  sgfSample += "KM[5.50]RE[W+R]\n;B[gc]C[B[aa]];W[cg]\n(;B[ee];W[]";
+  sgfSample += ";B[];W[];B[gg])(;B[aa];W[bb]))";
+
+  Sgf sgf;
+  ASSERT_TRUE(sgf.load("", sgfSample));
+  std::vector<Coord> expected;
+  for (auto iter = sgf.begin();
+       !iter.done() && (int)expected.size() < sgf.numMoves();
+       ++iter) {
+    expected.push_back(iter.getCoord());
+  }
+
+  SgfGame game;
+  SgfScanner::parse(sgfSample.data(), sgfSample.size(), &game);
+  EXPECT_EQ(game.moves, expected);
+  EXPECT_EQ(
+      game.moves,
+      std::vector<Coord>(
+          {str2coord("gc"), str2coord("cg"), str2coord("ee"), M_PASS}));
+  EXPECT_EQ(game.size, 9);
+  EXPECT_EQ(game.komi, 5.5);
+  EXPECT_EQ(game.handi, 2);
+  EXPECT_EQ(game.winner, S_WHITE);
+}
+
+TEST(SgfTest, testScannerSplitsCollections) {
+  std::string collection = "\n(;SZ[9]RE[B+1.5];B[aa](;W[bb])(;W[cc]))  ";
+  collection += "(;SZ[19];B[aa])(;RE[Void];B[a)])\n";
+  std::vector<std::string> games;
+  EXPECT_EQ(
+      SgfScanner::forEachGame(
+          collection.data(),
+          collection.size(),
+          [&](const char* p, size_t n) { games.emplace_back(p, n); }),
+      3u);
+  ASSERT_EQ(games.size(), 3u);
+  EXPECT_EQ(games[1], "(;SZ[19];B[aa])");
+
+  SgfGame game;
+  SgfScanner::parse(games[0].data(), games[0].size(), &game);
+  EXPECT_EQ(game.winner, S_BLACK);
+  EXPECT_EQ(game.moves.size(), 2u);
+  SgfScanner::parse(games[1].data(), games[1].size(), &game);
+  EXPECT_EQ(game.size, 19);
+  EXPECT_EQ(game.winner, S_OFF_BOARD);
+  EXPECT_EQ(game.moves, std::vector<Coord>({str2coord("aa")}));
+
+  for (const std::string s :
+       {"", "no game", "(;B[aa]", "(;SZ[9];B[aa", "(;SZ;B[aa])", "(;[aa])"}) {
+    EXPECT_THROW(
+        SgfScanner::parse(s.data(), s.size(), &game), std::runtime_error)
+        << s;
+  }
+  const std::string truncated = "(;B[aa])(;B[bb]";
+  EXPECT_THROW(
+      SgfScanner::forEachGame(
+          truncated.data(), truncated.size(), [](const char*, size_t) {}),
+      std::runtime_error);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
 
@@ -15,6 +15,17 @@ class ContextArgs(object):
             'num_games',
             'number of games',
             1024)
+        spec.addIntOption(
+            'num_game_threads',
+            'threads running the games (and their MCTS) as fibers; '
+            '0 = a thread per game',
+            0)
+        spec.addIntOption(
+            'num_search_threads',
+            'with a thread per game, threads running the MCTS of all the '
+            'games as fibers, stealing work from each other (e.g. the number '
+            'of cores); 0 = threads of each game',
+            0)
         spec.addIntOption(
             'batchsize',
             'batch size',
@@ -27,6 +38,31 @@ class ContextArgs(object):
             'verbose_comm',
             'enables verbose comm',
             False)
+        spec.addIntOption(
+            'numa_collector_node',
+            'NUMA node of the collectors and their shared memory; games '
+            'are spread over the nodes from there (-1 = no pinning)',
+            -1)
+        spec.addStrOption(
+            'gpu_pci_bus_id',
+            'PCI bus id of the GPU, to pin the collectors to its NUMA node '
+            'if numa_collector_node is -1 (e.g. 0000:3b:00.0)',
+            '')
+        spec.addStrOption(
+            'huge_pages',
+            'huge pages of the search trees, datasets and shared memory: '
+            'off, thp (transparent), 2mb or 1gb (hugetlb, falling back to '
+            'thp)',
+            'off')
+        spec.addStrOption(
+            'batch_capture',
+            'file to capture the served batches to, to replay them offline '
+            'against other batching options (see elf.BatchReplay)',
+            '')
+        spec.addIntOption(
+            'batch_capture_max',
+            'batches captured at most (0 = no limit)',
+            0)
         spec.addIntOption(
             'mcts_threads',
             'number of MCTS threads',
@@ -35,6 +71,14 @@ class ContextArgs(object):
             'mcts_rollout_per_batch',
             'Batch size for mcts rollout',
             1)
+        spec.addIntOption(
+            'mcts_pipelined_batches',
+            'number of rollout batches each MCTS thread keeps in flight',
+            1)
+        spec.addIntOption(
+            'mcts_threads_per_tree',
+            'MCTS threads sharing a tree (0 = all, 1 = root parallel)',
+            0)
         spec.addIntOption(
             'mcts_rollout_per_thread',
             'number of rollotus per MCTS thread',
@@ -59,6 +103,40 @@ class ContextArgs(object):
             'mcts_virtual_loss',
             '"virtual" number of losses for MCTS edges',
             0)
+        spec.addFloatOption(
+            'mcts_virtual_loss_growth',
+            'grow the virtual loss of an MCTS edge by this fraction of the '
+            'loss it already has from rollouts in flight (0 = constant)',
+            0.0)
+        spec.addIntOption(
+            'mcts_collision_retries',
+            'MCTS rollouts selected again per batch when they end at a leaf '
+            'already being evaluated',
+            0)
+        spec.addBoolOption(
+            'mcts_lock_free_backprop',
+            'update MCTS edge statistics with atomics instead of locks',
+            True)
+        spec.addIntOption(
+            'mcts_transposition_table_size',
+            'number of entries of the MCTS transposition table (0 = off)',
+            0)
+        spec.addIntOption(
+            'mcts_time_budget_ms',
+            'wall-clock budget of one MCTS search in ms (0 = none)',
+            0)
+        spec.addBoolOption(
+            'mcts_early_stop',
+            'stop MCTS once the most visited move cannot be overtaken',
+            False)
+        spec.addIntOption(
+            'mcts_ponder_rollouts_per_thread',
+            'rollouts per MCTS thread on the opponent\'s time (0 = off)',
+            0)
+        spec.addIntOption(
+            'mcts_max_num_nodes',
+            'node budget of the MCTS tree (0 = unbounded)',
+            0)
         spec.addStrOption(
             'mcts_pick_method',
             'criterion for mcts node selection',
@@ -95,16 +173,34 @@ class ContextArgs(object):
         mcts = co.mcts_options
 
         co.num_games = options.num_games
+        co.num_game_threads = options.num_game_threads
+        co.num_search_threads = options.num_search_threads
         co.batchsize = options.batchsize
         co.T = options.T
         co.verbose_comm = options.verbose_comm
+        co.numa_collector_node = options.numa_collector_node
+        co.gpu_pci_bus_id = options.gpu_pci_bus_id
+        co.huge_pages = options.huge_pages
+        co.batch_capture = options.batch_capture
+        co.batch_capture_max = options.batch_capture_max
 
         mcts.num_threads = options.mcts_threads
         mcts.num_rollouts_per_thread = options.mcts_rollout_per_thread
         mcts.num_rollouts_per_batch = options.mcts_rollout_per_batch
+        mcts.num_pipelined_batches = options.mcts_pipelined_batches
+        mcts.num_threads_per_tree = options.mcts_threads_per_tree
         mcts.verbose = options.mcts_verbose
         mcts.verbose_time = options.mcts_verbose_time
         mcts.virtual_loss = options.mcts_virtual_loss
+        mcts.virtual_loss_growth = options.mcts_virtual_loss_growth
+        mcts.max_collision_retries = options.mcts_collision_retries
+        mcts.lock_free_backprop = options.mcts_lock_free_backprop
+        mcts.transposition_table_size = options.mcts_transposition_table_size
+        mcts.time_budget_ms = options.mcts_time_budget_ms
+        mcts.early_stop = options.mcts_early_stop
+        mcts.ponder_rollouts_per_thread = \
+            options.mcts_ponder_rollouts_per_thread
+        mcts.max_num_nodes = options.mcts_max_num_nodes
         mcts.pick_method = options.mcts_pick_method
         mcts.persistent_tree = options.mcts_persistent_tree
         mcts.root_epsilon = options.mcts_epsilon
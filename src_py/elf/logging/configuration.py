@@ -6,7 +6,7 @@
 
 from elf.options import auto_import_options, PyOptionSpec
 
-from . import LoggerLevel, set_level
+from . import LoggerLevel, init_async, set_level
 
 
 class GlobalLoggingConfigurator(object):
@@ -19,6 +19,11 @@ class GlobalLoggingConfigurator(object):
             ('Global log level. Choose from '
              'trace, debug, info, warning, error, critical, or off)'),
             'info')
+        spec.addIntOption(
+            'log_async_queue',
+            ('If positive, the C++ loggers write on a background thread, '
+             'through a queue of this many messages (dropped when full)'),
+            8192)
         return spec
 
     @auto_import_options
@@ -29,3 +34,5 @@ class GlobalLoggingConfigurator(object):
         loglevel = LoggerLevel.from_str(self.options.loglevel)
         assert loglevel != LoggerLevel.invalid
         set_level(loglevel)
+        if self.options.log_async_queue > 0:
+            init_async(self.options.log_async_queue)
@@ -0,0 +1,12 @@
+# Copyright (c) 2018-present, Facebook, Inc.
+# All rights reserved.
+#
+# This source code is licensed under the BSD-style license found in the
+# LICENSE file in the root directory of this source tree.
+
+# The metrics of the C++ side: snapshot(), scrape() (Prometheus text format)
+# and start_http_server(port) / stop_http_server(); memory_usage() and
+# set_memory_budget(subsystem, bytes).
+
+from _elf._metrics import *
+from .configuration import MemoryBudgetConfigurator
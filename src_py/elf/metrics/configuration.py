@@ -0,0 +1,38 @@
+# Copyright (c) 2018-present, Facebook, Inc.
+# All rights reserved.
+#
+# This source code is licensed under the BSD-style license found in the
+# LICENSE file in the root directory of this source tree.
+
+from elf.options import auto_import_options, PyOptionSpec
+
+from . import set_memory_budget
+
+_SUBSYSTEMS = {
+    'tree': 'the MCTS trees, which stop growing and are pruned over it',
+    'replay': 'the replay buffer, which drops its oldest records over it',
+    'ingest': ('the messages received and not yet inserted, whose clients '
+               'are told to hold back over it'),
+}
+
+
+class MemoryBudgetConfigurator(object):
+    """Memory budgets of the C++ subsystems."""
+    @classmethod
+    def get_option_spec(cls):
+        spec = PyOptionSpec()
+        for name, what in _SUBSYSTEMS.items():
+            spec.addIntOption(
+                f'memory_budget_{name}_mb',
+                f'Memory budget (MB) of {what}; 0 for none',
+                0)
+        return spec
+
+    @auto_import_options
+    def __init__(self, option_map):
+        pass
+
+    def configure(self):
+        for name in _SUBSYSTEMS:
+            mb = getattr(self.options, f'memory_budget_{name}_mb')
+            set_memory_budget(name, mb << 20)
@@ -0,0 +1,11 @@
+# Copyright (c) 2018-present, Facebook, Inc.
+# All rights reserved.
+#
+# This source code is licensed under the BSD-style license found in the
+# LICENSE file in the root directory of this source tree.
+
+# Spans recorded by the C++ side: enable(capacity), disable(), clear() and
+# dump(path) / dump_json() in the Chrome trace format (chrome://tracing,
+# Perfetto).
+
+from _elf._tracing import *
@@ -10,6 +10,8 @@ from collections import defaultdict
 import numpy as np
 import torch
 
+import _elf
+
 
 class Allocator(object):
     ''' A wrapper class for batch data'''
@@ -17,6 +19,7 @@ class Allocator(object):
         "int32_t": torch.IntTensor,
         "int64_t": torch.LongTensor,
         "float": torch.FloatTensor,
+        "uint8_t": torch.ByteTensor,
         "unsigned char": torch.ByteTensor,
         "char": torch.ByteTensor
     }
@@ -24,6 +27,7 @@ class Allocator(object):
         "int32_t": 'i4',
         'int64_t': 'i8',
         'float': 'f4',
+        'uint8_t': 'u1',
         'unsigned char': 'byte',
         'char': 'byte'
     }
@@ -61,6 +65,7 @@ class Allocator(object):
         batch_spec = []
         name2idx = defaultdict(lambda: list())
         idx2name = dict()
+        idx2gpu = dict()
 
         for name, v in spec.items():
             print("%s: %s" % (name, v))
@@ -78,25 +83,68 @@ class Allocator(object):
 
             smem_opts = ctx.createSharedMemOptions(name, this_batchsize)
             smem_opts.setTimeout(v.get("timeout_usec", 0))
-
-            for _ in range(num_recv):
-                smem = ctx.allocateSharedMem(smem_opts, keys)
-                spec = dict((
-                    Allocator._alloc(smem[field], gpu, use_numpy=use_numpy)
-                    for field in keys
-                ))
-
-                # Split spec.
-                spec_input = {key: spec[key] for key in v["input"]}
-                spec_reply = {key: spec[key] for key in v["reply"]}
-
-                batch_spec.append(dict(input=spec_input, reply=spec_reply))
-
-                idx = smem.getSharedMemOptions().idx()
-                name2idx[name].append(idx)
-                idx2name[idx] = name
-
-        return batch_spec, name2idx, idx2name
+            smem_opts.setLatencyTarget(v.get("latency_target_usec", 0))
+            # Weights of the high, normal and low priority requests.
+            for i, w in enumerate(v.get("priority_weights", [])):
+                smem_opts.setPriorityWeight(i, w)
+            # Collectors filling their batches from one shared queue, so
+            # that the next batch is assembled while Python still has the
+            # previous ones.
+            smem_opts.setPooled(v.get("pooled", False))
+            # The number of collectors (and batches) of the label.
+            label_num_recv = v.get("num_recv", num_recv)
+            # The games go on once their states are in the batch, rather
+            # than once it is served (for batches without reply).
+            smem_opts.setReleaseOnFill(v.get("release_on_fill", False))
+            # Batches of the requests of one key only (e.g., the model
+            # version they need), given as batch.key.
+            smem_opts.setPartitionByKey(v.get("partition_by_key", False))
+            # Batches exchanged with other processes through POSIX shared
+            # memory: shm=dict(prefix=..., worker_idx=i) in the processes
+            # running the games, shm=dict(prefix=...) in the one serving
+            # them, with one batch per collector of all the workers.
+            shm = v.get("shm")
+            if shm is not None:
+                if "worker_idx" in shm:
+                    ctx.setShmWorker(
+                        name, shm["prefix"], v["input"], v["reply"],
+                        shm["worker_idx"], label_num_recv)
+                else:
+                    ctx.setShmServer(
+                        name, shm["prefix"], v["input"], v["reply"])
+
+            # The collectors of the label on each of these gpus (or
+            # (gpu, capacity) pairs, capacity the relative speed), rather
+            # than on gpu: the requests go to the least loaded of them.
+            devices = v.get("devices") or [None]
+
+            for device in devices:
+                this_gpu = gpu
+                if device is not None:
+                    this_gpu, capacity = \
+                        device if isinstance(device, tuple) else (device, 1.0)
+                    smem_opts.setDevice(this_gpu, capacity)
+                for _ in range(label_num_recv):
+                    smem = ctx.allocateSharedMem(smem_opts, keys)
+                    spec = dict((
+                        Allocator._alloc(
+                            smem[field], this_gpu, use_numpy=use_numpy)
+                        for field in keys
+                    ))
+
+                    # Split spec.
+                    spec_input = {key: spec[key] for key in v["input"]}
+                    spec_reply = {key: spec[key] for key in v["reply"]}
+
+                    batch_spec.append(
+                        dict(input=spec_input, reply=spec_reply))
+
+                    idx = smem.getSharedMemOptions().idx()
+                    name2idx[name].append(idx)
+                    idx2name[idx] = name
+                    idx2gpu[idx] = this_gpu
+
+        return batch_spec, name2idx, idx2name, idx2gpu
 
 
 def tensor_slice(t, dim, b, e=None):
@@ -317,15 +365,18 @@ class GCWrapper:
         '''
 
         # TODO Make a unified argument server and remove ``params``
-        self.batches, self.name2idx, self.idx2name = Allocator.spec2batches(
-            GC.ctx(), batchsize, spec,
-            use_numpy=use_numpy, gpu=gpu, num_recv=num_recv)
+        self.batches, self.name2idx, self.idx2name, self.idx2gpu = \
+            Allocator.spec2batches(
+                GC.ctx(), batchsize, spec,
+                use_numpy=use_numpy, gpu=gpu, num_recv=num_recv)
         self.batchdim = batchdim
         self.histdim = histdim
         self.gpu = gpu
         self.params = params
         self.GC = GC
         self._cb = {}
+        # Runs the wait / callback / step loop in C++ (see run()).
+        self._dispatcher = _elf.BatchDispatcher(GC.ctx(), batchdim)
 
     def reg_has_callback(self, key):
         return key in self.name2idx
@@ -337,7 +388,7 @@ class GCWrapper:
         else:
             return False
 
-    def reg_callback(self, key, cb):
+    def reg_callback(self, key, cb, zero_copy=False):
         '''Set callback function for key
 
         Parameters:
@@ -347,6 +398,11 @@ class GCWrapper:
             cb(function): the callback function to be called.
               The callback function has the signature
               ``cb(input_batch, input_batch_gpu, reply_batch)``.
+            zero_copy(bool): if True, ``cb(inputs, replies, smem)`` is
+              called directly from C++ with dicts of views on the shared
+              buffers, cut to the batch size; it writes the reply in place,
+              and its return value is ignored. No `Batch` is built and
+              nothing is moved to the gpu.
         '''
         if key not in self.name2idx:
             raise ValueError("Callback[%s] is not in the specification" % key)
@@ -356,6 +412,12 @@ class GCWrapper:
         for idx in self.name2idx[key]:
             # print("Register " + str(cb) + " at idx: %d" % idx)
             self._cb[idx] = cb
+            if zero_copy and cb is not None:
+                self._dispatcher.bind(
+                    idx, cb,
+                    self.batches[idx]["input"], self.batches[idx]["reply"])
+            else:
+                self._dispatcher.bindRaw(idx, self._call)
         return True
 
     def _makebatch(self, key_array):
@@ -379,14 +441,20 @@ class GCWrapper:
         assert batchsize > 0
 
         picked = self._makebatch(self.batches[idx]["input"]).first_k(batchsize)
-        if self.gpu is not None:
-            picked = picked.cpu2gpu(self.gpu)
+        # That of the collector, if the label has devices.
+        gpu = self.idx2gpu.get(idx, self.gpu)
+        if gpu is not None:
+            picked = picked.cpu2gpu(gpu)
 
         # Save the infos structure, if people want to have access to state
         # directly, they can use infos.s[i], which is a state pointer.
         picked.smem = smem
         picked.batchsize = batchsize
         picked.max_batchsize = smem.getSharedMemOptions().batchsize()
+        # -1 unless partitioned by key.
+        picked.key = smem.batch_key()
+        # The callback runs the replica of its model on this one.
+        picked.gpu = gpu
 
         # Get the reply array
         if self.batches[idx]["reply"] is not None:
@@ -398,8 +466,8 @@ class GCWrapper:
         reply = self._cb[idx](picked, *args, **kwargs)
         # If reply is meaningful, send them back.
         if isinstance(reply, dict) and sel_reply is not None:
-            if self.gpu is not None:
-                with torch.cuda.device(self.gpu):
+            if gpu is not None:
+                with torch.cuda.device(gpu):
                     keys_extra, keys_missing = sel_reply.copy_from(reply)
             else:
                 keys_extra, keys_missing = sel_reply.copy_from(reply)
@@ -416,6 +484,9 @@ class GCWrapper:
     def _check_callbacks(self):
         # Check whether all callbacks are assigned properly.
         for key, indices in self.name2idx.items():
+            # Served in C++ (e.g. setTorchScriptBackend), never returned here.
+            if self.GC.ctx().hasInferenceBackend(key):
+                continue
             for idx in indices:
                 if idx not in self._cb:
                     raise ValueError(
@@ -429,6 +500,11 @@ class GCWrapper:
         Samples in a returned batch are always from the same group,
         but the group key of the batch may be arbitrary.
         '''
+        if not args and not kwargs:
+            # Waits and steps with the GIL released.
+            self._dispatcher.run()
+            return
+
         # print("before wait")
         smem = self.GC.ctx().wait()
         # print("before calling")
@@ -436,6 +512,15 @@ class GCWrapper:
         # print("before_step")
         self.GC.ctx().step()
 
+    def run_batches(self, num_batches=0, timeout_usec=0):
+        '''Serve ``num_batches`` batches (no limit if 0) without returning
+        to Python in between; stops early when no batch comes within
+        ``timeout_usec`` (if > 0).
+
+        Returns the number of batches served.
+        '''
+        return self._dispatcher.run(num_batches, timeout_usec)
+
     def start(self):
         '''Start all game environments'''
         self._check_callbacks()
@@ -6,6 +6,7 @@
 
 import os
 
+import torch
 import torch.nn as nn
 import torch.distributed as dist
 
@@ -16,6 +17,29 @@ from elfgames.go.mcts_prediction import MCTSPrediction
 from elfgames.go.multiple_prediction import MultiplePrediction
 
 
+# Values of params["input_format"] (GoFeature::InputFormat).
+INPUT_FLOAT = 0
+INPUT_UINT8 = 1
+INPUT_BITS = 2
+
+
+def unpack_planes(s, input_format, board_size):
+    ''' Convert packed input planes to float, on the device s lives on.
+
+    With INPUT_BITS, s is (batch, planes, bytes) and cell j of a plane is bit
+    (j & 7) of byte (j >> 3).
+    '''
+    if input_format == INPUT_FLOAT:
+        return s
+    if input_format == INPUT_UINT8:
+        return s.float()
+    d = board_size * board_size
+    shifts = torch.arange(8, dtype=torch.uint8, device=s.device)
+    bits = (s.unsqueeze(-1) >> shifts) & 1
+    bits = bits.reshape(s.size(0), s.size(1), -1)[:, :, :d]
+    return bits.float().reshape(s.size(0), s.size(1), board_size, board_size)
+
+
 class Block(Model):
     @classmethod
     def get_option_spec(cls):
@@ -164,6 +188,7 @@ class Model_PolicyValue(Model):
         self.board_size = params["board_size"]
         self.num_future_actions = params["num_future_actions"]
         self.num_planes = params["num_planes"]
+        self.input_format = params.get("input_format", INPUT_FLOAT)
         # print("#future_action: " + str(self.num_future_actions))
         # print("#num_planes: " + str(self.num_planes))
 
@@ -269,7 +294,8 @@ class Model_PolicyValue(Model):
                   "(for cooldown = 50) in this case")
 
     def forward(self, x):
-        s = self._var(x["s"])
+        s = unpack_planes(x["s"], self.input_format, self.board_size)
+        s = self._var(s)
 
         s = self.init_conv(s)
         s = self.resnet(s)
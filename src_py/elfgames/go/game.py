@@ -34,12 +34,74 @@ class Loader(object):
             False)
         spec.addStrListOption(
             'list_files',
-            'Provide a list of json files for offline training',
+            'Provide a list of record (json or binary) or .sgf files for '
+            'offline training',
             [])
+        spec.addStrOption(
+            'dataset',
+            ('a GameDataset (see convertToDataset) for offline training, '
+             'instead of list_files'),
+            '')
+        spec.addIntOption(
+            'checkpoint_interval',
+            ('keep the boards of replayed games every this many moves, to '
+             'reach training positions faster (0 to disable)'),
+            16)
+        spec.addIntOption(
+            'checkpoint_cache_mb',
+            'memory for the boards of checkpoint_interval, in MB',
+            256)
         spec.addIntOption(
             'port',
             'TODO: fill this help message in',
             5556)
+        spec.addIntOption(
+            'num_shards',
+            ('number of shards of the server, which listens on as many '
+             'ports from port; clients pick one by their identity'),
+            1)
+        spec.addStrOption(
+            'shard_addrs',
+            ('addresses of the shards for the clients (host:port,...), '
+             'instead of server_addr with num_shards ports'),
+            '')
+        spec.addIntOption(
+            'failover_sec',
+            ('a client moves to another shard when its shard does not '
+             'answer within this many seconds'),
+            120)
+        spec.addIntOption(
+            'pub_port',
+            ('port on which the server publishes its model updates to the '
+             'clients (0: none)'),
+            0)
+        spec.addIntOption(
+            'stats_port',
+            ('port of the HTTP endpoint with the ingest stats of the server, '
+             'for Prometheus (0: none)'),
+            0)
+        spec.addIntOption(
+            'compression_level',
+            'zstd level of the records sent to the server (0: none); the '
+            'server offers compression to its clients when > 0',
+            0)
+        spec.addStrOption(
+            'compression_dict',
+            'zstd dictionary file, the same on the server and the clients',
+            '')
+        spec.addIntOption(
+            'writer_batch_records',
+            'clients send their records once they have this many of them',
+            32)
+        spec.addIntOption(
+            'writer_batch_sec',
+            '... or once the oldest of them is this old (in sec)',
+            10)
+        spec.addStrOption(
+            'spill_dir',
+            ('directory where clients keep their records while the server '
+             'is busy (empty: in memory)'),
+            '')
         spec.addStrOption(
             'server_addr',
             'TODO: fill this help message in',
@@ -60,6 +122,51 @@ class Loader(object):
             'num_reader',
             'TODO: fill this help message in',
             50)
+        spec.addStrOption(
+            'sampling',
+            ('how records are sampled from the replay buffer: uniform, '
+             'priority (by their priority), recency (the k-th newest with '
+             'weight recency_decay^k) or stratified (uniform among the '
+             'versions of the models that played them)'),
+            'uniform')
+        spec.addFloatOption(
+            'recency_decay',
+            'decay of the weights of older records with recency sampling',
+            0.999)
+        spec.addStrOption(
+            'replay_dir',
+            ('directory the replay buffer is persisted to, and restored '
+             'from on startup (empty: none)'),
+            '')
+        spec.addIntOption(
+            'replay_segment_mb',
+            'size of the segment files in replay_dir, in MB',
+            64)
+        spec.addIntOption(
+            'replay_max_segments',
+            'number of segment files kept in replay_dir',
+            16)
+        spec.addIntOption(
+            'replay_load_segments',
+            'number of the newest segment files restored on startup',
+            4)
+        spec.addIntOption(
+            'replay_pack_level',
+            ('if positive, the replay buffer keeps its records compressed '
+             '(zstd level, if available) and decodes them when sampled, '
+             'for a longer replay window in the same memory'),
+            0)
+        spec.addIntOption(
+            'replay_version_window',
+            ('keep only the replay records of the models of the last '
+             'replay_version_window versions (0: all)'),
+            0)
+        spec.addStrOption(
+            'replay_version_quotas',
+            ('largest shares of the samples of the replay records of the '
+             'newest, second newest, ... model versions, the last one for '
+             'older versions, e.g. "1,0.3,0.1" (empty: none)'),
+            '')
         spec.addIntOption(
             'num_reset_ranking',
             'TODO: fill this help message in',
@@ -158,10 +265,35 @@ class Loader(object):
             'use_df_feature',
             'TODO: fill this help message in',
             False)
+        spec.addStrOption(
+            'input_format',
+            'layout of the input planes: float, uint8 (one byte per cell) '
+            'or bits (bit-packed planes, unpacked by the model on the GPU). '
+            'The packed layouts need AGZ features',
+            'float')
         spec.addStrOption(
             'dump_record_prefix',
             'TODO: fill this help message in',
             '')
+        spec.addBoolOption(
+            'dump_record_archive',
+            ('write the dumps to hourly archives on a background thread '
+             'instead of a file each'),
+            True)
+        spec.addIntOption(
+            'dump_record_zstd_level',
+            'zstd level of the archived dumps (0: not compressed)',
+            0)
+        spec.addBoolOption(
+            'dump_tree_binary',
+            'dump the search trees in the binary tree format instead of '
+            'as text',
+            False)
+        spec.addBoolOption(
+            'binary_records',
+            'save the selfplay and eval records of the server in the '
+            'binary format (loaded like the JSON ones)',
+            False)
         spec.addIntOption(
             'policy_distri_cutoff',
             'TODO: fill this help message in',
@@ -174,10 +306,66 @@ class Loader(object):
             'following_pass',
             'TODO: fill this help message in',
             False)
+        spec.addBoolOption(
+            'd4_ensemble',
+            'Evaluate every MCTS leaf under all 8 board symmetries and '
+            'average the network outputs (8x the network work)',
+            False)
+        spec.addIntOption(
+            'eval_cache_mb',
+            ('memory for the network replies shared by the games of the '
+             'process, in MB (0 to disable)'),
+            0)
+        spec.addIntOption(
+            'opening_book_plies',
+            ('selfplay plays the first moves from the root policies of '
+             'earlier searches of the same model, shared by the games of '
+             'the process (0 to always search)'),
+            0)
+        spec.addIntOption(
+            'opening_book_searches',
+            'searches of a position before the opening book plays it',
+            8)
+        spec.addIntOption(
+            'opening_book_mb',
+            'memory for the opening book, in MB',
+            64)
+        spec.addBoolOption(
+            'resolve_without_nn',
+            ('evaluate MCTS leaves of exact value (decided score, forced '
+             'moves) without the network'),
+            True)
         spec.addIntOption(
             'selfplay_timeout_usec',
             'TODO: fill this help message in',
             0)
+        spec.addIntOption(
+            'selfplay_latency_target_usec',
+            'If > 0, adapt the selfplay actor batch sizes to keep requests '
+            'within this latency (usec)',
+            0)
+        spec.addIntOption(
+            'online_latency_target_usec',
+            'If > 0, adapt the online actor batch size to keep requests '
+            'within this latency (usec)',
+            0)
+        spec.addBoolOption(
+            'pooled_collectors',
+            'Let the collectors of a selfplay actor fill their batches from '
+            'a shared queue, rather than each from its own',
+            False)
+        spec.addStrOption(
+            'selfplay_devices',
+            'If set, gpus of the selfplay actors ("0,1,2:2", gpu[:capacity] '
+            'with capacity the relative speed), each with the collectors of '
+            'an actor; requests go to the least loaded one. For actors '
+            'served in C++, or callbacks using the model of batch.gpu',
+            '')
+        spec.addIntOption(
+            'train_prefetch',
+            'If > 0, number of training batches kept ready for the trainer, '
+            'filled by the games while it trains on another one',
+            0)
         spec.addIntOption(
             'gpu',
             'TODO: fill this help message in',
@@ -186,6 +374,15 @@ class Loader(object):
             'policy_distri_training_for_all',
             'TODO: fill this help message in',
             False)
+        spec.addFloatOption(
+            'full_search_prob',
+            'probability that a selfplay move gets the full search and is a '
+            'training target; the others get a fast search',
+            1.0)
+        spec.addIntOption(
+            'fast_rollouts_per_thread',
+            'rollouts per thread of the fast searches (see full_search_prob)',
+            100)
         spec.addBoolOption(
             'parameter_print',
             'TODO: fill this help message in',
@@ -225,6 +422,16 @@ class Loader(object):
             'eval_winrate_thres',
             'Win rate threshold for evalution',
             0.55)
+        spec.addFloatOption(
+            'eval_sprt_margin',
+            ('If > 0, end an evaluation as soon as a sequential test (SPRT) '
+             'tells the win rate is above or below eval_winrate_thres by '
+             'this margin'),
+            0.0)
+        spec.addFloatOption(
+            'eval_sprt_error',
+            'Error rates of the sequential test of eval_sprt_margin',
+            0.05)
         spec.addIntOption(
             'eval_old_model',
             ('If specified, then we directly switch to evaluation mode '
@@ -276,6 +483,9 @@ class Loader(object):
         opt = go.GameOptions()
         opt.seed = 0
         opt.list_files = self.options.list_files
+        opt.dataset = self.options.dataset
+        opt.checkpoint_interval = self.options.checkpoint_interval
+        opt.checkpoint_cache_mb = self.options.checkpoint_cache_mb
 
         if self.options.server_addr:
             opt.server_addr = self.options.server_addr
@@ -288,13 +498,30 @@ class Loader(object):
                 opt.server_id = ""
 
         opt.port = self.options.port
+        opt.num_shards = self.options.num_shards
+        opt.shard_addrs = self.options.shard_addrs
+        opt.failover_sec = self.options.failover_sec
+        opt.pub_port = self.options.pub_port
+        opt.stats_port = self.options.stats_port
+        opt.compression_level = self.options.compression_level
+        opt.compression_dict = self.options.compression_dict
+        opt.writer_batch_records = self.options.writer_batch_records
+        opt.writer_batch_sec = self.options.writer_batch_sec
+        opt.spill_dir = self.options.spill_dir
         opt.mode = self.options.mode
         opt.use_mcts = self.options.use_mcts
         opt.use_mcts_ai2 = self.options.use_mcts_ai2
         opt.use_df_feature = self.options.use_df_feature
+        opt.input_format = self.options.input_format
         opt.dump_record_prefix = self.options.dump_record_prefix
+        opt.dump_record_archive = self.options.dump_record_archive
+        opt.dump_record_zstd_level = self.options.dump_record_zstd_level
+        opt.dump_tree_binary = self.options.dump_tree_binary
+        opt.binary_records = self.options.binary_records
         opt.policy_distri_training_for_all = \
             self.options.policy_distri_training_for_all
+        opt.full_search_prob = self.options.full_search_prob
+        opt.fast_rollouts_per_thread = self.options.fast_rollouts_per_thread
         opt.verbose = self.options.verbose
         opt.black_use_policy_network_only = \
             self.options.black_use_policy_network_only
@@ -304,6 +531,15 @@ class Loader(object):
         opt.ratio_pre_moves = self.options.ratio_pre_moves
         opt.q_min_size = self.options.q_min_size
         opt.q_max_size = self.options.q_max_size
+        opt.sampling = self.options.sampling
+        opt.recency_decay = self.options.recency_decay
+        opt.replay_dir = self.options.replay_dir
+        opt.replay_segment_mb = self.options.replay_segment_mb
+        opt.replay_max_segments = self.options.replay_max_segments
+        opt.replay_load_segments = self.options.replay_load_segments
+        opt.replay_pack_level = self.options.replay_pack_level
+        opt.replay_version_window = self.options.replay_version_window
+        opt.replay_version_quotas = self.options.replay_version_quotas
         opt.num_reader = self.options.num_reader
         opt.start_ratio_pre_moves = self.options.start_ratio_pre_moves
         opt.ply_pass_enabled = self.options.ply_pass_enabled
@@ -313,6 +549,12 @@ class Loader(object):
         opt.policy_distri_cutoff = self.options.policy_distri_cutoff
         opt.num_games_per_thread = self.options.num_games_per_thread
         opt.following_pass = self.options.following_pass
+        opt.d4_ensemble = self.options.d4_ensemble
+        opt.eval_cache_mb = self.options.eval_cache_mb
+        opt.opening_book_plies = self.options.opening_book_plies
+        opt.opening_book_searches = self.options.opening_book_searches
+        opt.opening_book_mb = self.options.opening_book_mb
+        opt.resolve_without_nn = self.options.resolve_without_nn
         opt.resign_thres = self.options.resign_thres
         opt.preload_sgf = self.options.preload_sgf
         opt.preload_sgf_move_to = self.options.preload_sgf_move_to
@@ -332,6 +574,8 @@ class Loader(object):
         opt.selfplay_async = self.options.selfplay_async
         opt.eval_num_games = self.options.eval_num_games
         opt.eval_thres = self.options.eval_winrate_thres
+        opt.eval_sprt_margin = self.options.eval_sprt_margin
+        opt.eval_sprt_error = self.options.eval_sprt_error
         opt.cheat_eval_new_model_wins_half = \
             self.options.cheat_eval_new_model_wins_half
         opt.cheat_selfplay_random_result = \
@@ -374,6 +618,7 @@ class Loader(object):
                 input=["s"],
                 reply=["pi", "V", "a", "rv"],
                 timeout_usec=10,
+                latency_target_usec=self.options.online_latency_target_usec,
                 batchsize=co.mcts_options.num_rollouts_per_batch
             )
         elif self.options.mode == "selfplay":
@@ -383,6 +628,10 @@ class Loader(object):
                 reply=["pi", "V", "a", "rv"],
                 batchsize=self.options.batchsize,
                 timeout_usec=self.options.selfplay_timeout_usec,
+                latency_target_usec=self.options.selfplay_latency_target_usec,
+                pooled=self.options.pooled_collectors,
+                # One model version per batch (that of batch.key).
+                partition_by_key=True,
             )
             desc["actor_white"] = dict(
                 input=["s"],
@@ -391,7 +640,19 @@ class Loader(object):
                 if self.options.batchsize2 > 0
                 else self.options.batchsize,
                 timeout_usec=self.options.selfplay_timeout_usec,
+                latency_target_usec=self.options.selfplay_latency_target_usec,
+                pooled=self.options.pooled_collectors,
+                # One model version per batch (that of batch.key).
+                partition_by_key=True,
             )
+            if self.options.selfplay_devices:
+                devices = [
+                    (int(d.split(":")[0]),
+                     float(d.split(":")[1]) if ":" in d else 1.0)
+                    for d in self.options.selfplay_devices.split(",")
+                ]
+                desc["actor_black"]["devices"] = devices
+                desc["actor_white"]["devices"] = devices
             desc["game_end"] = dict(
                 batchsize=1,
             )
@@ -400,6 +661,15 @@ class Loader(object):
                 input=["black_ver", "white_ver"],
                 reply=None
             )
+        elif self.options.mode == "analysis":
+            # The searches of all the sessions, see AnalysisServer.
+            desc["actor_black"] = dict(
+                input=["s"],
+                reply=["pi", "V", "a", "rv"],
+                batchsize=self.options.batchsize,
+                timeout_usec=self.options.selfplay_timeout_usec or 10,
+                latency_target_usec=self.options.online_latency_target_usec,
+            )
         elif self.options.mode == "train" or \
                 self.options.mode == "offline_train":
             desc["train"] = dict(
@@ -407,6 +677,13 @@ class Loader(object):
                        "selfplay_ver"],
                 reply=None
             )
+            if self.options.train_prefetch > 0:
+                # The ready batches, and the one being trained on.
+                desc["train"].update(
+                    num_recv=self.options.train_prefetch + 1,
+                    pooled=True,
+                    release_on_fill=True,
+                )
             desc["train_ctrl"] = dict(
                 input=["selfplay_ver"],
                 reply=None,
@@ -11,7 +11,7 @@ import time
 import warnings
 
 from elf.options import import_options, PyOptionSpec
-from elf import logging
+from elf import logging, metrics
 from .model_interface import ModelInterface
 from .sampler import Sampler
 from .utils.fp16_utils import FP16Model
@@ -238,6 +238,7 @@ def load_env(
     option_spec = PyOptionSpec()
     option_spec.merge(PyOptionSpec.fromClasses((
         logging.GlobalLoggingConfigurator,
+        metrics.MemoryBudgetConfigurator,
         game_loader_class,
         method_class,
         sampler_class,
@@ -257,6 +258,7 @@ def load_env(
 
     global_logger_configurator = logging.GlobalLoggingConfigurator(option_map)
     global_logger_configurator.configure()
+    metrics.MemoryBudgetConfigurator(option_map).configure()
 
     pretty_option_str = pprint.pformat(option_map.getOptionDict(), width=50)
     logger.info(f'Parsed options: {pretty_option_str}')